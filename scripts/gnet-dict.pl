@@ -0,0 +1,95 @@
+#! /usr/bin/env perl
+
+#
+# Copyright (c) 2026, agent
+#
+#----------------------------------------------------------------------
+# This file is part of gtk-gnutella.
+#
+#  gtk-gnutella is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  gtk-gnutella is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with gtk-gnutella; if not, write to the Free Software
+#  Foundation, Inc.:
+#      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+#----------------------------------------------------------------------
+
+#
+# Builds a preset deflate dictionary from Gnutella traffic dumps.
+#
+# The dumps are the ones produced by gtk-gnutella when the properties
+# dump_received_gnutella_packets or dump_transmitted_gnutella_packets are
+# set (see src/core/dump.c): each packet is preceded by a 19-byte header
+# giving its origin, followed by the Gnutella header and payload.
+#
+# All the printable strings of at least 3 characters found in the payloads
+# are counted, and the ones saving the most bytes (occurrences times length)
+# are kept until the dictionary reaches the requested size.  The result is
+# printed as a C string initializer, the most frequent strings last as zlib
+# recommends, suitable for src/core/gnet_dict.c.
+#
+# Usage: gnet-dict.pl [-s size] [-m min] dump...
+#   -s : size of the dictionary to build (default 2048 bytes)
+#   -m : minimum amount of occurrences of retained strings (default 16)
+#
+
+use Getopt::Std;
+getopts('s:m:');
+
+my $size = $opt_s || 2048;
+my $min = $opt_m || 16;
+
+my %count;
+my $packets = 0;
+
+foreach my $file (@ARGV) {
+	open(DUMP, $file) || die "can't open $file: $!\n";
+	binmode DUMP;
+	while (read(DUMP, my $dh, 19) == 19) {
+		last unless read(DUMP, my $header, 23) == 23;
+		my $len = unpack('V', substr($header, 19, 4));
+		last unless read(DUMP, my $payload, $len) == $len;
+		$packets++;
+		while ($payload =~ /([\x20-\x7e]{3,64})/g) {
+			$count{$1}++;
+		}
+	}
+	close DUMP;
+}
+
+warn "$packets packets read, ", scalar(keys %count), " distinct strings\n";
+
+# Keep the strings that save the most, and drop those contained in an
+# already retained string.
+
+my @retained;
+my $total = 0;
+
+foreach my $s (sort {
+	$count{$b} * length($b) <=> $count{$a} * length($a) || $a cmp $b
+} grep { $count{$_} >= $min } keys %count) {
+	next if grep { index($_, $s) >= 0 } @retained;
+	last if $total + length($s) > $size;
+	push(@retained, $s);
+	$total += length($s);
+}
+
+# Most frequent strings come last.
+
+my @lines;
+foreach my $s (sort { $count{$a} <=> $count{$b} || $a cmp $b } @retained) {
+	(my $q = $s) =~ s/(["\\])/\\$1/g;
+	$q =~ s/\?\?/?\\?/g;		# Avoid trigraphs
+	push(@lines, "\t\"$q\"");
+}
+print "static const char gnet_dict[] =\n", join("\n", @lines), ";\n";
+
+warn "dictionary is $total bytes, ", scalar(@retained), " strings\n";
@@ -41,6 +41,7 @@
 #include "if/core/wrap.h"		/* For wrapped_io_t */
 #include "if/gnet_property_priv.h"
 
+#include "lib/cq.h"
 #include "lib/glib-missing.h"
 #include "lib/halloc.h"
 #include "lib/inputevt.h"
@@ -109,6 +110,17 @@ enum bsched_magic {
  * of the period, any amount of bandwidth that has been unused will be
  * given as "stolen" bandwidth to some of the schedulers stealing from us.
  * Priority is given to schedulers that used up all their bandwidth.
+ *
+ * Alternatively, when `bw_hierarchical' is set, schedulers are the leaves of
+ * a hierarchy of traffic classes (see struct bsched_class) and the bandwidth
+ * they can use is given by token buckets refilled continuously, which
+ * replaces stealing.
+ *
+ * When `bw_pacing' is set, each source is further paced within the period:
+ * after an I/O, it becomes eligible again only after the time needed to
+ * transfer that data at its share of the bandwidth.  Sources that trigger
+ * too early are disabled and re-enabled by their own callout event when they
+ * become eligible again, so that traffic flows smoothly instead of in bursts.
  */
 
 struct bsched {
@@ -140,9 +152,91 @@ struct bsched {
 	int current_used;			/**< Nb of active sources this period */
 	int bw_urgent;				/**< Urgent b/w required in stealing */
 	int io_favours;				/**< Amount of sources wanting favours */
+	struct bsched_class *cls;	/**< Traffic class, NULL if not hierarchical */
 	unsigned looped:1;			/**< True when looped once over sources */
 };
 
+/**
+ * Traffic class, for hierarchical bandwidth scheduling.
+ *
+ * Traffic classes form a tree whose leaves are the bandwidth schedulers.
+ * Each class has two token buckets: one refilled at its guaranteed rate,
+ * the other at its ceiling rate.  A class can always use its guaranteed
+ * tokens, and can borrow from its parent what the parent has available,
+ * within its ceiling.  Traffic is charged to the class and all its
+ * ancestors, the guaranteed rate of a class being the sum of the rates of
+ * its children.
+ *
+ * Borrowing between HTTP and Gnutella traffic is only allowed when the
+ * `bw_allow_stealing' property is set, as for plain schedulers.
+ */
+struct bsched_class {
+	const char *name;			/**< Name, for tracing purposes */
+	struct bsched_class *parent;	/**< Parent class, NULL for the root */
+	tm_t last_refill;			/**< Last time we refilled the buckets */
+	int rate;					/**< Guaranteed rate, in bytes/sec */
+	int ceil;					/**< Ceiling rate, in bytes/sec */
+	int tokens;					/**< Tokens at the guaranteed rate */
+	int ctokens;				/**< Tokens at the ceiling rate */
+	int frac;					/**< Token fraction at guaranteed rate (ppm) */
+	int cfrac;					/**< Token fraction at ceiling rate (ppm) */
+	unsigned http_gnet:1;		/**< Borrowing is HTTP/Gnet stealing */
+};
+
+/*
+ * Traffic classes.
+ */
+
+enum bsched_cid {
+	BSC_OUT = 0,
+	BSC_OUT_HTTP,
+	BSC_OUT_GNET,
+	BSC_OUT_GTCP,
+	BSC_OUT_GLEAF,
+	BSC_OUT_UDP,
+	BSC_OUT_GUDP,
+	BSC_OUT_DHT,
+	BSC_IN,
+	BSC_IN_HTTP,
+	BSC_IN_GNET,
+	BSC_IN_GTCP,
+	BSC_IN_GLEAF,
+	BSC_IN_UDP,
+	BSC_IN_GUDP,
+	BSC_IN_DHT,
+
+	BSC_COUNT
+};
+
+/**
+ * Traffic class hierarchy, parents being listed before their children.
+ */
+static const struct bsched_class_def {
+	const char *name;			/**< Class name */
+	int parent;					/**< Parent class, -1 for roots */
+	bsched_bws_t bws;			/**< Leaf scheduler, or BSCHED_BWS_INVALID */
+	bool http_gnet;				/**< Borrowing is HTTP/Gnet stealing */
+} bsched_class_def[] = {
+	{ "all out",	-1,				BSCHED_BWS_INVALID,		FALSE },
+	{ "out",		BSC_OUT,		BSCHED_BWS_OUT,			TRUE },
+	{ "G out",		BSC_OUT,		BSCHED_BWS_INVALID,		TRUE },
+	{ "G TCP out",	BSC_OUT_GNET,	BSCHED_BWS_GOUT,		FALSE },
+	{ "GL out",		BSC_OUT_GNET,	BSCHED_BWS_GLOUT,		TRUE },
+	{ "UDP out",	BSC_OUT_GNET,	BSCHED_BWS_INVALID,		FALSE },
+	{ "G UDP out",	BSC_OUT_UDP,	BSCHED_BWS_GOUT_UDP,	FALSE },
+	{ "DHT out",	BSC_OUT_UDP,	BSCHED_BWS_DHT_OUT,		FALSE },
+	{ "all in",		-1,				BSCHED_BWS_INVALID,		FALSE },
+	{ "in",			BSC_IN,			BSCHED_BWS_IN,			TRUE },
+	{ "G in",		BSC_IN,			BSCHED_BWS_INVALID,		TRUE },
+	{ "G TCP in",	BSC_IN_GNET,	BSCHED_BWS_GIN,			FALSE },
+	{ "GL in",		BSC_IN_GNET,	BSCHED_BWS_GLIN,		TRUE },
+	{ "UDP in",		BSC_IN_GNET,	BSCHED_BWS_INVALID,		FALSE },
+	{ "G UDP in",	BSC_IN_UDP,		BSCHED_BWS_GIN_UDP,		FALSE },
+	{ "DHT in",		BSC_IN_UDP,		BSCHED_BWS_DHT_IN,		FALSE },
+};
+
+static struct bsched_class bsched_classes[BSC_COUNT];
+
 /*
  * Global bandwidth schedulers.
  */
@@ -162,6 +256,7 @@ static int bws_in_ema = 0;
 #define BW_OUT_LEAF_MIN	32	 /**< Minimum out bandwidth per leaf connection */
 #define BW_UL_STALL_TIM	21600	/**< Hysteresis for upload stalling condition */
 #define BW_UL_RUN_TIME	3600 /**< Check period for running uploads */
+#define BW_PACING_SLACK	1000 /**< Pacing slack, in usecs */
 
 #define BW_TCP_MSG		40	 /**< Smallest size of a TCP message */
 #define BW_UDP_MSG		28	 /**< Minimal IP+UDP overhead for a UDP message */
@@ -252,6 +347,7 @@ bsched_free(bsched_t *bs)
 		bio_check(bio);
 		g_assert(bsched_get(bio->bws) == bs);
 		bio->bws = BSCHED_BWS_INVALID;	/* Mark orphan source */
+		cq_cancel(&bio->pacing_ev);
 	}
 
 	gm_list_free_null(&bs->sources);
@@ -261,6 +357,180 @@ bsched_free(bsched_t *bs)
 	WFREE(bs);
 }
 
+/**
+ * Initialize the traffic classes.
+ */
+static G_GNUC_COLD void
+bsched_class_init(void)
+{
+	uint i;
+
+	STATIC_ASSERT(G_N_ELEMENTS(bsched_class_def) == BSC_COUNT);
+
+	for (i = 0; i < BSC_COUNT; i++) {
+		const struct bsched_class_def *d = &bsched_class_def[i];
+		struct bsched_class *c = &bsched_classes[i];
+
+		g_assert(d->parent < (int) i);		/* Parents listed first */
+
+		c->name = d->name;
+		c->parent = d->parent < 0 ? NULL : &bsched_classes[d->parent];
+		c->http_gnet = d->http_gnet;
+	}
+}
+
+/**
+ * Refill the token buckets of a traffic class.
+ *
+ * Buckets can hold one second worth of traffic, which is the length of the
+ * scheduling period, so that a class can fully use its bandwidth although
+ * sources that were disabled for lack of bandwidth are only re-enabled at
+ * the next period.
+ *
+ * Refilling happens on every I/O, so the fraction of a token earned since
+ * the last refill is carried over: otherwise classes with a low rate would
+ * never gain a token, and all classes would be under-credited.
+ */
+static void
+bsched_class_refill(struct bsched_class *c, const tm_t *now)
+{
+	time_delta_t elapsed = tm_elapsed_us(now, &c->last_refill);
+	int64 t;
+
+	if G_UNLIKELY(elapsed < 0) {
+		c->last_refill = *now;		/* Time went backwards */
+		return;
+	}
+
+	if (0 == elapsed)
+		return;
+
+	c->last_refill = *now;
+
+	/*
+	 * Tokens range from minus one second to one second worth of traffic,
+	 * so two seconds refill the buckets whatever their state.  Capping
+	 * the elapsed time also bounds the 64-bit products below, rates going
+	 * up to BS_BW_MAX.
+	 */
+
+	elapsed = MIN(elapsed, 2000000);
+
+	t = (int64) c->rate * elapsed + c->frac;
+	c->tokens = MIN((int64) c->rate, c->tokens + t / 1000000);
+	c->frac = t % 1000000;
+
+	t = (int64) c->ceil * elapsed + c->cfrac;
+	c->ctokens = MIN((int64) c->ceil, c->ctokens + t / 1000000);
+	c->cfrac = t % 1000000;
+}
+
+/**
+ * Compute amount of bytes that the traffic class can use right now,
+ * through its own tokens or by borrowing from its ancestors.
+ */
+static int
+bsched_class_available(struct bsched_class *c, const tm_t *now)
+{
+	int own, avail;
+
+	bsched_class_refill(c, now);
+
+	own = MAX(0, c->tokens);
+
+	if (NULL == c->parent || c->ceil <= c->rate)
+		return own;
+
+	avail = MAX(own, bsched_class_available(c->parent, now));
+	return MIN(avail, MAX(0, c->ctokens));
+}
+
+/**
+ * Charge traffic to the class and all its ancestors.
+ *
+ * Buckets may become negative, up to one second worth of traffic, since the
+ * amount used by an I/O can exceed what was granted (e.g. UDP datagrams).
+ */
+static void
+bsched_class_charge(struct bsched_class *c, int used)
+{
+	for (/* empty */; c != NULL; c = c->parent) {
+		c->tokens = MAX(c->tokens - used, -c->rate);
+		c->ctokens = MAX(c->ctokens - used, -c->ceil);
+	}
+}
+
+/**
+ * Recompute the rates of the traffic classes from the configured bandwidth
+ * of the schedulers, and attach classes to the schedulers when hierarchical
+ * scheduling is configured.
+ *
+ * Disabled schedulers, which are not limited, do not take part in the
+ * hierarchy: their traffic is not charged.
+ */
+static void
+bsched_class_update(void)
+{
+	bool hierarchical = GNET_PROPERTY(bw_hierarchical);
+	int i;
+
+	for (i = 0; i < BSC_COUNT; i++)
+		bsched_classes[i].rate = 0;
+
+	/*
+	 * Bottom-up: leaves get the bandwidth of their scheduler, and each
+	 * class gets the sum of the rates of its children.
+	 */
+
+	for (i = BSC_COUNT - 1; i >= 0; i--) {
+		const struct bsched_class_def *d = &bsched_class_def[i];
+		struct bsched_class *c = &bsched_classes[i];
+
+		if (d->bws != BSCHED_BWS_INVALID) {
+			bsched_t *bs = bws_set[d->bws];
+
+			bsched_check(bs);
+
+			if (hierarchical && (bs->flags & BS_F_ENABLED)) {
+				c->rate = bs->bw_per_second;
+				bs->cls = c;
+			} else {
+				bs->cls = NULL;
+			}
+		}
+
+		if (c->parent != NULL)
+			c->parent->rate = MIN(BS_BW_MAX, c->parent->rate + c->rate);
+	}
+
+	/*
+	 * Top-down: a class can borrow up to the ceiling of its parent, unless
+	 * borrowing would be HTTP/Gnet stealing and it is not allowed.
+	 */
+
+	for (i = 0; i < BSC_COUNT; i++) {
+		struct bsched_class *c = &bsched_classes[i];
+
+		if (
+			NULL == c->parent ||
+			(c->http_gnet && !GNET_PROPERTY(bw_allow_stealing))
+		) {
+			c->ceil = c->rate;
+		} else {
+			c->ceil = MAX(c->rate, c->parent->ceil);
+		}
+
+		c->tokens = MIN(c->tokens, c->rate);
+		c->ctokens = MIN(c->ctokens, c->ceil);
+
+		if (GNET_PROPERTY(bsched_debug) > 4 && hierarchical) {
+			g_debug("BSCHED %s: class \"%s\" rate=%d ceil=%d "
+				"tokens=%d ctokens=%d",
+				G_STRFUNC, c->name, c->rate, c->ceil, c->tokens, c->ctokens);
+		}
+	}
+}
+
 /**
  * Is bandwidth scheduler saturated currently?
  */
@@ -270,6 +540,11 @@ bsched_saturated(bsched_bws_t bws)
 	const bsched_t *bs = bsched_get(bws);
 	if (!(bs->flags & BS_F_ENABLED))		/* Scheduler disabled */
 		return FALSE;
+	if (bs->cls != NULL) {
+		tm_t now;
+		tm_now(&now);
+		return 0 == bsched_class_available(bs->cls, &now);
+	}
 	return bs->bw_actual > bs->bw_max;
 }
 
@@ -459,6 +734,8 @@ bsched_config_steal_gnet(void)
 G_GNUC_COLD void
 bsched_early_init(void)
 {
+	bsched_class_init();
+
 	bws_set[BSCHED_BWS_OUT] = bsched_make("out",
 		BS_T_STREAM, BS_F_WRITE, GNET_PROPERTY(bw_http_out), 1000);
 
@@ -599,6 +876,7 @@ bsched_init(void)
 		bsched_config_steal_gnet();
 
 	bsched_set_peermode(GNET_PROPERTY(current_peermode));
+	bsched_class_update();
 }
 
 /**
@@ -794,6 +1072,38 @@ bio_bw_per_second(const bio_source_t *bio)
 	return bs->bw_per_second;
 }
 
+/**
+ * @return the rate at which the scheduler can currently send data, in bytes
+ * per second, including stolen bandwidth or the class ceiling.
+ */
+static int64
+bsched_rate(const bsched_t *bs)
+{
+	if (bs->cls != NULL)
+		return MAX(bs->cls->rate, bs->cls->ceil);
+
+	return (int64) (bs->bw_max + bs->bw_stolen) * 1000 / bs->period;
+}
+
+/**
+ * @return the rate at which the scheduler of this I/O source can currently
+ * send data, in bytes per second, or 0 if the scheduler is disabled, meaning
+ * bandwidth is not limited.
+ */
+ulong
+bio_bw_rate(const bio_source_t *bio)
+{
+	const bsched_t *bs;
+
+	bio_check(bio);
+
+	bs = bsched_get(bio->bws);
+	if (!(bs->flags & BS_F_ENABLED))
+		return 0;
+
+	return MAX(0, bsched_rate(bs));
+}
+
 /**
  * Trigger the "passive" callback to signify that a new timeslice has begun
  * and that I/Os can resume on the source.
@@ -919,7 +1229,8 @@ bio_remove_callback(bio_source_t *bio)
 	if (bio->io_tag)
 		bio_disable(bio);
 
-	bio->flags &= ~BIO_F_PASSIVE;
+	bio->flags &= ~(BIO_F_PASSIVE | BIO_F_PACED);
+	cq_cancel(&bio->pacing_ev);
 	bio->io_callback = NULL;
 	bio->io_arg = NULL;
 }
@@ -963,6 +1274,139 @@ bsched_clear_active(bsched_t *bs)
 	}
 }
 
+static void bio_pacing_wakeup(cqueue_t *cq, void *obj);
+
+/**
+ * Arm the pacing event of a source, to re-enable it when it becomes
+ * eligible again.
+ */
+static void
+bio_pacing_arm(bio_source_t *bio, const tm_t *now)
+{
+	time_delta_t delay = MAX(1, tm_elapsed_ms(&bio->eligible, now));
+
+	if (NULL == bio->pacing_ev)
+		bio->pacing_ev = cq_main_insert(delay, bio_pacing_wakeup, bio);
+	else
+		cq_resched(bio->pacing_ev, delay);
+}
+
+/**
+ * Callout queue callback to re-enable a paced source that is eligible
+ * again.
+ */
+static void
+bio_pacing_wakeup(cqueue_t *unused_cq, void *obj)
+{
+	bio_source_t *bio = obj;
+	tm_t now;
+
+	bio_check(bio);
+	(void) unused_cq;
+
+	bio->pacing_ev = NULL;		/* Event fired */
+
+	g_assert(bio->flags & BIO_F_PACED);
+
+	tm_now_exact(&now);
+
+	if (tm_elapsed_us(&bio->eligible, &now) > BW_PACING_SLACK) {
+		bio_pacing_arm(bio, &now);
+		return;
+	}
+
+	/*
+	 * Sources disabled for lack of bandwidth will be re-enabled when
+	 * the next timeslice begins.
+	 */
+
+	if (bsched_get(bio->bws)->flags & BS_F_NOBW)
+		return;
+
+	bio->flags &= ~BIO_F_PACED;
+
+	g_assert(0 == bio->io_tag);
+	g_assert(bio->io_callback != NULL);
+
+	if (bio->flags & BIO_F_PASSIVE)
+		bio_trigger(bio);
+	else
+		bio_enable(bio);
+}
+
+/**
+ * Disable source until it becomes eligible again, making sure it will be
+ * woken up in time.
+ */
+static void
+bsched_pacing_defer(bsched_t *bs, bio_source_t *bio, const tm_t *now)
+{
+	bsched_check(bs);
+	bio_check(bio);
+
+	if (bio->io_tag)
+		bio_disable(bio);
+
+	bio->flags |= BIO_F_PACED;
+	bio_pacing_arm(bio, now);
+
+	if (GNET_PROPERTY(bsched_debug) > 8) {
+		g_debug("BSCHED %s: [fd #%d] paced for %ld us in \"%s\"",
+			G_STRFUNC, bio->wio->fd(bio->wio),
+			(long) tm_elapsed_us(&bio->eligible, now), bs->name);
+	}
+}
+
+/**
+ * Compute next eligible time of a source after it used some bandwidth.
+ *
+ * The source is charged the time it takes to transfer the data at its
+ * share of the scheduler bandwidth, the share being computed from the
+ * amount of sources that are actively using the scheduler.
+ */
+static void
+bio_pace(bio_source_t *bio, ssize_t used)
+{
+	const bsched_t *bs = bsched_get(bio->bws);
+	int64 rate, delay;
+	int active;
+	tm_t now, inc;
+
+	/*
+	 * Favoured sources and those with allocated bandwidth are not paced,
+	 * and neither are sources for which we would not get any callback.
+	 */
+
+	if (!(bs->flags & BS_F_ENABLED) || NULL == bio->io_callback)
+		return;
+
+	if ((bio->flags & BIO_F_FAVOUR) || 0 != bio->bw_allocated)
+		return;
+
+	rate = bsched_rate(bs);
+
+	if G_UNLIKELY(rate <= 0)
+		return;
+
+	active = MAX(bs->last_used, bs->current_used);
+	active = MAX(active, 1);
+	delay = (int64) used * active * 1000000 / rate;
+	delay = MIN(delay, (int64) bs->period * 1000);	/* At most one period */
+
+	/*
+	 * A source that did not use its share does not accumulate credit:
+	 * pacing starts again from now.
+	 */
+
+	tm_now_exact(&now);
+	if (tm_cmp(&bio->eligible, &now) < 0)
+		bio->eligible = now;
+
+	inc.tv_sec = delay / 1000000;
+	inc.tv_usec = delay % 1000000;
+	tm_add(&bio->eligible, &inc);
+}
+
 /**
  * Called whenever a new scheduling timeslice begins.
  *
@@ -1032,7 +1476,8 @@ bsched_begin_timeslice(bsched_t *bs)
 		last = iter;		/* Remember last seen source for rotation */
 		count++;			/* Count them for assertion */
 
-		bio->flags &= ~(BIO_F_ACTIVE | BIO_F_USED);
+		bio->flags &= ~(BIO_F_ACTIVE | BIO_F_USED | BIO_F_PACED);
+		cq_cancel(&bio->pacing_ev);
 
 		if (bio->io_tag == 0 && bio->io_callback) {
 			if (bio->flags & BIO_F_PASSIVE)
@@ -1282,6 +1727,7 @@ bsched_source_remove(bio_source_t *bio)
 		bio->bws = BSCHED_BWS_INVALID;
 	}
 	inputevt_remove(&bio->io_tag);
+	cq_cancel(&bio->pacing_ev);
 	bio->magic = 0;
 	WFREE(bio);
 }
@@ -1321,9 +1767,12 @@ bsched_set_bandwidth(bsched_bws_t bws, int bandwidth)
 
 	/*
 	 * When all bandwidth has been used, disable all sources.
+	 *
+	 * With hierarchical scheduling, the class rates are only updated at
+	 * the next period.
 	 */
 
-	if (bs->bw_actual >= (bs->bw_max + bs->bw_stolen))
+	if (NULL == bs->cls && bs->bw_actual >= (bs->bw_max + bs->bw_stolen))
 		bsched_no_more_bandwidth(bs);
 
 	bs->flags |= BS_F_CHANGED_BW;
@@ -1366,6 +1815,24 @@ bw_available(bio_source_t *bio, int len)
 	if (bio->io_callback && !bio->io_tag && !(bio->flags & BIO_F_PASSIVE))
 		return 0;							/* No bandwidth available */
 
+	/*
+	 * When pacing, a source that triggers before its next eligible time
+	 * is disabled until then.
+	 */
+
+	if (
+		GNET_PROPERTY(bw_pacing) && bio->io_callback != NULL &&
+		!(bio->flags & BIO_F_FAVOUR) && 0 == bio->bw_allocated
+	) {
+		tm_t now;
+
+		tm_now_exact(&now);
+		if (tm_elapsed_us(&bio->eligible, &now) > BW_PACING_SLACK) {
+			bsched_pacing_defer(bs, bio, &now);
+			return 0;
+		}
+	}
+
 	/*
 	 * If uniform scheduling is on, disable source so that it does not
 	 * trigger again for this timeslice.
@@ -1420,7 +1887,14 @@ bw_available(bio_source_t *bio, int len)
 	 * only the regular bandwidth for now.  Hence the test below.
 	 */
 
-	available = bs->bw_max + bs->bw_stolen - bs->bw_actual;
+	if (bs->cls != NULL) {
+		tm_t now;
+
+		tm_now_exact(&now);
+		available = bsched_class_available(bs->cls, &now);
+	} else {
+		available = bs->bw_max + bs->bw_stolen - bs->bw_actual;
+	}
 
 	if (GNET_PROPERTY(bsched_debug) > 8)
 		g_debug("BSCHED %s: "
@@ -1647,8 +2121,16 @@ bsched_bw_update(bsched_t *bs, int used, int requested)
 	 * When all bandwidth has been used, disable all sources.
 	 */
 
-	if (bs->bw_actual >= (bs->bw_max + bs->bw_stolen))
+	if (bs->cls != NULL) {
+		tm_t now;
+
+		bsched_class_charge(bs->cls, used);
+		tm_now(&now);
+		if (0 == bsched_class_available(bs->cls, &now))
+			bsched_no_more_bandwidth(bs);
+	} else if (bs->bw_actual >= (bs->bw_max + bs->bw_stolen)) {
 		bsched_no_more_bandwidth(bs);
+	}
 }
 
 static inline ALWAYS_INLINE void
@@ -1658,6 +2140,9 @@ bio_bw_update(bio_source_t *bio, ssize_t used)
 
 	if G_UNLIKELY(0 != bio->bw_allocated)
 		bio->bw_allocated -= MIN(bio->bw_allocated, UNSIGNED(used));
+
+	if G_UNLIKELY(GNET_PROPERTY(bw_pacing))
+		bio_pace(bio, used);
 }
 
 /**
@@ -2893,6 +3378,9 @@ bsched_stealbeat(bsched_t *bs)
 	if (bs->flags & BS_F_NO_STEALING)	/* Stealing from scheduler disabled */
 		return;
 
+	if (bs->cls != NULL)				/* Borrowing done by traffic classes */
+		return;
+
 	/**
 	 * Note that we do not use the theoric bandwidth, but bs->bw_max to
 	 * estimate the amount of underused bandwidth.  The reason is that
@@ -3085,9 +3573,12 @@ bsched_timer(void)
 	}
 
 	/*
-	 * Third pass: begin new timeslice.
+	 * Third pass: begin new timeslice, after having updated the traffic
+	 * classes to account for configuration changes.
 	 */
 
+	bsched_class_update();
+
 	for (l = bws_list; l; l = g_slist_next(l)) {
 		bsched_bws_t bws = GPOINTER_TO_UINT(l->data);
 		bsched_begin_timeslice(bsched_get(bws));
@@ -12303,6 +12303,9 @@ http_version_nofix:
 		struct rx_inflate_args args;
 
 		args.cb = &download_rx_inflate_cb;
+		args.dict = NULL;
+		args.dict_len = 0;
+		args.offload = FALSE;
 		d->rx = rx_make_above(d->rx, rx_inflate_get_ops(), &args);
 		d->flags |= DL_F_NO_PIPELINE;	/* Disabled for this request */
 	}
@@ -769,4 +769,85 @@ ggep_stream_pack(ggep_stream_t *gs,
 	return ggep_stream_packv(gs, id, p_iov, 1, wflags);
 }
 
+/**
+ * Append an already encoded GGEP block, as produced by a closed stream, to
+ * the stream.
+ *
+ * The extensions of the block become part of the stream, as if they had
+ * been written individually, so that other extensions may still be emitted
+ * afterwards.  This allows caching of GGEP blocks that are costly to build.
+ *
+ * @param gs		a GGEP stream
+ * @param data		start of the encoded GGEP block, with its leading magic
+ * @param len		length of the GGEP block
+ *
+ * @return TRUE if OK.  On error, the stream is left in a clean state.
+ */
+bool
+ggep_stream_splice(ggep_stream_t *gs, const void *data, size_t len)
+{
+	const uchar *block = data;
+	const uchar *p, *end;
+	const uchar *last = NULL;
+	char *start;
+
+	g_assert(ggep_stream_is_valid(gs));
+	g_assert(gs->outbuf != NULL);		/* Stream not closed */
+	g_assert(!gs->begun);				/* Not within an extension */
+	g_assert(len > 1);
+	g_assert(GGEP_MAGIC == block[0]);
+
+	/*
+	 * Locate the last extension of the block, whose flags we'll need to
+	 * patch since it will no longer end the GGEP block.
+	 */
+
+	p = &block[1];
+	end = &block[len];
+
+	while (p < end) {
+		size_t plen = 0;
+		uchar b;
+
+		last = p;
+		p += 1 + (*p & GGEP_F_IDLEN);
+
+		do {
+			if (p >= end)
+				goto corrupted;
+			b = *p++;
+			plen = (plen << GGEP_L_VSHIFT) | (b & GGEP_L_VALUE);
+		} while (!(b & GGEP_L_LAST));
+
+		if (plen > UNSIGNED(end - p))
+			goto corrupted;
+
+		p += plen;
+	}
+
+	g_assert(last != NULL);
+
+	start = gs->o;
+
+	if (!gs->magic_sent) {
+		if (!ggep_stream_appendc(gs, GGEP_MAGIC))
+			return FALSE;
+	}
+
+	if (!ggep_stream_append(gs, &block[1], len - 1)) {
+		gs->o = start;
+		return FALSE;
+	}
+
+	gs->magic_sent = TRUE;
+	gs->last_fp = gs->o - (end - last);
+	*gs->last_fp &= ~GGEP_F_LAST;
+
+	return TRUE;
+
+corrupted:
+	ggep_errno = GGEP_E_INTERNAL;
+	return FALSE;
+}
+
 /* vi: set ts=4 sw=4 cindent: */
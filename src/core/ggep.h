@@ -140,6 +140,7 @@ bool ggep_stream_packv(ggep_stream_t *gs,
 	const char *id, const iovec_t *iov, int iovcnt, uint32 wflags);
 bool ggep_stream_pack(ggep_stream_t *gs,
 	const char *id, const void *payload, size_t plen, uint32 wflags);
+bool ggep_stream_splice(ggep_stream_t *gs, const void *data, size_t len);
 
 bool ggep_stream_is_valid(ggep_stream_t *gs);
 
@@ -923,6 +923,24 @@ gmsg_can_drop(const void *pdu, int size)
 	}
 }
 
+/**
+ * Compute the weight of a message, given as a whole PDU, which is the
+ * primary criterion used by gmsg_cmp() to order messages.
+ *
+ * @return the message weight, the higher the more prioritary.
+ */
+uint
+gmsg_weight(const void *pdu)
+{
+	uint8 f = gnutella_header_get_function(pdu);
+	uint w;
+
+	w = (f == GTA_MSG_DHT) ?
+		kmsg_weight[kademlia_header_get_function(pdu)] : msg_weight[f];
+
+	return w == VMSG_W ? vmsg_weight(gnutella_data(pdu)) : w;
+}
+
 /**
  * Perform a priority comparison between two messages, given as whole PDUs.
  *
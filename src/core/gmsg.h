@@ -132,6 +132,7 @@ bool gmsg_can_drop(const void *pdu, int size);
 bool gmsg_is_oob_query(const void *msg);
 bool gmsg_split_is_oob_query(const void *head, const void *data);
 int gmsg_cmp(const void *pdu1, const void *pdu2, bool pdu2_complete);
+uint gmsg_weight(const void *pdu);
 const char *gmsg_infostr(const void *msg);
 const char *gmsg_node_infostr(const struct gnutella_node *n);
 char *gmsg_infostr_full(const void *msg, size_t msg_len);
@@ -139,6 +139,8 @@ gnet_stats_general_to_string(gnr_stats_t type)
 		"local_hits",
 		"local_partial_hits",
 		"local_whats_new_hits",
+		"local_query_cache_hits",
+		"local_query_cache_misses",
 		"local_query_hits",
 		"oob_proxied_query_hits",
 		"oob_queries",
@@ -221,6 +223,8 @@ gnet_stats_general_to_string(gnr_stats_t type)
 		"udp_sr_tx_fragments_resent",
 		"udp_sr_tx_fragments_sending_avoided",
 		"udp_sr_tx_fragments_oversent",
+		"udp_sr_tx_fragments_fast_resent",
+		"udp_sr_tx_fragments_deferred",
 		"udp_sr_tx_total_acks_received",
 		"udp_sr_tx_cumulative_acks_received",
 		"udp_sr_tx_extended_acks_received",
@@ -249,6 +253,16 @@ gnet_stats_general_to_string(gnr_stats_t type)
 		"udp_sr_rx_ears_for_unknown_message",
 		"udp_sr_rx_ears_for_lingering_message",
 		"udp_sr_rx_from_hostile_ip",
+		"udp_sched_dht_ack_dropped",
+		"udp_sched_dht_rpc_dropped",
+		"udp_sched_guess_dropped",
+		"udp_sched_oob_dropped",
+		"udp_sched_other_dropped",
+		"udp_sched_dht_ack_delay_ms",
+		"udp_sched_dht_rpc_delay_ms",
+		"udp_sched_guess_delay_ms",
+		"udp_sched_oob_delay_ms",
+		"udp_sched_other_delay_ms",
 		"consolidated_servers",
 		"dup_downloads_in_consolidation",
 		"discovered_server_guid",
@@ -324,9 +338,12 @@ gnet_stats_general_to_string(gnr_stats_t type)
 		"dht_lookup_rejected_node_on_proximity",
 		"dht_lookup_rejected_node_on_divergence",
 		"dht_lookup_fixed_node_contact",
+		"dht_lookup_shared_rpcs",
+		"dht_lookup_pipelined_hops",
 		"dht_keys_held",
 		"dht_cached_keys_held",
 		"dht_values_held",
+		"dht_keys_filtered_lookups",
 		"dht_cached_kuid_targets_held",
 		"dht_cached_roots_held",
 		"dht_cached_roots_exact_hits",
@@ -386,6 +403,10 @@ gnet_stats_general_to_string(gnr_stats_t type)
 		"dht_publishing_bg_attempts",
 		"dht_publishing_bg_improvements",
 		"dht_publishing_bg_successful",
+		"dht_publishing_batches",
+		"dht_publishing_batched_values",
+		"dht_publisher_backlog",
+		"dht_publisher_lag_s",
 		"dht_sha1_data_type_collisions",
 		"dht_passively_protected_lookup_path",
 		"dht_actively_protected_lookup_path",
@@ -490,12 +511,12 @@ gnet_stats_randomness(const gnutella_node_t *n, uint8 type, uint32 val)
 	gnet_host_t host;
 
 	tm_now(&now);
-	gnet_stats_crc32 = crc32_update(gnet_stats_crc32, &now, sizeof now);
+	gnet_stats_crc32 = crc32c_update(gnet_stats_crc32, &now, sizeof now);
 	gnet_host_set(&host, n->addr, n->port);
-	gnet_stats_crc32 = crc32_update(
+	gnet_stats_crc32 = crc32c_update(
 		gnet_stats_crc32, &host, gnet_host_length(&host));
-	gnet_stats_crc32 = crc32_update(gnet_stats_crc32, &type, sizeof type);
-	gnet_stats_crc32 = crc32_update(gnet_stats_crc32, &val, sizeof val);
+	gnet_stats_crc32 = crc32c_update(gnet_stats_crc32, &type, sizeof type);
+	gnet_stats_crc32 = crc32c_update(gnet_stats_crc32, &val, sizeof val);
 }
 
 /**
@@ -42,8 +42,6 @@
 
 #include "lib/cq.h"
 #include "lib/glib-missing.h"	/* For gm_snprintf() */
-#include "lib/halloc.h"
-#include "lib/htable.h"
 #include "lib/pmsg.h"
 #include "lib/unsigned.h"		/* For size_saturate_add() */
 #include "lib/walloc.h"
@@ -54,10 +52,8 @@
 
 #define MQ_DEBUG_LVL(q)	(*q->debug)
 
-static void qlink_free(mqueue_t *q);
 static void mq_update_flowc(mqueue_t *q);
-static bool make_room_header(
-	mqueue_t *q, char *header, uint prio, int needed, int *offset);
+static bool make_room_header(mqueue_t *q, char *header, uint prio, int needed);
 static void mq_swift_timer(cqueue_t *cq, void *obj);
 
 /**
@@ -156,6 +152,16 @@ mq_bio(const mqueue_t *q)
 	return tx_bio_source(q->tx_drv);
 }
 
+/**
+ * @return the top of the TX stack driven by the queue.
+ */
+txdrv_t *
+mq_tx_driver(const mqueue_t *q)
+{
+	mq_check_consistency(q);
+	return q->tx_drv;
+}
+
 struct gnutella_node *
 mq_node(const mqueue_t *q)
 {
@@ -215,125 +221,29 @@ mq_info(const mqueue_t *q)
 }
 
 #ifdef MQ_DEBUG
-/*
- * This hashtable tracks the queue owning a given glist linkable.
- */
-static htable_t *qown = NULL;
-
-/**
- * Add linkable into queue
- */
-static void
-mq_add_linkable(mqueue_t *q, GList *l)
-{
-	mqueue_t *owner;
-
-	g_assert(q->magic == MQ_MAGIC);
-	g_assert(l != NULL);
-	g_assert(l->data != NULL);
-	
-	if (qown == NULL)
-		qown = NOT_LEAKING(htable_create(HASH_KEY_SELF, 0));
-
-	owner = htable_lookup(qown, l);
-	if (owner) {
-		g_carp("BUG: added linkable %p already owned by %s%s",
-			(void *) l, owner == q ? "ourselves" : "other", mq_info(owner));
-		if (owner != q)
-			g_warning("BUG: will make linkable %p belong to %s",
-				(void *) l, mq_info(q));
-		g_assert_not_reached();
-	}
-
-	htable_insert(qown, l, q);
-}
-
-/**
- * Remove linkable from queue
- */
-static void
-mq_remove_linkable(mqueue_t *q, GList *l)
-{
-	mqueue_t *owner;
-
-	g_assert(q->magic == MQ_MAGIC);
-	g_assert(l != NULL);
-	g_assert(qown != NULL);		/* Must have added something before */
-
-	owner = htable_lookup(qown, l);
-
-	if (owner == NULL)
-		g_error("BUG: removed linkable %p from %s belongs to no queue!",
-			(void *) l, mq_info(q));
-	else if (owner != q)
-		g_error("BUG: removed linkable %p from %s is from another queue!",
-			(void *) l, mq_info(q));
-	else
-		htable_remove(qown, l);
-}
-
 /**
  * Check queue's sanity.
  */
 void
-mq_check_track(mqueue_t *q, int offset, const char *where, int line)
+mq_check_track(mqueue_t *q, const char *where, int line)
 {
-	int qcount;
-	int qlink_alive = 0;
-	int n;
+	size_t qcount;
 
 	g_assert(q);
 
-	if (qown == NULL)
-		qown = NOT_LEAKING(htable_create(HASH_KEY_SELF, 0));
-
 	if (q->magic != MQ_MAGIC)
 		g_error("BUG: %s at %s:%d", mq_info(q), where, line);
 
-	qcount = g_list_length(q->qhead);
-	if (qcount != q->count)
+	qcount = rqueue_count(q->rq) + (NULL == q->qpartial ? 0 : 1);
+	if (qcount != UNSIGNED(q->count))
 		g_error("BUG: "
-			"%s has wrong q->count of %d (counted %d in list) at %s:%d",
+			"%s has wrong q->count of %d (counted %zu in queue) at %s:%d",
 			mq_info(q), q->count, qcount, where, line);
 
-	if (q->qlink == NULL)
-		return;
-
-	for (n = 0; n < q->qlink_count; n++) {
-		GList *item = q->qlink[n];
-		mqueue_t *owner;
-
-		if (item == NULL)
-			continue;
-
-		qlink_alive++;
-		if (item->data == NULL)
-			g_error("BUG: linkable #%d/%d from %s is NULL at %s:%d",
-				n, q->qlink_count, mq_info(q), where, line);
-
-		g_assert(qown);		/* If we have a qlink, we have added items */
-
-		owner = htable_lookup(qown, item);
-		if (owner != q)
-			g_error("BUG: linkable #%d/%d from %s "
-				"%s at %s:%d",
-				n, q->qlink_count, mq_info(q),
-				owner == NULL ?
-					"does not belong to any queue" :
-					"belongs to foreign queue",
-				where, line);
-	}
-
-	if (qlink_alive != qcount + offset)
-		g_error("BUG: qlink discrepancy for %s "
-		"(counted %d alive linkable, expected %d, queue has %d items) at %s:%d",
-		mq_info(q), qlink_alive, qcount + offset, qcount, where, line);
+	if (q->qpartial != NULL && pmsg_is_unread(q->qpartial))
+		g_error("BUG: %s has unread partial message at %s:%d",
+			mq_info(q), where, line);
 }
-#else	/* !MQ_DEBUG */
-
-#define	mq_add_linkable(x,y)
-#define	mq_remove_linkable(x,y)
-
 #endif	/* MQ_DEBUG */
 
 /*
@@ -352,27 +262,29 @@ mq_check_track(mqueue_t *q, int offset, const char *where, int line)
 void
 mq_free(mqueue_t *q)
 {
-	GList *l;
-	int n;
+	pmsg_t *mb;
+	int n = 0;
 
 	mq_check_consistency(q);
 
 	tx_free(q->tx_drv);		/* Get rid of lower layers */
 
-	for (n = 0, l = q->qhead; l; l = g_list_next(l)) {
+	if (q->qpartial != NULL) {
 		n++;
-		pmsg_free(l->data);
-		l->data = NULL;
-		mq_remove_linkable(q, l);
+		pmsg_free(q->qpartial);
+		q->qpartial = NULL;
 	}
 
-	g_assert(n == q->count);
+	while (NULL != (mb = rqueue_shift(q->rq))) {
+		n++;
+		pmsg_free(mb);
+	}
 
-	if (q->qlink)
-		qlink_free(q);
+	g_assert(n == q->count);
 
 	cq_cancel(&q->swift_ev);
-	gm_list_free_null(&q->qhead);
+	cq_cancel(&q->cork_ev);
+	rqueue_free_null(&q->rq);
 	pmsg_slist_free(&q->qwait);
 
 	q->magic = 0;
@@ -380,32 +292,122 @@ mq_free(mqueue_t *q)
 }
 
 /**
- * Remove link from message queue and return the previous item.
- * The `size' parameter refers to the size of the removed message.
+ * Account for the removal of a message from the queue, then free it.
  *
- * The underlying message is freed and the size information on the
- * queue is updated, but not the flow-control information.
+ * The size information on the queue is updated, but not the flow-control
+ * information.
  */
-static GList *
-mq_rmlink_prev(mqueue_t *q, GList *l, int size)
+static void
+mq_unlink(mqueue_t *q, pmsg_t *mb)
 {
-	GList *prev = g_list_previous(l);
-
-	mq_remove_linkable(q, l);
-	q->qhead = g_list_remove_link(q->qhead, l);
-	if (q->qtail == l)
-		q->qtail = prev;
+	int size = pmsg_size(mb);
 
 	g_assert(q->size >= size);
 	q->size -= size;
 	g_assert(q->count > 0);
 	q->count--;
 
-	pmsg_free(l->data);
-	l->data = NULL;
-	g_list_free_1(l);
+	pmsg_free(mb);
+}
+
+/**
+ * Remove the next message to send from the queue.
+ *
+ * The message is freed and the size information on the queue is updated,
+ * but not the flow-control information.
+ */
+static void
+mq_rmhead(mqueue_t *q)
+{
+	pmsg_t *mb;
+
+	if (q->qpartial != NULL) {
+		mb = q->qpartial;
+		q->qpartial = NULL;
+	} else {
+		mb = rqueue_shift(q->rq);
+	}
+
+	g_assert(mb != NULL);
+
+	mq_unlink(q, mb);
+}
+
+/**
+ * Remove message `mb' from the queue, which was either the last message
+ * returned by the `ri' iterator or the partially written message.
+ *
+ * The message is freed and the size information on the queue is updated,
+ * but not the flow-control information.
+ */
+static void
+mq_rmiter(mqueue_t *q, rqueue_iter_t *ri, pmsg_t *mb)
+{
+	if (mb == q->qpartial) {
+		q->qpartial = NULL;
+	} else {
+		pmsg_t *removed = rqueue_iter_remove(ri);
+		g_assert(removed == mb);
+	}
+
+	mq_unlink(q, mb);
+}
+
+/**
+ * Record that `written' bytes of the next message to send, which could not
+ * be sent completely, were written.
+ *
+ * That message is moved out of the ranked queue since it must be sent before
+ * anything else and can no longer be dropped.
+ */
+static void
+mq_partial(mqueue_t *q, int written)
+{
+	pmsg_t *mb = mq_head(q);
+
+	g_assert(mb != NULL);
+	g_assert(written > 0 && written < pmsg_size(mb));
+	g_assert(written < q->size);
+
+	if (NULL == q->qpartial) {
+		pmsg_t *head = rqueue_shift(q->rq);
+		g_assert(head == mb);
+		q->qpartial = mb;
+	}
+
+	mb->m_rptr += written;
+	q->size -= written;
+}
+
+/**
+ * @return the rank of the message in the queue, message with lower ranks
+ * being dropped first.
+ */
+static uint
+mq_rank(const pmsg_t *mb)
+{
+	uint weight = gmsg_weight(pmsg_start(mb));
+
+	return pmsg_prio(mb) * MQ_WEIGHTS + MIN(weight, MQ_WEIGHTS - 1);
+}
+
+/**
+ * Ranked queue comparison routine: messages of the same rank are dropped
+ * by increasing importance, as given by gmsg_cmp().
+ */
+static int
+mq_cmp(const void *a, const void *b)
+{
+	return gmsg_cmp(pmsg_start(a), pmsg_start(b), TRUE);
+}
 
-	return prev;
+/**
+ * Create the ranked queue holding the messages of a queue.
+ */
+rqueue_t *
+mq_rqueue_make(void)
+{
+	return rqueue_make(PMSG_P_COUNT, MQ_RANKS, mq_cmp);
 }
 
 /**
@@ -500,7 +502,7 @@ mq_swift_checkpoint(mqueue_t *q, bool initial)
 		gnutella_header_set_ttl(&q->header, GNET_PROPERTY(max_ttl));
 
 		if (needed > 0)
-			make_room_header(q, (char*) &q->header, PMSG_P_DATA, needed, NULL);
+			make_room_header(q, (char*) &q->header, PMSG_P_DATA, needed);
 
 		/*
 		 * Whether or not we were able to make enough room at this point
@@ -544,8 +546,7 @@ mq_swift_checkpoint(mqueue_t *q, bool initial)
 			gnutella_header_set_ttl(&q->header, ttl);
 
 			if (
-				make_room_header(q, (char*) &q->header, PMSG_P_DATA,
-					needed, NULL)
+				make_room_header(q, (char*) &q->header, PMSG_P_DATA, needed)
 			)
 				break;
 
@@ -601,6 +602,63 @@ mq_enter_swift(cqueue_t *unused_cq, void *obj)
 	mq_swift_checkpoint(q, TRUE);
 }
 
+/**
+ * Resume servicing of a corked queue.
+ */
+static void
+mq_uncork(mqueue_t *q)
+{
+	mq_check_consistency(q);
+
+	cq_cancel(&q->cork_ev);
+
+	if (!(q->flags & MQ_CORKED))
+		return;
+
+	q->flags &= ~MQ_CORKED;
+
+	if (q->count > 0)
+		tx_srv_enable(q->tx_drv);
+
+	if (MQ_DEBUG_LVL(q) > 9) {
+		g_debug("MQ uncorked for node %s (%d messages, %d bytes queued)",
+			node_addr(q->node), q->count, q->size);
+	}
+}
+
+/**
+ * Callout queue callback invoked when the corking delay has expired.
+ */
+static void
+mq_cork_timer(cqueue_t *unused_cq, void *obj)
+{
+	mqueue_t *q = obj;
+
+	(void) unused_cq;
+	mq_check_consistency(q);
+	g_assert(q->flags & MQ_CORKED);
+
+	q->cork_ev = NULL;			/* Event fired */
+	mq_uncork(q);
+}
+
+/**
+ * Delay servicing of the queue for at most `delay' ms, so that messages
+ * enqueued in the meantime can be written together.
+ */
+static void
+mq_cork(mqueue_t *q, int delay)
+{
+	mq_check_consistency(q);
+	g_assert(0 == q->count);		/* Only when queue is idle */
+	g_assert(!(q->flags & MQ_CORKED));
+	g_assert(NULL == q->cork_ev);
+	g_assert(delay > 0);
+
+	q->flags |= MQ_CORKED;
+	q->cork_ev = cq_main_insert(delay, mq_cork_timer, q);
+}
+
 /**
  * Called when the message queue first enters flow-control.
  */
@@ -646,8 +704,6 @@ mq_leave_flowc(mqueue_t *q)
 			node_addr(q->node), q->size);
 
 	q->flags &= ~(MQ_FLOWC|MQ_SWIFT);	/* Under low watermark, clear */
-	if (q->qlink)
-		qlink_free(q);
 
 	cq_cancel(&q->swift_ev);
 	node_tx_leave_flowc(q->node);	/* Signal end flow control */
@@ -697,31 +753,22 @@ mq_clear(mqueue_t *q)
 	 * If there are extended message blocks in the queue, freeing them
 	 * could cause the callback to attempt to queue something again.  Hence
 	 * we must mark we're clearing the queue to avoid deadly recursions that
-	 * would corrupt the qlink array.
+	 * would corrupt the queue.
+	 *
+	 * The message we started to write, if any, is kept.
 	 */
 
 	q->flags |= MQ_CLEAR;
 
-	while (q->qhead) {
-		GList *l = q->qhead;
-		pmsg_t *mb = l->data;
-
-		/*
-		 * Break if we started to write this message, i.e. if we read
-		 * some data out of it.
-		 */
-
-		if (!pmsg_is_unread(mb))
-			break;
+	while (0 != rqueue_count(q->rq)) {
+		pmsg_t *mb = rqueue_shift(q->rq);
 
-		(void) mq_rmlink_prev(q, l, pmsg_size(mb));
+		g_assert(pmsg_is_unread(mb));
+		mq_unlink(q, mb);
 	}
 
 	g_assert(q->count >= 0 && q->count <= 1);	/* At most one message */
 
-	if (q->qlink)
-		qlink_free(q);
-
 	q->flags &= ~MQ_CLEAR;
 
 	mq_update_flowc(q);
@@ -732,7 +779,10 @@ mq_clear(mqueue_t *q)
 	 */
 
 	if (q->count == 0) {
-		tx_srv_disable(q->tx_drv);
+		if (q->flags & MQ_CORKED)
+			mq_uncork(q);		/* Servicing was not enabled yet */
+		else
+			tx_srv_disable(q->tx_drv);
 		node_tx_service(q->node, FALSE);
 	}
 }
@@ -770,446 +820,58 @@ mq_flush(mqueue_t *q)
 	tx_flush(q->tx_drv);
 }
 
-/**
- * Compare two pointers to links based on their relative priorities, then
- * based on their held Gnutella messages.
- * -- qsort() callback
- */
-static int
-qlink_cmp(const void *a, const void *b)
-{
-	const GList * const *l1 = a, * const *l2 = b;
-	const pmsg_t *m1 = (*l1)->data, *m2 = (*l2)->data;
-
-	if (pmsg_prio(m1) == pmsg_prio(m2))
-		return gmsg_cmp(pmsg_start(m1), pmsg_start(m2), TRUE);
-	else
-		return pmsg_prio(m1) < pmsg_prio(m2) ? -1 : +1;
-}
-
-/**
- * Create the `qlink' sorted array of queued items.
- */
-static void
-qlink_create(mqueue_t *q)
-{
-	GList *l;
-	int n;
-
-	g_assert(q->qlink == NULL);
-
-	q->qlink = halloc(q->count * sizeof q->qlink[0]);
-
-	/*
-	 * Prepare sorting of queued messages.
-	 *
-	 * What's sorted is queue links, but the comparison factor is the
-	 * gmsg_cmp() routine to compare the Gnutella messages.
-	 */
-
-	for (l = q->qhead, n = 0; l && n < q->count; l = g_list_next(l), n++) {
-		g_assert(l->data != NULL);
-		q->qlink[n] = l;
-	}
-
-	if (l || n != q->count)
-		g_error("BUG: queue count of %d for %p is wrong (has %d)",
-			q->count, (void *) q, g_list_length(q->qhead));
-
-	/*
-	 * We use `n' and not `q->count' in case the warning above is emitted,
-	 * in which case we have garbage after the `n' first items.
-	 */
-
-	q->qlink_count = n;
-	qsort(q->qlink, n, sizeof q->qlink[0], qlink_cmp);
-
-	mq_check(q, 0);
-}
-
-/**
- * Free the `qlink' sorted array of queued items.
- */
-static void
-qlink_free(mqueue_t *q)
-{
-	g_assert(q->qlink);
-
-	HFREE_NULL(q->qlink);
-	q->qlink_count = 0;
-}
-
-/**
- * Insert linkable `l' within the sorted qlink array of linkables for the queue,
- * before the position indicated by `hint'.
- */
-static void
-qlink_insert_before(mqueue_t *q, int hint, GList *l)
-{
-	g_assert(hint >= 0 && hint < q->qlink_count);
-	g_assert(qlink_cmp(&q->qlink[hint], &l) >= 0);	/* `hint' >= `l' */
-	g_assert(l->data != NULL);
-
-	mq_check(q, -1);
-
-	/*
-	 * Lookup before the message for a NULL entry that we could fill.
-	 */
-
-	if (hint > 0 && q->qlink[hint - 1] == NULL) {
-		q->qlink[hint - 1] = l;
-		return;
-	}
-
-	/*
-	 * Extend the array then, and insert right at `hint' in the new array.
-	 */
-
-	q->qlink_count++;
-	q->qlink = hrealloc(q->qlink, q->qlink_count * sizeof q->qlink[0]);
-
-	
-	/* Shift right */
-	memmove(&q->qlink[hint + 1], &q->qlink[hint],
-		(q->qlink_count - hint - 1) * sizeof q->qlink[0]);
-
-	q->qlink[hint] = l;
-}
-
-/**
- * Insert linkable `l' within the sorted qlink array of linkables.
- */
-static void
-qlink_insert(mqueue_t *q, GList *l)
-{
-	int low = 0;
-	int high = q->qlink_count - 1;
-	GList **qlink = q->qlink;
-
-	g_assert(l->data != NULL);
-
-	mq_check(q, -1);
-
-	/*
-	 * If `qlink' is empty, create a slot for the new entry.
-	 */
-
-	if (high < 0) {
-		g_assert(q->count == 1);		/* `l' is already part of the queue */
-		q->qlink_count++;
-		q->qlink = hrealloc(q->qlink, q->qlink_count * sizeof q->qlink[0]);
-		q->qlink[0] = l;
-		return;
-	}
-
-	/*
-	 * If lower than the beginning, insert at the head.
-	 */
-
-	if (qlink[low] != NULL && qlink_cmp(&l, &qlink[low]) <= 0) {
-		qlink_insert_before(q, low, l);
-		return;
-	}
-
-	/*
-	 * If higher than the tail, insert at the tail.
-	 */
-
-	if (qlink[high] != NULL && qlink_cmp(&l, &qlink[high]) >= 0) {
-		q->qlink_count++;
-		q->qlink = hrealloc(q->qlink, q->qlink_count * sizeof q->qlink[0]);
-		q->qlink[q->qlink_count - 1] = l;
-		return;
-	}
-
-	/*
-	 * The array is sorted, so we're going to use a dichotomic search
-	 * to find the right insertion point.  However, there can be NULLified
-	 * entries in the array, so this is not a plain dichotomic search.
-	 */
-
-	while (low <= high) {
-		int mid = low + (high - low) / 2;
-		int c;
-
-		/*
-		 * If we end up in a NULL spot, inspect the [low, high] range.
-		 */
-
-		if (qlink[mid] == NULL) {
-			int n;
-			int lowest_non_null = -1;
-			int highest_non_null = -1;
-
-			/*
-			 * Go back towards `low' to find a non-NULL entry.
-			 */
-
-			for (n = mid - 1; n >= low; n--) {
-				if (qlink[n] != NULL) {
-					lowest_non_null = n;
-					break;
-				}
-			}
-
-			/*
-			 * Go forward towards `high' to find a non-NULL entry.
-			 */
-
-			for (n = mid + 1; n <= high; n++) {
-				if (qlink[n] != NULL) {
-					highest_non_null = n;
-					break;
-				}
-			}
-
-			/*
-			 * If both `lowest_non_null' and `highest_non_null' are -1, we
-			 * have only NULLs, and the boundaries are NULL as well.
-			 */
-
-			if (lowest_non_null == -1) {
-				if (highest_non_null == -1) {
-					qlink[mid] = l;
-					return;
-				}
-				low = mid + 1;
-				continue;
-			} else if (highest_non_null == -1) {
-				high = mid - 1;
-				continue;
-			}
-
-			/*
-			 * We know that the final insertion point will be after `low'
-			 * and before `high'.  If there are only NULL entries between
-			 * the two, we're done...
-			 */
-
-			if (lowest_non_null <= low + 1 && highest_non_null >= high - 1) {
-				qlink[mid] = l;			/* Insert at the middle of the range */
-				return;
-			}
-
-			if (qlink_cmp(&l, &qlink[lowest_non_null]) < 0) {
-				high = lowest_non_null - 1;
-				continue;
-			}
-
-			if (qlink_cmp(&l, &qlink[highest_non_null]) > 0) {
-				low = highest_non_null + 1;
-				continue;
-			}
-
-			/*
-			 * `lowest_non_null' <= `l' <= `highest_non_null'
-			 */
-
-			low = lowest_non_null + 1;
-			high = highest_non_null - 1;
-
-			continue;
-		}
-
-		/*
-		 * Regular dichotomic case.
-		 */
-
-		c = qlink_cmp(&qlink[mid], &l);
-
-		if (c == 0) {
-			qlink_insert_before(q, mid, l);
-			return;
-		} else if (c < 0)
-			low = mid + 1;
-		else
-			high = mid - 1;
-	}
-
-	if (qlink[low] == NULL) {
-		qlink[low] = l;
-		return;
-	}
-
-	qlink_insert_before(q, low, l);
-}
-
-/**
- * Remove the entry in the `qlink' linkable array, allowing compaction
- * when there are too many holes.
- *
- * @param q			the message queue
- * @param l			the linkable to remove from the qlink indexer
- */
-static void
-qlink_remove(mqueue_t *q, GList *l)
-{
-	GList **qlink = q->qlink;
-	int n = q->qlink_count;
-
-	g_assert(qlink);
-	g_assert(n > 0);
-	g_assert(l->data != NULL);
-
-	mq_check(q, 0);
-
-	/*
-	 * If more entries in `qlink' than 3 times the amount of queued messages,
-	 * we have too many NULL in the array.
-	 */
-
-	if (n > q->count * 3) {
-		GList **dest = qlink;
-		int copied = 0;
-		bool found = FALSE;
-
-		while (n-- > 0) {
-			GList *entry = *qlink++;
-			if (entry == NULL)
-				continue;
-			else if (l == entry) {
-				found = TRUE;
-				continue;
-			}
-			*dest++ = entry;
-			copied++;
-		}
-
-		q->qlink_count = copied;
-
-		if (found)
-			return;
-	} else {
-		while (n-- > 0) {
-			if (l == *qlink) {
-				*qlink = NULL;
-				return;
-			}
-			qlink++;
-		}
-
-		/* Should have been found -- FALL THROUGH */
-	}
-
-	g_error("BUG: linkable %p for %s not found "
-		"(qlink has %d slots, queue has %d counted items, really %d) at %s:%d",
-		(void *) l, mq_info(q),
-		q->qlink_count, q->count, g_list_length(q->qhead),
-		_WHERE_, __LINE__);
-}
-
 /**
  * Attempt to make room in the queue to be able to enqueue the new message
  * whose header is specified.
  *
- * If `offset' is not null, it may be set with the offset within qlink where
- * the message immediately more prioritary than the new one can be found.
- * It is up to the caller to initialize it with -1 and check whether it has
- * been set.
+ * Messages are dropped by increasing rank, i.e. by increasing priority and
+ * Gnutella message weight, and then in gmsg_cmp() order within a rank, the
+ * oldest messages being dropped first among messages comparing equal.
+ * This is the same order as sorting all the messages by priority and then
+ * by gmsg_cmp(), hence the first message that is at least as important as
+ * the new one means nothing else can be dropped.
  *
  * @param q			the queue
  * @param header	pointer to the header of the new message
  * @param msglen	if non-zero, header points to a full PDU of msglen bytes
  * @param prio		the priority of the new message we want to enqueue
  * @param needed	the amount of room we want to make in the queue
- * @param offset	see above description
  *
  * @returns TRUE if we were able to make enough room.
  */
 static bool
 make_room_internal(mqueue_t *q,
-	char *header, size_t msglen, uint prio, int needed, int *offset)
+	char *header, size_t msglen, uint prio, int needed)
 {
-	int n;
+	pmsg_t *cmb;
 	int dropped = 0;				/* Amount of messages dropped */
-	bool qlink_corrupted = FALSE;	/* BUG catcher */
 
 	g_assert(needed > 0);
-	mq_check(q, 0);
+	mq_check(q);
 
 	if (MQ_DEBUG_LVL(q) > 5)
 		g_debug("MQ %s try to make room for %d bytes in queue %p (node %s)",
 			(q->flags & MQ_SWIFT) ? "SWIFT" : "FLOWC",
 			needed, (void *) q, node_addr(q->node));
 
-	if (q->qhead == NULL)			/* Queue is empty */
+	if (0 == rqueue_count(q->rq))	/* Nothing we can drop */
 		return FALSE;
 
-	if (q->qlink == NULL)			/* No cached sorted queue links */
-		qlink_create(q);
-
-	g_assert(q->qlink);
-
 	/*
-	 * Traverse the sorted links and prune as many messages as necessary.
+	 * Prune as many of the least important messages as necessary.
 	 * Note that we try to prune at least one byte more than needed, hence
 	 * we stay in the loop even when needed reaches 0.
 	 *
-	 * To avoid freeing the qlink array every time we drop something, we
-	 * write NULLs at the entries we drop (which are then ignored
-	 * in the loop below).  When we break out because we found a more
-	 * prioritary message, we remember the index in the array and return it
-	 * to the caller.  If the message is finally inserted in the queue,
-	 * we can insert its GList link right before that index.
-	 *
-	 * This adds some complexity but it will avoid millions of calls to
-	 * qlink_cmp(), which is costly.
-	 *
-	 * The qlink array is freed when we leave flow control.  During FC, we
-	 * need to find the messages we're removing after writing them to the
-	 * network, so we can NULLify the corresponding slot in the qlink array.
+	 * Any partially written message, however unimportant, cannot be
+	 * removed or we'd break the flow of messages: it is no longer held
+	 * in the ranked queue anyway.
 	 */
 
-restart:
-	for (n = 0; needed >= 0 && n < q->qlink_count; n++) {
-		GList *item = q->qlink[n];
-		pmsg_t *cmb;
-		char *cmb_start;
-		int cmb_size;
-
-		/*
-		 * If slot was NULLified, skip it.
-		 */
-
-		if (item == NULL)
-			continue;
-
-		/*
-		 * BUG catcher -- I've seen situations where item->data is NULL
-		 * at this point, which means something is deeply corrupted...
-		 *		--RAM, 2006-07-14
-		 */
-
-		if (item->data == NULL) {
-			g_error("BUG: NULL data for qlink item #%d/%d in %s at %s:%d",
-				n, q->qlink_count, mq_info(q), _WHERE_, __LINE__);
-
-			if (qlink_corrupted) {
-				g_error(
-					"BUG: trying to ignore still invalid qlink entry at %s:%d",
-						_WHERE_, __LINE__);
-				continue;
-			}
-
-			qlink_corrupted = TRUE;		/* Try to mend it */
-			qlink_free(q);
-			qlink_create(q);
-
-			g_error("BUG: recreated qlink and restarting at %s:%d",
-				_WHERE_, __LINE__);
-			goto restart;
-		}
+	while (needed >= 0 && NULL != (cmb = rqueue_lowest(q->rq, NULL))) {
+		char *cmb_start = pmsg_start(cmb);
+		pmsg_t *removed;
 
-		cmb = item->data;
-		cmb_start = pmsg_start(cmb);
-
-		/*
-		 * Any partially written message, however unimportant, cannot be
-		 * removed or we'd break the flow of messages.
-		 */
-
-		if (pmsg_read_base(cmb) != cmb_start)	/* Started to write it  */
-			continue;
+		g_assert(pmsg_is_unread(cmb));
 
 		/*
 		 * If we reach a message equally or more important than the message
@@ -1220,11 +882,8 @@ restart:
 		 * (it's necessarily >= 0 if we're in the loop)
 		 */
 
-		if (gmsg_cmp(cmb_start, header, msglen != 0) >= 0) {
-			if (offset != NULL)
-				*offset = n;
+		if (gmsg_cmp(cmb_start, header, msglen != 0) >= 0)
 			break;
-		}
 
 		/*
 		 * If we reach a message whose priority is higher than ours, stop.
@@ -1232,11 +891,8 @@ restart:
 		 * even if its embedded Gnet message is deemed less important.
 		 */
 
-		if (pmsg_prio(cmb) > prio) {
-			if (offset != NULL)
-				*offset = n;
+		if (pmsg_prio(cmb) > prio)
 			break;
-		}
 
 		/*
 		 * Drop message.
@@ -1250,18 +906,16 @@ restart:
 					gmsg_infostr_full(header, msglen) : gmsg_infostr(header));
 		}
 
-		gnet_stats_count_flowc(pmsg_start(cmb), FALSE);
-		cmb_size = pmsg_size(cmb);
-
-		g_assert(q->qlink[n] == item);
+		gnet_stats_count_flowc(cmb_start, FALSE);
+		needed -= pmsg_size(cmb);
 
-		needed -= cmb_size;
-		q->qlink[n] = NULL;
-		(void) mq_rmlink_prev(q, item, cmb_size);
+		removed = rqueue_drop_lowest(q->rq);
+		g_assert(removed == cmb);
+		mq_unlink(q, cmb);
 
 		dropped++;
 
-		mq_check(q, 0);
+		mq_check(q);
 	}
 
 	if (dropped)
@@ -1303,21 +957,16 @@ restart:
  * Remove from the queue enough messages that are less prioritary than
  * the current one, so as to make sure we can enqueue it.
  *
- * If `offset' is not null, it may be set with the offset within qlink where
- * the message immediately more prioritary than `mb' can be found.  It is
- * up to the caller to initialize it with -1 and check whether it has been
- * set.
- *
  * @returns TRUE if we were able to make enough room.
  */
 static bool
-make_room(mqueue_t *q, pmsg_t *mb, int needed, int *offset)
+make_room(mqueue_t *q, pmsg_t *mb, int needed)
 {
 	char *header = pmsg_start(mb);
 	uint prio = pmsg_prio(mb);
 	size_t msglen = pmsg_written_size(mb);
 
-	return make_room_internal(q, header, msglen, prio, needed, offset);
+	return make_room_internal(q, header, msglen, prio, needed);
 }
 
 /**
@@ -1325,10 +974,9 @@ make_room(mqueue_t *q, pmsg_t *mb, int needed, int *offset)
  * point but a Gnutella header and a message priority explicitly.
  */
 static bool
-make_room_header(
-	mqueue_t *q, char *header, uint prio, int needed, int *offset)
+make_room_header(mqueue_t *q, char *header, uint prio, int needed)
 {
-	return make_room_internal(q, header, 0, prio, needed, offset);
+	return make_room_internal(q, header, 0, prio, needed);
 }
 
 /**
@@ -1338,12 +986,10 @@ static void
 mq_puthere(mqueue_t *q, pmsg_t *mb, int msize)
 {
 	int needed;
-	int qlink_offset = -1;
-	GList *new = NULL;
 	bool make_room_called = FALSE;
 	bool has_normal_prio = (pmsg_prio(mb) == PMSG_P_DATA);
 
-	mq_check(q, 0);
+	mq_check(q);
 
 	/*
 	 * If we're flow-controlled and the message can be dropped, acccept it
@@ -1356,7 +1002,7 @@ mq_puthere(mqueue_t *q, pmsg_t *mb, int msize)
 		has_normal_prio &&
 		gmsg_can_drop(pmsg_start(mb), msize) &&
 		((make_room_called = TRUE)) &&			/* Call make_room() once only */
-		!make_room(q, mb, msize, &qlink_offset)
+		!make_room(q, mb, msize)
 	) {
 		g_assert(pmsg_is_unread(mb));			/* Not partially written */
 		if (MQ_DEBUG_LVL(q) > 4)
@@ -1381,7 +1027,7 @@ mq_puthere(mqueue_t *q, pmsg_t *mb, int msize)
 
 	if (
 		needed > 0 &&
-		(make_room_called || !make_room(q, mb, needed, &qlink_offset))
+		(make_room_called || !make_room(q, mb, needed))
 	) {
 		/*
 		 * Close the connection only if the message is a prioritary one
@@ -1443,92 +1089,30 @@ mq_puthere(mqueue_t *q, pmsg_t *mb, int msize)
 	/*
 	 * Enqueue message.
 	 *
-	 * A normal priority message (the large majority of messages we deal with)
-	 * is always enqueued at the head: messsages are read from the tail, i.e.
-	 * it is a FIFO queue.
-	 *
-	 * A higher priority message needs to be inserted at the right place,
-	 * near the *tail* but after any partially sent message, and of course
-	 * after all enqueued messages with the same priority.
+	 * Messages are sent by decreasing priority, and in FIFO order among
+	 * messages of the same priority, once any partially sent message has
+	 * been completely written.  A message that was partially written to an
+	 * empty queue becomes that message.
 	 */
 
-	if (has_normal_prio) {
-		new = q->qhead = g_list_prepend(q->qhead, mb);
-		if (q->qtail == NULL)
-			q->qtail = q->qhead;
+	if G_UNLIKELY(!pmsg_is_unread(mb)) {
+		g_assert(0 == q->count);		/* Was written to an empty queue */
+		q->qpartial = mb;
 	} else {
-		GList *l;
-		uint prio = pmsg_prio(mb);
-		bool inserted = FALSE;
-
-		for (l = q->qtail; l; l = g_list_previous(l)) {
-			pmsg_t *m = l->data;
-
-			if (
-				pmsg_is_unread(m) &&			/* Not partially written */
-				pmsg_prio(m) < prio				/* Reached insert point */
-			) {
-				/*
-				 * Insert after current item, which is less prioritary than
-				 * we are, then leave the loop.
-				 */
-
-				q->qhead = gm_list_insert_after(q->qhead, l, mb);
-				new = g_list_next(l);
-
-				if (l == q->qtail)				/* Inserted at tail */
-					q->qtail = new;				/* New tail */
-
-				inserted = TRUE;
-				break;
-			}
-		}
-
-		/*
-		 * If we haven't inserted anything, then we've reached the
-		 * head of the list.
-		 */
-
-		if (!inserted) {
-			g_assert(l == NULL);
-
-			new = q->qhead = g_list_prepend(q->qhead, mb);
-			if (q->qtail == NULL)
-				q->qtail = q->qhead;
-		}
+		rqueue_put(q->rq, pmsg_prio(mb), mq_rank(mb), mb);
 	}
 
-	mq_add_linkable(q, new);
-
 	q->size += msize;
 	q->count++;
 
-	/*
-	 * If `qlink' is not NULL, insert `new' within it.
-	 *
-	 * We have two options: we called make_room() and have `qlink_offset'
-	 * set to something other than -1.  In that case, this is the offset
-	 * of the message more prioritary that us.
-	 *
-	 * We have not called make_room() yet: we need to scan the `qlink' array
-	 * to find the proper insertion place.
-	 */
-
-	if (q->qlink) {			/* Inserted something, `qlink' is stale */
-		g_assert(new != NULL);
-
-		if (qlink_offset != -1)
-			qlink_insert_before(q, qlink_offset, new);
-		else
-			qlink_insert(q, new);
-	}
-
 	/*
 	 * Update flow control indication, and enable node.
 	 */
 
 	mq_update_flowc(q);
-	tx_srv_enable(q->tx_drv);
+
+	if (!(q->flags & MQ_CORKED))
+		tx_srv_enable(q->tx_drv);
 
 	if (q->count == 1)
 		node_tx_service(q->node, TRUE);		/* Only on first message queued */
@@ -1546,9 +1130,12 @@ mq_putq(mqueue_t *q, pmsg_t *mb)
 
 static const struct mq_cops mq_cops = {
 	mq_puthere,				/**< puthere */
-	qlink_remove,			/**< qlink_remove */
-	mq_rmlink_prev,			/**< rmlink_prev */
+	mq_rmhead,				/**< rmhead */
+	mq_rmiter,				/**< rmiter */
+	mq_partial,				/**< partial */
 	mq_update_flowc,		/**< update_flowc */
+	mq_cork,				/**< cork */
+	mq_uncork,				/**< uncork */
 };
 
 /**
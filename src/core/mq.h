@@ -43,6 +43,7 @@
 
 #include "lib/cq.h"
 #include "lib/pmsg.h"
+#include "lib/rqueue.h"
 #include "lib/slist.h"
 
 typedef struct mqueue mqueue_t;
@@ -58,9 +59,12 @@ struct mq_ops {
 
 struct mq_cops {
 	void (*puthere)(mqueue_t *q, pmsg_t *mb, int msize);
-	void (*qlink_remove)(mqueue_t *q, GList *l);
-	GList *(*rmlink_prev)(mqueue_t *q, GList *l, int size);
+	void (*rmhead)(mqueue_t *q);
+	void (*rmiter)(mqueue_t *q, rqueue_iter_t *ri, pmsg_t *mb);
+	void (*partial)(mqueue_t *q, int written);
 	void (*update_flowc)(mqueue_t *q);
+	void (*cork)(mqueue_t *q, int delay);
+	void (*uncork)(mqueue_t *q);
 };
 
 #ifdef MQ_INTERNAL
@@ -74,21 +78,31 @@ enum mq_magic {
 	MQ_MAGIC = 0x33990ee
 };
 
+/*
+ * Messages are ranked by priority first, and then by Gnutella message weight
+ * (see gmsg_weight()), weights above MQ_WEIGHTS - 1 being folded.
+ */
+#define MQ_WEIGHTS	16
+#define MQ_RANKS	(PMSG_P_COUNT * MQ_WEIGHTS)
+
 /**
  * A message queue.
  *
- * The queue itself is a two-way list, whose head is kept in `qhead' and the
- * tail in `qtail', since a GList does not keep that information and we
- * don't want to traverse the list each time.  Manual bookkeeping required.
+ * The queued messages are held in `rq', a ranked queue whose levels are the
+ * message priorities: messages are sent by decreasing priority, in FIFO order
+ * within a priority.  Each message is also given a rank computed from its
+ * priority and its Gnutella message weight, messages of the same rank being
+ * ordered by gmsg_cmp(), which lets us quickly find the least important
+ * message to drop during flow-control.
+ *
+ * A message that we started to write is moved out of `rq' to `qpartial',
+ * since it must be completely sent before anything else and can never be
+ * dropped.  It remains accounted for in `count' and `size'.
  *
  * Flow control is triggered when the size reaches the high watermark,
  * and remains in effect until we reach the low watermark, thereby providing
  * the necessary hysteresis.
  *
- * The `qlink' field is used during flow-control.  It contains a sorted (by
- * priority) array of all the items in the list.  It is dynamically allocated
- * and freed as needed.
- *
  * The `header' is used to hold the function/hops/TTL of a reference message
  * to be used as a comparison point when speeding up dropping in flow-control.
  */
@@ -99,12 +113,13 @@ struct mqueue {
 	const struct mq_ops *ops;		/**< Polymorphic operations */
 	const struct mq_cops *cops;		/**< Common operations */
 	txdrv_t *tx_drv;				/**< Network TX stack driver */
-	GList *qhead, *qtail, **qlink;
+	rqueue_t *rq;			/**< Queued messages */
+	pmsg_t *qpartial;		/**< Partially written message */
 	slist_t *qwait;			/**< Waiting queue during putq recursions */
 	cevent_t *swift_ev;		/**< Callout queue event in "swift" mode */
+	cevent_t *cork_ev;		/**< Callout queue event ending corking */
 	const uint32 *debug;	/**< Debug config variable for this queue */
 	int swift_elapsed;		/**< Scheduled elapsed time, in ms */
-	int qlink_count;		/**< Amount of entries in `qlink' */
 	int maxsize;			/**< Maximum size of this queue (total queued) */
 	int count;				/**< Amount of messages queued */
 	int hiwat;				/**< High watermark */
@@ -124,11 +139,23 @@ mq_check_consistency(const struct mqueue * const q)
 	g_assert(MQ_MAGIC == q->magic);
 }
 
+/**
+ * @return the next message to send, NULL if the queue is empty.
+ */
+static inline pmsg_t *
+mq_head(const struct mqueue * const q)
+{
+	return q->qpartial != NULL ? q->qpartial : rqueue_head(q->rq);
+}
+
+rqueue_t *mq_rqueue_make(void);
+
 /*
  * Queue flags.
  */
 
 enum {
+	MQ_CORKED	= (1 << 5),	/**< Servicing delayed to batch messages */
 	MQ_CLEAR	= (1 << 4),	/**< Running mq_clear() */
 	MQ_WARNZONE	= (1 << 3),	/**< Between hiwat and lowat */
 	MQ_SWIFT	= (1 << 2),	/**< Swift mode, dropping more traffic */
@@ -145,11 +172,11 @@ enum {
 #endif
 
 #ifdef MQ_DEBUG
-void mq_check_track(mqueue_t *q, int offset, const char *where, int line);
+void mq_check_track(mqueue_t *q, const char *where, int line);
 
-#define mq_check(x,y)	mq_check_track((x), (y), _WHERE_, __LINE__)
+#define mq_check(x)		mq_check_track((x), _WHERE_, __LINE__)
 #else
-#define mq_check(x,y)
+#define mq_check(x)
 #endif
 
 #endif /* MQ_INTERNAL */
@@ -168,6 +195,7 @@ int mq_count(const mqueue_t *q) G_GNUC_PURE;
 int mq_pending(const mqueue_t *q);
 int mq_tx_pending(const mqueue_t *q);
 struct bio_source *mq_bio(const mqueue_t *q);
+txdrv_t *mq_tx_driver(const mqueue_t *q) G_GNUC_PURE;
 struct gnutella_node *mq_node(const mqueue_t *q) G_GNUC_PURE;
 
 /*
@@ -54,6 +54,7 @@
 #define MQ_MAXIOV		256		/**< Our limit on the I/O vectors we build */
 #define MQ_MINIOV		2		/**< Minimum amount of I/O vectors in service */
 #define MQ_MINSEND		256		/**< Minimum size we try to send */
+#define MQ_CORKSIZE		1400	/**< Stop corking past that queued size */
 
 static void mq_tcp_service(void *data);
 static const struct mq_ops mq_tcp_ops;
@@ -74,6 +75,7 @@ mq_tcp_make(int maxsize, struct gnutella_node *n, struct txdriver *nd)
 	q->maxsize = maxsize;
 	q->lowat = maxsize >> 2;		/* 25% of max size */
 	q->hiwat = maxsize >> 1;		/* 50% of max size */
+	q->rq = mq_rqueue_make();
 	q->qwait = slist_new();
 	q->ops = &mq_tcp_ops;
 	q->cops = mq_get_cops();
@@ -96,14 +98,15 @@ mq_tcp_service(void *data)
 	int iovcnt;
 	int sent;
 	ssize_t r;
-	GList *l;
+	rqueue_iter_t *ri;
+	pmsg_t *mb;
 	int dropped;
 	int maxsize;
 	bool saturated;
 	bool has_prioritary = FALSE;
 
 again:
-	mq_check(q, 0);
+	mq_check(q);
 	g_assert(q->count);		/* Queue is serviced, we must have something */
 
 	iovcnt = 0;
@@ -122,9 +125,11 @@ again:
 	maxsize = q->last_written + (q->last_written >> 1);		/* 1.5 times */
 	maxsize = MAX(MQ_MINSEND, maxsize);
 
-	for (l = q->qtail; l && iovsize > 0; /* empty */) {
+	ri = rqueue_iter_new(q->rq);
+	mb = q->qpartial != NULL ? q->qpartial : rqueue_iter_next(ri);
+
+	for (/* empty */; mb && iovsize > 0; mb = rqueue_iter_next(ri)) {
 		iovec_t *ie;
-		pmsg_t *mb = (pmsg_t *) l->data;
 		char *mbs = pmsg_start(mb);
 
 		/*
@@ -140,7 +145,6 @@ again:
 
 		if (pmsg_check(mb, q)) {
 			/* send the message */
-			l = g_list_previous(l);
 			iovsize--;
 			ie = &iov[iovcnt++];
 			iovec_set(ie, deconstify_pointer(mb->m_rptr), pmsg_size(mb));
@@ -149,17 +153,17 @@ again:
 				has_prioritary = TRUE;
 		} else {
 			gnet_stats_count_flowc(mbs, FALSE);	/* Done before message freed */
-			if (q->qlink)
-				q->cops->qlink_remove(q, l);
 
-			/* drop the message, will be freed by mq_rmlink_prev() */
-			l = q->cops->rmlink_prev(q, l, pmsg_size(mb));
+			/* drop the message, will be freed by mq_rmiter() */
+			q->cops->rmiter(q, ri, mb);
 
 			dropped++;
 		}
 	}
 
-	mq_check(q, 0);
+	rqueue_iter_release(&ri);
+
+	mq_check(q);
 	g_assert(iovcnt > 0 || dropped > 0);
 
 	if (dropped > 0)
@@ -207,9 +211,12 @@ again:
 	iovcnt = 0;
 	saturated = FALSE;
 
-	for (l = q->qtail; l && r > 0 && iovsize > 0; iovsize--) {
+	for (/* empty */; r > 0 && iovsize > 0; iovsize--) {
 		iovec_t *ie = &iov[iovcnt++];
-		pmsg_t *mb = (pmsg_t *) l->data;
+
+		mb = mq_head(q);
+		g_assert(mb != NULL);
+		g_assert(pmsg_read_base(mb) == iovec_base(ie));
 
 		if ((uint) r >= iovec_len(ie)) {		/* Completely written */
 			char *mb_start = pmsg_start(mb);
@@ -218,21 +225,15 @@ again:
 			pmsg_mark_sent(mb);
 			node_sent_accounting(q->node, function, mb_start, pmsg_size(mb));
 			r -= iovec_len(ie);
-			if (q->qlink)
-				q->cops->qlink_remove(q, l);
-			l = q->cops->rmlink_prev(q, l, iovec_len(ie));
+			q->cops->rmhead(q);
 		} else {
-			g_assert(r > 0 && r < pmsg_size(mb));
-			g_assert(r < q->size);
-			mb->m_rptr += r;
-			q->size -= r;
-			g_assert(l == q->qtail);	/* Partially written, is at tail */
+			q->cops->partial(q, r);		/* Must be sent before anything else */
 			saturated = TRUE;
 			break;
 		}
 	}
 
-	mq_check(q, 0);
+	mq_check(q);
 	g_assert(r == 0 || iovsize > 0);
 	g_assert(q->size >= 0 && q->count >= 0);
 
@@ -277,6 +278,31 @@ update_servicing:
 		node_flushq(q->node);		/* Need to flush kernel buffers faster */
 }
 
+/**
+ * Should a message enqueued to an empty queue be held for a while, so that
+ * it can be written along with the next ones?
+ *
+ * Only low-priority messages are held, and not on compressed links since the
+ * deflating layer already buffers data.  When corking is possible, the queue
+ * is corked.
+ *
+ * @return TRUE if the queue was corked.
+ */
+static bool
+mq_tcp_cork(mqueue_t *q, bool prioritary)
+{
+	uint32 delay = GNET_PROPERTY(mq_tcp_cork_delay);
+
+	if (0 == delay || prioritary || NODE_TX_COMPRESSED(q->node))
+		return FALSE;
+
+	if (q->flags & MQ_CORKED)	/* Queue emptied whilst corked */
+		return TRUE;
+
+	q->cops->cork(q, delay);
+	return TRUE;
+}
+
 /**
  * Enqueue message, which becomes owned by the queue.
  *
@@ -315,7 +341,7 @@ again:
 		return;
 	}
 
-	mq_check(q, 0);
+	mq_check(q);
 
 	size = pmsg_size(mb);
 	if (size == 0) {
@@ -325,7 +351,7 @@ again:
 
 	/*
 	 * Protect against recursion: we must not invoke puthere() whilst in
-	 * the middle of another putq() or we would corrupt the qlink array:
+	 * the middle of another putq() or we would corrupt the queue:
 	 * Messages received during recursion are inserted into the qwait list
 	 * and will be stuffed back into the queue when the initial putq() ends.
 	 *		--RAM, 2006-12-29
@@ -349,10 +375,11 @@ again:
 	gnet_stats_count_queued(q->node, function, mbs, size);
 
 	/*
-	 * If queue is empty, attempt a write immediatly.
+	 * If queue is empty, attempt a write immediatly, unless we can wait
+	 * for more messages to write them all at once.
 	 */
 
-	if (q->qhead == NULL) {
+	if (0 == q->count && !mq_tcp_cork(q, prioritary)) {
 		ssize_t written;
 
 		if (pmsg_check(mb, q)) {
@@ -411,6 +438,14 @@ again:
 	q->cops->puthere(q, mb, size);
 	mb = NULL;
 
+	/*
+	 * Stop holding messages as soon as a prioritary one comes in, or when
+	 * we have enough data queued to fill a TCP segment.
+	 */
+
+	if ((q->flags & MQ_CORKED) && (prioritary || q->size >= MQ_CORKSIZE))
+		q->cops->uncork(q);
+
 cleanup:
 	if (mb) {
 		pmsg_free(mb);
@@ -428,7 +463,7 @@ cleanup:
 	else
 		q->putq_entered--;
 
-	mq_check(q, 0);
+	mq_check(q);
 
 	/*
 	 * If we're exiting here with no other putq() registered, then we must
@@ -468,13 +503,7 @@ mq_no_putq(mqueue_t *unused_q, pmsg_t *unused_mb)
 static bool
 mq_tcp_flushed(const mqueue_t *q)
 {
-	pmsg_t *mb;
-
-	if (NULL == q->qtail)
-		return TRUE;			/* Empty queue */
-
-	mb = q->qtail->data;
-	return pmsg_is_unread(mb);
+	return NULL == q->qpartial;
 }
 
 static const struct mq_ops mq_tcp_ops = {
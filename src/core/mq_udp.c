@@ -161,6 +161,7 @@ mq_udp_make(int maxsize, struct gnutella_node *n, struct txdriver *nd)
 	q->maxsize = maxsize;
 	q->lowat = maxsize >> 2;		/* 25% of max size */
 	q->hiwat = maxsize >> 1;		/* 50% of max size */
+	q->rq = mq_rqueue_make();
 	q->qwait = slist_new();
 	q->ops = &mq_udp_ops;
 	q->cops = mq_get_cops();
@@ -179,18 +180,17 @@ mq_udp_service(void *data)
 {
 	mqueue_t *q = data;
 	int r;
-	GList *l;
+	pmsg_t *mb;
 	unsigned dropped = 0;
 
-	mq_check(q, 0);
+	mq_check(q);
 	g_assert(q->count);		/* Queue is serviced, we must have something */
 
 	/*
 	 * Write as much as possible.
 	 */
 
-	for (l = q->qtail; l; /* empty */) {
-		pmsg_t *mb = l->data;
+	while (NULL != (mb = mq_head(q))) {
 		int mb_size = pmsg_size(mb);
 		struct mq_udp_info *mi = pmsg_get_metadata(mb);
 
@@ -224,14 +224,11 @@ mq_udp_service(void *data)
 		 */
 
 	skip:
-		if (q->qlink)
-			q->cops->qlink_remove(q, l);
-
-		/* drop the message from queue, will be freed by mq_rmlink_prev() */
-		l = q->cops->rmlink_prev(q, l, mb_size);
+		/* drop the message from queue, will be freed by mq_rmhead() */
+		q->cops->rmhead(q);
 	}
 
-	mq_check(q, 0);
+	mq_check(q);
 	g_assert(q->size >= 0 && q->count >= 0);
 
 	if (dropped)
@@ -253,7 +250,7 @@ mq_udp_service(void *data)
 		node_tx_service(q->node, FALSE);
 	}
 
-	mq_check(q, 0);
+	mq_check(q);
 }
 
 /**
@@ -294,7 +291,7 @@ again:
 		return;
 	}
 
-	mq_check(q, 0);
+	mq_check(q);
 
 	size = pmsg_size(mb);
 
@@ -305,7 +302,7 @@ again:
 
 	/*
 	 * Protect against recursion: we must not invoke puthere() whilst in
-	 * the middle of another putq() or we would corrupt the qlink array:
+	 * the middle of another putq() or we would corrupt the queue:
 	 * Messages received during recursion are inserted into the qwait list
 	 * and will be stuffed back into the queue when the initial putq() ends.
 	 *		--RAM, 2006-12-29
@@ -338,7 +335,7 @@ again:
 	 * If queue is empty, attempt a write immediatly.
 	 */
 
-	if (q->qhead == NULL) {
+	if (0 == q->count) {
 		ssize_t written;
 
 		if (pmsg_check(mb, q)) {
@@ -420,7 +417,7 @@ cleanup:
 	else
 		q->putq_entered--;
 
-	mq_check(q, 0);
+	mq_check(q);
 
 	/*
 	 * If we're exiting here with no other putq() registered, then we must
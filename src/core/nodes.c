@@ -51,6 +51,7 @@
 #include "features.h"
 #include "geo_ip.h"
 #include "gmsg.h"
+#include "gnet_dict.h"
 #include "gnet_stats.h"
 #include "guid.h"
 #include "hcache.h"
@@ -1604,6 +1605,12 @@ node_init(void)
 	payload_inflate_buffer_len = settings_max_msg_size();
 	payload_inflate_buffer = halloc(payload_inflate_buffer_len);
 
+	/*
+	 * Compression of Gnutella links can be offloaded to worker threads.
+	 */
+
+	zlib_offload_init(GNET_PROPERTY(zlib_threads));
+
 	/*
 	 * Limit replies to TCP/UDP crawls from a single IP.
 	 */
@@ -2028,6 +2035,7 @@ node_remove_v(struct gnutella_node *n, const char *reason, va_list ap)
 		n->qrt_receive = NULL;
 	}
 	if (n->recv_query_table) {
+		qrt_index_remove(n);
 		qrt_unref(n->recv_query_table);
 		n->recv_query_table = NULL;
 
@@ -3560,10 +3568,31 @@ node_tx_deflate_flowc(void *o, size_t amount)
 		bio_add_allocated(mq_bio(n->outq), amount);
 }
 
+/**
+ * Is the node lacking bandwidth?
+ *
+ * This is the case when messages are backing up in its queue, or when the
+ * bandwidth scheduler that controls its output is saturated.
+ */
+static bool
+node_tx_deflate_congested(void *o)
+{
+	gnutella_node_t *n = o;
+
+	node_check(n);
+
+	if (n->outq != NULL && mq_above_low_watermark(n->outq))
+		return TRUE;
+
+	return bsched_saturated(n->peermode == NODE_P_LEAF ?
+		BSCHED_BWS_GLOUT : BSCHED_BWS_GOUT);
+}
+
 static struct tx_deflate_cb node_tx_deflate_cb = {
 	node_add_tx_deflated,		/* add_tx_deflated */
 	node_tx_shutdown,			/* shutdown */
 	node_tx_deflate_flowc,		/* flow_control */
+	node_tx_deflate_congested,	/* congested */
 };
 
 /***
@@ -3969,6 +3998,12 @@ node_is_now_connected(struct gnutella_node *n)
 			g_debug("receiving compressed data from node %s", node_addr(n));
 
 		args.cb = &node_rx_inflate_cb;
+		args.dict = NULL;
+		args.dict_len = 0;
+		args.offload = TRUE;
+
+		if (n->attrs2 & NODE_A2_DEFLATE_DICT)
+			args.dict = gnet_dict_data(&args.dict_len);
 
 		n->rx = rx_make_above(n->rx, rx_inflate_get_ops(), &args);
 
@@ -4014,6 +4049,12 @@ node_is_now_connected(struct gnutella_node *n)
 		args.reduced = settings_is_ultra() && NODE_IS_LEAF(n);
 		args.buffer_size = NODE_TX_BUFSIZ;
 		args.buffer_flush = NODE_TX_FLUSH;
+		args.dict = NULL;
+		args.dict_len = 0;
+		args.offload = TRUE;
+
+		if (n->attrs2 & NODE_A2_DEFLATE_DICT)
+			args.dict = gnet_dict_data(&args.dict_len);
 
 		ctx = tx_make_above(tx, tx_deflate_get_ops(), &args);
 		if (ctx == NULL) {
@@ -5408,6 +5449,27 @@ node_process_handshake_ack(struct gnutella_node *n, header_t *head)
 	}
 }
 
+/**
+ * @return the header string advertising the preset dictionary we can use
+ * on deflated streams, as a pointer to static data (empty if none).
+ */
+static const char *
+node_deflate_dict_header(void)
+{
+	static char buf[sizeof("X-Deflate-Dict: 01234567\r\n")];
+
+	if (
+		!GNET_PROPERTY(gnet_deflate_enabled) ||
+		!GNET_PROPERTY(gnet_deflate_dict)
+	)
+		return "";
+
+	gm_snprintf(buf, sizeof buf, "X-Deflate-Dict: %08x\r\n",
+		(unsigned) gnet_dict_id());
+
+	return buf;
+}
+
 /**
  * @return the header string that should be used to advertise our QRP version
  * in the reply to their handshake, as a pointer to static data.
@@ -5753,6 +5815,24 @@ node_process_handshake_header(struct gnutella_node *n, header_t *head)
 		if (field && strtok_has(field, ",", "deflate")) {
 			n->attrs |= NODE_A_RX_INFLATE;	/* We shall decompress input */
 		}
+
+		/*
+		 * X-Deflate-Dict -- preset dictionary known to the remote side
+		 *
+		 * We always advertise ours in the first headers we send, so by now
+		 * both sides know whether they share the same dictionary, which is
+		 * then used for both directions.
+		 */
+
+		field = header_get(head, "X-Deflate-Dict");
+		if (field != NULL && GNET_PROPERTY(gnet_deflate_dict)) {
+			uint32 id;
+			int error;
+
+			id = parse_uint32(field, NULL, 16, &error);
+			if (!error && gnet_dict_id() == id)
+				n->attrs2 |= NODE_A2_DEFLATE_DICT;
+		}
 	}
 
 	/*
@@ -6320,6 +6400,7 @@ node_process_handshake_header(struct gnutella_node *n, header_t *head)
 				"X-Ultrapeer: %s\r\n"
 	 			"X-Requeries: False\r\n"
 				"%s"		/* Accept-Encoding */
+				"%s"		/* X-Deflate-Dict */
 				"%s"		/* Content-Encoding */
 				"%s"		/* X-Ultrapeer-Needed */
 				"%s"		/* X-Query-Routing */
@@ -6336,6 +6417,7 @@ node_process_handshake_header(struct gnutella_node *n, header_t *head)
 				settings_is_leaf() ? "False" : "True",
 				GNET_PROPERTY(gnet_deflate_enabled)
 					? "Accept-Encoding: deflate\r\n" : "",
+				node_deflate_dict_header(),
 				(GNET_PROPERTY(gnet_deflate_enabled)
 				 	&& (n->attrs & NODE_A_TX_DEFLATE)) ? compressing : "",
 				settings_is_leaf() ? "" :
@@ -8721,6 +8803,7 @@ node_init_outgoing(struct gnutella_node *n)
 			"X-Query-Routing: 0.2\r\n"
 			"X-Requeries: False\r\n"
 			"%s"		/* "Accept-Encoding: deflate */
+			"%s"		/* X-Deflate-Dict */
 			"X-Token: %s\r\n"
 			"X-Live-Since: %s\r\n"
 			"X-Ultrapeer: %s\r\n"
@@ -8737,6 +8820,7 @@ node_init_outgoing(struct gnutella_node *n)
 			guid_hex_str(&guid),
 			GNET_PROPERTY(gnet_deflate_enabled)
 				? "Accept-Encoding: deflate\r\n" : "",
+			node_deflate_dict_header(),
 			tok_version(),
 			start_rfc822_date,
 			settings_is_leaf() ? "False" : "True",
@@ -9903,6 +9987,7 @@ node_qrt_discard(struct gnutella_node *n)
 	g_assert(n->peermode == NODE_P_LEAF || n->peermode == NODE_P_ULTRA);
 
 	if (n->recv_query_table != NULL) {
+		qrt_index_remove(n);
 		qrt_unref(n->recv_query_table);
 		n->recv_query_table = NULL;
 	}
@@ -10131,6 +10216,7 @@ node_close(void)
 	aging_destroy(&tcp_crawls);
 	aging_destroy(&udp_crawls);
 	pproxy_set_free_null(&proxies);
+	zlib_offload_close();		/* Before rxbuf_close(), jobs hold buffers */
 	rxbuf_close();
 	node_udp_scheduler_destroy_all();
 }
@@ -10621,7 +10707,7 @@ node_fill_flags(const struct nid *node_id, gnet_node_flags_t *flags)
 bool
 node_get_status(const struct nid *node_id, gnet_node_status_t *status)
 {
-    const gnutella_node_t  *node = node_by_id(node_id);
+    gnutella_node_t  *node = node_by_id(node_id);
 
     g_assert(status != NULL);
 
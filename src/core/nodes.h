@@ -357,6 +357,7 @@ enum {
  * Second attributes.
  */
 enum {
+	NODE_A2_DEFLATE_DICT= 1 << 6,	/**< Deflating with preset dictionary */
 	NODE_A2_NOT_GENUINE	= 1 << 5,	/**< Vendor cannot be genuine */
 	NODE_A2_CAN_TLS		= 1 << 4,	/**< Indicated support for TLS */
 	NODE_A2_TLS			= 1 << 3,	/**< TLS-tunneled */
@@ -34,6 +34,14 @@
  * if still shared and if not too popular, to make sure that their entries
  * do not expire in the DHT.
  *
+ * Entries due for publishing are not handed to the DHT publishing layer
+ * immediately: they are put in a backlog, ordered by urgency, which is
+ * drained at a steady pace.  This avoids bursts of DHT lookups and STORE
+ * requests after startup or a library rescan, when many entries become due
+ * at the same time.  Rare files and files that changed since they were
+ * last published go first.  Republishing delays are also slightly jittered
+ * so that entries published together do not remain synchronized.
+ *
  * @author Raphael Manfredi
  * @date 2009
  */
@@ -63,10 +71,12 @@
 #include "lib/cq.h"
 #include "lib/dbmw.h"
 #include "lib/dbstore.h"
+#include "lib/erbtree.h"
 #include "lib/file.h"
 #include "lib/glib-missing.h"
 #include "lib/hikset.h"
 #include "lib/misc.h"
+#include "lib/random.h"
 #include "lib/stringify.h"
 #include "lib/tm.h"
 #include "lib/unsigned.h"
@@ -88,6 +98,12 @@
 #define PUBLISH_MIN_DECIMATION	0.95	/**< Minimum acceptable decimation */
 #define PUBLISH_MIN_PROBABILITY	0.99999	/**< 5 nines */
 
+#define PUBLISH_DISPATCH	1000	/**< Backlog drained every second */
+#define PUBLISH_JITTER		10		/**< Advance delays by up to 1/10th */
+#define PUBLISH_RANK_CHANGED 600	/**< Precedence of new / changed files */
+#define PUBLISH_RANK_ALTLOC	60		/**< Precedence lost per alt-loc known */
+#define PUBLISH_LAG_SMOOTH	16		/**< Smoothing factor for average lag */
+
 /**
  * Decimation factor to adjust the republish time depending on how many
  * nodes we published to.  Since the overall probability of all the n nodes
@@ -121,7 +137,12 @@ struct publisher_entry {
 	time_t last_enqueued;		/**< When file was last enqueued */
 	time_t last_publish;		/**< When file was last published */
 	time_t last_delayed;		/**< When republish event was set */
+	time_t ready;				/**< When entry was put in the backlog */
+	time_t rank;				/**< Backlog ordering, lowest first */
+	uint32 seqno;				/**< Backlog ordering, for equal ranks */
+	rbnode_t ready_node;		/**< Embedded node in the backlog */
 	uint8 backgrounded;			/**< Whether PDHT is continuing publishing */
+	uint8 queued;				/**< Whether entry is in the backlog */
 };
 
 static inline void
@@ -138,6 +159,14 @@ static hikset_t *publisher_sha1;	/** Known entries by SHA1 */
  */
 static cqueue_t *publish_cq;
 
+/**
+ * Backlog of entries due for publishing, ordered by rank.
+ */
+static erbtree_t publisher_backlog;
+static uint32 publisher_seqno;		/**< Sequence number for backlog entries */
+static cperiodic_t *publisher_dispatch_ev;
+static time_delta_t publisher_lag;	/**< Average backlog lag, in ms */
+
 /**
  * DBM wrapper to associate a SHA1 with publish timing information.
  */
@@ -161,6 +190,19 @@ struct pubdata {
 
 static void publisher_handle(struct publisher_entry *pe);
 
+/**
+ * Backlog comparison routine: lowest rank first, then oldest entry.
+ */
+static int
+publisher_rank_cmp(const void *a, const void *b)
+{
+	const struct publisher_entry *pa = a, *pb = b;
+	int c;
+
+	c = CMP(pa->rank, pb->rank);
+	return 0 != c ? c : CMP(pa->seqno, pb->seqno);
+}
+
 /**
  *  Get pubdata from database.
  */
@@ -228,6 +270,9 @@ publisher_entry_free(struct publisher_entry *pe, bool do_remove)
 	if (pe->backgrounded)
 		pdht_cancel_file(pe->sha1, FALSE);
 
+	if (pe->queued)
+		erbtree_remove(&publisher_backlog, &pe->ready_node);
+
 	atom_sha1_free_null(&pe->sha1);
 	cq_cancel(&pe->publish_ev);
 	WFREE(pe);
@@ -262,8 +307,16 @@ publisher_retry(struct publisher_entry *pe, int delay, const char *msg)
 
 	publisher_check(pe);
 	g_assert(NULL == pe->publish_ev);
+	g_assert(!pe->queued);
 	g_assert(delay > 0);
 
+	/*
+	 * Advance the delay by a random fraction so that entries that were
+	 * processed together do not all come back at the same time.
+	 */
+
+	delay -= random_value(delay / PUBLISH_JITTER);
+
 	pd = get_pubdata(pe->sha1);
 	if (pd != NULL) {
 		pd->next_enqueue = time_advance(tm_time(), UNSIGNED(delay));
@@ -284,6 +337,56 @@ publisher_retry(struct publisher_entry *pe, int delay, const char *msg)
 	}
 }
 
+/**
+ * Put entry in the publishing backlog.
+ *
+ * The rank of an entry is the time at which it became due, advanced for
+ * files that were never published or changed since they were last published,
+ * and delayed for each known alternate location: the fewer sources there
+ * are for a file, the more it matters that it be found through the DHT.
+ * Since all entries age the same way, none can be starved.
+ *
+ * @param pe		the entry to publish
+ * @param sf		the shared file associated with the entry
+ * @param alt_locs	amount of known alternate locations for the file
+ */
+static void
+publisher_enqueue(struct publisher_entry *pe, const shared_file_t *sf,
+	int alt_locs)
+{
+	time_t now = tm_time();
+	time_t last = pe->last_publish;
+
+	publisher_check(pe);
+	g_assert(NULL == pe->publish_ev);
+	g_assert(!pe->queued);
+	g_assert(!pe->backgrounded);
+
+	if (0 == last) {
+		struct pubdata *pd = get_pubdata(pe->sha1);
+
+		if (pd != NULL && pd->expiration != 0)
+			last = pd->expiration - DHT_VALUE_ALOC_EXPIRE;
+	}
+
+	pe->ready = now;
+	pe->rank = now + alt_locs * PUBLISH_RANK_ALTLOC;
+	pe->seqno = publisher_seqno++;
+
+	if (0 == last || delta_time(shared_file_modification_time(sf), last) > 0)
+		pe->rank -= PUBLISH_RANK_CHANGED;
+
+	erbtree_insert(&publisher_backlog, &pe->ready_node);
+	pe->queued = TRUE;
+
+	if (GNET_PROPERTY(publisher_debug) > 3) {
+		g_debug("PUBLISHER SHA-1 %s queued for publishing "
+			"(%d alt-loc%s, %s, backlog: %zu)",
+			sha1_to_string(pe->sha1), alt_locs, 1 == alt_locs ? "" : "s",
+			0 == last ? "new" : "known", erbtree_count(&publisher_backlog));
+	}
+}
+
 /**
  * Hold publishing for some delay, for data we do not want to republish
  * in the short term (data deemed to be popular).  It therefore does not
@@ -724,9 +827,34 @@ publisher_handle(struct publisher_entry *pe)
 	}
 
 	/*
-	 * OK, we can publish this alternate location.
+	 * OK, we can publish this alternate location, when its turn comes.
 	 */
 
+	publisher_enqueue(pe, sf, alt_locs);
+}
+
+/**
+ * Publish entry taken out of the backlog.
+ *
+ * @return TRUE if publishing was started, FALSE if the entry was handled
+ * otherwise because conditions changed whilst it was waiting.
+ */
+static bool
+publisher_publish(struct publisher_entry *pe)
+{
+	shared_file_t *sf;
+
+	publisher_check(pe);
+	g_assert(NULL == pe->publish_ev);
+	g_assert(!pe->queued);
+
+	sf = shared_file_by_sha1(pe->sha1);
+
+	if (NULL == sf || SHARE_REBUILDING == sf || !dht_enabled()) {
+		publisher_handle(pe);
+		return FALSE;
+	}
+
 	if (pe->last_publish) {
 		if (GNET_PROPERTY(publisher_debug) > 2) {
 			g_debug("PUBLISHER SHA-1 %s re-enqueued %d secs "
@@ -737,6 +865,49 @@ publisher_handle(struct publisher_entry *pe)
 
 	pe->last_enqueued = tm_time();
 	pdht_publish_file(sf, publisher_done, pe);
+
+	return TRUE;
+}
+
+/**
+ * Periodic callback draining the backlog, publishing at most the configured
+ * amount of entries per second.
+ */
+static bool
+publisher_dispatch(void *unused_obj)
+{
+	uint32 n = GNET_PROPERTY(publisher_rate);
+	time_t now = tm_time();
+
+	(void) unused_obj;
+
+	while (n != 0) {
+		struct publisher_entry *pe;
+		rbnode_t *rn;
+		time_delta_t lag;
+
+		rn = erbtree_first(&publisher_backlog);
+		if (NULL == rn)
+			break;
+
+		pe = erbtree_key(rn, struct publisher_entry, ready_node);
+		publisher_check(pe);
+
+		erbtree_remove(&publisher_backlog, rn);
+		pe->queued = FALSE;
+
+		lag = delta_time(now, pe->ready) * 1000;
+		publisher_lag += (lag - publisher_lag) / PUBLISH_LAG_SMOOTH;
+
+		if (publisher_publish(pe))
+			n--;
+	}
+
+	gnet_stats_set_general(GNR_DHT_PUBLISHER_BACKLOG,
+		erbtree_count(&publisher_backlog));
+	gnet_stats_set_general(GNR_DHT_PUBLISHER_LAG, publisher_lag / 1000);
+
+	return TRUE;		/* Keep calling */
 }
 
 /**
@@ -937,6 +1108,11 @@ publisher_init(void)
 
 	cq_periodic_add(publish_cq, PUBLISH_SYNC_PERIOD, publisher_sync, NULL);
 
+	erbtree_init(&publisher_backlog, publisher_rank_cmp,
+		offsetof(struct publisher_entry, ready_node));
+	publisher_dispatch_ev =
+		cq_periodic_main_add(PUBLISH_DISPATCH, publisher_dispatch, NULL);
+
 	for (i = 0; i < G_N_ELEMENTS(inverse_decimation); i++) {
 		double n = i + 1.0;
 		double v = log(n / KDA_K);
@@ -1011,6 +1187,7 @@ publisher_close(void)
 	 * Final cleanup.
 	 */
 
+	cq_periodic_remove(&publisher_dispatch_ev);
 	hikset_foreach(publisher_sha1, free_entry, NULL);
 	hikset_free_null(&publisher_sha1);
 
@@ -55,8 +55,10 @@
 #include "lib/array.h"
 #include "lib/getdate.h"
 #include "lib/endian.h"
+#include "lib/halloc.h"
 #include "lib/hashing.h"
 #include "lib/hset.h"
+#include "lib/mempcpy.h"
 #include "lib/random.h"
 #include "lib/product.h"
 #include "lib/sequence.h"
@@ -619,121 +621,48 @@ failure:
 	found_clear();
 }
 
+/*
+ * Cached encoding of a hit entry.
+ *
+ * This is everything but the file index, which is written first, and the
+ * alternate locations, which change from one hit to the other and are emitted
+ * as a GGEP "ALT" extension ahead of the cached GGEP block.  Records are
+ * attached to the shared file, which discards them when its metadata change.
+ */
+struct qhit_record {
+	size_t plen;				/**< Length of entry prefix (size, name, URN) */
+	size_t glen;				/**< Length of the GGEP block, 0 if none */
+	unsigned paths:1;			/**< Whether relative paths were exposed */
+	char data[1];				/**< plen + glen bytes, extending structure */
+};
+
 /**
- * Add file to current query hit.
+ * Build the encoding of the hit entry for the file.
  *
- * @returns TRUE if we inserted the record, FALSE if we refused it due to
- * lack of space.
+ * @param sf		the shared file
+ * @param ggep_h	whether the SHA1 and TTH are emitted as GGEP "H"
+ *
+ * @return a new halloc()'ed record.
  */
-static bool
-add_file(const shared_file_t *sf)
+static struct qhit_record *
+qhit_record_build(const shared_file_t *sf, bool ggep_h)
 {
-	bool sha1_available;
-	gnet_host_t hvec[QHIT_MAX_ALT];
-	int hcnt = 0;
-	uint32 fs32, fs32_le, idx_le;
-	int ggep_len;
-	bool ok;
+	struct qhit_record *rec;
+	const char *rp;
+	size_t plen, gmax;
+	uint32 fs32, fs32_le;
 	ggep_stream_t gs;
-	size_t left, needed;
-	void *start;
-	bool is_partial;
-	uint32 file_index;
+	bool sha1_available, ok;
+	char *p;
 
-	is_partial = shared_file_is_partial(sf);
-	needed = 8 + 2 + shared_file_name_nfc_len(sf);	/* size of hit entry */
 	sha1_available = sha1_hash_available(sf);
+	rp = shared_file_relative_path(sf);
 
-	g_return_val_unless(!is_partial || sha1_available, FALSE);
-
-	/*
-	 * Make sure we never insert duplicate indices in a query hit.
-	 *
-	 * This code assumes there will never be any collision between shared
-	 * file indices and pointers to SHA1, which will always hold fortunately
-	 * in real life.
-	 */
-
-	file_index = shared_file_index(sf);
-
-	if (!is_partial) {
-		g_assert_log(
-			!found_contains(uint_to_pointer(file_index)),
-			"file_index=%u (%s SHA1), qhit_contains=%zu, qhit_files=%zu",
-			(unsigned) file_index, sha1_available ? "has" : "no",
-			found_contains_count(), found_file_count());
-	} else {
-		unsigned i;
-
-		/*
-		 * Generate a random file index, unique to this query hit.
-		 *
-		 * This is for the sake of our own spam detector which will
-		 * frown upon duplicate file indices.
-		 */
+	plen = 4 + shared_file_name_nfc_len(sf) + 1 + SHA1_URN_LENGTH + 1;
+	gmax = QHIT_MAX_GGEP + (NULL == rp ? 0 : strlen(rp));
 
-		for (i = 0; i < 100; i++) {
-			file_index = 1 + random_value(INT_MAX - 1);
-
-			if (!found_contains(uint_to_pointer(file_index)))
-				goto unique_file_index;
-		}
-		g_error("no luck with random number generator");
-	}
-
-unique_file_index:
-	found_insert(uint_to_pointer(file_index));
-
-	/*
-	 * In case we emit the SHA1 as a GGEP "H", we'll grow the buffer
-	 * larger necessary, since the extension will take at most 26 bytes,
-	 * and could take only 25.  This is NOT a problem, as we later adjust
-	 * the real size to fit the data we really emitted.
-	 *
-	 * If some alternate locations are available, they'll be included as
-	 * GGEP "ALT" afterwards.
-	 */
-
-	if (sha1_available) {
-		const sha1_t *sha1 = shared_file_sha1(sf);
-
-		/*
-		 * They can share twice or more identical files.  Make sure we only
-		 * include each SHA1 once in the query hits we return for a query:
-		 * having multiple entries would waste bandwidth anyway.
-		 */
-
-		if (found_contains(sha1)) {
-			if (GNET_PROPERTY(qhit_debug))
-				g_warning("QHIT not including SHA1 %s twice",
-					sha1_base32(sha1));
-			return TRUE;		/* Entry consumed, but not included */
-		}
-
-		found_insert(sha1);		/* SHA1 are atoms, address is unique */
-
-		needed += 9 + SHA1_BASE32_SIZE;
-		hcnt = dmesh_fill_alternate(sha1, hvec, G_N_ELEMENTS(hvec));
-		needed += hcnt * 18 + 6;	/* Conservative, assumes IPv6 only */
-	}
-
-	/*
-	 * Refuse entry if we don't have enough room.	-- RAM, 22/01/2002
-	 */
-
-	if (
-		found_size() + needed + QHIT_MIN_TRAILER_LEN
-			> GNET_PROPERTY(search_answers_forward_size)
-	)
-		return FALSE;
-
-	/*
-	 * Grow buffer by the size of the search results header 8 bytes,
-	 * plus the string length - NULL, plus two NULL's
-	 */
-
-	if (needed > found_left())
-		return FALSE;
+	rec = halloc(offsetof(struct qhit_record, data) + plen + gmax);
+	rec->paths = booleanize(GNET_PROPERTY(search_results_expose_relative_paths));
 
 	/*
 	 * If size is greater than 2^31-1, we store ~0 as the file size and will
@@ -741,46 +670,34 @@ unique_file_index:
 	 */
 
 	fs32 = shared_file_size(sf) >= (1U << 31) ? ~0U : shared_file_size(sf);
-
-	poke_le32(&idx_le, file_index);
-	if (!found_write(&idx_le, sizeof idx_le))
-		return FALSE;
 	poke_le32(&fs32_le, fs32);
-	if (!found_write(&fs32_le, sizeof fs32_le))
-		return FALSE;
-	if (!found_write(shared_file_name_nfc(sf), shared_file_name_nfc_len(sf)))
-		return FALSE;
 
-	/* Position equals the next byte to be written to */
-
-	if (!found_write("", 1))
-		return FALSE;
+	p = mempcpy(rec->data, &fs32_le, sizeof fs32_le);
+	p = mempcpy(p, shared_file_name_nfc(sf), shared_file_name_nfc_len(sf));
+	*p++ = '\0';
 
 	/*
 	 * We're now between the two NULs at the end of the hit entry.
-	 */
-
-	/*
+	 *
 	 * Emit the SHA1 as a plain ASCII URN if they don't grok "H".
 	 */
 
-	if (sha1_available && !found_ggep_h()) {
+	if (sha1_available && !ggep_h) {
 		const struct sha1 * const sha1 = shared_file_sha1(sf);
 
 		/* Good old way: ASCII URN */
-		if (!found_write(sha1_to_urn_string(sha1), SHA1_URN_LENGTH))
-			return FALSE;
-		if (!found_write("\x1c", 1))
-			return FALSE;
+		p = mempcpy(p, sha1_to_urn_string(sha1), SHA1_URN_LENGTH);
+		*p++ = '\x1c';
 	}
 
+	rec->plen = p - rec->data;
+	g_assert(rec->plen <= plen);
+
 	/*
 	 * From now on, we emit GGEP extensions, if we emit at all.
 	 */
 
-	left = found_left();
-	start = found_open();
-	ggep_stream_init(&gs, start, left);
+	ggep_stream_init(&gs, p, gmax);
 
 	/*
 	 * If we matched a partial file, let them know (unless the file is
@@ -796,7 +713,7 @@ unique_file_index:
 	 *		--RAM, 2011-05-15
 	 */
 
-	if (is_partial && !shared_file_is_finished(sf)) {
+	if (shared_file_is_partial(sf) && !shared_file_is_finished(sf)) {
 		time_t mtime = shared_file_modification_time(sf);
 		filesize_t available = shared_file_available(sf);
 		char buf[sizeof mtime + sizeof available];
@@ -819,7 +736,7 @@ unique_file_index:
 	 * way is GGEP "H" for binary URN but only gtk-gnutella implements it.
 	 */
 
-	if (sha1_available && found_ggep_h()) {
+	if (sha1_available && ggep_h) {
 		const struct sha1 * const sha1 = shared_file_sha1(sf);
 		const struct tth * const tth = shared_file_tth(sf);
 		const uint8 type = tth ? GGEP_H_BITPRINT : GGEP_H_SHA1;
@@ -841,7 +758,7 @@ unique_file_index:
 	 * hash in binary form.
 	 */
 
-	if (sha1_available && !found_ggep_h()) {
+	if (sha1_available && !ggep_h) {
 		const struct tth * const tth = shared_file_tth(sf);
 
 		if (tth) {
@@ -870,28 +787,10 @@ unique_file_index:
 			qhit_log_ggep_write_failure("LF");
 	}
 
-	/*
-	 * If we have known alternate locations, include a few of them for
-	 * this file in the GGEP "ALT" extension.
-	 */
-
-	if (hcnt > 0) {
-		unsigned flags = found_flags();
-
-		g_assert(hcnt <= QHIT_MAX_ALT);
-
-		if (GGEP_OK != ggept_alt_pack(&gs, hvec, hcnt, flags))
-			qhit_log_ggep_write_failure("ALT");
-	}
-
-	{
-		const char *rp = shared_file_relative_path(sf);
-		
-		if (rp) {
-			ok = ggep_stream_pack(&gs, GGEP_NAME(PATH), rp, strlen(rp), 0);
-			if (!ok)
-				qhit_log_ggep_write_failure("PATH");
-		}
+	if (rp) {
+		ok = ggep_stream_pack(&gs, GGEP_NAME(PATH), rp, strlen(rp), 0);
+		if (!ok)
+			qhit_log_ggep_write_failure("PATH");
 	}
 
 	{
@@ -917,6 +816,206 @@ unique_file_index:
 		}
 	}
 
+	rec->glen = ggep_stream_close(&gs);
+
+	return hrealloc(rec,
+		offsetof(struct qhit_record, data) + rec->plen + rec->glen);
+}
+
+/**
+ * Get the encoding of the hit entry for the file, building it if needed.
+ *
+ * Records of library files are cached in the shared file.  Those of partial
+ * files are built each time since the availability information they carry
+ * keeps changing, and must then be freed by the caller.
+ *
+ * @param sf		the shared file
+ * @param transient	set to TRUE if the returned record must be freed
+ *
+ * @return the record for the current query hit.
+ */
+static struct qhit_record *
+qhit_record_get(const shared_file_t *sf, bool *transient)
+{
+	bool ggep_h = found_ggep_h();
+	struct qhit_record *rec;
+
+	if (shared_file_is_partial(sf)) {
+		*transient = TRUE;
+		return qhit_record_build(sf, ggep_h);
+	}
+
+	*transient = FALSE;
+	rec = deconstify_pointer(shared_file_qhit_record(sf, ggep_h));
+
+	/*
+	 * The exposition of relative paths being a user preference, which can
+	 * be changed at any time, we need to rebuild the record when it changes.
+	 */
+
+	if (
+		NULL == rec ||
+		rec->paths !=
+			booleanize(GNET_PROPERTY(search_results_expose_relative_paths))
+	) {
+		rec = qhit_record_build(sf, ggep_h);
+		shared_file_set_qhit_record(sf, ggep_h, rec);
+	}
+
+	return rec;
+}
+
+/**
+ * Add file to current query hit.
+ *
+ * @returns TRUE if we inserted the record, FALSE if we refused it due to
+ * lack of space.
+ */
+static bool
+add_file(const shared_file_t *sf)
+{
+	bool sha1_available;
+	gnet_host_t hvec[QHIT_MAX_ALT];
+	int hcnt = 0;
+	uint32 idx_le;
+	int ggep_len;
+	ggep_stream_t gs;
+	struct qhit_record *rec;
+	size_t needed;
+	bool is_partial, transient, written;
+	uint32 file_index;
+
+	is_partial = shared_file_is_partial(sf);
+	needed = 8 + 2 + shared_file_name_nfc_len(sf);	/* size of hit entry */
+	sha1_available = sha1_hash_available(sf);
+
+	g_return_val_unless(!is_partial || sha1_available, FALSE);
+
+	/*
+	 * Make sure we never insert duplicate indices in a query hit.
+	 *
+	 * This code assumes there will never be any collision between shared
+	 * file indices and pointers to SHA1, which will always hold fortunately
+	 * in real life.
+	 */
+
+	file_index = shared_file_index(sf);
+
+	if (!is_partial) {
+		g_assert_log(
+			!found_contains(uint_to_pointer(file_index)),
+			"file_index=%u (%s SHA1), qhit_contains=%zu, qhit_files=%zu",
+			(unsigned) file_index, sha1_available ? "has" : "no",
+			found_contains_count(), found_file_count());
+	} else {
+		unsigned i;
+
+		/*
+		 * Generate a random file index, unique to this query hit.
+		 *
+		 * This is for the sake of our own spam detector which will
+		 * frown upon duplicate file indices.
+		 */
+
+		for (i = 0; i < 100; i++) {
+			file_index = 1 + random_value(INT_MAX - 1);
+
+			if (!found_contains(uint_to_pointer(file_index)))
+				goto unique_file_index;
+		}
+		g_error("no luck with random number generator");
+	}
+
+unique_file_index:
+	found_insert(uint_to_pointer(file_index));
+
+	/*
+	 * In case we emit the SHA1 as a GGEP "H", we'll grow the buffer
+	 * larger necessary, since the extension will take at most 26 bytes,
+	 * and could take only 25.  This is NOT a problem, as we later adjust
+	 * the real size to fit the data we really emitted.
+	 *
+	 * If some alternate locations are available, they'll be included as
+	 * GGEP "ALT" afterwards.
+	 */
+
+	if (sha1_available) {
+		const sha1_t *sha1 = shared_file_sha1(sf);
+
+		/*
+		 * They can share twice or more identical files.  Make sure we only
+		 * include each SHA1 once in the query hits we return for a query:
+		 * having multiple entries would waste bandwidth anyway.
+		 */
+
+		if (found_contains(sha1)) {
+			if (GNET_PROPERTY(qhit_debug))
+				g_warning("QHIT not including SHA1 %s twice",
+					sha1_base32(sha1));
+			return TRUE;		/* Entry consumed, but not included */
+		}
+
+		found_insert(sha1);		/* SHA1 are atoms, address is unique */
+
+		needed += 9 + SHA1_BASE32_SIZE;
+		hcnt = dmesh_fill_alternate(sha1, hvec, G_N_ELEMENTS(hvec));
+		needed += hcnt * 18 + 6;	/* Conservative, assumes IPv6 only */
+	}
+
+	/*
+	 * Refuse entry if we don't have enough room.	-- RAM, 22/01/2002
+	 */
+
+	if (
+		found_size() + needed + QHIT_MIN_TRAILER_LEN
+			> GNET_PROPERTY(search_answers_forward_size)
+	)
+		return FALSE;
+
+	/*
+	 * Grow buffer by the size of the search results header 8 bytes,
+	 * plus the string length - NULL, plus two NULL's
+	 */
+
+	if (needed > found_left())
+		return FALSE;
+
+	/*
+	 * The bulk of the entry comes from its cached encoding: only the file
+	 * index and the alternate locations are computed for each hit.
+	 */
+
+	poke_le32(&idx_le, file_index);
+	if (!found_write(&idx_le, sizeof idx_le))
+		return FALSE;
+
+	rec = qhit_record_get(sf, &transient);
+	written = FALSE;
+
+	if (!found_write(rec->data, rec->plen))
+		goto done;
+
+	ggep_stream_init(&gs, found_open(), found_left());
+
+	/*
+	 * If we have known alternate locations, include a few of them for
+	 * this file in the GGEP "ALT" extension.
+	 */
+
+	if (hcnt > 0) {
+		unsigned flags = found_flags();
+
+		g_assert(hcnt <= QHIT_MAX_ALT);
+
+		if (GGEP_OK != ggept_alt_pack(&gs, hvec, hcnt, flags))
+			qhit_log_ggep_write_failure("ALT");
+	}
+
+	if (rec->glen != 0) {
+		if (!ggep_stream_splice(&gs, &rec->data[rec->plen], rec->glen))
+			qhit_log_ggep_write_failure("cached");
+	}
+
 	/*
 	 * Because we don't know exactly the size of the GGEP extension
 	 * (could be COBS-encoded or not), we need to adjust the real
@@ -927,6 +1026,15 @@ unique_file_index:
 	found_close(ggep_len);
 
 	if (!found_write("", 1))		/* Append terminating NUL */
+		goto done;
+
+	written = TRUE;
+
+done:
+	if (transient)
+		HFREE_NULL(rec);
+
+	if (!written)
 		return FALSE;
 
 	found_add_files(1);
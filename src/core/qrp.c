@@ -50,6 +50,7 @@
 
 #include "lib/atoms.h"
 #include "lib/bg.h"
+#include "lib/bitmerge.h"
 #include "lib/cq.h"
 #include "lib/glib-missing.h"
 #include "lib/endian.h"
@@ -62,6 +63,7 @@
 #include "lib/sha1.h"
 #include "lib/str.h"
 #include "lib/stringify.h"
+#include "lib/tbitmap.h"
 #include "lib/tm.h"
 #include "lib/unsigned.h"
 #include "lib/utf8.h"
@@ -83,6 +85,7 @@
 #define MAX_TABLE_SIZE		(1 << MAX_TABLE_BITS)
 #define MAX_UP_TABLE_SIZE	131072 /**< Max size for inter-UP QRP: 128 Kslots */
 #define EMPTY_TABLE_SIZE	8
+#define QRT_INDEX_BITS		16		/**< 64K rows in the leaf QRT index */
 
 #define qrp_debugging(lvl)	G_UNLIKELY(GNET_PROPERTY(qrp_debug) > (lvl))
 
@@ -208,6 +211,26 @@ static struct routing_table *local_table;   /**< Table for local files */
 static struct routing_table *merged_table;  /**< From all our leaves */
 static int generation;
 
+/**
+ * The leaf QRT index.
+ *
+ * The QRTs of all our leaves are transposed into a bitmap holding one row
+ * per slot and one column per leaf, so that the leaves whose QRT can route
+ * a query are found by combining the rows of the query words, instead of
+ * probing each leaf QRT in turn.
+ *
+ * Each column records the leaf to which it belongs, and the column of each
+ * indexed leaf is kept in a table.
+ */
+struct qrt_index_entry {
+	struct gnutella_node *node;		/**< Leaf owning the column, NULL if free */
+};
+
+static tbitmap_t *qrt_index;					/**< Transposed leaf QRTs */
+static struct qrt_index_entry *qrt_index_entries;	/**< Indexed by column */
+static size_t qrt_index_capacity;				/**< Amount of entries */
+static htable_t *qrt_index_columns;				/**< Leaf -> column */
+
 static void qrt_compress_cancel_all(void);
 static void qrt_patch_compute(
 	struct routing_table *rt, struct routing_patch **rpp);
@@ -837,11 +860,11 @@ qrt_patch_compress(
 }
 
 /**
- * Create a new query routing table, with supplied `arena' and `slots'.
+ * Allocate a new query routing table, with supplied `arena' and `slots'.
  * The value used for infinity is given as `max'.
  */
 static struct routing_table *
-qrt_create(const char *name, char *arena, int slots, int max)
+qrt_alloc(const char *name, char *arena, int slots, int max)
 {
 	struct routing_table *rt;
 
@@ -864,11 +887,22 @@ qrt_create(const char *name, char *arena, int slots, int max)
 	rt->can_route_urn = qrp_can_route_default;
 	rt->can_route     = qrp_can_route_default;
 
-	qrt_compact(rt);
+	return rt;
+}
+
+/**
+ * Finish the creation of a compacted query routing table.
+ *
+ * @return its argument.
+ */
+static struct routing_table *
+qrt_created(struct routing_table *rt)
+{
+	g_assert(rt->compacted);
 
 	gnet_prop_set_guint32_val(PROP_QRP_GENERATION, (uint32) rt->generation);
 	gnet_prop_set_guint32_val(PROP_QRP_MEMORY,
-		GNET_PROPERTY(qrp_memory) + slots / 8);
+		GNET_PROPERTY(qrp_memory) + rt->slots / 8);
 
 	if (qrp_debugging(2))
 		rt->digest = atom_sha1_get(qrt_sha1(rt));
@@ -882,6 +916,40 @@ qrt_create(const char *name, char *arena, int slots, int max)
 	return rt;
 }
 
+/**
+ * Create a new query routing table, with supplied `arena' and `slots'.
+ * The value used for infinity is given as `max'.
+ */
+static struct routing_table *
+qrt_create(const char *name, char *arena, int slots, int max)
+{
+	struct routing_table *rt;
+
+	rt = qrt_alloc(name, arena, slots, max);
+	qrt_compact(rt);
+
+	return qrt_created(rt);
+}
+
+/**
+ * Create a new query routing table from an already compacted `arena',
+ * holding one bit per slot for `slots' slots.
+ */
+static struct routing_table *
+qrt_create_compacted(const char *name, uchar *arena, int slots)
+{
+	struct routing_table *rt;
+
+	g_assert(slots >= 8);
+	g_assert(0 == (slots & 0x7));		/* Multiple of 8 */
+
+	rt = qrt_alloc(name, (char *) arena, slots, LOCAL_INFINITY);
+	rt->set_count = bitmerge_count(arena, slots / 8);
+	rt->compacted = TRUE;
+
+	return qrt_created(rt);
+}
+
 /**
  * Create small empty table.
  */
@@ -915,48 +983,6 @@ qrt_free(struct routing_table *rt)
 	WFREE(rt);
 }
 
-/**
- * Shrink arena inplace to use only `new_slots' instead of `old_slots'.
- * The memory area is also shrunk and the new location of the arena is
- * returned.
- */
-static void *
-qrt_shrink_arena(char *arena, int old_slots, int new_slots, int inf_val)
-{
-	int factor;		/* Shrink factor */
-	int ratio;
-	int i, j;
-
-	g_assert(old_slots > new_slots);
-	g_assert(is_pow2(old_slots));
-	g_assert(is_pow2(new_slots));
-
-	ratio = highest_bit_set(old_slots) - highest_bit_set(new_slots);
-
-	g_assert(ratio >= 0);
-
-	factor = 1 << ratio;
-
-	/*
-	 * The shrinking algorithm: an entry is "set" to contain something if
-	 * any of the "factor" entries in the larger table contain something.
-	 */
-
-	for (i = 0, j = 0; i < new_slots && j < old_slots; i++, j += factor) {
-		int k;
-		int set = FALSE;
-
-		for (k = 0; k < factor && !set; k++) {
-			if ((uchar) arena[j + k] != inf_val)
-				set = TRUE;
-		}
-
-		arena[i] = set ? 0 : inf_val;
-	}
-
-	return hrealloc(arena, new_slots);
-}
-
 /**
  * @returns the query routing table, NULL if not computed yet.
  */
@@ -1042,7 +1068,7 @@ enum merge_magic {
 struct merge_context {
 	enum merge_magic magic;
 	GSList *tables;				/* Leaf routing tables */
-	uchar *arena;				/* Working arena (not compacted) */
+	uchar *arena;				/* Working arena (compacted, 1 bit per slot) */
 	int slots;					/* Amount of slots used for merged table */
 };
 
@@ -1129,10 +1155,8 @@ mrg_step_get_list(struct bgtask *unused_h, void *u, int unused_ticks)
 	g_assert(max_size > 0 || ctx->tables == NULL);
 
 	ctx->slots = max_size;
-	if (max_size > 0) {
-		ctx->arena = halloc(max_size);
-		memset(ctx->arena, LOCAL_INFINITY, max_size);
-	}
+	if (max_size > 0)
+		ctx->arena = halloc0(max_size / 8);		/* All slots empty */
 
 	return BGR_NEXT;
 }
@@ -1141,18 +1165,12 @@ mrg_step_get_list(struct bgtask *unused_h, void *u, int unused_ticks)
  * Merge routing table into specified arena.
  *
  * @param rt is the routing table to merge
- * @param arena is a non-compacted arena
+ * @param arena is a compacted arena
  * @param slots is the number of slots in the arena
  */
 static void
 merge_table_into_arena(struct routing_table *rt, uchar *arena, int slots)
 {
-	int ratio;
-	int expand;
-	int i;
-	int b;
-	int bytes;
-
 	/*
 	 * By construction, the size of the arena is the max of all the sizes
 	 * of the QRT tables, so the size of the routing table to merge can only
@@ -1165,97 +1183,17 @@ merge_table_into_arena(struct routing_table *rt, uchar *arena, int slots)
 	g_assert(is_pow2(rt->slots));
 	g_assert(rt->slots >= 8);
 
-	ratio = highest_bit_set(slots) - highest_bit_set(rt->slots);
-
-	g_assert(ratio >= 0);
-
-	expand = 1 << ratio;
-	bytes = rt->slots / 8;
-
-	g_assert(rt->slots * expand <= slots);	/* Won't overflow */
-
 	/*
-	 * Loop over the supplied QRT, and expand each slot `expand' times into
-	 * the arena, doing an "OR" merging.
-	 *
-	 * Since this is going to be a tight loop, try to optimize the smallest
-	 * expansion factors by avoiding memset() calls.
+	 * Since both the QRT and the arena are compacted, a slot is present
+	 * when its bit is set and merging is an "OR" of the two bitsets.
 	 *
-	 * Furthermore, we avoid repeated RT_SLOT_READ() calls by accessing the
-	 * compacted table one byte at a time and then looping on each of its bits.
+	 * When the QRT is smaller than the arena, each of its slots must be
+	 * expanded to cover the corresponding slots in the arena.  This is
+	 * handled by bitmerge_or_expand(), which falls back to a plain block
+	 * "OR" when both sizes are the same, the most common case.
 	 */
 
-#define RT_FOR_EACH_BIT_SET(ON_CHANGE)				\
-for (b = 0, i = 0; b < bytes; b++) {				\
-	uint8 entry = rt->arena[b];						\
-	unsigned mask = 0x80;							\
-													\
-	do {											\
-		/* "0 OR x = x", hence skip unset bits */	\
-		if (entry & mask) {							\
-			ON_CHANGE								\
-		}											\
-		i++;										\
-		mask >>= 1;									\
-	} while (mask);									\
-}
-
-	switch (expand) {
-	case 1:
-		RT_FOR_EACH_BIT_SET(
-			arena[i] = 0;		/* less than "inf" => indicates presence */
-		);
-		break;
-	case 2:
-		RT_FOR_EACH_BIT_SET(
-			size_t j = i * 2;
-			arena[j++] = 0;		/* less than "inf" => indicates presence */
-			arena[j] = 0;
-		);
-		break;
-	case 4:
-		RT_FOR_EACH_BIT_SET(
-			size_t j = i * 4;
-			arena[j++] = 0;		/* less than "inf" => indicates presence */
-			arena[j++] = 0;
-			arena[j++] = 0;
-			arena[j] = 0;
-		);
-		break;
-	case 8:
-		RT_FOR_EACH_BIT_SET(
-			size_t j = i * 8;
-			arena[j++] = 0;		/* less than "inf" => indicates presence */
-			arena[j++] = 0;
-			arena[j++] = 0;
-			arena[j++] = 0;
-			arena[j++] = 0;
-			arena[j++] = 0;
-			arena[j++] = 0;
-			arena[j] = 0;
-		);
-		break;
-	case 16:
-		RT_FOR_EACH_BIT_SET(
-			/* 0 is less than "infinity" => indicates presence */
-			memset(&arena[i * 16], 0, 16);
-		);
-		break;
-	case 32:
-		RT_FOR_EACH_BIT_SET(
-			/* 0 is less than "infinity" => indicates presence */
-			memset(&arena[i * 32], 0, 32);
-		);
-		break;
-	default:
-		RT_FOR_EACH_BIT_SET(
-			/* 0 is less than "infinity" => indicates presence */
-			memset(&arena[i * expand], 0, expand);
-		);
-		break;
-	}
-
-#undef RT_FOR_EACH_BIT_SET
+	bitmerge_or_expand(arena, slots / 8, rt->arena, rt->slots / 8);
 }
 
 /**
@@ -1319,8 +1257,7 @@ mrg_step_install_table(struct bgtask *unused_h, void *u, int unused_ticks)
 	if (settings_is_ultra()) {
 		struct routing_table *mt;
 		if (ctx->slots != 0)
-			mt = qrt_create("Merged table",
-				cast_to_pointer(ctx->arena), ctx->slots, LOCAL_INFINITY);
+			mt = qrt_create_compacted("Merged table", ctx->arena, ctx->slots);
 		else {
 			g_assert(ctx->arena == NULL);
 			mt = qrt_empty_table("Empty merged table");
@@ -1603,13 +1540,10 @@ struct qrp_context {
 	GSList *sl_substrings;		/**< List of all substrings */
 	htable_t *words;			/**< Words making up the files */
 	int substrings;				/**< Amount of substrings */
-	char *table;				/**< Computed routing table */
+	char *table;				/**< Computed routing table (compacted for merge) */
 	int slots;					/**< Amount of slots in table */
 	struct routing_table *st;	/**< Smaller table */
 	struct routing_table *lt;	/**< Larger table for merging (destination) */
-	int sidx;					/**< Source index in `st' */
-	int lidx;					/**< Merging index in `lt' */
-	int expand;					/**< Expansion ratio from `st' to `lt' */
 };
 
 static struct bgtask *qrp_comp;	/**< Background computation handle */
@@ -1978,7 +1912,6 @@ static bgret_t
 qrp_step_wait_for_merged_table(struct bgtask *h, void *u, int unused_ticks)
 {
 	struct qrp_context *ctx = u;
-	int ratio;
 
 	(void) unused_ticks;
 	g_assert(ctx->magic == QRP_MAGIC);
@@ -2006,11 +1939,11 @@ qrp_step_wait_for_merged_table(struct bgtask *h, void *u, int unused_ticks)
 	}
 
 	/*
-	 * Prepare the iteration for the next step.
+	 * Prepare the merging for the next step.
 	 *
 	 * Identify the smallest of the two tables, and put the smallest in `st'
-	 * and the largest in `lt'.  Then compute the expansion factor between
-	 * the two and allocate the arena for the merging.
+	 * and the largest in `lt'.  Then allocate the arena for the merging,
+	 * which is compacted and starts as a copy of the largest table.
 	 */
 
 	g_assert(local_table != NULL);
@@ -2026,17 +1959,10 @@ qrp_step_wait_for_merged_table(struct bgtask *h, void *u, int unused_ticks)
 		ctx->lt = qrt_ref(local_table);
 	}
 
-	ratio = highest_bit_set(ctx->lt->slots) - highest_bit_set(ctx->st->slots);
-
-	g_assert(ratio >= 0);		/* By construction, lt is larger than st */
-
-	ctx->expand = 1 << ratio;
-	ctx->sidx = ctx->lidx = 0;
-
+	g_assert(ctx->st->slots <= ctx->lt->slots);	/* By construction */
 	g_assert(ctx->table == NULL);
 
-	ctx->table = halloc(ctx->slots);
-	memset(ctx->table, LOCAL_INFINITY, ctx->slots);
+	ctx->table = hcopy(ctx->lt->arena, ctx->slots / 8);
 
 	/* Ready for iterating */
 
@@ -2047,18 +1973,13 @@ qrp_step_wait_for_merged_table(struct bgtask *h, void *u, int unused_ticks)
  * Merge `local_table' with `merged_table'.
  */
 static bgret_t
-qrp_step_merge_with_leaves(struct bgtask *unused_h, void *u, int ticks)
+qrp_step_merge_with_leaves(struct bgtask *unused_h, void *u, int unused_ticks)
 {
 	struct qrp_context *ctx = u;
-	int used;
 	struct routing_table *st = ctx->st;
-	struct routing_table *lt = ctx->lt;
-	int max;
-	int i = ctx->sidx;
-	int expand = ctx->expand;
-	int j;
 
 	(void) unused_h;
+	(void) unused_ticks;
 	g_assert(ctx->magic == QRP_MAGIC);
 
 	/*
@@ -2069,33 +1990,20 @@ qrp_step_merge_with_leaves(struct bgtask *unused_h, void *u, int ticks)
 	if (settings_is_leaf())
 		return BGR_NEXT;
 
-	g_assert(st != NULL && lt != NULL);
+	g_assert(st != NULL && ctx->lt != NULL);
 	g_assert(st->compacted);
-	g_assert(lt->compacted);
+	g_assert(ctx->lt->compacted);
 
-	max = st->slots;
-
-	for (used = 0; used < ticks && i < max; i++, used++, ctx->sidx++) {
-		bool vs = RT_SLOT_READ(st->arena, i);
-
-		/*
-		 * Since `lt', the larger table, has the same size as the merged
-		 * table, the `ctx->lidx' also points to the next area to be merged
-		 * in the result.
-		 */
-
-		g_assert(ctx->lidx + expand <= lt->slots);	/* Won't overflow */
+	/*
+	 * Since `lt', the larger table, has the same size as the merged
+	 * table and was copied there, we only need to "OR" the smaller table,
+	 * expanding its slots as needed.  This is fast enough to be done in
+	 * one single step, even for the largest tables.
+	 */
 
-		for (j = 0; j < expand; j++) {
-			bool vl = RT_SLOT_READ(lt->arena, ctx->lidx);
-			if (vl || vs)
-				ctx->table[ctx->lidx++] = 0;	/* Present, less than oo */
-			else
-				ctx->table[ctx->lidx++] = LOCAL_INFINITY;	/* Absent => oo */
-		}
-	}
+	bitmerge_or_expand(ctx->table, ctx->slots / 8, st->arena, st->slots / 8);
 
-	return (ctx->sidx < max) ? BGR_MORE : BGR_NEXT;
+	return BGR_NEXT;
 }
 
 /**
@@ -2130,8 +2038,12 @@ qrp_step_install_ultra(struct bgtask *h, void *u, int ticks)
 	 */
 
 	if (ctx->slots > MAX_UP_TABLE_SIZE) {
-		ctx->table = qrt_shrink_arena(
-			ctx->table, ctx->slots, MAX_UP_TABLE_SIZE, LOCAL_INFINITY);
+		char *table = halloc0(MAX_UP_TABLE_SIZE / 8);
+
+		bitmerge_or_shrink(table, MAX_UP_TABLE_SIZE / 8,
+			ctx->table, ctx->slots / 8);
+		HFREE_NULL(ctx->table);
+		ctx->table = table;
 		ctx->slots = MAX_UP_TABLE_SIZE;
 	}
 
@@ -2139,7 +2051,8 @@ qrp_step_install_ultra(struct bgtask *h, void *u, int ticks)
 	 * Install merged table as `routing_table'.
 	 */
 
-	rt = qrt_create("Routing table", ctx->table, ctx->slots, LOCAL_INFINITY);
+	rt = qrt_create_compacted("Routing table",
+			(uchar *) ctx->table, ctx->slots);
 	ctx->table = NULL;			/* Don't free arena when freeing context */
 
 	install_routing_table(rt);
@@ -3785,6 +3698,107 @@ qrt_dynamic_bind_empty(struct routing_table *rt)
 	rt->can_route     = qrp_cannot_route;
 }
 
+/**
+ * @return the column of the leaf in the leaf QRT index, TBITMAP_NONE if
+ * the leaf is not indexed.
+ */
+static size_t
+qrt_index_column(const struct gnutella_node *n)
+{
+	void *value;
+
+	if (!htable_lookup_extended(qrt_index_columns, n, NULL, &value))
+		return TBITMAP_NONE;
+
+	return pointer_to_size(value);
+}
+
+/**
+ * Record the (new or fully patched) QRT of a leaf into the leaf QRT index.
+ */
+static void
+qrt_index_install(struct gnutella_node *n, const struct routing_table *rt)
+{
+	size_t col;
+
+	qrt_check(rt);
+	g_assert(NODE_IS_LEAF(n));
+
+	if (NULL == qrt_index) {
+		qrt_index = tbitmap_make(QRT_INDEX_BITS);
+		qrt_index_columns = htable_create(HASH_KEY_SELF, 0);
+	}
+
+	col = qrt_index_column(n);
+
+	if (TBITMAP_NONE == col) {
+		size_t capacity;
+
+		col = tbitmap_column_alloc(qrt_index);
+		capacity = tbitmap_columns(qrt_index);
+
+		if (capacity > qrt_index_capacity) {
+			qrt_index_entries = hrealloc(qrt_index_entries,
+				capacity * sizeof qrt_index_entries[0]);
+			memset(&qrt_index_entries[qrt_index_capacity], 0,
+				(capacity - qrt_index_capacity) * sizeof qrt_index_entries[0]);
+			qrt_index_capacity = capacity;
+		}
+
+		g_assert(NULL == qrt_index_entries[col].node);
+
+		qrt_index_entries[col].node = n;
+		htable_insert(qrt_index_columns, n, size_to_pointer(col));
+	}
+
+	/*
+	 * Tables with less than 8 slots do not fill a byte: flag all the rows
+	 * unless the table is empty, the leaf QRT being checked anyway since it
+	 * is not exactly indexed.
+	 */
+
+	if (rt->slots >= 8) {
+		tbitmap_column_load(qrt_index, col, rt->arena, rt->slots / 8);
+	} else {
+		static const uint8 none = 0, all = 0xff;
+		tbitmap_column_load(qrt_index, col, rt->is_empty ? &none : &all, 1);
+	}
+}
+
+/**
+ * Remove leaf from the leaf QRT index, when its QRT is discarded or when
+ * the node is removed.
+ */
+void
+qrt_index_remove(struct gnutella_node *n)
+{
+	size_t col;
+
+	if (NULL == qrt_index)
+		return;
+
+	col = qrt_index_column(n);
+
+	if (TBITMAP_NONE == col)
+		return;
+
+	qrt_index_entries[col].node = NULL;
+	htable_remove(qrt_index_columns, n);
+	tbitmap_column_free(qrt_index, col);
+}
+
+/**
+ * Is the leaf QRT exactly represented in the leaf QRT index?
+ *
+ * When it is not, the index can only give us candidates, which need to
+ * be confirmed by the leaf QRT.
+ */
+static inline bool
+qrt_index_is_exact(const struct routing_table *rt)
+{
+	return rt->slots >= 8 && rt->bits <= QRT_INDEX_BITS;
+}
+
 /**
  * Handle reception of QRP RESET.
  *
@@ -4185,8 +4199,10 @@ qrt_handle_patch(
 		else
 			node_qrt_patched(n, rt);
 
-		if (NODE_IS_LEAF(n))
+		if (NODE_IS_LEAF(n)) {
+			qrt_index_install(n, rt);
 			qrp_leaf_changed();
+		}
 
 		if (qrp_debugging(4))
 			(void) qrt_dump(rt, GNET_PROPERTY(qrp_debug) > 19);
@@ -4339,6 +4355,11 @@ qrp_close(void)
 	if (merged_table)
 		qrt_unref(merged_table);
 
+	tbitmap_free_null(&qrt_index);
+	HFREE_NULL(qrt_index_entries);
+	htable_free_null(&qrt_index_columns);
+	qrt_index_capacity = 0;
+
 	HFREE_NULL(buffer.arena);
 }
 
@@ -4628,6 +4649,230 @@ qrp_node_can_route(const gnutella_node_t *n, const query_hashvec_t *qhv)
 	   rt->can_route(qhv, rt);
 }
 
+/**
+ * Compute the set of leaves whose QRT can route the query, using the leaf
+ * QRT index.
+ *
+ * As in qrp_can_route_default(), URNs are OR-ed and words AND-ed, and words
+ * are ignored when the query bears URNs.
+ *
+ * @return a column vector of tbitmap_words() items, to be freed by wfree().
+ */
+static uint64 *
+qrt_index_lookup(const query_hashvec_t *qhv)
+{
+	const struct query_hash *qh = qhv->vec;
+	uint64 *v;
+	uint i;
+
+	v = walloc(tbitmap_words(qrt_index) * sizeof v[0]);
+
+	if (qhv->has_urn) {
+		tbitmap_vec_clear(qrt_index, v);
+		/* URNs come first in the vector */
+		for (i = 0; i < qhv->count && QUERY_H_URN == qh[i].source; i++) {
+			tbitmap_vec_or(qrt_index, v,
+				qh[i].hashcode >> (32 - QRT_INDEX_BITS));
+		}
+	} else {
+		tbitmap_vec_fill(qrt_index, v);
+		for (i = 0; i < qhv->count; i++) {
+			if (
+				!tbitmap_vec_and(qrt_index, v,
+					qh[i].hashcode >> (32 - QRT_INDEX_BITS))
+			)
+				break;		/* No more leaves, no need to continue */
+		}
+	}
+
+	return v;
+}
+
+/**
+ * Check whether a node can be sent a query at all, regardless of its QRT.
+ */
+static inline ALWAYS_INLINE bool
+qrt_node_can_receive(const struct gnutella_node *dn, int hops,
+	const struct gnutella_node *source)
+{
+	if (!NODE_IS_WRITABLE(dn))
+		return FALSE;
+
+	if (hops >= dn->hops_flow)	/* Hops-flow prevents sending */
+		return FALSE;
+
+	if (dn == source)			/* Skip node that sent us the query */
+		return FALSE;
+
+	return TRUE;
+}
+
+/**
+ * Check whether a leaf must not be sent queries because of its GUID.
+ */
+static inline ALWAYS_INLINE bool
+qrt_leaf_is_rogue(const struct gnutella_node *dn)
+{
+	if (NODE_HAS_BAD_GUID(dn)) {
+		if (!NODE_USES_DUP_GUID(dn))
+			return TRUE;		/* Rogue node, probably */
+		if (NODE_IS_FIREWALLED(dn))
+			return TRUE;		/* Will not be able to PUSH to it */
+	}
+
+	return FALSE;
+}
+
+/**
+ * Check whether a query can be sent to the node.
+ *
+ * When ``indexed'' is TRUE, the node is a leaf that was selected through the
+ * leaf QRT index: the leaf QRT only needs to be checked when it is not
+ * exactly indexed.
+ *
+ * See qrt_build_query_target() for the meaning of the other parameters.
+ *
+ * @return whether the query can be sent to the node.
+ */
+static inline ALWAYS_INLINE bool
+qrt_node_is_target(struct gnutella_node *dn, const query_hashvec_t *qhvec,
+	int hops, int ttl, bool leaves, bool whats_new, bool sha1_query,
+	const struct gnutella_node *source, bool indexed)
+{
+	struct routing_table *rt = dn->recv_query_table;
+	bool is_leaf;
+
+	/*
+	 * Avoid G_UNLIKELY() hints here.  Either they are wrong hints
+	 * or they increase the code size and result in I-cache misses, but
+	 * profiling showed that these hints actually slow down this routine.
+	 *		--RAM, 2011-10-18
+	 */
+
+	if (!qrt_node_can_receive(dn, hops, source))
+		return FALSE;
+
+	/*
+	 * Look whether we can route the query to the peer (a leaf node or
+	 * a last-hop QRP capable ultra node).
+	 */
+
+	is_leaf = NODE_IS_LEAF(dn);
+
+	if (is_leaf) {
+		/* Leaf node */
+		if (!leaves) {
+			return FALSE;			/* Routing duplicate query, skip! */
+		} else if (whats_new) {
+			if (NODE_CAN_WHAT(dn)) {
+				if (NODE_HAS_EMPTY_QRT(dn))
+					return FALSE;	/* Leaf does not share, skip! */
+				goto can_send;		/* What's New? queries broadcasted */
+			} else {
+				return FALSE;		/* Leaf won't understand it, skip! */
+			}
+		}
+		if (rt == NULL)				/* No QRT yet */
+			return FALSE;			/* Don't send anything */
+		if (qrt_leaf_is_rogue(dn))
+			return FALSE;
+	} else {
+		/* Ultra node */
+		if (0 == ttl)				/* Exclude routing to other UPs */
+			return FALSE;
+		if (ttl > 1)				/* Only deal with last-hop UP */
+			goto can_send;			/* Send to other UP if ttl > 1 */
+		if (whats_new) {
+			if (NODE_CAN_WHAT(dn)) {
+				goto can_send;		/* Broadcast to that node */
+			} else {
+				return FALSE;		/* Skip node, would not be efficient */
+			}
+		}
+		if (rt == NULL)				/* UP has not sent us its table */
+			goto can_send;			/* Forward everything then */
+	}
+
+	node_inc_qrp_query(dn);		/* We have a QRT, mark we try routing */
+
+	if (
+		!(indexed && qrt_index_is_exact(rt)) &&
+		!(qhvec->has_urn ?
+		  rt->can_route_urn(qhvec, rt) :
+		  rt->can_route(qhvec, rt))
+	)
+		return FALSE;
+
+	if (!is_leaf)
+		goto can_send;			/* Avoid indentation of remaining code */
+
+	/*
+	 * If table for the leaf node is so full that we can't let all the
+	 * queries pass through, further restrict sending even though QRT says
+	 * we can let it go.
+	 *
+	 * We only do that when there are pending messages in the node's queue,
+	 * meaning we can't transmit all our packets fast enough.
+	 */
+
+	if (rt->pass_throw < 100 && NODE_MQUEUE_COUNT(dn) != 0) {
+		if ((int) random_value(99) >= rt->pass_throw)
+			return FALSE;
+	}
+
+	/*
+	 * If leaf is flow-controlled, it has trouble reading or we don't
+	 * have enough bandwidth to send everything.  If we were not skipping
+	 * it, the flow-control would cause the message queue to prioritize
+	 * the query in the queue, removing queries coming far away in favor
+	 * of closer ones (hops-wise).  But if we skip it alltogether, we loose
+	 * some potential for a match.
+	 *
+	 * Therefore, let only 50% of the queries pass to flow-controlled nodes.
+	 *
+	 * We don't let SHA1 queries through, as the chances they will match
+	 * are very slim: not all servents include the SHA1 in their QRP, and
+	 * there can be many hashing conflicts, so the fact that it matched
+	 * an entry in the QRP table does not imply there will be a match
+	 * in the leaf node.
+	 *		--RAM, 31/12/2003
+	 */
+
+	if (NODE_IN_TX_FLOW_CONTROL(dn)) {
+		if (sha1_query)
+			return FALSE;
+		if (random_value(255) >= 128)
+			return FALSE;
+	}
+
+	/*
+	 * OK, can send the query to that node.
+	 */
+
+can_send:
+
+	/*
+	 * Severely limit traffic to transient nodes since we're going
+	 * to shut them down soon anyway.  Send them something randomly
+	 * to limit easy spotting and account for the fact that the query
+	 * could be usefully relayed still (albeit it better have OOB
+	 * delivery).  The more spam they return, the less we send them.
+	 *		--RAM, 2011-11-24.
+	 */
+
+	if (NODE_IS_TRANSIENT(dn)) {
+		unsigned ratio;
+		ratio = uint_saturate_mult(dn->n_spam, 100) / (dn->received + 1);
+		if (random_value(99) < ratio)
+			return FALSE;
+	}
+
+	if (rt != NULL && !whats_new)
+		node_inc_qrp_match(dn);
+
+	return TRUE;
+}
+
 /**
  * Compute list of nodes to send the query to, based on node's QRT.
  * The query is identified by its list of QRP hashes, by its hop count, TTL
@@ -4682,152 +4927,81 @@ qrt_build_query_target(
 	sha1_query = qhvec_has_urn(qhvec);
 
 	/*
-	 * We need to special case processing of queries with TTL=1 so that they
-	 * get set to ultra peers that support last-hop QRP only if they can
-	 * provide a reply.  Ultrapeers that don't support last-hop QRP will
-	 * always get the query.
+	 * When routing to leaves, the leaf QRT index gives us the leaves whose
+	 * QRT can route the query, so we only need to look at these and at the
+	 * ultra nodes.  This is not possible when we have legacy connections,
+	 * which are not part of the ultra nodes, nor for "What's New?" queries,
+	 * which leaves get regardless of their QRT.
 	 */
 
-	for (sl = node_all_nodes(); sl; sl = g_slist_next(sl)) {
-		struct gnutella_node *dn = sl->data;
-		struct routing_table *rt = dn->recv_query_table;
-		bool is_leaf;
-
-		/*
-		 * Avoid G_UNLIKELY() hints in the loop.  Either they are wrong hints
-		 * or they increase the code size and result in I-cache misses, but
-		 * profiling showed that these hints actually slow down this routine.
-		 *		--RAM, 2011-10-18
-		 */
-
-		if (!NODE_IS_WRITABLE(dn))
-			continue;
+	if (
+		leaves && !whats_new && qrt_index != NULL &&
+		0 == GNET_PROPERTY(node_normal_count)
+	) {
+		uint64 *v = qrt_index_lookup(qhvec);
+		size_t col, next;
 
-		if (hops >= dn->hops_flow)	/* Hops-flow prevents sending */
-			continue;
+		for (sl = node_all_ultranodes(); sl; sl = g_slist_next(sl)) {
+			struct gnutella_node *dn = sl->data;
 
-		if (dn == source)			/* Skip node that sent us the query */
-			continue;
+			if (
+				qrt_node_is_target(dn, qhvec, hops, ttl, leaves, whats_new,
+					sha1_query, source, FALSE)
+			)
+				nodes = g_slist_prepend(nodes, dn);
+		}
 
 		/*
-		 * Look whether we can route the query to the peer (a leaf node or
-		 * a last-hop QRP capable ultra node).
+		 * Leaves whose QRT cannot route the query are not looked at any
+		 * further, but the query still counts in their QRP statistics when
+		 * qrt_node_is_target() would have tried to route it to them.
 		 */
 
-		is_leaf = NODE_IS_LEAF(dn);
-
-		if (is_leaf) {
-			/* Leaf node */
-			if (!leaves) {
-				continue;				/* Routing duplicate query, skip! */
-			} else if (whats_new) {
-				if (NODE_CAN_WHAT(dn)) {
-					if (NODE_HAS_EMPTY_QRT(dn))
-						continue;		/* Leaf does not share, skip! */
-					goto can_send;		/* What's New? queries broadcasted */
-				} else {
-					continue;			/* Leaf won't understand it, skip! */
-				}
-			}
-			if (rt == NULL)				/* No QRT yet */
-				continue;				/* Don't send anything */
-			if (NODE_HAS_BAD_GUID(dn)) {
-				if (!NODE_USES_DUP_GUID(dn))
-					continue;			/* Rogue node, probably */
-				if (NODE_IS_FIREWALLED(dn))
-					continue;			/* Will not be able to PUSH to it */
-			}
-		} else {
-			/* Ultra node */
-			if (0 == ttl)				/* Exclude routing to other UPs */
-				continue;
-			if (ttl > 1)				/* Only deal with last-hop UP */
-				goto can_send;			/* Send to other UP if ttl > 1 */
-			if (whats_new) {
-				if (NODE_CAN_WHAT(dn)) {
-					goto can_send;		/* Broadcast to that node */
-				} else {
-					continue;			/* Skip node, would not be efficient */
-				}
-			}
-			if (rt == NULL)				/* UP has not sent us its table */
-				goto can_send;			/* Forward everything then */
-		}
-
-		node_inc_qrp_query(dn);			/* We have a QRT, mark we try routing */
+		next = tbitmap_vec_next(qrt_index, v, 0);
 
-		if (!(qhvec->has_urn ?
-			  rt->can_route_urn(qhvec, rt) :
-			  rt->can_route(qhvec, rt)))
-			continue;
+		for (col = 0; col < qrt_index_capacity; col++) {
+			struct gnutella_node *dn = qrt_index_entries[col].node;
+			bool candidate = col == next;
 
-		if (!is_leaf)
-			goto can_send;			/* Avoid indentation of remaining code */
+			if (candidate)
+				next = tbitmap_vec_next(qrt_index, v, col + 1);
 
-		/*
-		 * If table for the leaf node is so full that we can't let all the
-		 * queries pass through, further restrict sending even though QRT says
-		 * we can let it go.
-		 *
-		 * We only do that when there are pending messages in the node's queue,
-		 * meaning we can't transmit all our packets fast enough.
-		 */
-
-		if (rt->pass_throw < 100 && NODE_MQUEUE_COUNT(dn) != 0) {
-			if ((int) random_value(99) >= rt->pass_throw)
+			if (NULL == dn)
 				continue;
-		}
 
-		/*
-		 * If leaf is flow-controlled, it has trouble reading or we don't
-		 * have enough bandwidth to send everything.  If we were not skipping
-		 * it, the flow-control would cause the message queue to prioritize
-		 * the query in the queue, removing queries coming far away in favor
-		 * of closer ones (hops-wise).  But if we skip it alltogether, we loose
-		 * some potential for a match.
-		 *
-		 * Therefore, let only 50% of the queries pass to flow-controlled nodes.
-		 *
-		 * We don't let SHA1 queries through, as the chances they will match
-		 * are very slim: not all servents include the SHA1 in their QRP, and
-		 * there can be many hashing conflicts, so the fact that it matched
-		 * an entry in the QRP table does not imply there will be a match
-		 * in the leaf node.
-		 *		--RAM, 31/12/2003
-		 */
-
-		if (NODE_IN_TX_FLOW_CONTROL(dn)) {
-			if (sha1_query)
-				continue;
-			if (random_value(255) >= 128)
-				continue;
+			if (candidate) {
+				if (
+					qrt_node_is_target(dn, qhvec, hops, ttl, leaves, whats_new,
+						sha1_query, source, TRUE)
+				)
+					nodes = g_slist_prepend(nodes, dn);
+			} else if (
+				qrt_node_can_receive(dn, hops, source) &&
+				!qrt_leaf_is_rogue(dn)
+			) {
+				node_inc_qrp_query(dn);
+			}
 		}
 
-		/*
-		 * OK, can send the query to that node.
-		 */
-
-	can_send:
+		wfree(v, tbitmap_words(qrt_index) * sizeof v[0]);
+		return nodes;
+	}
 
-		/*
-		 * Severely limit traffic to transient nodes since we're going
-		 * to shut them down soon anyway.  Send them something randomly
-		 * to limit easy spotting and account for the fact that the query
-		 * could be usefully relayed still (albeit it better have OOB
-		 * delivery).  The more spam they return, the less we send them.
-		 *		--RAM, 2011-11-24.
-		 */
+	/*
+	 * We need to special case processing of queries with TTL=1 so that they
+	 * get set to ultra peers that support last-hop QRP only if they can
+	 * provide a reply.  Ultrapeers that don't support last-hop QRP will
+	 * always get the query.
+	 */
 
-		if (NODE_IS_TRANSIENT(dn)) {
-			unsigned ratio;
-			ratio = uint_saturate_mult(dn->n_spam, 100) / (dn->received + 1);
-			if (random_value(99) < ratio)
-				continue;
-		}
+	for (sl = node_all_nodes(); sl; sl = g_slist_next(sl)) {
+		struct gnutella_node *dn = sl->data;
 
-		nodes = g_slist_prepend(nodes, dn);
-		if (rt != NULL && !whats_new)
-			node_inc_qrp_match(dn);
+		if (
+			qrt_node_is_target(dn, qhvec, hops, ttl, leaves, whats_new,
+				sha1_query, source, FALSE)
+		)
+			nodes = g_slist_prepend(nodes, dn);
 	}
 
 	return nodes;
@@ -57,6 +57,7 @@
 #include "lib/hset.h"
 #include "lib/htable.h"
 #include "lib/tm.h"
+#include "lib/tslab.h"
 #include "lib/walloc.h"
 
 #include "lib/override.h"	/* Must be the last header included */
@@ -97,24 +98,35 @@ routing_udp_node_check(const struct routing_udp_node * const un)
 /**
  * An entry in the routing table.
  *
- * Each entry is stored in the "message_array[]", to keep track of the
- * order used to create the routes, and in a hash table for quick lookup,
- * hashing being made based on the muid and the function.
+ * Entries are fixed-sized records held in a time-bucketed slab table, keyed
+ * by the muid and the function, which must therefore be the leading fields.
+ * The first MESSAGE_ROUTES routes are stored within the entry itself, which
+ * covers the vast majority of messages, further routes being stored in a
+ * separately allocated extension.
  *
  * Query hit routes and push routes are precious, therefore they are
- * moved to the tail of the "message_array[]" when they get used to increase
- * their liftime.
+ * moved to the current bucket when they get used to increase their lifetime.
  */
+#define MESSAGE_ROUTES		4	/**< Amount of routes held in the entry */
+
+struct message_extra {
+	struct route_data **routes;	/**< Routes beyond the first MESSAGE_ROUTES */
+	uint8 *ttls;				/**< TTL by route for these routes */
+	uint size;					/**< Allocated length of arrays */
+};
+
 struct message {
 	struct guid muid;			/**< Message UID */
-	struct message **slot;		/**< Place where we're referenced from */
-	GSList *routes;	            /**< route_data from where the message came */
-	GSList *ttls;				/**< For broadcasted messages: TTL by route */
 	uint8 function;				/**< Type of the message */
 	uint8 ttl;					/**< Max TTL we saw for this message */
-	uint8 chunk_idx;			/**< Index of chunk holding the slot */
+	uint8 count;				/**< Amount of routes recorded */
+	uint8 ttls[MESSAGE_ROUTES];	/**< For broadcasted messages: TTL by route */
+	struct route_data *routes[MESSAGE_ROUTES];	/**< Where message came from */
+	struct message_extra *extra;	/**< Additional routes, NULL if none */
 };
 
+#define MESSAGE_KEY_SIZE	offsetof(struct message, ttl)
+
 /**
  * We don't store a list of nodes in the message structure, but a list of
  * route_data: the reason is that nodes can go away, but we don't want to
@@ -151,34 +163,22 @@ static const char *debug_msg[256];
 /*
  * Routing table data structures.
  *
- * This is known as the "message_array[]".  It used to be a fixed-sized
- * array, but it is no more.  Instead, we use an array of chunks that
- * are dynamically allocated as needed.  The aim is to not cycle
- * back to the beginning of the table, loosing all the routing information
- * before at least TABLE_MIN_CYCLE seconds have elapsed or we have
- * allocated more than the amount of chunks we can tolerate.
- *
- * Each chunk contains pointers to dynamically allocated message entries,
- * each pointer being called a "slot" whilst the message structure is called
- * the "entry".
+ * This used to be known as the "message_array[]".  Messages are now held in
+ * a time-bucketed slab table: new entries are appended to the current bucket,
+ * and buckets are expired as a whole when the ring wraps around.  The aim is
+ * to not lose routing information before at least TABLE_MIN_CYCLE seconds
+ * have elapsed, unless the table uses more memory than configured by the
+ * "routing_table_max_memory" property, in which case the oldest bucket is
+ * discarded early.
  */
 
-#define CHUNK_BITS			14 	  /**< log2 of # messages stored  in a chunk */
-#define MAX_CHUNKS			64	  /**< Max # of chunks */
+#define TABLE_BUCKETS		8	  /**< Amount of time buckets */
 #define TABLE_MIN_CYCLE		3600  /**< 1 hour at least */
-
-#define CHUNK_MESSAGES		(1 << CHUNK_BITS)
-#define CHUNK_INDEX(x)		(((x) & ~(CHUNK_MESSAGES - 1)) >> CHUNK_BITS)
-#define ENTRY_INDEX(x)		((x) & (CHUNK_MESSAGES - 1))
+#define TABLE_PERIOD		(TABLE_MIN_CYCLE / (TABLE_BUCKETS - 1) + 1)
 
 static struct {
-	struct message **chunks[MAX_CHUNKS];
-	int next_idx;				 /**< Next slot to use in "message_array[]" */
-	int capacity;				 /**< Capacity in terms of messages */
-	int count;					 /**< Amount really stored */
-	unsigned nchunks;			 /**< Amount of allocated chunks */
-	hset_t *messages_hashed;	 /**< All messages (key = struct message) */
-	time_t last_rotation;		 /**< Last time we restarted from idx=0 */
+	tslab_t *messages;			 /**< All messages (key = muid + function) */
+	size_t maxmem;				 /**< Memory ceiling of the table, in bytes */
 } routing;
 
 /**
@@ -746,231 +746,55 @@ init_routing_data(struct gnutella_node *node)
 }
 
 /**
- * Make sure slot belongs to specified chunk index.
- */
-static void
-slot_check(struct message * const * const slot, unsigned chunk_idx)
-{
-	const void *chunk_base;
-	const void *chunk_end;
-
-	g_assert(uint_is_non_negative(chunk_idx));
-	g_assert(chunk_idx < MAX_CHUNKS);
-	g_assert(chunk_idx < routing.nchunks);
-
-	chunk_base = routing.chunks[chunk_idx];
-	chunk_end = const_ptr_add_offset(chunk_base, CHUNK_MESSAGES * sizeof *slot);
-
-	g_assert(ptr_cmp(slot, chunk_base) >= 0);
-	g_assert(ptr_cmp(slot, chunk_end) < 0);
-}
-
-/**
- * Asserts that a message entry is consistent and belongs to the correct chunk.
- */
-static void
-message_check(const struct message * const m, unsigned chunk_idx)
-{
-	g_assert(m != NULL);
-	slot_check(m->slot, chunk_idx);
-	g_assert(chunk_idx == m->chunk_idx);
-}
-
-/**
- * Clean already allocated entry.
+ * @return the i-th route of the message.
  */
-static void
-clean_entry(struct message *entry)
+static inline struct route_data *
+message_route(const struct message *m, uint i)
 {
-	g_assert(entry != NULL);
-
-	hset_remove(routing.messages_hashed, entry);
+	g_assert(i < m->count);
 
-	if (entry->routes != NULL)
-		free_route_list(entry);
-
-	g_assert(entry->ttls == NULL);		/* Cleaned by free_route_list() */
-	g_assert(entry->routes == NULL);	/* Idem */
-
-	entry->ttl = 0;
+	return i < MESSAGE_ROUTES ?
+		m->routes[i] : m->extra->routes[i - MESSAGE_ROUTES];
 }
 
 /**
- * Prepare entry, cleaning any old value we can find at the referenced slot.
- * We try to avoid re-allocating something if we can.
- *
- * @return message entry to use
+ * @return pointer to the TTL recorded for the i-th route of the message.
  */
-static struct message *
-prepare_entry(struct message **entryp, unsigned chunk_idx)
+static inline uint8 *
+message_route_ttl(struct message *m, uint i)
 {
-	struct message *entry = *entryp;
-
-	STATIC_ASSERT(MAX_CHUNKS <= MAX_INT_VAL(uint8));
-
-	g_assert(uint_is_non_negative(chunk_idx));
-	g_assert(chunk_idx < MAX_CHUNKS);
-	slot_check(entryp, chunk_idx);
-
-	if (entry == NULL) {
-		WALLOC0(entry);
-		*entryp = entry;
-		entry->slot = entryp;
-		entry->chunk_idx = chunk_idx;	/* 8-bit value, must fit */
-		routing.count++;
-		gnet_stats_inc_general(GNR_ROUTING_TABLE_COUNT);
-		goto done;
-	}
-
-	/*
-	 * We cycled over the table, remove the message at the slot we're
-	 * going to supersede.  We don't need to allocate anything, we'll
-	 * reuse the old structure, which will be rehashed after being updated.
-	 */
-
-	clean_entry(entry);
-
-	/*
-	 * Attempt to move the object around if it can help compacting.
-	 */
+	g_assert(i < m->count);
 
-	{
-		struct message *nentry = WMOVE(entry);
-
-		if (nentry != entry)
-			entry = *entryp = nentry;
-	}
-
-done:
-	g_assert(entryp == entry->slot);
-	message_check(entry, chunk_idx);
-
-	return entry;
+	return i < MESSAGE_ROUTES ?
+		&m->ttls[i] : &m->extra->ttls[i - MESSAGE_ROUTES];
 }
 
 /**
- * Attempt to reallocate an already allocated chunk to see if the VMM layer
- * can relocate a fragment.
- */
-static struct message **
-routing_chunk_move(struct message **chunk, unsigned chunk_idx)
-{
-	struct message **nchunk;
-	struct message **p;
-	unsigned i;
-
-	g_assert(chunk != NULL);
-	g_assert(uint_is_non_negative(chunk_idx));
-	g_assert(chunk_idx < MAX_CHUNKS);
-	g_assert(chunk == routing.chunks[chunk_idx]);
-
-	nchunk = hrealloc(chunk, CHUNK_MESSAGES * sizeof(struct message *));
-	if (nchunk == chunk)
-		return chunk;
-
-	/*
-	 * VMM layer chose to relocate the chunk, update all the entries.
-	 */
-
-	if (GNET_PROPERTY(routing_debug)) {
-		g_debug("RT moving chunk #%u from %p to %p",
-			chunk_idx, (void *) chunk, (void *) nchunk);
-	}
-
-	for (p = &nchunk[0], i = 0; i < CHUNK_MESSAGES; i++, p++) {
-		struct message *m = *p;
-
-		if (m != NULL) {
-			message_check(m, chunk_idx);
-			m->slot = p;
-		}
-	}
-
-	return routing.chunks[chunk_idx] = nchunk;
-}
-
-/**
- * Try to move the chunks we have, since the lowest indices
- * (which are going to be the more permanent chunks) will be
- * better hosted in the early VM space, freeing up the upper
- * VM space for more volatile data and possibly defragmenting.
- */
-static void
-routing_chunk_move_attempt(void)
-{
-	size_t i;
-
-	for (i = 0; i < routing.nchunks; i++) {
-		routing.chunks[i] = routing_chunk_move(routing.chunks[i], i);
-	}
-}
-
-/**
- * Advance slot index so that a call to get_next_slot() will return the
- * next available slot.
+ * Update the routing table statistics.
  */
 static void
-advance_slot(void)
+routing_update_stats(void)
 {
-	/*
-	 * It's OK to go beyond the last allocated chunk (a new chunk will
-	 * be allocated next time) unless we already reached the last chunk.
-	 */
+	tslab_info_t info;
 
-	routing.next_idx++;
+	tslab_info(routing.messages, &info);
 
-	if (CHUNK_INDEX(routing.next_idx) >= MAX_CHUNKS)
-		routing.next_idx = 0;		/* Will force cycling over next time */
+	gnet_stats_set_general(GNR_ROUTING_TABLE_CHUNKS, info.slabs);
+	gnet_stats_set_general(GNR_ROUTING_TABLE_CAPACITY, info.capacity);
+	gnet_stats_set_general(GNR_ROUTING_TABLE_COUNT, info.count);
 }
 
 /**
- * Clear routing table, starting with specified chunk index.
- *
- * @param idx	the index of the first chunk to clear
+ * Free routine callback for entries discarded from the routing table.
  */
 static void
-routing_clear(unsigned idx)
+routing_message_free(void *rec, void *unused_data)
 {
-	size_t i;
-
-	for (i = idx; i < routing.nchunks; i++) {
-		struct message **rchunk = routing.chunks[i];
-		size_t j;
-
-		if (GNET_PROPERTY(routing_debug)) {
-			g_debug("RT freeing chunk #%zu at %p, now holds %d / %d",
-				i, (void *) rchunk, routing.count, routing.capacity);
-		}
+	struct message *m = rec;
 
-		for (j = 0; j < CHUNK_MESSAGES; j++) {
-			struct message *m = rchunk[j];
+	(void) unused_data;
 
-			if (m != NULL) {
-				message_check(m, i);
-				g_assert(m->slot == &rchunk[j]);
-				clean_entry(m);
-				WFREE(m);
-				routing.count--;
-			}
-		}
-
-		routing.capacity -= CHUNK_MESSAGES;
-		HFREE_NULL(routing.chunks[i]);
-	}
-
-	routing.nchunks = idx;
-	gnet_stats_set_general(GNR_ROUTING_TABLE_CHUNKS, routing.nchunks);
-	gnet_stats_set_general(GNR_ROUTING_TABLE_CAPACITY, routing.capacity);
-	gnet_stats_set_general(GNR_ROUTING_TABLE_COUNT, routing.count);
-
-	g_assert(uint_is_non_negative(routing.nchunks));
-
-	/*
-	 * After freeing chunks, we may be able to move around some of the
-	 * remaining ones.
-	 */
-
-	routing_chunk_move_attempt();
+	free_route_list(m);
 }
 
 /**
@@ -980,202 +804,73 @@ void
 routing_clear_all(void)
 {
 	if (GNET_PROPERTY(routing_debug)) {
-		g_debug("RT clearing whole table (holds %d / %d)",
-			routing.capacity, routing.count);
+		g_debug("RT clearing whole table (holds %zu)",
+			tslab_count(routing.messages));
 	}
 
-	routing_clear(0);
-	routing.next_idx = 0;
-	routing.last_rotation = tm_time();
-	hset_clear(routing.messages_hashed);	/* Paranoid */
+	tslab_clear(routing.messages);
+	routing_update_stats();
 }
 
 /**
- * Fetch next routing table slot, a pointer to a routing entry.
- *
- * When `advance' is FALSE, the slot is allocated as usual but there is
- * no increment of the slot index for next time.  This allows trial allocation
- * to see where the message will be allocated.  If the slot is kept, the
- * caller must call advance_slot().
- *
- * When `advance' is TRUE, the slot is allocated and the slot index is
- * incremented immediately.
+ * Fetch new routing table entry to be able to store routing information.
  *
- * @param advance		whether to advance the slot index
- * @param cidx			if non-NULL, filled with the chunk index where slot is
+ * This can expire older entries, hence any entry previously obtained from
+ * the routing table must be considered as stale after this call.
  *
- * @return the address of the allocated slot.
+ * @return new entry for the message, with no route recorded.
  */
-static struct message **
-get_next_slot(bool advance, unsigned *cidx)
+static struct message *
+get_next_entry(const struct guid *muid, uint8 function)
 {
-	unsigned idx;
-	unsigned chunk_idx;
-	struct message **chunk;
-	struct message **slot = NULL;
-	time_t now = tm_time();
-	time_delta_t elapsed = delta_time(now, routing.last_rotation);
-
-	idx = routing.next_idx;
-	chunk_idx = CHUNK_INDEX(idx);
-
-	g_assert(UNSIGNED(chunk_idx) < MAX_CHUNKS);
-
-	chunk = routing.chunks[chunk_idx];
-
-	/*
-	 * If we get back here with a next index of zero and the chunk is
-	 * allocated, it means we've naturally cycled over.  There is nothing
-	 * to free up (or we would discard the whole table).
-	 */
-
-	if G_UNLIKELY(0 == idx && NULL != chunk) {
-		if (GNET_PROPERTY(routing_debug)) {
-			g_debug("RT cycled naturally over table, elapsed=%u, holds %d / %d",
-				(unsigned) elapsed, routing.count, routing.capacity);
-		}
-		routing.last_rotation = now;	/* Just cycled over */
-		elapsed = 0;
-	}
-
-	/*
-	 * If we've taken more than TABLE_MIN_CYCLE seconds since the last
-	 * rotation and reach the start of an allocated chunk, it means we
-	 * have more chunks than we need.  Discard all remaining chunks before
-	 * rotating.
-	 */
+	struct message key;
+	struct message *entry;
+	size_t maxmem;
+	tslab_info_t info;
+	size_t forced;
 
-	if G_UNLIKELY(elapsed > TABLE_MIN_CYCLE) {
-		/*
-		 * 0 != ENTRY_INDEX(idx): means we're not at the start of a chunk.
-		 * chunk == NULL: means we've reached an empty chunk, nothing to free.
-		 */
+	maxmem = GNET_PROPERTY(routing_table_max_memory) * (size_t) 1024 * 1024;
 
-		if G_UNLIKELY(chunk != NULL && 0 == ENTRY_INDEX(idx)) {
-			routing_clear(chunk_idx);
-			chunk = NULL;
-		}
+	if G_UNLIKELY(maxmem != routing.maxmem) {
+		routing.maxmem = maxmem;
+		tslab_set_maxmem(routing.messages, maxmem);
 	}
 
-	if (chunk == NULL) {
-
-		g_assert(idx >= UNSIGNED(routing.capacity));
-
-		/*
-		 * Chunk does not exist yet, determine whether we should create
-		 * it or recycle the table by going back to the start.
-		 */
-
-		if (idx > 0 && elapsed > TABLE_MIN_CYCLE) {
-			if (GNET_PROPERTY(routing_debug)) {
-				g_debug("RT cycling over table, elapsed=%u, holds %d / %d",
-					(unsigned) elapsed, routing.count, routing.capacity);
-			}
-
-			chunk_idx = 0;
-			idx = routing.next_idx = 0;
-			routing.last_rotation = now;
-			slot = routing.chunks[0];
-		} else {
-			/*
-			 * Allocate new chunk, expanding the capacity of the table.
-			 */
-
-			g_assert(idx == 0 || chunk_idx > 0);
-			g_assert(chunk_idx == routing.nchunks);
-
-			routing_chunk_move_attempt();		/* Compact before allocating */
-
-			routing.nchunks++;
-			routing.capacity += CHUNK_MESSAGES;
-			routing.chunks[chunk_idx] =
-				halloc0(CHUNK_MESSAGES * sizeof(struct message *));
-
-			gnet_stats_inc_general(GNR_ROUTING_TABLE_CHUNKS);
-			gnet_stats_count_general(GNR_ROUTING_TABLE_CAPACITY,
-				CHUNK_MESSAGES);
-
-			if (GNET_PROPERTY(routing_debug)) {
-				g_debug("RT created new chunk #%d at %p, now holds %d / %d",
-					chunk_idx, (void *) routing.chunks[chunk_idx],
-					routing.count, routing.capacity);
-			}
-
-			slot = routing.chunks[chunk_idx];	/* First slot in new chunk */
-		}
-	} else {
-		unsigned entry_idx = ENTRY_INDEX(idx);
-
-		/*
-		 * Each time we move to a new chunk, see whether we can move some
-		 * of the existing ones around to compact the VM space.
-		 */
+	tslab_info(routing.messages, &info);
+	forced = info.forced;
 
-		if (0 == entry_idx) {
-			routing_chunk_move_attempt();
-			chunk = routing.chunks[chunk_idx];	/* In case it moved */
-		}
+	key.muid = *muid;
+	key.function = function;
+	entry = tslab_insert(routing.messages, &key);
 
-		/*
-		 * If we went back to the first index without allocating a chunk,
-		 * it means we finally cycled over the table, in a forced way,
-		 * because we have already allocated the maximum amount of chunks.
-		 */
+	g_assert(0 == entry->count);
+	g_assert(NULL == entry->extra);
 
-		if (0 == idx && MAX_CHUNKS == routing.nchunks) {
-			if (GNET_PROPERTY(routing_debug)) {
-				g_warning("RT cycling over FORCED, elapsed=%u, holds %d / %d",
-					(unsigned) elapsed, routing.count, routing.capacity);
-			}
-			routing.last_rotation = now;
+	if (GNET_PROPERTY(routing_debug)) {
+		tslab_info(routing.messages, &info);
+		if G_UNLIKELY(info.forced != forced) {
+			g_warning("RT cycling over FORCED, holds %zu in %zu bytes",
+				info.count, info.memory);
 		}
-
-		slot = &chunk[entry_idx];
 	}
 
-	g_assert(slot != NULL);
-	g_assert(idx == UNSIGNED(routing.next_idx));
-	g_assert(idx < UNSIGNED(routing.capacity));
-	g_assert(routing.nchunks <= MAX_CHUNKS);
-
-	if (advance)
-		advance_slot();
-
-	if (cidx != NULL)
-		*cidx = chunk_idx;
-
-	slot_check(slot, chunk_idx);
-
-	return slot;
-}
-
-/**
- * Fetch next routing table entry to be able to store routing information.
- */
-static struct message *
-get_next_entry(void)
-{
-	struct message **slot;
-	unsigned chunk_idx;
+	routing_update_stats();
 
-	slot = get_next_slot(TRUE, &chunk_idx);
-	return prepare_entry(slot, chunk_idx);
+	return entry;
 }
 
 /**
  * When a precious route (for query hit or push) is used, revitalize the
- * entry by moving it to the end of the "message_array[]", thereby making
- * it unlikely that it expires soon.
+ * entry by moving it to the current bucket of the routing table, thereby
+ * making it unlikely that it expires soon.
+ *
+ * Contrary to get_next_entry(), this never expires any other entry.
  *
  * @return the new location of the revitalized entry
  */
-static void
+static struct message *
 revitalize_entry(struct message *entry, bool force)
 {
-	struct message **relocated;
-	struct message *prev;
-	unsigned chunk_idx;
-
 	/*
 	 * Leaves don't route anything, so we usually don't revitalize their
 	 * entries.  The only exception is when it makes use of the recorded
@@ -1183,58 +878,24 @@ revitalize_entry(struct message *entry, bool force)
 	 */
 
 	if (!force && settings_is_leaf())
-		return;
-
-	/*
-	 * Relocate at the end of the table, preventing early expiration.
-	 */
-
-	relocated = get_next_slot(FALSE, &chunk_idx);
-
-	/*
-	 * If slot is allocated in the same chunk, there's no need to revitalize
-	 * since entries in the same chunk will roughly have the same lifetime.
-	 */
-
-	if (chunk_idx == entry->chunk_idx)			/* Same chunk being used */
-		return;
-
-	/*
-	 * Clean and reclaim new slot content, if present.
-	 */
-
-	advance_slot();							/* Keeping the slot */
-	prev = *relocated;
-
-	if (prev != NULL) {
-		message_check(prev, chunk_idx);
-		g_assert(prev->slot == relocated);
-		clean_entry(prev);
-		WFREE(prev);
-		routing.count--;
-		gnet_stats_dec_general(GNR_ROUTING_TABLE_COUNT);
-	}
+		return entry;
 
 	/*
-	 * Move `entry' to this new slot.
+	 * Entries already in the current bucket are left where they are, since
+	 * they will roughly have the same lifetime as a relocated entry.
 	 */
 
-	*relocated = entry;
-	*(entry->slot) = NULL;					/* Old slot "freed" */
-	entry->slot = relocated;				/* Entry now at new slot */
-	entry->chunk_idx = chunk_idx;			/* Entry moved to new chunk */
-
-	message_check(entry, chunk_idx);
+	return tslab_refresh(routing.messages, entry);
 }
 
 /**
  * Did node send the message?
  */
 static bool
-route_node_sent_message(struct gnutella_node *n, struct message *m)
+route_node_sent_message(struct gnutella_node *n, const struct message *m)
 {
 	struct route_data *route;
-	GSList *sl;
+	uint i;
 
 	if (n == fake_node)
 		route = &fake_route;
@@ -1249,8 +910,8 @@ route_node_sent_message(struct gnutella_node *n, struct message *m)
 	if (route == NULL)
 		return FALSE;
 
-	for (sl = m->routes; sl; sl = g_slist_next(sl)) {
-		if (route == sl->data)
+	for (i = 0; i < m->count; i++) {
+		if (route == message_route(m, i))
 			return TRUE;
 	}
 
@@ -1268,30 +929,25 @@ route_node_sent_message(struct gnutella_node *n, struct message *m)
 static bool
 route_node_ttl_higher(struct gnutella_node *n, struct message *m, uint8 ttl)
 {
-	GSList *l;
-	int i;
+	uint i;
 	struct route_data *route;
 
 	g_assert(n != fake_node);
 	g_assert(
 		m->function == GTA_MSG_PUSH_REQUEST || m->function == GTA_MSG_SEARCH);
-	g_assert(m->ttls != NULL);
 
 	route = get_routing_data(n);
 
 	g_assert(route != NULL);
 
-	for (l = m->routes, i = 0; l; l = g_slist_next(l), i++) {
-		if (route == l->data) {
-			GSList *t = g_slist_nth(m->ttls, i);
-			uint8 old_ttl;
+	for (i = 0; i < m->count; i++) {
+		if (route == message_route(m, i)) {
+			uint8 *old_ttl = message_route_ttl(m, i);
 
-			g_assert(t != NULL);
-			old_ttl = GPOINTER_TO_INT(t->data);
-			if (old_ttl >= ttl)
+			if (*old_ttl >= ttl)
 				return FALSE;
 
-			t->data = GUINT_TO_POINTER((uint) ttl);
+			*old_ttl = ttl;
 			return TRUE;
 		}
 	}
@@ -1300,40 +956,6 @@ route_node_ttl_higher(struct gnutella_node *n, struct message *m, uint8 ttl)
 	return FALSE;
 }
 
-/**
- * compares two message structures
- */
-static int
-message_compare_func(const void *p, const void *q)
-{
-	const struct message *a = p, *b = q;
-
-	return a->function == b->function && guid_eq(&a->muid, &b->muid);
-}
-
-/**
- * Hashes message structures for storage in a hash table.
- */
-static uint
-message_hash_func(const void *key)
-{
-	const struct message *msg = key;
-
-	return integer_hash(msg->function) ^
-		universal_hash(&msg->muid, GUID_RAW_SIZE);
-}
-
-/**
- * Alternate hashing of message structures for storage in a hash table.
- */
-static uint
-message_hash_func2(const void *key)
-{
-	const struct message *msg = key;
-
-	return integer_hash2(msg->function) ^ guid_hash(&msg->muid);
-}
-
 /**
  * Reset this node's GUID.
  */
@@ -1432,9 +1054,11 @@ routing_init(void)
 	 * need to be deallocated
 	 */
 
-	routing.messages_hashed = hset_create_any(message_hash_func,
-		message_hash_func2, message_compare_func);
-	routing.last_rotation = tm_time();
+	routing.maxmem =
+		GNET_PROPERTY(routing_table_max_memory) * (size_t) 1024 * 1024;
+	routing.messages = tslab_make(sizeof(struct message), MESSAGE_KEY_SIZE,
+		TABLE_BUCKETS, TABLE_PERIOD, routing.maxmem,
+		routing_message_free, NULL);
 
 	/*
 	 * Push proxification and starving GUIDs.
@@ -1503,27 +1127,110 @@ remove_one_message_reference(struct route_data *rd)
 		g_assert(rd == &fake_route);
 }
 
+/**
+ * Free the additional routes of the message.
+ */
+static void
+message_extra_free(struct message *m)
+{
+	struct message_extra *me = m->extra;
+
+	wfree(me->routes, me->size * sizeof me->routes[0]);
+	wfree(me->ttls, me->size * sizeof me->ttls[0]);
+	WFREE(me);
+	m->extra = NULL;
+}
+
+/**
+ * Set the i-th route of the message.
+ */
+static void
+message_route_set(struct message *m, uint i, struct route_data *rd, uint8 ttl)
+{
+	g_assert(i < m->count);
+
+	if (i < MESSAGE_ROUTES) {
+		m->routes[i] = rd;
+		m->ttls[i] = ttl;
+	} else {
+		m->extra->routes[i - MESSAGE_ROUTES] = rd;
+		m->extra->ttls[i - MESSAGE_ROUTES] = ttl;
+	}
+}
+
+/**
+ * Append route to the message, along with the TTL the message had when
+ * received from that route.
+ */
+static void
+message_route_add(struct message *m, struct route_data *rd, uint8 ttl)
+{
+	if G_UNLIKELY(MAX_INT_VAL(uint8) == m->count)
+		return;		/* Plenty of routes already, ignore this one */
+
+	if (m->count >= MESSAGE_ROUTES) {
+		struct message_extra *me = m->extra;
+
+		if (NULL == me) {
+			WALLOC0(me);
+			m->extra = me;
+		}
+
+		if (m->count - MESSAGE_ROUTES >= me->size) {
+			uint n = 0 == me->size ? MESSAGE_ROUTES : 2 * me->size;
+
+			me->routes = wrealloc(me->routes,
+				me->size * sizeof me->routes[0], n * sizeof me->routes[0]);
+			me->ttls = wrealloc(me->ttls,
+				me->size * sizeof me->ttls[0], n * sizeof me->ttls[0]);
+			me->size = n;
+		}
+	}
+
+	m->count++;
+	message_route_set(m, m->count - 1, rd, ttl);
+	rd->saved_messages++;
+}
+
+/**
+ * Remove the i-th route of the message.
+ */
+static void
+message_route_remove(struct message *m, uint i)
+{
+	struct route_data *rd = message_route(m, i);
+	uint j;
+
+	for (j = i + 1; j < m->count; j++) {
+		message_route_set(m, j - 1,
+			message_route(m, j), *message_route_ttl(m, j));
+	}
+
+	m->count--;
+
+	if (m->extra != NULL && m->count <= MESSAGE_ROUTES)
+		message_extra_free(m);
+
+	remove_one_message_reference(rd);
+}
+
 /**
  * Dispose of route list in message.
  */
 static void
 free_route_list(struct message *m)
 {
-	GSList *sl;
+	uint i;
 
 	g_assert(m);
 
-	for (sl = m->routes; sl; sl = g_slist_next(sl))
-		remove_one_message_reference(sl->data);
+	for (i = 0; i < m->count; i++)
+		remove_one_message_reference(message_route(m, i));
 
-	gm_slist_free_null(&m->routes);
-
-	/*
-	 * If the message was a broadcasted one, we kept track of the TTL of
-	 * each message along the route.  This needs to be freed as well.
-	 */
+	m->count = 0;
 
-	gm_slist_free_null(&m->ttls);	/* Data are ints, nothing to free */
+	if (m->extra != NULL)
+		message_extra_free(m);
 }
 
 /**
@@ -1618,14 +1325,8 @@ message_add(const struct guid *muid, uint8 function,
 
 	if (found)			/* Dup message forwarded due to higher TTL */
 		entry = m;		/* Reuse existing entry */
-	else {
-		entry = get_next_entry();
-		g_assert(entry->routes == NULL);
-
-		/* fill in that storage space */
-		entry->muid = *muid;
-		entry->function = function;
-	}
+	else
+		entry = get_next_entry(muid, function);
 
 	g_assert(route != NULL);
 
@@ -1637,15 +1338,12 @@ message_add(const struct guid *muid, uint8 function,
 	 */
 
 	if (!found || !route_node_sent_message(node, m)) {
-		uint ttl;
-
-		route->saved_messages++;
-		entry->routes = g_slist_append(entry->routes, route);
+		uint8 ttl;
 
 		/*
-		 * If message is typically broadcasted, also record the TTL of
-		 * that route, since a node is allowed to resend us a message
-		 * if it comes with a higher TTL than previously seen.
+		 * Also record the TTL of that route: for typically broadcasted
+		 * messages, a node is allowed to resend us a message if it comes
+		 * with a higher TTL than previously seen.
 		 *		--RAM, 2005-10-02
 		 */
 
@@ -1653,12 +1351,7 @@ message_add(const struct guid *muid, uint8 function,
 				? GNET_PROPERTY(my_ttl)
 				: gnutella_header_get_ttl(&node->header);
 
-		switch (function) {
-		case GTA_MSG_PUSH_REQUEST:
-		case GTA_MSG_SEARCH:
-			entry->ttls = g_slist_append(entry->ttls, GUINT_TO_POINTER(ttl));
-			break;
-		}
+		message_route_add(entry, route, ttl);
 	}
 
 	if (found)
@@ -1672,9 +1365,6 @@ message_add(const struct guid *muid, uint8 function,
 		entry->ttl = gnutella_header_get_ttl(&node->header);
 	else
 		entry->ttl = GNET_PROPERTY(my_ttl);
-
-	/* insert the new message into the hash table */
-	hset_insert(routing.messages_hashed, entry);
 }
 
 /**
@@ -1684,30 +1374,13 @@ message_add(const struct guid *muid, uint8 function,
 static void
 purge_dangling_references(struct message *m)
 {
-	GSList *sl;
-	GSList *t;
+	uint i = 0;
 
-	for (sl = m->routes, t = m->ttls; sl; /* empty */) {
-		struct route_data *rd = sl->data;
-
-		if (rd->node == NULL) {
-			GSList *next = g_slist_next(sl);
-			m->routes = g_slist_remove_link(m->routes, sl);
-			remove_one_message_reference(rd);
-			g_slist_free_1(sl);
-			sl = next;
-
-			if (t) {
-				next = g_slist_next(t);
-				m->ttls = g_slist_remove_link(m->ttls, t);
-				g_slist_free_1(t);
-				t = next;
-			}
-		} else {
-			sl = g_slist_next(sl);
-			if (t)
-				t = g_slist_next(t);
-		}
+	while (i < m->count) {
+		if (NULL == message_route(m, i)->node)
+			message_route_remove(m, i);
+		else
+			i++;
 	}
 }
 
@@ -1723,9 +1396,8 @@ message_forget(const struct guid *muid, uint8 function, gnutella_node_t *node)
 {
 	bool found;
 	struct message *m;
-	GSList *sl;
-	GSList *t;
 	struct route_data *route;
+	uint i;
 
 	g_assert(muid != NULL);
 	node_check(node);
@@ -1737,18 +1409,9 @@ message_forget(const struct guid *muid, uint8 function, gnutella_node_t *node)
 	route = get_routing_data(node);
 	g_return_unless(route != NULL);
 
-	for (
-		sl = m->routes, t = m->ttls;
-		sl != NULL;
-		sl = g_slist_next(sl), t = g_slist_next(t)
-	) {
-		struct route_data *rd = sl->data;
-
-		if (route == rd) {
-			m->routes = g_slist_remove_link(m->routes, sl);
-			if (t != NULL)
-				m->ttls = g_slist_remove_link(m->ttls, t);
-			remove_one_message_reference(rd);
+	for (i = 0; i < m->count; i++) {
+		if (route == message_route(m, i)) {
+			message_route_remove(m, i);
 			break;
 		}
 	}
@@ -1758,22 +1421,22 @@ message_forget(const struct guid *muid, uint8 function, gnutella_node_t *node)
  * Look for a particular message in the routing tables.
  *
  * If none of the nodes that sent us the message are still present, then
- * m->routes will be NULL.
+ * m->count will be 0.
  *
  * @return TRUE if the message is found.
  */
 static bool
 find_message(const struct guid *muid, uint8 function, struct message **m)
 {
-	struct message dummy;
-	const void *orig_key;
+	struct message key;
+	struct message *msg;
 
-	dummy.muid = *muid;
-	dummy.function = function;
+	key.muid = *muid;
+	key.function = function;
 
-	if (hset_contains_extended(routing.messages_hashed, &dummy, &orig_key)) {
-		struct message *msg = deconstify_pointer(orig_key);
+	msg = tslab_lookup(routing.messages, &key);
 
+	if (msg != NULL) {
 		/* wipe out dead references to old nodes */
 		purge_dangling_references(msg);
 
@@ -1853,9 +1516,9 @@ check_hops_ttl(struct route_log *route_log, struct gnutella_node *sender)
  * The message is not physically sent yet, but the `dest' structure is filled
  * with proper routing information.
  *
- * `routes' is normally NULL unless we're forwarding a PUSH request.  In that
- * case, it must be sent to the whole list of routes we have, and `target' will
- * be NULL.
+ * `m' is normally NULL unless we're forwarding a PUSH request.  In that
+ * case, it must be sent to the whole list of routes we have for the message,
+ * and `target' will be NULL.
  *
  * @attention
  * NB: we're just *recording* routing information for the message into `dest',
@@ -1867,11 +1530,12 @@ static bool
 forward_message(
 	struct route_log *route_log,
 	struct gnutella_node **node,
-	struct gnutella_node *target, struct route_dest *dest, GSList *routes)
+	struct gnutella_node *target, struct route_dest *dest,
+	const struct message *m)
 {
 	struct gnutella_node *sender = *node;
 
-	g_assert(routes == NULL || target == NULL);
+	g_assert(m == NULL || target == NULL);
 	g_assert(settings_is_ultra());
 
 	/* Drop messages that would travel way too many nodes --RAM */
@@ -1923,19 +1587,19 @@ forward_message(
 	} else {
 		/*
 		 * Forward message to all others nodes, or the the ones specified
-		 * by the `routes' parameter if not NULL.
+		 * by the routes of `m' if not NULL.
 		 */
 
-		if (routes != NULL) {
-			GSList *l;
+		if (m != NULL) {
 			GSList *nodes = NULL;
 			int count = 0;
+			uint i;
 
 			g_assert(gnutella_header_get_function(&sender->header)
 					== GTA_MSG_PUSH_REQUEST);
 
-			for (l = routes; l; l = g_slist_next(l)) {
-				struct route_data *rd = l->data;
+			for (i = 0; i < m->count; i++) {
+				struct route_data *rd = message_route(m, i);
 				if (rd->node == sender)
 					continue;
 
@@ -2083,7 +1747,7 @@ handle_duplicate(struct route_log *route_log, gnutella_node_t **node,
 	 * each route.
 	 */
 
-	if (m->routes && route_node_sent_message(sender, m)) {
+	if (m->count != 0 && route_node_sent_message(sender, m)) {
 		bool higher_ttl;
 
 		/*
@@ -2151,7 +1815,7 @@ handle_duplicate(struct route_log *route_log, gnutella_node_t **node,
 				   guid_hex_str(gnutella_header_get_muid(&sender->header)));
 		}
 	} else {
-		if (m->routes == NULL) {
+		if (0 == m->count) {
 			routing_log_extra(route_log, "all routes lost");
 
 			if (GNET_PROPERTY(log_dup_gnutella_other_node)) {
@@ -2162,13 +1826,13 @@ handle_duplicate(struct route_log *route_log, gnutella_node_t **node,
 			}
 		} else {
 			if (GNET_PROPERTY(log_gnutella_routing)) {
-				unsigned count = g_slist_length(m->routes);
+				unsigned count = m->count;
 				routing_log_extra(route_log, "%u remaining route%s",
 					count, 1 == count ? "" : "s");
 			}
 
 			if (GNET_PROPERTY(log_dup_gnutella_other_node)) {
-				unsigned count = g_slist_length(m->routes);
+				unsigned count = m->count;
 				gmsg_log_split_duplicate(&sender->header, sender->data,
 					sender->size,
 					"from %s: %sother node, %u route%s (dups=%u)",
@@ -2331,7 +1995,7 @@ route_push(struct route_log *route_log,
 
 		forward_message(route_log, node, neighbour, dest, NULL);
 
-	} else if (find_message(guid, QUERY_HIT_ROUTE_SAVE, &m) && m->routes) {
+	} else if (find_message(guid, QUERY_HIT_ROUTE_SAVE, &m) && m->count != 0) {
 		gnet_stats_inc_general(GNR_PUSH_RELAYED_VIA_TABLE_ROUTE);
 
 		/*
@@ -2339,11 +2003,11 @@ route_push(struct route_log *route_log,
 		 * at least TABLE_MIN_CYCLE secs more after seeing this PUSH.
 		 */
 
-		revitalize_entry(m, FALSE);
-		forward_message(route_log, node, NULL, dest, m->routes);
+		m = revitalize_entry(m, FALSE);
+		forward_message(route_log, node, NULL, dest, m);
 
 	} else {
-		if (m && m->routes == NULL) {
+		if (m != NULL && 0 == m->count) {
 			routing_log_extra(route_log, "route to target GUID %s gone",
 				guid_hex_str(guid));
 			gnet_stats_count_dropped(sender, MSG_DROP_ROUTE_LOST);
@@ -2516,7 +2180,7 @@ route_query_hit(struct route_log *route_log,
 				message_add(origin_guid, QUERY_HIT_ROUTE_SAVE, sender);
 				route_starving_check(origin_guid);
 			}
-		} else if (m->routes == NULL || !route_node_sent_message(sender, m)) {
+		} else if (0 == m->count || !route_node_sent_message(sender, m)) {
 			struct route_data *route;
 
 			/*
@@ -2532,14 +2196,11 @@ route_query_hit(struct route_log *route_log,
 			g_assert(route != NULL);
 
 			/*
-			 * A query hit is not a broadcasted message, so there's
-			 * no recording of the TTLs at which we see it.
+			 * A query hit is not a broadcasted message, so the TTL at
+			 * which we see it along that route is irrelevant.
 			 */
 
-			g_assert(m->ttls == NULL);
-
-			m->routes = g_slist_append(m->routes, route);
-			route->saved_messages++;
+			message_route_add(m, route, 0);
 
 			/*
 			 * We just made use of this routing data: make it persist
@@ -2549,7 +2210,7 @@ route_query_hit(struct route_log *route_log,
 			 * query hit flow by.
 			 */
 
-			revitalize_entry(m, FALSE);
+			m = revitalize_entry(m, FALSE);
 		}
 	}
 
@@ -2581,18 +2242,18 @@ route_query_hit(struct route_log *route_log,
 	g_assert(m);		/* Or find_message() would have returned FALSE */
 
 	/*
-	 * Since this routing data is used, relocate it at the end of
-	 * the "message_array[]" to augment its lifetime.
+	 * Since this routing data is used, relocate it in the current bucket
+	 * of the routing table to augment its lifetime.
 	 */
 
-	revitalize_entry(m, FALSE);
+	m = revitalize_entry(m, FALSE);
 
 	/*
-	 * If `m->routes' is NULL, we have seen the request, but unfortunately
+	 * If `m->count' is 0, we have seen the request, but unfortunately
 	 * none of the nodes that sent us the request are connected any more.
 	 */
 
-	if (m->routes == NULL)
+	if (0 == m->count)
 		goto route_lost;
 
 	if (route_node_sent_message(fake_node, m)) {
@@ -2629,12 +2290,12 @@ route_query_hit(struct route_log *route_log,
 	 * XXX route for relaying. --RAM, 2004-08-29
 	 */
 	{
-		GSList *sl;
+		uint i;
 		bool skipped_transient = FALSE;
 
 		found = NULL;
-		for (sl = m->routes; sl; sl = g_slist_next(sl)) {
-			struct route_data *route = sl->data;
+		for (i = 0; i < m->count; i++) {
+			struct route_data *route = message_route(m, i);
 
 			g_assert(route);
 			g_assert(route->node);
@@ -2657,7 +2318,7 @@ route_query_hit(struct route_log *route_log,
 				 * will be logged as a message targeted to a transient node.
 				 */
 
-				if (NULL != g_slist_next(sl)) {
+				if (i + 1 < m->count) {
 					gnutella_node_t *rn;
 
 					rn = route_node_get_gnutella(route->node);
@@ -2916,7 +2577,7 @@ route_exists_for_reply(const struct guid *muid, uint8 function)
 {
 	struct message *m;
 
-	if (!find_message(muid, function & ~0x01, &m) || m->routes == NULL)
+	if (!find_message(muid, function & ~0x01, &m) || 0 == m->count)
 		return FALSE;
 
 	return TRUE;
@@ -2954,12 +2615,13 @@ route_towards_guid(const struct guid *guid)
 	if (node)
 		return g_slist_prepend(NULL, node);
 	
-	if (find_message(guid, QUERY_HIT_ROUTE_SAVE, &m) && m->routes) {
-		GSList *iter, *nodes = NULL;
+	if (find_message(guid, QUERY_HIT_ROUTE_SAVE, &m) && m->count != 0) {
+		GSList *nodes = NULL;
+		uint i;
 		
-		revitalize_entry(m, TRUE);
-		for (iter = m->routes; NULL != iter; iter = g_slist_next(iter)) {
-			struct route_data *rd = iter->data;
+		m = revitalize_entry(m, TRUE);
+		for (i = 0; i < m->count; i++) {
+			struct route_data *rd = message_route(m, i);
 			nodes = g_slist_prepend(nodes, rd->node);
 		}
 		return nodes;
@@ -3031,25 +2693,9 @@ routing_close(void)
 {
 	uint cnt;
 
-	g_assert(routing.messages_hashed != NULL);
+	g_assert(routing.messages != NULL);
 
-	hset_free_null(&routing.messages_hashed);
-
-	for (cnt = 0; cnt < MAX_CHUNKS; cnt++) {
-		struct message **chunk = routing.chunks[cnt];
-		if (chunk != NULL) {
-			int i;
-			for (i = 0; i < CHUNK_MESSAGES; i++) {
-				struct message *m = chunk[i];
-				if (m != NULL) {
-					message_check(m, cnt);
-					free_route_list(m);
-					WFREE(m);
-				}
-			}
-			HFREE_NULL(chunk);
-		}
-	}
+	tslab_free_null(&routing.messages);
 
 	hset_foreach(ht_banned_push, free_banned_push, NULL);
 	hset_free_null(&ht_banned_push);
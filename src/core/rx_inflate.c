@@ -42,6 +42,8 @@
 
 #include "lib/walloc.h"
 #include "lib/pmsg.h"
+#include "lib/workq.h"
+#include "lib/xmalloc.h"
 #include "lib/zlib_util.h"
 #include "lib/override.h"		/* Must be the last header included */
 
@@ -51,11 +53,58 @@
 struct attr {
 	const struct rx_inflate_cb *cb;	/**< Layer-specific callbacks */
 	z_streamp inz;					/**< Decompressing stream */
+	const void *dict;				/**< Preset dictionary, NULL if none */
+	size_t dict_len;				/**< Length of dictionary */
+	struct inflate_async *async;	/**< Offloading context, NULL if none */
 	int flags;
 };
 
 #define IF_ENABLED	0x00000001		/**< Reception enabled */
 
+/*
+ * When offloaded, each job is given INFLATE_JOB_BUFS RX buffers to fill.
+ * Should this not be enough, the worker inflates the remaining data in a
+ * private spill buffer, grown by INFLATE_JOB_SPILL bytes at least, which
+ * the main thread then copies to new RX buffers.
+ */
+#define INFLATE_JOB_BUFS	2
+#define INFLATE_JOB_SPILL	4096
+
+/*
+ * Context of a stream offloaded to a worker thread.
+ *
+ * Whilst jobs are in flight, the decompressing stream belongs to the worker.
+ * Since the layer can be destroyed at any time, the stream is released by
+ * the completion of the last job when jobs remain in flight.
+ */
+struct inflate_async {
+	z_streamp inz;					/**< Decompressing stream */
+	rxdrv_t *rx;					/**< Our layer, NULL once destroyed */
+	workq_t *wq;					/**< Work queue processing the stream */
+	uint key;						/**< Key pinning stream to its worker */
+	uint inflight;					/**< Jobs posted, not completed yet */
+	const void *dict;				/**< Preset dictionary, NULL if none */
+	size_t dict_len;				/**< Length of dictionary */
+};
+
+/*
+ * A decompression job, processed by the worker.
+ */
+struct inflate_job {
+	struct inflate_async *ia;		/**< Stream context */
+	pmsg_t *mb;						/**< Data to inflate */
+	const char *in;					/**< Start of data to inflate */
+	size_t inlen;					/**< Length of data to inflate */
+	pdata_t *db[INFLATE_JOB_BUFS];	/**< RX buffers to fill */
+	char *out[INFLATE_JOB_BUFS];	/**< Start of RX buffers */
+	size_t outsize[INFLATE_JOB_BUFS];	/**< Size of RX buffers */
+	size_t outlen[INFLATE_JOB_BUFS];	/**< Inflated data in RX buffers */
+	char *spill;					/**< Inflated data not fitting RX buffers */
+	size_t spill_len;				/**< Length of spilled data */
+	size_t spill_size;				/**< Size of spill buffer */
+	int ret;						/**< Status returned by zlib */
+};
+
 /**
  * Decompress more data from the input buffer `mb'.
  * @returns decompressed data in a new buffer, or NULL if no more data.
@@ -95,6 +144,18 @@ inflate_data(rxdrv_t *rx, pmsg_t *mb)
 
 	ret = inflate(inz, Z_SYNC_FLUSH);
 
+	/*
+	 * When a preset dictionary was negotiated, the stream header requests
+	 * it before any data can be inflated.  Should the stream refer to a
+	 * different dictionary, zlib will refuse ours.
+	 */
+
+	if (Z_NEED_DICT == ret && attr->dict != NULL) {
+		ret = inflateSetDictionary(inz, attr->dict, attr->dict_len);
+		if (Z_OK == ret)
+			ret = inflate(inz, Z_SYNC_FLUSH);
+	}
+
 	if (ret != Z_OK && ret != Z_STREAM_END) {
 		errno = EIO;
 		attr->cb->inflate_error(rx->owner, "Decompression failed: %s",
@@ -127,6 +188,229 @@ cleanup:
 	return NULL;
 }
 
+/***
+ *** Offloading to worker threads.
+ ***/
+
+/**
+ * Release stream context.
+ */
+static void
+inflate_async_free(struct inflate_async *ia)
+{
+	int ret;
+
+	g_assert(0 == ia->inflight);
+
+	ret = inflateEnd(ia->inz);
+	if (ret != Z_OK)
+		g_warning("while freeing offloaded decompressor: %s",
+			zlib_strerror(ret));
+
+	WFREE(ia->inz);
+	WFREE(ia);
+}
+
+/**
+ * Free decompression job, along with the RX buffers it still holds.
+ */
+static void
+inflate_job_free(struct inflate_job *ij)
+{
+	uint i;
+
+	for (i = 0; i < INFLATE_JOB_BUFS; i++) {
+		if (ij->db[i] != NULL)
+			rxbuf_free(ij->db[i]);
+	}
+
+	pmsg_free(ij->mb);
+	xfree(ij->spill);
+	WFREE(ij);
+}
+
+/**
+ * Process decompression job -- runs in the worker thread.
+ */
+static void
+inflate_job_run(void *arg)
+{
+	struct inflate_job *ij = arg;
+	struct inflate_async *ia = ij->ia;
+	z_streamp inz = ia->inz;
+	int ret = Z_OK;
+	uint i = 0;
+
+	inz->next_in = deconstify_pointer(ij->in);
+	inz->avail_in = ij->inlen;
+
+	while (0 != inz->avail_in && Z_OK == ret) {
+		char *start;
+		size_t size;
+
+		if (i < INFLATE_JOB_BUFS) {
+			start = ij->out[i];
+			size = ij->outsize[i];
+		} else {
+			if (ij->spill_len == ij->spill_size) {
+				ij->spill_size += MAX(ij->spill_size, INFLATE_JOB_SPILL);
+				ij->spill = xrealloc(ij->spill, ij->spill_size);
+			}
+			start = &ij->spill[ij->spill_len];
+			size = ij->spill_size - ij->spill_len;
+		}
+
+		inz->next_out = cast_to_pointer(start);
+		inz->avail_out = size;
+
+		ret = inflate(inz, Z_SYNC_FLUSH);
+
+		if (Z_NEED_DICT == ret && ia->dict != NULL) {
+			ret = inflateSetDictionary(inz, ia->dict, ia->dict_len);
+			if (Z_OK == ret)
+				ret = inflate(inz, Z_SYNC_FLUSH);
+		}
+
+		if (i < INFLATE_JOB_BUFS)
+			ij->outlen[i++] = size - inz->avail_out;
+		else
+			ij->spill_len += size - inz->avail_out;
+
+		/*
+		 * Room left in the output buffer means all the input was consumed.
+		 */
+
+		if (0 != inz->avail_out)
+			break;
+	}
+
+	ij->ret = ret;
+}
+
+/**
+ * Deliver inflated data held in RX buffer to the upper layer.
+ *
+ * @return FALSE if the upper layer reported an error.
+ */
+static bool
+inflate_deliver(rxdrv_t *rx, pdata_t *db, size_t len)
+{
+	struct attr *attr = rx->opaque;
+
+	if (attr->cb->add_rx_inflated != NULL)
+		attr->cb->add_rx_inflated(rx->owner, len);
+
+	return (*rx->data.ind)(rx, pmsg_alloc(PMSG_P_DATA, db, 0, len));
+}
+
+/**
+ * Completion of a decompression job -- runs in the main thread.
+ */
+static void
+inflate_job_done(void *arg)
+{
+	struct inflate_job *ij = arg;
+	struct inflate_async *ia = ij->ia;
+	rxdrv_t *rx = ia->rx;
+	struct attr *attr;
+	const char *p;
+	size_t len;
+	uint i;
+
+	g_assert(ia->inflight != 0);
+
+	ia->inflight--;
+
+	if (NULL == rx) {
+		inflate_job_free(ij);
+		if (0 == ia->inflight)
+			inflate_async_free(ia);
+		return;
+	}
+
+	attr = rx->opaque;
+
+	/*
+	 * Once reception is disabled, pending data are discarded, as the
+	 * synchronous processing would do.
+	 */
+
+	if (!(attr->flags & IF_ENABLED))
+		goto done;
+
+	if (ij->ret != Z_OK && ij->ret != Z_STREAM_END) {
+		errno = EIO;
+		attr->cb->inflate_error(rx->owner, "Decompression failed: %s",
+			zlib_strerror(ij->ret));
+		goto done;
+	}
+
+	/*
+	 * At any time, a packet we forward can cause the reception to be
+	 * disabled, in which case we must stop.
+	 */
+
+	for (i = 0; i < INFLATE_JOB_BUFS; i++) {
+		pdata_t *db = ij->db[i];
+
+		if (0 == ij->outlen[i])
+			break;
+
+		ij->db[i] = NULL;		/* Ownership transferred to message */
+
+		if (!inflate_deliver(rx, db, ij->outlen[i]))
+			goto done;
+
+		if (!(attr->flags & IF_ENABLED))
+			goto done;
+	}
+
+	for (p = ij->spill, len = ij->spill_len; len != 0; /* empty */) {
+		pdata_t *db = rxbuf_new();
+		size_t n = MIN(len, pdata_len(db));
+
+		memcpy(pdata_start(db), p, n);
+		p += n;
+		len -= n;
+
+		if (!inflate_deliver(rx, db, n))
+			break;
+
+		if (!(attr->flags & IF_ENABLED))
+			break;
+	}
+
+done:
+	inflate_job_free(ij);
+}
+
+/**
+ * Post decompression job to the worker.
+ */
+static void
+inflate_async_post(rxdrv_t *rx, pmsg_t *mb)
+{
+	struct attr *attr = rx->opaque;
+	struct inflate_async *ia = attr->async;
+	struct inflate_job *ij;
+	uint i;
+
+	WALLOC0(ij);
+	ij->ia = ia;
+	ij->mb = mb;
+	ij->in = pmsg_read_base(mb);
+	ij->inlen = pmsg_size(mb);
+
+	for (i = 0; i < INFLATE_JOB_BUFS; i++) {
+		ij->db[i] = rxbuf_new();
+		ij->out[i] = pdata_start(ij->db[i]);
+		ij->outsize[i] = pdata_len(ij->db[i]);
+	}
+
+	ia->inflight++;
+	workq_post(ia->wq, ia->key, inflate_job_run, inflate_job_done, ij);
+}
+
 /***
  *** Polymorphic routines.
  ***/
@@ -140,14 +424,24 @@ rx_inflate_init(rxdrv_t *rx, const void *args)
 	const struct rx_inflate_args *rargs = args;
 	struct attr *attr;
 	z_streamp inz;
+	workq_t *wq = NULL;
+	uint key = 0;
 	int ret;
 
 	rx_check(rx);
 	g_assert(rargs->cb != NULL);
 
+	/*
+	 * Streams offloaded to a worker thread must use a thread-safe allocator,
+	 * since inflate() allocates its window lazily.
+	 */
+
+	if (rargs->offload)
+		wq = zlib_offload(&key);
+
 	WALLOC(inz);
-	inz->zalloc = zlib_alloc_func;
-	inz->zfree = zlib_free_func;
+	inz->zalloc = NULL == wq ? zlib_alloc_func : zlib_xalloc_func;
+	inz->zfree = NULL == wq ? zlib_free_func : zlib_xfree_func;
 	inz->opaque = NULL;
 
 	ret = inflateInit(inz);
@@ -162,8 +456,23 @@ rx_inflate_init(rxdrv_t *rx, const void *args)
 	WALLOC(attr);
 	attr->cb = rargs->cb;
 	attr->inz = inz;
+	attr->dict = rargs->dict;
+	attr->dict_len = rargs->dict_len;
 	attr->flags = 0;
 
+	if (wq != NULL) {
+		struct inflate_async *ia;
+
+		WALLOC0(ia);
+		ia->inz = inz;
+		ia->rx = rx;
+		ia->wq = wq;
+		ia->key = key;
+		ia->dict = rargs->dict;
+		ia->dict_len = rargs->dict_len;
+		attr->async = ia;
+	}
+
 	rx->opaque = attr;
 
 	return rx;		/* OK */
@@ -180,12 +489,26 @@ rx_inflate_destroy(rxdrv_t *rx)
 
 	g_assert(attr->inz);
 
-	ret = inflateEnd(attr->inz);
-	if (ret != Z_OK)
-		g_warning("while freeing decompressor for peer %s: %s",
-			gnet_host_to_string(&rx->host), zlib_strerror(ret));
+	/*
+	 * When offloaded, the stream is released by the completion of the
+	 * last job still in flight, if any.
+	 */
+
+	if (attr->async != NULL) {
+		struct inflate_async *ia = attr->async;
+
+		ia->rx = NULL;
+		if (0 == ia->inflight)
+			inflate_async_free(ia);
+	} else {
+		ret = inflateEnd(attr->inz);
+		if (ret != Z_OK)
+			g_warning("while freeing decompressor for peer %s: %s",
+				gnet_host_to_string(&rx->host), zlib_strerror(ret));
+
+		WFREE(attr->inz);
+	}
 
-	WFREE(attr->inz);
 	WFREE(attr);
 }
 
@@ -202,6 +525,19 @@ rx_inflate_recv(rxdrv_t *rx, pmsg_t *mb)
 	rx_check(rx);
 	g_assert(mb);
 
+	/*
+	 * When offloaded, data will be delivered to the upper layer once
+	 * inflated, and errors are reported through the callbacks.
+	 */
+
+	if (attr->async != NULL) {
+		if ((attr->flags & IF_ENABLED) && 0 != pmsg_size(mb))
+			inflate_async_post(rx, mb);
+		else
+			pmsg_free(mb);
+		return TRUE;
+	}
+
 	/*
 	 * Decompress the stream, forwarding inflated data to the upper layer.
 	 * At any time, a packet we forward can cause the reception to be
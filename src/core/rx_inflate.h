@@ -54,6 +54,9 @@ struct rx_inflate_cb {
  */
 struct rx_inflate_args {
 	const struct rx_inflate_cb *cb;		/**< Callbacks */
+	const void *dict;					/**< Optional preset dictionary */
+	size_t dict_len;					/**< Length of dictionary */
+	bool offload;						/**< Whether a worker may inflate */
 };
 
 #endif	/* _core_rx_inflate_h_ */
@@ -68,10 +68,15 @@
  * timeout, to avoid undue TX activity because we're holding the ACK, yet it
  * must be large enough to make waiting worth it, i.e. get enough fragments
  * during the holding period.
+ *
+ * Delayed ACKs are nonetheless flushed as soon as enough of them are pending,
+ * or when a fragment is received out-of-order, because the sender relies on
+ * timely acknowledgments to pace its transmissions and detect losses.
  */
 
 #define RX_UT_EXPIRE_MS	(70*1000)	/* Expiration time for RX messages, in ms */
-#define RX_UT_DELAY_MS	500			/* ACK delay: 500 ms -- must be << 5 s */
+#define RX_UT_DELAY_MS	500			/* ACK delay: 500 ms -- must be < min RTO */
+#define RX_UT_ACK_BATCH	2			/* Flush delayed ACKs past that amount */
 
 #define RX_UT_DBG_MSG		(1U << 0)	/* Messages */
 #define RX_UT_DBG_FRAG		(1U << 1)	/* Fragments */
@@ -1317,6 +1322,21 @@ ut_got_message(const rxdrv_t *rx, const void *data, size_t len,
 
 	ut_handle_fragment(um, &head, mb);
 
+	/*
+	 * Now that the fragment has been accounted for, flush delayed ACKs if
+	 * we hold enough of them or if the fragment revealed that previous ones
+	 * are missing: the sender can then resend them without waiting.
+	 */
+
+	if (
+		um->acks_ev != NULL &&
+		(
+			um->acks_pending >= RX_UT_ACK_BATCH ||
+			bit_array_first_clear(um->fbits, 0, um->fragcnt - 1) < head.part
+		)
+	)
+		cq_expire(um->acks_ev);		/* Calls ut_delayed_ack() */
+
 done:
  	pmsg_free(mb);
 }
@@ -7890,7 +7890,7 @@ search_request(struct gnutella_node *n,
 			gnet_stats_count_general(GNR_LOCAL_WHATS_NEW_HITS, cnt);
 
 		} else if (!sri->skip_file_search) {
-			shared_files_match(search,
+			shared_files_match(search, sri->media_types,
 				got_match, qctx, max_replies, sri->partials, qhv);
 			qhv_filled = TRUE;		/* A side effect of st_search() */
 		}
@@ -62,6 +62,7 @@
 #include "if/gnet_property_priv.h"
 #include "if/bridge/c2ui.h"
 
+#include "lib/aging.h"
 #include "lib/ascii.h"
 #include "lib/atoms.h"
 #include "lib/bg.h"
@@ -76,6 +77,7 @@
 #include "lib/htable.h"
 #include "lib/listener.h"
 #include "lib/mime_type.h"
+#include "lib/random.h"
 #include "lib/str.h"
 #include "lib/tm.h"
 #include "lib/utf8.h"
@@ -113,6 +115,8 @@ struct shared_file {
 
 	enum mime_type mime_type;	/* MIME type of the file */
 
+	void *qhit_record[2];		/**< Cached query hit records (halloc) */
+
 	int refcnt;					/**< Reference count */
 	uint32 flags;				/**< See below for definition */
 };
@@ -163,6 +167,7 @@ static shared_file_t **sorted_file_table;	/* Sorted by name */
 
 static struct recursive_scan *recursive_scan_context;
 static bool share_rebuilding;
+static uint32 share_generation;		/* Changes when library content changes */
 
 /**
  * This hash table maps a SHA1 hash (base-32 encoded) onto the corresponding
@@ -351,6 +356,8 @@ shared_file_deindex(shared_file_t *sf)
 {
 	shared_file_check(sf);
 
+	share_generation++;		/* Invalidates cached query results */
+
 	if (SHARE_F_BASENAME & sf->flags) {
 		if (file_basenames != NULL) {
 			htable_remove(file_basenames, sf->name_nfc);
@@ -400,6 +407,18 @@ shared_file_deindex(shared_file_t *sf)
 	}
 }
 
+/**
+ * Discard the cached query hit records, after a metadata change.
+ */
+static void
+shared_file_qhit_invalidate(shared_file_t *sf)
+{
+	unsigned i;
+
+	for (i = 0; i < G_N_ELEMENTS(sf->qhit_record); i++)
+		HFREE_NULL(sf->qhit_record[i]);
+}
+
 /**
  * Dispose of a shared_file_t structure and nullify the pointer.
  */
@@ -415,6 +434,7 @@ shared_file_free(shared_file_t **sf_ptr)
 		if (sf->flags & SHARE_F_INDEXED)
 			shared_file_deindex(sf);
 
+		shared_file_qhit_invalidate(sf);
 		atom_sha1_free_null(&sf->sha1);
 		atom_tth_free_null(&sf->tth);
 		atom_str_free_null(&sf->relative_path);
@@ -548,8 +568,211 @@ done:
 	return sf;
 }
 
+/*
+ * Query result cache.
+ *
+ * Popular queries reach us many times per minute, from different leaves and
+ * neighbours.  Instead of matching them against the library each time, we
+ * remember the indices of the files matching a canonic query for a given
+ * set of media types, during QCACHE_LIFETIME seconds at most.
+ *
+ * Each entry records the library generation at the time it was created, and
+ * is ignored when the library content changed since then.
+ *
+ * Because st_search() starts its scan at a random place to return different
+ * files to repeated queries when there are more matches than requested, we
+ * record up to QCACHE_MAX_FILES matches and replay them from a random offset.
+ */
+
+#define QCACHE_LIFETIME		60		/**< Max lifetime of entries, in seconds */
+#define QCACHE_MAX_FILES	1024	/**< Max amount of matches recorded */
+
+struct qcache_key {
+	const char *query;			/**< Canonic query (atom) */
+	unsigned media_mask;		/**< Requested media types, 0 for any */
+};
+
+struct qcache_entry {
+	struct qcache_key key;		/**< The key, embedded */
+	uint32 generation;			/**< Library generation when entry created */
+	uint32 *indices;			/**< Indices of matching files */
+	uint count;					/**< Amount of indices */
+	uint size;					/**< Allocated length of indices[] */
+};
+
+static aging_table_t *qcache;
+
+static uint
+qcache_key_hash(const void *key)
+{
+	const struct qcache_key *k = key;
+
+	return string_mix_hash(k->query) ^ integer_hash(k->media_mask);
+}
+
+static bool
+qcache_key_eq(const void *a, const void *b)
+{
+	const struct qcache_key *ka = a, *kb = b;
+
+	return ka->media_mask == kb->media_mask && 0 == strcmp(ka->query, kb->query);
+}
+
+static void
+qcache_entry_free(struct qcache_entry *qe)
+{
+	atom_str_free_null(&qe->key.query);
+	HFREE_NULL(qe->indices);
+	WFREE(qe);
+}
+
+/**
+ * Free routine callback for the query cache aging table.
+ */
+static void
+qcache_kvfree(void *unused_key, void *value)
+{
+	(void) unused_key;
+	qcache_entry_free(value);
+}
+
+/**
+ * st_search() callback recording matches of the requested media types.
+ */
+static bool
+qcache_record(void *ctx, void *data)
+{
+	struct qcache_entry *qe = ctx;
+	const shared_file_t *sf = data;
+
+	if (
+		0 != qe->key.media_mask &&
+		!shared_file_has_media_type(sf, qe->key.media_mask)
+	)
+		return FALSE;
+
+	if (qe->count == qe->size) {
+		qe->size = MAX(16, 2 * qe->size);
+		qe->indices = hrealloc(qe->indices, qe->size * sizeof qe->indices[0]);
+	}
+
+	qe->indices[qe->count++] = sf->file_index;
+	return TRUE;
+}
+
+/**
+ * Replay cached matches, starting at a random offset.
+ *
+ * @return the amount of matches kept by the callback.
+ */
+static int
+qcache_replay(const struct qcache_entry *qe,
+	st_search_callback callback, void *user_data, int max_res)
+{
+	uint i, offset;
+	int n = 0;
+
+	if (0 == qe->count)
+		return 0;
+
+	offset = random_value(qe->count - 1);
+
+	for (i = 0; i < qe->count && n < max_res; i++) {
+		shared_file_t *sf = shared_file(qe->indices[(i + offset) % qe->count]);
+
+		if (NULL == sf || SHARE_REBUILDING == sf)
+			continue;
+
+		if (!shared_file_is_shareable(sf))
+			continue;
+
+		if ((*callback)(user_data, sf))
+			n++;
+	}
+
+	return n;
+}
+
+/**
+ * Match query against the library, using the query cache.
+ *
+ * @return the amount of matches kept by the callback.
+ */
+static int
+qcache_search(const char *query, unsigned media_mask,
+	st_search_callback callback, void *user_data,
+	int max_res, query_hashvec_t *qhv)
+{
+	struct qcache_key key;
+	struct qcache_entry *qe;
+	char *canonic;
+	int n;
+
+	canonic = UNICODE_CANONIZE(query);
+	key.query = canonic;
+	key.media_mask = media_mask;
+
+	qe = aging_lookup(qcache, &key);
+
+	if (qe != NULL && qe->generation != share_generation) {
+		aging_remove(qcache, &key);
+		qe = NULL;
+	}
+
+	if (qe != NULL) {
+		gnet_stats_inc_general(GNR_LOCAL_QUERY_CACHE_HITS);
+
+		/*
+		 * The query hash vector is a side effect of st_search(), which
+		 * we are not calling.
+		 */
+
+		if (qhv != NULL)
+			st_fill_qhv(query, qhv);
+
+		n = qcache_replay(qe, callback, user_data, max_res);
+	} else {
+		gnet_stats_inc_general(GNR_LOCAL_QUERY_CACHE_MISSES);
+
+		WALLOC0(qe);
+		qe->key.media_mask = media_mask;
+		qe->generation = share_generation;
+
+		(void) st_search(search_table, query, qcache_record, qe,
+			QCACHE_MAX_FILES, qhv);
+
+		n = qcache_replay(qe, callback, user_data, max_res);
+
+		if (aging_count(qcache) < GNET_PROPERTY(query_cache_entries)) {
+			qe->key.query = atom_str_get(canonic);
+			qe->indices = hrealloc(qe->indices,
+				qe->count * sizeof qe->indices[0]);
+			qe->size = qe->count;
+			aging_insert(qcache, &qe->key, qe);
+		} else {
+			qcache_entry_free(qe);
+		}
+	}
+
+	if (canonic != query)
+		HFREE_NULL(canonic);
+
+	return n;
+}
+
+/**
+ * Match query against the library, then the partial files if requested.
+ *
+ * @param query			the query string
+ * @param media_mask	requested media types, 0 for any (used for caching only)
+ * @param callback		invoked on each matching file
+ * @param user_data		additional callback argument
+ * @param max_res		maximum amount of matches to keep
+ * @param partials		whether to match partial files as well
+ * @param qhv			if non-NULL, filled with query hashes, for routing
+ */
 void
-shared_files_match(const char *query,
+shared_files_match(const char *query, unsigned media_mask,
 	st_search_callback callback, void *user_data,
 	int max_res, bool partials, query_hashvec_t *qhv)
 {
@@ -558,9 +781,17 @@ shared_files_match(const char *query,
 
 	/*
 	 * First search from the library.
+	 *
+	 * Unless the query cache is disabled or we're rebuilding the library,
+	 * in which case file indices are meaningless, use the cache.  It relies
+	 * on the callback to also filter on the requested media types.
 	 */
 
-	n = st_search(search_table, query, callback, user_data, max_res, qhv);
+	if (0 == GNET_PROPERTY(query_cache_entries) || NULL == file_table)
+		n = st_search(search_table, query, callback, user_data, max_res, qhv);
+	else
+		n = qcache_search(query, media_mask, callback, user_data, max_res, qhv);
+
 	gnet_stats_count_general(GNR_LOCAL_HITS, n);
 
 	remain = max_res - n;
@@ -1863,6 +2094,7 @@ recursive_scan_step_install_shared(struct bgtask *bt, void *data, int ticks)
 	}
 
 	share_free();
+	share_generation++;		/* Invalidates cached query results */
 
 	search_table = ctx->search_tb;
 	file_basenames = ctx->basenames;
@@ -2267,6 +2499,7 @@ share_close(void)
 	oob_close();			/* References hits, so needs ``sha1_to_share'' */
 	qhit_close();
 	st_free(&partial_table);
+	aging_destroy(&qcache);
 	htable_free_null(&share_media_types);
 	hset_free_null(&partial_files);
 	st_free(&partial_table);
@@ -2307,6 +2540,7 @@ shared_file_set_sha1(shared_file_t *sf, const struct sha1 *sha1)
 	}
 
 	atom_sha1_change(&sf->sha1, sha1);
+	shared_file_qhit_invalidate(sf);
 
 	/*
 	 * If the file is no longer in the index table, it must not be
@@ -2351,6 +2585,7 @@ shared_file_set_tth(shared_file_t *sf, const struct tth *tth)
 	g_assert(!shared_file_is_partial(sf));	/* Cannot be a partial file */
 
 	atom_tth_change(&sf->tth, tth);
+	shared_file_qhit_invalidate(sf);
 }
 
 void
@@ -2437,6 +2672,7 @@ sha1_hash_is_uptodate(shared_file_t *sf)
 		sf->flags |= SHARE_F_RECOMPUTING;
 		sf->mtime = buf.st_mtime;
 		sf->file_size = buf.st_size;
+		shared_file_qhit_invalidate(sf);
 		request_sha1(sf);
 		return FALSE;
 	}
@@ -2597,6 +2833,51 @@ shared_file_creation_time(const shared_file_t *sf)
 	return sf->ctime;
 }
 
+/**
+ * Get the cached query hit record of the shared file.
+ *
+ * The record is built and interpreted by the query hit layer, which keeps
+ * one version per encoding variant.  It is discarded whenever the metadata
+ * of the file change.
+ *
+ * @param sf		the shared file
+ * @param variant	the encoding variant (0 or 1)
+ *
+ * @return the cached record, NULL if none was recorded yet.
+ */
+const void *
+shared_file_qhit_record(const shared_file_t *sf, unsigned variant)
+{
+	shared_file_check(sf);
+	g_assert(variant < G_N_ELEMENTS(sf->qhit_record));
+
+	return sf->qhit_record[variant];
+}
+
+/**
+ * Cache the query hit record of the shared file.
+ *
+ * This is only a cache, which does not alter the logical state of the
+ * shared file, hence it can be set on a read-only shared file.
+ *
+ * @param sf		the shared file
+ * @param variant	the encoding variant (0 or 1)
+ * @param record	the halloc()'ed record, which is taken over
+ */
+void
+shared_file_set_qhit_record(const shared_file_t *sf, unsigned variant,
+	void *record)
+{
+	shared_file_t *wsf = deconstify_pointer(sf);
+
+	shared_file_check(sf);
+	g_assert(variant < G_N_ELEMENTS(sf->qhit_record));
+	g_assert(!shared_file_is_partial(sf));
+
+	HFREE_NULL(wsf->qhit_record[variant]);
+	wsf->qhit_record[variant] = record;
+}
+
 /**
  * @return available bytes (same as filesize, unless file is partial).
  */
@@ -3004,6 +3285,9 @@ share_init(void)
 	partial_files = hset_create(HASH_KEY_SELF, 0);
 	partial_table = st_create();
 
+	qcache = aging_make(QCACHE_LIFETIME,
+		qcache_key_hash, qcache_key_eq, qcache_kvfree);
+
 	/*
 	 * Create the hash table yielding the media type flags from a MIME type.
 	 */
@@ -106,6 +106,9 @@ void shared_file_set_sha1(shared_file_t *, const struct sha1 *sha1);
 void shared_file_set_tth(shared_file_t *, const struct tth *tth);
 void shared_file_set_modification_time(shared_file_t *sf, time_t mtime);
 void shared_file_set_path(shared_file_t *sf, const char *pathname);
+const void *shared_file_qhit_record(const shared_file_t *sf, unsigned variant);
+void shared_file_set_qhit_record(const shared_file_t *sf, unsigned variant,
+	void *record);
 
 void shared_file_check(const shared_file_t *sf);
 bool sha1_hash_available(const shared_file_t *sf) G_GNUC_PURE;
@@ -137,7 +140,7 @@ void share_add_partial(const shared_file_t *sf);
 void share_remove_partial(const shared_file_t *sf);
 void share_update_matching_information(void);
 
-void shared_files_match(const char *query,
+void shared_files_match(const char *query, unsigned media_mask,
 		st_search_callback callback, void *user_data,
 		int max_res, bool partials, struct query_hashvec *qhv);
 
@@ -46,9 +46,12 @@
 
 #include "lib/cq.h"
 #include "lib/endian.h"
+#include "lib/iovec.h"
 #include "lib/mempcpy.h"
 #include "lib/tm.h"
 #include "lib/walloc.h"
+#include "lib/workq.h"
+#include "lib/xmalloc.h"
 #include "lib/zlib_util.h"
 
 #include "lib/override.h"		/* Must be the last header included */
@@ -69,6 +72,24 @@
 #define BUFFER_NAGLE	500		/**< 500 ms */
 #define BUFFER_DELAY	2		/**< 2 secs -- max Nagle delay */
 
+/*
+ * The compression level is adapted every DEFLATE_ADAPT_EPOCHS flushes, when
+ * adaptation is enabled.  A link whose compression costs more than
+ * DEFLATE_COST_HIGH usecs per KiB of input is deemed expensive.  Changing
+ * the level may emit a few bytes, hence we require DEFLATE_LEVEL_ROOM bytes
+ * of room in the fill buffer to do so.
+ */
+#define DEFLATE_ADAPT_EPOCHS	4
+#define DEFLATE_COST_HIGH		100.0	/**< usecs per KiB */
+#define DEFLATE_LEVEL_ROOM		64
+
+/*
+ * When the stream is offloaded to a worker thread, the output of each job
+ * is first produced in a private buffer, initially sized to the input plus
+ * DEFLATE_JOB_ROOM bytes, then moved into our buffers by the main thread.
+ */
+#define DEFLATE_JOB_ROOM		1024
+
 struct buffer {
 	char *arena;				/**< Buffer arena */
 	char *end;					/**< First byte outside buffer */
@@ -93,6 +114,12 @@ struct attr {
 	size_t flushed;				/**< Amount of output bytes since last flush */
 	size_t total_input;			/**< Total amount of input bytes flushed */
 	size_t total_output;		/**< Total amount of output bytes flushed */
+	double elapsed;				/**< Time spent deflating since last flush */
+	double cost_ema;			/**< EMA of deflating cost, usecs per KiB */
+	int level;					/**< Current compression level */
+	int max_level;				/**< Compression level we started with */
+	uint epochs;				/**< Flushes since last level decision */
+	uint changes;				/**< Amount of compression level changes */
 	int flags;					/**< Operating flags */
 	cqueue_t *cq;				/**< The callout queue to use for Nagle */
 	cevent_t *tm_ev;			/**< The timer event */
@@ -105,9 +132,50 @@ struct attr {
 		uint32		size;		/**< Payload size counter for gzip */
 		uLong		crc;		/**< CRC-32 accumlator for gzip */
 	} gzip;
+	struct deflate_async *async;	/**< Offloading context, NULL if none */
 	unsigned nagle:1;			/**< Whether to use Nagle or not */
 };
 
+/*
+ * Context of a stream offloaded to a worker thread.
+ *
+ * Whilst jobs are in flight, the compressing stream belongs to the worker.
+ * Since the layer can be destroyed at any time, the stream is released by
+ * the completion of the last job when jobs remain in flight.
+ */
+struct deflate_async {
+	z_streamp outz;				/**< Compressing stream */
+	txdrv_t *tx;				/**< Our layer, NULL once destroyed */
+	workq_t *wq;				/**< Work queue processing the stream */
+	uint key;					/**< Key pinning stream to its worker */
+	uint inflight;				/**< Jobs posted, not completed yet */
+	size_t queued;				/**< Input bytes posted, not completed yet */
+	size_t posted;				/**< Input bytes posted since last flush */
+	size_t backlog;				/**< Output bytes not moved to our buffers */
+	struct deflate_job *head;	/**< Oldest completed job, if any */
+	struct deflate_job *tail;	/**< Youngest completed job */
+};
+
+/*
+ * A compression job, processed by the worker.
+ */
+struct deflate_job {
+	struct deflate_async *da;	/**< Stream context */
+	struct deflate_job *next;	/**< Next completed job */
+	char *in;					/**< Data to compress */
+	char *out;					/**< Compressed data */
+	size_t inlen;				/**< Length of input */
+	size_t outlen;				/**< Length of output */
+	size_t outsize;				/**< Size of output buffer */
+	size_t outpos;				/**< Output already moved to our buffers */
+	double elapsed;				/**< Time spent deflating */
+	int flush;					/**< Flushing mode for deflate() */
+	int level;					/**< Compression level to set, 0 if none */
+	int old_level;				/**< Previous compression level */
+	int ret;					/**< Status returned by zlib */
+	bool send;					/**< Whether to send data once flushed */
+};
+
 /*
  * Operating flags.
  */
@@ -116,9 +184,12 @@ struct attr {
 #define DF_NAGLE		0x00000002	/**< Nagle timer started */
 #define DF_FLUSH		0x00000004	/**< Flushing started */
 #define DF_SHUTDOWN		0x00000008	/**< Stack has shut down */
+#define DF_FINISH		0x00000010	/**< Final flush posted to worker */
 
 static void deflate_nagle_timeout(cqueue_t *cq, void *arg);
 static size_t tx_deflate_pending(txdrv_t *tx);
+static void deflate_async_flush(txdrv_t *tx, bool send);
+static void deflate_async_post(txdrv_t *tx, struct deflate_job *dj);
 
 #define tx_deflate_debugging(lvl) \
 	G_UNLIKELY(GNET_PROPERTY(tx_deflate_debug) > (lvl) && \
@@ -288,6 +359,37 @@ deflate_rotate_and_send(txdrv_t *tx)
 	deflate_send(tx);
 }
 
+/**
+ * Send the "filling buffer" if it holds data and no send is pending.
+ */
+static void
+deflate_send_pending(txdrv_t *tx)
+{
+	struct attr *attr = tx->opaque;
+
+	if (-1 == attr->send_idx) {			/* No write pending */
+		struct buffer *b = &attr->buf[attr->fill_idx];
+
+		if (b->rptr != b->wptr)			/* Something to send */
+			deflate_rotate_and_send(tx);
+	}
+}
+
+/**
+ * Invoke the closing callback, once.
+ */
+static void
+deflate_closed(txdrv_t *tx)
+{
+	struct attr *attr = tx->opaque;
+	tx_closed_t cb = attr->closed;
+
+	if (cb != NULL) {
+		attr->closed = NULL;
+		(*cb)(tx, attr->closed_arg);
+	}
+}
+
 /**
  * Compute amount of buffered output data awaiting to be sent.
  */
@@ -343,6 +445,7 @@ deflate_flushed(txdrv_t *tx)
 {
 	struct attr *attr = tx->opaque;
 	double flush = 0.0;
+	double cost = 0.0;
 
 	g_assert(size_is_non_negative(attr->unflushed));
 
@@ -361,20 +464,170 @@ deflate_flushed(txdrv_t *tx)
 
 		flush = 1.0 - ((double) attr->flushed / attr->unflushed);
 		attr->ratio_ema += (flush / 2.0) - (attr->ratio_ema / 2.0);
+
+		/*
+		 * Same smoothing for the CPU cost of compression, measured on all
+		 * the deflate() calls made since the last flush.
+		 */
+
+		cost = attr->elapsed * 1e6 / (attr->unflushed / 1024.0);
+		attr->cost_ema += (cost / 2.0) - (attr->cost_ema / 2.0);
 	}
 
 	if (tx_deflate_debugging(4)) {
 		g_debug("TX %s: (%s) deflated %zu bytes into %zu "
-			"(%.2f%%, EMA=%.2f%%, overall %.2f%%)",
+			"(%.2f%%, EMA=%.2f%%, overall %.2f%%, level %d, %.1f us/KiB)",
 			G_STRFUNC, gnet_host_to_string(&tx->host),
 			attr->unflushed, attr->flushed,
-			100 * flush, 100 * attr->ratio_ema, 100 * attr->ratio);
+			100 * flush, 100 * attr->ratio_ema, 100 * attr->ratio,
+			attr->level, cost);
 	}
 
 	attr->unflushed = attr->flushed = 0;
+	attr->elapsed = 0.0;
 	attr->flags &= ~DF_FLUSH;
 }
 
+/**
+ * Change the compression level of the stream.
+ *
+ * This must be done right after a flush, when there are no pending input
+ * bytes, so that the parameter change does not force a new block on data
+ * still being compressed.
+ *
+ * @return TRUE if the level was changed.
+ */
+static bool
+deflate_set_level(txdrv_t *tx, int level)
+{
+	struct attr *attr = tx->opaque;
+	z_streamp outz = attr->outz;
+	struct buffer *b = &attr->buf[attr->fill_idx];	/* Buffer we fill */
+	int old_avail;
+	int ret;
+
+	g_assert(level >= Z_BEST_SPEED && level <= Z_BEST_COMPRESSION);
+
+	/*
+	 * When offloaded, the change is done by the worker, in sequence with
+	 * the data to compress.  Should it fail, we'll revert to the old level
+	 * when the job completes.
+	 */
+
+	if (attr->async != NULL) {
+		struct deflate_job *dj;
+
+		WALLOC0(dj);
+		dj->flush = Z_NO_FLUSH;
+		dj->level = level;
+		dj->old_level = attr->level;
+		deflate_async_post(tx, dj);
+
+		if (tx_deflate_debugging(1)) {
+			g_debug("TX %s: (%s) compression level %d -> %d "
+				"(ratio EMA=%.2f%%, %.1f us/KiB, offloaded)",
+				G_STRFUNC, gnet_host_to_string(&tx->host),
+				attr->level, level, 100 * attr->ratio_ema, attr->cost_ema);
+		}
+
+		attr->level = level;
+		return TRUE;
+	}
+
+	old_avail = b->end - b->wptr;
+
+	if (old_avail < DEFLATE_LEVEL_ROOM)
+		return FALSE;				/* Will retry at next decision */
+
+	outz->next_out = cast_to_pointer(b->wptr);
+	outz->avail_out = old_avail;
+	outz->avail_in = 0;
+
+	ret = deflateParams(outz, level, Z_DEFAULT_STRATEGY);
+
+	if (Z_OK != ret) {
+		if (tx_deflate_debugging(0)) {
+			g_debug("TX %s: (%s) cannot switch to level %d: %s",
+				G_STRFUNC, gnet_host_to_string(&tx->host), level,
+				zlib_strerror(ret));
+		}
+		return FALSE;
+	}
+
+	/*
+	 * Account for any data emitted whilst switching parameters.
+	 */
+
+	{
+		size_t written = old_avail - outz->avail_out;
+
+		b->wptr += written;
+		attr->flushed += written;
+
+		if (written != 0 && NULL != attr->cb->add_tx_deflated)
+			attr->cb->add_tx_deflated(tx->owner, written);
+	}
+
+	if (tx_deflate_debugging(1)) {
+		g_debug("TX %s: (%s) compression level %d -> %d "
+			"(ratio EMA=%.2f%%, %.1f us/KiB)",
+			G_STRFUNC, gnet_host_to_string(&tx->host),
+			attr->level, level, 100 * attr->ratio_ema, attr->cost_ema);
+	}
+
+	attr->level = level;
+	attr->changes++;
+
+	return TRUE;
+}
+
+/**
+ * Adapt the compression level of the link.
+ *
+ * When the node is CPU-bound, we trade compression ratio for CPU by lowering
+ * the level, unless the link lacks bandwidth (saturated scheduler or backlog
+ * in the message queue), in which case only links whose compression cost is
+ * high are stepped down.  When bandwidth is scarce and CPU is not, or when
+ * nothing is scarce, we go back up towards the initial level.
+ */
+static void
+deflate_adapt(txdrv_t *tx)
+{
+	struct attr *attr = tx->opaque;
+	int level = attr->level;
+
+	if (tx->flags & TX_CLOSING)
+		return;
+
+	if (!GNET_PROPERTY(deflate_adaptive_level)) {
+		level = attr->max_level;
+	} else {
+		bool cpu_bound, congested;
+
+		if (++attr->epochs < DEFLATE_ADAPT_EPOCHS)
+			return;
+
+		attr->epochs = 0;
+		cpu_bound = GNET_PROPERTY(overloaded_cpu);
+		congested = NULL != attr->cb->congested &&
+			(*attr->cb->congested)(tx->owner);
+
+		if (!cpu_bound) {
+			level++;
+		} else if (!congested) {
+			level -= attr->cost_ema > DEFLATE_COST_HIGH ? 2 : 1;
+		} else if (attr->cost_ema > DEFLATE_COST_HIGH) {
+			level--;
+		}
+
+		level = MAX(level, Z_BEST_SPEED);
+		level = MIN(level, attr->max_level);
+	}
+
+	if (level != attr->level)
+		deflate_set_level(tx, level);
+}
+
 /**
  * Flush compression within filling buffer.
  *
@@ -386,9 +639,15 @@ deflate_flush(txdrv_t *tx)
 	struct attr *attr = tx->opaque;
 	z_streamp outz = attr->outz;
 	struct buffer *b;
+	tm_t start, end;
 	int ret;
 	int old_avail;
 
+	if (attr->async != NULL) {
+		deflate_async_flush(tx, FALSE);
+		return TRUE;
+	}
+
 retry:
 	b = &attr->buf[attr->fill_idx];	/* Buffer we fill */
 
@@ -416,7 +675,10 @@ retry:
 
 	g_assert(outz->avail_out > 0);
 
+	tm_now_exact(&start);
 	ret = deflate(outz, (tx->flags & TX_CLOSING) ? Z_FINISH : Z_SYNC_FLUSH);
+	tm_now_exact(&end);
+	attr->elapsed += tm_elapsed_f(&end, &start);
 
 	switch (ret) {
 	case Z_BUF_ERROR:				/* Nothing to flush */
@@ -469,6 +731,7 @@ retry:
 
 done:
 	deflate_flushed(tx);
+	deflate_adapt(tx);
 
 	return TRUE;		/* Fully flushed */
 }
@@ -486,16 +749,17 @@ deflate_flush_send(txdrv_t *tx)
 	 * deflate_rotate_and_send() and finish the flush.  But it is possible
 	 * that the whole send buffer does not get sent immediately.  Therefore,
 	 * we need to recheck for attr->send_idx.
+	 *
+	 * When offloaded, sending will happen once the flush is completed.
 	 */
 
-	if (deflate_flush(tx)) {
-		if (-1 == attr->send_idx) {			/* No write pending */
-			struct buffer *b = &attr->buf[attr->fill_idx];
-
-			if (b->rptr != b->wptr)			/* Something to send */
-				deflate_rotate_and_send(tx);
-		}
+	if (attr->async != NULL) {
+		deflate_async_flush(tx, TRUE);
+		return;
 	}
+
+	if (deflate_flush(tx))
+		deflate_send_pending(tx);
 }
 
 /**
@@ -569,6 +833,7 @@ deflate_add(txdrv_t *tx, const void *data, int len)
 		bool flush_started = (attr->flags & DF_FLUSH) ? TRUE : FALSE;
 		int old_avail;
 		const char *in, *old_in;
+		tm_t start, end;
 
 		/*
 		 * Prepare call to deflate().
@@ -592,7 +857,10 @@ deflate_add(txdrv_t *tx, const void *data, int len)
 		 * that we have more room available for the output.
 		 */
 
+		tm_now_exact(&start);
 		ret = deflate(outz, flush_started ? Z_SYNC_FLUSH : 0);
+		tm_now_exact(&end);
+		attr->elapsed += tm_elapsed_f(&end, &start);
 
 		if (Z_OK != ret) {
 			attr->flags |= DF_SHUTDOWN;
@@ -691,6 +959,388 @@ deflate_add(txdrv_t *tx, const void *data, int len)
 	return added;
 }
 
+/***
+ *** Offloading to worker threads.
+ ***/
+
+/**
+ * Release stream context.
+ */
+static void
+deflate_async_free(struct deflate_async *da)
+{
+	int ret;
+
+	g_assert(0 == da->inflight);
+	g_assert(NULL == da->head);
+
+	ret = deflateEnd(da->outz);
+
+	if (Z_OK != ret && Z_DATA_ERROR != ret)
+		g_warning("while freeing offloaded compressor: %s",
+			zlib_strerror(ret));
+
+	WFREE(da->outz);
+	WFREE(da);
+}
+
+/**
+ * Free compression job.
+ */
+static void
+deflate_job_free(struct deflate_job *dj)
+{
+	xfree(dj->in);
+	xfree(dj->out);
+	WFREE(dj);
+}
+
+/**
+ * Process compression job -- runs in the worker thread.
+ */
+static void
+deflate_job_run(void *arg)
+{
+	struct deflate_job *dj = arg;
+	z_streamp outz = dj->da->outz;
+	tm_t start, end;
+	int ret;
+
+	tm_current_time(&start);
+
+	dj->outsize = dj->inlen + DEFLATE_JOB_ROOM;
+	dj->out = xmalloc(dj->outsize);
+
+	outz->next_out = cast_to_pointer(dj->out);
+	outz->avail_out = dj->outsize;
+
+	if (dj->level != 0) {
+		outz->avail_in = 0;
+		ret = deflateParams(outz, dj->level, Z_DEFAULT_STRATEGY);
+	} else {
+		outz->next_in = cast_to_pointer(dj->in);
+		outz->avail_in = dj->inlen;
+
+		/*
+		 * Whenever deflate() returns with room left in the output buffer,
+		 * all the input was consumed and the requested flush was done.
+		 */
+
+		for (;;) {
+			ret = deflate(outz, dj->flush);
+
+			if (Z_BUF_ERROR == ret)
+				ret = Z_OK;				/* Nothing to flush */
+
+			if ((Z_OK != ret && Z_STREAM_END != ret) || 0 != outz->avail_out)
+				break;
+
+			dj->out = xrealloc(dj->out, 2 * dj->outsize);
+			outz->next_out = cast_to_pointer(&dj->out[dj->outsize]);
+			outz->avail_out = dj->outsize;
+			dj->outsize *= 2;
+		}
+	}
+
+	dj->outlen = ptr_diff(outz->next_out, dj->out);
+	dj->ret = ret;
+
+	tm_current_time(&end);
+	dj->elapsed = tm_elapsed_f(&end, &start);
+}
+
+/**
+ * Are we holding too much data on behalf of the worker?
+ */
+static bool
+deflate_async_busy(const txdrv_t *tx)
+{
+	const struct attr *attr = tx->opaque;
+	const struct deflate_async *da = attr->async;
+
+	/*
+	 * Having a backlog means our buffers are full, and we do not want to
+	 * have more than a flush worth of data in flight.
+	 */
+
+	return da != NULL && (da->backlog != 0 || da->queued >= attr->buffer_flush);
+}
+
+/**
+ * Move output of completed jobs to our buffers, sending them as they fill.
+ */
+static void
+deflate_async_drain(txdrv_t *tx)
+{
+	struct attr *attr = tx->opaque;
+	struct deflate_async *da = attr->async;
+	struct deflate_job *dj;
+
+	while (NULL != (dj = da->head)) {
+		while (dj->outpos < dj->outlen) {
+			struct buffer *b = &attr->buf[attr->fill_idx];	/* Buffer we fill */
+			size_t n;
+
+			if (b->wptr >= b->end) {
+				if (attr->send_idx >= 0)
+					return;		/* Wait for the send buffer to be flushed */
+
+				deflate_rotate_and_send(tx);	/* Can set TX_ERROR */
+
+				if (tx->flags & TX_ERROR)
+					return;
+				continue;
+			}
+
+			n = MIN(ptr_diff(b->end, b->wptr), dj->outlen - dj->outpos);
+			b->wptr = mempcpy(b->wptr, &dj->out[dj->outpos], n);
+			dj->outpos += n;
+			da->backlog -= n;
+			attr->flushed += n;
+
+			if (NULL != attr->cb->add_tx_deflated)
+				attr->cb->add_tx_deflated(tx->owner, n);
+		}
+
+		da->head = dj->next;
+		if (NULL == da->head)
+			da->tail = NULL;
+
+		attr->unflushed += dj->inlen;
+		attr->elapsed += dj->elapsed;
+
+		if (Z_NO_FLUSH != dj->flush) {
+			deflate_flushed(tx);
+
+			if (dj->send)
+				deflate_send_pending(tx);	/* Can set TX_ERROR */
+
+			if (0 == (tx->flags & TX_ERROR))
+				deflate_adapt(tx);
+		}
+
+		deflate_job_free(dj);
+
+		if (tx->flags & TX_ERROR)
+			return;
+	}
+}
+
+/**
+ * Completion of a compression job -- runs in the main thread.
+ */
+static void
+deflate_job_done(void *arg)
+{
+	struct deflate_job *dj = arg;
+	struct deflate_async *da = dj->da;
+	txdrv_t *tx = da->tx;
+	struct attr *attr;
+
+	g_assert(da->inflight != 0);
+	g_assert(size_is_non_negative(da->queued - dj->inlen));
+
+	da->inflight--;
+	da->queued -= dj->inlen;
+
+	/*
+	 * Once the stack went down, the owner may be gone already: discard.
+	 */
+
+	if (NULL == tx || (tx->flags & TX_DOWN)) {
+		deflate_job_free(dj);
+		if (NULL == tx && 0 == da->inflight)
+			deflate_async_free(da);
+		return;
+	}
+
+	attr = tx->opaque;
+
+	if (attr->flags & DF_SHUTDOWN) {
+		deflate_job_free(dj);
+		return;
+	}
+
+	if (dj->level != 0) {
+		if (Z_OK == dj->ret) {
+			attr->changes++;
+		} else {
+			if (tx_deflate_debugging(0)) {
+				g_debug("TX %s: (%s) cannot switch to level %d: %s",
+					G_STRFUNC, gnet_host_to_string(&tx->host), dj->level,
+					zlib_strerror(dj->ret));
+			}
+			attr->level = dj->old_level;
+		}
+	} else if (Z_OK != dj->ret && Z_STREAM_END != dj->ret) {
+		attr->flags |= DF_SHUTDOWN;
+		tx->flags |= TX_ERROR;
+
+		(*attr->cb->shutdown)(tx->owner, "Compression failed: %s",
+			zlib_strerror(dj->ret));
+		deflate_job_free(dj);
+		return;
+	}
+
+	if (tx_deflate_debugging(9)) {
+		g_debug("TX %s: (%s) worker deflated %zu bytes into %zu "
+			"in %.1f us (in flight: %u job%s, %zu bytes) [%c%c]",
+			G_STRFUNC, gnet_host_to_string(&tx->host),
+			dj->inlen, dj->outlen, dj->elapsed * 1e6,
+			da->inflight, 1 == da->inflight ? "" : "s", da->queued,
+			(attr->flags & DF_FLOWC) ? 'C' : '-',
+			(attr->flags & DF_FLUSH) ? 'f' : '-');
+	}
+
+	/*
+	 * Jobs complete in the order they were posted, hence appending to the
+	 * backlog preserves the ordering of the output.
+	 */
+
+	dj->next = NULL;
+	if (NULL == da->tail)
+		da->head = dj;
+	else
+		da->tail->next = dj;
+	da->tail = dj;
+	da->backlog += dj->outlen;
+
+	deflate_async_drain(tx);
+
+	if (tx->flags & TX_ERROR)
+		return;
+
+	if (tx->flags & TX_CLOSING) {
+		if (0 == tx_deflate_pending(tx))
+			deflate_closed(tx);
+		return;
+	}
+
+	/*
+	 * If we can accept data again, service the upper layer.
+	 */
+
+	if ((attr->flags & DF_FLOWC) && !deflate_async_busy(tx)) {
+		deflate_set_flowc(tx, FALSE);	/* Leave flow control state */
+
+		if (tx->flags & TX_SERVICE) {
+			g_assert(tx->srv_routine);
+			tx->srv_routine(tx->srv_arg);
+		}
+	}
+}
+
+/**
+ * Post compression job to the worker.
+ */
+static void
+deflate_async_post(txdrv_t *tx, struct deflate_job *dj)
+{
+	struct attr *attr = tx->opaque;
+	struct deflate_async *da = attr->async;
+
+	dj->da = da;
+	da->inflight++;
+	da->queued += dj->inlen;
+
+	workq_post(da->wq, da->key, deflate_job_run, deflate_job_done, dj);
+}
+
+/**
+ * Post flushing job to the worker.
+ *
+ * @param tx		the layer
+ * @param send		whether to send buffered data once flushed
+ */
+static void
+deflate_async_flush(txdrv_t *tx, bool send)
+{
+	struct attr *attr = tx->opaque;
+	struct deflate_job *dj;
+
+	/*
+	 * Once the stream is finished, there is nothing more to flush.
+	 */
+
+	if (attr->flags & DF_FINISH) {
+		if (send && 0 == attr->async->inflight)
+			deflate_send_pending(tx);
+		return;
+	}
+
+	WALLOC0(dj);
+	dj->flush = (tx->flags & TX_CLOSING) ? Z_FINISH : Z_SYNC_FLUSH;
+	dj->send = send;
+
+	if (Z_FINISH == dj->flush)
+		attr->flags |= DF_FINISH;
+
+	attr->flags |= DF_FLUSH;
+	attr->async->posted = 0;
+
+	deflate_async_post(tx, dj);
+}
+
+/**
+ * Hand data over to the worker.
+ *
+ * @return the amount of input bytes that were consumed, i.e. all of them.
+ */
+static ssize_t
+deflate_async_add(txdrv_t *tx, const iovec_t *iov, int iovcnt)
+{
+	struct attr *attr = tx->opaque;
+	struct deflate_job *dj;
+	size_t len;
+	char *p;
+	int i;
+
+	len = iov_calculate_size(iov, iovcnt);
+
+	if (0 == len)
+		return 0;
+
+	g_assert(len <= INT_MAX);
+
+	WALLOC0(dj);
+	dj->in = p = xmalloc(len);
+	dj->inlen = len;
+	dj->flush = Z_NO_FLUSH;
+
+	for (i = 0; i < iovcnt; i++)
+		p = mempcpy(p, iovec_base(&iov[i]), iovec_len(&iov[i]));
+
+	deflate_async_post(tx, dj);
+	attr->async->posted += len;
+
+	if (tx_deflate_debugging(9)) {
+		g_debug("TX %s: (%s) posted %zu bytes (nagle %s, "
+			"posted %zu) [%c%c]", G_STRFUNC,
+			gnet_host_to_string(&tx->host), len,
+			(attr->flags & DF_NAGLE) ? "on" : "off", attr->async->posted,
+			(attr->flags & DF_FLOWC) ? 'C' : '-',
+			(attr->flags & DF_FLUSH) ? 'f' : '-');
+	}
+
+	/*
+	 * Start Nagle if not already on, and request a flush when enough
+	 * data was given since the last one, as deflate_add() does.
+	 */
+
+	if (attr->flags & DF_NAGLE)
+		deflate_nagle_delay(tx);
+	else
+		deflate_nagle_start(tx);
+
+	if (attr->async->posted > attr->buffer_flush)
+		deflate_async_flush(tx, FALSE);
+
+	if (deflate_async_busy(tx))
+		deflate_set_flowc(tx, TRUE);	/* Enter flow control */
+
+	return len;
+}
+
 /**
  * Service routine for the compressing stage.
  *
@@ -726,6 +1376,17 @@ deflate_service(void *data)
 	if (attr->send_idx >= 0)		/* Could not send it entirely */
 		return;						/* Done, servicing still enabled */
 
+	/*
+	 * When offloaded, move the output of completed jobs to our buffers.
+	 */
+
+	if (attr->async != NULL) {
+		deflate_async_drain(tx);	/* Can set TX_ERROR */
+
+		if (tx->flags & TX_ERROR)
+			return;
+	}
+
 	/*
 	 * NB: In the following operations, order matters.  In particular, we
 	 * must disable the servicing before attempting to service the upper
@@ -758,10 +1419,11 @@ deflate_service(void *data)
 
 	/*
 	 * If we entered flow control, we can now safely leave it, since we
-	 * have at least a free `fill' buffer.
+	 * have at least a free `fill' buffer, unless we still have too much
+	 * data on behalf of the worker.
 	 */
 
-	if (attr->flags & DF_FLOWC)
+	if ((attr->flags & DF_FLOWC) && !deflate_async_busy(tx))
 		deflate_set_flowc(tx, FALSE);	/* Leave flow control state */
 
 	/*
@@ -777,7 +1439,7 @@ deflate_service(void *data)
 			return;
 
 		if (0 == tx_deflate_pending(tx)) {
-			(*attr->closed)(tx, attr->closed_arg);
+			deflate_closed(tx);
 			return;
 		}
 	}
@@ -816,15 +1478,26 @@ tx_deflate_init(txdrv_t *tx, void *args)
 	struct attr *attr;
 	struct tx_deflate_args *targs = args;
 	z_streamp outz;
+	workq_t *wq = NULL;
+	uint key = 0;
+	int level;
 	int ret;
 	int i;
 
 	g_assert(tx);
 	g_assert(NULL != targs->cb);
 
+	/*
+	 * Streams offloaded to a worker thread must use a thread-safe allocator.
+	 * The gzip encapsulation needs to see the data, so it is never offloaded.
+	 */
+
+	if (targs->offload && !targs->gzip)
+		wq = zlib_offload(&key);
+
 	WALLOC(outz);
-	outz->zalloc = zlib_alloc_func;
-	outz->zfree = zlib_free_func;
+	outz->zalloc = NULL == wq ? zlib_alloc_func : zlib_xalloc_func;
+	outz->zfree = NULL == wq ? zlib_free_func : zlib_xfree_func;
 	outz->opaque = NULL;
 
 	/*
@@ -863,25 +1536,35 @@ tx_deflate_init(txdrv_t *tx, void *args)
 	{
 		int window_bits = MAX_WBITS;		/* Must be 8 .. MAX_WBITS */
 		int mem_level = MAX_MEM_LEVEL;		/* Must be 1 .. MAX_MEM_LEVEL */
-		int level = Z_BEST_COMPRESSION;
+		level = Z_BEST_COMPRESSION;
 
 		if (targs->reduced) {
 			/* Ultra -> Leaf connection */
 			window_bits = 14;
 			mem_level = 6;
-			level = Z_DEFAULT_COMPRESSION;
+			level = 6;		/* Z_DEFAULT_COMPRESSION, explicitly */
 		}
 
 		g_assert(window_bits >= 8 && window_bits <= MAX_WBITS);
 		g_assert(mem_level >= 1 && mem_level <= MAX_MEM_LEVEL);
-		g_assert(level == Z_DEFAULT_COMPRESSION ||
-			(level >= Z_BEST_SPEED && level <= Z_BEST_COMPRESSION));
+		g_assert(level >= Z_BEST_SPEED && level <= Z_BEST_COMPRESSION);
 
 		ret = deflateInit2(outz, level, Z_DEFLATED,
 				targs->gzip ? (-window_bits) : window_bits, mem_level,
 				Z_DEFAULT_STRATEGY);
 	}
 
+	/*
+	 * A preset dictionary, when negotiated, primes the window before any
+	 * data is compressed.
+	 */
+
+	if (Z_OK == ret && targs->dict != NULL) {
+		ret = deflateSetDictionary(outz, targs->dict, targs->dict_len);
+		if (Z_OK != ret)
+			deflateEnd(outz);
+	}
+
 	if (Z_OK != ret) {
 		g_warning("unable to initialize compressor for peer %s: %s",
 			gnet_host_to_string(&tx->host), zlib_strerror(ret));
@@ -896,10 +1579,22 @@ tx_deflate_init(txdrv_t *tx, void *args)
 	attr->buffer_flush = targs->buffer_flush;
 	attr->nagle = booleanize(targs->nagle);
 	attr->gzip.enabled = targs->gzip;
+	attr->level = attr->max_level = level;
 
 	attr->outz = outz;
 	attr->tm_ev = NULL;
 
+	if (wq != NULL) {
+		struct deflate_async *da;
+
+		WALLOC0(da);
+		da->outz = outz;
+		da->tx = tx;
+		da->wq = wq;
+		da->key = key;
+		attr->async = da;
+	}
+
 	for (i = 0; i < BUFFER_COUNT; i++) {
 		struct buffer *b = &attr->buf[i];
 
@@ -959,16 +1654,39 @@ tx_deflate_destroy(txdrv_t *tx)
 	}
 
 	/*
-	 * We ignore Z_DATA_ERROR errors (discarded data, probably).
+	 * When offloaded, the stream is released by the completion of the
+	 * last job still in flight, if any.
 	 */
 
-	ret = deflateEnd(attr->outz);
+	if (attr->async != NULL) {
+		struct deflate_async *da = attr->async;
+		struct deflate_job *dj;
 
-	if (Z_OK != ret && Z_DATA_ERROR != ret)
-		g_warning("while freeing compressor for peer %s: %s",
-			gnet_host_to_string(&tx->host), zlib_strerror(ret));
+		while (NULL != (dj = da->head)) {
+			da->head = dj->next;
+			deflate_job_free(dj);
+		}
+
+		da->tail = NULL;
+		da->backlog = 0;
+		da->tx = NULL;
+
+		if (0 == da->inflight)
+			deflate_async_free(da);
+	} else {
+		/*
+		 * We ignore Z_DATA_ERROR errors (discarded data, probably).
+		 */
+
+		ret = deflateEnd(attr->outz);
+
+		if (Z_OK != ret && Z_DATA_ERROR != ret)
+			g_warning("while freeing compressor for peer %s: %s",
+				gnet_host_to_string(&tx->host), zlib_strerror(ret));
+
+		WFREE(attr->outz);
+	}
 
-	WFREE(attr->outz);
 	cq_cancel(&attr->tm_ev);
 	WFREE(attr);
 }
@@ -997,6 +1715,11 @@ tx_deflate_write(txdrv_t *tx, const void *data, size_t len)
 	if (attr->flags & (DF_FLOWC|DF_SHUTDOWN))
 		return 0;
 
+	if (attr->async != NULL) {
+		iovec_t iov = iov_get(deconstify_pointer(data), len);
+		return deflate_async_add(tx, &iov, 1);
+	}
+
 	return deflate_add(tx, data, len);
 }
 
@@ -1019,6 +1742,17 @@ tx_deflate_writev(txdrv_t *tx, iovec_t *iov, int iovcnt)
 			(attr->flags & DF_FLUSH) ? 'f' : '-');
 	}
 
+	/*
+	 * When offloaded, the whole vector is handed over as a single job.
+	 */
+
+	if (attr->async != NULL) {
+		if (attr->flags & (DF_FLOWC|DF_SHUTDOWN))
+			return 0;
+
+		return deflate_async_add(tx, iov, iovcnt);
+	}
+
 	while (iovcnt-- > 0) {
 		int ret;
 
@@ -1094,6 +1828,22 @@ tx_deflate_pending(txdrv_t *tx)
 		pending += attr->flushed >= projected ? 1 : projected - attr->flushed;
 	}
 
+	/*
+	 * When offloaded, account for the output of completed jobs we could
+	 * not buffer yet, and for the projected output of jobs in flight.
+	 */
+
+	if (attr->async != NULL) {
+		const struct deflate_async *da = attr->async;
+
+		pending += da->backlog;
+
+		if (0 != da->inflight) {
+			size_t projected = da->queued * (1.0 - attr->ratio_ema);
+			pending += MAX(projected, 1);
+		}
+	}
+
 	return pending;
 }
 
@@ -1221,4 +1971,34 @@ tx_deflate_get_ops(void)
 	return &tx_deflate_ops;
 }
 
+/**
+ * Fill compression statistics of the deflating layer.
+ *
+ * @return FALSE if the TX driver is not a deflating layer.
+ */
+bool
+tx_deflate_info(const txdrv_t *tx, struct tx_deflate_info *info)
+{
+	const struct attr *attr;
+
+	tx_check(tx);
+	g_assert(info != NULL);
+
+	if (tx->ops != &tx_deflate_ops)
+		return FALSE;
+
+	attr = tx->opaque;
+
+	info->input = attr->total_input;
+	info->output = attr->total_output;
+	info->ratio = attr->ratio;
+	info->ratio_ema = attr->ratio_ema;
+	info->cost = attr->cost_ema;
+	info->level = attr->level;
+	info->max_level = attr->max_level;
+	info->changes = attr->changes;
+
+	return TRUE;
+}
+
 /* vi: set ts=4 sw=4 cindent: */
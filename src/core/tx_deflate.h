@@ -48,6 +48,7 @@ struct tx_deflate_cb {
 	void (*add_tx_deflated)(void *owner, int amount);
 	void (*shutdown)(void *owner, const char *reason, ...);
 	void (*flow_control)(void *owner, size_t amount);
+	bool (*congested)(void *owner);
 };
 
 /**
@@ -61,8 +62,27 @@ struct tx_deflate_args {
 	bool nagle;					/**< Whether to use Nagle or not */
 	bool gzip;					/**< Whether to use gzip encapsulation */
 	bool reduced;				/**< Whether to use reduced compression */
+	bool offload;				/**< Whether a worker thread may compress */
+	const void *dict;			/**< Optional preset dictionary */
+	size_t dict_len;			/**< Length of dictionary */
 };
 
+/**
+ * Compression statistics of the layer.
+ */
+struct tx_deflate_info {
+	uint64 input;				/**< Total amount of input bytes flushed */
+	uint64 output;				/**< Total amount of output bytes flushed */
+	double ratio;				/**< Overall compression ratio */
+	double ratio_ema;			/**< EMA of compression ratio */
+	double cost;				/**< EMA of deflating cost, in usecs per KiB */
+	int level;					/**< Current compression level */
+	int max_level;				/**< Compression level we started with */
+	uint changes;				/**< Amount of compression level changes */
+};
+
+bool tx_deflate_info(const txdrv_t *tx, struct tx_deflate_info *info);
+
 #endif	/* _core_tx_deflate_h_ */
 
 /* vi: set ts=4 sw=4 cindent: */
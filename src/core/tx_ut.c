@@ -149,12 +149,30 @@
  *
  * Our maximum payload size is set to 476 bytes (to limit the total IP message
  * to 512 bytes, including our 8-byte header + 28 bytes of UDP/IP header).
- * The fragment transmission timeout (ACK not received) is set to 5 secs for
- * the first transmission, 10 secs for the second and 20 secs for the third
- * and last attempt (exponential retry delay).
- * The packet transmission timeout is set to 60 secs (larger than 5+10+20+20=55
- * in case each fragment is not immediately sent out), to leave about 20 seconds
- * to get the final acknowledgement back on the last re-transmission.
+ * The packet transmission timeout is set to 60 secs, leaving enough time for
+ * the last re-transmission of a fragment to be acknowledged even when the
+ * fragments could not be immediately sent out.
+ *
+ * CONGESTION CONTROL
+ *
+ * The layer keeps some state about each destination host: the smoothed
+ * round-trip time (RTT) and its variance, measured on fragments that were
+ * acknowledged after a single transmission (Karn's algorithm), from which
+ * the retransmission timeout (RTO) is derived, as TCP does.  The RTO starts
+ * at 5 secs for unknown hosts and is backed off exponentially for each
+ * re-transmission of a fragment.
+ *
+ * The amount of reliable fragments in flight to a host, i.e. sent and not
+ * acknowledged yet, is bounded by a congestion window.  That window is driven
+ * by the queuing delay, i.e. the difference between the current RTT and the
+ * smallest RTT seen recently, LEDBAT-style: it grows as long as the queuing
+ * delay remains below a target and shrinks when it exceeds the target.  It is
+ * halved when fragments are lost.  Fragments that cannot be sent because the
+ * window is full are held in a per-host queue until acknowledgments come back.
+ *
+ * Extended acknowledgments, which carry the reception bitmap of the message,
+ * are also used to resend lost fragments without waiting for their timeout
+ * when enough of the fragments sent after them were received.
  *
  * LINK WITH THE RX SIDE
  *
@@ -189,6 +207,7 @@
 #include "lib/eslist.h"
 #include "lib/gnet_host.h"
 #include "lib/hevset.h"
+#include "lib/hikset.h"
 #include "lib/idtable.h"
 #include "lib/nid.h"
 #include "lib/tm.h"
@@ -205,6 +224,19 @@
 #define TX_UT_EAR_SEND_MAX	3		/* Max amount of EAR transmissions */
 
 #define TX_UT_EXPIRE_MS		(60*1000)	/* Expiration time for packets, in ms */
+#define TX_UT_RTO_INIT		5000		/* Initial RTO, in ms */
+#define TX_UT_RTO_MIN		1000		/* Minimum RTO (ACKs can be delayed) */
+#define TX_UT_RTO_MAX		22500		/* Maximum RTO, in ms */
+#define TX_UT_DUP_THRESH	3			/* Later fragments for fast resend */
+#define TX_UT_PEER_LINGER	(10*60*1000)	/* Keep idle host state 10 min */
+
+#define TX_UT_CWND_SHIFT	8			/* Window in 1/256th of fragments */
+#define TX_UT_CWND_INIT		(4 << TX_UT_CWND_SHIFT)
+#define TX_UT_CWND_MIN		(2 << TX_UT_CWND_SHIFT)
+#define TX_UT_CWND_MAX		(TX_UT_FRAG_MAX << TX_UT_CWND_SHIFT)
+#define TX_UT_TARGET_MS		100			/* Target queuing delay, in ms */
+#define TX_UT_BASE_HISTORY	10			/* Base delay history, in minutes */
+#define TX_UT_CUR_HISTORY	4			/* Current delay filter, in samples */
 #define TX_UT_SEQNO_COUNT	(1U << 16)	/* Amount of 16-bit sequence IDs */
 #define TX_UT_SEQNO_THRESH	1024		/* Sequence ID freeing threshold */
 
@@ -213,6 +245,7 @@
 #define TX_UT_DBG_ACK		(1U << 2)	/* Acknowledgments */
 #define TX_UT_DBG_SEND		(1U << 3)	/* Sending to lower layer */
 #define TX_UT_DBG_TIMEOUT	(1U << 4)	/* Timeouts */
+#define TX_UT_DBG_CWND		(1U << 5)	/* Congestion window */
 
 #define tx_ut_debugging(mask, to) \
 	G_UNLIKELY((GNET_PROPERTY(tx_ut_debug_flags) & (mask)) && \
@@ -228,6 +261,7 @@ struct attr {
 	idtable_t *seq;			/* Messages to send indexed by sequence ID */
 	txdrv_t *tx;			/* Back pointer to TX layer owning this struct */
 	eslist_t pending[PMSG_P_COUNT];	/* Pending messages to service, by prio */
+	hikset_t *peers;		/* Congestion state of destinations, by host */
 	size_t buffered;		/* Total size of enqueued messages */
 	zlib_deflater_t *zd;	/* Deflating object */
 	struct tx_ut_cb *cb;	/* Callbacks */
@@ -259,6 +293,47 @@ enum ut_frag_magic { UT_FRAG_MAGIC = 0x179a92a6 };
 
 struct ut_msg;
 
+enum ut_peer_magic { UT_PEER_MAGIC = 0x2c54c0b3 };
+
+/**
+ * Congestion state for a destination host.
+ *
+ * The congestion window is expressed in fragments, as a fixed-point number
+ * with TX_UT_CWND_SHIFT bits of fractional part, so that it can grow by
+ * fractions of fragments as acknowledgments come back.
+ *
+ * The queuing delay is estimated as the difference between the current
+ * delay (smallest of the last few RTT samples, to filter out delayed ACKs)
+ * and the base delay (smallest RTT seen over the last few minutes).
+ */
+struct ut_peer {
+	enum ut_peer_magic magic;
+	const gnet_host_t *to;			/* Destination address (atom) */
+	struct attr *attr;				/* TX layer private attributes */
+	cevent_t *release_ev;			/* Sending of waiting fragments */
+	cevent_t *linger_ev;			/* Expiration of idle state */
+	elist_t wait;					/* Fragments waiting for the window */
+	tm_t last_loss;					/* Last time we shrank the window */
+	time_delta_t srtt;				/* Smoothed RTT, in ms (0 if unknown) */
+	time_delta_t rttvar;			/* RTT variation, in ms */
+	time_delta_t rto;				/* Retransmission timeout, in ms */
+	time_delta_t cur[TX_UT_CUR_HISTORY];	/* Last RTT samples */
+	time_delta_t base[TX_UT_BASE_HISTORY];	/* Minimum RTT, per minute */
+	time_t base_stamp;				/* Start of current base delay minute */
+	uint32 cwnd;					/* Congestion window (fixed-point) */
+	uint32 ssthresh;				/* Slow-start threshold (fixed-point) */
+	uint samples;					/* Amount of RTT samples taken */
+	uint refcnt;					/* Amount of messages to that host */
+	uint inflight;					/* Fragments sent, pending ACK */
+};
+
+static inline void
+ut_peer_check(const struct ut_peer * const up)
+{
+	g_assert(up != NULL);
+	g_assert(UT_PEER_MAGIC == up->magic);
+}
+
 /**
  * A fragment to send.
  */
@@ -267,11 +342,14 @@ struct ut_frag {
 	struct ut_msg *msg;				/* Message where fragment belongs */
 	cevent_t *resend_ev;			/* Timer for fragment retransmission */
 	pmsg_t *fb;						/* Fragment message block */
-	link_t lk;						/* Link in "resend" queue */
+	link_t lk;						/* Link in "resend" or "wait" queue */
+	tm_t sent;						/* Last transmission time */
 	uint8 fragno;					/* Fragment number, zero-based */
 	uint8 txcnt;					/* Amount of times fragment was sent */
 	uint resend:1;					/* Enqueued for resending */
 	uint pending:1;					/* Pending ACK on resending */
+	uint waiting:1;					/* Waiting for congestion window */
+	uint inflight:1;				/* Counted in the congestion window */
 };
 
 static void
@@ -307,6 +385,7 @@ struct ut_msg {
 	cevent_t *ear_ev;				/* Expire timer for EARs */
 	struct ut_frag **fragments;		/* Fragments to send (NULL when ACK-ed) */
 	struct attr *attr;				/* TX layer private attributes */
+	struct ut_peer *peer;			/* Congestion state of destination */
 	elist_t resend;					/* Fragments to resend */
 	uint16 seqno;					/* Sequence ID number */
 	uint16 fragtx;					/* Fragments transmitted, total */
@@ -366,6 +445,7 @@ static unsigned ut_mset_refcnt;
 
 static bool ut_frag_free(struct ut_frag *uf, bool free_message);
 static void ut_frag_send(const struct ut_frag *uf);
+static void ut_frag_xmit(struct ut_frag *uf);
 static void ut_ack_send(pmsg_t *mb);
 static void ut_resend_async(struct ut_msg *um);
 
@@ -453,6 +533,492 @@ ut_msg_is_alive(struct nid mid)
 	return um;
 }
 
+/**
+ * Get the congestion state of the destination host, creating it if needed.
+ *
+ * A reference is taken on the returned object, to be released with
+ * ut_peer_unref().
+ */
+static struct ut_peer *
+ut_peer_get(struct attr *attr, const gnet_host_t *to)
+{
+	struct ut_peer *up;
+
+	ut_attr_check(attr);
+
+	up = hikset_lookup(attr->peers, to);
+
+	if (NULL == up) {
+		WALLOC0(up);
+		up->magic = UT_PEER_MAGIC;
+		up->to = atom_host_get(to);
+		up->attr = attr;
+		up->rto = TX_UT_RTO_INIT;
+		up->cwnd = TX_UT_CWND_INIT;
+		up->ssthresh = TX_UT_CWND_MAX;
+		elist_init(&up->wait, offsetof(struct ut_frag, lk));
+		hikset_insert_key(attr->peers, &up->to);
+	} else {
+		ut_peer_check(up);
+		cq_cancel(&up->linger_ev);
+	}
+
+	up->refcnt++;
+
+	return up;
+}
+
+/**
+ * Free congestion state.
+ */
+static void
+ut_peer_free(struct ut_peer *up)
+{
+	ut_peer_check(up);
+	g_assert(0 == up->refcnt);
+	g_assert(0 == elist_count(&up->wait));
+
+	cq_cancel(&up->release_ev);
+	cq_cancel(&up->linger_ev);
+	atom_host_free_null(&up->to);
+	up->magic = 0;
+	WFREE(up);
+}
+
+/**
+ * Callout queue callback invoked when congestion state has been idle for
+ * too long.
+ */
+static void
+ut_peer_expired(cqueue_t *unused_cq, void *obj)
+{
+	struct ut_peer *up = obj;
+
+	(void) unused_cq;
+
+	ut_peer_check(up);
+	ut_attr_check(up->attr);
+	g_assert(0 == up->refcnt);
+
+	up->linger_ev = NULL;		/* Callback triggered */
+
+	hikset_remove(up->attr->peers, up->to);
+	ut_peer_free(up);
+}
+
+/**
+ * Remove reference on congestion state.
+ *
+ * When the last reference goes, the state is kept around for a while in
+ * case new messages are sent to the same host, so that we do not have to
+ * learn about the path again.
+ */
+static void
+ut_peer_unref(struct ut_peer *up)
+{
+	ut_peer_check(up);
+	g_assert(up->refcnt != 0);
+
+	if (0 == --up->refcnt) {
+		g_assert(NULL == up->linger_ev);
+		up->linger_ev = cq_main_insert(TX_UT_PEER_LINGER, ut_peer_expired, up);
+	}
+}
+
+/**
+ * Hash set iterator to release all congestion states.
+ */
+static void
+ut_destroy_peer(void *data, void *unused_arg)
+{
+	struct ut_peer *up = data;
+
+	(void) unused_arg;
+
+	ut_peer_free(up);
+}
+
+/**
+ * @return the congestion window, in fragments.
+ */
+static inline uint
+ut_peer_window(const struct ut_peer *up)
+{
+	return up->cwnd >> TX_UT_CWND_SHIFT;
+}
+
+/**
+ * Computes the delay (in ms) we have to wait at most to get an ACK back,
+ * given the amount of transmissions already made.
+ */
+static int
+ut_peer_delay(const struct ut_peer *up, unsigned txcnt)
+{
+	time_delta_t delay = up->rto;
+
+	ut_peer_check(up);
+	g_assert(txcnt != 0);
+
+	while (--txcnt != 0 && delay < TX_UT_RTO_MAX)
+		delay += delay / 2;			/* Exponential backoff */
+
+	return MIN(delay, TX_UT_RTO_MAX);
+}
+
+/**
+ * Computes the delay (in ms) before resending a fragment, depending on how
+ * many times it was sent already.
+ */
+static int
+ut_frag_delay(const struct ut_frag *uf)
+{
+	ut_frag_check(uf);
+	g_assert(uf->txcnt != 0);
+
+	return ut_peer_delay(uf->msg->peer, uf->txcnt);
+}
+
+/**
+ * Compute the smallest non-zero value of an array of delays.
+ *
+ * @return the smallest delay, 0 if there are none.
+ */
+static time_delta_t
+ut_delay_min(const time_delta_t *ary, size_t cnt)
+{
+	time_delta_t min = 0;
+	size_t i;
+
+	for (i = 0; i < cnt; i++) {
+		if (ary[i] != 0 && (0 == min || ary[i] < min))
+			min = ary[i];
+	}
+
+	return min;
+}
+
+/**
+ * @return the estimated queuing delay on the path to the host, in ms.
+ */
+static time_delta_t
+ut_peer_qdelay(const struct ut_peer *up)
+{
+	time_delta_t cur, base;
+
+	cur = ut_delay_min(up->cur, G_N_ELEMENTS(up->cur));
+	base = ut_delay_min(up->base, G_N_ELEMENTS(up->base));
+
+	return cur > base ? cur - base : 0;
+}
+
+/**
+ * Record new RTT sample, updating the retransmission timeout and the delay
+ * histories used to compute the queuing delay.
+ *
+ * @param up		the congestion state
+ * @param rtt		the round-trip time measured, in ms
+ */
+static void
+ut_peer_rtt_sample(struct ut_peer *up, time_delta_t rtt)
+{
+	time_t now = tm_time();
+	time_delta_t rto;
+
+	ut_peer_check(up);
+
+	rtt = MAX(rtt, 1);		/* Zero signals "no sample" in histories */
+
+	/*
+	 * Same smoothing as TCP (RFC 6298).
+	 */
+
+	if (0 == up->samples++) {
+		up->srtt = rtt;
+		up->rttvar = rtt / 2;
+	} else {
+		time_delta_t delta = up->srtt - rtt;
+
+		up->rttvar = (3 * up->rttvar + ABS(delta)) / 4;
+		up->srtt = (7 * up->srtt + rtt) / 8;
+	}
+
+	rto = up->srtt + MAX(4 * up->rttvar, 10);
+	up->rto = CLAMP(rto, TX_UT_RTO_MIN, TX_UT_RTO_MAX);
+
+	/*
+	 * The current delay is filtered over the last samples, to ignore the
+	 * ACKs that were delayed by the receiving side.
+	 *
+	 * The base delay is the minimum RTT seen, over one-minute periods to
+	 * be able to forget about it should the route to the host change.
+	 */
+
+	up->cur[up->samples % G_N_ELEMENTS(up->cur)] = rtt;
+
+	if (0 == up->base_stamp || delta_time(now, up->base_stamp) >= 60) {
+		memmove(&up->base[1], &up->base[0],
+			sizeof up->base - sizeof up->base[0]);
+		up->base[0] = rtt;
+		up->base_stamp = now;
+	} else {
+		up->base[0] = MIN(up->base[0], rtt);
+	}
+
+	if (tx_ut_debugging(TX_UT_DBG_CWND, up->to)) {
+		g_debug("TX UT: %s: RTT to %s is %ld ms (srtt=%ld, rttvar=%ld, "
+			"rto=%ld, qdelay=%ld)",
+			G_STRFUNC, gnet_host_to_string(up->to), (long) rtt,
+			(long) up->srtt, (long) up->rttvar, (long) up->rto,
+			(long) ut_peer_qdelay(up));
+	}
+}
+
+/**
+ * Update the congestion window after fragments were acknowledged.
+ *
+ * As long as the window is below the slow-start threshold and no queuing
+ * is sensed, the window grows by one fragment for each fragment acknowledged.
+ * Otherwise, the window is driven by the queuing delay: it grows by up to one
+ * fragment per round-trip when there is no queuing, and shrinks at the same
+ * pace when the queuing delay is twice the target.
+ *
+ * @param up		the congestion state
+ * @param acked		amount of fragments in flight that were acknowledged
+ */
+static void
+ut_peer_acked(struct ut_peer *up, uint acked)
+{
+	time_delta_t qdelay;
+	uint32 cwnd;
+	bool limited;
+
+	ut_peer_check(up);
+
+	if (0 == acked)
+		return;
+
+	/*
+	 * The window should not grow if we were not using it fully, otherwise
+	 * it would lose all significance.
+	 */
+
+	limited = 0 != elist_count(&up->wait) ||
+		up->inflight + acked + 1 >= ut_peer_window(up);
+
+	qdelay = ut_peer_qdelay(up);
+	cwnd = up->cwnd;
+
+	if (up->cwnd < up->ssthresh && qdelay < TX_UT_TARGET_MS / 2) {
+		if (limited)
+			cwnd += acked << TX_UT_CWND_SHIFT;
+	} else {
+		int64 delta;
+
+		if (up->cwnd < up->ssthresh)
+			up->ssthresh = up->cwnd;		/* Leave slow-start */
+
+		delta = (int64) (TX_UT_TARGET_MS - qdelay) * acked *
+			(1 << (2 * TX_UT_CWND_SHIFT)) / (TX_UT_TARGET_MS * (int64) up->cwnd);
+
+		if (delta < 0 || limited)
+			cwnd = MAX((int64) up->cwnd + delta, 0);
+	}
+
+	cwnd = CLAMP(cwnd, TX_UT_CWND_MIN, TX_UT_CWND_MAX);
+
+	if (
+		ut_peer_window(up) != (cwnd >> TX_UT_CWND_SHIFT) &&
+		tx_ut_debugging(TX_UT_DBG_CWND, up->to)
+	) {
+		g_debug("TX UT: %s: window to %s now %u fragment%s "
+			"(%u in flight, %zu waiting, qdelay=%ld ms, %s)",
+			G_STRFUNC, gnet_host_to_string(up->to),
+			cwnd >> TX_UT_CWND_SHIFT,
+			1 == (cwnd >> TX_UT_CWND_SHIFT) ? "" : "s",
+			up->inflight, elist_count(&up->wait), (long) qdelay,
+			up->cwnd < up->ssthresh ? "slow-start" : "steady");
+	}
+
+	up->cwnd = cwnd;
+}
+
+/**
+ * Fragments to the host were lost, shrink the congestion window.
+ *
+ * Losses are accounted for at most once per round-trip, since a burst of
+ * lost fragments is the sign of a single congestion event.
+ */
+static void
+ut_peer_loss(struct ut_peer *up)
+{
+	tm_t now;
+	time_delta_t period;
+
+	ut_peer_check(up);
+
+	tm_now_exact(&now);
+	period = 0 == up->samples ? up->rto : up->srtt;
+
+	if (
+		0 != up->last_loss.tv_sec &&
+		tm_elapsed_ms(&now, &up->last_loss) < period
+	)
+		return;
+
+	up->last_loss = now;		/* Struct copy */
+	up->ssthresh = MAX(up->cwnd / 2, TX_UT_CWND_MIN);
+	up->cwnd = up->ssthresh;
+
+	/*
+	 * Back off the RTO as well, until we get a new RTT sample.  There is
+	 * no need to when we have no sample yet, the initial RTO being large.
+	 */
+
+	if (up->samples != 0)
+		up->rto = MIN(up->rto * 2, TX_UT_RTO_MAX);
+
+	if (tx_ut_debugging(TX_UT_DBG_CWND, up->to)) {
+		g_debug("TX UT: %s: loss to %s, window now %u fragment%s "
+			"(%u in flight, %zu waiting, rto=%ld ms)",
+			G_STRFUNC, gnet_host_to_string(up->to), ut_peer_window(up),
+			1 == ut_peer_window(up) ? "" : "s",
+			up->inflight, elist_count(&up->wait), (long) up->rto);
+	}
+}
+
+/**
+ * Account fragment as being in flight and send it.
+ */
+static void
+ut_frag_fly(struct ut_frag *uf)
+{
+	struct ut_peer *up = uf->msg->peer;
+
+	g_assert(!uf->inflight);
+	g_assert(!uf->waiting);
+
+	uf->inflight = TRUE;
+	up->inflight++;
+	ut_frag_send(uf);
+}
+
+/**
+ * Callout queue callback invoked to send fragments waiting for the window.
+ */
+static void
+ut_peer_release(cqueue_t *unused_cq, void *obj)
+{
+	struct ut_peer *up = obj;
+	struct ut_frag *uf;
+
+	(void) unused_cq;
+
+	ut_peer_check(up);
+	g_assert(up->release_ev != NULL);
+
+	up->release_ev = NULL;		/* Callback triggered */
+
+	while (up->inflight < ut_peer_window(up)) {
+		uf = elist_shift(&up->wait);
+
+		if (NULL == uf)
+			break;
+
+		ut_frag_check(uf);
+		g_assert(uf->waiting);
+
+		uf->waiting = FALSE;
+		ut_frag_fly(uf);
+	}
+}
+
+/**
+ * Request asynchronous sending of fragments waiting for the window, if needed.
+ */
+static void
+ut_peer_release_async(struct ut_peer *up)
+{
+	ut_peer_check(up);
+
+	if (
+		NULL == up->release_ev && 0 != elist_count(&up->wait) &&
+		up->inflight < ut_peer_window(up)
+	)
+		up->release_ev = cq_main_insert(1, ut_peer_release, up);
+}
+
+/**
+ * Fragment is no longer in flight (acknowledged, lost or dropped).
+ */
+static void
+ut_frag_land(struct ut_frag *uf)
+{
+	struct ut_peer *up;
+
+	if (!uf->inflight)
+		return;
+
+	up = uf->msg->peer;
+	ut_peer_check(up);
+	g_assert(up->inflight != 0);
+
+	uf->inflight = FALSE;
+	up->inflight--;
+	ut_peer_release_async(up);
+}
+
+/**
+ * Transmit fragment, if the congestion window allows it.
+ *
+ * Unreliable fragments are not acknowledged, hence they are not subject to
+ * the congestion window and are sent immediately.
+ *
+ * Otherwise, the fragment is put in the waiting queue of the destination,
+ * re-transmissions being put ahead of first transmissions to let messages
+ * already under way complete first.
+ */
+static void
+ut_frag_xmit(struct ut_frag *uf)
+{
+	struct ut_msg *um;
+	struct ut_peer *up;
+
+	ut_frag_check(uf);
+	ut_msg_check(uf->msg);
+
+	um = uf->msg;
+	up = um->peer;
+
+	if (!um->reliable) {
+		ut_frag_send(uf);
+		return;
+	}
+
+	if (0 == elist_count(&up->wait) && up->inflight < ut_peer_window(up)) {
+		ut_frag_fly(uf);
+		return;
+	}
+
+	g_assert(!uf->waiting);
+
+	uf->waiting = TRUE;
+	if (0 == uf->txcnt)
+		elist_append(&up->wait, uf);
+	else
+		elist_prepend(&up->wait, uf);
+
+	gnet_stats_inc_general(GNR_UDP_SR_TX_FRAGMENTS_DEFERRED);
+
+	if (tx_ut_debugging(TX_UT_DBG_CWND, um->to)) {
+		g_debug("TX UT[%s]: %s: deferring fragment #%u/%u seq=0x%04x to %s "
+			"(window=%u, %u in flight, %zu waiting)",
+			nid_to_string(&um->mid), G_STRFUNC,
+			uf->fragno + 1, um->fragcnt, um->seqno,
+			gnet_host_to_string(um->to), ut_peer_window(up),
+			up->inflight, elist_count(&up->wait));
+	}
+}
+
 /**
  * Free message.
  */
@@ -517,6 +1083,7 @@ ut_msg_free(struct ut_msg *um, bool free_sequence)
 
 	attr->buffered = size_saturate_sub(attr->buffered, pmsg_size(um->mb));
 
+	ut_peer_unref(um->peer);
 	cq_cancel(&um->expire_ev);
 	cq_cancel(&um->iterate_ev);
 	cq_cancel(&um->ear_ev);
@@ -581,6 +1148,11 @@ ut_frag_free(struct ut_frag *uf, bool free_message)
 	if (uf->resend)
 		elist_remove(&um->resend, uf);
 
+	if (uf->waiting)
+		elist_remove(&um->peer->wait, uf);
+
+	ut_frag_land(uf);
+
 	if (uf->pending) {
 		um->pending--;
 		ut_resend_async(um);
@@ -610,34 +1182,6 @@ ut_frag_free(struct ut_frag *uf, bool free_message)
 	return is_last;
 }
 
-/**
- * Computes the delay (in ms) we have to wait at most to get an ACK back.
- *
- */
-static int
-ut_sending_delay(unsigned txcnt)
-{
-	switch (txcnt) {
-	case 1:  return 5000;		/* 5 seconds */
-	case 2:  return 7500;		/* 7.5 seconds */
-	case 3:  return 11250;		/* 11.25 seconds */
-	default: return 22500;		/* 22.5 seconds */
-	}
-}
-
-/**
- * Computes the delay (in ms) before resending a fragment, depending on how
- * many times it was sent already.
- */
-static int
-ut_frag_delay(const struct ut_frag *uf)
-{
-	ut_frag_check(uf);
-	g_assert(uf->txcnt != 0);
-
-	return ut_sending_delay(uf->txcnt);
-}
-
 /**
  * Send an EAR (Extra ACK Request) to the remote end.
  */
@@ -727,8 +1271,8 @@ ut_resend_iterate(cqueue_t *unused_cq, void *obj)
 
 		uf->resend = FALSE;
 		uf->pending = TRUE;
-		ut_frag_send(uf);
 		um->pending++;
+		ut_frag_xmit(uf);
 	}
 }
 
@@ -827,6 +1371,13 @@ ut_frag_resend(cqueue_t *unused_cq, void *obj)
 		um->alpha /= 2;				/* Decrease sending parallelism */
 	}
 
+	/*
+	 * The fragment is deemed lost, which is a sign of congestion.
+	 */
+
+	ut_frag_land(uf);
+	ut_peer_loss(um->peer);
+
 	/*
 	 * If we sent the fragment too many times already, give up on the whole
 	 * message.
@@ -966,6 +1517,7 @@ ut_frag_pmsg_free(pmsg_t *mb, void *arg)
 
 		uf->txcnt++;
 		um->fragtx++;
+		tm_now_exact(&uf->sent);
 		gnet_stats_inc_general(GNR_UDP_SR_TX_FRAGMENTS_SENT);
 		if (uf->txcnt > 1) {
 			um->fragtx2++;
@@ -1089,14 +1641,14 @@ ut_ack_pmsg_free(pmsg_t *mb, void *arg)
 				um->ear_pending = FALSE;		/* Got CONF that it was sent */
 				g_assert(NULL == um->ear_ev);
 				um->ear_ev = cq_main_insert(
-					ut_sending_delay(um->ears), ut_ear_resend, um);
+					ut_peer_delay(um->peer, um->ears), ut_ear_resend, um);
 
 				if (tx_ut_debugging(TX_UT_DBG_TIMEOUT, um->to)) {
 					g_debug("TX UT[%s]: %s: EAR seq=0x%04x tx=%d to %s "
 						"will be resent in %d ms",
 						nid_to_string(&um->mid), G_STRFUNC,
 						um->seqno, um->ears, gnet_host_to_string(um->to),
-						ut_sending_delay(um->ears));
+						ut_peer_delay(um->peer, um->ears));
 				}
 			}
 		}
@@ -1611,6 +2163,7 @@ ut_msg_create(struct attr *attr, pmsg_t *mb, const gnet_host_t *to)
 	um->seqno = seqno;
 	um->mid = ut_msg_id_create();
 	um->attr = attr;
+	um->peer = ut_peer_get(attr, to);
 	um->deflated = booleanize(deflated);
 	elist_init(&um->resend, offsetof(struct ut_frag, lk));
 
@@ -1726,6 +2279,100 @@ tx_ut_service(void *data)
 	tx_ut_upper_service(tx);
 }
 
+/**
+ * Acknowledged fragments, as processed by ut_got_ack().
+ */
+struct ut_acked {
+	tm_t now;				/* Time at which ACK was received */
+	time_delta_t rtt;		/* Smallest RTT measured, -1 if none */
+	uint count;				/* Amount of fragments in flight acknowledged */
+};
+
+/**
+ * Account for the acknowledgment of a fragment.
+ *
+ * Only fragments sent once can yield an RTT sample (Karn's algorithm).  Since
+ * an acknowledgment can cover several fragments, we keep the smallest RTT,
+ * that of the fragment sent last, which is the one that most likely
+ * triggered the acknowledgment.
+ */
+static void
+ut_frag_acked(const struct ut_frag *uf, struct ut_acked *ua)
+{
+	ut_frag_check(uf);
+
+	if (!uf->inflight)
+		return;
+
+	ua->count++;
+
+	if (1 == uf->txcnt) {
+		time_delta_t rtt = tm_elapsed_ms(&ua->now, &uf->sent);
+
+		if (ua->rtt < 0 || rtt < ua->rtt)
+			ua->rtt = rtt;
+	}
+}
+
+/**
+ * Fragment was acknowledged: account for it and free it.
+ *
+ * @return TRUE if the fragment was the last one remaining.
+ */
+static bool
+ut_frag_ack(struct ut_frag *uf, struct ut_acked *ua)
+{
+	ut_frag_acked(uf, ua);
+	return ut_frag_free(uf, TRUE);
+}
+
+/**
+ * Resend fragments that extended acknowledgments report as missing, without
+ * waiting for their retransmission timeout, when enough fragments sent after
+ * them were already received.
+ *
+ * @param um		the message
+ * @param base		fragment number corresponding to bit 0 of ``missing''
+ * @param max		first fragment number not covered by ``missing''
+ * @param missing	the bitmap of missing fragments
+ * @param highest	highest fragment number known to be received
+ */
+static void
+ut_fast_resend(struct ut_msg *um,
+	unsigned base, unsigned max, uint32 missing, unsigned highest)
+{
+	unsigned f;
+	uint32 mask = 1;
+
+	ut_msg_check(um);
+
+	for (f = base; f < max && f + TX_UT_DUP_THRESH <= highest; f++, mask <<= 1) {
+		struct ut_frag *uf = um->fragments[f];
+
+		if (0 == (missing & mask) || NULL == uf)
+			continue;
+
+		/*
+		 * Only consider fragments sent once and awaiting their ACK: those
+		 * already resent could have been sent after the received ones.
+		 */
+
+		if (1 != uf->txcnt || NULL == uf->resend_ev)
+			continue;
+
+		if (tx_ut_debugging(TX_UT_DBG_ACK | TX_UT_DBG_TIMEOUT, um->to)) {
+			g_debug("TX UT[%s]: %s: fragment #%u/%u seq=0x%04x to %s "
+				"reported missing, fragment #%u received",
+				nid_to_string(&um->mid), G_STRFUNC,
+				f + 1, um->fragcnt, um->seqno,
+				gnet_host_to_string(um->to), highest + 1);
+		}
+
+		gnet_stats_inc_general(GNR_UDP_SR_TX_FRAGMENTS_FAST_RESENT);
+		cq_expire(uf->resend_ev);		/* Calls ut_frag_resend() */
+	}
+}
+
 /***
  *** Routines exported to the RX side of the semi-reliable UDP layer.
  ***/
@@ -1743,6 +2390,8 @@ ut_got_ack(txdrv_t *tx, const gnet_host_t *from, const struct ut_ack *ack)
 	struct attr *attr = tx->opaque;
 	struct ut_msg *um;
 	struct ut_frag *uf;
+	struct ut_peer *up;
+	struct ut_acked ua;
 	const char *reason;
 
 	ut_attr_check(attr);
@@ -1826,6 +2475,16 @@ ut_got_ack(txdrv_t *tx, const gnet_host_t *from, const struct ut_ack *ack)
 	um->alive = TRUE;
 	cq_cancel(&um->ear_ev);
 
+	/*
+	 * The congestion state of the host remains valid even if the message
+	 * is freed below: it lingers when the last reference goes.
+	 */
+
+	up = um->peer;
+	ua.rtt = -1;
+	ua.count = 0;
+	tm_now_exact(&ua.now);
+
 	if (ack->ear)
 		goto ear_nack;		/* Got an EAR NACK, not a fragment ACK */
 
@@ -1840,9 +2499,17 @@ ut_got_ack(txdrv_t *tx, const gnet_host_t *from, const struct ut_ack *ack)
 		ack->received == um->fragcnt ||
 		(ack->cumulative && ack->fragno + 1 == um->fragcnt)
 	) {
+		unsigned i;
+
+		for (i = 0; i < um->fragcnt; i++) {
+			uf = um->fragments[i];
+			if (uf != NULL)
+				ut_frag_acked(uf, &ua);
+		}
+
 		um->fragsent = um->fragcnt;		/* Signals: all fragments received */
 		ut_msg_free(um, TRUE);
-		return;
+		goto done;
 	}
 
 	/*
@@ -1857,8 +2524,8 @@ ut_got_ack(txdrv_t *tx, const gnet_host_t *from, const struct ut_ack *ack)
 	if (uf != NULL) {
 		g_assert(ack->fragno == uf->fragno);
 
-		if (ut_frag_free(uf, TRUE))
-			return;		/* Was the last fragment */
+		if (ut_frag_ack(uf, &ua))
+			goto done;		/* Was the last fragment */
 	}
 
 	/*
@@ -1871,8 +2538,8 @@ ut_got_ack(txdrv_t *tx, const gnet_host_t *from, const struct ut_ack *ack)
 
 		for (i = 0; i < ack->fragno; i++) {
 			uf = um->fragments[i];
-			if (uf != NULL && ut_frag_free(uf, TRUE))
-				return;		/* Was the last fragment */
+			if (uf != NULL && ut_frag_ack(uf, &ua))
+				goto done;		/* Was the last fragment */
 		}
 	}
 
@@ -1892,6 +2559,7 @@ ut_got_ack(txdrv_t *tx, const gnet_host_t *from, const struct ut_ack *ack)
 		unsigned f;
 		uint32 mask = 1;			/* bit 0 */
 		unsigned frags = base;		/* Counts received fragments */
+		unsigned highest = ack->fragno;	/* Highest received fragment */
 
 		max = MIN(max, um->fragcnt);
 
@@ -1899,8 +2567,9 @@ ut_got_ack(txdrv_t *tx, const gnet_host_t *from, const struct ut_ack *ack)
 			if (0 == (ack->missing & mask)) {
 				uf = um->fragments[f];		/* This fragment was received */
 				frags++;
-				if (uf != NULL && ut_frag_free(uf, TRUE))
-					return;		/* Was the last fragment */
+				highest = MAX(highest, f);
+				if (uf != NULL && ut_frag_ack(uf, &ua))
+					goto done;		/* Was the last fragment */
 			}
 		}
 
@@ -1913,10 +2582,18 @@ ut_got_ack(txdrv_t *tx, const gnet_host_t *from, const struct ut_ack *ack)
 		if (max < um->fragcnt && ack->received == frags + um->fragcnt - max) {
 			for (f = max; f < um->fragcnt; f++) {
 				uf = um->fragments[f];
-				if (uf != NULL && ut_frag_free(uf, TRUE))
-					return;		/* Was the last fragment */
+				if (uf != NULL && ut_frag_ack(uf, &ua))
+					goto done;		/* Was the last fragment */
 			}
+			highest = um->fragcnt - 1;
 		}
+
+		/*
+		 * The bitmap tells us which fragments are missing: resend those
+		 * that were overtaken by enough fragments sent after them.
+		 */
+
+		ut_fast_resend(um, base, max, ack->missing, highest);
 	}
 
 	/* FALL THROUGH */
@@ -1932,6 +2609,18 @@ ear_nack:
 
 	um->expecting_ack = FALSE;
 
+	/* FALL THROUGH */
+
+done:
+	/*
+	 * Update the congestion state of the host: a new RTT sample changes the
+	 * estimated queuing delay, which drives the congestion window.
+	 */
+
+	if (ua.rtt >= 0)
+		ut_peer_rtt_sample(up, ua.rtt);
+
+	ut_peer_acked(up, ua.count);
 	return;
 
 spurious:
@@ -2060,6 +2749,8 @@ tx_ut_init(txdrv_t *tx, void *args)
 	attr->tag = targs->tag;				/* struct copy */
 	attr->improved_acks = booleanize(targs->advertise_improved_acks);
 	attr->ear_support = booleanize(targs->ear_support);
+	attr->peers = hikset_create_any(offsetof(struct ut_peer, to),
+		gnet_host_hash, gnet_host_eq);
 
 	for (i = 0; i < G_N_ELEMENTS(attr->pending); i++) {
 		eslist_init(&attr->pending[i], offsetof(struct ut_queued, lk));
@@ -2110,6 +2801,8 @@ tx_ut_destroy(txdrv_t *tx)
 	idtable_foreach(attr->seq, ut_destroy_msg, NULL);
 	idtable_destroy(attr->seq);
 	ut_pending_discard(attr);
+	hikset_foreach(attr->peers, ut_destroy_peer, NULL);
+	hikset_free_null(&attr->peers);
 
 	attr->magic = 0;
 	WFREE(attr);
@@ -2173,13 +2866,14 @@ tx_ut_sendto(txdrv_t *tx, pmsg_t *mb, const gnet_host_t *to)
 		gnet_stats_inc_general(GNR_UDP_SR_TX_MESSAGES_DEFLATED);
 
 	/*
-	 * Send all the fragments immediately.
+	 * Send all the fragments immediately, as far as the congestion window
+	 * to the destination allows.
 	 */
 
 	for (i = 0; i < um->fragcnt; i++) {
 		struct ut_frag *uf = um->fragments[i];
 
-		ut_frag_send(uf);
+		ut_frag_xmit(uf);
 	}
 
 	return pmsg_size(mb);		/* "wrote" the whole message */
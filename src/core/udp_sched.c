@@ -31,23 +31,41 @@
  * manner according to available bandwidth.  Packets are silently dropped
  * when they become too old.
  *
- * Packets in the LIFO stack are also processed by destination address to avoid
- * flooding the destination with too many packets: when an entry in the LIFO
- * is processed, its destination is remembered and we skip other items to the
- * same destination until we have processed all the queued items and bandwidth
- * remains, at which time we go back to the top of the stack and resume.
+ * Sending is paced continuously through token buckets rather than flushed
+ * at the beginning of each bandwidth scheduling period, since bursts of
+ * datagrams are likely to be lost somewhere along the path and cause
+ * needless RPC timeouts and retransmissions on the other end:
+ *
+ * - a global bucket, filled at the rate of the bandwidth scheduler, spreads
+ *   the traffic over the period.
+ *
+ * - a bucket per flow, i.e. per destination address and traffic class,
+ *   avoids flooding the destination with too many packets and makes sure
+ *   one single host does not capture all the available outgoing bandwidth.
+ *   Packets sent with the highest priority are not held by the flow bucket
+ *   but are still charged to it.
+ *
+ * Buckets can go into debt when a large datagram is sent, and traffic is
+ * held until the debt is repaid.  When traffic is held, a callout event is
+ * armed to resume sending as soon as the relevant bucket is replenished.
+ *
+ * The traffic class is inferred from the Gnutella header of the datagram:
+ * DHT RPC requests, DHT RPC replies, GUESS queries and UDP pings, OOB query
+ * hits (including all the semi-reliable UDP traffic) and everything else.
+ * Queueing delay and drops are accounted for each traffic class.
  *
  * This layer stops accepting packets (i.e. it returns 0 on send() operations)
  * when its amount buffered is 3 times the amount of data that can be sent per
  * second.
  *
- * Scheduling of UDP packets is normally done once per second but in the advent
- * all the bandwidth was not consumed, incoming packets are sent immediately
- * until no more bandwidth is available, at which point we start queuing again.
+ * When all the buckets allow it, incoming packets are sent immediately until
+ * no more bandwidth is available, at which point we start queuing again.
  *
- * An scheduling queue is maintained by priority to send traffic ahead of any 
- * other less prioritary packets.  This is typically used for acknowledgments,
- * since delaying an ACK will likely cause retransmission on the other end.
+ * A scheduling queue is maintained by priority and by traffic class to send
+ * traffic ahead of any other less prioritary packets.  This is typically used
+ * for acknowledgments, since delaying an ACK will likely cause retransmission
+ * on the other end.  Within a given priority, DHT replies are sent first,
+ * then DHT requests, GUESS traffic, OOB hits and finally the other traffic.
  *
  * This layer is at the bottom of the TX stacks, but it can be used by several
  * TX stacks which happen to have the same shared bandwidth pool.  Therefore,
@@ -62,16 +80,21 @@
 
 #include "udp_sched.h"
 #include "bsched.h"
+#include "gnet_stats.h"
 #include "inet.h"
 #include "tx.h"
 #include "tx_dgram.h"
 
+#include "if/core/gnutella.h"
+#include "if/dht/kademlia.h"
+
 #include "lib/atoms.h"
+#include "lib/cq.h"
 #include "lib/eslist.h"
 #include "lib/gnet_host.h"
 #include "lib/hashing.h"
 #include "lib/hashlist.h"
-#include "lib/hset.h"
+#include "lib/hikset.h"
 #include "lib/log.h"
 #include "lib/palloc.h"
 #include "lib/pmsg.h"
@@ -85,6 +108,14 @@
 
 #define UDP_SCHED_EXPIRE	5	/**< Seconds before expiring unsent messages */
 #define UDP_SCHED_FACTOR	3	/**< Stop when that many times the b/w queued */
+#define UDP_SCHED_BURST		100	/**< Global bucket depth, in ms of b/w */
+#define UDP_SCHED_MIN_BURST	1500	/**< Minimal bucket depth, in bytes */
+#define UDP_SCHED_FLOW_SHARE	4	/**< Max b/w share of a flow is 1/4 */
+#define UDP_SCHED_FLOW_MIN	4096	/**< Minimal flow rate, in bytes/s */
+#define UDP_SCHED_FLOW_RATE	65536	/**< Flow rate when b/w is unlimited */
+#define UDP_SCHED_FLOW_BURST	250	/**< Flow bucket depth, in ms of b/w */
+#define UDP_SCHED_FLOW_LINGER	2000	/**< ms before reclaiming idle flows */
+#define UDP_SCHED_DELAY_SMOOTH	8	/**< Queueing delay EMA smoothing */
 
 #define udp_sched_log(lvl, fmt, ...)						\
 G_STMT_START {												\
@@ -93,6 +124,45 @@ G_STMT_START {												\
 } G_STMT_END
 
 
+/**
+ * Traffic classes, in the order in which they are served for a given
+ * priority.
+ */
+enum udp_sched_class {
+	UDP_SCHED_CLS_DHT_ACK = 0,		/**< DHT RPC replies */
+	UDP_SCHED_CLS_DHT_RPC,			/**< DHT RPC requests */
+	UDP_SCHED_CLS_GUESS,			/**< GUESS queries, UDP pings and pongs */
+	UDP_SCHED_CLS_OOB,				/**< OOB query hits, semi-reliable UDP */
+	UDP_SCHED_CLS_OTHER,			/**< Any other traffic */
+
+	UDP_SCHED_CLS_COUNT
+};
+
+/**
+ * A token bucket.
+ *
+ * Tokens are bytes, and the bucket can go into debt (negative amount of
+ * tokens) when a datagram larger than the amount of available tokens is sent.
+ */
+struct udp_bucket {
+	int64 tokens;					/**< Available tokens, in bytes */
+	tm_t last;						/**< Last refill time */
+};
+
+/**
+ * A flow, i.e. the traffic sent to a given destination for a traffic class.
+ */
+struct udp_flow_key {
+	gnet_host_t to;					/**< Destination address */
+	enum udp_sched_class cls;		/**< Traffic class */
+};
+
+struct udp_flow {
+	struct udp_flow_key key;		/**< Flow key (embedded) */
+	struct udp_bucket bucket;		/**< Token bucket for the flow */
+	uint queued;					/**< Amount of queued messages */
+};
+
 enum udp_sched_magic { UDP_SCHED_MAGIC = 0x23e00967 };
 
 /**
@@ -110,12 +180,18 @@ struct udp_sched {
 	pool_t *txpool;					/**< TX descriptor pool */
 	bio_source_t *bio;				/**< Bandwidth-limited I/O source */
 	wrap_io_t *wio;					/**< Cached wrapped IO object on socket */
-	eslist_t lifo[PMSG_P_COUNT];	/**< LIFO stacks of TX descriptors */
+	eslist_t lifo[PMSG_P_COUNT][UDP_SCHED_CLS_COUNT];	/**< LIFO stacks */
 	eslist_t tx_released;			/**< Deferred TX descriptor freeing */
-	hset_t *seen;					/**< Remembers destinations processed */
+	hikset_t *flows;				/**< Flows, by destination and class */
 	hash_list_t *stacks;			/**< TX stacks using us */
+	cevent_t *pacing_ev;			/**< Resumes sending of held traffic */
+	struct udp_bucket bucket;		/**< Global token bucket */
+	tm_t now;						/**< Time of last bucket refilling */
+	int64 rate;						/**< Current rate (bytes/s), 0 = unlimited */
 	size_t buffered;				/**< Amount buffered (regular + urgent) */
+	time_delta_t flow_wait;			/**< Min wait (ms) of held flows, 0=none */
 	unsigned used_all:1;			/**< Set when all b/w was used */
+	unsigned paced:1;				/**< Set when global bucket is empty */
 	unsigned flow_controlled:1;		/**< Whether we flow-controlled */
 };
 
@@ -140,7 +216,9 @@ struct udp_tx_desc {
 	const gnet_host_t *to;			/**< Destination address (atom) */
 	const txdrv_t *tx;				/**< TX stack origin */
 	const struct tx_dgram_cb *cb;	/**< Callback actions on datagram */
+	struct udp_flow *flow;			/**< Flow to which message belongs */
 	slink_t lnk;					/**< LIFO queue link */
+	tm_t queued;					/**< When message was queued */
 	time_t expire;					/**< Expiration time */
 };
 
@@ -177,6 +255,330 @@ udp_tx_stack_eq(const void *a, const void *b)
 	return ua->tx == ub->tx;
 }
 
+static uint
+udp_flow_key_hash(const void *key)
+{
+	const struct udp_flow_key *k = key;
+
+	return gnet_host_hash(&k->to) + integer_hash(k->cls);
+}
+
+static bool
+udp_flow_key_eq(const void *a, const void *b)
+{
+	const struct udp_flow_key *ka = a, *kb = b;
+
+	return ka->cls == kb->cls && gnet_host_eq(&ka->to, &kb->to);
+}
+
+/**
+ * Statistics counting the messages dropped by the scheduler, by class.
+ */
+static const gnr_stats_t udp_sched_dropped_stat[] = {
+	GNR_UDP_SCHED_DHT_ACK_DROPPED,
+	GNR_UDP_SCHED_DHT_RPC_DROPPED,
+	GNR_UDP_SCHED_GUESS_DROPPED,
+	GNR_UDP_SCHED_OOB_DROPPED,
+	GNR_UDP_SCHED_OTHER_DROPPED,
+};
+
+/**
+ * Statistics holding the average queueing delay, by class.
+ */
+static const gnr_stats_t udp_sched_delay_stat[] = {
+	GNR_UDP_SCHED_DHT_ACK_DELAY,
+	GNR_UDP_SCHED_DHT_RPC_DELAY,
+	GNR_UDP_SCHED_GUESS_DELAY,
+	GNR_UDP_SCHED_OOB_DELAY,
+	GNR_UDP_SCHED_OTHER_DELAY,
+};
+
+/**
+ * Exponential moving average of the queueing delay, by class, in us.
+ *
+ * These are shared by all the schedulers, but traffic classes are mostly
+ * specific to one scheduler anyway: DHT traffic has its own bandwidth.
+ */
+static time_delta_t udp_sched_delay[UDP_SCHED_CLS_COUNT];
+
+static const char *
+udp_sched_class_to_string(enum udp_sched_class cls)
+{
+	switch (cls) {
+	case UDP_SCHED_CLS_DHT_ACK:	return "DHT ACK";
+	case UDP_SCHED_CLS_DHT_RPC:	return "DHT RPC";
+	case UDP_SCHED_CLS_GUESS:	return "GUESS";
+	case UDP_SCHED_CLS_OOB:		return "OOB";
+	case UDP_SCHED_CLS_OTHER:	return "other";
+	case UDP_SCHED_CLS_COUNT:	break;
+	}
+
+	return "unknown";
+}
+
+/**
+ * Determine the traffic class of a message.
+ *
+ * @param mb		the message to send
+ * @param tx		the TX stack sending the message
+ */
+static enum udp_sched_class
+udp_sched_classify(const pmsg_t *mb, const txdrv_t *tx)
+{
+	const void *header;
+
+	/*
+	 * Traffic from a TX stack with a layer above the datagram one comes
+	 * from the semi-reliable UDP layer, which is only used to send back
+	 * query hits (and acknowledgments for the ones we receive).
+	 */
+
+	if (tx->upper != NULL)
+		return UDP_SCHED_CLS_OOB;
+
+	if (pmsg_size(mb) < GTA_HEADER_SIZE)
+		return UDP_SCHED_CLS_OTHER;
+
+	header = pmsg_start(mb);
+
+	switch (gnutella_header_get_function(header)) {
+	case GTA_MSG_DHT:
+		if (pmsg_size(mb) < KDA_HEADER_SIZE)
+			return UDP_SCHED_CLS_OTHER;
+		/* Requests have odd function codes, their replies the next one */
+		return (kademlia_header_get_function(header) & 0x1) ?
+			UDP_SCHED_CLS_DHT_RPC : UDP_SCHED_CLS_DHT_ACK;
+	case GTA_MSG_INIT:
+	case GTA_MSG_INIT_RESPONSE:
+	case GTA_MSG_SEARCH:
+		return UDP_SCHED_CLS_GUESS;
+	case GTA_MSG_SEARCH_RESULTS:
+		return UDP_SCHED_CLS_OOB;
+	default:
+		break;
+	}
+
+	return UDP_SCHED_CLS_OTHER;
+}
+
+/**
+ * Account for a message leaving the scheduler, sent or dropped.
+ *
+ * @param cls		the traffic class of the message
+ * @param queued	when message was queued, NULL if it was sent immediately
+ * @param now		current time
+ * @param dropped	whether the message was dropped
+ */
+static void
+udp_sched_class_account(enum udp_sched_class cls,
+	const tm_t *queued, const tm_t *now, bool dropped)
+{
+	time_delta_t delay, *avg;
+
+	STATIC_ASSERT(UDP_SCHED_CLS_COUNT == G_N_ELEMENTS(udp_sched_dropped_stat));
+	STATIC_ASSERT(UDP_SCHED_CLS_COUNT == G_N_ELEMENTS(udp_sched_delay_stat));
+	g_assert(UNSIGNED(cls) < UDP_SCHED_CLS_COUNT);
+
+	if (dropped) {
+		gnet_stats_inc_general(udp_sched_dropped_stat[cls]);
+		return;
+	}
+
+	delay = NULL == queued ? 0 : MAX(0, tm_elapsed_us(now, queued));
+	avg = &udp_sched_delay[cls];
+	*avg += (delay - *avg) / UDP_SCHED_DELAY_SMOOTH;
+
+	gnet_stats_set_general(udp_sched_delay_stat[cls], *avg / 1000);
+}
+
+/**
+ * @return depth of a bucket filled at the specified rate, in bytes.
+ */
+static int64
+udp_bucket_depth(int64 rate, int ms)
+{
+	return MAX(rate * ms / 1000, UDP_SCHED_MIN_BURST);
+}
+
+/**
+ * Refill bucket, at the specified rate (bytes/s), up to its depth.
+ */
+static void
+udp_bucket_refill(struct udp_bucket *b,
+	int64 rate, int64 depth, const tm_t *now)
+{
+	time_delta_t elapsed = tm_elapsed_us(now, &b->last);
+	int64 tokens;
+
+	if (elapsed <= 0)
+		return;
+
+	/*
+	 * Only move the refill time when tokens are added, so that frequent
+	 * refilling at a low rate does not lose tokens due to rounding.
+	 */
+
+	tokens = rate * elapsed / 1000000;
+
+	if (b->tokens + tokens >= depth) {
+		b->tokens = depth;
+		b->last = *now;
+	} else if (tokens != 0) {
+		b->tokens += tokens;
+		b->last = *now;
+	}
+}
+
+/**
+ * @return amount of milliseconds to wait before the bucket has tokens again.
+ */
+static time_delta_t
+udp_bucket_wait(const struct udp_bucket *b, int64 rate)
+{
+	if (b->tokens > 0 || rate <= 0)
+		return 0;
+
+	return (1 - b->tokens) * 1000 / rate + 1;
+}
+
+/**
+ * @return the rate at which flows are paced, in bytes/s.
+ */
+static int64
+udp_sched_flow_rate(const udp_sched_t *us)
+{
+	if (0 == us->rate)
+		return UDP_SCHED_FLOW_RATE;
+
+	return MAX(us->rate / UDP_SCHED_FLOW_SHARE, UDP_SCHED_FLOW_MIN);
+}
+
+/**
+ * Refill the global bucket, recording the current time and rate.
+ */
+static void
+udp_sched_refill(udp_sched_t *us)
+{
+	tm_now_exact(&us->now);
+	us->rate = bio_bw_rate(us->bio);
+
+	if (us->rate != 0) {
+		udp_bucket_refill(&us->bucket, us->rate,
+			udp_bucket_depth(us->rate, UDP_SCHED_BURST), &us->now);
+	}
+}
+
+/**
+ * Refill flow bucket.
+ */
+static void
+udp_flow_refill(const udp_sched_t *us, struct udp_flow *uf)
+{
+	int64 rate = udp_sched_flow_rate(us);
+
+	udp_bucket_refill(&uf->bucket, rate,
+		udp_bucket_depth(rate, UDP_SCHED_FLOW_BURST), &us->now);
+}
+
+/**
+ * Get the flow for a destination and traffic class, creating it if needed.
+ */
+static struct udp_flow *
+udp_flow_get(udp_sched_t *us, const gnet_host_t *to, enum udp_sched_class cls)
+{
+	struct udp_flow_key key;
+	struct udp_flow *uf;
+
+	ZERO(&key);
+	gnet_host_copy(&key.to, to);
+	key.cls = cls;
+
+	uf = hikset_lookup(us->flows, &key);
+
+	if (NULL == uf) {
+		int64 rate = udp_sched_flow_rate(us);
+
+		WALLOC0(uf);
+		uf->key = key;		/* Struct copy */
+		uf->bucket.tokens = udp_bucket_depth(rate, UDP_SCHED_FLOW_BURST);
+		uf->bucket.last = us->now;
+		hikset_insert_key(us->flows, &uf->key);
+	} else {
+		udp_flow_refill(us, uf);
+	}
+
+	return uf;
+}
+
+/**
+ * Charge the buckets for a message that was just sent.
+ */
+static void
+udp_sched_charge(udp_sched_t *us, struct udp_flow *uf, const pmsg_t *mb)
+{
+	int len = pmsg_size(mb);
+
+	if (us->rate != 0)
+		us->bucket.tokens -= len;
+
+	uf->bucket.tokens -= len;
+}
+
+/**
+ * @return amount of ms to wait before a message of given priority can be
+ * sent on the flow, 0 meaning it can be sent now.
+ */
+static time_delta_t
+udp_sched_wait(const udp_sched_t *us, const struct udp_flow *uf, uint prio)
+{
+	time_delta_t wait = udp_bucket_wait(&us->bucket, us->rate);
+
+	if (PMSG_P_HIGHEST != prio) {
+		time_delta_t fwait =
+			udp_bucket_wait(&uf->bucket, udp_sched_flow_rate(us));
+		wait = MAX(wait, fwait);
+	}
+
+	return wait;
+}
+
+/**
+ * Reclaim flow if idle (hikset iterator).
+ *
+ * @return TRUE if flow was freed.
+ */
+static bool
+udp_flow_reclaim(void *data, void *udata)
+{
+	struct udp_flow *uf = data;
+	const udp_sched_t *us = udata;
+
+	if (uf->queued != 0)
+		return FALSE;
+
+	if (tm_elapsed_ms(&us->now, &uf->bucket.last) < UDP_SCHED_FLOW_LINGER)
+		return FALSE;
+
+	WFREE(uf);
+	return TRUE;
+}
+
+/**
+ * Free flow (hikset iterator).
+ */
+static bool
+udp_flow_free(void *data, void *unused_udata)
+{
+	struct udp_flow *uf = data;
+
+	(void) unused_udata;
+
+	g_assert(0 == uf->queued);
+
+	WFREE(uf);
+	return TRUE;
+}
+
 /**
  * Wrapper used by palloc() to allocate a new UDP TX descriptor.
  */
@@ -244,6 +646,20 @@ udp_tx_desc_flag_release(struct udp_tx_desc *txd, udp_sched_t *us)
 	eslist_append(&us->tx_released, txd);
 }
 
+/**
+ * Account for a TX descriptor leaving the LIFO queue.
+ */
+static void
+udp_tx_desc_dequeue(struct udp_tx_desc *txd, udp_sched_t *us)
+{
+	udp_tx_desc_check(txd, TRUE);
+	udp_sched_check(us);
+	g_assert(txd->flow->queued != 0);
+
+	us->buffered = size_saturate_sub(us->buffered, pmsg_size(txd->mb));
+	txd->flow->queued--;
+}
+
 /**
  * Release message (eslist iterator).
  * 
@@ -278,7 +694,7 @@ udp_tx_desc_drop(void *data, void *udata)
 	udp_tx_desc_check(txd, TRUE);
 	g_assert(1 == pmsg_refcnt(txd->mb));
 
-	us->buffered = size_saturate_sub(us->buffered, pmsg_size(txd->mb));
+	udp_tx_desc_dequeue(txd, us);
 	udp_tx_desc_flag_release(txd, us);
 	return TRUE;
 }
@@ -298,8 +714,11 @@ udp_tx_desc_expired(void *data, void *udata)
 	udp_tx_desc_check(txd, TRUE);
 
 	if (delta_time(tm_time(), txd->expire) > 0) {
-		udp_sched_log(1, "%p: expiring mb=%p (%d bytes) prio=%u",
-			us, txd->mb, pmsg_size(txd->mb), pmsg_prio(txd->mb));
+		udp_sched_log(1, "%p: expiring mb=%p (%d bytes) prio=%u class=%s",
+			us, txd->mb, pmsg_size(txd->mb), pmsg_prio(txd->mb),
+			udp_sched_class_to_string(txd->flow->key.cls));
+
+		udp_sched_class_account(txd->flow->key.cls, NULL, NULL, TRUE);
 
 		if (txd->cb->add_tx_dropped != NULL)
 			(*txd->cb->add_tx_dropped)(txd->tx->owner, 1);	/* Dropped in TX */
@@ -458,47 +877,82 @@ udp_tx_desc_send(void *data, void *udata)
 {
 	struct udp_tx_desc *txd = data;
 	udp_sched_t *us = udata;
+	struct udp_flow *uf;
 	unsigned prio;
 
 	udp_sched_check(us);
 	udp_tx_desc_check(txd, TRUE);
 
-	if (us->used_all)
+	if (us->used_all || us->paced)
 		return FALSE;
 
+	if (us->rate != 0 && us->bucket.tokens <= 0) {
+		us->paced = TRUE;
+		return FALSE;
+	}
+
 	/*
-	 * Avoid flushing consecutive queued messages to the same destination,
-	 * for regular (non-prioritary) messages.
+	 * Hold regular messages when their flow is exhausted, remembering when
+	 * the first held flow will be able to send again.
 	 *
 	 * This serves two purposes:
 	 *
 	 * 1- It makes sure one single host does not capture all the available
 	 *    outgoing bandwidth.
 	 *
-	 * 2- It somehow delays consecutive packets to a given host thereby reducing
+	 * 2- It delays consecutive packets to a given host thereby reducing
 	 *    flooding and hopefully avoiding saturation of its RX flow.
 	 */
 
 	prio = pmsg_prio(txd->mb);
-
-	if (PMSG_P_DATA == prio && hset_contains(us->seen, txd->to)) {
-		udp_sched_log(2, "%p: skipping mb=%p (%d bytes) to %s",
-			us, txd->mb, pmsg_size(txd->mb), gnet_host_to_string(txd->to));
-		return FALSE;
+	uf = txd->flow;
+	udp_flow_refill(us, uf);
+
+	if (PMSG_P_HIGHEST != prio) {
+		time_delta_t wait =
+			udp_bucket_wait(&uf->bucket, udp_sched_flow_rate(us));
+
+		if (wait != 0) {
+			udp_sched_log(2, "%p: holding mb=%p (%d bytes) to %s for %ld ms",
+				us, txd->mb, pmsg_size(txd->mb),
+				gnet_host_to_string(txd->to), (long) wait);
+			us->flow_wait = 0 == us->flow_wait ?
+				wait : MIN(wait, us->flow_wait);
+			return FALSE;
+		}
 	}
 
-	if (udp_sched_mb_sendto(us, txd->mb, txd->to, txd->tx, txd->cb)) {
-		if (PMSG_P_DATA == prio && pmsg_was_sent(txd->mb))
-			hset_insert(us->seen, atom_host_get(txd->to));
-	} else {
+	if (!udp_sched_mb_sendto(us, txd->mb, txd->to, txd->tx, txd->cb))
 		return FALSE;		/* Unsent, leave it in the queue */
+
+	if (pmsg_was_sent(txd->mb)) {
+		udp_sched_charge(us, uf, txd->mb);
+		udp_sched_class_account(uf->key.cls, &txd->queued, &us->now, FALSE);
 	}
 
-	us->buffered = size_saturate_sub(us->buffered, pmsg_size(txd->mb));
+	udp_tx_desc_dequeue(txd, us);
 	udp_tx_desc_flag_release(txd, us);
 	return TRUE;
 }
 
+static void udp_sched_pacing_wakeup(cqueue_t *cq, void *obj);
+
+/**
+ * Arm the pacing event to resume sending in the specified amount of ms,
+ * unless it is already due to fire earlier.
+ */
+static void
+udp_sched_pacing_arm(udp_sched_t *us, time_delta_t delay)
+{
+	delay = MAX(1, delay);
+
+	if (NULL == us->pacing_ev) {
+		us->pacing_ev = cq_main_insert(delay, udp_sched_pacing_wakeup, us);
+	} else if (cq_remaining(us->pacing_ev) > delay) {
+		cq_resched(us->pacing_ev, delay);
+	}
+}
+
 /**
  * Send datagram.
  *
@@ -517,16 +971,29 @@ udp_sched_send(udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
 {
 	int len;
 	struct udp_tx_desc *txd;
+	struct udp_flow *uf;
 	uint prio;
 
 	len = pmsg_size(mb);
+	prio = pmsg_prio(mb);
+
+	udp_sched_refill(us);
+	uf = udp_flow_get(us, to, udp_sched_classify(mb, tx));
 
 	/*
-	 * Try to send immediately if we have bandwidth.
+	 * Try to send immediately if we have bandwidth and the buckets allow it.
 	 */
 
-	if (!us->used_all && udp_sched_mb_sendto(us, mb, to, tx, cb))
+	if (
+		!us->used_all && 0 == udp_sched_wait(us, uf, prio) &&
+		udp_sched_mb_sendto(us, mb, to, tx, cb)
+	) {
+		if (pmsg_was_sent(mb)) {
+			udp_sched_charge(us, uf, mb);
+			udp_sched_class_account(uf->key.cls, NULL, &us->now, FALSE);
+		}
 		return len;		/*  Message "sent" */
+	}
 
 	/*
 	 * If we already have enough data enqueued, flow-control the upper
@@ -539,8 +1006,6 @@ udp_sched_send(udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
 	 *		--RAM, 2012-10-12
 	 */
 
-	prio = pmsg_prio(mb);
-
 	if (
 		PMSG_P_HIGHEST != prio &&
 		us->buffered >= UDP_SCHED_FACTOR * bio_bw_per_second(us->bio)
@@ -572,10 +1037,13 @@ udp_sched_send(udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
 	txd->to = atom_host_get(to);
 	txd->tx = tx;
 	txd->cb = cb;
+	txd->flow = uf;
+	txd->queued = us->now;
 	txd->expire = time_advance(tm_time(), UDP_SCHED_EXPIRE);
 
-	udp_sched_log(4, "%p: queuing mb=%p (%d bytes) prio=%u",
-		us, mb, pmsg_size(mb), pmsg_prio(mb));
+	udp_sched_log(4, "%p: queuing mb=%p (%d bytes) prio=%u class=%s",
+		us, mb, pmsg_size(mb), pmsg_prio(mb),
+		udp_sched_class_to_string(uf->key.cls));
 
 	/*
 	 * The queue used is a LIFO to avoid buffering delaying all the messages.
@@ -584,8 +1052,18 @@ udp_sched_send(udp_sched_t *us, pmsg_t *mb, const gnet_host_t *to,
 	 */
 
 	g_assert(prio < G_N_ELEMENTS(us->lifo));
-	eslist_prepend(&us->lifo[prio], txd);
+	eslist_prepend(&us->lifo[prio][uf->key.cls], txd);
 	us->buffered = size_saturate_add(us->buffered, len);
+	uf->queued++;
+
+	/*
+	 * Unless we are out of bandwidth for this period, in which case the
+	 * start of the next period will resume sending, make sure we resume
+	 * as soon as the buckets allow it.
+	 */
+
+	if (!us->used_all)
+		udp_sched_pacing_arm(us, udp_sched_wait(us, uf, prio));
 
 	return len;		/* Message queued, but tell upper layers it's sent */
 }
@@ -601,29 +1079,6 @@ udp_sched_process(udp_sched_t *us, eslist_t *list)
 	eslist_foreach_remove(list, udp_tx_desc_send, us);
 }
 
-/**
- * Release host atom.
- */
-static void
-udp_seen_host_free(const void *data, void *udata)
-{
-	(void) udata;
-
-	atom_host_free(data);
-}
-
-/**
- * Remove all entries in the "seen" hashed set.
- */
-static void
-udp_sched_seen_clear(udp_sched_t *us)
-{
-	udp_sched_check(us);
-
-	hset_foreach(us->seen, udp_seen_host_free, NULL);
-	hset_clear(us->seen);
-}
-
 /**
  * Reclaim all pending TX descriptors.
  */
@@ -706,6 +1161,116 @@ udp_sched_service(udp_sched_t *us, struct udp_service_ctx *ctx)
 	hash_list_foreach(us->stacks, udp_sched_tx_service, ctx);
 }
 
+/**
+ * Send queued traffic as long as we have bandwidth and the buckets allow it.
+ */
+static void
+udp_sched_drain(udp_sched_t *us)
+{
+	size_t buffered;
+
+	udp_sched_check(us);
+
+	udp_sched_refill(us);
+	us->paced = FALSE;
+	us->flow_wait = 0;
+
+	/*
+	 * Schedule pending traffic in LIFO order (starting from head),
+	 * processing the highest priority queue first and, within a priority,
+	 * the traffic classes in their order of importance.
+	 *
+	 * We loop as long as traffic is sent because reclaiming sent messages
+	 * can re-queue traffic.
+	 */
+
+	do {
+		unsigned i, j;
+
+		buffered = us->buffered;
+
+		for (i = G_N_ELEMENTS(us->lifo); i != 0; i--) {
+			for (j = 0; j < UDP_SCHED_CLS_COUNT; j++) {
+				if (us->used_all || us->paced)
+					goto done;
+				udp_sched_process(us, &us->lifo[i-1][j]);
+			}
+		}
+	done:
+		udp_sched_tx_release(us);		/* May re-queue traffic */
+		udp_sched_log(5, "%p: loop tail: %zu bytes buffered, b/w %s%s",
+			us, us->buffered, us->used_all ? "gone" : "available",
+			us->paced ? " (paced)" : "");
+	} while (
+		!us->used_all && !us->paced &&
+		us->buffered != 0 && us->buffered != buffered
+	);
+
+	/*
+	 * If traffic is held by the buckets, resume as soon as they allow it.
+	 * When we ran out of bandwidth, the next timeslice will resume sending.
+	 */
+
+	if (0 == us->buffered || us->used_all)
+		return;
+
+	if (us->paced)
+		udp_sched_pacing_arm(us, udp_bucket_wait(&us->bucket, us->rate));
+	else if (us->flow_wait != 0)
+		udp_sched_pacing_arm(us, us->flow_wait);
+}
+
+/**
+ * Service flow-controlled upper layers if we have bandwidth again.
+ */
+static void
+udp_sched_unblock(udp_sched_t *us, int source, inputevt_cond_t cond)
+{
+	udp_sched_check(us);
+
+	if (
+		!us->used_all && us->flow_controlled &&
+		us->buffered < UDP_SCHED_FACTOR * bio_bw_per_second(us->bio)
+	) {
+		struct udp_service_ctx ctx;
+
+		us->flow_controlled = FALSE;
+		ctx.fd = source;
+		ctx.cond = cond;
+		udp_sched_service(us, &ctx);
+	}
+}
+
+/**
+ * Callout queue callback to resume sending of traffic held by the buckets.
+ */
+static void
+udp_sched_pacing_wakeup(cqueue_t *unused_cq, void *obj)
+{
+	udp_sched_t *us = obj;
+
+	udp_sched_check(us);
+	(void) unused_cq;
+
+	us->pacing_ev = NULL;		/* Callback triggered */
+
+	udp_sched_log(5, "%p: resuming, %zu bytes buffered", us, us->buffered);
+
+	udp_sched_drain(us);
+	udp_sched_unblock(us, us->wio->fd(us->wio), INPUT_EVENT_W);
+}
+
+/**
+ * Reclaim idle flows.
+ */
+static void
+udp_sched_flows_reclaim(udp_sched_t *us)
+{
+	udp_sched_check(us);
+
+	hikset_foreach_remove(us->flows, udp_flow_reclaim, us);
+}
+
 /**
  * Invoked each time a new bandwidth timeslice begins.
  */
@@ -713,59 +1278,55 @@ static void
 udp_sched_begin(void *data, int source, inputevt_cond_t cond)
 {
 	udp_sched_t *us = data;
-	unsigned i;
+	unsigned i, j;
 
 	udp_sched_check(us);
 
-	udp_sched_log(4, "%p: starting, %zu bytes buffered", us, us->buffered);
-	udp_sched_log(5, "%p: messages queued: "
-		"data=%zu, control=%zu, urgent=%zu, highest=%zu",
-		us, eslist_count(&us->lifo[PMSG_P_DATA]),
-		eslist_count(&us->lifo[PMSG_P_CONTROL]),
-		eslist_count(&us->lifo[PMSG_P_URGENT]),
-		eslist_count(&us->lifo[PMSG_P_HIGHEST]));
+	udp_sched_log(4, "%p: starting, %zu bytes buffered, %zu flows",
+		us, us->buffered, hikset_count(us->flows));
+
+	if G_UNLIKELY(GNET_PROPERTY(udp_sched_debug) >= 5) {
+		for (j = 0; j < UDP_SCHED_CLS_COUNT; j++) {
+			s_debug("%s: %p: %s messages queued: "
+				"data=%zu, control=%zu, urgent=%zu, highest=%zu, "
+				"avg delay=%ld us", G_STRFUNC, us, udp_sched_class_to_string(j),
+				eslist_count(&us->lifo[PMSG_P_DATA][j]),
+				eslist_count(&us->lifo[PMSG_P_CONTROL][j]),
+				eslist_count(&us->lifo[PMSG_P_URGENT][j]),
+				eslist_count(&us->lifo[PMSG_P_HIGHEST][j]),
+				(long) udp_sched_delay[j]);
+		}
+	}
 
 	/*
 	 * Expire old traffic that we could not send.
 	 */
 
 	for (i = 0; i < G_N_ELEMENTS(us->lifo); i++) {
-		eslist_foreach_remove(&us->lifo[i], udp_tx_desc_expired, us);
+		for (j = 0; j < UDP_SCHED_CLS_COUNT; j++) {
+			eslist_foreach_remove(&us->lifo[i][j], udp_tx_desc_expired, us);
+		}
 	}
 
 	/*
-	 * Schedule pending traffic in LIFO order (starting from head),
-	 * processing the highest priority queue first.
+	 * A new timeslice means we have bandwidth again: resume sending held
+	 * traffic, as far as the buckets allow.
 	 */
 
 	us->used_all = FALSE;
-
-	do {
-		udp_sched_seen_clear(us);
-		for (i = G_N_ELEMENTS(us->lifo); i != 0 && !us->used_all; i--) {
-			udp_sched_process(us, &us->lifo[i-1]);
-		}
-		udp_sched_tx_release(us);		/* May re-queue traffic */
-		udp_sched_log(5, "%p: loop tail: %zu bytes buffered, b/w %s",
-			us, us->buffered, us->used_all ? "gone" : "available");
-	} while (!us->used_all && us->buffered != 0);
+	udp_sched_drain(us);
+	udp_sched_flows_reclaim(us);
 
 	/*
 	 * If we did not use all the bandwidth yet and we flow-controlled
 	 * upper layers, service them.
 	 */
 
-	if (!us->used_all && us->flow_controlled) {
-		struct udp_service_ctx ctx;
+	udp_sched_unblock(us, source, cond);
 
-		us->flow_controlled = FALSE;
-		ctx.fd = source;
-		ctx.cond = cond;
-		udp_sched_service(us, &ctx);
-	}
-
-	udp_sched_log(4, "%p: done (b/w %s, %zu bytes buffered%s)",
+	udp_sched_log(4, "%p: done (b/w %s, %zu bytes buffered%s%s)",
 		us, us->used_all ? "gone" : "available", us->buffered,
+		us->paced ? ", paced" : "",
 		us->flow_controlled ? ", flow-controlled" : "");
 }
 
@@ -787,7 +1348,7 @@ udp_sched_t *
 udp_sched_make(bsched_bws_t bws, wrap_io_t *wio)
 {
 	udp_sched_t *us;
-	unsigned i;
+	unsigned i, j;
 
 	wrap_io_check(wio);
 	g_assert(wio->sendto != NULL);
@@ -797,11 +1358,15 @@ udp_sched_make(bsched_bws_t bws, wrap_io_t *wio)
 	us->txpool = pool_create("UDP TX descriptors", sizeof(struct udp_tx_desc),
 		udp_tx_desc_alloc, udp_tx_desc_free, NULL);
 	us->bio = bsched_source_add(bws, wio, BIO_F_WRITE, NULL, NULL);
+	us->wio = wio;
 	for (i = 0; i < G_N_ELEMENTS(us->lifo); i++) {
-		eslist_init(&us->lifo[i], offsetof(struct udp_tx_desc, lnk));
+		for (j = 0; j < UDP_SCHED_CLS_COUNT; j++) {
+			eslist_init(&us->lifo[i][j], offsetof(struct udp_tx_desc, lnk));
+		}
 	}
 	eslist_init(&us->tx_released, offsetof(struct udp_tx_desc, lnk));
-	us->seen = hset_create_any(gnet_host_hash, gnet_host_hash2, gnet_host_eq);
+	us->flows = hikset_create_any(offsetof(struct udp_flow, key),
+		udp_flow_key_hash, udp_flow_key_eq);
 	us->stacks = hash_list_new(udp_tx_stack_hash, udp_tx_stack_eq);
 
 	/*
@@ -811,6 +1376,10 @@ udp_sched_make(bsched_bws_t bws, wrap_io_t *wio)
 
 	bio_add_passive_callback(us->bio, udp_sched_begin, us);
 
+	udp_sched_refill(us);
+	us->bucket.tokens = udp_bucket_depth(us->rate, UDP_SCHED_BURST);
+	us->bucket.last = us->now;
+
 	return us;
 }
 
@@ -821,7 +1390,7 @@ void
 udp_sched_free(udp_sched_t *us)
 {
 	udp_sched_check(us);
-	unsigned i;
+	unsigned i, j;
 
 	/*
 	 * TX stacks are asynchronously collected, so we need to force collection
@@ -833,12 +1402,15 @@ udp_sched_free(udp_sched_t *us)
 	g_assert(0 == hash_list_length(us->stacks));
 
 	for (i = 0; i < G_N_ELEMENTS(us->lifo); i++) {
-		udp_sched_drop_all(us, &us->lifo[i]);
+		for (j = 0; j < UDP_SCHED_CLS_COUNT; j++) {
+			udp_sched_drop_all(us, &us->lifo[i][j]);
+		}
 	}
 	udp_sched_tx_release(us);
-	udp_sched_seen_clear(us);
+	cq_cancel(&us->pacing_ev);
 	pool_free(us->txpool);
-	hset_free_null(&us->seen);
+	hikset_foreach_remove(us->flows, udp_flow_free, NULL);
+	hikset_free_null(&us->flows);
 	hash_list_free(&us->stacks);
 	bsched_source_remove(us->bio);
 
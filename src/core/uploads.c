@@ -3479,6 +3479,7 @@ static const struct tx_deflate_cb upload_tx_deflate_cb = {
 	NULL,				/* add_tx_deflated */
 	upload_tx_error,	/* shutdown */
 	NULL,				/* flow_control */
+	NULL,				/* congested */
 };
 
 static void
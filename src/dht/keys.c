@@ -86,9 +86,11 @@
 
 #include "lib/atoms.h"
 #include "lib/bstr.h"
+#include "lib/cbloom.h"
 #include "lib/cq.h"
 #include "lib/dbmw.h"
 #include "lib/dbstore.h"
+#include "lib/endian.h"
 #include "lib/glib-missing.h"
 #include "lib/hikset.h"
 #include "lib/pmsg.h"
@@ -107,6 +109,7 @@
 #define KBALL_FIRST		60		/**< First k-ball update after 1 minute */
 
 #define KEYS_DB_CACHE_SIZE	512	/**< Amount of keys to keep cached in RAM */
+#define KEYS_FILTER_SIZE	4096	/**< Initial capacity of key filters */
 
 /**
  * Information about our neighbourhood (k-ball), updated periodically.
@@ -157,15 +160,16 @@ keyinfo_check(const struct keyinfo *ki)
  * Information about a key that is stored to disk and not kept in memory.
  * The structure is serialized first, not written as-is.
  *
- * Indices in the two arrays match, that is creators[i] and dbkeys[i] are
- * related: the first is the KUID of the node that publishes the value,
+ * Indices in the arrays match, that is creators[i], dbkeys[i] and types[i]
+ * are related: the first is the KUID of the node that publishes the value,
  * the second is the allocated key used within our DB backend to access
- * values (see values.c).
+ * values (see values.c) and the last is the type of the value.
  */
 struct keydata {
 	uint8 values;					/**< Amount of values stored */
 	kuid_t creators[MAX_VALUES];	/**< Secondary keys (sorted numerically) */
 	uint64 dbkeys[MAX_VALUES];		/**< Associated SDBM keys for values */
+	dht_value_type_t types[MAX_VALUES];	/**< Type of values */
 };
 
 /**
@@ -180,6 +184,18 @@ static dbmw_t *db_keydata;
 static char db_keybase[] = "dht_keys";
 static char db_keywhat[] = "DHT key data";
 
+/**
+ * Counting Bloom filters over the (primary key, secondary key) and the
+ * (primary key, value type) pairs of the values we hold.
+ *
+ * Most FIND_VALUE requests for keys we hold ask for a creator or a type of
+ * value we do not have, and most STORE requests bring values from new
+ * creators: the filters let us answer these without reading the key data
+ * from the database.
+ */
+static cbloom_t *keys_creators;
+static cbloom_t *keys_types;
+
 static cevent_t *kball_ev;		/**< Event for periodic k-ball update */
 static cperiodic_t *keys_periodic_ev;
 
@@ -401,6 +417,146 @@ lookup_secondary(const struct keydata *kd, const kuid_t *skey)
 	return 0;		/* Not found */
 }
 
+#define KEYS_CREATOR_ITEM	(2 * KUID_RAW_SIZE)	/* Primary + secondary keys */
+#define KEYS_TYPE_ITEM		(KUID_RAW_SIZE + 4)	/* Primary key + value type */
+
+/**
+ * Fill buffer with the (primary key, secondary key) filter item.
+ */
+static inline void
+keys_creator_item(char buf[KEYS_CREATOR_ITEM],
+	const kuid_t *id, const kuid_t *cid)
+{
+	memcpy(&buf[0], id, KUID_RAW_SIZE);
+	memcpy(&buf[KUID_RAW_SIZE], cid, KUID_RAW_SIZE);
+}
+
+/**
+ * Fill buffer with the (primary key, value type) filter item.
+ */
+static inline void
+keys_type_item(char buf[KEYS_TYPE_ITEM],
+	const kuid_t *id, dht_value_type_t type)
+{
+	memcpy(&buf[0], id, KUID_RAW_SIZE);
+	poke_be32(&buf[KUID_RAW_SIZE], type);
+}
+
+/**
+ * Record value in the key filters.
+ */
+static void
+keys_filter_insert(const kuid_t *id, const kuid_t *cid, dht_value_type_t type)
+{
+	char citem[KEYS_CREATOR_ITEM];
+	char titem[KEYS_TYPE_ITEM];
+
+	keys_creator_item(citem, id, cid);
+	keys_type_item(titem, id, type);
+
+	cbloom_add(keys_creators, citem, sizeof citem);
+	cbloom_add(keys_types, titem, sizeof titem);
+}
+
+/**
+ * Remove value from the key filters.
+ */
+static void
+keys_filter_remove(const kuid_t *id, const kuid_t *cid, dht_value_type_t type)
+{
+	char citem[KEYS_CREATOR_ITEM];
+	char titem[KEYS_TYPE_ITEM];
+
+	keys_creator_item(citem, id, cid);
+	keys_type_item(titem, id, type);
+
+	cbloom_remove(keys_creators, citem, sizeof citem);
+	cbloom_remove(keys_types, titem, sizeof titem);
+}
+
+/**
+ * @return whether we may hold a value from the creator under the key.
+ */
+static bool
+keys_filter_has_creator(const kuid_t *id, const kuid_t *cid)
+{
+	char citem[KEYS_CREATOR_ITEM];
+
+	keys_creator_item(citem, id, cid);
+
+	return cbloom_contains(keys_creators, citem, sizeof citem);
+}
+
+/**
+ * @return whether we may hold a value of the given type under the key.
+ */
+static bool
+keys_filter_has_type(const kuid_t *id, dht_value_type_t type)
+{
+	char titem[KEYS_TYPE_ITEM];
+
+	if (DHT_VT_ANY == type)
+		return TRUE;
+
+	keys_type_item(titem, id, type);
+
+	return cbloom_contains(keys_types, titem, sizeof titem);
+}
+
+/**
+ * Hash set iterator to record the values held under a key in the filters.
+ */
+static void
+keys_filter_load(void *val, void *unused_data)
+{
+	struct keyinfo *ki = val;
+	const struct keydata *kd;
+	int i;
+
+	(void) unused_data;
+	keyinfo_check(ki);
+
+	if (0 == ki->values)
+		return;
+
+	kd = get_keydata(ki->kuid);
+	if (NULL == kd)
+		return;
+
+	for (i = 0; i < kd->values; i++)
+		keys_filter_insert(ki->kuid, &kd->creators[i], kd->types[i]);
+}
+
+/**
+ * Record new value in the key filters, rebuilding larger filters from the
+ * key data when they hold more values than they were sized for.
+ *
+ * This must be called once the key data holding the value was written.
+ */
+static void
+keys_filter_add(const kuid_t *id, const kuid_t *cid, dht_value_type_t type)
+{
+	size_t count;
+
+	keys_filter_insert(id, cid, type);
+
+	count = cbloom_count(keys_creators);
+
+	if G_LIKELY(count <= cbloom_capacity(keys_creators))
+		return;
+
+	cbloom_free_null(&keys_creators);
+	cbloom_free_null(&keys_types);
+	keys_creators = cbloom_make(2 * count);
+	keys_types = cbloom_make(2 * count);
+
+	hikset_foreach(keys, keys_filter_load, NULL);
+
+	if (GNET_PROPERTY(dht_storage_debug))
+		g_debug("DHT STORE rebuilt key filters for %zu values (capacity %zu)",
+			cbloom_count(keys_creators), cbloom_capacity(keys_creators));
+}
+
 /**
  * See whether we can expire values stored under the key.
  *
@@ -544,6 +700,11 @@ keys_has(const kuid_t *id, const kuid_t *cid, bool store)
 	if (store)
 		ki->store_requests++;
 
+	if (!keys_filter_has_creator(id, cid)) {
+		gnet_stats_inc_general(GNR_DHT_KEYS_FILTERED_LOOKUPS);
+		return 0;
+	}
+
 	kd = get_keydata(id);
 	if (kd == NULL)
 		return 0;
@@ -622,11 +783,15 @@ keys_remove_value(const kuid_t *id, const kuid_t *cid, uint64 dbkey)
 	g_assert(idx >= 0 && idx < kd->values);
 	g_assert(dbkey == kd->dbkeys[idx]);
 
+	keys_filter_remove(id, cid, kd->types[idx]);
+
 	if (idx < kd->values - 1) {
 		memmove(&kd->creators[idx], &kd->creators[idx+1],
 			sizeof(kd->creators[0]) * (kd->values - idx - 1));
 		memmove(&kd->dbkeys[idx], &kd->dbkeys[idx+1],
 			sizeof(kd->dbkeys[0]) * (kd->values - idx - 1));
+		memmove(&kd->types[idx], &kd->types[idx+1],
+			sizeof(kd->types[0]) * (kd->values - idx - 1));
 	}
 
 	/*
@@ -669,6 +834,40 @@ keys_update_value(const kuid_t *id, time_t expire)
 	ki->next_expire = MIN(ki->next_expire, expire);
 }
 
+/**
+ * The creator of a value held under the key superseded it with a value of
+ * a different type.
+ *
+ * @param id		the primary key (existing already)
+ * @param cid		the secondary key (creator's ID)
+ * @param type		the new type of the value
+ */
+void
+keys_update_value_type(const kuid_t *id, const kuid_t *cid,
+	dht_value_type_t type)
+{
+	struct keydata *kd;
+	int idx;
+
+	g_assert(hikset_contains(keys, id));
+
+	kd = get_keydata(id);
+	if (NULL == kd)
+		return;
+
+	idx = lookup_secondary_idx(kd, cid);
+
+	g_assert(idx >= 0 && idx < kd->values);
+
+	if (type == kd->types[idx])
+		return;
+
+	keys_filter_remove(id, cid, kd->types[idx]);
+	kd->types[idx] = type;
+	dbmw_write(db_keydata, id, kd, sizeof *kd);
+	keys_filter_insert(id, cid, type);
+}
+
 /**
  * Add value to a key, recording the new association between the KUID of the
  * creator (secondary key) and the 64-bit DB key under which the value is
@@ -677,11 +876,12 @@ keys_update_value(const kuid_t *id, time_t expire)
  * @param id		the primary key (may not exist yet)
  * @param cid		the secondary key (creator's ID)
  * @param dbkey		the 64-bit DB key
+ * @param type		the type of the value
  * @param expire	expiration time for the value
  */
 void
 keys_add_value(const kuid_t *id, const kuid_t *cid,
-	uint64 dbkey, time_t expire)
+	uint64 dbkey, dht_value_type_t type, time_t expire)
 {
 	struct keyinfo *ki;
 	struct keydata *kd;
@@ -725,6 +925,7 @@ keys_add_value(const kuid_t *id, const kuid_t *cid,
 		kd->values = 0;						/* will be incremented below */
 		kd->creators[0] = *cid;				/* struct copy */
 		kd->dbkeys[0] = dbkey;
+		kd->types[0] = type;
 
 		gnet_stats_inc_general(GNR_DHT_KEYS_HELD);
 		if (!in_kball)
@@ -787,11 +988,14 @@ keys_add_value(const kuid_t *id, const kuid_t *cid,
 				sizeof(kd->creators[0]) * (kd->values - low));
 			memmove(&kd->dbkeys[low+1], &kd->dbkeys[low],
 				sizeof(kd->dbkeys[0]) * (kd->values - low));
+			memmove(&kd->types[low+1], &kd->types[low],
+				sizeof(kd->types[0]) * (kd->values - low));
 		}
 
 	empty:
 		kd->creators[low] = *cid;			/* struct copy */
 		kd->dbkeys[low] = dbkey;
+		kd->types[low] = type;
 
 		ki->next_expire = MIN(ki->next_expire, expire);
 	}
@@ -800,6 +1004,7 @@ keys_add_value(const kuid_t *id, const kuid_t *cid,
 	ki->values++;
 
 	dbmw_write(db_keydata, id, kd, sizeof *kd);
+	keys_filter_add(id, cid, type);
 
 	if (GNET_PROPERTY(dht_storage_debug) > 2)
 		g_debug("DHT STORE %s key %s now holds %d/%d value%s",
@@ -908,6 +1113,26 @@ keys_get(const kuid_t *id, dht_value_type_t type,
 	*loadptr = ki->get_req_load;
 	ki->get_requests++;
 
+	/*
+	 * Most of the time, we do not hold any of the values they are after.
+	 */
+
+	if (0 == secondary_count) {
+		if (!keys_filter_has_type(id, type)) {
+			gnet_stats_inc_general(GNR_DHT_KEYS_FILTERED_LOOKUPS);
+			goto done;
+		}
+	} else {
+		for (i = 0; i < secondary_count; i++) {
+			if (keys_filter_has_creator(id, secondary[i]))
+				break;
+		}
+		if (i == secondary_count) {
+			gnet_stats_inc_general(GNR_DHT_KEYS_FILTERED_LOOKUPS);
+			goto done;
+		}
+	}
+
 	kd = get_keydata(id);
 	if (kd == NULL)				/* DB failure */
 		return 0;
@@ -966,6 +1191,9 @@ keys_get(const kuid_t *id, dht_value_type_t type,
 
 		g_assert(0 != dbkey);
 
+		if (type != DHT_VT_ANY && type != kd->types[i])
+			continue;		/* Do not load values of the wrong type */
+
 		v = values_get(dbkey, type);
 		if (v == NULL)
 			continue;
@@ -1016,6 +1244,7 @@ serialize_keydata(pmsg_t *mb, const void *data)
 	for (i = 0; i < kd->values; i++) {
 		pmsg_write(mb, &kd->creators[i], sizeof(kd->creators[i]));
 		pmsg_write(mb, &kd->dbkeys[i], sizeof(kd->dbkeys[i]));
+		pmsg_write_be32(mb, kd->types[i]);
 	}
 }
 
@@ -1034,10 +1263,15 @@ deserialize_keydata(bstr_t *bs, void *valptr, size_t len)
 	g_assert(kd->values <= G_N_ELEMENTS(kd->creators));
 
 	STATIC_ASSERT(G_N_ELEMENTS(kd->creators) == G_N_ELEMENTS(kd->dbkeys));
+	STATIC_ASSERT(G_N_ELEMENTS(kd->creators) == G_N_ELEMENTS(kd->types));
 
 	for (i = 0; i < kd->values; i++) {
+		uint32 type;
+
 		bstr_read(bs, &kd->creators[i], sizeof(kd->creators[i]));
 		bstr_read(bs, &kd->dbkeys[i], sizeof(kd->dbkeys[i]));
+		bstr_read_be32(bs, &type);
+		kd->types[i] = type;
 	}
 }
 
@@ -1283,6 +1517,8 @@ keys_init(void)
 
 	keys = hikset_create(
 		offsetof(struct keyinfo, kuid), HASH_KEY_FIXED, KUID_RAW_SIZE);
+	keys_creators = cbloom_make(KEYS_FILTER_SIZE);
+	keys_types = cbloom_make(KEYS_FILTER_SIZE);
 	install_periodic_kball(KBALL_FIRST);
 
 	/* Legacy: remove after 0.97 -- RAM, 2011-05-03 */
@@ -1461,6 +1697,9 @@ keys_close(void)
 		hikset_free_null(&keys);
 	}
 
+	cbloom_free_null(&keys_creators);
+	cbloom_free_null(&keys_types);
+
 	kuid_atom_free_null(&kball.furthest);
 	kuid_atom_free_null(&kball.closest);
 
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2026 agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup dht
+ * @file
+ *
+ * Flat table of routing table contacts, for k-closest selection.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#ifndef _dht_ktable_h_
+#define _dht_ktable_h_
+
+#include "knode.h"
+
+struct ktable;
+typedef struct ktable ktable_t;
+
+/**
+ * Callback invoked on each contact, by increasing distance to a target.
+ *
+ * @param kn		the contact
+ * @param group		the opaque group to which the contact belongs
+ * @param data		user-supplied data
+ *
+ * @return TRUE to continue with the next contact, FALSE to stop.
+ */
+typedef bool (*ktable_cb_t)(knode_t *kn, const void *group, void *data);
+
+/*
+ * Public interface.
+ */
+
+ktable_t *ktable_make(void);
+void ktable_free_null(ktable_t **kt_ptr);
+void ktable_insert(ktable_t *kt, knode_t *kn, const void *group);
+bool ktable_remove(ktable_t *kt, const knode_t *kn);
+const void *ktable_group(const ktable_t *kt, const knode_t *kn);
+size_t ktable_count(const ktable_t *kt) G_GNUC_PURE;
+size_t ktable_closest(ktable_t *kt, const kuid_t *id,
+	ktable_cb_t cb, void *data);
+
+#endif /* _dht_ktable_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
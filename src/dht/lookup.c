@@ -57,12 +57,14 @@
 #include "lib/cq.h"
 #include "lib/glib-missing.h"
 #include "lib/hashlist.h"
+#include "lib/hikset.h"
 #include "lib/htable.h"
 #include "lib/host_addr.h"
 #include "lib/map.h"
 #include "lib/nid.h"
 #include "lib/patricia.h"
 #include "lib/pmsg.h"
+#include "lib/prefixhist.h"
 #include "lib/random.h"
 #include "lib/sectoken.h"
 #include "lib/tm.h"
@@ -78,6 +80,18 @@
 #define NL_VAL_MAX_RETRY	3		/* Max RPC retries to fetch sec keys */
 #define NL_FIND_DELAY		5000	/* 5 seconds, in ms */
 #define NL_VAL_DELAY		1000	/* 1 second, in ms */
+#define NL_STALL_MIN		250		/* Min delay before RPCs are stalled, in ms */
+#define NL_STALL_VAR		2		/* Stalled after SRTT + 2 RTT variations */
+#define NL_MIN_ALPHA		(KDA_ALPHA - 1)	/* Parallelism with fast replies */
+#define NL_MAX_ALPHA		(2 * KDA_ALPHA)	/* Parallelism with timeouts */
+
+/**
+ * A pending FIND_NODE RPC issued by another lookup is shared when its target
+ * and ours have at least that many more common leading bits than the queried
+ * node has with our target: the queried node will then pick its reply from
+ * the same region of its routing table as if we had asked for our own target.
+ */
+#define NL_SHARE_BITS		4
 
 /**
  * Maximum number of nodes from a class C network that we can return in
@@ -110,20 +124,31 @@ static unsigned kball_dist_proba[KUID_RAW_BITSIZE];
 #define KL_ABNORMAL_THRESH	1.01	/**< Abnormal K-L divergence threshold */
 #define KL_COUNTER_THRESH	0.43	/**< Countermeasure objective */
 
-static double log2_frequency[KDA_K][KDA_K];
-
 /**
  * Table keeping track of all the node lookup objects that we have created
  * and which are still running.
  */
 static htable_t *nlookups;
 
+/**
+ * Pending FIND_NODE RPCs, indexed by the KUID of the queried node, which
+ * concurrent lookups can share instead of issuing their own RPC.
+ */
+static hikset_t *lookup_rpcs;
+
+/**
+ * Completed shared RPCs whose outcome is being dispatched to the lookups
+ * that were waiting for it.
+ */
+static htable_t *lookup_rpc_dispatching;
+
 static void lookup_iterate(nlookup_t *nl);
 static void lookup_value_free(nlookup_t *nl, bool free_vvec);
 static void lookup_value_iterate(nlookup_t *nl);
 static void lookup_value_expired(cqueue_t *unused_cq, void *obj);
 static void lookup_value_delay(nlookup_t *nl);
 static void lookup_requery(nlookup_t *nl, const knode_t *kn);
+static void lookup_rpc_orphan(const nlookup_t *nl);
 
 typedef enum {
 	NLOOKUP_MAGIC = 0x2bb8100cU
@@ -193,6 +218,7 @@ struct nlookup {
 	cevent_t *expire_ev;		/**< Global expiration event for lookup */
 	cevent_t *delay_ev;			/**< Delay event for retries */
 	acct_net_t *c_class;		/**< Counts class-C networks in path */
+	prefixhist_t *prefixes;		/**< Counts common prefix lengths in path */
 	union {
 		struct {
 			lookup_cb_ok_t ok;		/**< OK callback for "find node" */
@@ -212,6 +238,7 @@ struct nlookup {
 	lookup_type_t type;			/**< Type of lookup (NODE or VALUE) */
 	enum parallelism mode;		/**< Parallelism mode */
 	int max_common_bits;		/**< Max common bits we allow */
+	int alpha;					/**< Current parallelism */
 	int initial_contactable;	/**< Amount of contactable nodes initially */
 	int amount;					/**< Amount of closest nodes we'd like */
 	int msg_pending;			/**< Amount of messages pending */
@@ -250,6 +277,9 @@ struct nlookup {
 	map_t *pending;				/**< Nodes still pending a reply */
 	map_t *alternate;			/**< Alternate address for nodes */
 	map_t *fixed;				/**< Nodes whose contact address was fixed */
+	cevent_t *stall_ev;			/**< Pipelining event for stalled RPCs */
+	uint32 stalled_hop;			/**< RPCs issued up to that hop are stalled */
+	int rpc_stalled;			/**< Amount of stalled RPCs still pending */
 };
 
 /**
@@ -414,6 +444,8 @@ lookup_free(nlookup_t *nl)
 	if (lookup_is_fetching(nl))
 		lookup_value_free(nl, TRUE);
 
+	lookup_rpc_orphan(nl);
+
 	map_foreach(nl->tokens, free_token, NULL);
 	patricia_foreach(nl->shortlist, knode_patricia_free, NULL);
 	map_foreach(nl->queried, knode_map_free, NULL);
@@ -426,6 +458,7 @@ lookup_free(nlookup_t *nl)
 
 	cq_cancel(&nl->expire_ev);
 	cq_cancel(&nl->delay_ev);
+	cq_cancel(&nl->stall_ev);
 	kuid_atom_free_null(&nl->kuid);
 
 	map_destroy(nl->tokens);
@@ -438,6 +471,7 @@ lookup_free(nlookup_t *nl)
 	patricia_destroy(nl->path);
 	patricia_destroy(nl->ball);
 	acct_net_free_null(&nl->c_class);
+	prefixhist_free_null(&nl->prefixes);
 
 	if (!(nl->flags & NL_F_DONT_REMOVE))
 		htable_remove(nlookups, &nl->lid);
@@ -716,6 +750,7 @@ lookup_final_stats(const nlookup_t *nl)
 		stats.msg_sent = nl->msg_sent;
 		stats.msg_dropped = nl->msg_dropped;
 		stats.rpc_replies = nl->rpc_replies;
+		stats.rpc_timeouts = nl->rpc_timeouts;
 		stats.bw_outgoing = nl->bw_outgoing;
 		stats.bw_incoming = nl->bw_incoming;
 
@@ -1937,6 +1972,32 @@ lookup_c_class_update_count(const nlookup_t *nl, const knode_t *kn, int pmone)
 	acct_net_update(nl->c_class, kn->addr, NET_CLASS_C_MASK, pmone);
 }
 
+/**
+ * Update the histogram of common prefix lengths within the lookup path,
+ * from which the Sybil attack checks derive the prefix distribution of
+ * the k-closest nodes without iterating over the path.
+ *
+ * @param nl		node lookup
+ * @param kn		node whose KUID is the purpose of the update
+ * @param pmone		plus or minus one
+ */
+static void
+lookup_prefix_update_count(const nlookup_t *nl, const knode_t *kn, int pmone)
+{
+	size_t common;
+
+	lookup_check(nl);
+	knode_check(kn);
+	g_assert(pmone == +1 || pmone == -1);
+
+	common = kuid_common_prefix(kn->id, nl->kuid);
+
+	if (pmone > 0)
+		prefixhist_add(nl->prefixes, common);
+	else
+		prefixhist_remove(nl->prefixes, common);
+}
+
 /**
  * Add node to the shortlist.
  */
@@ -1995,6 +2056,7 @@ lookup_path_add(nlookup_t *nl, const knode_t *kn)
 	patricia_insert(nl->ball, kn->id, knode_refcnt_inc(kn));
 	
 	lookup_c_class_update_count(nl, kn, +1);
+	lookup_prefix_update_count(nl, kn, +1);
 }
 
 /**
@@ -2037,6 +2099,7 @@ lookup_path_remove(nlookup_t *nl, knode_t *kn)
 
 	if (patricia_remove(nl->path, kn->id)) {
 		lookup_c_class_update_count(nl, kn, -1);
+		lookup_prefix_update_count(nl, kn, -1);
 		knode_refcnt_dec(kn);
 	}
 
@@ -2072,49 +2135,28 @@ kl_item_revcmp(const void *a, const void *b)
 }
 
 /**
- * Count the amount of the k-closest nodes in the path whose prefix has
- * a number of common leading bits falling within the specified window.
- *
- * @param nl		the node lookup
- * @param bmin		minimum number of common bits expected in prefixes
- * @param prefix[]	array counting prefixes by common bits, to fill in
- *
- * @return the amount of nodes from the path that fall within the window.
+ * Log the contribution of each prefix to the K-L divergence.
  */
-static size_t
-lookup_path_count_prefixes(const nlookup_t *nl,
-	int bmin, size_t prefix[KDA_C + 1])
+static void
+kullback_leibler_log(const nlookup_t *nl, size_t nodes, int bmin,
+	const size_t prefix[], const double contrib[])
 {
-	patricia_iter_t *iter;
-	size_t nodes;
 	size_t i;
-	int bmax = bmin + KDA_C;
 
-	lookup_check(nl);
-
-	iter = patricia_metric_iterator_lazy(nl->path, nl->kuid, TRUE);
-	nodes = 0;
-	memset(prefix, 0, sizeof prefix[0] * (KDA_C + 1));
-	i = 0;
-
-	while (i++ < KDA_K && patricia_iter_has_next(iter)) {
-		knode_t *kn = patricia_iter_next_value(iter);
-		size_t common;
+	for (i = 0; i < UNSIGNED(KDA_C + 1); i++) {
+		double freq = (double) prefix[i] / nodes;
 
-		knode_check(kn);
+		if (0 == prefix[i])
+			continue;
 
-		common = kuid_common_prefix(kn->id, nl->kuid);
-		if (common >= UNSIGNED(bmin) && common <= UNSIGNED(bmax)) {
-			size_t j = common - bmin;
-			g_assert(j < UNSIGNED(KDA_C + 1));
-			prefix[j]++;
-			nodes++;
-		}
+		g_debug("DHT LOOKUP[%s] %u-bit prefix: "
+			"freq = %g (%u/%u node%s, log2=%g), theoric = %g => "
+			"K-L contribution: %g",
+			nid_to_string(&nl->lid), (unsigned) (i + bmin),
+			freq, (unsigned) prefix[i], (unsigned) nodes,
+			1 == prefix[i] ? "" : "s",
+			log(freq) / log(2.0), 1.0 / pow(2.0, i + 1.0), contrib[i]);
 	}
-
-	patricia_iterator_release(&iter);
-
-	return nodes;
 }
 
 /**
@@ -2133,62 +2175,23 @@ static double
 kullback_leibler_div(const nlookup_t *nl, size_t nodes, int bmin,
 	size_t prefix[KDA_C + 1], struct kl_item items[KDA_C + 1])
 {
-	double M[KDA_C + 1];		/* Measured distribution */
+	double contrib[KDA_C + 1];
 	double dkl;
 	size_t i;
 
 	g_assert(nodes <= KDA_K);
 	g_assert(size_is_positive(nodes));
 
-	for (i = 0; i < UNSIGNED(KDA_C + 1); i++) {
-		g_assert(prefix[i] <= nodes);
-		M[i] = (double) prefix[i] / nodes;
-	}
-
-	dkl = 0.0;
-
-	for (i = 0; i < G_N_ELEMENTS(M); i++) {
-		double ct;
+	dkl = prefixhist_kl_div(nodes, KDA_C + 1, prefix, contrib);
 
+	for (i = 0; i < G_N_ELEMENTS(contrib); i++) {
 		items[i].prefix = i + bmin;
-
-		if (0 == prefix[i]) {
-			items[i].contrib = 0.0;
-			continue;
-		}
-
-		/*
-		 * For faster computations, note that:
-		 *
-		 * log2(M(j) / T(j)) = log2(M(j)) - log2(T(j))
-		 *
-		 * T(j) = 1 / 2^(j - b_min + 1)
-		 * log2(T(j)) = b_min - j - 1
-		 *
-		 * But in M[], indices are i = j - b_min, hence:
-		 *
-		 * log2(T(i)) = -(i + 1)
-		 *
-		 * For the M(i), we precomputed the log2 values for all the possible
-		 * frequencies in the log2_frequency[][] matrix.
-		 */
-
-		ct = M[i] * (log2_frequency[nodes - 1][prefix[i] - 1] + (i + 1.0));
-		dkl += ct;
-		items[i].contrib = ct;
-
-		if (GNET_PROPERTY(dht_lookup_debug) > 2) {
-			g_debug("DHT LOOKUP[%s] %u-bit prefix: "
-				"freq = %g (%u/%u node%s, log2=%g), theoric = %g => "
-				"K-L contribution: %g",
-				nid_to_string(&nl->lid), (unsigned) (i + bmin),
-				M[i], (unsigned) prefix[i], (unsigned) nodes,
-				1 == prefix[i] ? "" : "s",
-				log2_frequency[nodes - 1][prefix[i] - 1],
-				1.0 / pow(2.0, i + 1.0), ct);
-		}
+		items[i].contrib = contrib[i];
 	}
 
+	if (GNET_PROPERTY(dht_lookup_debug) > 2)
+		kullback_leibler_log(nl, nodes, bmin, prefix, contrib);
+
 	return dkl;
 }
 
@@ -2208,6 +2211,8 @@ lookup_path_is_safe(nlookup_t *nl)
 	size_t prefix[KDA_C + 1];
 	struct kl_item items[KDA_C + 1];
 	GList *nodelist[KDA_C + 1];
+	prefixhist_window_t win[2];		/* Window, then shifted by 1 bit */
+	const prefixhist_window_t *w;
 	size_t nodes;
 	double dkl, previous_dkl;
 	knode_t *removed_kn;
@@ -2295,21 +2300,30 @@ lookup_path_is_safe(nlookup_t *nl)
 	g_assert(min_common_bits >= 0);		/* by construction */
 
 	/*
-	 * Count the prefixes falling within the window into prefix[].
+	 * The prefix distributions of the k-closest nodes within the window,
+	 * and within the window shifted by 1 bit, are derived at once from
+	 * the histogram of prefix lengths in the path, which is maintained
+	 * as nodes enter and leave the path.  Their K-L divergence is computed
+	 * at the same time.
 	 */
 
+	STATIC_ASSERT(KDA_C + 1 <= PREFIXHIST_WIDTH_MAX);
+
+	prefixhist_windows(nl->prefixes, KDA_K, min_common_bits, KDA_C + 1,
+		win, G_N_ELEMENTS(win));
+	w = &win[0];
+
 compute:
 
-	nodes = lookup_path_count_prefixes(nl, min_common_bits, prefix);
+	nodes = w->nodes;
 
 	if (0 == nodes)
 		return TRUE;	/* No node falling within our K-L divergence window */
 
-	/*
-	 * Compute the K-L divergence.
-	 */
+	dkl = w->dkl;
 
-	dkl = kullback_leibler_div(nl, nodes, min_common_bits, prefix, items);
+	if (GNET_PROPERTY(dht_lookup_debug) > 2)
+		kullback_leibler_log(nl, nodes, min_common_bits, w->counts, w->contrib);
 
 	if (GNET_PROPERTY(dht_lookup_debug) > 1) {
 		g_debug("DHT LOOKUP[%s] with %u/%u node%s, K-L divergence to %s = %g",
@@ -2348,12 +2362,13 @@ compute:
 
 	if (
 		!shifted &&
-		((KDA_K == nodes && prefix[0] <= 3) || prefix[1] >= nodes / 2 - 1)
+		((KDA_K == nodes && w->counts[0] <= 3) || w->counts[1] >= nodes / 2 - 1)
 	) {
 		min_common_bits++;
 		max_common_bits++;
 		shifted = TRUE;
-		empty_min_prefix = 0 == prefix[0];
+		empty_min_prefix = 0 == w->counts[0];
+		w = &win[1];
 
 		if (GNET_PROPERTY(dht_lookup_debug) > 1) {
 			g_debug("DHT LOOKUP[%s] shifting K-L window to [%d, %d] bits",
@@ -2392,8 +2407,16 @@ compute:
 				nid_to_string(&nl->lid), min_common_bits, max_common_bits);
 		}
 
-		nodes = lookup_path_count_prefixes(nl, min_common_bits, prefix);
-		dkl = kullback_leibler_div(nl, nodes, min_common_bits, prefix, items);
+		w = &win[0];
+	}
+
+	nodes = w->nodes;
+	dkl = w->dkl;
+
+	for (i = 0; i < G_N_ELEMENTS(prefix); i++) {
+		prefix[i] = w->counts[i];
+		items[i].prefix = i + min_common_bits;
+		items[i].contrib = w->contrib[i];
 	}
 
 	/*
@@ -2932,6 +2955,7 @@ lookup_load_path(nlookup_t *nl)
 				patricia_insert(nl->path, kn->id, kn);
 				map_insert(nl->queried, kn->id, knode_refcnt_inc(kn));
 				lookup_c_class_update_count(nl, kn, +1);
+				lookup_prefix_update_count(nl, kn, +1);
 			} else if (GNET_PROPERTY(dht_lookup_debug)) {
 				g_debug("DHT LOOKUP[%s] not loading %s in path: %s",
 					nid_to_string(&nl->lid), knode_to_string(kn), reason);
@@ -3458,6 +3482,252 @@ accepting:
 	return TRUE;
 }
 
+/***
+ *** Shared FIND_NODE RPCs.
+ ***
+ *** Concurrent lookups for nearby KUIDs (user lookups, publishing, bucket
+ *** refreshes) tend to query the same nodes.  When a lookup is about to
+ *** send a FIND_NODE to a node which is already being queried by another
+ *** lookup for a close-enough target, it waits for that RPC instead and
+ *** gets a copy of its outcome.
+ ***/
+
+enum lookup_rpc_magic { LOOKUP_RPC_MAGIC = 0x5e3a0c91 };
+
+/**
+ * Outcome of a shared RPC.
+ */
+enum lookup_rpc_outcome {
+	LOOKUP_RPC_PENDING = 0,		/**< No outcome yet */
+	LOOKUP_RPC_REPLY,			/**< Got a reply */
+	LOOKUP_RPC_TIMEOUT,			/**< RPC timed out */
+	LOOKUP_RPC_CANCEL			/**< RPC was cancelled, or issuer is gone */
+};
+
+/**
+ * A pending FIND_NODE RPC.
+ */
+struct lookup_rpc {
+	enum lookup_rpc_magic magic;
+	kuid_t *id;					/**< KUID of the queried node (atom) */
+	kuid_t *target;				/**< Target of the FIND_NODE (atom) */
+	struct nid owner;			/**< Lookup which issued the RPC */
+	GSList *waiters;			/**< Waiting lookups (struct lookup_waiter) */
+	cevent_t *dispatch_ev;		/**< Dispatching of outcome to waiters */
+	char *payload;				/**< Copy of the reply payload */
+	size_t len;					/**< Length of the payload */
+	kda_msg_t function;			/**< Reply message type */
+	enum lookup_rpc_outcome outcome;	/**< Outcome of the RPC */
+};
+
+/**
+ * A lookup waiting for a shared RPC.
+ */
+struct lookup_waiter {
+	struct nid lid;				/**< The waiting lookup */
+	uint32 hop;					/**< Hop at which it would have sent its RPC */
+};
+
+static void lookup_rpc_dispatched(cqueue_t *unused_cq, void *obj);
+
+static inline void
+lookup_rpc_check(const struct lookup_rpc * const lr)
+{
+	g_assert(lr != NULL);
+	g_assert(LOOKUP_RPC_MAGIC == lr->magic);
+}
+
+/**
+ * Free shared RPC record.
+ */
+static void
+lookup_rpc_free(struct lookup_rpc *lr)
+{
+	GSList *sl;
+
+	lookup_rpc_check(lr);
+
+	GM_SLIST_FOREACH(lr->waiters, sl) {
+		struct lookup_waiter *lw = sl->data;
+		WFREE(lw);
+	}
+	gm_slist_free_null(&lr->waiters);
+
+	if (lr->payload != NULL)
+		wfree(lr->payload, lr->len);
+
+	cq_cancel(&lr->dispatch_ev);
+	kuid_atom_free_null(&lr->id);
+	kuid_atom_free_null(&lr->target);
+	lr->magic = 0;
+	WFREE(lr);
+}
+
+/**
+ * Record that lookup is sending a FIND_NODE RPC to node, so that other
+ * lookups may share it.
+ */
+static void
+lookup_rpc_record(const nlookup_t *nl, const knode_t *kn)
+{
+	struct lookup_rpc *lr;
+
+	lookup_check(nl);
+	knode_check(kn);
+
+	if (hikset_contains(lookup_rpcs, kn->id))
+		return;			/* Node already queried by another lookup */
+
+	WALLOC0(lr);
+	lr->magic = LOOKUP_RPC_MAGIC;
+	lr->id = kuid_get_atom(kn->id);
+	lr->target = kuid_get_atom(nl->kuid);
+	lr->owner = nl->lid;
+
+	hikset_insert(lookup_rpcs, lr);
+}
+
+/**
+ * Attempt to wait for a pending FIND_NODE RPC to the node, issued by
+ * another lookup, instead of sending our own.
+ *
+ * @return TRUE if lookup will be given the outcome of the pending RPC.
+ */
+static bool
+lookup_rpc_join(const nlookup_t *nl, const knode_t *kn)
+{
+	struct lookup_rpc *lr;
+	struct lookup_waiter *lw;
+	size_t common;
+
+	lookup_check(nl);
+	knode_check(kn);
+
+	lr = hikset_lookup(lookup_rpcs, kn->id);
+	if (NULL == lr)
+		return FALSE;
+
+	lookup_rpc_check(lr);
+	g_assert(LOOKUP_RPC_PENDING == lr->outcome);
+
+	if (nid_equal(&lr->owner, &nl->lid))
+		return FALSE;
+
+	common = kuid_common_prefix(lr->target, nl->kuid);
+
+	if (
+		common < KUID_RAW_BITSIZE &&
+		common < kuid_common_prefix(kn->id, nl->kuid) + NL_SHARE_BITS
+	)
+		return FALSE;
+
+	WALLOC(lw);
+	lw->lid = nl->lid;
+	lw->hop = nl->hops;
+	lr->waiters = g_slist_prepend(lr->waiters, lw);
+
+	gnet_stats_inc_general(GNR_DHT_LOOKUP_SHARED_RPCS);
+
+	if (GNET_PROPERTY(dht_lookup_debug) > 2) {
+		g_debug("DHT LOOKUP[%s] hop %u, sharing RPC to %s from LOOKUP[%s] "
+			"(%zu common bit%s with its target)",
+			nid_to_string(&nl->lid), nl->hops, knode_to_string(kn),
+			nid_to_string2(&lr->owner), common, 1 == common ? "" : "s");
+	}
+
+	return TRUE;
+}
+
+/**
+ * Record the outcome of a shared RPC.
+ *
+ * The shared RPC is no longer pending and its outcome will be dispatched
+ * asynchronously to the waiting lookups, if any.
+ */
+static void
+lookup_rpc_finish(struct lookup_rpc *lr, enum lookup_rpc_outcome outcome,
+	kda_msg_t function, const char *payload, size_t len)
+{
+	lookup_rpc_check(lr);
+	g_assert(LOOKUP_RPC_PENDING == lr->outcome);
+
+	if (NULL == lr->waiters) {
+		lookup_rpc_free(lr);
+		return;
+	}
+
+	lr->outcome = outcome;
+	lr->function = function;
+
+	if (payload != NULL) {
+		lr->payload = wcopy(payload, len);
+		lr->len = len;
+	}
+
+	htable_insert(lookup_rpc_dispatching, lr, lr);
+	lr->dispatch_ev = cq_main_insert(1, lookup_rpc_dispatched, lr);
+}
+
+/**
+ * Signal completion of a FIND_NODE RPC issued by lookup to node.
+ *
+ * @param nl		the lookup which issued the RPC
+ * @param kn		the queried node
+ * @param outcome	the outcome of the RPC
+ * @param function	the type of the reply message (for replies)
+ * @param payload	the reply payload (for replies)
+ * @param len		the length of the payload
+ */
+static void
+lookup_rpc_complete(const nlookup_t *nl, const knode_t *kn,
+	enum lookup_rpc_outcome outcome,
+	kda_msg_t function, const char *payload, size_t len)
+{
+	struct lookup_rpc *lr;
+
+	lookup_check(nl);
+	knode_check(kn);
+
+	lr = hikset_lookup(lookup_rpcs, kn->id);
+	if (NULL == lr || !nid_equal(&lr->owner, &nl->lid))
+		return;
+
+	hikset_remove(lookup_rpcs, kn->id);
+	lookup_rpc_finish(lr, outcome, function, payload, len);
+}
+
+/**
+ * Hash set iterator callback to cancel shared RPCs issued by a lookup.
+ */
+static bool
+lookup_rpc_orphan_if(void *value, void *data)
+{
+	struct lookup_rpc *lr = value;
+	const nlookup_t *nl = data;
+
+	lookup_rpc_check(lr);
+
+	if (!nid_equal(&lr->owner, &nl->lid))
+		return FALSE;
+
+	lookup_rpc_finish(lr, LOOKUP_RPC_CANCEL, 0, NULL, 0);
+	return TRUE;
+}
+
+/**
+ * Lookup is being freed: the replies to its pending RPCs will be ignored,
+ * hence the lookups waiting for them must query the nodes themselves.
+ */
+static void
+lookup_rpc_orphan(const nlookup_t *nl)
+{
+	lookup_check(nl);
+
+	if (nl->rpc_pending != 0 && lookup_rpcs != NULL)
+		hikset_foreach_remove(lookup_rpcs, lookup_rpc_orphan_if,
+			deconstify_pointer(nl));
+}
+
 /***
  *** RPC event callbacks for FIND_NODE and FIND_VALUE operations.
  *** See revent_pmsg_free() and revent_rpc_cb() to understand calling contexts.
@@ -3507,6 +3777,8 @@ lk_msg_dropped(void *obj, knode_t *kn, pmsg_t *unused_mb)
 	nl->msg_dropped++;
 	nl->udp_drops++;
 
+	lookup_rpc_complete(nl, kn, LOOKUP_RPC_CANCEL, 0, NULL, 0);
+
 	if (map_remove(nl->queried, kn->id))
 		knode_refcnt_dec(kn);
 	if (map_remove(nl->pending, kn->id))
@@ -3535,6 +3807,10 @@ lk_rpc_cancelled(void *obj, uint32 hop)
 		g_assert(nl->rpc_latest_pending > 0);
 		nl->rpc_latest_pending--;
 	}
+	if (hop <= nl->stalled_hop) {
+		g_assert(nl->rpc_stalled > 0);
+		nl->rpc_stalled--;
+	}
 
 	nl->rpc_pending--;
 
@@ -3582,10 +3858,29 @@ lk_handling_rpc(void *obj, enum dht_rpc_ret type,
 		g_assert(nl->rpc_latest_pending > 0);
 		nl->rpc_latest_pending--;
 	}
+	if (hop <= nl->stalled_hop) {
+		g_assert(nl->rpc_stalled > 0);
+		nl->rpc_stalled--;
+	}
 	nl->rpc_pending--;
 
 	removed = map_remove(nl->pending, kn->id);
 	g_assert(removed);
+
+	/*
+	 * Adapt parallelism to the latency we experience: timeouts mean we
+	 * have to query more nodes in parallel to avoid waiting for dead ones,
+	 * whilst nodes replying faster than average let us query fewer nodes.
+	 */
+
+	if (DHT_RPC_TIMEOUT == type) {
+		if (nl->alpha < NL_MAX_ALPHA)
+			nl->alpha++;
+	} else if (kn->rtt != 0 && kn->rtt <= dht_rpc_srtt()) {
+		if (nl->alpha > NL_MIN_ALPHA)
+			nl->alpha--;
+	}
+
 	knode_refcnt_dec(kn);		/* Was referenced in nl->pending */
 
 	/*
@@ -3598,6 +3893,7 @@ lk_handling_rpc(void *obj, enum dht_rpc_ret type,
 		knode_t *an;
 
 		nl->rpc_timeouts++;
+		lookup_rpc_complete(nl, kn, LOOKUP_RPC_TIMEOUT, 0, NULL, 0);
 
 		an = map_lookup(nl->alternate, kn->id);
 		if (an != NULL) {
@@ -3617,6 +3913,12 @@ lk_handle_reply(void *obj, const knode_t *kn,
 
 	lookup_check(nl);
 
+	/*
+	 * Let the lookups waiting for this RPC get their copy of the reply.
+	 */
+
+	lookup_rpc_complete(nl, kn, LOOKUP_RPC_REPLY, function, payload, len);
+
 	/*
 	 * We got a reply from the remote node.
 	 * Ensure it is of the correct type.
@@ -3877,23 +4179,113 @@ static struct revent_ops lookup_ops = {
 	lk_iterate,					/* iterate */
 };
 
+/**
+ * Give waiting lookup the outcome of the shared RPC, as if it had issued
+ * the RPC itself at the hop it started to wait.
+ */
+static void
+lookup_rpc_deliver(nlookup_t *nl, const struct lookup_rpc *lr, uint32 hop)
+{
+	knode_t *kn;
+
+	lookup_check(nl);
+	lookup_rpc_check(lr);
+
+	kn = map_lookup(nl->pending, lr->id);
+
+	g_assert(kn != NULL);
+	g_assert(nl->rpc_pending > 0);
+
+	if (GNET_PROPERTY(dht_lookup_debug) > 2) {
+		g_debug("DHT LOOKUP[%s] handling shared %s for RPC issued at hop %u "
+			"to %s by LOOKUP[%s]",
+			nid_to_string(&nl->lid),
+			LOOKUP_RPC_REPLY == lr->outcome ? "reply" :
+			LOOKUP_RPC_TIMEOUT == lr->outcome ? "timeout" : "cancel",
+			hop, knode_to_string(kn), nid_to_string2(&lr->owner));
+	}
+
+	switch (lr->outcome) {
+	case LOOKUP_RPC_REPLY:
+		lk_handling_rpc(nl, DHT_RPC_REPLY, kn, hop);
+		if (lk_handle_reply(nl, kn, lr->function, lr->payload, lr->len, hop))
+			lk_iterate(nl, DHT_RPC_REPLY, hop);
+		return;
+	case LOOKUP_RPC_TIMEOUT:
+		lk_handling_rpc(nl, DHT_RPC_TIMEOUT, kn, hop);
+		lk_iterate(nl, DHT_RPC_TIMEOUT, hop);
+		return;
+	case LOOKUP_RPC_CANCEL:
+		/*
+		 * We never got anything from the node, put it back in the
+		 * shortlist so that we may query it ourselves.
+		 */
+
+		knode_refcnt_inc(kn);
+		if (map_remove(nl->pending, kn->id))
+			knode_refcnt_dec(kn);
+		if (map_remove(nl->queried, kn->id))
+			knode_refcnt_dec(kn);
+		lookup_shortlist_add(nl, kn);
+		knode_free(kn);
+		lk_rpc_cancelled(nl, hop);
+		return;
+	case LOOKUP_RPC_PENDING:
+		break;
+	}
+
+	g_assert_not_reached();
+}
+
+/**
+ * Callout queue callback to dispatch outcome of shared RPC to the lookups
+ * that were waiting for it.
+ */
+static void
+lookup_rpc_dispatched(cqueue_t *unused_cq, void *obj)
+{
+	struct lookup_rpc *lr = obj;
+	GSList *sl;
+
+	(void) unused_cq;
+	lookup_rpc_check(lr);
+
+	lr->dispatch_ev = NULL;		/* Callback triggered */
+	htable_remove(lookup_rpc_dispatching, lr);
+
+	/*
+	 * Waiters were prepended, hence reverse the list to dispatch the
+	 * outcome in the order lookups started to wait.
+	 */
+
+	lr->waiters = g_slist_reverse(lr->waiters);
+
+	GM_SLIST_FOREACH(lr->waiters, sl) {
+		struct lookup_waiter *lw = sl->data;
+		nlookup_t *nl = lookup_is_alive(lw->lid);
+
+		if (nl != NULL)
+			lookup_rpc_deliver(nl, lr, lw->hop);
+	}
+
+	lookup_rpc_free(lr);
+}
+
 /**
  * Send a FIND message to the specified node.
+ *
+ * When a FIND_NODE to the same node is already pending for a close-enough
+ * target, no message is sent and we wait for the outcome of that RPC.
  */
 static void
 lookup_send(nlookup_t *nl, knode_t *kn)
 {
-	if (GNET_PROPERTY(dht_lookup_debug) > 2)
-		g_debug("DHT LOOKUP[%s] hop %u, querying %s",
-			nid_to_string(&nl->lid), nl->hops, knode_to_string(kn));
-
 	/*
-	 * Increate message pending variables before sending, as the callback
+	 * Increate RPC pending variables before sending, as the callback
 	 * for message freeing can be synchronous with the call if the UDP queue
 	 * is empty.
 	 */
 
-	nl->msg_pending++;
 	nl->rpc_pending++;
 	nl->rpc_latest_pending++;
 
@@ -3905,6 +4297,25 @@ lookup_send(nlookup_t *nl, knode_t *kn)
 	case LOOKUP_STORE:
 	case LOOKUP_TOKEN:
 	case LOOKUP_REFRESH:
+		if (lookup_rpc_join(nl, kn))
+			return;
+		break;
+	case LOOKUP_VALUE:
+		break;
+	}
+
+	if (GNET_PROPERTY(dht_lookup_debug) > 2)
+		g_debug("DHT LOOKUP[%s] hop %u, querying %s",
+			nid_to_string(&nl->lid), nl->hops, knode_to_string(kn));
+
+	nl->msg_pending++;
+
+	switch (nl->type) {
+	case LOOKUP_NODE:
+	case LOOKUP_STORE:
+	case LOOKUP_TOKEN:
+	case LOOKUP_REFRESH:
+		lookup_rpc_record(nl, kn);
 		revent_find_node(kn, nl->kuid, nl->lid, &lookup_ops, nl->hops);
 		return;
 	case LOOKUP_VALUE:
@@ -3999,6 +4410,80 @@ lookup_async_iterate(nlookup_t *nl)
 	nl->delay_ev = cq_main_insert(1, lookup_delay_expired, nl);
 }
 
+/**
+ * Stall expiration: the RPCs we issued so far took longer than what the
+ * RTT of the queried nodes let us expect.
+ */
+static void
+lookup_stalled(cqueue_t *unused_cq, void *obj)
+{
+	nlookup_t *nl = obj;
+
+	(void) unused_cq;
+	lookup_check(nl);
+
+	nl->stall_ev = NULL;		/* Callback triggered */
+
+	if (
+		0 == nl->rpc_latest_pending ||
+		0 == patricia_count(nl->shortlist) ||
+		(nl->flags & (NL_F_DELAYED | NL_F_COMPLETED)) ||
+		lookup_is_fetching(nl)
+	)
+		return;
+
+	/*
+	 * Instead of waiting for the RPC timeouts, pipeline the next hop:
+	 * the pending RPCs no longer count against the parallelism of the
+	 * lookup, but we will still process their replies if they come.
+	 */
+
+	nl->stalled_hop = nl->hops;
+	nl->rpc_stalled = nl->rpc_pending;
+
+	gnet_stats_inc_general(GNR_DHT_LOOKUP_PIPELINED_HOPS);
+
+	if (GNET_PROPERTY(dht_lookup_debug) > 1) {
+		g_debug("DHT LOOKUP[%s] hop %u stalled with %d RPC%s pending",
+			nid_to_string(&nl->lid), nl->hops,
+			nl->rpc_pending, 1 == nl->rpc_pending ? "" : "s");
+	}
+
+	lookup_iterate(nl);
+}
+
+/**
+ * Arm the stall timer after sending RPCs at the current hop.
+ *
+ * @param nl		the lookup
+ * @param rtt		the largest stall delay of the queried nodes, 0 if unknown
+ */
+static void
+lookup_stall_arm(nlookup_t *nl, uint32 rtt)
+{
+	int delay;
+
+	lookup_check(nl);
+
+	cq_cancel(&nl->stall_ev);
+
+	/*
+	 * With strict parallelism, we want all the replies of a hop anyway.
+	 * And if we do not know the RTT of all the nodes we queried, we can
+	 * only wait for the RPC timeouts.
+	 */
+
+	if (LOOKUP_STRICT == nl->mode || 0 == rtt)
+		return;
+
+	delay = MAX(rtt, NL_STALL_MIN);
+
+	if (delay >= DHT_RPC_MINDELAY)
+		return;			/* RPC timeouts will not fire much later */
+
+	nl->stall_ev = cq_main_insert(delay, lookup_stalled, nl);
+}
+
 /**
  * Iterate the lookup, once we have determined we must send more probes.
  */
@@ -4010,7 +4495,9 @@ lookup_iterate(nlookup_t *nl)
 	GSList *ignored = NULL;
 	GSList *sl;
 	int i = 0;
-	int alpha = KDA_ALPHA;
+	int alpha = nl->alpha;
+	uint32 rtt = 0;
+	bool rtt_known = TRUE;
 	char reason[80];
 	int reason_len;
 
@@ -4035,11 +4522,11 @@ lookup_iterate(nlookup_t *nl)
 	}
 
 	/*
-	 * Enforce bounded parallelism here.
+	 * Enforce bounded parallelism here, stalled RPCs not being accounted.
 	 */
 
 	if (LOOKUP_BOUNDED == nl->mode) {
-		alpha -= nl->rpc_pending;
+		alpha -= nl->rpc_pending - nl->rpc_stalled;
 
 		if (alpha <= 0) {
 			if (GNET_PROPERTY(dht_lookup_debug) > 2)
@@ -4102,6 +4589,9 @@ lookup_iterate(nlookup_t *nl)
 			if (nl->flags & NL_F_UDP_DROP)
 				break;				/* Synchronous UDP drop detected */
 			i++;
+			rtt = MAX(rtt, kn->rtt + NL_STALL_VAR * kn->rttvar);
+			if (0 == kn->rtt)
+				rtt_known = FALSE;
 		}
 
 		to_remove = g_slist_prepend(to_remove, kn);
@@ -4168,7 +4658,15 @@ lookup_iterate(nlookup_t *nl)
 				nid_to_string(&nl->lid));
 
 		lookup_completed(nl);
+		return;
 	}
+
+	/*
+	 * Pipeline the next hop if the RPCs we just sent take too long compared
+	 * to the RTT we measured for these nodes.
+	 */
+
+	lookup_stall_arm(nl, rtt_known ? rtt : 0);
 }
 
 /**
@@ -4267,10 +4765,12 @@ lookup_create(const kuid_t *kuid, lookup_type_t type,
 	nl->path = patricia_create(KUID_RAW_BITSIZE);
 	nl->ball = patricia_create(KUID_RAW_BITSIZE);
 	nl->c_class = acct_net_create();
+	nl->prefixes = prefixhist_make(KUID_RAW_BITSIZE);
 	nl->err = error;
 	nl->arg = arg;
 	nl->expire_ev = cq_main_insert(NL_MAX_LIFETIME, lookup_expired, nl);
 	nl->max_common_bits = KDA_C + dht_get_kball_furthest();
+	nl->alpha = KDA_ALPHA;
 	tm_now_exact(&nl->start);
 
 	htable_insert(nlookups, &nl->lid, nl);
@@ -5057,33 +5557,12 @@ done:
 G_GNUC_COLD void
 lookup_init(void)
 {
-	double log_2 = log(2.0);
 	size_t i;
 
 	nlookups = htable_create_any(nid_hash, nid_hash2, nid_equal);
-
-	/*
-	 * Build lower triangular matrix of all possible log2(frequency).
-	 *
-	 *   A is a square matrix, K x K
-	 *
-	 *   0 <= i < K and 0 <= j < K
-	 *
-	 *   Aij = 0                           j > i
-	 *   Aij = log2((j+1) / (i+1))         j <= i
-	 */
-
-	for (i = 0; i < KDA_K; i++) {
-		size_t j;
-		double count = i + 1.0;
-		for (j = 0; j < count; j++) {
-			double f = (j + 1.0) / count;
-			log2_frequency[i][j] = log(f) / log_2;
-		}
-		for (j = count; j < KDA_K; j++) {
-			log2_frequency[i][j] = 0.0;		/* In case used by mistake */
-		}
-	}
+	lookup_rpcs = hikset_create(
+		offsetof(struct lookup_rpc, id), HASH_KEY_FIXED, KUID_RAW_SIZE);
+	lookup_rpc_dispatching = htable_create(HASH_KEY_SELF, 0);
 
 	/*
 	 * Build probability of DHT value acceptance with 'n' bits of distance
@@ -5122,6 +5601,30 @@ free_lookup(const void *key, void *value, void *data)
 		lookup_cancel(nl, TRUE);
 }
 
+/**
+ * Hash set iteration callback to free the shared RPC records.
+ */
+static void
+free_lookup_rpc(void *value, void *unused_data)
+{
+	(void) unused_data;
+
+	lookup_rpc_free(value);
+}
+
+/**
+ * Hashtable iteration callback to free the shared RPC records being
+ * dispatched.
+ */
+static void
+free_dispatched_rpc(const void *unused_key, void *value, void *unused_data)
+{
+	(void) unused_key;
+	(void) unused_data;
+
+	lookup_rpc_free(value);
+}
+
 /**
  * Cleanup data structures used by Kademlia node lookups.
  *
@@ -5132,6 +5635,16 @@ lookup_close(bool exiting)
 {
 	htable_foreach(nlookups, free_lookup, &exiting);
 	htable_free_null(&nlookups);
+
+	/*
+	 * Freeing the lookups may have scheduled the dispatching of their
+	 * pending shared RPCs, so the dispatching table must go last.
+	 */
+
+	hikset_foreach(lookup_rpcs, free_lookup_rpc, NULL);
+	hikset_free_null(&lookup_rpcs);
+	htable_foreach(lookup_rpc_dispatching, free_dispatched_rpc, NULL);
+	htable_free_null(&lookup_rpc_dispatching);
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -72,6 +72,7 @@ struct lookup_stats {
 	int msg_sent;				/**< Amount of messages sent */
 	int msg_dropped;			/**< Amount of messages dropped */
 	int rpc_replies;			/**< Amount of valid RPC replies */
+	int rpc_timeouts;			/**< Amount of RPC timeouts */
 	int bw_outgoing;			/**< Amount of outgoing bandwidth used */
 	int bw_incoming;			/**< Amount of incoming bandwidth used */
 };
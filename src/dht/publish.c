@@ -151,6 +151,8 @@
 #include "core/gnet_stats.h"
 
 #include "lib/cq.h"
+#include "lib/hashing.h"
+#include "lib/host_addr.h"
 #include "lib/htable.h"
 #include "lib/nid.h"
 #include "lib/patricia.h"
@@ -171,12 +173,33 @@
 #define PB_OFFLOAD_MAX_LIFETIME		600000	/* 10 minutes, in ms */
 #define PB_VALUE_MAX_LIFETIME		240000	/* 4 minutes, in ms */
 
+#define PB_BATCH_DELAY		250		/* Time to gather values for a root, in ms */
+#define PB_BATCH_MAX_VALUES	8		/* Max amount of values in a STORE batch */
+#define PB_BATCH_MAX_SIZE	512		/* Aimed STORE size, see kmsg_build_store() */
+
 /**
  * Table keeping track of all the publish objects that we have created
  * and which are still running.
  */
 static htable_t *publishes;
 
+/**
+ * Value publishes run concurrently and often have to STORE to the same roots
+ * at about the same time.  Values sent to a given root are gathered for a
+ * short while in an open batch, indexed by the root node (its KUID and its
+ * address), so that they can be sent in a single STORE message.
+ *
+ * Batches sent are indexed by their ID until both their message and their
+ * RPC have been processed, to dispatch the RPC events to the publishes
+ * which contributed values.
+ *
+ * To know whether it is worth opening a batch, we count, for each root node,
+ * the running value publishes which still have it ahead in their STORE path.
+ */
+static htable_t *publish_batches;
+static htable_t *publish_batches_sent;
+static htable_t *publish_upcoming;
+
 /**
  * Publish types.
  */
@@ -240,6 +263,7 @@ struct publish {
 			publish_cb_t cb;	/**< Completion callback */
 			void *arg;			/**< Additional callback argument */
 			size_t idx;			/**< Current node index we're publishing to */
+			size_t upcoming;	/**< First node recorded as upcoming root */
 			unsigned full;		/**< Nodes that reported key being full */
 		} v;
 	} target;					/**< STORE targets */
@@ -381,6 +405,114 @@ free_kuid_atom(void *obj)
 	kuid_atom_free(obj);
 }
 
+/**
+ * Hashing of root nodes, by KUID and address.
+ */
+static uint
+publish_root_hash(const void *key)
+{
+	const knode_t *kn = key;
+
+	return kuid_hash(kn->id) ^ host_addr_hash(kn->addr) ^ port_hash(kn->port);
+}
+
+/**
+ * Equality of root nodes, by KUID and address.
+ */
+static bool
+publish_root_eq(const void *a, const void *b)
+{
+	const knode_t *k1 = a, *k2 = b;
+
+	return k1->id == k2->id &&		/* We know IDs are atoms */
+		host_addr_equal(k1->addr, k2->addr) && k1->port == k2->port;
+}
+
+/**
+ * @return amount of value publishes which have the root ahead of them.
+ */
+static uint
+publish_upcoming_count(const knode_t *kn)
+{
+	return GPOINTER_TO_UINT(htable_lookup(publish_upcoming, kn));
+}
+
+/**
+ * Record that a value publish has the root ahead of it.
+ */
+static void
+publish_upcoming_add(knode_t *kn)
+{
+	const void *key;
+	void *n;
+
+	if (htable_lookup_extended(publish_upcoming, kn, &key, &n)) {
+		htable_insert(publish_upcoming, key,
+			GUINT_TO_POINTER(GPOINTER_TO_UINT(n) + 1));
+	} else {
+		htable_insert(publish_upcoming, knode_refcnt_inc(kn),
+			GUINT_TO_POINTER(1));
+	}
+}
+
+/**
+ * Record that a value publish is done with the root.
+ */
+static void
+publish_upcoming_remove(const knode_t *kn)
+{
+	const void *key;
+	void *n;
+
+	if (!htable_lookup_extended(publish_upcoming, kn, &key, &n))
+		g_assert_not_reached();
+
+	if (GPOINTER_TO_UINT(n) > 1) {
+		htable_insert(publish_upcoming, key,
+			GUINT_TO_POINTER(GPOINTER_TO_UINT(n) - 1));
+	} else {
+		htable_remove(publish_upcoming, key);
+		knode_free(deconstify_pointer(key));
+	}
+}
+
+/**
+ * Record all the nodes of the value publish path, starting at the current
+ * index, as upcoming roots.
+ */
+static void
+publish_upcoming_record(publish_t *pb)
+{
+	const lookup_rs_t *rs = pb->target.v.rs;
+	size_t i;
+
+	g_assert(PUBLISH_VALUE == pb->type);
+
+	pb->target.v.upcoming = pb->target.v.idx;
+
+	for (i = pb->target.v.idx; i < rs->path_len; i++)
+		publish_upcoming_add(rs->path[i].kn);
+}
+
+/**
+ * The value publish moved on to the node at index ``idx'' in its path:
+ * the nodes before it are no longer upcoming roots.
+ */
+static void
+publish_upcoming_advance(publish_t *pb, size_t idx)
+{
+	const lookup_rs_t *rs = pb->target.v.rs;
+	size_t i;
+
+	g_assert(PUBLISH_VALUE == pb->type);
+	g_assert(idx <= rs->path_len);
+
+	for (i = pb->target.v.upcoming; i < idx; i++)
+		publish_upcoming_remove(rs->path[i].kn);
+
+	pb->target.v.upcoming = MAX(idx, pb->target.v.upcoming);
+}
+
 /**
  * Destroy a publish request.
  */
@@ -400,6 +532,7 @@ publish_free(publish_t *pb)
 		pmsg_free_null(&pb->target.c.pending);
 		break;
 	case PUBLISH_VALUE:
+		publish_upcoming_advance(pb, pb->target.v.rs->path_len);
 		dht_value_free(pb->target.v.value, TRUE);
 		WFREE_NULL(pb->target.v.status,
 			pb->target.v.rs->path_len * sizeof *pb->target.v.status);
@@ -871,6 +1004,72 @@ publish_async_iterate(publish_t *pb)
 	pb->delay_ev = cq_main_insert(1, publish_delay_expired, pb);
 }
 
+/**
+ * Account for the STORE status returned by a node for one published value.
+ *
+ * @param pb			the publish object
+ * @param kn			node sending the reply
+ * @param primary		primary key of the value
+ * @param secondary		secondary key of the value
+ * @param code			the STORE status code
+ * @param description	status description (not NUL-terminated), may be NULL
+ * @param length		length of the status description
+ *
+ * @return TRUE if OK, FALSE if the status code means we have to stop
+ * publishing to that node.
+ */
+static bool
+publish_status_record(publish_t *pb, const knode_t *kn,
+	const kuid_t *primary, const kuid_t *secondary,
+	uint16 code, const char *description, uint16 length)
+{
+	if (STORE_SC_OK == code) {
+		if (GNET_PROPERTY(dht_publish_debug) > 3)
+			g_debug("DHT PUBLISH[%s] STORED pk=%s sk=%s at %s",
+				nid_to_string(&pb->pid),
+				kuid_to_hex_string(primary),
+				kuid_to_hex_string2(secondary), knode_to_string(kn));
+
+		pb->published++;
+		return TRUE;
+	}
+
+	if (GNET_PROPERTY(dht_publish_debug)) {
+		char msg[80];
+		clamp_strncpy(msg, sizeof msg, description, length);
+		g_debug("DHT PUBLISH[%s] cannot STORE "
+			"pk=%s sk=%s at %s: %s (%s)",
+			nid_to_string(&pb->pid),
+			kuid_to_hex_string(primary),
+			kuid_to_hex_string2(secondary), knode_to_string(kn),
+			dht_store_error_to_string(code), msg);
+	}
+
+	pb->errors++;
+
+	/*
+	 * Some specific error codes prevent us from continuing.
+	 *
+	 * These codes were published on the GDF:
+	 *   http://groups.yahoo.com/group/the_gdf/message/23498
+	 *   http://groups.yahoo.com/group/the_gdf/message/23502
+	 */
+
+	switch (code) {
+	case STORE_SC_FULL:
+	case STORE_SC_FULL_LOADED:
+	case STORE_SC_EXHAUSTED:
+		return FALSE;
+	case STORE_SC_BAD_TOKEN:
+		tcache_remove(kn->id);
+		return FALSE;
+	default:
+		break;
+	}
+
+	return TRUE;
+}
+
 /**
  * Handle STORE acknowledgement from node.
  *
@@ -1007,49 +1206,11 @@ publish_handle_reply(publish_t *pb, const knode_t *kn,
 			goto abort_publishing;
 		}
 
-		if (STORE_SC_OK == status.code) {
-			if (GNET_PROPERTY(dht_publish_debug) > 3)
-				g_debug("DHT PUBLISH[%s] STORED pk=%s sk=%s at %s",
-					nid_to_string(&pb->pid),
-					kuid_to_hex_string(&primary),
-					kuid_to_hex_string2(&secondary), knode_to_string(kn));
-
-			pb->published++;
-		} else {
-			if (GNET_PROPERTY(dht_publish_debug)) {
-				char msg[80];
-				clamp_strncpy(msg, sizeof msg,
-					status.description, status.length);
-				g_debug("DHT PUBLISH[%s] cannot STORE "
-					"pk=%s sk=%s at %s: %s (%s)",
-					nid_to_string(&pb->pid),
-					kuid_to_hex_string(&primary),
-					kuid_to_hex_string2(&secondary), knode_to_string(kn),
-					dht_store_error_to_string(status.code), msg);
-			}
-
-			pb->errors++;
-
-			/*
-			 * Some specific error codes prevent us from continuing.
-			 *
-			 * These codes were published on the GDF:
-			 *   http://groups.yahoo.com/group/the_gdf/message/23498
-			 *   http://groups.yahoo.com/group/the_gdf/message/23502
-			 */
-
-			switch (status.code) {
-			case STORE_SC_FULL:
-			case STORE_SC_FULL_LOADED:
-			case STORE_SC_EXHAUSTED:
-				goto abort_publishing;
-			case STORE_SC_BAD_TOKEN:
-				tcache_remove(kn->id);
-				goto abort_publishing;
-			default:
-				break;
-			}
-		}
+		if (
+			!publish_status_record(pb, kn, &primary, &secondary,
+				status.code, status.description, status.length)
+		)
+			goto abort_publishing;
 	}
 
 	/*
@@ -1243,19 +1404,30 @@ pb_freeing_msg(void *obj)
 	pb->msg_pending--;
 }
 
+/**
+ * Account for a sent STORE message.
+ *
+ * @param pb		the publish object
+ * @param size		amount of bytes sent on behalf of the publish
+ */
 static void
-pb_msg_sent(void *obj, pmsg_t *mb)
+publish_msg_sent(publish_t *pb, int size)
 {
-	publish_t *pb = obj;
 	publish_check(pb);
 
 	g_assert(pb->rpc_pending > 0);
 	pb->msg_sent++;
-	pb->bw_outgoing += pmsg_written_size(mb);
+	pb->bw_outgoing += size;
 	if (pb->udp_drops > 0)
 		pb->udp_drops--;
 }
 
+static void
+pb_msg_sent(void *obj, pmsg_t *mb)
+{
+	publish_msg_sent(obj, pmsg_written_size(mb));
+}
+
 static void
 pb_msg_dropped(void *obj, knode_t *unused_kn, pmsg_t *mb)
 {
@@ -1507,6 +1679,7 @@ pb_value_handling_rpc(void *obj, enum dht_rpc_ret type,
 	 */
 
 	pb->target.v.idx = publish_value_next_unstored(pb, pb->target.v.idx + 1);
+	publish_upcoming_advance(pb, pb->target.v.idx);
 
 	/*
 	 * On timeout, we invalidate the token cache for the node because
@@ -1521,6 +1694,46 @@ pb_value_handling_rpc(void *obj, enum dht_rpc_ret type,
 	}
 }
 
+/**
+ * Record the STORE status code obtained from a root which replied to the
+ * value publishing.
+ *
+ * @return FALSE if the publish was terminated.
+ */
+static bool
+publish_value_record_reply(publish_t *pb, const knode_t *kn, uint16 code)
+{
+	publish_check(pb);
+	g_assert(PUBLISH_VALUE == pb->type);
+
+	/*
+	 * We count the amount of replies because, regardless of whether we got
+	 * a successful status or an error back, we must not attempt to store
+	 * values beyond the k-closest alive nodes.
+	 */
+
+	pb->rpc_replies++;
+	publish_value_set_store_status(pb, kn, code);
+
+	switch (code) {
+	case STORE_SC_FULL:
+	case STORE_SC_FULL_LOADED:
+		if (++pb->target.v.full >= PB_MAX_FULL) {
+			if (GNET_PROPERTY(dht_publish_debug)) {
+				g_warning("DHT PUBLISH[%s] terminating due to key being full",
+					nid_to_string(&pb->pid));
+			}
+			publish_terminate(pb, PUBLISH_E_POPULAR);
+			return FALSE;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return TRUE;
+}
+
 static bool
 pb_value_handle_reply(void *obj, const knode_t *kn,
 	kda_msg_t function, const char *payload, size_t len, uint32 udata)
@@ -1601,31 +1814,10 @@ pb_value_handle_reply(void *obj, const knode_t *kn,
 
 	stable_record_activity(kn);
 
-	/*
-	 * We count the amount of replies because, regardless of whether we got
-	 * a successful status or an error back, we must not attempt to store
-	 * values beyond the k-closest alive nodes.
-	 */
-
-	pb->rpc_replies++;
 	publish_handle_reply(pb, kn, payload, len, NULL, &code);
-	publish_value_set_store_status(pb, kn, code);
 
-	switch (code) {
-	case STORE_SC_FULL:
-	case STORE_SC_FULL_LOADED:
-		if (++pb->target.v.full >= PB_MAX_FULL) {
-			if (GNET_PROPERTY(dht_publish_debug)) {
-				g_warning("DHT PUBLISH[%s] terminating due to key being full",
-					nid_to_string(&pb->pid));
-			}
-			publish_terminate(pb, PUBLISH_E_POPULAR);
-			return FALSE;		/* Do not iterate, publish was terminated */
-		}
-		break;
-	default:
-		break;
-	}
+	if (!publish_value_record_reply(pb, kn, code))
+		return FALSE;		/* Do not iterate, publish was terminated */
 
 	return can_iterate;
 }
@@ -1918,63 +2110,820 @@ publish_value_send(publish_t *pb, knode_t *kn, pmsg_t *mb)
 	pb->flags &= ~PB_F_SENDING;
 }
 
+/***
+ *** STORE batches.
+ ***/
+
+typedef enum {
+	PUBLISH_BATCH_MAGIC = 0x2e9c1b43U
+} publish_batch_magic_t;
+
 /**
- * Main iteration control for value publishing.
+ * A publish contributing a value to a STORE batch.
  */
-static void
-publish_value_iterate(publish_t *pb)
-{
-	pmsg_t *mb;
-	GSList *sl;
-	lookup_rc_t *rc;
+struct publish_member {
+	struct nid pid;				/**< Publish ID */
+	uint32 hop;					/**< Publish hop when value was added */
+};
 
-	publish_check(pb);
-	g_assert(PUBLISH_VALUE == pb->type);
+/**
+ * A STORE batch, holding values from several publishes for the same root.
+ */
+struct publish_batch {
+	publish_batch_magic_t magic;
+	struct nid bid;				/**< Batch ID, for RPC events */
+	knode_t *kn;				/**< Root where values are sent (refcounted) */
+	void *token;				/**< Security token for root */
+	uint8 toklen;				/**< Length of security token */
+	bool cached_token;			/**< Whether token comes from token cache */
+	struct publish_member members[PB_BATCH_MAX_VALUES];
+	int count;					/**< Amount of members */
+	size_t size;				/**< Size of serialized STORE message */
+	cevent_t *flush_ev;			/**< Flushing event, whilst batch is open */
+	uint32 flags;				/**< Operating flags */
+};
 
-	/*
-	 * If we have no more messages to send, we're done.
-	 *
-	 * NB: it is possible to have pb->cnt == 0 when a background publishing
-	 * is requested but none of the previous STORE status indicated that
-	 * we could re-attempt a new STORE request.
-	 */
+/**
+ * Operating flags for STORE batches.
+ */
+#define PBB_F_MSG_PENDING	(1U << 0)	/**< Message not processed yet */
+#define PBB_F_RPC_PENDING	(1U << 1)	/**< RPC not completed yet */
 
-	if (
-		pb->target.v.idx >= pb->target.v.rs->path_len ||	/* No more nodes */
-		pb->rpc_replies >= pb->cnt					/* Reached count target */
-	) {
-		publish_terminate(pb,
-			(pb->rpc_replies || 0 == pb->cnt) ? PUBLISH_E_OK : PUBLISH_E_NONE);
-		return;
-	}
+static inline void
+publish_batch_check(const struct publish_batch *b)
+{
+	g_assert(b);
+	g_assert(PUBLISH_BATCH_MAGIC == b->magic);
+}
 
-	/*
-	 * Build message to send to next node.
-	 */
+/**
+ * Check whether sent batch is still alive.
+ *
+ * @return NULL if the batch ID is unknown, otherwise the batch object
+ */
+static void *
+publish_batch_is_alive(struct nid bid)
+{
+	struct publish_batch *b;
 
-	g_assert(size_is_non_negative(pb->target.v.idx));
-	g_assert(pb->target.v.idx < pb->target.v.rs->path_len);
+	if (NULL == publish_batches_sent)
+		return NULL;
 
-	rc = &pb->target.v.rs->path[pb->target.v.idx];
+	b = htable_lookup(publish_batches_sent, &bid);
 
-	if (GNET_PROPERTY(dht_publish_debug) > 4) {
-		char buf[80];
-		bin_to_hex_buf(rc->token, rc->token_len, buf, sizeof buf);
-		g_debug("DHT PUBLISH[%s] at root %u/%u, "
-			"using %u-byte token \"%s\" for %s",
-			nid_to_string(&pb->pid),
-			(unsigned) pb->target.v.idx + 1,
-			(unsigned) pb->target.v.rs->path_len,
-			rc->token_len, buf, knode_to_string(rc->kn));
-	}
+	if (b)
+		publish_batch_check(b);
 
-	sl = kmsg_build_store(rc->token, rc->token_len, &pb->target.v.value, 1);
+	return b;
+}
 
-	g_assert(sl != NULL);
-	g_assert(g_slist_length(sl) == 1);
+/**
+ * Destroy a STORE batch, which must no longer be referenced by any table.
+ */
+static void
+publish_batch_free(struct publish_batch *b)
+{
+	publish_batch_check(b);
 
-	mb = sl->data;
-	g_slist_free(sl);
+	cq_cancel(&b->flush_ev);
+	knode_free(b->kn);
+	WFREE_NULL(b->token, b->toklen);
+	b->magic = 0;
+	WFREE(b);
+}
+
+/**
+ * Destroy sent batch once both its message and its RPC were processed.
+ */
+static void
+publish_batch_release(struct publish_batch *b)
+{
+	publish_batch_check(b);
+
+	if (b->flags & (PBB_F_MSG_PENDING | PBB_F_RPC_PENDING))
+		return;
+
+	htable_remove(publish_batches_sent, &b->bid);
+	publish_batch_free(b);
+}
+
+/**
+ * Fetch the publish object of the i-th member of the batch.
+ *
+ * A member cannot move on to its next root until the batch RPC completes,
+ * but it may still be alive at a later hop when the message is freed after
+ * an RPC timeout.
+ *
+ * @return the publish object if it is still alive, NULL otherwise.
+ */
+static publish_t *
+publish_batch_member(const struct publish_batch *b, int i)
+{
+	publish_t *pb;
+
+	publish_batch_check(b);
+	g_assert(i >= 0 && i < b->count);
+
+	pb = publish_is_alive(b->members[i].pid);
+
+	if (pb != NULL)
+		g_assert(PUBLISH_VALUE == pb->type);
+
+	return pb;
+}
+
+/**
+ * Collect the publish IDs of the members of the batch still alive.
+ *
+ * @return the amount of IDs filled in the supplied vector.
+ */
+static int
+publish_batch_alive(const struct publish_batch *b,
+	struct nid pids[PB_BATCH_MAX_VALUES])
+{
+	int i, n = 0;
+
+	for (i = 0; i < b->count; i++) {
+		publish_t *pb = publish_batch_member(b, i);
+
+		if (pb != NULL)
+			pids[n++] = pb->pid;
+	}
+
+	return n;
+}
+
+/**
+ * RPC event callbacks for STORE batches, dispatching events to the
+ * contributing publishes as if each of them had sent its own STORE.
+ */
+
+static void
+pbb_freeing_msg(void *obj)
+{
+	struct publish_batch *b = obj;
+	int i;
+
+	publish_batch_check(b);
+	g_assert(b->flags & PBB_F_MSG_PENDING);
+
+	for (i = 0; i < b->count; i++) {
+		publish_t *pb = publish_batch_member(b, i);
+		if (pb != NULL)
+			pb_freeing_msg(pb);
+	}
+
+	b->flags &= ~PBB_F_MSG_PENDING;
+
+	/*
+	 * If the RPC already timed out, nothing else will be dispatched for
+	 * this batch.
+	 */
+
+	publish_batch_release(b);
+}
+
+static void
+pbb_msg_sent(void *obj, pmsg_t *mb)
+{
+	struct publish_batch *b = obj;
+	struct nid pids[PB_BATCH_MAX_VALUES];
+	int i, n;
+
+	publish_batch_check(b);
+
+	n = publish_batch_alive(b, pids);
+
+	for (i = 0; i < n; i++) {
+		publish_msg_sent(publish_is_alive(pids[i]),
+			pmsg_written_size(mb) / n);
+	}
+}
+
+static void
+pbb_msg_dropped(void *obj, knode_t *kn, pmsg_t *mb)
+{
+	struct publish_batch *b = obj;
+	int i;
+
+	publish_batch_check(b);
+
+	for (i = 0; i < b->count; i++) {
+		publish_t *pb = publish_batch_member(b, i);
+		if (pb != NULL)
+			pb_msg_dropped(pb, kn, mb);
+	}
+}
+
+static void
+pbb_rpc_cancelled(void *obj, uint32 unused_udata)
+{
+	struct publish_batch *b = obj;
+	int i;
+
+	publish_batch_check(b);
+	(void) unused_udata;
+
+	g_assert(b->flags & PBB_F_RPC_PENDING);
+
+	b->flags &= ~PBB_F_RPC_PENDING;
+
+	for (i = 0; i < b->count; i++) {
+		publish_t *pb = publish_batch_member(b, i);
+		if (pb != NULL)
+			pb_rpc_cancelled(pb, b->members[i].hop);
+	}
+
+	publish_batch_release(b);
+}
+
+static void
+pbb_handling_rpc(void *obj, enum dht_rpc_ret type,
+	const knode_t *kn, uint32 unused_udata)
+{
+	struct publish_batch *b = obj;
+	int i;
+
+	publish_batch_check(b);
+	(void) unused_udata;
+
+	g_assert(b->flags & PBB_F_RPC_PENDING);
+
+	b->flags &= ~PBB_F_RPC_PENDING;
+
+	for (i = 0; i < b->count; i++) {
+		publish_t *pb = publish_batch_member(b, i);
+		if (pb != NULL)
+			pb_value_handling_rpc(pb, type, kn, b->members[i].hop);
+	}
+}
+
+/**
+ * Parse the STORE acknowledgement for a batch, dispatching each status to
+ * the publish which sent the value.
+ *
+ * @param b			the STORE batch
+ * @param kn		node sending the reply
+ * @param payload	payload of the RPC reply
+ * @param len		length of the reply
+ * @param pids		IDs of the publishes to which the reply pertains
+ * @param codes		where STORE status codes are written, for each publish
+ * @param n			amount of entries in pids[] and codes[]
+ */
+static void
+publish_batch_parse_reply(const struct publish_batch *b, const knode_t *kn,
+	const char *payload, size_t len,
+	const struct nid *pids, uint16 *codes, int n)
+{
+	bstr_t *bs;
+	uint8 acks;
+	const char *reason;
+	unsigned i = 0;
+
+	bs = bstr_open(payload, len, GNET_PROPERTY(dht_debug) ? BSTR_F_ERROR : 0);
+
+	if (!bstr_read_u8(bs, &acks)) {
+		reason = "could not read amount of statuses";
+		goto bad;
+	}
+
+	for (i = 0; i < acks; i++) {
+		kuid_t primary;
+		kuid_t secondary;
+		uint16 code;
+		uint16 length;
+		const char *description = NULL;
+		publish_t *pb = NULL;
+		int j;
+
+		if (
+			!bstr_read(bs, &primary, KUID_RAW_SIZE) ||
+			!bstr_read(bs, &secondary, KUID_RAW_SIZE) ||
+			!bstr_read_be16(bs, &code) ||
+			!bstr_read_be16(bs, &length)
+		) {
+			reason = "truncated status";
+			goto bad;
+		}
+
+		if (length > 0) {
+			description = bstr_read_base(bs);
+			if (!bstr_skip(bs, length)) {
+				reason = "cannot grab status description string";
+				goto bad;
+			}
+		}
+
+		/*
+		 * A batch holds at most one value per key, all created by us.
+		 */
+
+		for (j = 0; j < n; j++) {
+			pb = publish_is_alive(pids[j]);
+			if (pb != NULL && kuid_eq(pb->key, &primary))
+				break;
+		}
+
+		if (j == n || !kuid_eq(&secondary, get_our_kuid())) {
+			if (GNET_PROPERTY(dht_debug) || GNET_PROPERTY(dht_publish_debug))
+				g_warning("DHT PUBLISH[%s] unexpected status #%u in batch "
+					"STORE_RESPONSE from %s: pk=%s sk=%s",
+					nid_to_string(&b->bid), i + 1, knode_to_string(kn),
+					kuid_to_hex_string(&primary),
+					kuid_to_hex_string2(&secondary));
+			continue;
+		}
+
+		codes[j] = code;
+		publish_status_record(pb, kn, &primary, &secondary,
+			code, description, length);
+	}
+
+	bstr_free(&bs);
+	return;
+
+bad:
+	if (GNET_PROPERTY(dht_debug) || GNET_PROPERTY(dht_publish_debug))
+		g_warning("DHT PUBLISH[%s] improper batch STORE_RESPONSE status #%u "
+			"from %s: %s%s%s",
+			nid_to_string(&b->bid), i + 1, knode_to_string(kn), reason,
+			bstr_has_error(bs) ? ": " : "",
+			bstr_has_error(bs) ? bstr_error(bs) : "");
+
+	bstr_free(&bs);
+}
+
+static bool
+pbb_handle_reply(void *obj, const knode_t *kn,
+	kda_msg_t function, const char *payload, size_t len, uint32 unused_udata)
+{
+	struct publish_batch *b = obj;
+	struct nid pids[PB_BATCH_MAX_VALUES];
+	uint16 codes[PB_BATCH_MAX_VALUES];
+	int i, n;
+
+	publish_batch_check(b);
+	(void) unused_udata;
+
+	n = publish_batch_alive(b, pids);
+
+	if (0 == n)
+		goto done;
+
+	for (i = 0; i < n; i++) {
+		publish_t *pb = publish_is_alive(pids[i]);
+		pb->bw_incoming += (len + KDA_HEADER_SIZE) / n;
+		codes[i] = STORE_SC_ERROR;		/* Assume the worst */
+	}
+
+	if (function != KDA_MSG_STORE_RESPONSE) {
+		if (GNET_PROPERTY(dht_publish_debug)) {
+			g_warning("DHT PUBLISH[%s] batch got unexpected %s reply from %s",
+				nid_to_string(&b->bid), kmsg_name(function),
+				knode_to_string(kn));
+		}
+		for (i = 0; i < n; i++) {
+			publish_t *pb = publish_is_alive(pids[i]);
+			pb->rpc_bad++;
+		}
+		goto iterate;
+	}
+
+	/*
+	 * Same logic as pb_value_handle_reply(), only for all the publishes
+	 * at once.
+	 */
+
+	if (kn->flags & (KNODE_F_FIREWALLED | KNODE_F_SHUTDOWNING)) {
+		if (GNET_PROPERTY(dht_publish_debug)) {
+			g_warning("DHT PUBLISH[%s] batch got %s from to-be-ignored %s%s%s",
+				nid_to_string(&b->bid), kmsg_name(function),
+				(kn->flags & KNODE_F_FIREWALLED) ? "firewalled " : "",
+				(kn->flags & KNODE_F_SHUTDOWNING) ? "shutdowning " : "",
+				knode_to_string(kn));
+		}
+		tcache_remove(kn->id);
+		for (i = 0; i < n; i++) {
+			publish_t *pb = publish_is_alive(pids[i]);
+			pb->rpc_bad++;
+			publish_value_set_store_status(pb, kn, STORE_SC_FIREWALLED);
+		}
+		goto iterate;
+	}
+
+	stable_record_activity(kn);
+	publish_batch_parse_reply(b, kn, payload, len, pids, codes, n);
+
+	for (i = 0; i < n; i++) {
+		publish_t *pb = publish_is_alive(pids[i]);
+		if (pb != NULL)
+			publish_value_record_reply(pb, kn, codes[i]);
+	}
+
+	/* FALL THROUGH */
+
+iterate:
+	/*
+	 * Publishes terminated whilst processing the reply are no longer alive.
+	 */
+
+	for (i = 0; i < n; i++) {
+		publish_t *pb = publish_is_alive(pids[i]);
+		if (pb != NULL) {
+			g_assert(0 == pb->rpc_pending);
+			publish_iterate(pb);
+		}
+	}
+
+	/* FALL THROUGH */
+
+done:
+	publish_batch_release(b);
+	return FALSE;		/* Publishes were already iterated */
+}
+
+static void
+pbb_iterate(void *obj, enum dht_rpc_ret unused_type, uint32 unused_udata)
+{
+	struct publish_batch *b = obj;
+	struct nid pids[PB_BATCH_MAX_VALUES];
+	int i, n;
+
+	publish_batch_check(b);
+	(void) unused_type;
+	(void) unused_udata;
+
+	/*
+	 * Only invoked on RPC timeouts, since replies are fully processed by
+	 * pbb_handle_reply().
+	 */
+
+	n = publish_batch_alive(b, pids);
+
+	for (i = 0; i < n; i++) {
+		publish_t *pb = publish_is_alive(pids[i]);
+		if (pb != NULL) {
+			g_assert(0 == pb->rpc_pending);
+			publish_iterate(pb);
+		}
+	}
+
+	publish_batch_release(b);
+}
+
+static struct revent_ops publish_batch_ops = {
+	"PUBLISH",				/* name */
+	"holding values: ",		/* udata is the amount of values */
+	GNET_PROPERTY_PTR(dht_publish_debug),	/* debug */
+	publish_batch_is_alive,					/* is_alive */
+	/* message free routine callbacks */
+	pbb_freeing_msg,			/* freeing_msg */
+	pbb_msg_sent,				/* msg_sent */
+	pbb_msg_dropped,			/* msg_dropped */
+	pbb_rpc_cancelled,			/* rpc_cancelled */
+	/* RPC callbacks */
+	pbb_handling_rpc,			/* handling_rpc */
+	pbb_handle_reply,			/* handle_reply */
+	pbb_iterate,				/* iterate */
+};
+
+/**
+ * Send the values held in the batch to the root, as one STORE message.
+ *
+ * The batch is removed from the set of open batches and is released when
+ * the RPC events are processed, possibly before we return.
+ */
+static void
+publish_batch_flush(struct publish_batch *b)
+{
+	dht_value_t *vvec[PB_BATCH_MAX_VALUES];
+	struct nid pids[PB_BATCH_MAX_VALUES];
+	int i, n;
+	GSList *sl;
+	pmsg_t *mb;
+
+	publish_batch_check(b);
+	g_assert(!(b->flags & (PBB_F_MSG_PENDING | PBB_F_RPC_PENDING)));
+
+	htable_remove(publish_batches, b->kn);
+	cq_cancel(&b->flush_ev);
+
+	/*
+	 * Publishes may have been cancelled or may have expired whilst the
+	 * batch was open: their values are no longer sent.
+	 */
+
+	n = publish_batch_alive(b, pids);
+
+	if (0 == n) {
+		publish_batch_free(b);
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		publish_t *pb = publish_is_alive(pids[i]);
+
+		vvec[i] = pb->target.v.value;
+
+		/*
+		 * Same as publish_value_send(), to detect synchronous UDP drops.
+		 */
+
+		pb->flags |= PB_F_SENDING;
+		pb->flags &= ~PB_F_UDP_DROP;
+	}
+
+	sl = kmsg_build_store(b->token, b->toklen, vvec, n);
+
+	g_assert(sl != NULL);
+	g_assert(g_slist_length(sl) == 1);	/* Batch size limited accordingly */
+
+	mb = sl->data;
+	g_slist_free(sl);
+
+	if (n > 1) {
+		gnet_stats_inc_general(GNR_DHT_PUBLISHING_BATCHES);
+		gnet_stats_count_general(GNR_DHT_PUBLISHING_BATCHED_VALUES, n);
+	}
+
+	if (GNET_PROPERTY(dht_publish_debug) > 3) {
+		g_debug("DHT PUBLISH[%s] sending STORE batch of %d value%s "
+			"(%d bytes) with %s token to %s",
+			nid_to_string(&b->bid), n, 1 == n ? "" : "s", pmsg_size(mb),
+			b->cached_token ? "cached" : "lookup", knode_to_string(b->kn));
+	}
+
+	b->flags |= PBB_F_MSG_PENDING | PBB_F_RPC_PENDING;
+	htable_insert(publish_batches_sent, &b->bid, b);
+
+	revent_store(b->kn, mb, b->bid, &publish_batch_ops, n);
+	pmsg_free(mb);
+
+	/*
+	 * The batch may be gone now if the message was synchronously dropped.
+	 * If we got hit by synchronous dropping, delay further iterations.
+	 */
+
+	for (i = 0; i < n; i++) {
+		publish_t *pb = publish_is_alive(pids[i]);
+
+		if (NULL == pb)
+			continue;
+
+		pb->flags &= ~PB_F_SENDING;
+
+		if (pb->flags & PB_F_UDP_DROP)
+			publish_delay(pb);
+	}
+}
+
+/**
+ * Callout queue callback to flush an open batch.
+ */
+static void
+publish_batch_flush_expired(cqueue_t *unused_cq, void *obj)
+{
+	struct publish_batch *b = obj;
+
+	(void) unused_cq;
+	publish_batch_check(b);
+
+	b->flush_ev = NULL;
+	publish_batch_flush(b);
+}
+
+/**
+ * Create a new open batch for the root.
+ *
+ * The security token cached for the root is preferred over the one collected
+ * by the lookup, since it is the most recent one and it is not bound to a
+ * particular key.
+ */
+static struct publish_batch *
+publish_batch_create(const lookup_rc_t *rc)
+{
+	struct publish_batch *b;
+	const void *token;
+	uint8 toklen;
+
+	WALLOC0(b);
+	b->magic = PUBLISH_BATCH_MAGIC;
+	b->bid = publish_id_create();
+	b->kn = knode_refcnt_inc(rc->kn);
+
+	if (tcache_get(rc->kn->id, &toklen, &token, NULL)) {
+		b->cached_token = TRUE;
+	} else {
+		token = rc->token;
+		toklen = rc->token_len;
+	}
+
+	if (toklen != 0) {
+		b->token = wcopy(token, toklen);
+		b->toklen = toklen;
+	}
+
+	b->size = KDA_HEADER_SIZE + 1 + b->toklen + 1;
+	b->flush_ev = cq_main_insert(PB_BATCH_DELAY, publish_batch_flush_expired, b);
+	htable_insert(publish_batches, b->kn, b);
+
+	return b;
+}
+
+/**
+ * Can the value of the publish be added to the open batch?
+ */
+static bool
+publish_batch_accepts(const struct publish_batch *b, const publish_t *pb,
+	const lookup_rc_t *rc, size_t vsize)
+{
+	int i;
+
+	publish_batch_check(b);
+
+	if (b->count >= PB_BATCH_MAX_VALUES)
+		return FALSE;
+
+	if (b->size + vsize > PB_BATCH_MAX_SIZE)
+		return FALSE;
+
+	/*
+	 * Without a cached token, we use the one from the lookup, and we cannot
+	 * mix values obtained with different tokens.
+	 */
+
+	if (
+		!b->cached_token &&
+		(rc->token_len != b->toklen ||
+			(b->toklen != 0 && 0 != memcmp(rc->token, b->token, b->toklen)))
+	)
+		return FALSE;
+
+	/*
+	 * Values are stored by (primary, secondary) key: since all the values
+	 * are ours, each key can only appear once in a batch.
+	 */
+
+	for (i = 0; i < b->count; i++) {
+		const publish_t *member = publish_batch_member(b, i);
+
+		if (member != NULL && kuid_eq(member->key, pb->key))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Should the next STORE for the value publish be batched?
+ *
+ * There is no point delaying the STORE unless a batch is already open for
+ * the root, or another value publish still has the same root ahead in its
+ * path (the current publish accounts for one).
+ */
+static bool
+publish_batch_wanted(const knode_t *kn)
+{
+	return NULL != htable_lookup(publish_batches, kn) ||
+		publish_upcoming_count(kn) > 1;
+}
+
+/**
+ * Add the value of the publish to the open batch for the root, creating
+ * a new batch as needed.
+ *
+ * The publish is accounted for as if it had sent its STORE already.
+ */
+static void
+publish_batch_add(publish_t *pb, const lookup_rc_t *rc)
+{
+	struct publish_batch *b;
+	struct publish_member *m;
+	size_t vsize;
+
+	publish_check(pb);
+	g_assert(PUBLISH_VALUE == pb->type);
+
+	vsize = DHT_VALUE_HEADER_SIZE + dht_value_length(pb->target.v.value);
+	b = htable_lookup(publish_batches, rc->kn);
+
+	if (b != NULL && !publish_batch_accepts(b, pb, rc, vsize)) {
+		publish_batch_flush(b);
+		b = NULL;
+	}
+
+	if (NULL == b)
+		b = publish_batch_create(rc);
+
+	pb->hops++;
+	pb->msg_pending++;
+	pb->rpc_pending++;
+
+	m = &b->members[b->count++];
+	m->pid = pb->pid;
+	m->hop = pb->hops;
+	b->size += vsize;
+
+	if (GNET_PROPERTY(dht_publish_debug) > 3) {
+		g_debug("DHT PUBLISH[%s] hop %u batching STORE as #%d in %s "
+			"for node #%u/%u: %s",
+			nid_to_string(&pb->pid), pb->hops, b->count,
+			nid_to_string2(&b->bid),
+			(unsigned) pb->target.v.idx + 1,
+			(unsigned) pb->target.v.rs->path_len,
+			knode_to_string(rc->kn));
+	}
+
+	/*
+	 * Send immediately when no other value could fit in the message.
+	 */
+
+	if (
+		b->count >= PB_BATCH_MAX_VALUES ||
+		b->size + DHT_VALUE_HEADER_SIZE > PB_BATCH_MAX_SIZE
+	)
+		publish_batch_flush(b);
+}
+
+/**
+ * Hashtable iteration callback to free the STORE batches.
+ */
+static void
+free_publish_batch(const void *unused_key, void *value, void *unused_data)
+{
+	(void) unused_key;
+	(void) unused_data;
+
+	publish_batch_free(value);
+}
+
+/**
+ * Main iteration control for value publishing.
+ */
+static void
+publish_value_iterate(publish_t *pb)
+{
+	pmsg_t *mb;
+	GSList *sl;
+	lookup_rc_t *rc;
+
+	publish_check(pb);
+	g_assert(PUBLISH_VALUE == pb->type);
+
+	/*
+	 * If we have no more messages to send, we're done.
+	 *
+	 * NB: it is possible to have pb->cnt == 0 when a background publishing
+	 * is requested but none of the previous STORE status indicated that
+	 * we could re-attempt a new STORE request.
+	 */
+
+	if (
+		pb->target.v.idx >= pb->target.v.rs->path_len ||	/* No more nodes */
+		pb->rpc_replies >= pb->cnt					/* Reached count target */
+	) {
+		publish_terminate(pb,
+			(pb->rpc_replies || 0 == pb->cnt) ? PUBLISH_E_OK : PUBLISH_E_NONE);
+		return;
+	}
+
+	/*
+	 * Build message to send to next node.
+	 */
+
+	g_assert(size_is_non_negative(pb->target.v.idx));
+	g_assert(pb->target.v.idx < pb->target.v.rs->path_len);
+
+	rc = &pb->target.v.rs->path[pb->target.v.idx];
+
+	if (GNET_PROPERTY(dht_publish_debug) > 4) {
+		char buf[80];
+		bin_to_hex_buf(rc->token, rc->token_len, buf, sizeof buf);
+		g_debug("DHT PUBLISH[%s] at root %u/%u, "
+			"using %u-byte token \"%s\" for %s",
+			nid_to_string(&pb->pid),
+			(unsigned) pb->target.v.idx + 1,
+			(unsigned) pb->target.v.rs->path_len,
+			rc->token_len, buf, knode_to_string(rc->kn));
+	}
+
+	/*
+	 * Let the value be sent along with others to the same root if
+	 * other publishes are running.
+	 */
+
+	if (publish_batch_wanted(rc->kn)) {
+		publish_batch_add(pb, rc);
+		return;
+	}
+
+	sl = kmsg_build_store(rc->token, rc->token_len, &pb->target.v.value, 1);
+
+	g_assert(sl != NULL);
+	g_assert(g_slist_length(sl) == 1);
+
+	mb = sl->data;
+	g_slist_free(sl);
 
 	/*
 	 * Send message to node.
@@ -2475,6 +3424,7 @@ publish_value(dht_value_t *value, const lookup_rs_t *rs,
 	 * to be among the set of the k-closest neighbours of the publishing key.
 	 */
 
+	publish_upcoming_record(pb);
 	publish_self(pb);
 	publish_async_iterate(pb);
 	return pb;
@@ -2522,6 +3472,7 @@ publish_value_background(dht_value_t *value,
 		rs->path_len * sizeof *pb->target.v.status);
 	pb->flags |= PB_F_BACKGROUND;
 	pb->target.v.idx = publish_value_next_unstored(pb, 0);
+	publish_upcoming_record(pb);
 
 	/*
 	 * Contrary to a regular publish, we do not attempt to republish locally
@@ -2542,6 +3493,10 @@ publish_init(void)
 	g_assert(NULL == publishes);
 
 	publishes = htable_create_any(nid_hash, nid_hash2, nid_equal);
+	publish_batches = htable_create_any(publish_root_hash, NULL, publish_root_eq);
+	publish_upcoming = htable_create_any(publish_root_hash, NULL,
+		publish_root_eq);
+	publish_batches_sent = htable_create_any(nid_hash, nid_hash2, nid_equal);
 }
 
 /** 
@@ -2580,6 +3535,18 @@ free_publish(const void *key, void *value, void *data)
 	}
 }
 
+/**
+ * Hashtable iteration callback to free the upcoming root nodes.
+ */
+static void
+free_upcoming(const void *key, void *unused_value, void *unused_data)
+{
+	(void) unused_value;
+	(void) unused_data;
+
+	knode_free(deconstify_pointer(key));
+}
+
 /**
  * Cleanup data structures used by Kademlia publishing.
  *
@@ -2588,8 +3555,16 @@ free_publish(const void *key, void *value, void *data)
 void
 publish_close(bool exiting)
 {
+	htable_foreach(publish_batches, free_publish_batch, NULL);
+	htable_free_null(&publish_batches);
+	htable_foreach(publish_batches_sent, free_publish_batch, NULL);
+	htable_free_null(&publish_batches_sent);
+
 	htable_foreach(publishes, free_publish, &exiting);
 	htable_free_null(&publishes);
+
+	htable_foreach(publish_upcoming, free_upcoming, NULL);
+	htable_free_null(&publish_upcoming);
 }
 
 /* vi: set ts=4 sw=4 cindent: */
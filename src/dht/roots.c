@@ -39,18 +39,20 @@
  * going to rather slow lookups down, since we'll have to wait for more RPC
  * timeouts before moving forward.
  *
- * The cache is organized as two separate DBMW databases + one table kept in
+ * The cache is organized as one memory-mapped table + one table kept in
  * memory:
  *
  * + The memory table maps a target KUID to a structure keeping track of the
  *   last updates made to the root nodes for this KUID.
  *
- * + The first DBMW maps a KUID target to KDA_K dbkeys.  The intent is NOT to
- *   be able to share contact information between targets (this would involve
- *   refcounting and more I/O load for bookkeeping) but rather to prevent
- *   any size limitation of SDBM and keep values short-enough.
+ * + The memory-mapped table maps a KUID target to a fixed-size record holding
+ *   the contact information of its KDA_K roots.  Contacts are not shared
+ *   between targets (this would involve refcounting for bookkeeping).
  *
- * + The second DBMW maps each dbkey to a node contact.
+ * Since lookups for popular keys are frequent, seeding a lookup must be
+ * cheap: records are read directly from the mapped table, without any I/O
+ * nor deserialization, and updated in place.  The kernel lazily writes
+ * the modified pages back to disk.
  *
  * @author Raphael Manfredi
  * @date 2009
@@ -72,10 +74,9 @@
 
 #include "lib/atoms.h"
 #include "lib/cq.h"
-#include "lib/dbmw.h"
 #include "lib/dbstore.h"
-#include "lib/hset.h"
 #include "lib/map.h"
+#include "lib/mmhash.h"
 #include "lib/patricia.h"
 #include "lib/stringify.h"
 #include "lib/tm.h"
@@ -87,11 +88,7 @@
 
 #define ROOTS_CALLOUT		5000		/**< Heartbeat every 5 seconds */
 #define ROOTKEY_LIFETIME	(2*3600*1000)	/**< 2 hours */
-#define ROOTS_SYNC_PERIOD	60000		/**< Flush DB every minute */
-
-#define ROOTKEYS_DB_CACHE_SIZE	512		/**< Cached amount of root keys */
-#define CONTACT_DB_CACHE_SIZE	4096	/**< Cached amount of contacts */
-#define CONTACT_MAP_CACHE_SIZE	128		/**< Amount of SDBM pages to cache */
+#define ROOTS_SYNC_PERIOD	60000		/**< Flush table every minute */
 
 /**
  * Private callout queue used to expire entries in the database that have
@@ -108,18 +105,17 @@ static cqueue_t *roots_cq;
 static patricia_t *roots;
 
 /**
- * DBM wrapper to associate a target KUID with the set of KDA_K dbkeys.
+ * Memory-mapped table associating a target KUID with its KDA_K roots.
  */
-static dbmw_t *db_rootdata;
-static char db_rootdata_base[] = "dht_roots";
-static char db_rootdata_what[] = "DHT root node key datasets";
+static mmhash_t *db_rootdata;
+static char db_rootdata_base[] = "dht_root_cache";
+static char db_rootdata_what[] = "DHT root nodes";
 
-/**
- * DBM wrapper to associate a dbkey with the contact information.
+/*
+ * Roots used to be kept in two SDBM databases.
  */
-static dbmw_t *db_contact;
-static char db_contact_base[] = "dht_root_contacts";
-static char db_contact_what[] = "DHT root node contacts";
+static char db_rootdata_old_base[] = "dht_roots";
+static char db_contact_old_base[] = "dht_root_contacts";
 
 enum rootinfo_magic { ROOTINFO_MAGIC = 0x3320aefaU };
 
@@ -140,31 +136,14 @@ rootinfo_check(const struct rootinfo *ri)
 	g_assert(ROOTINFO_MAGIC == ri->magic);
 }
 
-#define ROOTDATA_STRUCT_VERSION	0
-
-/**
- * Information about a target KUID that is stored to disk.
- * The structure is serialized first, not written as-is.
- */
-struct rootdata {
-	uint64 dbkeys[KDA_K];	/**< SDBM keys pointing to contact information */
-	time_t last_update;		/**< When we last updated the key set */
-	uint8 count;			/**< Amount of dbkeys contained */
-};
-
-/**
- * Internal counter used to assign DB keys to the contacts we're storing.
- */
-static uint64 contactid = 1;		/* 0 is not a valid key (used as marker) */
-
-#define CONTACT_STRUCT_VERSION	1
+#define ROOTDATA_STRUCT_VERSION	1
 
 /**
  * Contact information.
- * The structure is serialized first, not written as-is.
+ * The structure is held as-is in the memory-mapped table.
  */
 struct contact {
-	kuid_t *id;				/**< KUID of the node (atom) */
+	kuid_t id;				/**< KUID of the node */
 	vendor_code_t vcode;	/**< Vendor code */
 	time_t first_seen;		/**< First seen time */
 	host_addr_t addr;		/**< IP of the node */
@@ -173,8 +152,18 @@ struct contact {
 	uint8 minor;			/**< Minor version */
 };
 
-static unsigned targets_managed;	/**< Amount of targets held in database */
-static unsigned contacts_managed;	/**< Amount of contacts held in database */
+/**
+ * Information about a target KUID that is stored to disk.
+ * The structure is held as-is in the memory-mapped table.
+ */
+struct rootdata {
+	time_t last_update;		/**< When we last updated the contact set */
+	uint8 count;			/**< Amount of contacts held */
+	struct contact contacts[KDA_K];	/**< The roots, closest first */
+};
+
+static unsigned targets_managed;	/**< Amount of targets held in table */
+static unsigned contacts_managed;	/**< Amount of contacts held in table */
 
 /**
  * Allocate a new rootinfo structure.
@@ -205,106 +194,49 @@ free_rootinfo(struct rootinfo *ri)
 }
 
 /**
- * Get rootdata from database.
+ * Get rootdata from table.
+ *
+ * @return pointer to the record within the table, NULL if not found.
  */
-static struct rootdata *
+static const struct rootdata *
 get_rootdata(const kuid_t *id)
 {
-	struct rootdata *rd;
+	const struct rootdata *rd;
 
-	rd = dbmw_read(db_rootdata, id, NULL);
+	rd = mmhash_lookup(db_rootdata, id);
 
 	if (NULL == rd) {
-		if (dbmw_has_ioerr(db_rootdata)) {
-			g_warning("DBMW \"%s\" I/O error, bad things could happen...",
-				dbmw_name(db_rootdata));
-		} else {
-			g_warning("key %s exists but was not found in DBMW \"%s\"",
-				kuid_to_hex_string(id), dbmw_name(db_rootdata));
-		}
+		g_warning("key %s exists but was not found in \"%s\"",
+			kuid_to_hex_string(id), mmhash_name(db_rootdata));
 	}
 
 	return rd;
 }
 
 /**
- * Get contact from database.
- */
-static struct contact *
-get_contact(uint64 dbkey, bool shout)
-{
-	struct contact *c;
-
-	c = dbmw_read(db_contact, &dbkey, NULL);
-
-	if (NULL == c) {
-		if (dbmw_has_ioerr(db_contact)) {
-			g_warning("DBMW \"%s\" I/O error, bad things could happen...",
-				dbmw_name(db_contact));
-		} else if (shout) {
-			g_warning("key %s exists but was not found in DBMW \"%s\"",
-				uint64_to_string(dbkey), dbmw_name(db_contact));
-		}
-	}
-
-	return c;
-}
-
-/**
- * Delete contact from database.
- */
-static void
-delete_contact(uint64 dbkey)
-{
-	g_assert(uint_is_positive(contacts_managed));
-
-	contacts_managed--;
-	gnet_stats_dec_general(GNR_DHT_CACHED_ROOTS_HELD);
-
-	dbmw_delete(db_contact, &dbkey);
-
-	if (GNET_PROPERTY(dht_roots_debug) > 2)
-		g_debug("DHT contact DB-key %s reclaimed", uint64_to_string(dbkey));
-}
-
-/**
- * Delete rootdata from database.
+ * Delete rootdata from table.
  */
 static void
 delete_rootdata(const kuid_t *id)
 {
 	const struct rootdata *rd;
-	unsigned i;
 
 	rd = get_rootdata(id);
 	if (NULL == rd)
 		return;
 
-	for (i = 0; i < rd->count; i++) {
-		delete_contact(rd->dbkeys[i]);
-	}
+	g_assert(contacts_managed >= rd->count);
 
-	dbmw_delete(db_rootdata, id);
+	contacts_managed -= rd->count;
+	gnet_stats_count_general(GNR_DHT_CACHED_ROOTS_HELD, -rd->count);
+
+	mmhash_remove(db_rootdata, id);
 
 	if (GNET_PROPERTY(dht_roots_debug) > 2)
 		g_debug("DHT ROOTS k-closest nodes from %s reclaimed",
 			kuid_to_hex_string(id));
 }
 
-/**
- * Map iterator callback to reclaim a DB-key value.
- */
-static void
-reclaim_dbkey(void *u_key, void *val, void *u_data)
-{
-	uint64 *dbkey = val;
-
-	(void) u_key;
-	(void) u_data;
-
-	delete_contact(*dbkey);
-}
-
 /**
  * Callout queue callback to expire target.
  */
@@ -336,16 +268,11 @@ roots_record(patricia_t *nodes, const kuid_t *kuid)
 {
 	struct rootinfo *ri;
 	struct rootdata *rd;
-	struct rootdata new_rd;
-	struct {
-		kuid_t id;
-		uint64 dbkey;
-	} previous[KDA_K];
-	map_t *existing;
+	struct rootdata previous;
 	patricia_iter_t *iter;
-	unsigned i;
+	unsigned i, j;
 	unsigned new = 0, reused = 0;	/* For logging */
-	bool existed = FALSE;			/* For logging */
+	bool created;
 
 	g_assert(nodes != NULL);
 	g_assert(kuid != NULL);
@@ -364,57 +291,23 @@ roots_record(patricia_t *nodes, const kuid_t *kuid)
 	if (NULL == ri) {
 		ri = allocate_rootinfo(kuid);
 		patricia_insert(roots, ri->kuid, ri);
-		rd = &new_rd;
-		new_rd.count = 0;
 		targets_managed++;
 		gnet_stats_inc_general(GNR_DHT_CACHED_KUID_TARGETS_HELD);
-	} else {
-		rd = get_rootdata(kuid);
-		if (NULL == rd) {
-			if (dbmw_has_ioerr(db_rootdata))
-				return;			/* I/O error */
-			/* Key supposed to exist but not found -> DB was corrupted */
-			rd = &new_rd;
-			new_rd.count = 0;
-		} else {
-			existed = TRUE;
-		}
 	}
 
 	/*
-	 * To avoid having to create new (and then delete old) contacts, we
-	 * retrieve all the known old roots and map their KUID to the existing
-	 * DB key that was used to retrieve each of them.  To prevent atom
-	 * creation, we take a copy of the KUIDs and dbkeys on the stack.
-	 *
-	 * Only truly new contacts will be created, and only old contacts that
-	 * are no longer present among the k-closest roots will be deleted.
+	 * The record is updated in place, so we take a copy of the old roots
+	 * on the stack to be able to reuse the information we had about the
+	 * contacts that are still among the k-closest roots.
 	 */
 
-	STATIC_ASSERT(G_N_ELEMENTS(rd->dbkeys) == G_N_ELEMENTS(previous));
-
-	existing = map_create_patricia(KUID_RAW_BITSIZE);
+	rd = mmhash_write(db_rootdata, kuid, &created);
 
-	for (i = 0; i < rd->count; i++) {
-		struct contact *c = get_contact(rd->dbkeys[i], FALSE);
-
-		/*
-		 * It can happen that ``rd'' contains DB keys that no longer exist
-		 * in the contact database.  At startup time, we clear orphaned keys,
-		 * but we do nothing against "ghost" DB keys referenced by entries
-		 * within db_rootdata.  These are harmless anyway and will disappear
-		 * as we expire entries or update them after a lookup.
-		 *
-		 * That's why the above get_contact() call silences "key not found"
-		 * type of warnings.
-		 */
-
-		if (NULL == c)
-			continue;		/* I/O error or stale info in ``rd'' */ 
-
-		previous[i].id = *c->id;		/* Struct copy */
-		previous[i].dbkey = rd->dbkeys[i];
-		map_insert(existing, &previous[i].id, &previous[i].dbkey);
+	if (created) {
+		previous.count = 0;
+	} else {
+		previous = *rd;		/* Struct copy */
+		g_assert(previous.count <= G_N_ELEMENTS(previous.contacts));
 	}
 
 	/*
@@ -424,77 +317,52 @@ roots_record(patricia_t *nodes, const kuid_t *kuid)
 	iter = patricia_metric_iterator_lazy(nodes, kuid, TRUE);
 	i = 0;
 
-	while (patricia_iter_has_next(iter) && i < G_N_ELEMENTS(rd->dbkeys)) {
+	while (patricia_iter_has_next(iter) && i < G_N_ELEMENTS(rd->contacts)) {
 		knode_t *kn = patricia_iter_next_value(iter);
-		uint64 *dbkey_ptr;
+		struct contact *c = &rd->contacts[i++];
+
+		for (j = 0; j < previous.count; j++) {
+			if (kuid_eq(&previous.contacts[j].id, kn->id))
+				break;
+		}
 
 		/*
 		 * If entry existed in the previous set, we reuse the old contact.
-		 *
-		 * Note that presence in the ``existing'' map means that we were
-		 * able to read the contact from the database earlier, so this time
-		 * we issue a verbose get_contact() call to warn if we fail to
-		 * retrieve the contact from the database again.
 		 */
 
-		dbkey_ptr = map_lookup(existing, kn->id);
-
-		if (NULL != dbkey_ptr) {
-			struct contact *c = get_contact(*dbkey_ptr, TRUE);
-
-			if (NULL == c)
-				continue;		/* I/O error, most probably */
+		if (j < previous.count) {
+			*c = previous.contacts[j];		/* Struct copy */
 
 			/* Update contact addr:port information, if stale */
 			if (c->port != kn->port || !host_addr_equal(c->addr, kn->addr)) {
 				c->port = kn->port;
 				c->addr = kn->addr;
 				c->first_seen = tm_time();	/* New node address */
-				dbmw_write(db_contact, dbkey_ptr, c, sizeof *c);
 				gnet_stats_inc_general(GNR_DHT_CACHED_ROOTS_CONTACT_REFRESHED);
 			}
-
-			map_remove(existing, kn->id);	/* We reused it */
-			rd->dbkeys[i++] = *dbkey_ptr;	/* Reuse existing contact */
 			reused++;
 		} else {
-			struct contact nc;
-			uint64 dbkey;
-
-			nc.id = kuid_get_atom(kn->id);	/* Freed through free_contact() */
-			nc.vcode = kn->vcode;	/* Struct copy */
-			nc.addr = kn->addr;		/* Struct copy */
-			nc.port = kn->port;
-			nc.major = kn->major;
-			nc.minor = kn->minor;
-			nc.first_seen = kn->first_seen;
-			dbkey = contactid++;
-			contacts_managed++;
-			gnet_stats_inc_general(GNR_DHT_CACHED_ROOTS_HELD);
-
-			dbmw_write(db_contact, &dbkey, &nc, sizeof nc);
-				
-			rd->dbkeys[i++] = dbkey;
+			c->id = *kn->id;		/* Struct copy */
+			c->vcode = kn->vcode;	/* Struct copy */
+			c->addr = kn->addr;		/* Struct copy */
+			c->port = kn->port;
+			c->major = kn->major;
+			c->minor = kn->minor;
+			c->first_seen = kn->first_seen;
 			new++;
 		}
 	}
 
-	rd->count = i;
 	patricia_iterator_release(&iter);
 
-	/*
-	 * Any remaining entry in ``existing'' was not reused and can be deleted.
-	 */
-
-	map_foreach(existing, reclaim_dbkey, NULL);
-	map_destroy(existing);
+	rd->count = i;
+	rd->last_update = tm_time();
 
-	/*
-	 * Persist rootdata and update rootinfo.
-	 */
+	g_assert(contacts_managed >= previous.count);
 
-	rd->last_update = tm_time();
-	dbmw_write(db_rootdata, kuid, rd, sizeof *rd);
+	contacts_managed += rd->count - previous.count;
+	gnet_stats_count_general(GNR_DHT_CACHED_ROOTS_HELD,
+		(int) rd->count - (int) previous.count);
 
 	if (ri->expire_ev) {
 		cq_resched(ri->expire_ev, ROOTKEY_LIFETIME);
@@ -507,10 +375,10 @@ roots_record(patricia_t *nodes, const kuid_t *kuid)
 			"(new=%u, reused=%u, elapsed=%s)",
 			rd->count, (unsigned) patricia_count(nodes),
 			1 == rd->count ? "" : "s",
-			existed ? "existing" : "new",
+			created ? "new" : "existing",
 			kuid_to_hex_string(kuid), new, reused,
-			existed ?
-				compact_time(delta_time(tm_time(), ri->last_update)) : "-");
+			created ?
+				"-" : compact_time(delta_time(tm_time(), ri->last_update)));
 	}
 
 	ri->last_update = tm_time();
@@ -520,7 +388,7 @@ roots_record(patricia_t *nodes, const kuid_t *kuid)
  * Fill the supplied vector `kvec' whose size is `kcnt' with the knodes
  * that are the closest neighbours we have found.
  *
- * @param rd		the contact data we have found
+ * @param rd		the roots we have found
  * @param kvec		base of the "knode_t *" vector
  * @param kcnt		size of the "knode_t *" vector
  * @param known		a PATRICIA containing known neighbours already.
@@ -531,7 +399,7 @@ roots_record(patricia_t *nodes, const kuid_t *kuid)
  * caller to invoke knode_free() on the returned entries.
  */
 static int
-roots_fill_vector(struct rootdata *rd,
+roots_fill_vector(const struct rootdata *rd,
 	knode_t **kvec, int kcnt, patricia_t *known,
 	const knode_t *furthest, const kuid_t *id)
 {
@@ -540,14 +408,15 @@ roots_fill_vector(struct rootdata *rd,
 
 	g_assert(NULL == furthest || id != NULL);
 
-	for (i = 0; i < rd->count && i < kcnt; i++) {
-		struct contact *c = get_contact(rd->dbkeys[i], FALSE);
-		knode_t *kn;
+	/*
+	 * Contacts are read directly from the memory-mapped table.
+	 */
 
-		if (NULL == c)
-			continue;		/* I/O error or corrupted database */
+	for (i = 0; i < rd->count && j < kcnt; i++) {
+		const struct contact *c = &rd->contacts[i];
+		knode_t *kn;
 
-		if (patricia_contains(known, c->id))
+		if (patricia_contains(known, &c->id))
 			continue;
 
 		/*
@@ -555,10 +424,10 @@ roots_fill_vector(struct rootdata *rd,
 		 * that boundary.
 		 */
 
-		if (furthest != NULL && kuid_cmp3(id, c->id, furthest->id) >= 0)
+		if (furthest != NULL && kuid_cmp3(id, &c->id, furthest->id) >= 0)
 			continue;
 
-		kn = knode_new(c->id, 0,
+		kn = knode_new(&c->id, 0,
 			c->addr, c->port, c->vcode, c->major, c->minor);
 		kn->flags |= KNODE_F_CACHED;
 		kn->first_seen = c->first_seen;
@@ -607,10 +476,10 @@ roots_fill_closest(const kuid_t *id,
 	ri = patricia_lookup(roots, id);
 
 	if (NULL != ri) {
-		struct rootdata *rd = get_rootdata(id);
+		const struct rootdata *rd = get_rootdata(id);
 
 		if (NULL == rd)
-			return 0;			/* I/O error or corrupted database */
+			return 0;			/* Corrupted table */
 
 		/*
 		 * We have an exact target match: return the nodes we have
@@ -668,7 +537,7 @@ roots_fill_closest(const kuid_t *id,
 			(void) patricia_iter_next_value(iter);	/* Skip exact match */
 
 			while (patricia_iter_has_next(iter)) {
-				struct rootdata *rd;
+				const struct rootdata *rd;
 
 				cri = patricia_iter_next_value(iter);
 				if (
@@ -681,7 +550,7 @@ roots_fill_closest(const kuid_t *id,
 
 				rd = get_rootdata(cri->kuid);
 				if (NULL == rd) {
-					cri = NULL;		/* I/O error or corrupted database */
+					cri = NULL;		/* Corrupted table */
 					break;
 				}
 				if (rd->count >= KDA_K)
@@ -730,11 +599,11 @@ roots_fill_closest(const kuid_t *id,
 				kuid_cmp3(id, cri->kuid, furthest->id) < 0
 			)
 		) {
-			struct rootdata *rd = get_rootdata(cri->kuid);
+			const struct rootdata *rd = get_rootdata(cri->kuid);
 			int added;
 
 			if (NULL == rd)
-				return 0;		/* I/O error or corrupted database */
+				return 0;		/* Corrupted table */
 
 			added = roots_fill_vector(rd, &kvec[filled], kcnt - filled, aknown,
 				furthest, id);
@@ -775,172 +644,18 @@ roots_fill_closest(const kuid_t *id,
 }
 
 /**
- * Serialization routine for rootdata.
- */
-static void
-serialize_rootdata(pmsg_t *mb, const void *data)
-{
-	const struct rootdata *rd = data;
-	unsigned i;
-
-	pmsg_write_u8(mb, rd->count);
-	pmsg_write_time(mb, rd->last_update);
-	for (i = 0; i < rd->count; i++) {
-		pmsg_write_be64(mb, rd->dbkeys[i]);
-	}
-
-	/*
-	 * Because this is persistent, version the structure so that changes
-	 * can be processed efficiently after an upgrade.
-	 *
-	 * This is done here and not at the beginning of the serialized data
-	 * because I forgot to plan for it before.
-	 *		--RAM, 2009-10-18
-	 */
-
-	pmsg_write_u8(mb, ROOTDATA_STRUCT_VERSION);
-}
-
-/**
- * Deserialization routine for rootdata.
- */
-static void
-deserialize_rootdata(bstr_t *bs, void *valptr, size_t len)
-{
-	struct rootdata *rd = valptr;
-	unsigned i;
-	uint8 version;
-
-	g_assert(sizeof *rd == len);
-
-	bstr_read_u8(bs, &rd->count);
-	bstr_read_time(bs, &rd->last_update);
-	g_assert(rd->count <= G_N_ELEMENTS(rd->dbkeys));
-
-	for (i = 0; i < rd->count; i++) {
-		bstr_read_be64(bs, &rd->dbkeys[i]);
-	}
-
-	bstr_read_u8(bs, &version);
-}
-
-/**
- * Serialization routine for contacts.
- */
-static void
-serialize_contact(pmsg_t *mb, const void *data)
-{
-	const struct contact *c = data;
-
-	pmsg_write(mb, c->id->v, KUID_RAW_SIZE);
-	pmsg_write_be32(mb, c->vcode.u32);
-	pmsg_write_ipv4_or_ipv6_addr(mb, c->addr);
-	pmsg_write_be16(mb, c->port);
-	pmsg_write_u8(mb, c->major);
-	pmsg_write_u8(mb, c->minor);
-
-	/*
-	 * Because this is persistent, version the structure so that changes
-	 * can be processed efficiently after an upgrade.
-	 *
-	 * This is done here and not at the beginning of the serialized data
-	 * because I forgot to plan for it before.
-	 *		--RAM, 2009-10-18
-	 */
-
-	pmsg_write_u8(mb, CONTACT_STRUCT_VERSION);
-	pmsg_write_time(mb, c->first_seen);	/* Added at version 1 */
-}
-
-/**
- * Deserialization routine for contacts.
- */
-static void
-deserialize_contact(bstr_t *bs, void *valptr, size_t len)
-{
-	struct contact *c = valptr;
-	kuid_t id;
-	uint8 version;
-
-	g_assert(sizeof *c == len);
-
-	c->id = NULL;
-
-	bstr_read(bs, id.v, KUID_RAW_SIZE);
-	bstr_read_be32(bs, &c->vcode.u32);
-	bstr_read_packed_ipv4_or_ipv6_addr(bs, &c->addr);
-	bstr_read_be16(bs, &c->port);
-	bstr_read_u8(bs, &c->major);
-	bstr_read_u8(bs, &c->minor);
-	bstr_read_u8(bs, &version);
-
-	/*
-	 * "first_seen" was added at version 1.
-	 */
-
-	if (version < 1)
-		c->first_seen = tm_time();
-	else
-		bstr_read_time(bs, &c->first_seen);
-
-	/*
-	 * Only create the KUID atom if there was no error in the deserialization
-	 * since the value free callbacks are not invoked by the DBMW layer when
-	 * there is a deserialization error.
-	 */
-
-	if (bstr_ended(bs)) {
-		c->id = kuid_get_atom(&id);
-	}
-}
-
-/**
- * Free routine for contacts, to release internally allocated memory, not
- * the structure itself.
- */
-static void
-free_contact(void *valptr, size_t len)
-{
-	struct contact *c = valptr;
-
-	g_assert(sizeof *c == len);
-
-	kuid_atom_free_null(&c->id);
-}
-
-/**
- * Context for recreate_ri() and remove_orphan().
- */
-struct recreate_context {
-	hset_t *dbkeys;			/* Seen DB keys (atoms) */
-	uint orphans;			/* Orphan keys found */
-};
-
-static void
-free_dbkey_kv(const void *key, void *u_data)
-{
-	const uint64 *dbkey = key;
-
-	(void) u_data;
-
-	atom_uint64_free(dbkey);
-}
-
-/**
- * DBMW foreach iterator to recreate keyinfo if not too ancient.
- * @return TRUE if entry is too ancient and key must be deleted.
+ * Table iterator to recreate rootinfo if not too ancient.
+ * @return TRUE if entry is too ancient or corrupted and must be deleted.
  */
 static bool
-recreate_ri(void *key, void *value, size_t u_len, void *data)
+recreate_ri(const void *key, void *value, void *u_data)
 {
-	struct recreate_context *ctx = data;
 	const struct rootdata *rd = value;
 	const kuid_t *id = key;
 	struct rootinfo *ri;
 	time_delta_t d;
-	int i;
 
-	(void) u_len;
+	(void) u_data;
 
 	/*
 	 * If cached roots are too ancient, drop them.
@@ -952,32 +667,19 @@ recreate_ri(void *key, void *value, size_t u_len, void *data)
 		g_debug("DHT ROOTS retrieved target %s (%s)",
 			kuid_to_hex_string(id), compact_time(d));
 
-	if (d >= ROOTKEY_LIFETIME / 1000) {
-		for (i = 0; i < rd->count; i++) {
-			dbmw_delete(db_contact, &rd->dbkeys[i]);
-		}
+	if (d >= ROOTKEY_LIFETIME / 1000 || d < 0)
+		return TRUE;
+
+	if (rd->count > G_N_ELEMENTS(rd->contacts)) {
+		g_warning("DHT ROOTS dropping corrupted roots for %s (count=%u)",
+			kuid_to_hex_string(id), rd->count);
 		return TRUE;
 	}
 
 	/*
 	 * OK, we can keep these roots.
-	 *
-	 * Be sure to remember the largest contact ID we keep, so that we can
-	 * initialize our counter properly for creating new entries later on.
 	 */
 
-	for (i = 0; i < rd->count; i++) {
-		uint64 dbkey = rd->dbkeys[i];
-
-		if (dbkey >= contactid)
-			contactid = dbkey + 1;
-
-		if (!hset_contains(ctx->dbkeys, &dbkey)) {
-			const uint64 *dbatom = atom_uint64_get(&dbkey);
-			hset_insert(ctx->dbkeys, dbatom);
-		}
-	}
-
 	ri = allocate_rootinfo(id);
 	patricia_insert(roots, ri->kuid, ri);
 	ri->last_update = rd->last_update;
@@ -1003,36 +705,14 @@ recreate_ri(void *key, void *value, size_t u_len, void *data)
 }
 
 /**
- * DBMW foreach iterator to remove orphan DB keys.
- * @return TRUE if entry is an orphan and must be deleted.
- */
-static bool
-remove_orphan(void *key, void *u_value, size_t u_len, void *data)
-{
-	struct recreate_context *ctx = data;
-	uint64 *dbkey = key;
-
-	(void) u_value;
-	(void) u_len;
-
-	if (hset_contains(ctx->dbkeys, dbkey)) {
-		ctx->orphans++;
-		return TRUE;
-	}
-
-	return FALSE;
-}
-
-/**
- * Periodic DB synchronization.
+ * Periodic table synchronization.
  */
 static bool
 roots_sync(void *unused_obj)
 {
 	(void) unused_obj;
 
-	dbstore_sync(db_rootdata);
-	dbstore_sync(db_contact);
+	mmhash_sync(db_rootdata);
 
 	return TRUE;
 }
@@ -1043,60 +723,34 @@ roots_sync(void *unused_obj)
 static void
 roots_init_rootinfo(void)
 {
-	struct recreate_context ctx;
 	size_t count;
 
 	if (GNET_PROPERTY(dht_roots_debug)) {
-		count = dbmw_count(db_rootdata);
-		g_debug("DHT ROOTS scanning %u retrieved target KUID%s",
-			(unsigned) count, 1 == count ? "" : "s");
+		count = mmhash_count(db_rootdata);
+		g_debug("DHT ROOTS scanning %zu retrieved target KUID%s",
+			count, 1 == count ? "" : "s");
 	}
 
-	ctx.dbkeys = hset_create(HASH_KEY_FIXED, sizeof(uint64));
-	ctx.orphans = 0;
+	mmhash_foreach_remove(db_rootdata, recreate_ri, NULL);
 
-	dbmw_foreach_remove(db_rootdata, recreate_ri, &ctx);
-	dbmw_foreach_remove(db_contact, remove_orphan, &ctx);
-
-	hset_foreach(ctx.dbkeys, free_dbkey_kv, NULL);
-	hset_free_null(&ctx.dbkeys);
-
-	count = dbmw_count(db_rootdata);
+	count = mmhash_count(db_rootdata);
 
 	if (GNET_PROPERTY(dht_roots_debug)) {
-		g_debug("DHT ROOTS kept %u target KUID%s: targets=%u, contacts=%u",
-			(unsigned) count, 1 == count ? "" : "s",
-			targets_managed, contacts_managed);
-		g_debug("DHT ROOTS stripped %u orphan contact DB-key%s",
-			ctx.orphans, 1 == ctx.orphans ? "" : "s");
+		g_debug("DHT ROOTS kept %zu target KUID%s: targets=%u, contacts=%u",
+			count, 1 == count ? "" : "s", targets_managed, contacts_managed);
 	}
 
 	/*
-	 * If we retained no entries, issue a dbmw_clear() to restore underlying
-	 * SDBM files to their smallest possible value.  This is necessary because
-	 * the database is persistent and it can grow very large on disk, but still
-	 * holding only a few values per page.  Being able to get a fresh start
-	 * occasionally is a plus.
+	 * If we retained no entries, clear the table to restore the underlying
+	 * file to its smallest possible size.
 	 */
 
 	if (0 == count) {
-		contactid = 1;
 		targets_managed = contacts_managed = 0;
 		if (GNET_PROPERTY(dht_roots_debug)) {
-			g_debug("DHT ROOTS clearing database");
-		}
-	} else {
-		if (GNET_PROPERTY(dht_roots_debug)) {
-			g_debug("DHT ROOTS shrinking database files");
+			g_debug("DHT ROOTS clearing table");
 		}
-	}
-
-	dbstore_shrink(db_rootdata);
-	dbstore_shrink(db_contact);
-
-	if (GNET_PROPERTY(dht_roots_debug)) {
-		g_debug("DHT ROOTS first allocated contact DB-key will be %s",
-			uint64_to_string(contactid));
+		mmhash_clear(db_rootdata);
 	}
 }
 
@@ -1106,37 +760,20 @@ roots_init_rootinfo(void)
 G_GNUC_COLD void
 roots_init(void)
 {
-	dbstore_kv_t root_kv = { KUID_RAW_SIZE, NULL, sizeof(struct rootdata), 0 };
-	dbstore_kv_t contact_kv = { sizeof(uint64), NULL, sizeof(struct contact),
-		sizeof(struct contact) + KUID_RAW_SIZE };
-	dbstore_packing_t root_packing =
-		{ serialize_rootdata, deserialize_rootdata, NULL };
-	dbstore_packing_t contact_packing =
-		{ serialize_contact, deserialize_contact, free_contact };
-
 	g_assert(NULL == roots_cq);
 	g_assert(NULL == roots);
 	g_assert(NULL == db_rootdata);
-	g_assert(NULL == db_contact);
 
 	roots_cq = cq_main_submake("roots", ROOTS_CALLOUT);
 	roots = patricia_create(KUID_RAW_BITSIZE);
 
-	/* Legacy: remove after 0.97 -- RAM, 2011-05-03 */
-	dbstore_move(settings_config_dir(), settings_dht_db_dir(), db_rootdata_base);
-	dbstore_move(settings_config_dir(), settings_dht_db_dir(), db_contact_base);
-
-	db_rootdata = dbstore_open(db_rootdata_what, settings_dht_db_dir(),
-		db_rootdata_base, root_kv, root_packing,
-		ROOTKEYS_DB_CACHE_SIZE, kuid_hash, kuid_eq,
-		GNET_PROPERTY(dht_storage_in_memory));
+	/* Roots used to be kept in SDBM databases */
+	dbstore_unlink_sdbm(settings_dht_db_dir(), db_rootdata_old_base);
+	dbstore_unlink_sdbm(settings_dht_db_dir(), db_contact_old_base);
 
-	db_contact = dbstore_open(db_contact_what, settings_dht_db_dir(),
-		db_contact_base, contact_kv, contact_packing,
-		CONTACT_DB_CACHE_SIZE, uint64_mem_hash, uint64_mem_eq,
-		GNET_PROPERTY(dht_storage_in_memory));
-
-	dbmw_set_map_cache(db_contact, CONTACT_MAP_CACHE_SIZE);
+	db_rootdata = mmhash_open(db_rootdata_what, settings_dht_db_dir(),
+		db_rootdata_base, KUID_RAW_SIZE, sizeof(struct rootdata),
+		ROOTDATA_STRUCT_VERSION, GNET_PROPERTY(dht_storage_in_memory));
 
 	roots_init_rootinfo();
 	cq_periodic_add(roots_cq, ROOTS_SYNC_PERIOD, roots_sync, NULL);
@@ -1175,11 +812,7 @@ roots_close(void)
 			targets_managed, contacts_managed);
 	}
 
-	dbstore_close(db_rootdata, settings_dht_db_dir(), db_rootdata_base);
-	db_rootdata = NULL;
-
-	dbstore_close(db_contact, settings_dht_db_dir(), db_contact_base);
-	db_contact = NULL;
+	mmhash_close_null(&db_rootdata);
 
 	cq_free_null(&roots_cq);
 }
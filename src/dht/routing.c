@@ -59,6 +59,7 @@
 #include "acct.h"
 #include "kuid.h"
 #include "knode.h"
+#include "ktable.h"
 #include "rpc.h"
 #include "lookup.h"
 #include "token.h"
@@ -87,14 +88,18 @@
 #include "lib/bigint.h"
 #include "lib/bit_array.h"
 #include "lib/cq.h"
+#include "lib/crc.h"
 #include "lib/file.h"
 #include "lib/getdate.h"
 #include "lib/glib-missing.h"
+#include "lib/halloc.h"
 #include "lib/hashlist.h"
 #include "lib/hikset.h"
 #include "lib/host_addr.h"
 #include "lib/map.h"
+#include "lib/mempcpy.h"
 #include "lib/parse.h"
+#include "lib/path.h"
 #include "lib/patricia.h"
 #include "lib/pow2.h"
 #include "lib/random.h"
@@ -166,6 +171,29 @@
 #define REFRESH_PERIOD			(60*60)		/* 1 hour */
 #define OUR_REFRESH_PERIOD		(15*60)		/* 15 minutes */
 
+/**
+ * Routing table snapshots.
+ *
+ * The routing table is saved whenever the set of good nodes changes, and
+ * at least every ROUTE_SNAPSHOT_PERIOD to keep the last-seen times accurate.
+ *
+ * When we restart with a snapshot younger than ROUTE_WARM_PERIOD, taken with
+ * the same KUID, we do not bootstrap again if enough of the closest nodes
+ * reply to a ping within ROUTE_VERIFY_TIMEOUT.  The other restored nodes are
+ * then pinged ROUTE_VERIFY_BATCH at a time, every ROUTE_VERIFY_PERIOD.
+ */
+#define ROUTE_SNAPSHOT_PERIOD	(5*60)		/* 5 minutes */
+#define ROUTE_WARM_PERIOD		(2*REFRESH_PERIOD)
+#define ROUTE_VERIFY_TIMEOUT	(15*1000)	/* 15 seconds, in ms */
+#define ROUTE_VERIFY_PERIOD		1000		/* 1 second, in ms */
+#define ROUTE_VERIFY_BATCH		8			/* Nodes pinged per stage */
+
+#define ROUTE_SNAP_MAGIC		"GDHT"
+#define ROUTE_SNAP_VERSION		1
+#define ROUTE_SNAP_HEADER		36	/* Magic, version, time, KUID, count */
+#define ROUTE_SNAP_RECORD		64	/* Size of node records */
+#define ROUTE_SNAP_MAX			65536	/* Max amount of nodes loaded */
+
 /*
  * K-bucket node information, accessed through the "kbucket" structure.
  */
@@ -243,6 +271,7 @@ struct kstats {
 	struct nsize network[K_REGIONS];	/**< K_OTHER_SIZE items at most */
 	statx_t *lookdata;			/**< Statistics on lookups[] */
 	statx_t *netdata;			/**< Statistics on network[] */
+	time_t saved;				/**< When routing table was last saved */
 	bool dirty;					/**< The "good" list was changed */
 };
 
@@ -258,17 +287,22 @@ static bool initialized;		/**< Whether dht_init() was called */
 static enum dht_bootsteps old_boot_status = DHT_BOOT_NONE;
 
 static struct kbucket *root = NULL;	/**< The root of the routing table tree. */
+static ktable_t *contacts;			/**< All the nodes in the routing table */
 static kuid_t *our_kuid;			/**< Our own KUID (atom) */
 static struct kstats stats;			/**< Statistics on the routing table */
 
-static const char dht_route_file[] = "dht_nodes";
+static const char dht_route_file[] = "dht_snapshot";
 static const char dht_route_what[] = "the DHT routing table";
+static const char node_file[] = "dht_nodes";
+static const char file_what[] = "DHT nodes";
 static const kuid_t kuid_null;
 
 static void bucket_alive_check(cqueue_t *cq, void *obj);
 static void bucket_stale_check(cqueue_t *cq, void *obj);
 static void bucket_refresh(cqueue_t *cq, void *obj);
 static void dht_route_retrieve(void);
+static bool route_verify_start(void);
+static void route_verify_clear(void);
 static struct kbucket *dht_find_bucket(const kuid_t *id);
 
 /*
@@ -838,6 +872,44 @@ allocate_node_lists(struct kbucket *kb)
 	kb->nodes->refresh = NULL;
 }
 
+/**
+ * Record node in the k-bucket's node table.
+ *
+ * The node is also recorded (or moved to the k-bucket when already present)
+ * in the flat table of all the contacts.
+ */
+static void
+bucket_insert_node(struct kbucket *kb, knode_t *kn)
+{
+	hikset_insert_key(kb->nodes->all, &kn->id);
+	ktable_insert(contacts, kn, kb);
+}
+
+/**
+ * Remove node from the k-bucket's node table and from the flat table of
+ * all the contacts.
+ */
+static void
+bucket_remove_node(struct kbucket *kb, knode_t *kn)
+{
+	hikset_remove(kb->nodes->all, kn->id);
+	ktable_remove(contacts, kn);
+}
+
+/**
+ * Hash set iterator to remove nodes still belonging to the k-bucket from
+ * the flat table of all the contacts.
+ */
+static void
+bucket_forget_contact(void *value, void *data)
+{
+	knode_t *kn = value;
+	const struct kbucket *kb = data;
+
+	if (ktable_group(contacts, kn) == kb)
+		ktable_remove(contacts, kn);
+}
+
 /**
  * Forget node previously held in the routing table.
  *
@@ -940,6 +1012,14 @@ free_node_lists(struct kbucket *kb)
 		check_leaf_list_consistency(kb, knodes->stale, KNODE_STALE);
 		check_leaf_list_consistency(kb, knodes->pending, KNODE_PENDING);
 
+		/*
+		 * Nodes moved to another bucket during a split or a merge were
+		 * re-attached to their new bucket in the contact table: the ones
+		 * still attached to this bucket are leaving the routing table.
+		 */
+
+		hikset_foreach(knodes->all, bucket_forget_contact, kb);
+
 		/* These cannot be NULL when kb->nodes is allocated */
 		free_node_hashlist(&knodes->good);
 		free_node_hashlist(&knodes->stale);
@@ -1534,6 +1614,17 @@ dht_attempt_bootstrap(void)
 	if (NULL == root)
 		return;
 
+	/*
+	 * If we restored a recent routing table, the verification of the
+	 * closest nodes will tell whether we need to bootstrap.
+	 */
+
+	if (route_verify_start()) {
+		if (GNET_PROPERTY(dht_debug))
+			g_debug("DHT bootstrap deferred: verifying restored nodes");
+		return;
+	}
+
 	/*
 	 * If we are already completely bootstrapped, there is nothing to do
 	 * in passive node.
@@ -1592,6 +1683,8 @@ dht_initialize(bool post_init)
 	 * Allocate root node for the routing table.
 	 */
 
+	contacts = ktable_make();
+
 	WALLOC0(root);
 	root->ours = TRUE;
 	allocate_node_lists(root);
@@ -1863,7 +1956,7 @@ split_among(void *value, void *user_data)
 	g_assert(hash_list_length(hl) < list_maxsize_for(kn->status));
 
 	hash_list_append(hl, knode_refcnt_inc(kn));
-	hikset_insert_key(target->nodes->all, &kn->id);
+	bucket_insert_node(target, kn);
 	c_class_update_count(kn, target, +1);
 
 	/*
@@ -2042,7 +2135,7 @@ add_node_internal(struct kbucket *kb,
 	g_assert(kn->status == status);
 
 	hash_list_append(hl, knode_refcnt_inc(kn));
-	hikset_insert_key(kb->nodes->all, &kn->id);
+	bucket_insert_node(kb, kn);
 	c_class_update_count(kn, kb, +1);
 
 	if (GNET_PROPERTY(dht_debug) > 2)
@@ -2364,7 +2457,7 @@ dht_remove_node_from_bucket(knode_t *kn, struct kbucket *kb)
 	hl = list_for(kb, tkn->status);
 
 	if (hash_list_remove(hl, tkn)) {
-		hikset_remove(kb->nodes->all, tkn->id);
+		bucket_remove_node(kb, tkn);
 		c_class_update_count(tkn, kb, -1);
 
 		if (GNET_PROPERTY(dht_debug) > 2)
@@ -2548,7 +2641,7 @@ dht_set_node_status(knode_t *kn, knode_status_t new)
 					host_addr_port_to_string(removed->addr, removed->port),
 					kbucket_to_string(kb));
 		} else {
-			hikset_remove(kb->nodes->all, removed->id);
+			bucket_remove_node(kb, removed);
 			c_class_update_count(removed, kb, -1);
 
 			if (GNET_PROPERTY(dht_debug))
@@ -4364,73 +4457,75 @@ dht_size(void)
 }
 
 /**
- * GList sort callback.
- */
-static int
-distance_to(const void *a, const void *b, void *user_data)
-{
-	const knode_t *ka = a;
-	const knode_t *kb = b;
-	const kuid_t *id = user_data;
-
-	return kuid_cmp3(id, ka->id, kb->id);
-}
+ * Context for dht_fill_closest().
+ *
+ * Nodes are seen by increasing distance to the target, hence bucket by bucket
+ * since each bucket covers a range of KUIDs sharing the same prefix.  The
+ * eligible nodes of the current bucket are buffered so that we can decide
+ * whether pending nodes must be used, which depends on the amount of good
+ * (and stale) nodes in the bucket.
+ */
+struct fill_closest {
+	knode_t **kvec;				/**< Base of the vector to fill */
+	int kcnt;					/**< Size of the vector */
+	int added;					/**< Amount of entries filled */
+	const kuid_t *exclude;		/**< KUID to exclude, NULL if none */
+	const void *kb;				/**< Bucket of the buffered nodes */
+	time_t now;					/**< Current time */
+	int count;					/**< Amount of buffered nodes */
+	int available;				/**< Amount of non-pending buffered nodes */
+	bool alive;					/**< Whether we want only alive nodes */
+	knode_t *nodes[K_BUCKET_GOOD + K_BUCKET_STALE + K_BUCKET_PENDING];
+};
 
 /**
- * Fill the supplied vector `kvec' whose size is `kcnt' with the good
- * nodes from the current bucket, inserting them by increasing distance
- * to the supplied ID.
- *
- * @param id		the KUID for which we're finding the closest neighbours
- * @param kb		the bucket used
- * @param kvec		base of the "knode_t *" vector
- * @param kcnt		size of the "knode_t *" vector
- * @param exclude	the KUID to exclude (NULL if no exclusion)
- * @param alive		whether we want only know-to-be-alive nodes
+ * Flush nodes buffered for the current bucket into the vector, by increasing
+ * distance to the target.
  *
- * @return the amount of entries filled in the vector.
+ * Pending nodes are only considered if we do not have enough good nodes
+ * (or stale nodes that are still somewhat likely to be alive) in the bucket
+ * to fill the vector.
  */
-static int
-fill_closest_in_bucket(
-	const kuid_t *id, struct kbucket *kb,
-	knode_t **kvec, int kcnt, const kuid_t *exclude, bool alive)
+static void
+fill_closest_flush(struct fill_closest *fc)
 {
-	GList *nodes = NULL;
-	GList *good;
-	GList *l;
-	int added;
-	int available = 0;
+	bool with_pending = fc->available < fc->kcnt - fc->added;
+	int i;
 
-	g_assert(id);
-	g_assert(is_leaf(kb));
-	g_assert(kvec);
+	for (i = 0; i < fc->count && fc->added < fc->kcnt; i++) {
+		knode_t *kn = fc->nodes[i];
 
-	/*
-	 * If we can determine that we do not have enough good nodes in the bucket
-	 * to fill the vector, consider "stale" nodes and then "pending" nodes
-	 * (excluding shutdowning ones), provided we got traffic from them
-	 * recently (defined by the aliveness period).
-	 */
+		if (KNODE_PENDING == kn->status && !with_pending)
+			continue;
 
-	good = hash_list_list(kb->nodes->good);
+		fc->kvec[fc->added++] = kn;
+	}
 
-	while (good) {
-		knode_t *kn = good->data;
+	fc->count = fc->available = 0;
+}
 
-		knode_check(kn);
-		g_assert(KNODE_GOOD == kn->status);
+/**
+ * Contact table iterator for dht_fill_closest().
+ *
+ * @return TRUE to get the next closest node, FALSE when the vector is filled.
+ */
+static bool
+fill_closest_node(knode_t *kn, const void *kb, void *data)
+{
+	struct fill_closest *fc = data;
 
-		if (
-			(!exclude || !kuid_eq(kn->id, exclude)) &&
-			(!alive || (kn->flags & KNODE_F_ALIVE))
-		) {
-			nodes = g_list_prepend(nodes, kn);
-			available++;
-		}
+	knode_check(kn);
 
-		good = g_list_remove(good, kn);
+	if (kb != fc->kb) {
+		fill_closest_flush(fc);
+		if (fc->added >= fc->kcnt)
+			return FALSE;
+		fc->kb = kb;
 	}
 
+	if (fc->exclude != NULL && kuid_eq(kn->id, fc->exclude))
+		return TRUE;
+
 	/*
 	 * Only stale nodes that are still somewhat likely to be alive are
 	 * included in the set, provided we're not limited to only
@@ -4440,128 +4535,45 @@ fill_closest_in_bucket(
 	 * stale nodes (alive will be TRUE).  But for our own lookups, it's good
 	 * to include stale nodes because we may discover they're still alive
 	 * without having to ping them explicitly.
+	 *
+	 * Pending nodes that are shutdowning are never included, and when
+	 * we want alive nodes, we must have got traffic from them recently
+	 * (defined by the aliveness period).
 	 */
 
-	if (!alive) {
-		GList *stale = hash_list_list(kb->nodes->stale);
-
-		while (stale) {
-			knode_t *kn = stale->data;
-
-			knode_check(kn);
-			g_assert(KNODE_STALE == kn->status);
-
-			if (
-				(!exclude || !kuid_eq(kn->id, exclude)) &&
-				knode_still_alive_probability(kn) >= ALIVE_PROBA_LOW_THRESH
-			) {
-				nodes = g_list_prepend(nodes, kn);
-				available++;
-			}
-
-			stale = g_list_remove(stale, kn);
-		}
-	}
-
-	/*
-	 * Pending nodes come last, if we miss nodes.
-	 */
-
-	if (available < kcnt) {
-		GList *pending = hash_list_list(kb->nodes->pending);
-		time_t now = tm_time();
-
-		while (pending) {
-			knode_t *kn = pending->data;
-
-			knode_check(kn);
-			g_assert(KNODE_PENDING == kn->status);
-
-			if (
-				!(kn->flags & KNODE_F_SHUTDOWNING) &&
-				(!exclude || !kuid_eq(kn->id, exclude)) &&
-				(!alive ||
-					(
-						(kn->flags & KNODE_F_ALIVE) &&
-						delta_time(now, kn->last_seen) < alive_period()
-					)
-				)
-			) {
-				nodes = g_list_prepend(nodes, kn);
-				available++;
-			}
-
-			pending = g_list_remove(pending, kn);
-		}
-	}
-
-	/*
-	 * Sort the candidates by increasing distance to the target KUID and
-	 * insert them in the vector.
-	 */
-
-	nodes = g_list_sort_with_data(nodes, distance_to, deconstify_pointer(id));
-
-	for (added = 0, l = nodes; l && kcnt; l = g_list_next(l)) {
-		*kvec++ = l->data;
-		kcnt--;
-		added++;
-	}
-
-	g_list_free(nodes);
-
-	return added;
-}
-
-/**
- * Recursively fill the supplied vector `kvec' whose size is `kcnt' with the
- * good nodes held in the leaves under the current bucket,
- * inserting them by increasing distance to the supplied ID.
- *
- * @param id		the KUID for which we're finding the closest neighbours
- * @param kb		the bucket from which we recurse
- * @param kvec		base of the "knode_t *" vector
- * @param kcnt		size of the "knode_t *" vector
- * @param exclude	the KUID to exclude (NULL if no exclusion)
- * @param alive		whether we want only know-to-be-alive nodes
- *
- * @return the amount of entries filled in the vector.
- */
-static int
-recursively_fill_closest_from(
-	const kuid_t *id,
-	struct kbucket *kb,
-	knode_t **kvec, int kcnt, const kuid_t *exclude, bool alive)
-{
-	int byt;
-	uchar mask;
-	struct kbucket *closest;
-	int added;
-
-	g_assert(id);
-	g_assert(kb);
-
-	if (is_leaf(kb))
-		return fill_closest_in_bucket(id, kb, kvec, kcnt, exclude, alive);
-
-	kuid_position(kb->depth, &byt, &mask);
-
-	if ((kb->one->prefix.v[byt] & mask) == (id->v[byt] & mask)) {
-		g_assert((kb->zero->prefix.v[byt] & mask) != (id->v[byt] & mask));
-		closest = kb->one;
-	} else {
-		g_assert((kb->zero->prefix.v[byt] & mask) == (id->v[byt] & mask));
-		closest = kb->zero;
+	switch (kn->status) {
+	case KNODE_GOOD:
+		if (fc->alive && !(kn->flags & KNODE_F_ALIVE))
+			return TRUE;
+		fc->available++;
+		break;
+	case KNODE_STALE:
+		if (
+			fc->alive ||
+			knode_still_alive_probability(kn) < ALIVE_PROBA_LOW_THRESH
+		)
+			return TRUE;
+		fc->available++;
+		break;
+	case KNODE_PENDING:
+		if (kn->flags & KNODE_F_SHUTDOWNING)
+			return TRUE;
+		if (
+			fc->alive && (
+				!(kn->flags & KNODE_F_ALIVE) ||
+				delta_time(fc->now, kn->last_seen) >= alive_period()
+			)
+		)
+			return TRUE;
+		break;
+	case KNODE_UNKNOWN:
+		g_assert_not_reached();
 	}
 
-	added = recursively_fill_closest_from(
-		id, closest, kvec, kcnt, exclude, alive);
-
-	if (added < kcnt)
-		added += recursively_fill_closest_from(id, sibling_of(closest),
-			kvec + added, kcnt - added, exclude, alive);
+	g_assert(fc->count < (int) G_N_ELEMENTS(fc->nodes));
 
-	return added;
+	fc->nodes[fc->count++] = kn;
+	return TRUE;
 }
 
 /**
@@ -4581,51 +4593,39 @@ dht_fill_closest(
 	const kuid_t *id,
 	knode_t **kvec, int kcnt, const kuid_t *exclude, bool alive)
 {
-	struct kbucket *kb;
+	struct fill_closest fc;
 	int added;
-	int wanted = kcnt;			/* Remember for tracing only */
-	knode_t **base = kvec;		/* Idem */
+	knode_t **base = kvec;		/* For tracing only */
 
 	g_assert(id);
 	g_assert(kcnt > 0);
 	g_assert(kvec);
 
 	/*
-	 * Start by filling from hosts in the k-bucket of the ID.
-	 */
-
-	kb = dht_find_bucket(id);
-	added = fill_closest_in_bucket(id, kb, kvec, kcnt, exclude, alive);
-	kvec += added;
-	kcnt -= added;
-
-	g_assert(kcnt >= 0);
-
-	/*
-	 * Now iteratively move up to the root bucket, trying to fill more
-	 * closest nodes from these buckets which are farther and farther away
+	 * Nodes are taken from the flat contact table, by increasing distance
+	 * to the target, which is the order in which we would visit them by
+	 * starting with the k-bucket of the ID and then moving up the tree,
+	 * filling from the sibling buckets which are farther and farther away
 	 * from the target ID.
 	 */
 
-	for (/* empty */; kb->depth && kcnt; kb = kb->parent) {
-		struct kbucket *sibling = sibling_of(kb);
-		int more;
+	ZERO(&fc);
+	fc.kvec = kvec;
+	fc.kcnt = kcnt;
+	fc.exclude = exclude;
+	fc.alive = alive;
+	fc.now = tm_time();
 
-		g_assert(sibling->parent == kb->parent);
-		g_assert(sibling != kb);
+	ktable_closest(contacts, id, fill_closest_node, &fc);
+	fill_closest_flush(&fc);
 
-		more = recursively_fill_closest_from(
-			id, sibling, kvec, kcnt, exclude, alive);
-		kvec += more;
-		kcnt -= more;
-		added += more;
+	added = fc.added;
 
-		g_assert(kcnt >= 0);
-	}
+	g_assert(added <= kcnt);
 
 	if (GNET_PROPERTY(dht_debug) > 15) {
 		g_debug("DHT found %d/%d %s nodes (excluding %s) closest to %s",
-			added, wanted, alive ? "alive" : "known",
+			added, kcnt, alive ? "alive" : "known",
 			exclude ? kuid_to_hex_string(exclude) : "nothing",
 			kuid_to_hex_string2(id));
 
@@ -4722,109 +4722,215 @@ dht_lookup_notify(const kuid_t *id, lookup_type_t type)
 }
 
 /**
- * Write node information to file.
+ * Serialize node into a snapshot record.
+ *
+ * @param kn		the node to serialize
+ * @param buf		the record buffer, ROUTE_SNAP_RECORD bytes long
  */
 static void
-write_node(const knode_t *kn, FILE *f)
+route_snapshot_poke(const knode_t *kn, char *buf)
 {
+	char *p = buf;
+
 	knode_check(kn);
 
-	fprintf(f, "KUID %s\nVNDR %s\nVERS %u.%u\nHOST %s\n"
-		"CTIM %s\nSEEN %s\nEND\n\n",
-		kuid_to_hex_string(kn->id),
-		vendor_code_to_string(kn->vcode.u32),
-		kn->major, kn->minor,
-		host_addr_port_to_string(kn->addr, kn->port),
-		timestamp_utc_to_string(kn->first_seen),
-		timestamp_utc_to_string2(kn->last_seen));
+	memset(buf, 0, ROUTE_SNAP_RECORD);
+
+	p = mempcpy(p, kn->id->v, KUID_RAW_SIZE);
+	p = poke_be32(p, kn->vcode.u32);
+	*p++ = host_addr_net(kn->addr);
+	host_ip_port_poke(p, kn->addr, kn->port, NULL);
+	p += 18;								/* Room for IPv6 and port */
+	*p++ = kn->status;
+	*p++ = kn->major;
+	*p++ = kn->minor;
+	*p++ = kn->rpc_timeouts;
+	p = poke_be32(p, kn->first_seen);
+	p = poke_be32(p, kn->last_seen);
+	p = poke_be32(p, kn->rtt);
+	p = poke_be32(p, kn->rttvar);
+
+	g_assert(ptr_diff(p, buf) < ROUTE_SNAP_RECORD);
+}
+
+/**
+ * Context for dht_snapshot_leaf_bucket().
+ */
+struct route_snapshot {
+	FILE *f;						/**< File where snapshot is written */
+	uint32 crc;						/**< Running CRC-32 of the snapshot */
+	uint32 count;					/**< Amount of nodes written */
+	bool error;						/**< Whether we got a write error */
+};
+
+/**
+ * Write node record to the snapshot.
+ */
+static void
+route_snapshot_write(struct route_snapshot *rs, const knode_t *kn)
+{
+	char buf[ROUTE_SNAP_RECORD];
+
+	if (rs->error)
+		return;
+
+	route_snapshot_poke(kn, buf);
+
+	if (1 != fwrite(buf, sizeof buf, 1, rs->f)) {
+		rs->error = TRUE;
+		return;
+	}
+
+	rs->crc = crc32_update(rs->crc, buf, sizeof buf);
+	rs->count++;
 }
 
 /**
- * Store all good nodes from a leaf bucket.
+ * Store all good and stale nodes from a leaf bucket.
+ *
+ * Pending nodes are not persisted: we never got a chance to know whether
+ * they would be useful.
  */
 static void
-dht_store_leaf_bucket(struct kbucket *kb, void *u)
+dht_snapshot_leaf_bucket(struct kbucket *kb, void *u)
 {
-	FILE *f = u;
+	struct route_snapshot *rs = u;
 	hash_list_iter_t *iter;
 
 	if (!is_leaf(kb))
 		return;
 
-	/*
-	 * All good nodes are persisted.
-	 */
-
 	iter = hash_list_iterator(kb->nodes->good);
 	while (hash_list_iter_has_next(iter)) {
-		const knode_t *kn;
-
-		kn = hash_list_iter_next(iter);
-		write_node(kn, f);
+		route_snapshot_write(rs, hash_list_iter_next(iter));
 	}
 	hash_list_iter_release(&iter);
 
-	/*
-	 * Stale nodes for which the RPC timeout condition was cleared
-	 * are also elected.
-	 */
-
 	iter = hash_list_iterator(kb->nodes->stale);
 	while (hash_list_iter_has_next(iter)) {
-		const knode_t *kn;
-
-		kn = hash_list_iter_next(iter);
-		if (!kn->rpc_timeouts)
-			write_node(kn, f);
+		route_snapshot_write(rs, hash_list_iter_next(iter));
 	}
 	hash_list_iter_release(&iter);
 }
 
 /**
- * Save all the good nodes from the routing table.
+ * Remove the legacy textual routing table, superseded by the snapshot.
+ *
+ * Reading it renamed it as ".orig", so both names are removed.
+ */
+static void
+dht_route_unlink_legacy(void)
+{
+	static bool done;
+	char *path, *path_orig;
+
+	if (done)
+		return;
+
+	done = TRUE;
+
+	path = make_pathname(settings_config_dir(), node_file);
+	path_orig = h_strdup_printf("%s.orig", path);
+	(void) unlink(path);
+	(void) unlink(path_orig);
+	HFREE_NULL(path);
+	HFREE_NULL(path_orig);
+}
+
+/**
+ * Save a snapshot of the routing table.
+ *
+ * The snapshot is a compact binary image of the good and stale nodes of
+ * all the k-buckets: a header, fixed-size node records and a trailing
+ * CRC-32.  Because the node count in the header is only known once all the
+ * records were written, the CRC covers the records first and then the final
+ * header.  All values are big-endian.
  */
 static void
 dht_route_store(void)
 {
-	FILE *f;
+	struct route_snapshot rs;
+	char header[ROUTE_SNAP_HEADER];
+	char *p = header;
 	file_path_t fp;
 
 	file_path_set(&fp, settings_config_dir(), dht_route_file);
-	f = file_config_open_write(dht_route_what, &fp);
+	rs.f = file_config_open_write(dht_route_what, &fp);
 
-	if (!f)
+	if (NULL == rs.f)
 		return;
 
-	file_config_preamble(f, "DHT nodes");
-
-	fputs(
-		"#\n"
-		"# Format is:\n"
-		"#  KUID <hex node ID>\n"
-		"#  VNDR <vendor code>\n"
-		"#  VERS <major.minor>\n"
-		"#  HOST <IP and port>\n"
-		"#  CTIM <first time node was seen>\n"
-		"#  SEEN <last seen message>\n"
-		"#  END\n"
-		"#  \n\n",
-		f
-	);
-
-	if (root)
-		recursively_apply(root, dht_store_leaf_bucket, f);
-
-	file_config_close(f, &fp);
+	rs.crc = 0;
+	rs.count = 0;
+	rs.error = FALSE;
+
+	/*
+	 * The amount of nodes is only known at the end, hence we rewrite
+	 * the header once all the nodes have been written.
+	 */
+
+	ZERO(&header);
+	p = mempcpy(p, ROUTE_SNAP_MAGIC, 4);
+	*p++ = ROUTE_SNAP_VERSION;
+	p += 3;									/* Reserved */
+	p = poke_be32(p, tm_time());
+	p = mempcpy(p, our_kuid->v, KUID_RAW_SIZE);
+
+	if (1 != fwrite(header, sizeof header, 1, rs.f))
+		rs.error = TRUE;
+
+	if (root != NULL)
+		recursively_apply(root, dht_snapshot_leaf_bucket, &rs);
+
+	poke_be32(p, rs.count);
+	rs.crc = crc32_update(rs.crc, header, sizeof header);
+
+	if (!rs.error) {
+		char trailer[4];
+
+		poke_be32(trailer, rs.crc);
+
+		if (
+			0 != fseek(rs.f, 0, SEEK_SET) ||
+			1 != fwrite(header, sizeof header, 1, rs.f) ||
+			0 != fseek(rs.f, 0, SEEK_END) ||
+			1 != fwrite(trailer, sizeof trailer, 1, rs.f)
+		)
+			rs.error = TRUE;
+	}
+
+	if (rs.error) {
+		g_warning("%s(): error writing %s: %m", G_STRFUNC, dht_route_what);
+		fclose(rs.f);
+		return;		/* Partial ".new" file is not renamed */
+	}
+
+	file_config_close(rs.f, &fp);
 	stats.dirty = FALSE;
+	stats.saved = tm_time();
+
+	dht_route_unlink_legacy();
+
+	if (GNET_PROPERTY(dht_debug)) {
+		g_debug("DHT saved %u node%s in routing table snapshot",
+			rs.count, 1 == rs.count ? "" : "s");
+	}
 }
 
 /**
- * Save good nodes if table is dirty.
+ * Save routing table if the good nodes changed or if the last snapshot
+ * is too old, so that the last-seen times of nodes remain accurate.
  */
 void
 dht_route_store_if_dirty(void)
 {
-	if (stats.dirty)
+	if (NULL == root)
+		return;
+
+	if (
+		stats.dirty ||
+		delta_time(tm_time(), stats.saved) >= ROUTE_SNAPSHOT_PERIOD
+	)
 		dht_route_store();
 }
 
@@ -4857,6 +4963,7 @@ dht_close(bool exiting)
 		return;
 
 	dht_route_store();
+	route_verify_clear();
 
 	/*
 	 * Since we're shutting down the route table, we also need to shut down
@@ -4880,6 +4987,7 @@ dht_close(bool exiting)
 
 	recursively_apply(root, dht_free_bucket, NULL);
 	root = NULL;
+	ktable_free_null(&contacts);
 	kuid_atom_free_null(&our_kuid);
 
 	for (i = 0; i < K_REGIONS; i++) {
@@ -5257,6 +5365,65 @@ dht_ipp_extract(const struct gnutella_node *n, const char *payload, int paylen,
  *** Parsing of persisted DHT routing table.
  ***/
 
+/**
+ * A node loaded from the persisted routing table, with its former status.
+ */
+struct route_entry {
+	knode_t *kn;					/**< The loaded node */
+	knode_status_t status;			/**< Good or stale */
+};
+
+/**
+ * Record loaded node, taking ownership of the node.
+ *
+ * @param nodes		the loaded nodes, by KUID
+ * @param kn		the loaded node
+ * @param status	the status the node had when it was persisted
+ */
+static void
+route_entry_add(patricia_t *nodes, knode_t *kn, knode_status_t status)
+{
+	struct route_entry *re;
+
+	/*
+	 * Since they shutdown, the bogons or hostile database could
+	 * have changed.  Revalidate addresses.
+	 */
+
+	if (!knode_is_usable(kn)) {
+		g_warning("DHT ignoring persisted unusable %s", knode_to_string(kn));
+		knode_free(kn);
+		return;
+	}
+
+	if (patricia_contains(nodes, kn->id)) {
+		g_warning("DHT ignoring persisted dup %s", knode_to_string(kn));
+		knode_free(kn);
+		return;
+	}
+
+	WALLOC(re);
+	re->kn = kn;
+	re->status = status;
+	patricia_insert(nodes, kn->id, re);
+}
+
+/**
+ * PATRICIA iterator to free loaded nodes.
+ */
+static void
+route_entry_free(void *u_key, size_t u_kbits, void *value, void *u_d)
+{
+	struct route_entry *re = value;
+
+	(void) u_key;
+	(void) u_kbits;
+	(void) u_d;
+
+	knode_free(re->kn);
+	WFREE(re);
+}
+
 typedef enum {
 	DHT_ROUTE_TAG_UNKNOWN = 0,
 
@@ -5316,19 +5483,20 @@ dht_route_string_to_tag(const char *s)
 }
 
 /**
- * Load persisted routing table from file.
+ * Load persisted routing table from file, in the former textual format.
+ *
+ * @param f				the file to parse
+ * @param nodes			where loaded nodes are recorded, by KUID
+ * @param most_recent	updated with the time elapsed since most recent node
  */
 static void
-dht_route_parse(FILE *f)
+dht_route_parse(FILE *f, patricia_t *nodes, time_delta_t *most_recent)
 {
 	bit_array_t tag_used[BIT_ARRAY_SIZE(NUM_DHT_ROUTE_TAGS + 1)];
 	char line[1024];
 	unsigned line_no = 0;
 	bool done = FALSE;
-	time_delta_t most_recent = REFRESH_PERIOD;
 	time_t now = tm_time();
-	patricia_t *nodes;
-	patricia_iter_t *iter;
 	/* Variables filled for each entry */
 	host_addr_t addr;
 	uint16 port;
@@ -5341,7 +5509,6 @@ dht_route_parse(FILE *f)
 	g_return_if_fail(f);
 
 	bit_array_init(tag_used, NUM_DHT_ROUTE_TAGS);
-	nodes = patricia_create(KUID_RAW_BITSIZE);
 
 	while (fgets(line, sizeof line, f)) {
 		const char *tag_name, *value;
@@ -5458,31 +5625,14 @@ dht_route_parse(FILE *f)
 			 */
 
 			delta = delta_time(now, seen);
-			if (delta >= 0 && delta < most_recent)
-				most_recent = delta;
+			if (delta >= 0 && delta < *most_recent)
+				*most_recent = delta;
 
 			kn = knode_new(&kuid, 0, addr, port, vcode, major, minor);
 			kn->last_seen = seen;
 			kn->first_seen = ctim;
 
-			/*
-			 * Add node to routing table.  If the KUID has changed since
-			 * the last time the routing table was saved (e.g. they are
-			 * importing a persisted file from another instance), then bucket
-			 * splits will not occur in the same way and some nodes will be
-			 * discarded.  It does not matter much, we should have enough
-			 * good hosts to attempt a bootstrap.
-			 *
-			 * Since they shutdown, the bogons or hostile database could
-			 * have changed.  Revalidate addresses.
-			 */
-
-			if (!knode_is_usable(kn)) {
-				g_warning("DHT ignoring persisted unusable %s",
-					knode_to_string(kn));
-			} else {
-				patricia_insert(nodes, kn->id, kn);
-			}
+			route_entry_add(nodes, kn, KNODE_GOOD);
 
 			/* Reset state */
 			done = FALSE;
@@ -5494,18 +5644,427 @@ dht_route_parse(FILE *f)
 		g_warning("damaged DHT route entry at line %u, aborting", line_no);
 		break;
 	}
+}
+
+/**
+ * Deserialize snapshot record.
+ *
+ * @param buf			the record, ROUTE_SNAP_RECORD bytes long
+ * @param nodes			where loaded node is recorded, by KUID
+ * @param now			current time
+ * @param most_recent	updated with the time elapsed since node was seen
+ */
+static void
+route_snapshot_peek(const char *buf, patricia_t *nodes, time_t now,
+	time_delta_t *most_recent)
+{
+	const char *p = buf;
+	kuid_t kuid;
+	vendor_code_t vcode;
+	host_addr_t addr;
+	uint16 port;
+	uint8 net, status, major, minor, timeouts;
+	time_delta_t delta;
+	knode_t *kn;
+
+	memcpy(kuid.v, p, KUID_RAW_SIZE);
+	p += KUID_RAW_SIZE;
+	vcode.u32 = peek_be32(p);
+	p += 4;
+	net = *p++;
+
+	if (NET_TYPE_IPV4 != net && NET_TYPE_IPV6 != net) {
+		g_warning("DHT ignoring persisted node %s with bad network type %u",
+			kuid_to_hex_string(&kuid), net);
+		return;
+	}
+
+	host_ip_port_peek(p, net, &addr, &port);
+	p += 18;
+	status = *p++;
+	major = *p++;
+	minor = *p++;
+	timeouts = *p++;
+
+	kn = knode_new(&kuid, 0, addr, port, vcode, major, minor);
+	kn->rpc_timeouts = timeouts;
+	kn->first_seen = peek_be32(p);
+	p += 4;
+	kn->last_seen = peek_be32(p);
+	p += 4;
+	kn->rtt = peek_be32(p);
+	p += 4;
+	kn->rttvar = peek_be32(p);
+
+	delta = delta_time(now, kn->last_seen);
+	if (delta >= 0 && delta < *most_recent)
+		*most_recent = delta;
+
+	route_entry_add(nodes, kn, KNODE_STALE == status ? KNODE_STALE : KNODE_GOOD);
+}
+
+/**
+ * Load routing table snapshot.
+ *
+ * @param nodes			where loaded nodes are recorded, by KUID
+ * @param most_recent	updated with the time elapsed since most recent node
+ * @param same_kuid		set to whether snapshot was taken with our KUID
+ *
+ * @return TRUE if snapshot was loaded, FALSE if missing or damaged.
+ */
+static bool
+dht_route_load(patricia_t *nodes, time_delta_t *most_recent, bool *same_kuid)
+{
+	file_path_t fp[1];
+	char header[ROUTE_SNAP_HEADER];
+	char *buf = NULL;
+	size_t len = 0;
+	uint32 count, crc, i;
+	time_t now = tm_time();
+	bool ok = FALSE;
+	FILE *f;
+
+	file_path_set(fp, settings_config_dir(), dht_route_file);
+	f = file_config_open_read(dht_route_what, fp, G_N_ELEMENTS(fp));
+
+	if (NULL == f)
+		return FALSE;
+
+	if (1 != fread(header, sizeof header, 1, f))
+		goto damaged;
+
+	if (
+		0 != memcmp(header, ROUTE_SNAP_MAGIC, 4) ||
+		ROUTE_SNAP_VERSION != (uchar) header[4]
+	)
+		goto damaged;
+
+	count = peek_be32(&header[12 + KUID_RAW_SIZE]);
+	if (count > ROUTE_SNAP_MAX)
+		goto damaged;
+
+	/*
+	 * The records are followed by the CRC-32, which covers the records
+	 * and then the header.
+	 */
+
+	len = count * ROUTE_SNAP_RECORD + 4;
+	buf = halloc(len);
+
+	if (1 != fread(buf, len, 1, f))
+		goto damaged;
+
+	crc = crc32_update(0, buf, len - 4);
+	crc = crc32_update(crc, header, sizeof header);
+
+	if (crc != peek_be32(&buf[len - 4]))
+		goto damaged;
+
+	*same_kuid = 0 == memcmp(&header[12], our_kuid->v, KUID_RAW_SIZE);
+
+	for (i = 0; i < count; i++) {
+		route_snapshot_peek(&buf[i * ROUTE_SNAP_RECORD],
+			nodes, now, most_recent);
+	}
+
+	if (GNET_PROPERTY(dht_debug)) {
+		time_delta_t age = delta_time(now, peek_be32(&header[8]));
+
+		g_debug("DHT loaded %u node%s from routing table snapshot "
+			"taken %s ago%s", count, 1 == count ? "" : "s",
+			compact_time(MAX(age, 0)), *same_kuid ? "" : " with another KUID");
+	}
+
+	ok = TRUE;
+	goto done;
+
+damaged:
+	g_warning("damaged %s snapshot, ignoring it", dht_route_what);
+
+done:
+	HFREE_NULL(buf);
+	fclose(f);
+	return ok;
+}
+
+/**
+ * Staged verification of the nodes restored from the persisted routing table.
+ *
+ * The first stage pings the KDA_K closest nodes to our KUID, the ones which
+ * matter most for the lookups of active nodes.  When the snapshot is recent
+ * enough, the outcome of that stage decides whether we need to bootstrap
+ * again.  Further stages ping the remaining nodes by increasing distance,
+ * a few at a time, so that dead nodes are quickly flagged through the
+ * regular RPC timeout handling.
+ */
+static struct route_verify {
+	GSList *nodes;				/**< Restored nodes to verify, closest first */
+	cevent_t *ev;				/**< Next verification stage */
+	uint gen;					/**< Generation, to spot obsolete replies */
+	uint pinged;				/**< Nodes checked during first stage */
+	uint answered;				/**< Nodes that answered or timed out */
+	uint replied;				/**< Nodes known to be alive */
+	bool started;				/**< Whether verification was started */
+	bool first_done;			/**< Whether first stage was concluded */
+	bool boot;					/**< Whether first stage decides on bootstrap */
+} route_verify;
+
+/**
+ * Discard pending verification of restored nodes.
+ */
+static void
+route_verify_clear(void)
+{
+	GSList *sl;
+
+	GM_SLIST_FOREACH(route_verify.nodes, sl) {
+		knode_free(sl->data);
+	}
+	gm_slist_free_null(&route_verify.nodes);
+	cq_cancel(&route_verify.ev);
+
+	route_verify.pinged = route_verify.answered = route_verify.replied = 0;
+	route_verify.started = route_verify.boot = FALSE;
+	route_verify.first_done = FALSE;
+	route_verify.gen++;			/* Ignore replies to previous pings */
+}
+
+/**
+ * Get next restored node to verify, if still in the routing table.
+ *
+ * @return node to verify, which must be freed with knode_free(), or NULL
+ * when all nodes were verified.
+ */
+static knode_t *
+route_verify_next(void)
+{
+	while (route_verify.nodes != NULL) {
+		knode_t *kn = route_verify.nodes->data;
+
+		route_verify.nodes =
+			g_slist_delete_link(route_verify.nodes, route_verify.nodes);
+
+		if (KNODE_UNKNOWN != kn->status)
+			return kn;
+
+		knode_free(kn);			/* Was removed from the routing table */
+	}
+
+	return NULL;
+}
+
+/**
+ * Callout queue callback for the later verification stages.
+ */
+static void
+route_verify_stage(cqueue_t *unused_cq, void *unused_obj)
+{
+	uint i;
+
+	(void) unused_cq;
+	(void) unused_obj;
+
+	route_verify.ev = NULL;
+
+	if (!GNET_PROPERTY(is_inet_connected))
+		goto next;
+
+	for (i = 0; i < ROUTE_VERIFY_BATCH; i++) {
+		knode_t *kn = route_verify_next();
+
+		if (NULL == kn) {
+			if (GNET_PROPERTY(dht_debug))
+				g_debug("DHT verified all restored nodes");
+			return;
+		}
+
+		if (!(kn->flags & KNODE_F_ALIVE))
+			dht_lazy_rpc_ping(kn);
+
+		knode_free(kn);
+	}
+
+next:
+	route_verify.ev =
+		cq_main_insert(ROUTE_VERIFY_PERIOD, route_verify_stage, NULL);
+}
+
+/**
+ * Conclude the first verification stage.
+ */
+static void
+route_verify_first_done(void)
+{
+	if (route_verify.first_done)
+		return;
+
+	route_verify.first_done = TRUE;
+	cq_cancel(&route_verify.ev);
+
+	if (GNET_PROPERTY(dht_debug)) {
+		g_debug("DHT %u/%u closest restored node%s alive",
+			route_verify.replied, route_verify.pinged,
+			1 == route_verify.pinged ? "" : "s");
+	}
+
+	if (route_verify.boot) {
+		route_verify.boot = FALSE;
+
+		if (
+			route_verify.replied >= KDA_K / 2 &&
+			DHT_BOOT_SEEDED == GNET_PROPERTY(dht_boot_status)
+		) {
+			if (GNET_PROPERTY(dht_debug))
+				g_debug("DHT restored routing table is usable, no bootstrap");
+
+			gnet_prop_set_guint32_val(PROP_DHT_BOOT_STATUS,
+				DHT_BOOT_COMPLETED);
+			keys_update_kball();
+		}
+
+		dht_attempt_bootstrap();
+	}
+
+	route_verify.ev =
+		cq_main_insert(ROUTE_VERIFY_PERIOD, route_verify_stage, NULL);
+}
+
+/**
+ * Callout queue callback invoked when first verification stage timed out.
+ */
+static void
+route_verify_timeout(cqueue_t *unused_cq, void *unused_obj)
+{
+	(void) unused_cq;
+	(void) unused_obj;
+
+	route_verify.ev = NULL;
+	route_verify_first_done();
+}
+
+/**
+ * RPC callback for the pings of the first verification stage.
+ */
+static void
+route_verify_cb(
+	enum dht_rpc_ret type,
+	const knode_t *unused_kn,
+	const struct gnutella_node *unused_n,
+	kda_msg_t unused_function,
+	const char *unused_payload, size_t unused_len, void *arg)
+{
+	(void) unused_kn;
+	(void) unused_n;
+	(void) unused_function;
+	(void) unused_payload;
+	(void) unused_len;
+
+	if (GPOINTER_TO_UINT(arg) != route_verify.gen)
+		return;
+
+	route_verify.answered++;
+	if (DHT_RPC_REPLY == type)
+		route_verify.replied++;
+
+	/*
+	 * The timeout event is only set once all the pings were sent.
+	 * Replies coming after the first stage was concluded, i.e. after
+	 * the timeout, must not conclude it again.
+	 */
+
+	if (
+		route_verify.answered == route_verify.pinged &&
+		route_verify.ev != NULL && !route_verify.first_done
+	)
+		route_verify_first_done();
+}
+
+/**
+ * Start verification of the restored nodes, if not already done.
+ *
+ * @return TRUE if bootstrapping must wait for the first stage to complete,
+ * in which case dht_attempt_bootstrap() will be called again.
+ */
+static bool
+route_verify_start(void)
+{
+	bool boot = route_verify.boot;
+	uint i;
+
+	if (route_verify.started || NULL == route_verify.nodes)
+		return route_verify.boot;
+
+	route_verify.started = TRUE;
+
+	if (!GNET_PROPERTY(is_inet_connected)) {
+		route_verify.boot = FALSE;
+		route_verify.ev =
+			cq_main_insert(ROUTE_VERIFY_PERIOD, route_verify_stage, NULL);
+		return FALSE;
+	}
+
+	for (i = 0; i < KDA_K; i++) {
+		knode_t *kn = route_verify_next();
+
+		if (NULL == kn)
+			break;
+
+		route_verify.pinged++;
+
+		if (kn->flags & KNODE_F_ALIVE) {
+			route_verify.answered++;
+			route_verify.replied++;
+		} else {
+			dht_rpc_ping(kn, route_verify_cb,
+				GUINT_TO_POINTER(route_verify.gen));
+		}
+
+		knode_free(kn);
+	}
+
+	if (route_verify.answered == route_verify.pinged) {
+		route_verify_first_done();
+	} else {
+		route_verify.ev =
+			cq_main_insert(ROUTE_VERIFY_TIMEOUT, route_verify_timeout, NULL);
+	}
+
+	return boot;
+}
+
+/**
+ * Insert loaded nodes in the routing table.
+ *
+ * @param nodes			the loaded nodes, by KUID, freed on return
+ * @param most_recent	time elapsed since we last saw the most recent node
+ * @param same_kuid		whether nodes were persisted with our current KUID
+ */
+static void
+dht_route_install(patricia_t *nodes, time_delta_t most_recent, bool same_kuid)
+{
+	patricia_iter_t *iter;
+
+	route_verify_clear();
 
 	/*
 	 * Now insert the recorded nodes in topological order, so that
 	 * we fill the closest subtree first and minimize the level of
 	 * splitting in the furthest parts of the tree.
+	 *
+	 * If the KUID has changed since the last time the routing table was
+	 * saved (e.g. they are importing a persisted file from another instance),
+	 * then bucket splits will not occur in the same way and some nodes will
+	 * be discarded.  It does not matter much, we should have enough good
+	 * hosts to attempt a bootstrap.
 	 */
 
 	iter = patricia_metric_iterator_lazy(nodes, our_kuid, TRUE);
 
 	while (patricia_iter_has_next(iter)) {
 		knode_t *tkn;
-		knode_t *kn = patricia_iter_next_value(iter);
+		struct route_entry *re = patricia_iter_next_value(iter);
+		knode_t *kn = re->kn;
+
 		if ((tkn = dht_find_node(kn->id))) {
 			g_warning("DHT ignoring persisted dup %s (has %s already)",
 				knode_to_string(kn), knode_to_string2(tkn));
@@ -5515,59 +6074,88 @@ dht_route_parse(FILE *f)
 				if (GNET_PROPERTY(dht_debug)) {
 					g_debug("DHT ignored persisted %s", knode_to_string(kn));
 				}
+			} else {
+				if (KNODE_STALE == re->status)
+					dht_set_node_status(kn, KNODE_STALE);
+				route_verify.nodes =
+					g_slist_prepend(route_verify.nodes, knode_refcnt_inc(kn));
 			}
 		}
 	}
 	patricia_iterator_release(&iter);
-	patricia_foreach(nodes, knode_patricia_free, NULL);
+	patricia_foreach(nodes, route_entry_free, NULL);
 	patricia_destroy(nodes);
 
+	route_verify.nodes = g_slist_reverse(route_verify.nodes);
+
 	/*
 	 * If the delta is smaller than half the bucket refresh period, we
 	 * can consider the table as being bootstrapped: they are restarting
 	 * after an update, for instance.
+	 *
+	 * If it is older but still warm, the first verification stage will
+	 * tell whether we can skip the bootstrap.
 	 */
 
 	if (dht_seeded()) {
-		enum dht_bootsteps boot_status =
-			most_recent < REFRESH_PERIOD / 2 ?
-				DHT_BOOT_COMPLETED : DHT_BOOT_SEEDED;
+		enum dht_bootsteps boot_status = DHT_BOOT_SEEDED;
+
+		if (same_kuid && most_recent < REFRESH_PERIOD / 2)
+			boot_status = DHT_BOOT_COMPLETED;
+		else if (same_kuid && most_recent < ROUTE_WARM_PERIOD)
+			route_verify.boot = TRUE;
+
 		if (
 			old_boot_status != DHT_BOOT_NONE &&
 			old_boot_status != DHT_BOOT_COMPLETED
 		) {
 			boot_status = old_boot_status;
+			route_verify.boot = FALSE;
 		}
 		gnet_prop_set_guint32_val(PROP_DHT_BOOT_STATUS, boot_status);
 	}
 
 	if (GNET_PROPERTY(dht_debug))
-		g_debug("DHT after retrieval we are %s",
-			boot_status_to_string(GNET_PROPERTY(dht_boot_status)));
+		g_debug("DHT after retrieval we are %s%s",
+			boot_status_to_string(GNET_PROPERTY(dht_boot_status)),
+			route_verify.boot ? " (pending verification)" : "");
 
 	keys_update_kball();
 	dht_update_size_estimate();
 }
 
-static const char node_file[] = "dht_nodes";
-static const char file_what[] = "DHT nodes";
-
 /**
- * Retrieve previous routing table from ~/.gtk-gnutella/dht_nodes.
+ * Retrieve previous routing table from ~/.gtk-gnutella/dht_snapshot, or
+ * from the former ~/.gtk-gnutella/dht_nodes.
  */
 static void
 dht_route_retrieve(void)
 {
-	file_path_t fp[1];
-	FILE *f;
+	patricia_t *nodes;
+	time_delta_t most_recent = ROUTE_WARM_PERIOD;
+	bool same_kuid = TRUE;
+
+	nodes = patricia_create(KUID_RAW_BITSIZE);
+
+	if (!dht_route_load(nodes, &most_recent, &same_kuid)) {
+		file_path_t fp[1];
+		FILE *f;
 
-	file_path_set(fp, settings_config_dir(), node_file);
-	f = file_config_open_read(file_what, fp, G_N_ELEMENTS(fp));
+		/* Legacy: textual format used before binary snapshots */
 
-	if (f) {
-		dht_route_parse(f);
+		file_path_set(fp, settings_config_dir(), node_file);
+		f = file_config_open_read(file_what, fp, G_N_ELEMENTS(fp));
+
+		if (NULL == f) {
+			patricia_destroy(nodes);
+			return;
+		}
+
+		dht_route_parse(f, nodes, &most_recent);
 		fclose(f);
 	}
+
+	dht_route_install(nodes, most_recent, same_kuid);
 }
 
 /* vi: set ts=4 sw=4 cindent: */
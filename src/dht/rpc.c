@@ -96,6 +96,15 @@ static hikset_t *pending;		/**< Pending RPC (GUID -> rpc_cb) */
  */
 static aging_table_t *rpc_recent;
 
+/**
+ * RTT statistics over all the RPC replies we got, used to derive timeouts
+ * for nodes we never got a reply from.
+ */
+static struct rpc_rtt {
+	uint32 srtt;				/**< Smoothed RTT, in ms (0 if unknown) */
+	uint32 rttvar;				/**< RTT variation, in ms */
+} rpc_rtt;
+
 /**
  * RPC operation to string, for logs.
  */
@@ -295,41 +304,76 @@ rpc_cb_free(struct rpc_cb *rcb, bool in_shutdown)
 }
 
 /**
- * Compute a suitable timeout for the RPC call, in milliseconds, based
- * on the average RTT we have measured in the past for that node and the
- * amount of RPC timeouts that we have seen so far.
+ * Account for a new RTT measurement in the smoothed RTT and its variation,
+ * as done by TCP (RFC 6298).
+ *
+ * @param srtt		the smoothed RTT to update (0 if no measurement yet)
+ * @param rttvar	the RTT variation to update
+ * @param rtt		the measured RTT, in ms
+ */
+static void
+rpc_rtt_sample(uint32 *srtt, uint32 *rttvar, uint32 rtt)
+{
+	if (0 == *srtt) {
+		*rttvar = rtt / 2;
+		*srtt = MAX(rtt, 1);			/* 0 means "unknown" */
+	} else {
+		uint32 delta = *srtt > rtt ? *srtt - rtt : rtt - *srtt;
+
+		*rttvar = (3 * *rttvar + delta) / 4;
+		*srtt = MAX((7 * *srtt + rtt) / 8, 1);
+	}
+}
+
+/**
+ * Compute the RPC timeout for a node, in milliseconds.
+ *
+ * The RTT statistics of the node (or of the whole population of nodes if
+ * we never got any reply from it) are used to compute the timeout as
+ * TCP does, the smoothed RTT plus four times its variation.  This value is
+ * then doubled for each consecutive RPC timeout we already had with that
+ * node.
  */
-static int
-rpc_delay(const knode_t *kn)
+uint32
+dht_rpc_rto(const knode_t *kn)
 {
-	int timeout = DHT_RPC_MINDELAY;
+	uint32 timeout;
 
 	knode_check(kn);
 
+	if (kn->rtt)
+		timeout = kn->rtt + 4 * kn->rttvar;
+	else if (rpc_rtt.srtt)
+		timeout = rpc_rtt.srtt + 4 * rpc_rtt.rttvar;
+	else
+		timeout = DHT_RPC_FIRSTDELAY;
+
+	timeout = MAX(timeout, DHT_RPC_MINDELAY);
+
 	/*
-	 * If we already have seen timeouts for this host, use additional
-	 * timeout of 256ms * 2^timeouts. As 256 = 2^8, this is 2^(timeouts+8).
-	 *
-	 * We clamp the amount of timeouts considered to 10, to prevent overflowing
-	 * the integer. 2^10 is also roughly 1 second, so we're already way beyond
-	 * the reasonable timeout maximum of DHT_RPC_MAXDELAY.
+	 * We clamp the amount of timeouts considered to 4, since the timeout is
+	 * then already well beyond the reasonable maximum of DHT_RPC_MAXDELAY.
 	 */
 
-	STATIC_ASSERT(DHT_RPC_MAXDELAY < (1 << (10 + 8)));
+	STATIC_ASSERT(DHT_RPC_MAXDELAY < (DHT_RPC_MINDELAY << 4));
 
 	if (kn->rpc_timeouts)
-		timeout = 1 << (MIN(kn->rpc_timeouts, 10) + 8);
-
-	if (kn->rtt)
-		timeout += 3 * kn->rtt;
-	else
-		timeout = DHT_RPC_FIRSTDELAY;
+		timeout = MIN(timeout, DHT_RPC_MAXDELAY) << MIN(kn->rpc_timeouts, 4);
 
 	STATIC_ASSERT(DHT_RPC_FIRSTDELAY <= DHT_RPC_MAXDELAY);
 
 	return MIN(timeout, DHT_RPC_MAXDELAY);
 }
 
+/**
+ * @return the smoothed RTT measured over all the nodes, in ms, 0 if unknown.
+ */
+uint32
+dht_rpc_srtt(void)
+{
+	return rpc_rtt.srtt;
+}
+
 /**
  * End of RPC lingering time (callout queue callback).
  */
@@ -641,6 +685,7 @@ dht_rpc_answer(const guid_t *muid,
 {
 	struct rpc_cb *rcb;
 	tm_t now;
+	uint32 rtt;			/* Measured RTT, in ms */
 	knode_t *rn;		/* Node to which we sent the RPC */
 
 	knode_check(kn);
@@ -676,14 +721,17 @@ dht_rpc_answer(const guid_t *muid,
 
 		/*
 		 * If the node from which we got a reply is in the routing table,
-		 * update the RTT EMA, since it took longer than expected to get a
-		 * reply -- we want to do better next time at projecting a suitable RTT.
+		 * update its RTT statistics, since it took longer than expected to
+		 * get a reply -- we want to do better next time at projecting a
+		 * suitable timeout.  Likewise for the statistics of all the nodes.
 		 */
 
-		if (KNODE_UNKNOWN != kn->status) {
-			tm_now_exact(&now);
-			kn->rtt += (tm_elapsed_ms(&now, &rcb->start) >> 1) - (kn->rtt >> 1);
-		}
+		tm_now_exact(&now);
+		rtt = tm_elapsed_ms(&now, &rcb->start);
+		rpc_rtt_sample(&rpc_rtt.srtt, &rpc_rtt.rttvar, rtt);
+
+		if (KNODE_UNKNOWN != kn->status)
+			rpc_rtt_sample(&kn->rtt, &kn->rttvar, rtt);
 
 		cq_expire(rcb->timeout);		/* Will free up `rcb' */
 		return FALSE;
@@ -762,9 +810,7 @@ dht_rpc_answer(const guid_t *muid,
 	}
 
 	/*
-	 * Exponential moving average for RTT is computed on the last n=3 terms.
-	 * The smoothing factor, sm=2/(n+1), is therefore 0.5, which is easy
-	 * to compute.
+	 * Update the RTT statistics of the node and of the whole population.
 	 *
 	 * Note that we use the starting point of the RPC, not the time at which
 	 * we actually sent the message from the queue because we also want to
@@ -772,18 +818,20 @@ dht_rpc_answer(const guid_t *muid,
 	 */
 
 	tm_now_exact(&now);
+	rtt = tm_elapsed_ms(&now, &rcb->start);
 
 	rn->rpc_timeouts = 0;
-	rn->rtt += (tm_elapsed_ms(&now, &rcb->start) >> 1) - (rn->rtt >> 1);
+	rpc_rtt_sample(&rn->rtt, &rn->rttvar, rtt);
+	rpc_rtt_sample(&rpc_rtt.srtt, &rpc_rtt.rttvar, rtt);
 
 	/*
 	 * If the node from which we got a reply is in the routing table and
-	 * not the same node as `rn', update the rtt there as well.
+	 * not the same node as `rn', update the RTT there as well.
 	 */
 
 	if (KNODE_UNKNOWN != kn->status && kn != rn) {
 		kn->rpc_timeouts = 0;
-		kn->rtt += (tm_elapsed_ms(&now, &rcb->start) >> 1) - (kn->rtt >> 1);
+		rpc_rtt_sample(&kn->rtt, &kn->rttvar, rtt);
 	}
 
 	/*
@@ -846,7 +894,7 @@ dht_rpc_ping_extended(knode_t *kn, uint32 flags, dht_rpc_cb_t cb, void *arg)
 
 	knode_check(kn);
 
-	muid = rpc_call_prepare(DHT_RPC_PING, kn, rpc_delay(kn), flags, cb, arg);
+	muid = rpc_call_prepare(DHT_RPC_PING, kn, dht_rpc_rto(kn), flags, cb, arg);
 	kmsg_send_ping(kn, muid);
 }
 
@@ -910,7 +958,7 @@ dht_rpc_find_node(knode_t *kn, const kuid_t *id,
 
 	knode_check(kn);
 
-	muid = rpc_call_prepare(DHT_RPC_FIND_NODE, kn, rpc_delay(kn), 0, cb, arg);
+	muid = rpc_call_prepare(DHT_RPC_FIND_NODE, kn, dht_rpc_rto(kn), 0, cb, arg);
 	kmsg_send_find_node(kn, id, muid, mfree, marg);
 }
 
@@ -940,7 +988,7 @@ dht_rpc_find_value(knode_t *kn, const kuid_t *id, dht_value_type_t type,
 
 	knode_check(kn);
 
-	muid = rpc_call_prepare(DHT_RPC_FIND_VALUE, kn, rpc_delay(kn), 0, cb, arg);
+	muid = rpc_call_prepare(DHT_RPC_FIND_VALUE, kn, dht_rpc_rto(kn), 0, cb, arg);
 	kmsg_send_find_value(kn, id, type, skeys, scnt, muid, mfree, marg);
 }
 
@@ -965,7 +1013,7 @@ dht_rpc_store(knode_t *kn, pmsg_t *mb,
 	knode_check(kn);
 	g_assert(pmsg_is_writable(mb));		/* Not shared, or would corrupt data */
 
-	muid = rpc_call_prepare(DHT_RPC_STORE, kn, rpc_delay(kn), 0, cb, arg);
+	muid = rpc_call_prepare(DHT_RPC_STORE, kn, dht_rpc_rto(kn), 0, cb, arg);
 
 	/*
 	 * We need to write the RPC MUID at the beginning of the pre-built message
@@ -44,8 +44,8 @@
 #include "lib/pmsg.h"
 
 #define DHT_RPC_MAXDELAY	15000	/* 15 secs max to get a reply */
-#define DHT_RPC_MINDELAY	3000	/* 3 secs min to get a reply */
-#define DHT_RPC_FIRSTDELAY	5000	/* 5 secs the first time */
+#define DHT_RPC_MINDELAY	1500	/* 1.5 secs min to get a reply */
+#define DHT_RPC_FIRSTDELAY	5000	/* 5 secs before any RTT is measured */
 
 /**
  * RPC operations.
@@ -114,6 +114,8 @@ bool dht_fix_kuid_contact(const kuid_t *kuid, host_addr_t *addr, uint16 *port,
 bool dht_rpc_timeout(const guid_t *muid);
 bool dht_rpc_cancel(const guid_t *muid);
 bool dht_rpc_cancel_if_no_callback(const guid_t *muid);
+uint32 dht_rpc_srtt(void) G_GNUC_PURE;
+uint32 dht_rpc_rto(const knode_t *kn) G_GNUC_PURE;
 bool dht_lazy_rpc_ping(knode_t *kn);
 void dht_rpc_ping(knode_t *kn, dht_rpc_cb_t cb, void *arg);
 void dht_rpc_ping_extended(
@@ -42,10 +42,14 @@
  * of traffic generated will naturally vary.
  *
  * For each created lookup, statistics are gathered upon completion.  This
- * allows the queue to measure the actual bandwidth used by the lookups and
- * to adjust the amount of concurrency based on bandwidth hints provided
- * by the user: the larger the hints, the more concurrency will take place
- * and the faster the results will come back, at the expense on bandwidth.
+ * allows the queue to adjust the amount of concurrency to the latency
+ * experienced by the lookups: the concurrency window grows slowly as long
+ * as lookups complete without many RPC timeouts and without inflating the
+ * RTT measured on DHT nodes, and shrinks quickly otherwise.
+ *
+ * The actual bandwidth used by the lookups is also measured, to make sure
+ * we never exceed the bandwidth hints provided by the user: the larger the
+ * hints, the more concurrency may take place, at the expense on bandwidth.
  *
  * @author Raphael Manfredi
  * @date 2008
@@ -56,6 +60,7 @@
 #include "ulq.h"
 #include "kuid.h"
 #include "lookup.h"
+#include "rpc.h"
 
 #include "if/gnet_property_priv.h"
 #include "if/dht/kademlia.h"
@@ -73,6 +78,8 @@
 #define ULQ_MAX_RUNNING		3		/**< Initial amount of concurrent reqs */
 #define ULQ_UDP_DELAY		5000	/**< Delay in ms if UDP flow-controlled */
 #define ULQ_EMA_SHIFT		7		/**< Shifting during EMA computation */
+#define ULQ_MAX_WINDOW		32		/**< Max concurrency window */
+#define ULQ_RTT_INFLATION	2		/**< RTT inflation signalling congestion */
 
 #define vema(x)	((x) >> ULQ_EMA_SHIFT)
 
@@ -150,6 +157,8 @@ static struct ulq_sched {
 	int sz_in_ema;					/**< Slow EMA of incoming message size */
 	int sz_out_ema;					/**< Slow EMA of outgoing message size */
 	int msg_dropped;				/**< Exponentially decaying # of drops */
+	int window;						/**< Concurrency window (shifted) */
+	int srtt_ema;					/**< Slow EMA of RPC smoothed RTT */
 	bool udp_flow_controlled;		/**< Whether UDP was flow-controlled */
 } sched;
 
@@ -307,6 +316,68 @@ ulq_node_found_cb(const kuid_t *kuid, const lookup_rs_t *rs, void *arg)
 	ulq_completed(ui);
 }
 
+/**
+ * Shrink the concurrency window multiplicatively.
+ */
+static void
+ulq_window_shrink(void)
+{
+	sched.window -= sched.window / 4;
+	sched.window = MAX(sched.window, 1 << ULQ_EMA_SHIFT);
+}
+
+/**
+ * Adjust the concurrency window on the latency experienced by a lookup.
+ */
+static void
+ulq_window_update(const struct lookup_stats *ls)
+{
+	uint32 srtt = dht_rpc_srtt();
+	bool congested;
+
+	/*
+	 * A lookup which had messages dropped, saw more than a quarter of its
+	 * RPCs timing out, or was run whilst the RTT of DHT nodes got inflated
+	 * compared to its long-term average, means we're running too many
+	 * lookups in parallel.
+	 */
+
+	congested = ls->msg_dropped > 0 ||
+		4 * ls->rpc_timeouts > ls->rpc_timeouts + ls->rpc_replies ||
+		(sched.srtt_ema != 0 &&
+			srtt > ULQ_RTT_INFLATION * UNSIGNED(vema(sched.srtt_ema)));
+
+	if (srtt != 0) {
+		int avg = srtt << ULQ_EMA_SHIFT;
+
+		if (0 == sched.srtt_ema)
+			sched.srtt_ema = avg;
+		else
+			sched.srtt_ema += (avg >> 4) - (sched.srtt_ema >> 4);
+	}
+
+	/*
+	 * Additive increase of one lookup per window's worth of completed
+	 * lookups, multiplicative decrease on congestion.
+	 */
+
+	if (congested) {
+		ulq_window_shrink();
+	} else {
+		sched.window += (1 << (2 * ULQ_EMA_SHIFT)) / sched.window;
+		sched.window = MIN(sched.window, ULQ_MAX_WINDOW << ULQ_EMA_SHIFT);
+	}
+
+	if (GNET_PROPERTY(dht_ulq_debug) > 2) {
+		g_debug("DHT ULQ window %s to %d.%02d (srtt=%u ms, avg=%d ms, "
+			"timeouts=%d, replies=%d, dropped=%d)",
+			congested ? "shrunk" : "grown", vema(sched.window),
+			(sched.window & ((1 << ULQ_EMA_SHIFT) - 1)) * 100 >> ULQ_EMA_SHIFT,
+			srtt, vema(sched.srtt_ema),
+			ls->rpc_timeouts, ls->rpc_replies, ls->msg_dropped);
+	}
+}
+
 /**
  * Statistics callback invoked when loookup is finished, before user-defined
  * callbacks for error and results.
@@ -356,6 +427,8 @@ ulq_lookup_stats(const kuid_t *kuid,
 	sched.msg_dropped += ls->msg_dropped;
 	sched.msg_dropped -= sched.msg_dropped >> 1;	/* Halve the count */
 
+	ulq_window_update(ls);
+
 	if (GNET_PROPERTY(dht_ulq_debug) > 1)
 		g_debug("DHT ULQ %s lookup completed in %g secs (in=%d, out=%d)",
 			ui->uq->name, ls->elapsed, ls->bw_incoming, ls->bw_outgoing);
@@ -544,13 +617,20 @@ ulq_service(void)
 
 		if (GNET_PROPERTY(dht_ulq_debug) > 1)
 			g_debug("DHT ULQ service: limits in = (bw: %d, sz: %d), "
-				"out = (bw: %d, sz: %d)",
-				in_limit, sz_in_limit, out_limit, sz_out_limit);
+				"out = (bw: %d, sz: %d), window = %d",
+				in_limit, sz_in_limit, out_limit, sz_out_limit,
+				vema(sched.window));
 
 		in_limit = MIN(in_limit, sz_in_limit);
 		out_limit = MIN(out_limit, sz_out_limit);
 
+		/*
+		 * The concurrency window, driven by the latency we experience,
+		 * operates within the bandwidth limits.
+		 */
+
 		max = MIN(out_limit, in_limit);
+		max = MIN(max, vema(sched.window));
 	}
 
 	/*
@@ -663,6 +743,7 @@ ulq_do_service(cqueue_t *unused_cq, void *unused_obj)
 		sched.bw_in_ema += sched.bw_in_ema / 4;
 		sched.bw_out_ema += sched.bw_out_ema / 4;
 		sched.udp_flow_controlled = TRUE;
+		ulq_window_shrink();
 		ulq_delay_servicing();
 		return;
 	}
@@ -883,6 +964,7 @@ ulq_init(void)
 
 	ZERO(&sched);
 	sched.runq = slist_new();
+	sched.window = ULQ_MAX_RUNNING << ULQ_EMA_SHIFT;
 }
 
 /**
@@ -56,6 +56,11 @@
  * information about the values is kept in RAM, mainly to handle limits and
  * data expiration.
  *
+ * Values are held in log-structured stores: republishing or replicating a
+ * value appends its new version to the log instead of updating it in place,
+ * and values expiring at about the same time end-up in the same segments,
+ * which are discarded as a whole once all their values have expired.
+ *
  * @author Raphael Manfredi
  * @date 2008
  */
@@ -86,7 +91,9 @@
 #include "lib/hashing.h"
 #include "lib/host_addr.h"
 #include "lib/hset.h"
+#include "lib/htable.h"
 #include "lib/log.h"				/* For log_file_printable() */
+#include "lib/logstore.h"
 #include "lib/mempcpy.h"
 #include "lib/parse.h"
 #include "lib/pmsg.h"
@@ -113,8 +120,7 @@
 #define MAX_VALUES		262144	/**< Max # of values we accept to manage */
 #define EXPIRE_PERIOD	30		/**< Asynchronous expire period: 30 secs */
 
-#define VALUES_DB_CACHE_SIZE 1024	/**< Amount of values to keep cached */
-#define RAW_DB_CACHE_SIZE	 512	/**< Amount of raw data to keep cached */
+#define VALUES_COMPACT_BUDGET	(1024 * 1024)	/**< Bytes compacted per period */
 
 #define equiv(p,q)  (!(p) == !(q))
 
@@ -125,14 +131,12 @@
  * We do store the so-called secondary key here as well to allow traversal
  * of the values without going through the keys first.
  *
- * NB: the actual value is stored separately in a dedicated database, indexed
- * by the same 64-bit key as the valuedata.  Two reasons for this:
- * 1) SDBM puts constraints on the total size of key+value (<= 1008 bytes).
- *    Our local key is 8 bytes, that leaves 1000 bytes at most for values.
- * 2) The access pattern is going to be different.  We shall access the meta
- *    information more often than the value itself and we don't want to
- *    read and deserialize the actual value each time, or write it back when
- *    the meta information are updated.
+ * NB: the actual value is stored separately in a dedicated log store, indexed
+ * by the same 64-bit key as the valuedata, because the access pattern is
+ * going to be different.  We shall access the meta information more often
+ * than the value itself and we don't want to read and deserialize the actual
+ * value each time, or append it again to the log when the meta information
+ * are updated.
  */
 struct valuedata {
 	kuid_t id;					/**< The primary key of the value */
@@ -158,7 +162,6 @@ struct valuedata {
 	uint32 n_replication;		/**< Amount of replication we had */
 	uint32 s_elapsed_publish;	/**< Sum of elapsed time between publications */
 	uint32 s_elapsed_replicat;	/**< Sum of elapsed time between replications */
-	uint32 n_requests;			/**< Amount of time value was requested */
 };
 
 /**
@@ -187,19 +190,33 @@ static acct_net_t *values_per_class_c;
 static hset_t *expired;
 
 /**
- * DBM wrapper to store valuedata.
+ * Amount of times each value was requested, indexed by DB key.
+ *
+ * This is only used for statistics and is not worth rewriting the valuedata
+ * record in the log for each lookup hit, hence it is only kept in RAM.
  */
-static dbmw_t *db_valuedata;
+static htable_t *requests;
+
+/**
+ * Log store for serialized valuedata.
+ */
+static logstore_t *db_valuedata;
 static char db_valbase[] = "dht_values";
 static char db_valwhat[] = "DHT value data";
 
 /**
- * DBM wrapper to store actual data.
+ * Log store for actual data.
  */
-static dbmw_t *db_rawdata;
+static logstore_t *db_rawdata;
 static char db_rawbase[] = "dht_raw";
 static char db_rawwhat[] = "DHT raw data";
 
+/**
+ * Reused streams to (de)serialize valuedata.
+ */
+static pmsg_t *valuedata_mb;
+static bstr_t *valuedata_bs;
+
 /**
  * DBM wrapper to remember expired (key, creator_id) tuples.
  */
@@ -251,7 +268,6 @@ serialize_valuedata(pmsg_t *mb, const void *data)
 	pmsg_write_be32(mb, vd->n_replication);
 	pmsg_write_be32(mb, vd->s_elapsed_publish);
 	pmsg_write_be32(mb, vd->s_elapsed_replicat);
-	pmsg_write_be32(mb, vd->n_requests);
 }
 
 /**
@@ -287,7 +303,6 @@ deserialize_valuedata(bstr_t *bs, void *valptr, size_t len)
 	bstr_read_be32(bs, &vd->n_replication);
 	bstr_read_be32(bs, &vd->s_elapsed_publish);
 	bstr_read_be32(bs, &vd->s_elapsed_replicat);
-	bstr_read_be32(bs, &vd->n_requests);
 }
 
 /**
@@ -873,45 +888,116 @@ kuid_pair_was_republished(const kuid_t *key, const kuid_t *skey)
 
 /**
  * Get valuedata from database.
+ *
+ * The returned structure is only valid until the next call, and must be
+ * written back through put_valuedata() when modified.
  */
 static struct valuedata *
 get_valuedata(uint64 dbkey)
 {
-	struct valuedata *vd;
+	static struct valuedata vd;
+	size_t length;
+	void *data;
 
-	vd = dbmw_read(db_valuedata, &dbkey, NULL);
+	data = logstore_read(db_valuedata, dbkey, &length);
 
-	if (vd == NULL) {
-		if (dbmw_has_ioerr(db_valuedata)) {
-			g_warning("DBMW \"%s\" I/O error, bad things could happen...",
-				dbmw_name(db_valuedata));
+	if (data == NULL) {
+		if (logstore_has_ioerr(db_valuedata)) {
+			g_warning("log \"%s\" I/O error, bad things could happen...",
+				logstore_name(db_valuedata));
 		} else {
-			g_warning("value for DB-key %s exists but not found in DBMW \"%s\"",
-				uint64_to_string(dbkey), dbmw_name(db_valuedata));
+			g_warning("value for DB-key %s exists but not found in log \"%s\"",
+				uint64_to_string(dbkey), logstore_name(db_valuedata));
 		}
 		return NULL;
 	}
 
-	return vd;
+	bstr_reset(valuedata_bs, data, length, BSTR_F_ERROR);
+	deserialize_valuedata(valuedata_bs, &vd, sizeof vd);
+
+	if (bstr_has_error(valuedata_bs)) {
+		g_warning("cannot deserialize value for DB-key %s in log \"%s\": %s",
+			uint64_to_string(dbkey), logstore_name(db_valuedata),
+			bstr_error(valuedata_bs));
+		return NULL;
+	}
+
+	return &vd;
 }
 
 /**
- * Delete valuedata from the database.
+ * Write valuedata to database.
+ */
+static void
+put_valuedata(uint64 dbkey, const struct valuedata *vd)
+{
+	pmsg_reset(valuedata_mb);
+	serialize_valuedata(valuedata_mb, vd);
+
+	g_assert(UNSIGNED(pmsg_size(valuedata_mb)) <= sizeof *vd);
+
+	if (
+		!logstore_write(db_valuedata, dbkey, pmsg_start(valuedata_mb),
+			pmsg_size(valuedata_mb), vd->expire)
+	) {
+		g_warning("log \"%s\" I/O error, bad things could happen...",
+			logstore_name(db_valuedata));
+	}
+}
+
+/**
+ * Count a request for the value.
+ */
+static void
+values_count_request(uint64 dbkey)
+{
+	const void *key;
+	void *n;
+
+	if (htable_lookup_extended(requests, &dbkey, &key, &n)) {
+		htable_insert(requests, key, GUINT_TO_POINTER(GPOINTER_TO_UINT(n) + 1));
+	} else {
+		htable_insert(requests, atom_uint64_get(&dbkey), GUINT_TO_POINTER(1));
+	}
+}
+
+/**
+ * @return amount of times the value was requested.
+ */
+static uint
+values_requests(uint64 dbkey)
+{
+	return GPOINTER_TO_UINT(htable_lookup(requests, &dbkey));
+}
+
+/**
+ * Forget about the amount of requests for the value.
+ */
+static void
+values_forget_requests(uint64 dbkey)
+{
+	const void *key;
+
+	if (htable_lookup_extended(requests, &dbkey, &key, NULL)) {
+		htable_remove(requests, key);
+		atom_uint64_free(key);
+	}
+}
+
+/**
+ * Forget about a value, whose valuedata is supplied, undoing all the
+ * accounting made when it was first published and removing it from the
+ * database.
  *
  * @param dbkey			the 64-bit DB key
+ * @param vd			the valuedata of the value
  * @param has_expired	whether deletion happens because value expired
  */
 static void
-delete_valuedata(uint64 dbkey, bool has_expired)
+forget_valuedata(uint64 dbkey, const struct valuedata *vd, bool has_expired)
 {
-	const struct valuedata *vd;
-
 	g_assert(values_managed > 0);
 
-	vd = get_valuedata(dbkey);
-	if (NULL == vd)
-		return;			/* I/O error or corrupted data */
-
 	values_managed--;
 	acct_net_update(values_per_class_c, vd->addr, NET_CLASS_C_MASK, -1);
 	acct_net_update(values_per_ip, vd->addr, NET_IPv4_MASK, -1);
@@ -921,9 +1007,28 @@ delete_valuedata(uint64 dbkey, bool has_expired)
 		kuid_pair_has_expired(&vd->id, &vd->cid);
 
 	keys_remove_value(&vd->id, &vd->cid, dbkey);
+	values_forget_requests(dbkey);
+
+	logstore_delete(db_rawdata, dbkey);
+	logstore_delete(db_valuedata, dbkey);
+}
+
+/**
+ * Delete valuedata from the database.
+ *
+ * @param dbkey			the 64-bit DB key
+ * @param has_expired	whether deletion happens because value expired
+ */
+static void
+delete_valuedata(uint64 dbkey, bool has_expired)
+{
+	const struct valuedata *vd;
+
+	vd = get_valuedata(dbkey);
+	if (NULL == vd)
+		return;			/* I/O error or corrupted data */
 
-	dbmw_delete(db_rawdata, &dbkey);
-	dbmw_delete(db_valuedata, &dbkey);
+	forget_valuedata(dbkey, vd, has_expired);
 }
 
 /**
@@ -963,6 +1068,9 @@ values_periodic_expire(void *unused_obj)
 	(void) unused_obj;
 
 	values_reclaim_expired();
+	logstore_compact(db_valuedata, VALUES_COMPACT_BUDGET);
+	logstore_compact(db_rawdata, VALUES_COMPACT_BUDGET);
+
 	return TRUE;		/* Keep calling */
 }
 
@@ -981,7 +1089,7 @@ log_expired_value_stats(uint64 dbkey, const struct valuedata *vd)
 		kuid_to_hex_string(&vd->id),
 		compact_time(delta_time(tm_time(), vd->created)),
 		(unsigned) vd->n_republish, (unsigned) vd->n_replication,
-		(unsigned) vd->n_requests, uint64_to_string(dbkey));
+		values_requests(dbkey), uint64_to_string(dbkey));
 
 	if (GNET_PROPERTY(dht_storage_debug) > 1) {
 		uint32 avg_publish = 0;
@@ -1542,7 +1650,7 @@ values_publish(const knode_t *kn, const dht_value_t *v)
 		vd->publish = vd->created;
 		fill_valuedata(vd, cn, v);
 
-		keys_add_value(v->id, cn->id, dbkey, vd->expire);
+		keys_add_value(v->id, cn->id, dbkey, vd->type, vd->expire);
 
 		values_managed++;
 		gnet_stats_inc_general(GNR_DHT_VALUES_HELD);
@@ -1618,6 +1726,9 @@ values_publish(const knode_t *kn, const dht_value_t *v)
 
 			value_count_republish(vd);
 
+			if (v->type != vd->type)
+				keys_update_value_type(&vd->id, &vd->cid, v->type);
+
 			vd->original = TRUE;
 			fill_valuedata(vd, cn, v);
 
@@ -1638,7 +1749,7 @@ values_publish(const knode_t *kn, const dht_value_t *v)
 		if (values_has_expired(dbkey, tm_time(), NULL))
 			goto expired;
 
-		data = dbmw_read(db_rawdata, &dbkey, &length);
+		data = logstore_read(db_rawdata, dbkey, &length);
 
 		g_assert(data);
 		g_assert(length == vd->length);		/* Or our bookkeeping is faulty */
@@ -1666,13 +1777,28 @@ values_publish(const knode_t *kn, const dht_value_t *v)
 
 		g_assert(v->length == vd->length);	/* Ensured by preceding code */
 
-		dbmw_write(db_rawdata, &dbkey, deconstify_pointer(v->data), v->length);
+		if (!logstore_write(db_rawdata, dbkey, v->data, v->length, vd->expire))
+			goto ioerr;
 	}
 
-	dbmw_write(db_valuedata, &dbkey, vd, sizeof *vd);
+	put_valuedata(dbkey, vd);
 
 	return STORE_SC_OK;
 
+ioerr:
+	g_warning("log \"%s\" I/O error, dropping value for DB-key %s",
+		logstore_name(db_rawdata), uint64_to_string(dbkey));
+
+	/*
+	 * Forget the value entirely, using the valuedata we have at hand: it
+	 * reflects the accounting made so far, whereas what we could read back
+	 * from the log is stale or missing, since the log is failing.
+	 */
+
+	forget_valuedata(dbkey, vd, FALSE);
+
+	return STORE_SC_DB_IO;
+
 mismatch:
 	if (GNET_PROPERTY(dht_storage_debug) > 1) {
 		g_debug("DHT STORE spotted %s mismatch: got %s from %s {creator: %s}",
@@ -1715,7 +1841,7 @@ values_store(const knode_t *kn, const dht_value_t *v, bool token)
 	knode_check(kn);
 	g_assert(v);
 
-	g_assert(dbmw_count(db_rawdata) == (size_t) values_managed);
+	g_assert(logstore_count(db_rawdata) == (size_t) values_managed);
 
 	if (GNET_PROPERTY(dht_storage_debug) > 1) {
 		g_debug("DHT STORE %s as %s v%u.%u (%u byte%s) created by %s (%s)",
@@ -1777,7 +1903,7 @@ values_store(const knode_t *kn, const dht_value_t *v, bool token)
 
 	status =  0 == v->length ? values_remove(kn, v) : values_publish(kn, v);
 
-	g_assert(dbmw_count(db_rawdata) == (size_t) values_managed);
+	g_assert(logstore_count(db_rawdata) == (size_t) values_managed);
 
 	/* FALL THROUGH */
 
@@ -1834,13 +1960,13 @@ values_get(uint64 dbkey, dht_value_type_t type)
 	 * OK, we have a value and its type matches.  Build the DHT value.
 	 */
 
-	vd->n_requests++;
+	values_count_request(dbkey);
 
 	if (vd->length) {
 		size_t length;
 		void *data;
 
-		data = dbmw_read(db_rawdata, &dbkey, &length);
+		data = logstore_read(db_rawdata, dbkey, &length);
 
 		g_assert(data);
 		g_assert(length == vd->length);		/* Or our bookkeeping is faulty */
@@ -1864,12 +1990,7 @@ values_get(uint64 dbkey, dht_value_type_t type)
 G_GNUC_COLD void
 values_init(void)
 {
-	dbstore_kv_t value_kv =
-		{ sizeof(uint64), NULL, sizeof(struct valuedata), 0 };
-	dbstore_kv_t raw_kv		= { sizeof(uint64), NULL, DHT_VALUE_MAX_LEN, 0 };
 	dbstore_kv_t expired_kv	= { 2 * KUID_RAW_SIZE, NULL, 0, 0 };
-	dbstore_packing_t value_packing =
-		{ serialize_valuedata, deserialize_valuedata, NULL };
 	dbstore_packing_t no_packing = { NULL, NULL, NULL };
 
 	g_assert(NULL == db_valuedata);
@@ -1878,29 +1999,40 @@ values_init(void)
 	g_assert(NULL == values_per_ip);
 	g_assert(NULL == values_per_class_c);
 	g_assert(NULL == expired);
+	g_assert(NULL == requests);
 	g_assert(NULL == values_expire_ev);
 
 	/* Legacy: remove after 0.97 -- RAM, 2011-05-03 */
-	dbstore_move(settings_config_dir(), settings_dht_db_dir(), db_valbase);
-	dbstore_move(settings_config_dir(), settings_dht_db_dir(), db_rawbase);
 	dbstore_move(settings_config_dir(), settings_dht_db_dir(), db_expbase);
 
-	db_valuedata = dbstore_create(db_valwhat, settings_dht_db_dir(),
-		db_valbase, value_kv, value_packing, VALUES_DB_CACHE_SIZE,
-		uint64_mem_hash, uint64_mem_eq,
+	/* Values used to be kept in SDBM databases */
+	dbstore_unlink_sdbm(settings_dht_db_dir(), db_valbase);
+	dbstore_unlink_sdbm(settings_dht_db_dir(), db_rawbase);
+
+	db_valuedata = logstore_create(db_valwhat, settings_dht_db_dir(),
+		db_valbase, sizeof(struct valuedata),
 		GNET_PROPERTY(dht_storage_in_memory));
 
-	db_rawdata = dbstore_create(db_rawwhat, settings_dht_db_dir(), db_rawbase,
-		raw_kv, no_packing, RAW_DB_CACHE_SIZE, uint64_mem_hash, uint64_mem_eq,
+	db_rawdata = logstore_create(db_rawwhat, settings_dht_db_dir(),
+		db_rawbase, DHT_VALUE_MAX_LEN,
 		GNET_PROPERTY(dht_storage_in_memory));
 
 	db_expired = dbstore_create(db_expwhat, settings_dht_db_dir(), db_expbase,
 		expired_kv, no_packing, 0, kuid_pair_hash, kuid_pair_eq,
 		GNET_PROPERTY(dht_storage_in_memory));
 
+	/*
+	 * We allocate one more byte than the maximum serialized size to be able
+	 * to detect overflows.
+	 */
+
+	valuedata_mb = pmsg_new(PMSG_P_DATA, NULL, sizeof(struct valuedata) + 1);
+	valuedata_bs = bstr_create();
+
 	values_per_ip = acct_net_create();
 	values_per_class_c = acct_net_create();
 	expired = hset_create_any(uint64_hash, NULL, uint64_eq);
+	requests = htable_create_any(uint64_hash, NULL, uint64_eq);
 
 	values_expire_ev = cq_periodic_main_add(EXPIRE_PERIOD * 1000,
 		values_periodic_expire, NULL);
@@ -1916,16 +2048,29 @@ expired_free_k(const void *key, void *u_data)
 	atom_uint64_free(dbkey);
 }
 
+static void
+requests_free_kv(const void *key, void *u_value, void *u_data)
+{
+	const uint64 *dbkey = key;
+
+	(void) u_value;
+	(void) u_data;
+
+	atom_uint64_free(dbkey);
+}
+
 /**
  * Close values management.
  */
 G_GNUC_COLD void
 values_close(void)
 {
-	dbstore_delete(db_valuedata);
-	dbstore_delete(db_rawdata);
+	logstore_free_null(&db_valuedata);
+	logstore_free_null(&db_rawdata);
 	dbstore_delete(db_expired);
-	db_valuedata = db_rawdata = db_expired = NULL;
+	db_expired = NULL;
+	pmsg_free_null(&valuedata_mb);
+	bstr_free(&valuedata_bs);
 	acct_net_free_null(&values_per_ip);
 	acct_net_free_null(&values_per_class_c);
 	cq_periodic_remove(&values_expire_ev);
@@ -1935,6 +2080,8 @@ values_close(void)
 
 	hset_foreach(expired, expired_free_k, NULL);
 	hset_free_null(&expired);
+	htable_foreach(requests, requests_free_kv, NULL);
+	htable_free_null(&requests);
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -25,7 +25,9 @@
 #define _if_core_bsched_h_
 
 #include "if/core/wrap.h"	/* For wrap_io_t */
+#include "lib/cq.h"			/* For cevent_t */
 #include "lib/inputevt.h"	/* For inputevt_handler_t */
+#include "lib/tm.h"			/* For tm_t */
 
 #define BS_BW_MAX	(2*1024*1024)
 
@@ -71,6 +73,8 @@ typedef struct bio_source {
 	uint bw_last_bps;				/**< B/w used last period (bps) */
 	uint bw_fast_ema;				/**< Fast EMA of actual bandwidth used */
 	uint bw_slow_ema;				/**< Slow EMA of actual bandwidth used */
+	tm_t eligible;					/**< Next eligible time, when pacing */
+	cevent_t *pacing_ev;			/**< Re-enables source, when paced */
 } bio_source_t;
 
 /*
@@ -83,6 +87,7 @@ typedef struct bio_source {
 #define BIO_F_USED			(1 << 3)	/**< Source used this period */
 #define BIO_F_FAVOUR		(1 << 4)	/**< Try to favour source this period */
 #define BIO_F_PASSIVE		(1 << 5)	/**< Don't insert source for events */
+#define BIO_F_PACED			(1 << 6)	/**< Source disabled by pacing */
 
 #define BIO_F_RW			(BIO_F_READ|BIO_F_WRITE)
 
@@ -135,6 +135,8 @@ typedef enum {
 	GNR_LOCAL_HITS,
 	GNR_LOCAL_PARTIAL_HITS,
 	GNR_LOCAL_WHATS_NEW_HITS,
+	GNR_LOCAL_QUERY_CACHE_HITS,
+	GNR_LOCAL_QUERY_CACHE_MISSES,
 	GNR_LOCAL_QUERY_HITS,
 	GNR_OOB_PROXIED_QUERY_HITS,
 	GNR_OOB_QUERIES,
@@ -217,6 +219,8 @@ typedef enum {
 	GNR_UDP_SR_TX_FRAGMENTS_RESENT,
 	GNR_UDP_SR_TX_FRAGMENTS_SENDING_AVOIDED,
 	GNR_UDP_SR_TX_FRAGMENTS_OVERSENT,
+	GNR_UDP_SR_TX_FRAGMENTS_FAST_RESENT,
+	GNR_UDP_SR_TX_FRAGMENTS_DEFERRED,
 	GNR_UDP_SR_TX_TOTAL_ACKS_RECEIVED,
 	GNR_UDP_SR_TX_CUMULATIVE_ACKS_RECEIVED,
 	GNR_UDP_SR_TX_EXTENDED_ACKS_RECEIVED,
@@ -245,6 +249,16 @@ typedef enum {
 	GNR_UDP_SR_RX_EARS_FOR_UNKNOWN_MESSAGE,
 	GNR_UDP_SR_RX_EARS_FOR_LINGERING_MESSAGE,
 	GNR_UDP_SR_RX_FROM_HOSTILE_IP,
+	GNR_UDP_SCHED_DHT_ACK_DROPPED,
+	GNR_UDP_SCHED_DHT_RPC_DROPPED,
+	GNR_UDP_SCHED_GUESS_DROPPED,
+	GNR_UDP_SCHED_OOB_DROPPED,
+	GNR_UDP_SCHED_OTHER_DROPPED,
+	GNR_UDP_SCHED_DHT_ACK_DELAY,
+	GNR_UDP_SCHED_DHT_RPC_DELAY,
+	GNR_UDP_SCHED_GUESS_DELAY,
+	GNR_UDP_SCHED_OOB_DELAY,
+	GNR_UDP_SCHED_OTHER_DELAY,
 	GNR_CONSOLIDATED_SERVERS,
 	GNR_DUP_DOWNLOADS_IN_CONSOLIDATION,
 	GNR_DISCOVERED_SERVER_GUID,
@@ -320,9 +334,12 @@ typedef enum {
 	GNR_DHT_LOOKUP_REJECTED_NODE_ON_PROXIMITY,
 	GNR_DHT_LOOKUP_REJECTED_NODE_ON_DIVERGENCE,
 	GNR_DHT_LOOKUP_FIXED_NODE_CONTACT,
+	GNR_DHT_LOOKUP_SHARED_RPCS,
+	GNR_DHT_LOOKUP_PIPELINED_HOPS,
 	GNR_DHT_KEYS_HELD,
 	GNR_DHT_CACHED_KEYS_HELD,
 	GNR_DHT_VALUES_HELD,
+	GNR_DHT_KEYS_FILTERED_LOOKUPS,
 	GNR_DHT_CACHED_KUID_TARGETS_HELD,
 	GNR_DHT_CACHED_ROOTS_HELD,
 	GNR_DHT_CACHED_ROOTS_EXACT_HITS,
@@ -382,6 +399,10 @@ typedef enum {
 	GNR_DHT_PUBLISHING_BG_ATTEMPTS,
 	GNR_DHT_PUBLISHING_BG_IMPROVEMENTS,
 	GNR_DHT_PUBLISHING_BG_SUCCESSFUL,
+	GNR_DHT_PUBLISHING_BATCHES,
+	GNR_DHT_PUBLISHING_BATCHED_VALUES,
+	GNR_DHT_PUBLISHER_BACKLOG,
+	GNR_DHT_PUBLISHER_LAG,
 	GNR_DHT_SHA1_DATA_TYPE_COLLISIONS,
 	GNR_DHT_PASSIVELY_PROTECTED_LOOKUP_PATH,
 	GNR_DHT_ACTIVELY_PROTECTED_LOOKUP_PATH,
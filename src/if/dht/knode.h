@@ -56,7 +56,8 @@ typedef struct knode {
 	time_t last_seen;			/**< Last seen message from that node */
 	time_t last_sent;			/**< Last sent RPC to that node */
 	vendor_code_t vcode;		/**< Vendor code (vcode.u32 == 0 if unknown) */
-	uint32 rtt;					/**< Round-trip time in milliseconds */
+	uint32 rtt;					/**< Smoothed round-trip time, in ms */
+	uint32 rttvar;				/**< Round-trip time variation, in ms */
 	uint32 flags;				/**< Operating flags */
 	host_addr_t addr;			/**< IP of the node */
 	knode_status_t status;		/**< Node status (good, stale, pending) */
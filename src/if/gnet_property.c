@@ -1062,6 +1062,24 @@ gboolean gnet_property_variable_clean_shutdown     = TRUE;
 static const gboolean gnet_property_variable_clean_shutdown_default = TRUE;
 gboolean gnet_property_variable_clean_restart     = TRUE;
 static const gboolean gnet_property_variable_clean_restart_default = TRUE;
+guint32  gnet_property_variable_routing_table_max_memory     = 64;
+static const guint32  gnet_property_variable_routing_table_max_memory_default = 64;
+guint32  gnet_property_variable_query_cache_entries     = 1024;
+static const guint32  gnet_property_variable_query_cache_entries_default = 1024;
+gboolean gnet_property_variable_deflate_adaptive_level     = TRUE;
+static const gboolean gnet_property_variable_deflate_adaptive_level_default = TRUE;
+gboolean gnet_property_variable_gnet_deflate_dict     = TRUE;
+static const gboolean gnet_property_variable_gnet_deflate_dict_default = TRUE;
+gboolean gnet_property_variable_bw_hierarchical     = FALSE;
+static const gboolean gnet_property_variable_bw_hierarchical_default = FALSE;
+gboolean gnet_property_variable_bw_pacing     = FALSE;
+static const gboolean gnet_property_variable_bw_pacing_default = FALSE;
+guint32  gnet_property_variable_mq_tcp_cork_delay     = 5;
+static const guint32  gnet_property_variable_mq_tcp_cork_delay_default = 5;
+guint32  gnet_property_variable_zlib_threads     = 0;
+static const guint32  gnet_property_variable_zlib_threads_default = 0;
+guint32  gnet_property_variable_publisher_rate     = 2;
+static const guint32  gnet_property_variable_publisher_rate_default = 2;
 
 static prop_set_t *gnet_property;
 
@@ -9565,7 +9583,7 @@ gnet_prop_init(void) {
      * General data:
      */
     gnet_property->props[445].name = "tx_ut_debug_flags";
-    gnet_property->props[445].desc = _("Debugging flags for the semi-reliable UDP TX layer: 1: messages, 2: fragments, 4: acknowledgments, 8: transmissions, 16: timeouts.");
+    gnet_property->props[445].desc = _("Debugging flags for the semi-reliable UDP TX layer: 1: messages, 2: fragments, 4: acknowledgments, 8: transmissions, 16: timeouts, 32: congestion window.");
     gnet_property->props[445].ev_changed = event_new("tx_ut_debug_flags_changed");
     gnet_property->props[445].save = TRUE;
     gnet_property->props[445].vector_size = 1;
@@ -9832,6 +9850,174 @@ gnet_prop_init(void) {
     gnet_property->props[459].data.boolean.def   = (void *) &gnet_property_variable_clean_restart_default;
     gnet_property->props[459].data.boolean.value = (void *) &gnet_property_variable_clean_restart;
 
+
+    /*
+     * PROP_ROUTING_TABLE_MAX_MEMORY:
+     *
+     * General data:
+     */
+    gnet_property->props[460].name = "routing_table_max_memory";
+    gnet_property->props[460].desc = _("Maximum amount of memory, in MiB, used by the message routing table.  When reached, the oldest routes are discarded before their natural expiration.");
+    gnet_property->props[460].ev_changed = event_new("routing_table_max_memory_changed");
+    gnet_property->props[460].save = TRUE;
+    gnet_property->props[460].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[460].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[460].data.guint32.def   = (void *) &gnet_property_variable_routing_table_max_memory_default;
+    gnet_property->props[460].data.guint32.value = (void *) &gnet_property_variable_routing_table_max_memory;
+    gnet_property->props[460].data.guint32.choices = NULL;
+    gnet_property->props[460].data.guint32.max   = 1024;
+    gnet_property->props[460].data.guint32.min   = 4;
+
+
+    /*
+     * PROP_QUERY_CACHE_ENTRIES:
+     *
+     * General data:
+     */
+    gnet_property->props[461].name = "query_cache_entries";
+    gnet_property->props[461].desc = _("Maximum amount of query results cached, to avoid matching popular queries against the library each time they are received.  Set to 0 to disable the cache.");
+    gnet_property->props[461].ev_changed = event_new("query_cache_entries_changed");
+    gnet_property->props[461].save = TRUE;
+    gnet_property->props[461].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[461].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[461].data.guint32.def   = (void *) &gnet_property_variable_query_cache_entries_default;
+    gnet_property->props[461].data.guint32.value = (void *) &gnet_property_variable_query_cache_entries;
+    gnet_property->props[461].data.guint32.choices = NULL;
+    gnet_property->props[461].data.guint32.max   = 65536;
+    gnet_property->props[461].data.guint32.min   = 0;
+
+
+    /*
+     * PROP_DEFLATE_ADAPTIVE_LEVEL:
+     *
+     * General data:
+     */
+    gnet_property->props[462].name = "deflate_adaptive_level";
+    gnet_property->props[462].desc = _("Whether the compression level of Gnutella links should be adapted dynamically, trading compression ratio for CPU time when the node is CPU-bound and bandwidth is not scarce.");
+    gnet_property->props[462].ev_changed = event_new("deflate_adaptive_level_changed");
+    gnet_property->props[462].save = TRUE;
+    gnet_property->props[462].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[462].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[462].data.boolean.def   = (void *) &gnet_property_variable_deflate_adaptive_level_default;
+    gnet_property->props[462].data.boolean.value = (void *) &gnet_property_variable_deflate_adaptive_level;
+
+
+    /*
+     * PROP_GNET_DEFLATE_DICT:
+     *
+     * General data:
+     */
+    gnet_property->props[463].name = "gnet_deflate_dict";
+    gnet_property->props[463].desc = _("Whether a preset dictionary should be used on deflated Gnutella connections, when the remote servent advertises the same dictionary during the handshake.");
+    gnet_property->props[463].ev_changed = event_new("gnet_deflate_dict_changed");
+    gnet_property->props[463].save = TRUE;
+    gnet_property->props[463].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[463].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[463].data.boolean.def   = (void *) &gnet_property_variable_gnet_deflate_dict_default;
+    gnet_property->props[463].data.boolean.value = (void *) &gnet_property_variable_gnet_deflate_dict;
+
+
+    /*
+     * PROP_BW_HIERARCHICAL:
+     *
+     * General data:
+     */
+    gnet_property->props[464].name = "bw_hierarchical";
+    gnet_property->props[464].desc = _("Whether bandwidth schedulers should be organized as a hierarchy of traffic classes with guaranteed rates, borrowing unused bandwidth from their parent class within a ceiling, instead of stealing unused bandwidth at the end of each period.");
+    gnet_property->props[464].ev_changed = event_new("bw_hierarchical_changed");
+    gnet_property->props[464].save = TRUE;
+    gnet_property->props[464].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[464].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[464].data.boolean.def   = (void *) &gnet_property_variable_bw_hierarchical_default;
+    gnet_property->props[464].data.boolean.value = (void *) &gnet_property_variable_bw_hierarchical;
+
+
+    /*
+     * PROP_BW_PACING:
+     *
+     * General data:
+     */
+    gnet_property->props[465].name = "bw_pacing";
+    gnet_property->props[465].desc = _("Whether I/O sources should be paced within the scheduling period, each source waiting after an I/O for the time it takes to transfer that data at its share of the bandwidth, instead of being allowed to burst until the bandwidth for the period is exhausted.");
+    gnet_property->props[465].ev_changed = event_new("bw_pacing_changed");
+    gnet_property->props[465].save = TRUE;
+    gnet_property->props[465].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[465].type               = PROP_TYPE_BOOLEAN;
+    gnet_property->props[465].data.boolean.def   = (void *) &gnet_property_variable_bw_pacing_default;
+    gnet_property->props[465].data.boolean.value = (void *) &gnet_property_variable_bw_pacing;
+
+
+    /*
+     * PROP_MQ_TCP_CORK_DELAY:
+     *
+     * General data:
+     */
+    gnet_property->props[466].name = "mq_tcp_cork_delay";
+    gnet_property->props[466].desc = _("Maximum delay, in milliseconds, during which low-priority Gnutella messages sent to an idle uncompressed TCP connection are held so that they can be written together with the next ones. High-priority messages are always sent immediately. Set to 0 to write each message as soon as it is queued.");
+    gnet_property->props[466].ev_changed = event_new("mq_tcp_cork_delay_changed");
+    gnet_property->props[466].save = TRUE;
+    gnet_property->props[466].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[466].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[466].data.guint32.def   = (void *) &gnet_property_variable_mq_tcp_cork_delay_default;
+    gnet_property->props[466].data.guint32.value = (void *) &gnet_property_variable_mq_tcp_cork_delay;
+    gnet_property->props[466].data.guint32.choices = NULL;
+    gnet_property->props[466].data.guint32.max   = 100;
+    gnet_property->props[466].data.guint32.min   = 0;
+
+
+    /*
+     * PROP_ZLIB_THREADS:
+     *
+     * General data:
+     */
+    gnet_property->props[467].name = "zlib_threads";
+    gnet_property->props[467].desc = _("Amount of worker threads to which the compression and decompression of Gnutella links is offloaded.  When 0, compression is done by the main thread.  Changes take effect at the next restart.");
+    gnet_property->props[467].ev_changed = event_new("zlib_threads_changed");
+    gnet_property->props[467].save = TRUE;
+    gnet_property->props[467].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[467].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[467].data.guint32.def   = (void *) &gnet_property_variable_zlib_threads_default;
+    gnet_property->props[467].data.guint32.value = (void *) &gnet_property_variable_zlib_threads;
+    gnet_property->props[467].data.guint32.choices = NULL;
+    gnet_property->props[467].data.guint32.max   = 16;
+    gnet_property->props[467].data.guint32.min   = 0;
+
+
+    /*
+     * PROP_PUBLISHER_RATE:
+     *
+     * General data:
+     */
+    gnet_property->props[468].name = "publisher_rate";
+    gnet_property->props[468].desc = _("Target amount of files the DHT publisher may start publishing per second, to smooth the load on the DHT.");
+    gnet_property->props[468].ev_changed = event_new("publisher_rate_changed");
+    gnet_property->props[468].save = TRUE;
+    gnet_property->props[468].vector_size = 1;
+
+    /* Type specific data: */
+    gnet_property->props[468].type               = PROP_TYPE_GUINT32;
+    gnet_property->props[468].data.guint32.def   = (void *) &gnet_property_variable_publisher_rate_default;
+    gnet_property->props[468].data.guint32.value = (void *) &gnet_property_variable_publisher_rate;
+    gnet_property->props[468].data.guint32.choices = NULL;
+    gnet_property->props[468].data.guint32.max   = 100;
+    gnet_property->props[468].data.guint32.min   = 1;
+
     gnet_property->by_name = htable_create(HASH_KEY_STRING, 0);
     for (n = 0; n < GNET_PROPERTY_NUM; n ++) {
         htable_insert(gnet_property->by_name,
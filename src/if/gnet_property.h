@@ -496,6 +496,15 @@ typedef enum {
     PROP_LOG_UHC_PINGS_TX,
     PROP_CLEAN_SHUTDOWN,
     PROP_CLEAN_RESTART,
+    PROP_ROUTING_TABLE_MAX_MEMORY,
+    PROP_QUERY_CACHE_ENTRIES,
+    PROP_DEFLATE_ADAPTIVE_LEVEL,
+    PROP_GNET_DEFLATE_DICT,
+    PROP_BW_HIERARCHICAL,
+    PROP_BW_PACING,
+    PROP_MQ_TCP_CORK_DELAY,
+    PROP_ZLIB_THREADS,
+    PROP_PUBLISHER_RATE,
     GNET_PROPERTY_END
 } gnet_property_t;
 
@@ -509,6 +509,15 @@ extern const gboolean gnet_property_variable_log_uhc_pings_rx;
 extern const gboolean gnet_property_variable_log_uhc_pings_tx;
 extern const gboolean gnet_property_variable_clean_shutdown;
 extern const gboolean gnet_property_variable_clean_restart;
+extern const guint32  gnet_property_variable_routing_table_max_memory;
+extern const guint32  gnet_property_variable_query_cache_entries;
+extern const gboolean gnet_property_variable_deflate_adaptive_level;
+extern const gboolean gnet_property_variable_gnet_deflate_dict;
+extern const gboolean gnet_property_variable_bw_hierarchical;
+extern const gboolean gnet_property_variable_bw_pacing;
+extern const guint32  gnet_property_variable_mq_tcp_cork_delay;
+extern const guint32  gnet_property_variable_zlib_threads;
+extern const guint32  gnet_property_variable_publisher_rate;
 
 
 prop_set_t *gnet_prop_init(void);
@@ -0,0 +1,337 @@
+/*
+ * bitmerge-test -- bitset merging tests and benchmarking.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This program simulates the merging of leaf QRP tables by an ultrapeer,
+ * using synthetic leaf tables, and compares the packed bitset merging with
+ * the historical per-slot merging into a non-compacted arena.
+ */
+
+#include "common.h"
+
+#include "bitmerge.h"
+#include "misc.h"
+#include "path.h"
+#include "rand31.h"
+#include "str.h"
+#include "tm.h"
+#include "xmalloc.h"
+
+#define DEFAULT_LEAVES	300			/* Amount of leaf tables */
+#define DEFAULT_BITS	16			/* 64K slots per leaf table */
+#define DEFAULT_FILL	1			/* 1% of slots filled */
+#define PRESENT			0			/* Slot present in arena */
+#define INFINITY_VAL	2			/* Slot absent in arena (LOCAL_INFINITY) */
+
+const char *progname;
+static unsigned initial_seed;
+
+struct leaf_table {
+	uint8 *arena;					/* Compacted arena, 1 bit per slot */
+	size_t slots;
+};
+
+static void G_GNUC_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-hmt] [-b bits] [-c leaves] [-f fill] [-n loops]\n"
+		"       [-R seed]\n"
+		"  -b : leaf table size in bits (default = %u)\n"
+		"  -c : amount of leaf tables (default = %u)\n"
+		"  -f : fill percentage of leaf tables (default = %u)\n"
+		"  -h : prints this help message\n"
+		"  -m : mix table sizes, down to 1/8 of the largest size\n"
+		"  -n : sets amount of loops\n"
+		"  -t : time each test\n"
+		"  -R : seed for repeatable random key sequence\n"
+		, progname, DEFAULT_BITS, DEFAULT_LEAVES, DEFAULT_FILL);
+	exit(EXIT_FAILURE);
+}
+
+static void G_GNUC_NORETURN
+test_abort(const char *what)
+{
+	printf("%s - FAILED\n", what);
+	printf("use '-R %u' to reproduce problem.\n", initial_seed);
+	abort();
+}
+
+static struct leaf_table *
+generate_tables(size_t leaves, uint bits, uint fill, bool mixed)
+{
+	struct leaf_table *lt;
+	size_t i;
+
+	lt = xmalloc0(leaves * sizeof lt[0]);
+
+	for (i = 0; i < leaves; i++) {
+		uint b = mixed ? bits - rand31_value(3) : bits;
+		size_t slots = (size_t) 1 << b;
+		size_t set = slots * fill / 100;
+		size_t j;
+
+		lt[i].slots = slots;
+		lt[i].arena = xmalloc0(slots / 8);
+
+		for (j = 0; j < set; j++) {
+			size_t s = rand31_value(slots - 1);
+			lt[i].arena[s >> 3] |= 0x80 >> (s & 0x7);
+		}
+	}
+
+	return lt;
+}
+
+static void
+free_tables(struct leaf_table *lt, size_t leaves)
+{
+	size_t i;
+
+	for (i = 0; i < leaves; i++)
+		xfree(lt[i].arena);
+	xfree(lt);
+}
+
+/*
+ * Historical merging: each set bit of the leaf table is expanded into the
+ * non-compacted arena, one byte per slot.
+ */
+static void
+merge_bytes(const struct leaf_table *lt, uint8 *arena, size_t slots)
+{
+	size_t expand = slots / lt->slots;
+	size_t bytes = lt->slots / 8;
+	size_t b, i;
+
+	for (b = 0, i = 0; b < bytes; b++) {
+		uint8 entry = lt->arena[b];
+		uint mask;
+
+		for (mask = 0x80; mask != 0; mask >>= 1, i++) {
+			if (entry & mask)
+				memset(&arena[i * expand], PRESENT, expand);
+		}
+	}
+}
+
+/*
+ * Compaction of the arena, needed to create the merged routing table.
+ */
+static void
+compact_bytes(const uint8 *arena, uint8 *bits, size_t slots)
+{
+	size_t i;
+
+	memset(bits, 0, slots / 8);
+
+	for (i = 0; i < slots; i++) {
+		if (arena[i] != INFINITY_VAL)
+			bits[i >> 3] |= 0x80 >> (i & 0x7);
+	}
+}
+
+static void
+run_bytes(const struct leaf_table *lt, size_t leaves, size_t slots,
+	uint8 *result, size_t loops)
+{
+	uint8 *arena = xmalloc(slots);
+
+	while (loops-- != 0) {
+		size_t i;
+
+		memset(arena, INFINITY_VAL, slots);
+		for (i = 0; i < leaves; i++)
+			merge_bytes(&lt[i], arena, slots);
+		compact_bytes(arena, result, slots);
+	}
+
+	xfree(arena);
+}
+
+static void
+run_bits(const struct leaf_table *lt, size_t leaves, size_t slots,
+	uint8 *result, size_t loops)
+{
+	while (loops-- != 0) {
+		size_t i;
+
+		memset(result, 0, slots / 8);
+		for (i = 0; i < leaves; i++)
+			bitmerge_or_expand(result, slots / 8, lt[i].arena, lt[i].slots / 8);
+	}
+}
+
+static double
+timeit(void (*f)(const struct leaf_table *, size_t, size_t, uint8 *, size_t),
+	const struct leaf_table *lt, size_t leaves, size_t slots,
+	uint8 *result, size_t loops)
+{
+	tm_t start, end;
+	double ustart, uend;
+
+	tm_now_exact(&start);
+	tm_cputime(&ustart, NULL);
+	(*f)(lt, leaves, slots, result, loops);
+	tm_cputime(&uend, NULL);
+	tm_now_exact(&end);
+
+	return ustart == uend ? tm_elapsed_f(&end, &start) : uend - ustart;
+}
+
+static void
+test_shrink(const uint8 *bits, size_t slots, const char *what)
+{
+	size_t factor;
+
+	for (factor = 2; factor <= 64 && slots / factor >= 8; factor *= 2) {
+		size_t nslots = slots / factor;
+		uint8 *small = xmalloc0(nslots / 8);
+		size_t i;
+
+		bitmerge_or_shrink(small, nslots / 8, bits, slots / 8);
+
+		for (i = 0; i < nslots; i++) {
+			bool set = FALSE;
+			size_t j;
+
+			for (j = i * factor; j < (i + 1) * factor && !set; j++)
+				set = 0 != (bits[j >> 3] & (0x80 >> (j & 0x7)));
+
+			if (set != (0 != (small[i >> 3] & (0x80 >> (i & 0x7)))))
+				test_abort(what);
+		}
+
+		xfree(small);
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	bool tflag = FALSE;
+	bool mixed = FALSE;
+	size_t leaves = DEFAULT_LEAVES;
+	uint bits = DEFAULT_BITS;
+	uint fill = DEFAULT_FILL;
+	size_t loops = 0;
+	unsigned rseed = 0;
+	struct leaf_table *lt;
+	uint8 *ref, *res;
+	size_t slots;
+	char what[80];
+	int c;
+
+	mingw_early_init();
+	progname = filepath_basename(argv[0]);
+
+	while ((c = getopt(argc, argv, "b:c:f:hmn:tR:")) != EOF) {
+		switch (c) {
+		case 'b':			/* leaf table size, in bits */
+			bits = atoi(optarg);
+			break;
+		case 'c':			/* amount of leaf tables */
+			leaves = atol(optarg);
+			break;
+		case 'f':			/* fill percentage */
+			fill = atoi(optarg);
+			break;
+		case 'm':			/* mix table sizes */
+			mixed = TRUE;
+			break;
+		case 'n':			/* amount of loops */
+			loops = atol(optarg);
+			break;
+		case 't':			/* timing report */
+			tflag = TRUE;
+			break;
+		case 'R':			/* randomize in a repeatable way */
+			rseed = atoi(optarg);
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 0)
+		usage();
+
+	if (bits < 6 || bits > 21 || fill > 100 || 0 == leaves)
+		usage();
+
+	rand31_set_seed(rseed);
+	initial_seed = rand31_current_seed();
+
+	if (0 == loops)
+		loops = tflag ? 10 : 1;
+
+	lt = generate_tables(leaves, bits, fill, mixed);
+	slots = (size_t) 1 << bits;
+	ref = xmalloc(slots / 8);
+	res = xmalloc(slots / 8);
+
+	str_bprintf(what, sizeof what, "%zu %s%zu-slot tables, %u%% filled",
+		leaves, mixed ? "mixed " : "", slots, fill);
+
+	{
+		double tbytes, tbits;
+
+		tbytes = timeit(run_bytes, lt, leaves, slots, ref, loops);
+		tbits = timeit(run_bits, lt, leaves, slots, res, loops);
+
+		if (0 != memcmp(ref, res, slots / 8))
+			test_abort(what);
+
+		test_shrink(res, slots, what);
+
+		if (tflag) {
+			printf("%s - [%zu] bytes=%.3gs, bits=%.3gs, speedup=%.2f\n",
+				what, loops, tbytes, tbits,
+				tbits > 0.0 ? tbytes / tbits : 0.0);
+		} else {
+			printf("%s - %zu slots set - OK\n",
+				what, bitmerge_count(res, slots / 8));
+		}
+	}
+
+	xfree(ref);
+	xfree(res);
+	free_tables(lt, leaves);
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Merging of packed bitsets.
+ *
+ * The bitsets handled here are plain byte arrays where bit ``i'' is stored
+ * in byte i / 8, the first bit of each byte being its most significant one.
+ * This is the layout of compacted QRP tables.
+ *
+ * Merging two bitsets of the same size is a mere OR of the two arenas, which
+ * we perform on 128-bit blocks when SSE2 is available, or on native words
+ * otherwise.  Bitsets of different sizes (always differing by a power of 2)
+ * are merged by either expanding each bit of the smaller set to cover the
+ * corresponding range in the larger one, or by folding ranges of bits from
+ * the larger set into a single bit of the smaller one.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "bitmerge.h"
+#include "pow2.h"
+#include "unsigned.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "override.h"			/* Must be the last header included */
+
+/**
+ * Is the 8-byte block starting at ``p'' made of zeros only?
+ */
+static inline bool
+bitmerge_block_is_zero(const uint8 *p)
+{
+	uint64 v;
+
+	memcpy(&v, p, sizeof v);	/* ``p'' is not necessarily aligned */
+	return 0 == v;
+}
+
+/**
+ * OR ``len'' bytes from ``src'' into ``dst''.
+ *
+ * The two areas must not overlap.
+ */
+void
+bitmerge_or(void *dst, const void *src, size_t len)
+{
+	uint8 *d = dst;
+	const uint8 *s = src;
+
+	g_assert(0 == len || (dst != NULL && src != NULL));
+
+#ifdef __SSE2__
+	/*
+	 * Align the destination on a 128-bit boundary so that we can use aligned
+	 * loads and stores on it, the source being read with unaligned loads.
+	 */
+
+	while (len != 0 && 0 != (pointer_to_ulong(d) & 0xf)) {
+		*d++ |= *s++;
+		len--;
+	}
+
+	while (len >= 64) {
+		__m128i *dv = (__m128i *) d;
+		const __m128i *sv = (const __m128i *) s;
+
+		_mm_store_si128(&dv[0],
+			_mm_or_si128(_mm_load_si128(&dv[0]), _mm_loadu_si128(&sv[0])));
+		_mm_store_si128(&dv[1],
+			_mm_or_si128(_mm_load_si128(&dv[1]), _mm_loadu_si128(&sv[1])));
+		_mm_store_si128(&dv[2],
+			_mm_or_si128(_mm_load_si128(&dv[2]), _mm_loadu_si128(&sv[2])));
+		_mm_store_si128(&dv[3],
+			_mm_or_si128(_mm_load_si128(&dv[3]), _mm_loadu_si128(&sv[3])));
+
+		d += 64;
+		s += 64;
+		len -= 64;
+	}
+
+	while (len >= 16) {
+		__m128i *dv = (__m128i *) d;
+
+		_mm_store_si128(dv, _mm_or_si128(
+			_mm_load_si128(dv), _mm_loadu_si128((const __m128i *) s)));
+
+		d += 16;
+		s += 16;
+		len -= 16;
+	}
+#else	/* !__SSE2__ */
+	while (len != 0 && 0 != (pointer_to_ulong(d) & (sizeof(ulong) - 1))) {
+		*d++ |= *s++;
+		len--;
+	}
+
+	while (len >= 4 * sizeof(ulong)) {
+		ulong *dw = (ulong *) d;
+		ulong sw[4];
+
+		memcpy(sw, s, sizeof sw);	/* Source may not be aligned */
+		dw[0] |= sw[0];
+		dw[1] |= sw[1];
+		dw[2] |= sw[2];
+		dw[3] |= sw[3];
+
+		d += sizeof sw;
+		s += sizeof sw;
+		len -= sizeof sw;
+	}
+#endif	/* __SSE2__ */
+
+	while (len-- != 0)
+		*d++ |= *s++;
+}
+
+/**
+ * Spread the 8 bits of a byte over 16 bits, each bit being doubled.
+ */
+static inline uint
+bitmerge_spread2(uint8 b)
+{
+	uint x = b;
+
+	x = (x | (x << 4)) & 0x0f0f;
+	x = (x | (x << 2)) & 0x3333;
+	x = (x | (x << 1)) & 0x5555;
+
+	return x | (x << 1);
+}
+
+/**
+ * Spread the 8 bits of a byte over 32 bits, each bit being quadrupled.
+ */
+static inline uint32
+bitmerge_spread4(uint8 b)
+{
+	uint32 x = b;
+
+	x = (x | (x << 12)) & 0x000f000fU;
+	x = (x | (x << 6))  & 0x03030303U;
+	x = (x | (x << 3))  & 0x11111111U;
+
+	return x * 0xf;
+}
+
+/**
+ * OR the ``slen'' bytes of ``src'' into the ``dlen'' bytes of ``dst'',
+ * each bit of the source being expanded to cover dlen / slen bits in the
+ * destination.
+ *
+ * The expansion ratio dlen / slen must be a power of 2.  When it is 1, this
+ * is a plain bitmerge_or().
+ */
+void
+bitmerge_or_expand(void *dst, size_t dlen, const void *src, size_t slen)
+{
+	uint8 *d = dst;
+	const uint8 *s = src;
+	size_t expand, i;
+
+	g_assert(dst != NULL);
+	g_assert(src != NULL);
+	g_assert(size_is_positive(slen));
+	g_assert(dlen >= slen);
+	g_assert(0 == dlen % slen);
+
+	expand = dlen / slen;
+
+	g_assert(IS_POWER_OF_2(expand));
+
+	if (1 == expand) {
+		bitmerge_or(dst, src, slen);
+		return;
+	}
+
+	/*
+	 * Since OR-ing with 0 is a no-op and tables are usually sparse, skip
+	 * blocks of zeroes quickly.
+	 */
+
+	for (i = 0; i < slen; i++) {
+		uint8 b;
+
+		if (0 == (i & 0x7) && i + 8 <= slen && bitmerge_block_is_zero(&s[i])) {
+			i += 7;
+			continue;
+		}
+
+		b = s[i];
+		if (0 == b)
+			continue;
+
+		switch (expand) {
+		case 2:
+			{
+				uint x = bitmerge_spread2(b);
+				uint8 *p = &d[2 * i];
+
+				p[0] |= x >> 8;
+				p[1] |= x & 0xff;
+			}
+			break;
+		case 4:
+			{
+				uint32 x = bitmerge_spread4(b);
+				uint8 *p = &d[4 * i];
+
+				p[0] |= x >> 24;
+				p[1] |= (x >> 16) & 0xff;
+				p[2] |= (x >> 8) & 0xff;
+				p[3] |= x & 0xff;
+			}
+			break;
+		default:
+			{
+				size_t n = expand / 8;		/* Bytes covered by each bit */
+				uint8 *p = &d[expand * i];
+				uint mask;
+
+				/* Setting all the bits of the range is an OR merge */
+
+				for (mask = 0x80; mask != 0; mask >>= 1, p += n) {
+					if (b & mask)
+						memset(p, 0xff, n);
+				}
+			}
+			break;
+		}
+	}
+}
+
+/**
+ * OR the ``slen'' bytes of ``src'' into the ``dlen'' bytes of ``dst'',
+ * each range of slen / dlen bits in the source being folded into a single
+ * bit of the destination, which is set when any of the bits in the range is.
+ *
+ * The shrinking ratio slen / dlen must be a power of 2.  When it is 1, this
+ * is a plain bitmerge_or().
+ */
+void
+bitmerge_or_shrink(void *dst, size_t dlen, const void *src, size_t slen)
+{
+	uint8 *d = dst;
+	const uint8 *s = src;
+	size_t factor, i;
+
+	g_assert(dst != NULL);
+	g_assert(src != NULL);
+	g_assert(size_is_positive(dlen));
+	g_assert(slen >= dlen);
+	g_assert(0 == slen % dlen);
+
+	factor = slen / dlen;
+
+	g_assert(IS_POWER_OF_2(factor));
+
+	switch (factor) {
+	case 1:
+		bitmerge_or(dst, src, slen);
+		break;
+	case 2:
+		/* Each source byte yields 4 bits, a nibble of the destination */
+		for (i = 0; i < slen; i++) {
+			uint t = s[i] | (s[i] << 1);
+			uint n;
+
+			if (0 == t)
+				continue;
+
+			n = ((t >> 4) & 0x8) | ((t >> 3) & 0x4) |
+				((t >> 2) & 0x2) | ((t >> 1) & 0x1);
+			d[i / 2] |= (i & 0x1) ? n : (n << 4);
+		}
+		break;
+	case 4:
+		/* Each source byte yields 2 bits of the destination */
+		for (i = 0; i < slen; i++) {
+			uint b = s[i];
+			uint n;
+
+			if (0 == b)
+				continue;
+
+			n = ((b & 0xf0) ? 0x2 : 0) | ((b & 0x0f) ? 0x1 : 0);
+			d[i / 4] |= n << (6 - 2 * (i & 0x3));
+		}
+		break;
+	default:
+		{
+			size_t n = factor / 8;		/* Source bytes per destination bit */
+			size_t j, bits = dlen * 8;
+
+			for (j = 0; j < bits; j++) {
+				const uint8 *p = &s[j * n];
+				size_t k = 0;
+
+				while (k + 8 <= n && bitmerge_block_is_zero(&p[k]))
+					k += 8;
+				while (k < n && 0 == p[k])
+					k++;
+
+				if (k < n)
+					d[j >> 3] |= 0x80 >> (j & 0x7);
+			}
+		}
+		break;
+	}
+}
+
+/**
+ * @return the amount of bits set in the ``len'' bytes starting at ``p''.
+ */
+size_t
+bitmerge_count(const void *p, size_t len)
+{
+	const uint8 *s = p;
+	size_t count = 0;
+
+	g_assert(0 == len || p != NULL);
+
+	while (len >= sizeof(uint32)) {
+		uint32 v;
+
+		memcpy(&v, s, sizeof v);
+		count += popcount(v);
+		s += sizeof v;
+		len -= sizeof v;
+	}
+
+	while (len-- != 0)
+		count += bits_set(*s++);
+
+	return count;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
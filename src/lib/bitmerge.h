@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Merging of packed bitsets.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#ifndef _bitmerge_h_
+#define _bitmerge_h_
+
+/*
+ * Public interface.
+ */
+
+void bitmerge_or(void *dst, const void *src, size_t len);
+void bitmerge_or_expand(void *dst, size_t dlen, const void *src, size_t slen);
+void bitmerge_or_shrink(void *dst, size_t dlen, const void *src, size_t slen);
+size_t bitmerge_count(const void *p, size_t len) G_GNUC_PURE;
+
+#endif /* _bitmerge_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
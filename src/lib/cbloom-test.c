@@ -0,0 +1,381 @@
+/*
+ * cbloom-test -- counting Bloom filter tests and benchmarking.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include "common.h"
+
+#include "lib/cbloom.h"
+#include "lib/misc.h"
+#include "lib/path.h"
+#include "lib/rand31.h"
+#include "lib/str.h"
+#include "lib/tm.h"
+#include "lib/xmalloc.h"
+
+#define TEST_BITS	16
+#define KEY_SIZE	20			/* Same as a KUID */
+#define MAX_FP		3			/* Max false positive percentage tolerated */
+#define SATURATE	300			/* More than a counter can hold */
+
+const char *progname;
+static bool silent_mode;
+static unsigned initial_seed;
+static const char *current_test;
+
+static void G_GNUC_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-htS] [-c items] [-n loops] [-N main-loops] [-R seed]\n"
+		"  -c : sets item count to test\n"
+		"  -h : prints this help message\n"
+		"  -n : sets amount of loops\n"
+		"  -t : time each test\n"
+		"  -N : run the main test loop that many times (default = 1)\n"
+		"  -R : seed for repeatable random key sequence\n"
+		"  -S : silent mode -- do not print anything for successful tests\n"
+		, progname);
+	exit(EXIT_FAILURE);
+}
+
+static void G_GNUC_NORETURN
+test_abort(const char *why)
+{
+	if (current_test != NULL)
+		printf("%s - %s - FAILED\n", current_test, why);
+	printf("use '-R %u' to reproduce problem.\n", initial_seed);
+	abort();
+}
+
+static char *
+generate_keys(size_t cnt)
+{
+	char *keys = xmalloc(cnt * KEY_SIZE);
+
+	rand31_bytes(keys, cnt * KEY_SIZE);
+
+	return keys;
+}
+
+static inline const char *
+key(const char *keys, size_t i)
+{
+	return &keys[i * KEY_SIZE];
+}
+
+/*
+ * Make sure all the given keys are found, a Bloom filter never yielding
+ * false negatives.
+ */
+static void
+assert_contains(const cbloom_t *cb, const char *keys, size_t first, size_t end,
+	const char *why)
+{
+	size_t i;
+
+	for (i = first; i < end; i++) {
+		if (!cbloom_contains(cb, key(keys, i), KEY_SIZE))
+			test_abort(why);
+	}
+}
+
+/*
+ * @return the percentage of keys found in the filter.
+ */
+static size_t
+found_percentage(const cbloom_t *cb, const char *keys, size_t first, size_t end)
+{
+	size_t i, n = 0;
+
+	if (first == end)
+		return 0;
+
+	for (i = first; i < end; i++) {
+		if (cbloom_contains(cb, key(keys, i), KEY_SIZE))
+			n++;
+	}
+
+	return n * 100 / (end - first);
+}
+
+/*
+ * Add ``cnt'' keys, check they are all found and that keys never added are
+ * mostly not found, then remove half of the keys and check the others are
+ * still all found.
+ *
+ * The second half of ``keys'' holds keys that are never added.
+ */
+static void
+test_add_remove(const char *keys, size_t cnt)
+{
+	cbloom_t *cb = cbloom_make(cnt);
+	size_t i;
+
+	for (i = 0; i < cnt; i++)
+		cbloom_add(cb, key(keys, i), KEY_SIZE);
+
+	if (cbloom_count(cb) != cnt || cbloom_capacity(cb) < cnt)
+		test_abort("count after add");
+
+	assert_contains(cb, keys, 0, cnt, "false negative after add");
+
+	if (found_percentage(cb, keys, cnt, 2 * cnt) > MAX_FP)
+		test_abort("false positives after add");
+
+	for (i = 0; i < cnt; i += 2)
+		cbloom_remove(cb, key(keys, i), KEY_SIZE);
+
+	if (cbloom_count(cb) != cnt / 2)
+		test_abort("count after remove");
+
+	for (i = 1; i < cnt; i += 2) {
+		if (!cbloom_contains(cb, key(keys, i), KEY_SIZE))
+			test_abort("false negative after remove");
+	}
+
+	/*
+	 * Items added several times must be removed as many times.
+	 */
+
+	for (i = 1; i < cnt; i += 2)
+		cbloom_add(cb, key(keys, i), KEY_SIZE);
+	for (i = 1; i < cnt; i += 2)
+		cbloom_remove(cb, key(keys, i), KEY_SIZE);
+
+	for (i = 1; i < cnt; i += 2) {
+		if (!cbloom_contains(cb, key(keys, i), KEY_SIZE))
+			test_abort("false negative after duplicate remove");
+	}
+
+	for (i = 1; i < cnt; i += 2)
+		cbloom_remove(cb, key(keys, i), KEY_SIZE);
+
+	if (0 != cbloom_count(cb))
+		test_abort("count after removing all");
+
+	if (0 != found_percentage(cb, keys, 0, 2 * cnt))
+		test_abort("keys found in empty filter");
+
+	cbloom_free_null(&cb);
+
+	if (cb != NULL)
+		test_abort("free");
+}
+
+/*
+ * Saturate the counters of a key, make sure removing it as many times as it
+ * was added does not cause false negatives for the other keys, and that the
+ * saturated counters stick.
+ */
+static void
+test_saturation(const char *keys, size_t cnt)
+{
+	cbloom_t *cb = cbloom_make(cnt);
+	size_t i;
+
+	for (i = 0; i < SATURATE; i++)
+		cbloom_add(cb, key(keys, 0), KEY_SIZE);
+
+	for (i = 1; i < cnt; i++)
+		cbloom_add(cb, key(keys, i), KEY_SIZE);
+
+	for (i = 0; i < SATURATE; i++)
+		cbloom_remove(cb, key(keys, 0), KEY_SIZE);
+
+	if (cbloom_count(cb) != cnt - 1)
+		test_abort("count after saturation");
+
+	if (!cbloom_contains(cb, key(keys, 0), KEY_SIZE))
+		test_abort("saturated counters released");
+
+	assert_contains(cb, keys, 1, cnt, "false negative after saturation");
+
+	cbloom_free_null(&cb);
+
+	/*
+	 * Overload a filter sized for a single item: most counters are shared,
+	 * and many saturate.  Removing half of the keys must keep all the
+	 * others.
+	 */
+
+	cb = cbloom_make(1);
+
+	for (i = 0; i < cnt; i++)
+		cbloom_add(cb, key(keys, i), KEY_SIZE);
+
+	for (i = 0; i < cnt; i += 2)
+		cbloom_remove(cb, key(keys, i), KEY_SIZE);
+
+	for (i = 1; i < cnt; i += 2) {
+		if (!cbloom_contains(cb, key(keys, i), KEY_SIZE))
+			test_abort("false negative in overloaded filter");
+	}
+
+	cbloom_clear(cb);
+
+	if (0 != cbloom_count(cb) || 0 != found_percentage(cb, keys, 0, cnt))
+		test_abort("clear");
+
+	cbloom_free_null(&cb);
+}
+
+static void
+run_lookups(const char *keys, size_t cnt, size_t loops)
+{
+	cbloom_t *cb = cbloom_make(cnt);
+	size_t i;
+
+	for (i = 0; i < cnt; i++)
+		cbloom_add(cb, key(keys, i), KEY_SIZE);
+
+	while (loops-- != 0) {
+		for (i = 0; i < 2 * cnt; i++)
+			(void) cbloom_contains(cb, key(keys, i), KEY_SIZE);
+	}
+
+	cbloom_free_null(&cb);
+}
+
+static void
+test(size_t cnt, bool chrono, size_t loops)
+{
+	char *keys = generate_keys(2 * cnt);
+	char buf[80];
+
+	str_bprintf(buf, sizeof buf, "%zu items", cnt);
+	current_test = buf;
+
+	test_add_remove(keys, cnt);
+	test_saturation(keys, cnt);
+
+	if (chrono) {
+		tm_t start, end;
+		double ustart, uend;
+
+		tm_now_exact(&start);
+		tm_cputime(&ustart, NULL);
+		run_lookups(keys, cnt, loops);
+		tm_cputime(&uend, NULL);
+		tm_now_exact(&end);
+
+		printf("%s - [%zu] time=%.3gs, CPU=%.3gs\n", buf, loops,
+			tm_elapsed_f(&end, &start), uend - ustart);
+	} else if (!silent_mode) {
+		printf("%s - OK\n", buf);
+	}
+	fflush(stdout);
+
+	current_test = NULL;
+	xfree(keys);
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	bool tflag = FALSE;
+	size_t count = 0;
+	size_t loops = 0;
+	size_t main_loops = 1;
+	size_t main_count = 0;
+	bool multiple_loops = FALSE;
+	int c;
+	size_t i;
+	unsigned rseed = 0;
+
+	mingw_early_init();
+	progname = filepath_basename(argv[0]);
+
+	while ((c = getopt(argc, argv, "c:hn:tN:R:S")) != EOF) {
+		switch (c) {
+		case 'c':			/* amount of items to use */
+			count = atol(optarg);
+			break;
+		case 't':			/* timing report */
+			tflag++;
+			break;
+		case 'n':			/* amount of loops */
+			loops = atol(optarg);
+			break;
+		case 'N':			/* number of main loops */
+			main_loops = atol(optarg);
+			break;
+		case 'R':			/* randomize in a repeatable way */
+			rseed = atoi(optarg);
+			break;
+		case 'S':			/* silent mode */
+			silent_mode = TRUE;
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 0)
+		usage();
+
+	if (silent_mode && tflag) {
+		fprintf(stderr, "%s: -S has little effect when -t is present\n",
+			progname);
+	}
+
+	if (0 == loops)
+		loops = tflag ? 100 : 1;
+
+	rand31_set_seed(rseed);
+	multiple_loops = main_loops > 1;
+
+	while (main_loops--) {
+		initial_seed = rand31_current_seed();
+		main_count++;
+
+		if (multiple_loops) {
+			printf("test loop #%lu (%lu more) with seed %u\n",
+				(ulong) main_count, (ulong) main_loops, initial_seed);
+		}
+
+		for (i = 4; i <= TEST_BITS; i += 2) {
+			size_t cnt = count != 0 ? count : 1U << i;
+
+			test(cnt, tflag, loops);
+
+			if (count != 0)
+				break;
+		}
+	}
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Counting Bloom filters.
+ *
+ * A Bloom filter answers set membership queries in constant time and space,
+ * without holding the items: a negative answer is always right, a positive
+ * answer is wrong with a small probability.  It is meant to be consulted
+ * before an expensive lookup, when most of the lookups are going to fail.
+ *
+ * Each item sets CBLOOM_HASHES counters, whose indices are derived by double
+ * hashing, and the item may be present if all its counters are non-zero.
+ * Using counters instead of bits allows items to be removed.  A counter that
+ * reaches its maximum value sticks there, so that removals never cause false
+ * negatives.
+ *
+ * The filter is sized for a given amount of items, with CBLOOM_RATIO counters
+ * per item, yielding a false positive rate around 1% at full capacity.  The
+ * rate degrades gracefully as more items are held: it is up to the user to
+ * rebuild a larger filter when cbloom_count() exceeds cbloom_capacity().
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "cbloom.h"
+#include "halloc.h"
+#include "hashing.h"
+#include "pow2.h"
+#include "walloc.h"
+
+#include "override.h"			/* Must be the last header included */
+
+#define CBLOOM_HASHES	4		/**< Amount of counters set per item */
+#define CBLOOM_RATIO	10		/**< Amount of counters per item */
+#define CBLOOM_MIN		1024	/**< Minimum amount of counters */
+
+enum cbloom_magic { CBLOOM_MAGIC = 0x3a5f09c2 };
+
+/**
+ * A counting Bloom filter.
+ */
+struct cbloom {
+	enum cbloom_magic magic;
+	uint8 *counters;		/**< The counters */
+	size_t mask;			/**< Amount of counters - 1 (power of 2) */
+	size_t capacity;		/**< Amount of items filter was sized for */
+	size_t count;			/**< Amount of items held */
+};
+
+static inline void
+cbloom_check(const struct cbloom * const cb)
+{
+	g_assert(cb != NULL);
+	g_assert(CBLOOM_MAGIC == cb->magic);
+}
+
+/**
+ * Compute the indices of the counters of an item.
+ */
+static void
+cbloom_indices(const cbloom_t *cb, const void *key, size_t len,
+	size_t idx[CBLOOM_HASHES])
+{
+	unsigned h1, h2;
+	size_t i;
+
+	h1 = binary_hash(key, len);
+	h2 = binary_hash2(key, len) | 1;	/* Odd: visits all the counters */
+
+	for (i = 0; i < CBLOOM_HASHES; i++) {
+		idx[i] = h1 & cb->mask;
+		h1 += h2;
+	}
+}
+
+/**
+ * Create a new counting Bloom filter.
+ *
+ * @param capacity		the expected amount of items
+ *
+ * @return a new filter, which must be freed with cbloom_free_null().
+ */
+cbloom_t *
+cbloom_make(size_t capacity)
+{
+	cbloom_t *cb;
+	size_t size;
+
+	size = MAX(capacity, 1) * CBLOOM_RATIO;
+	size = MAX(size, CBLOOM_MIN);
+	size = next_pow2(MIN(size, 1U << 31));
+
+	WALLOC0(cb);
+	cb->magic = CBLOOM_MAGIC;
+	cb->counters = halloc0(size);
+	cb->mask = size - 1;
+	cb->capacity = size / CBLOOM_RATIO;
+
+	return cb;
+}
+
+/**
+ * Free counting Bloom filter and nullify its pointer.
+ */
+void
+cbloom_free_null(cbloom_t **cb_ptr)
+{
+	cbloom_t *cb = *cb_ptr;
+
+	if (cb != NULL) {
+		cbloom_check(cb);
+		HFREE_NULL(cb->counters);
+		cb->magic = 0;
+		WFREE(cb);
+		*cb_ptr = NULL;
+	}
+}
+
+/**
+ * Add item to the filter.
+ *
+ * The same item may be added several times, in which case it must be
+ * removed as many times.
+ */
+void
+cbloom_add(cbloom_t *cb, const void *key, size_t len)
+{
+	size_t idx[CBLOOM_HASHES];
+	size_t i;
+
+	cbloom_check(cb);
+
+	cbloom_indices(cb, key, len, idx);
+
+	for (i = 0; i < CBLOOM_HASHES; i++) {
+		uint8 *c = &cb->counters[idx[i]];
+
+		if G_LIKELY(*c != MAX_INT_VAL(uint8))
+			(*c)++;
+	}
+
+	cb->count++;
+}
+
+/**
+ * Remove item from the filter.
+ *
+ * The item must have been previously added.
+ */
+void
+cbloom_remove(cbloom_t *cb, const void *key, size_t len)
+{
+	size_t idx[CBLOOM_HASHES];
+	size_t i;
+
+	cbloom_check(cb);
+	g_assert(cb->count != 0);
+
+	cbloom_indices(cb, key, len, idx);
+
+	for (i = 0; i < CBLOOM_HASHES; i++) {
+		uint8 *c = &cb->counters[idx[i]];
+
+		g_assert(*c != 0);		/* Item was added */
+
+		if G_LIKELY(*c != MAX_INT_VAL(uint8))
+			(*c)--;
+	}
+
+	cb->count--;
+}
+
+/**
+ * Check whether item may be held in the filter.
+ *
+ * @return FALSE if the item is certainly not held, TRUE if it may be.
+ */
+bool
+cbloom_contains(const cbloom_t *cb, const void *key, size_t len)
+{
+	size_t idx[CBLOOM_HASHES];
+	size_t i;
+
+	cbloom_check(cb);
+
+	cbloom_indices(cb, key, len, idx);
+
+	for (i = 0; i < CBLOOM_HASHES; i++) {
+		if (0 == cb->counters[idx[i]])
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Remove all the items from the filter.
+ */
+void
+cbloom_clear(cbloom_t *cb)
+{
+	cbloom_check(cb);
+
+	memset(cb->counters, 0, cb->mask + 1);
+	cb->count = 0;
+}
+
+/**
+ * @return amount of items held in the filter.
+ */
+size_t
+cbloom_count(const cbloom_t *cb)
+{
+	cbloom_check(cb);
+
+	return cb->count;
+}
+
+/**
+ * @return amount of items the filter was sized for.
+ */
+size_t
+cbloom_capacity(const cbloom_t *cb)
+{
+	cbloom_check(cb);
+
+	return cb->capacity;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
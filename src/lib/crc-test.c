@@ -0,0 +1,253 @@
+/*
+ * crc-test -- CRC-32C tests and benchmarking.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This program checks that all the CRC-32C implementations supported by the
+ * CPU compute the same values as the table-driven one, on whole buffers and
+ * when data is fed in pieces, and compares their throughput.
+ */
+
+#include "common.h"
+
+#include "crc.h"
+#include "misc.h"
+#include "path.h"
+#include "rand31.h"
+#include "str.h"
+#include "tm.h"
+#include "xmalloc.h"
+
+#define DEFAULT_SIZE	(64 * 1024)		/* Buffer size */
+#define DEFAULT_CHECKS	1000			/* Amount of random checks */
+
+const char *progname;
+static unsigned initial_seed;
+
+static void G_GNUC_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-ht] [-b size] [-c checks] [-n loops] [-R seed]\n"
+		"  -b : buffer size (default = %u)\n"
+		"  -c : amount of random checks (default = %u)\n"
+		"  -h : prints this help message\n"
+		"  -n : sets amount of loops\n"
+		"  -t : time each implementation\n"
+		"  -R : seed for repeatable random data\n"
+		, progname, DEFAULT_SIZE, DEFAULT_CHECKS);
+	exit(EXIT_FAILURE);
+}
+
+static void G_GNUC_NORETURN
+test_abort(const char *what)
+{
+	printf("%s - FAILED\n", what);
+	printf("use '-R %u' to reproduce problem.\n", initial_seed);
+	abort();
+}
+
+static void
+select_impl(enum crc32c_impl impl)
+{
+	if (!crc32c_impl_select(impl))
+		g_error("cannot select CRC-32C implementation \"%s\"",
+			crc32c_impl_name(impl));
+}
+
+/*
+ * Check the well-known test vector and a few corner cases.
+ */
+static void
+test_vectors(const char *what)
+{
+	static const char check[] = "123456789";
+	uchar zeroes[32], ones[32];
+
+	memset(zeroes, 0, sizeof zeroes);
+	memset(ones, 0xff, sizeof ones);
+
+	if (0xe3069283U != crc32c(check, CONST_STRLEN(check)))
+		test_abort(what);
+	if (0 != crc32c(check, 0))
+		test_abort(what);
+	if (0x8a9136aaU != crc32c(zeroes, sizeof zeroes))
+		test_abort(what);
+	if (0x62a8ab43U != crc32c(ones, sizeof ones))
+		test_abort(what);
+}
+
+/*
+ * Compare CRCs of random slices of the buffer, computed in random pieces,
+ * with the ones computed by the table-driven version.
+ */
+static void
+test_random(const uchar *buf, size_t size, size_t checks, const char *what)
+{
+	enum crc32c_impl impl = crc32c_impl_current();
+	size_t i;
+
+	for (i = 0; i < checks; i++) {
+		size_t start = rand31_value(size - 1);
+		size_t len = rand31_value(size - start);
+		size_t cut = rand31_value(len);
+		uint32 ref, crc;
+
+		select_impl(CRC32C_IMPL_TABLE);
+		ref = crc32c(&buf[start], len);
+		select_impl(impl);
+
+		if (ref != crc32c(&buf[start], len))
+			test_abort(what);
+
+		crc = crc32c_update(0, &buf[start], cut);
+		crc = crc32c_update(crc, &buf[start + cut], len - cut);
+
+		if (ref != crc)
+			test_abort(what);
+	}
+}
+
+static double
+timeit(const uchar *buf, size_t size, size_t loops, uint32 *crc)
+{
+	tm_t start, end;
+	double ustart, uend;
+	size_t i;
+
+	tm_now_exact(&start);
+	tm_cputime(&ustart, NULL);
+	for (i = 0; i < loops; i++)
+		*crc = crc32c_update(*crc, buf, size);
+	tm_cputime(&uend, NULL);
+	tm_now_exact(&end);
+
+	return ustart == uend ? tm_elapsed_f(&end, &start) : uend - ustart;
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	bool tflag = FALSE;
+	size_t size = DEFAULT_SIZE;
+	size_t checks = DEFAULT_CHECKS;
+	size_t loops = 0;
+	unsigned rseed = 0;
+	double ttable = 0.0;
+	uint32 ref = 0;
+	uchar *buf;
+	char what[80];
+	int c, i;
+
+	mingw_early_init();
+	progname = filepath_basename(argv[0]);
+
+	while ((c = getopt(argc, argv, "b:c:hn:tR:")) != EOF) {
+		switch (c) {
+		case 'b':			/* buffer size */
+			size = atol(optarg);
+			break;
+		case 'c':			/* amount of random checks */
+			checks = atol(optarg);
+			break;
+		case 'n':			/* amount of loops */
+			loops = atol(optarg);
+			break;
+		case 't':			/* timing report */
+			tflag = TRUE;
+			break;
+		case 'R':			/* randomize in a repeatable way */
+			rseed = atoi(optarg);
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 0)
+		usage();
+
+	if (size < 2)
+		usage();
+
+	rand31_set_seed(rseed);
+	initial_seed = rand31_current_seed();
+
+	if (0 == loops)
+		loops = tflag ? 1 + (256 * 1024 * 1024) / size : 1;
+
+	buf = xmalloc(size);
+	rand31_bytes(buf, size);
+
+	for (i = 0; i < CRC32C_IMPL_COUNT; i++) {
+		const char *name = crc32c_impl_name(i);
+		uint32 crc = 0;
+		double t;
+
+		if (!crc32c_impl_select(i)) {
+			printf("%s - not supported by CPU\n", name);
+			continue;
+		}
+
+		str_bprintf(what, sizeof what, "%s, %zu bytes", name, size);
+
+		test_vectors(what);
+		test_random(buf, size, checks, what);
+
+		t = timeit(buf, size, loops, &crc);
+
+		if (CRC32C_IMPL_TABLE == i) {
+			ref = crc;
+			ttable = t;
+		} else if (ref != crc) {
+			test_abort(what);
+		}
+
+		if (tflag) {
+			printf("%s - [%zu] %.3gs (%.3g MiB/s), speedup=%.2f\n",
+				what, loops, t,
+				t > 0.0 ? size * loops / t / (1024.0 * 1024.0) : 0.0,
+				t > 0.0 ? ttable / t : 0.0);
+		} else {
+			printf("%s - OK\n", what);
+		}
+	}
+
+	xfree(buf);
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
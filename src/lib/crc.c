@@ -27,6 +27,17 @@
  *
  * CRC computations.
  *
+ * Two families are provided: the historical CRC-32 from Ethernet, used by
+ * some of our on-wire formats and hence frozen, and the CRC-32C from
+ * Castagnoli, which is to be used by any new checksum.
+ *
+ * The CRC-32C can be computed by dedicated instructions on modern x86 CPUs:
+ * the SSE4.2 "crc32" instruction processes 8 bytes at a time, and when the
+ * PCLMULQDQ carry-less multiplication is also available, large buffers are
+ * split in three streams whose CRCs are computed in parallel and combined.
+ * The implementation is selected at runtime, falling back to a table-driven
+ * "slicing-by-8" version.
+ *
  * @author Raphael Manfredi
  * @date 2003
  */
@@ -34,6 +45,19 @@
 #include "common.h"
 
 #include "crc.h"
+#include "unsigned.h"
+
+/*
+ * Hardware versions are only compiled-in on x86_64, where gcc lets us
+ * compile functions for a specific target within a generic compilation.
+ * CPU features are probed with cpuid: __builtin_cpu_supports() does not
+ * know about PCLMUL before gcc 6.
+ */
+#if defined(__x86_64__) && HAS_GCC(4, 9)
+#define CRC32C_HW
+#include <cpuid.h>
+#endif
+
 #include "override.h"		/* Must be the last header included */
 
 /**
@@ -60,6 +84,26 @@
 
 static uint32 crc_table[256];
 
+/**
+ * The CRC-32C polynomial, in its reflected form:
+ * X^32+X^28+X^27+X^26+X^25+X^23+X^22+X^20+X^19+X^18+X^14+X^13+X^11+X^10+X^9
+ * +X^8+X^6+X^0.
+ *
+ * In the reflected form, the coefficient of x^0 is stored in the MSB.
+ */
+#define CRC32C_POLYNOMIAL	0x82f63b78U
+
+#define CRC32C_BLOCK	1024	/**< Stream length in 3-way processing */
+
+static uint32 crc32c_table[8][256];
+
+typedef uint32 (*crc32c_fn_t)(uint32 crc, const void *data, size_t len);
+
+static uint32 crc32c_resolve(uint32 crc, const void *data, size_t len);
+
+static crc32c_fn_t crc32c_fn = crc32c_resolve;
+static enum crc32c_impl crc32c_impl;
+
 /**
  * Generates a 256-word table containing all CRC remainders for every
  * possible 8-bit byte.
@@ -107,6 +151,350 @@ crc32_update(uint32 crc_accum, const void *data, size_t len)
 	return crc_accum;
 }
 
+/**
+ * Generates the tables for the "slicing-by-8" CRC-32C computation.
+ *
+ * Entry i in table k is the CRC of byte i followed by k zero bytes.
+ */
+static void
+crc32c_gen_crc_table(void)
+{
+	uint32 i, crc_accum;
+	int k;
+
+	for (i = 0; i < 256; i++) {
+		int j;
+
+		crc_accum = i;
+		for (j = 0; j < 8; j++) {
+			if (crc_accum & 1)
+				crc_accum = (crc_accum >> 1) ^ CRC32C_POLYNOMIAL;
+			else
+				crc_accum = (crc_accum >> 1);
+		}
+		crc32c_table[0][i] = crc_accum;
+	}
+
+	for (k = 1; k < 8; k++) {
+		for (i = 0; i < 256; i++) {
+			crc_accum = crc32c_table[k - 1][i];
+			crc32c_table[k][i] =
+				(crc_accum >> 8) ^ crc32c_table[0][crc_accum & 0xff];
+		}
+	}
+}
+
+/**
+ * Update the CRC-32C register on the data block, using tables.
+ *
+ * The computation is independent from the endianness of the CPU.
+ */
+static G_GNUC_HOT uint32
+crc32c_sw(uint32 crc, const void *data, size_t len)
+{
+	const uchar *p = data;
+
+	while (len >= 8) {
+		crc ^= p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32) p[3] << 24);
+		crc =
+			crc32c_table[7][crc & 0xff] ^
+			crc32c_table[6][(crc >> 8) & 0xff] ^
+			crc32c_table[5][(crc >> 16) & 0xff] ^
+			crc32c_table[4][crc >> 24] ^
+			crc32c_table[3][p[4]] ^
+			crc32c_table[2][p[5]] ^
+			crc32c_table[1][p[6]] ^
+			crc32c_table[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+
+	while (len-- != 0)
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+
+	return crc;
+}
+
+#ifdef CRC32C_HW
+
+typedef long long crc_v2di __attribute__((vector_size(16)));
+
+/**
+ * Constants for combining the 3 streams, computed at initialization time.
+ */
+static uint32 crc32c_k1, crc32c_k2;
+
+/**
+ * Compute x^n mod P, in the reflected representation.
+ */
+static uint32
+crc32c_xpow(size_t n)
+{
+	uint32 r = 0x80000000U;		/* x^0 */
+
+	while (n-- != 0)
+		r = (r & 1) ? (r >> 1) ^ CRC32C_POLYNOMIAL : r >> 1;
+
+	return r;
+}
+
+/**
+ * Update the CRC-32C register on the data block, using the SSE4.2 "crc32"
+ * instruction.
+ */
+static G_GNUC_HOT uint32 __attribute__((target("sse4.2")))
+crc32c_sse42(uint32 crc, const void *data, size_t len)
+{
+	const uchar *p = data;
+	uint64 c = crc;
+
+	while (len != 0 && 0 != ((uintptr_t) p & 7)) {
+		c = __builtin_ia32_crc32qi(c, *p++);
+		len--;
+	}
+
+	while (len >= 8) {
+		c = __builtin_ia32_crc32di(c, *(const uint64 *) p);
+		p += 8;
+		len -= 8;
+	}
+
+	while (len-- != 0)
+		c = __builtin_ia32_crc32qi(c, *p++);
+
+	return c;
+}
+
+/**
+ * Shift the CRC register by the amount of bits corresponding to constant k,
+ * which must be x^(n-33) mod P to shift by n bits.
+ *
+ * The carry-less product of the register and k is x^(-32) * crc * x^n, and
+ * the "crc32" instruction on that 64-bit value multiplies it by x^32 whilst
+ * reducing it modulo P.
+ */
+static inline uint32 __attribute__((target("sse4.2,pclmul")))
+crc32c_shift(uint32 crc, uint32 k)
+{
+	crc_v2di a = { crc, 0 }, b = { k, 0 };
+	crc_v2di r;
+
+	r = __builtin_ia32_pclmulqdq128(a, b, 0x00);
+	return __builtin_ia32_crc32di(0, r[0]);
+}
+
+/**
+ * Update the CRC-32C register on the data block, processing 3 streams at
+ * once with the SSE4.2 "crc32" instruction to hide its latency, the CRCs
+ * of the streams being combined using PCLMULQDQ.
+ */
+static G_GNUC_HOT uint32 __attribute__((target("sse4.2,pclmul")))
+crc32c_clmul(uint32 crc, const void *data, size_t len)
+{
+	const uchar *p = data;
+	uint64 c = crc;
+
+	while (len != 0 && 0 != ((uintptr_t) p & 7)) {
+		c = __builtin_ia32_crc32qi(c, *p++);
+		len--;
+	}
+
+	while (len >= 3 * CRC32C_BLOCK) {
+		const uint64 *a = (const uint64 *) p;
+		const uint64 *b = (const uint64 *) (p + CRC32C_BLOCK);
+		const uint64 *e = (const uint64 *) (p + 2 * CRC32C_BLOCK);
+		uint64 cb = 0, ce = 0;
+		size_t i;
+
+		for (i = 0; i < CRC32C_BLOCK / 8; i++) {
+			c = __builtin_ia32_crc32di(c, a[i]);
+			cb = __builtin_ia32_crc32di(cb, b[i]);
+			ce = __builtin_ia32_crc32di(ce, e[i]);
+		}
+
+		c = crc32c_shift(c, crc32c_k1) ^ crc32c_shift(cb, crc32c_k2) ^ ce;
+		p += 3 * CRC32C_BLOCK;
+		len -= 3 * CRC32C_BLOCK;
+	}
+
+	while (len >= 8) {
+		c = __builtin_ia32_crc32di(c, *(const uint64 *) p);
+		p += 8;
+		len -= 8;
+	}
+
+	while (len-- != 0)
+		c = __builtin_ia32_crc32qi(c, *p++);
+
+	return c;
+}
+
+/**
+ * Does the CPU support the feature flagged by ``bit'' in the ECX register
+ * returned by cpuid leaf 1?
+ */
+static bool
+crc32c_cpu_has(unsigned bit)
+{
+	unsigned eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return FALSE;
+
+	return 0 != (ecx & bit);
+}
+
+#endif	/* CRC32C_HW */
+
+/**
+ * Is the CRC-32C implementation usable on this CPU?
+ */
+static bool
+crc32c_impl_supported(enum crc32c_impl impl)
+{
+	switch (impl) {
+	case CRC32C_IMPL_TABLE:
+		return TRUE;
+#ifdef CRC32C_HW
+	case CRC32C_IMPL_SSE42:
+		return crc32c_cpu_has(bit_SSE4_2);
+	case CRC32C_IMPL_CLMUL:
+		return crc32c_cpu_has(bit_SSE4_2) && crc32c_cpu_has(bit_PCLMUL);
+#else
+	case CRC32C_IMPL_SSE42:
+	case CRC32C_IMPL_CLMUL:
+		return FALSE;
+#endif
+	case CRC32C_IMPL_COUNT:
+		break;
+	}
+
+	g_assert_not_reached();
+	return FALSE;
+}
+
+/**
+ * Select the CRC-32C implementation to use.
+ *
+ * This is normally done automatically, picking the fastest implementation
+ * supported by the CPU, and is meant to be used for testing.
+ *
+ * @return TRUE if the implementation was selected, FALSE if not supported.
+ */
+bool
+crc32c_impl_select(enum crc32c_impl impl)
+{
+	g_assert(UNSIGNED(impl) < CRC32C_IMPL_COUNT);
+
+	crc_init();
+
+	if (!crc32c_impl_supported(impl))
+		return FALSE;
+
+	switch (impl) {
+	case CRC32C_IMPL_TABLE:
+		crc32c_fn = crc32c_sw;
+		break;
+#ifdef CRC32C_HW
+	case CRC32C_IMPL_SSE42:
+		crc32c_fn = crc32c_sse42;
+		break;
+	case CRC32C_IMPL_CLMUL:
+		crc32c_fn = crc32c_clmul;
+		break;
+#endif
+	default:
+		g_assert_not_reached();
+	}
+
+	crc32c_impl = impl;
+	return TRUE;
+}
+
+/**
+ * @return the CRC-32C implementation being used.
+ */
+enum crc32c_impl
+crc32c_impl_current(void)
+{
+	crc_init();
+	return crc32c_impl;
+}
+
+/**
+ * @return the name of the CRC-32C implementation.
+ */
+const char *
+crc32c_impl_name(enum crc32c_impl impl)
+{
+	switch (impl) {
+	case CRC32C_IMPL_TABLE:		return "table";
+	case CRC32C_IMPL_SSE42:		return "sse4.2";
+	case CRC32C_IMPL_CLMUL:		return "sse4.2+pclmul";
+	case CRC32C_IMPL_COUNT:		break;
+	}
+
+	return "unknown";
+}
+
+/**
+ * Select the fastest CRC-32C implementation supported by the CPU.
+ */
+static void
+crc32c_impl_init(void)
+{
+	int i;
+
+#ifdef CRC32C_HW
+	crc32c_k1 = crc32c_xpow(8 * 2 * CRC32C_BLOCK - 33);
+	crc32c_k2 = crc32c_xpow(8 * CRC32C_BLOCK - 33);
+#endif
+
+	for (i = CRC32C_IMPL_COUNT - 1; i >= 0; i--) {
+		if (crc32c_impl_select(i))
+			break;
+	}
+}
+
+/**
+ * Computes the CRC-32C on first invocation, when the implementation has not
+ * been selected yet.
+ */
+static uint32
+crc32c_resolve(uint32 crc, const void *data, size_t len)
+{
+	crc_init();
+	return (*crc32c_fn)(crc, data, len);
+}
+
+/**
+ * Update the CRC-32C on the data block.
+ *
+ * This can be used to compute the CRC-32C of data coming in pieces: the
+ * CRC of the concatenation of two blocks is that of the second block,
+ * computed with the CRC of the first block as the starting value.
+ *
+ * @param crc		the CRC of the previous data, 0 initially
+ * @param data		the input data for CRC-32C calculation
+ * @param len		the length of the data
+ *
+ * @return the CRC-32C of all the data seen so far.
+ */
+uint32
+crc32c_update(uint32 crc, const void *data, size_t len)
+{
+	return ~(*crc32c_fn)(~crc, data, len);
+}
+
+/**
+ * @return the CRC-32C of the data block.
+ */
+uint32
+crc32c(const void *data, size_t len)
+{
+	return crc32c_update(0, data, len);
+}
+
 /**
  * Initialize the CRC computations.
  */
@@ -120,6 +508,8 @@ crc_init(void)
 
 	done = TRUE;
 	crc32_gen_crc_table();
+	crc32c_gen_crc_table();
+	crc32c_impl_init();
 }
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -36,9 +36,27 @@
 
 #include "common.h"
 
+/**
+ * CRC-32C implementations.
+ */
+enum crc32c_impl {
+	CRC32C_IMPL_TABLE = 0,		/**< Table-driven, always available */
+	CRC32C_IMPL_SSE42,			/**< SSE4.2 "crc32" instruction */
+	CRC32C_IMPL_CLMUL,			/**< SSE4.2 with PCLMULQDQ, 3 streams */
+
+	CRC32C_IMPL_COUNT
+};
+
 void crc_init(void);
 uint32 crc32_update(uint32 crc_accum, const void *data, size_t len);
 
+uint32 crc32c_update(uint32 crc, const void *data, size_t len);
+uint32 crc32c(const void *data, size_t len);
+
+bool crc32c_impl_select(enum crc32c_impl impl);
+enum crc32c_impl crc32c_impl_current(void);
+const char *crc32c_impl_name(enum crc32c_impl impl) G_GNUC_CONST;
+
 #endif	/* _crc_h_ */
 
 /* vi: set ts=4 sw=4 cindent: */
@@ -397,4 +397,19 @@ dbstore_move(const char *src, const char *dst, const char *base)
 	HFREE_NULL(new_path);
 }
 
+/**
+ * Remove SDBM files from "dir", for databases no longer kept as SDBM.
+ *
+ * @param dir				the directory where SDBM files are
+ * @param base				the base name of SDBM files
+ */
+void
+dbstore_unlink_sdbm(const char *dir, const char *base)
+{
+	char *path = make_pathname(dir, base);
+
+	dbmap_unlink_sdbm(path);
+	HFREE_NULL(path);
+}
+
 /* vi: set ts=4 sw=4 cindent: */
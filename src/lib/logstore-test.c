@@ -0,0 +1,379 @@
+/*
+ * logstore-test -- log-structured record store tests and benchmarking.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This program replays a synthetic stream of record updates, deletions and
+ * lookups, as done by the DHT value storage when nodes republish values,
+ * checking the log-structured store returns the expected records at all
+ * times, including whilst segments are being compacted.
+ */
+
+#include "common.h"
+
+#include "logstore.h"
+#include "misc.h"
+#include "path.h"
+#include "rand31.h"
+#include "str.h"
+#include "tm.h"
+#include "xmalloc.h"
+
+#define DEFAULT_OPS		200000		/* Amount of operations replayed */
+#define DEFAULT_KEYS	20000		/* Amount of distinct keys */
+#define DEFAULT_LIFE	3600		/* Record lifetime, in seconds */
+#define MAX_LEN			512			/* Max record length */
+#define COMPACT_EVERY	1000		/* Compaction period, in operations */
+#define COMPACT_BUDGET	(256 * 1024)	/* Bytes scanned per compaction */
+
+const char *progname;
+static unsigned initial_seed;
+static const char *dir = ".";
+static bool incore;
+
+enum op_type { OP_WRITE, OP_DELETE, OP_READ };
+
+/*
+ * An operation, as replayed.
+ */
+struct op {
+	enum op_type type;
+	uint32 key;
+	uint16 len;					/* For writes */
+	uint32 version;				/* Record version, for writes */
+	time_t expire;				/* For writes */
+};
+
+/*
+ * Expected state of each key.
+ */
+struct state {
+	uint32 version;
+	uint16 len;
+	bool present;
+};
+
+static void G_GNUC_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-hmt] [-d dir] [-k keys] [-l life] [-n loops]\n"
+		"       [-o ops] [-R seed]\n"
+		"  -d : directory where files are created (default = %s)\n"
+		"  -h : prints this help message\n"
+		"  -k : amount of distinct keys (default = %u)\n"
+		"  -l : lifetime of records in seconds (default = %u)\n"
+		"  -m : keep stores in memory\n"
+		"  -n : sets amount of loops\n"
+		"  -o : amount of operations (default = %u)\n"
+		"  -t : time each test\n"
+		"  -R : seed for repeatable random operation sequence\n"
+		, progname, dir, DEFAULT_KEYS, DEFAULT_LIFE, DEFAULT_OPS);
+	exit(EXIT_FAILURE);
+}
+
+static void G_GNUC_NORETURN
+test_abort(const char *what)
+{
+	printf("%s - FAILED\n", what);
+	printf("use '-R %u' to reproduce problem.\n", initial_seed);
+	abort();
+}
+
+static void
+fill_data(char *buf, uint32 key, uint32 version, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = (key * 31 + version * 7 + i) & 0xff;
+}
+
+/*
+ * Mostly writes, as values are republished and replicated much more often
+ * than they are requested, with some deletions.
+ */
+static struct op *
+generate_ops(size_t count, size_t keys, uint life)
+{
+	struct op *ops;
+	time_t now = tm_time();
+	size_t i;
+
+	ops = xmalloc(count * sizeof ops[0]);
+
+	for (i = 0; i < count; i++) {
+		uint r = rand31_value(99);
+		struct op *o = &ops[i];
+
+		o->key = rand31_value(keys - 1);
+
+		if (r < 60) {
+			o->type = OP_WRITE;
+			o->len = 1 + rand31_value(MAX_LEN - 1);
+			o->version = i;
+			o->expire = now + life + life * i / count;
+		} else if (r < 70) {
+			o->type = OP_DELETE;
+		} else {
+			o->type = OP_READ;
+		}
+	}
+
+	return ops;
+}
+
+static void
+check_read(const struct state *st, const void *data, size_t len,
+	uint32 key, const char *what)
+{
+	char buf[MAX_LEN];
+
+	if (!st->present) {
+		if (data != NULL)
+			test_abort(what);
+		return;
+	}
+
+	if (NULL == data || len != st->len)
+		test_abort(what);
+
+	fill_data(buf, key, st->version, len);
+
+	if (0 != memcmp(buf, data, len))
+		test_abort(what);
+}
+
+static void
+run_logstore(const struct op *ops, size_t count, size_t keys, size_t loops)
+{
+	const char *what = "logstore";
+	char buf[MAX_LEN];
+
+	while (loops-- != 0) {
+		struct state *st = xmalloc0(keys * sizeof st[0]);
+		logstore_info_t info;
+		logstore_t *ls;
+		size_t i, n = 0;
+
+		ls = logstore_create(what, dir, "logstore-test", MAX_LEN, incore);
+
+		for (i = 0; i < count; i++) {
+			const struct op *o = &ops[i];
+			struct state *s = &st[o->key];
+			size_t len;
+			void *data;
+
+			switch (o->type) {
+			case OP_WRITE:
+				fill_data(buf, o->key, o->version, o->len);
+				if (!logstore_write(ls, o->key, buf, o->len, o->expire))
+					test_abort(what);
+				n += !s->present;
+				s->present = TRUE;
+				s->len = o->len;
+				s->version = o->version;
+				break;
+			case OP_DELETE:
+				if (s->present != logstore_delete(ls, o->key))
+					test_abort(what);
+				n -= s->present;
+				s->present = FALSE;
+				break;
+			case OP_READ:
+				data = logstore_read(ls, o->key, &len);
+				check_read(s, data, len, o->key, what);
+				break;
+			}
+
+			if (0 == i % COMPACT_EVERY)
+				logstore_compact(ls, COMPACT_BUDGET);
+		}
+
+		if (n != logstore_count(ls))
+			test_abort(what);
+
+		/*
+		 * Complete any pending compaction before checking all the records
+		 * can still be read back.
+		 */
+
+		while (0 != logstore_compact(ls, COMPACT_BUDGET))
+			continue;
+
+		for (i = 0; i < keys; i++) {
+			size_t len;
+			void *data = logstore_read(ls, i, &len);
+			check_read(&st[i], data, len, i, what);
+		}
+
+		logstore_info(ls, &info);
+
+		if (info.count != n || info.live > info.size)
+			test_abort(what);
+
+		/*
+		 * Deleting all the records discards all the segments.
+		 */
+
+		for (i = 0; i < keys; i++) {
+			if (st[i].present && !logstore_delete(ls, i))
+				test_abort(what);
+		}
+
+		logstore_info(ls, &info);
+
+		if (0 != info.count || 0 != info.segments)
+			test_abort(what);
+
+		logstore_free_null(&ls);
+		xfree(st);
+	}
+}
+
+static double
+timeit(void (*f)(const struct op *, size_t, size_t, size_t),
+	const struct op *ops, size_t count, size_t keys, size_t loops)
+{
+	tm_t start, end;
+
+	/*
+	 * We're measuring I/O as well, hence we use the wall-clock time.
+	 */
+
+	tm_now_exact(&start);
+	(*f)(ops, count, keys, loops);
+	tm_now_exact(&end);
+
+	return tm_elapsed_f(&end, &start);
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	bool tflag = FALSE;
+	size_t count = DEFAULT_OPS;
+	size_t keys = DEFAULT_KEYS;
+	uint life = DEFAULT_LIFE;
+	size_t loops = 0;
+	unsigned rseed = 0;
+	struct op *ops;
+	double tlog;
+	char what[80];
+	int c;
+
+	mingw_early_init();
+	progname = filepath_basename(argv[0]);
+
+	while ((c = getopt(argc, argv, "d:hk:l:mn:o:tR:")) != EOF) {
+		switch (c) {
+		case 'd':			/* directory for files */
+			dir = optarg;
+			break;
+		case 'k':			/* amount of keys */
+			keys = atol(optarg);
+			break;
+		case 'l':			/* record lifetime */
+			life = atoi(optarg);
+			break;
+		case 'm':			/* in-core stores */
+			incore = TRUE;
+			break;
+		case 'n':			/* amount of loops */
+			loops = atol(optarg);
+			break;
+		case 'o':			/* amount of operations */
+			count = atol(optarg);
+			break;
+		case 't':			/* timing report */
+			tflag = TRUE;
+			break;
+		case 'R':			/* randomize in a repeatable way */
+			rseed = atoi(optarg);
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 0)
+		usage();
+
+	if (keys < 2 || 0 == count || 0 == life)
+		usage();
+
+	/*
+	 * Files can only be opened through absolute paths.
+	 */
+
+	if (!incore && !is_absolute_path(dir)) {
+		static char path[MAX_PATH_LEN];
+		char cwd[MAX_PATH_LEN];
+
+		if (NULL == getcwd(cwd, sizeof cwd)) {
+			fprintf(stderr, "%s: getcwd() failed: %s\n",
+				progname, g_strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		str_bprintf(path, sizeof path, "%s/%s", cwd, dir);
+		dir = path;
+	}
+
+	rand31_set_seed(rseed);
+	initial_seed = rand31_current_seed();
+
+	if (0 == loops)
+		loops = tflag ? 3 : 1;
+
+	ops = generate_ops(count, keys, life);
+
+	str_bprintf(what, sizeof what, "%zu operations on %zu keys%s",
+		count, keys, incore ? " in core" : "");
+
+	tlog = timeit(run_logstore, ops, count, keys, loops);
+
+	if (tflag) {
+		printf("%s - [%zu] %.3gs (%.3g op/s)\n",
+			what, loops, tlog, tlog > 0.0 ? count * loops / tlog : 0.0);
+	} else {
+		printf("%s - OK\n", what);
+	}
+
+	xfree(ops);
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
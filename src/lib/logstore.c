@@ -0,0 +1,759 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Log-structured record stores.
+ *
+ * A log store holds variable-sized records, indexed by a 64-bit key, in
+ * append-only segments.  Writing a record always appends it at the end of
+ * a segment, the previous version of the record becoming dead space: there
+ * are no random writes, no page splits and no write-back cache to manage.
+ * Only the index, locating the latest version of each record, is kept in
+ * memory.
+ *
+ * Records are written along with their expiration time and segments only
+ * hold records expiring within the same time window.  Therefore, when
+ * expired records are deleted, whole segments become empty and are simply
+ * discarded, without having to reclaim space record by record.
+ *
+ * Segments that are mostly made of dead records and which are not going to
+ * expire soon are compacted incrementally, through logstore_compact(): their
+ * live records are copied at the end of the log, after which the segment is
+ * empty and discarded.
+ *
+ * Stores are transient: segments are created afresh and removed when the
+ * store is freed.  They are kept in memory when requested, or when their
+ * file cannot be created.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "logstore.h"
+#include "compat_pio.h"
+#include "elist.h"
+#include "endian.h"
+#include "fd.h"
+#include "file.h"
+#include "halloc.h"
+#include "hikset.h"
+#include "htable.h"
+#include "path.h"
+#include "tm.h"
+#include "walloc.h"
+
+#include "override.h"			/* Must be the last header included */
+
+#define LOGSTORE_SEG_SIZE	(4 * 1024 * 1024)	/**< Maximum segment size */
+#define LOGSTORE_MEM_INIT	(64 * 1024)		/**< Initial in-core segment size */
+#define LOGSTORE_WINDOW		600		/**< Expiration window of a segment (secs) */
+#define LOGSTORE_HDR_SIZE	12		/**< Record header: key + data length */
+#define LOGSTORE_DEAD_PCT	50		/**< Compact when more dead than that */
+
+enum logstore_magic { LOGSTORE_MAGIC = 0x4c07a3e1 };
+
+/**
+ * A segment of the log.
+ */
+struct logseg {
+	char *mem;				/**< In-core arena, NULL if held on disk */
+	int fd;					/**< Segment file, -1 if held in core */
+	uint32 id;				/**< Segment number, suffix of file name */
+	uint32 size;			/**< Bytes written to the segment */
+	uint32 capacity;		/**< Size of in-core arena */
+	uint32 live;			/**< Bytes used by live records */
+	uint32 records;			/**< Amount of live records */
+	uint window;			/**< Expiration window of records */
+	time_t expire;			/**< Latest expiration time of records */
+	bool sealed;			/**< Whether segment no longer receives writes */
+	link_t lk;				/**< Links segments together */
+};
+
+/**
+ * Index entry, locating the latest version of a record.
+ */
+struct logrec {
+	const uint64 *kptr;		/**< Points to key, for the index (embedded key) */
+	uint64 key;				/**< The record key */
+	struct logseg *seg;		/**< Segment holding the record */
+	uint32 offset;			/**< Offset of record header in segment */
+	uint32 len;				/**< Length of record data */
+};
+
+/**
+ * A log-structured store.
+ */
+struct logstore {
+	enum logstore_magic magic;
+	char *name;				/**< Store name, for logs */
+	char *path;				/**< Base path of segment files, NULL if in core */
+	hikset_t *index;		/**< Index of records, by key */
+	htable_t *heads;		/**< Segment receiving writes, by window */
+	elist_t segs;			/**< All the segments, oldest first */
+	struct logseg *victim;	/**< Segment being compacted */
+	uint32 cursor;			/**< Compaction offset in victim */
+	uint32 next_id;			/**< Number of next segment */
+	size_t maxlen;			/**< Maximum record length */
+	char *rbuf;				/**< Read buffer */
+	char *wbuf;				/**< Write buffer */
+	size_t compacted;		/**< Amount of records moved by compaction */
+	size_t dropped;			/**< Amount of segments discarded */
+	bool ioerr;				/**< Whether last operation had an I/O error */
+};
+
+static inline void
+logstore_check(const struct logstore * const ls)
+{
+	g_assert(ls != NULL);
+	g_assert(LOGSTORE_MAGIC == ls->magic);
+}
+
+/**
+ * @return the expiration window of records expiring at specified time.
+ */
+static inline uint
+logstore_window(time_t expire)
+{
+	return expire / LOGSTORE_WINDOW + 1;	/* Never 0, used as hash key */
+}
+
+/**
+ * @return the size taken by a record of given data length in the log.
+ */
+static inline uint32
+logstore_recsize(size_t len)
+{
+	return LOGSTORE_HDR_SIZE + len;
+}
+
+/**
+ * @return the halloc()'ed path of the segment file.
+ */
+static char *
+logseg_path(const logstore_t *ls, const struct logseg *seg)
+{
+	return h_strdup_printf("%s.%u", ls->path, (unsigned) seg->id);
+}
+
+/**
+ * Create a new segment for records expiring within the given window,
+ * which becomes the head segment of that window.
+ */
+static struct logseg *
+logseg_create(logstore_t *ls, uint window)
+{
+	struct logseg *seg;
+
+	WALLOC0(seg);
+	seg->id = ls->next_id++;
+	seg->window = window;
+	seg->fd = -1;
+
+	if (ls->path != NULL) {
+		char *path = logseg_path(ls, seg);
+		seg->fd = file_create(path, O_RDWR | O_TRUNC, S_IRUSR | S_IWUSR);
+		HFREE_NULL(path);
+	}
+
+	if (-1 == seg->fd) {
+		seg->capacity = LOGSTORE_MEM_INIT;
+		seg->mem = halloc(seg->capacity);
+	}
+
+	elist_append(&ls->segs, seg);
+	htable_insert(ls->heads, uint_to_pointer(window), seg);
+
+	return seg;
+}
+
+/**
+ * Discard segment, all its records being dead.
+ */
+static void
+logseg_free(logstore_t *ls, struct logseg *seg)
+{
+	g_assert(0 == seg->records);
+
+	if (!seg->sealed)
+		htable_remove(ls->heads, uint_to_pointer(seg->window));
+
+	if (ls->victim == seg)
+		ls->victim = NULL;
+
+	if (seg->mem != NULL) {
+		HFREE_NULL(seg->mem);
+	} else {
+		char *path = logseg_path(ls, seg);
+
+		fd_forget_and_close(&seg->fd);
+		if (-1 == unlink(path))
+			g_warning("%s(): cannot unlink \"%s\": %m", G_STRFUNC, path);
+		HFREE_NULL(path);
+	}
+
+	elist_remove(&ls->segs, seg);
+	ls->dropped++;
+	WFREE(seg);
+}
+
+/**
+ * Read data from a segment.
+ *
+ * @return TRUE if OK, FALSE on I/O error.
+ */
+static bool
+logseg_read(logstore_t *ls, const struct logseg *seg,
+	uint32 offset, void *buf, size_t len)
+{
+	g_assert(offset + len <= seg->size);
+
+	if (seg->mem != NULL) {
+		memcpy(buf, &seg->mem[offset], len);
+		return TRUE;
+	}
+
+	if ((ssize_t) len != compat_pread(seg->fd, buf, len, offset)) {
+		g_warning("%s(): cannot read %zu bytes at offset %u in \"%s\": %m",
+			G_STRFUNC, len, (unsigned) offset, ls->name);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Append record at the end of a segment.
+ *
+ * @param ls		the log store
+ * @param seg		the segment to append to
+ * @param key		the record key
+ * @param data		the record data
+ * @param len		the length of the record data
+ *
+ * @return TRUE if OK, FALSE on I/O error.
+ */
+static bool
+logseg_append(logstore_t *ls, struct logseg *seg,
+	uint64 key, const void *data, size_t len)
+{
+	uint32 n = logstore_recsize(len);
+	char *p;
+
+	g_assert(!seg->sealed);
+	g_assert(seg->size + n <= LOGSTORE_SEG_SIZE);
+
+	if (seg->mem != NULL) {
+		if (seg->size + n > seg->capacity) {
+			seg->capacity = MIN(2 * seg->capacity, LOGSTORE_SEG_SIZE);
+			seg->mem = hrealloc(seg->mem, seg->capacity);
+		}
+		p = &seg->mem[seg->size];
+	} else {
+		p = ls->wbuf;
+	}
+
+	poke_be64(&p[0], key);
+	poke_be32(&p[8], len);
+	memcpy(&p[LOGSTORE_HDR_SIZE], data, len);
+
+	if (NULL == seg->mem && n != compat_pwrite(seg->fd, p, n, seg->size)) {
+		g_warning("%s(): cannot write %u bytes at offset %u in \"%s\": %m",
+			G_STRFUNC, (unsigned) n, (unsigned) seg->size, ls->name);
+		return FALSE;
+	}
+
+	seg->size += n;
+	return TRUE;
+}
+
+/**
+ * Get the head segment of a window, able to receive a record of given length.
+ */
+static struct logseg *
+logstore_head(logstore_t *ls, uint window, size_t len)
+{
+	struct logseg *seg;
+
+	seg = htable_lookup(ls->heads, uint_to_pointer(window));
+
+	if (seg != NULL && seg->size + logstore_recsize(len) > LOGSTORE_SEG_SIZE) {
+		htable_remove(ls->heads, uint_to_pointer(window));
+		seg->sealed = TRUE;
+		seg = NULL;
+	}
+
+	if (NULL == seg)
+		seg = logseg_create(ls, window);
+
+	return seg;
+}
+
+/**
+ * Account for a live record in its segment.
+ */
+static void
+logrec_attach(struct logrec *rec, struct logseg *seg, uint32 offset,
+	time_t expire)
+{
+	rec->seg = seg;
+	rec->offset = offset;
+	seg->live += logstore_recsize(rec->len);
+	seg->records++;
+	seg->expire = MAX(seg->expire, expire);
+}
+
+/**
+ * A record of given length is no longer live in the segment, which is
+ * discarded when it no longer holds any live record.
+ */
+static void
+logseg_release(logstore_t *ls, struct logseg *seg, uint32 len)
+{
+	g_assert(seg->records != 0);
+	g_assert(seg->live >= logstore_recsize(len));
+
+	seg->live -= logstore_recsize(len);
+	seg->records--;
+
+	if (0 == seg->records)
+		logseg_free(ls, seg);
+}
+
+/**
+ * Create a new log store.
+ *
+ * @param name		the name of the store, for logs
+ * @param dir		the directory where segment files are put
+ * @param base		the base name of segment files
+ * @param maxlen	the maximum length of records
+ * @param incore	if TRUE, keep segments in memory
+ *
+ * @return new log store.
+ */
+logstore_t *
+logstore_create(const char *name, const char *dir, const char *base,
+	size_t maxlen, bool incore)
+{
+	logstore_t *ls;
+
+	g_assert(name != NULL);
+	g_assert(incore || (dir != NULL && base != NULL));
+	g_assert(logstore_recsize(maxlen) <= LOGSTORE_SEG_SIZE);
+
+	WALLOC0(ls);
+	ls->magic = LOGSTORE_MAGIC;
+	ls->name = h_strdup(name);
+	ls->path = incore ? NULL : make_pathname(dir, base);
+	ls->index = hikset_create(
+		offsetof(struct logrec, kptr), HASH_KEY_FIXED, sizeof(uint64));
+	ls->heads = htable_create(HASH_KEY_SELF, 0);
+	elist_init(&ls->segs, offsetof(struct logseg, lk));
+	ls->next_id = 1;
+	ls->maxlen = maxlen;
+	ls->rbuf = halloc(logstore_recsize(maxlen));
+	ls->wbuf = halloc(logstore_recsize(maxlen));
+
+	return ls;
+}
+
+static void
+logstore_free_rec(void *data, void *unused_udata)
+{
+	struct logrec *rec = data;
+
+	(void) unused_udata;
+
+	WFREE(rec);
+}
+
+/**
+ * Free log store, removing all its segments, and nullify its pointer.
+ */
+void
+logstore_free_null(logstore_t **ls_ptr)
+{
+	logstore_t *ls = *ls_ptr;
+	struct logseg *seg;
+
+	if (NULL == ls)
+		return;
+
+	logstore_check(ls);
+
+	hikset_foreach(ls->index, logstore_free_rec, NULL);
+	hikset_free_null(&ls->index);
+
+	while (NULL != (seg = elist_head(&ls->segs))) {
+		seg->records = 0;
+		logseg_free(ls, seg);
+	}
+
+	htable_free_null(&ls->heads);
+	HFREE_NULL(ls->name);
+	HFREE_NULL(ls->path);
+	HFREE_NULL(ls->rbuf);
+	HFREE_NULL(ls->wbuf);
+	ls->magic = 0;
+	WFREE(ls);
+	*ls_ptr = NULL;
+}
+
+/**
+ * Write record, superseding any previous version.
+ *
+ * @param ls		the log store
+ * @param key		the record key
+ * @param data		the record data
+ * @param len		the length of the record data
+ * @param expire	when record expires, to group it with similar records
+ *
+ * @return TRUE if OK, FALSE on I/O error, the previous version being kept.
+ */
+bool
+logstore_write(logstore_t *ls, uint64 key,
+	const void *data, size_t len, time_t expire)
+{
+	struct logrec *rec;
+	struct logseg *seg;
+	uint32 offset;
+
+	logstore_check(ls);
+	g_assert(len <= ls->maxlen);
+	g_assert(data != NULL || 0 == len);
+
+	seg = logstore_head(ls, logstore_window(expire), len);
+	offset = seg->size;
+
+	if (!logseg_append(ls, seg, key, data, len)) {
+		ls->ioerr = TRUE;
+		if (0 == seg->records)
+			logseg_free(ls, seg);
+		return FALSE;
+	}
+
+	ls->ioerr = FALSE;
+	rec = hikset_lookup(ls->index, &key);
+
+	/*
+	 * The new version is accounted for before releasing the previous one
+	 * so that the head segment cannot be discarded when it held the only
+	 * live version of the record.
+	 */
+
+	if (rec != NULL) {
+		struct logseg *old = rec->seg;
+		uint32 oldlen = rec->len;
+
+		rec->len = len;
+		logrec_attach(rec, seg, offset, expire);
+		logseg_release(ls, old, oldlen);
+	} else {
+		WALLOC(rec);
+		rec->key = key;
+		rec->kptr = &rec->key;
+		rec->len = len;
+		logrec_attach(rec, seg, offset, expire);
+		hikset_insert(ls->index, rec);
+	}
+
+	return TRUE;
+}
+
+/**
+ * Read record.
+ *
+ * The returned data is only valid until the next operation on the store.
+ *
+ * @param ls		the log store
+ * @param key		the record key
+ * @param lenptr	if non-NULL, written with the length of the record
+ *
+ * @return the record data, NULL if not found or on I/O error.
+ */
+void *
+logstore_read(logstore_t *ls, uint64 key, size_t *lenptr)
+{
+	const struct logrec *rec;
+	const struct logseg *seg;
+
+	logstore_check(ls);
+
+	ls->ioerr = FALSE;
+	rec = hikset_lookup(ls->index, &key);
+
+	if (NULL == rec)
+		return NULL;
+
+	seg = rec->seg;
+
+	if (lenptr != NULL)
+		*lenptr = rec->len;
+
+	/*
+	 * In-core segments are only reallocated when written to, hence we can
+	 * return a pointer to the record data directly.
+	 */
+
+	if (seg->mem != NULL)
+		return &seg->mem[rec->offset + LOGSTORE_HDR_SIZE];
+
+	if (!logseg_read(ls, seg, rec->offset + LOGSTORE_HDR_SIZE,
+			ls->rbuf, rec->len)) {
+		ls->ioerr = TRUE;
+		return NULL;
+	}
+
+	return ls->rbuf;
+}
+
+/**
+ * @return whether the store holds a record for the key.
+ */
+bool
+logstore_exists(const logstore_t *ls, uint64 key)
+{
+	logstore_check(ls);
+
+	return hikset_contains(ls->index, &key);
+}
+
+/**
+ * Delete record.
+ *
+ * @return TRUE if the record was found and deleted.
+ */
+bool
+logstore_delete(logstore_t *ls, uint64 key)
+{
+	struct logrec *rec;
+
+	logstore_check(ls);
+
+	rec = hikset_lookup(ls->index, &key);
+
+	if (NULL == rec)
+		return FALSE;
+
+	hikset_remove(ls->index, &key);
+	logseg_release(ls, rec->seg, rec->len);
+	WFREE(rec);
+
+	return TRUE;
+}
+
+/**
+ * Select the next segment to compact.
+ *
+ * We only consider sealed segments holding more dead records than the
+ * compaction threshold, and which are not expiring shortly, since their
+ * records are then going to die anyway.  The segment with the most dead
+ * space is chosen.
+ *
+ * @return the segment to compact, NULL if none.
+ */
+static struct logseg *
+logstore_victim(const logstore_t *ls)
+{
+	struct logseg *victim = NULL;
+	uint32 dead = 0;
+	time_t now = tm_time();
+	link_t *lk;
+
+	for (lk = elist_first(&ls->segs); lk != NULL; lk = elist_next(lk)) {
+		struct logseg *seg = elist_data(&ls->segs, lk);
+		uint32 d = seg->size - seg->live;
+
+		if (!seg->sealed)
+			continue;
+
+		if (delta_time(seg->expire, now) < LOGSTORE_WINDOW)
+			continue;
+
+		if ((uint64) d * 100 <= (uint64) seg->size * LOGSTORE_DEAD_PCT)
+			continue;
+
+		if (d > dead) {
+			victim = seg;
+			dead = d;
+		}
+	}
+
+	return victim;
+}
+
+/**
+ * Incrementally compact the store.
+ *
+ * Live records from the segment being compacted are copied at the end of
+ * the log, until the amount of bytes scanned reaches the budget.  The
+ * segment is discarded once all its records have been moved.
+ *
+ * @param ls		the log store
+ * @param budget	amount of bytes we can scan
+ *
+ * @return the amount of bytes scanned.
+ */
+size_t
+logstore_compact(logstore_t *ls, size_t budget)
+{
+	size_t scanned = 0;
+
+	logstore_check(ls);
+
+	if (NULL == ls->victim) {
+		ls->victim = logstore_victim(ls);
+		ls->cursor = 0;
+	}
+
+	while (ls->victim != NULL && scanned < budget) {
+		struct logseg *seg = ls->victim;
+		struct logseg *dest;
+		struct logrec *rec;
+		uint64 key;
+		uint32 len, offset = ls->cursor;
+
+		/*
+		 * The segment is discarded as soon as its last live record is moved,
+		 * so reaching its end means the index is inconsistent.
+		 */
+
+		g_assert(offset < seg->size);
+
+		if (!logseg_read(ls, seg, offset, ls->rbuf, LOGSTORE_HDR_SIZE))
+			goto ioerr;
+
+		key = peek_be64(&ls->rbuf[0]);
+		len = peek_be32(&ls->rbuf[8]);
+
+		g_assert(len <= ls->maxlen);
+
+		ls->cursor += logstore_recsize(len);
+		scanned += logstore_recsize(len);
+		rec = hikset_lookup(ls->index, &key);
+
+		if (NULL == rec || rec->seg != seg || rec->offset != offset)
+			continue;		/* Dead record */
+
+		if (!logseg_read(ls, seg, offset + LOGSTORE_HDR_SIZE, ls->rbuf, len))
+			goto ioerr;
+
+		dest = logstore_head(ls, seg->window, len);
+
+		g_assert(dest != seg);		/* Victim is sealed */
+
+		offset = dest->size;
+
+		if (!logseg_append(ls, dest, key, ls->rbuf, len)) {
+			if (0 == dest->records)
+				logseg_free(ls, dest);
+			goto ioerr;
+		}
+
+		logrec_attach(rec, dest, offset, seg->expire);
+		logseg_release(ls, seg, len);		/* May discard the victim */
+		ls->compacted++;
+	}
+
+	return scanned;
+
+ioerr:
+	ls->ioerr = TRUE;
+	ls->victim = NULL;		/* Will pick a segment again next time */
+	return scanned;
+}
+
+/**
+ * @return the name of the store.
+ */
+const char *
+logstore_name(const logstore_t *ls)
+{
+	logstore_check(ls);
+
+	return ls->name;
+}
+
+/**
+ * @return the amount of records held in the store.
+ */
+size_t
+logstore_count(const logstore_t *ls)
+{
+	logstore_check(ls);
+
+	return hikset_count(ls->index);
+}
+
+/**
+ * @return whether the last read or write operation had an I/O error.
+ */
+bool
+logstore_has_ioerr(const logstore_t *ls)
+{
+	logstore_check(ls);
+
+	return ls->ioerr;
+}
+
+/**
+ * @return whether segments are requested to be held in memory.
+ */
+bool
+logstore_is_incore(const logstore_t *ls)
+{
+	logstore_check(ls);
+
+	return NULL == ls->path;
+}
+
+/**
+ * Fill statistics about the store.
+ */
+void
+logstore_info(const logstore_t *ls, logstore_info_t *info)
+{
+	link_t *lk;
+
+	logstore_check(ls);
+	g_assert(info != NULL);
+
+	ZERO(info);
+	info->count = hikset_count(ls->index);
+	info->segments = elist_count(&ls->segs);
+	info->compacted = ls->compacted;
+	info->dropped = ls->dropped;
+
+	for (lk = elist_first(&ls->segs); lk != NULL; lk = elist_next(lk)) {
+		const struct logseg *seg = elist_data(&ls->segs, lk);
+
+		info->size += seg->size;
+		info->live += seg->live;
+	}
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Log-structured record stores.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#ifndef _logstore_h_
+#define _logstore_h_
+
+typedef struct logstore logstore_t;
+
+/**
+ * Store statistics.
+ */
+typedef struct logstore_info {
+	size_t count;			/**< Amount of live records */
+	size_t segments;		/**< Amount of segments */
+	size_t size;			/**< Total size of segments, in bytes */
+	size_t live;			/**< Bytes used by live records */
+	size_t compacted;		/**< Amount of records moved by compaction */
+	size_t dropped;			/**< Amount of segments discarded */
+} logstore_info_t;
+
+/*
+ * Public interface.
+ */
+
+logstore_t *logstore_create(const char *name, const char *dir,
+	const char *base, size_t maxlen, bool incore);
+void logstore_free_null(logstore_t **ls_ptr);
+
+bool logstore_write(logstore_t *ls, uint64 key,
+	const void *data, size_t len, time_t expire);
+void *logstore_read(logstore_t *ls, uint64 key, size_t *lenptr);
+bool logstore_exists(const logstore_t *ls, uint64 key);
+bool logstore_delete(logstore_t *ls, uint64 key);
+size_t logstore_compact(logstore_t *ls, size_t budget);
+
+const char *logstore_name(const logstore_t *ls) G_GNUC_PURE;
+size_t logstore_count(const logstore_t *ls) G_GNUC_PURE;
+bool logstore_has_ioerr(const logstore_t *ls) G_GNUC_PURE;
+bool logstore_is_incore(const logstore_t *ls) G_GNUC_PURE;
+void logstore_info(const logstore_t *ls, logstore_info_t *info);
+
+#endif /* _logstore_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,434 @@
+/*
+ * mmhash-test -- memory-mapped hash table tests and benchmarking.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This program replays a synthetic stream of record updates, removals and
+ * lookups, as done by the DHT root cache when lookups complete and cached
+ * targets expire, checking the table returns the expected records at all
+ * times, including after it was closed and opened again.
+ */
+
+#include "common.h"
+
+#include "endian.h"
+#include "halloc.h"
+#include "misc.h"
+#include "mmhash.h"
+#include "path.h"
+#include "rand31.h"
+#include "str.h"
+#include "tm.h"
+#include "xmalloc.h"
+
+#define DEFAULT_OPS		200000		/* Amount of operations replayed */
+#define DEFAULT_KEYS	20000		/* Amount of distinct keys */
+#define REOPEN_EVERY	50000		/* Reopening period, in operations */
+#define KEY_SIZE		20			/* Same as a KUID */
+#define VERSION			1			/* Version of values */
+
+const char *progname;
+static unsigned initial_seed;
+static const char *dir = ".";
+static const char base[] = "mmhash-test";
+static bool incore;
+
+enum op_type { OP_WRITE, OP_DELETE, OP_READ, OP_EXPIRE };
+
+/*
+ * An operation, as replayed.
+ */
+struct op {
+	enum op_type type;
+	uint32 key;
+	uint32 version;				/* Record version, for writes */
+};
+
+/*
+ * Values held in the table.
+ */
+struct value {
+	uint32 key;
+	uint32 version;
+	uint8 filler[40];
+};
+
+/*
+ * Expected state of each key.
+ */
+struct state {
+	uint32 version;
+	bool present;
+};
+
+static void G_GNUC_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-hmt] [-d dir] [-k keys] [-n loops] [-o ops] [-R seed]\n"
+		"  -d : directory where files are created (default = %s)\n"
+		"  -h : prints this help message\n"
+		"  -k : amount of distinct keys (default = %u)\n"
+		"  -m : keep tables in memory\n"
+		"  -n : sets amount of loops\n"
+		"  -o : amount of operations (default = %u)\n"
+		"  -t : time each test\n"
+		"  -R : seed for repeatable random operation sequence\n"
+		, progname, dir, DEFAULT_KEYS, DEFAULT_OPS);
+	exit(EXIT_FAILURE);
+}
+
+static void G_GNUC_NORETURN
+test_abort(const char *what)
+{
+	printf("%s - FAILED\n", what);
+	printf("use '-R %u' to reproduce problem.\n", initial_seed);
+	abort();
+}
+
+static void
+make_key(char *buf, uint32 key)
+{
+	size_t i;
+
+	poke_be32(buf, key);
+	for (i = 4; i < KEY_SIZE; i++)
+		buf[i] = (key * 131 + i * 17) & 0xff;
+}
+
+static void
+fill_value(struct value *v, uint32 key, uint32 version)
+{
+	size_t i;
+
+	v->key = key;
+	v->version = version;
+	for (i = 0; i < sizeof v->filler; i++)
+		v->filler[i] = (key * 31 + version * 7 + i) & 0xff;
+}
+
+/*
+ * Mostly reads, as cached roots are looked up much more often than they
+ * are updated, with some deletions and periodic expiration sweeps.
+ */
+static struct op *
+generate_ops(size_t count, size_t keys)
+{
+	struct op *ops;
+	size_t i;
+
+	ops = xmalloc(count * sizeof ops[0]);
+
+	for (i = 0; i < count; i++) {
+		uint r = rand31_value(999);
+		struct op *o = &ops[i];
+
+		o->key = rand31_value(keys - 1);
+
+		if (r < 300) {
+			o->type = OP_WRITE;
+			o->version = i;
+		} else if (r < 400) {
+			o->type = OP_DELETE;
+		} else if (r < 999) {
+			o->type = OP_READ;
+		} else {
+			o->type = OP_EXPIRE;
+			o->version = i;
+		}
+	}
+
+	return ops;
+}
+
+static void
+check_read(const struct state *st, const struct value *v, uint32 key,
+	const char *what)
+{
+	struct value ev;
+
+	if (!st->present) {
+		if (v != NULL)
+			test_abort(what);
+		return;
+	}
+
+	if (NULL == v)
+		test_abort(what);
+
+	fill_value(&ev, key, st->version);
+
+	if (0 != memcmp(&ev, v, sizeof ev))
+		test_abort(what);
+}
+
+/*
+ * Context for expire_cb().
+ */
+struct expire_ctx {
+	struct state *st;
+	uint32 limit;
+	size_t removed;
+};
+
+static bool
+expire_cb(const void *key, void *value, void *data)
+{
+	struct expire_ctx *ctx = data;
+	struct value *v = value;
+	char kbuf[KEY_SIZE];
+
+	make_key(kbuf, v->key);
+
+	if (0 != memcmp(kbuf, key, KEY_SIZE) || !ctx->st[v->key].present)
+		test_abort("expire");
+
+	if (v->version >= ctx->limit)
+		return FALSE;
+
+	ctx->st[v->key].present = FALSE;
+	ctx->removed++;
+	return TRUE;
+}
+
+static mmhash_t *
+open_table(const char *what)
+{
+	return mmhash_open(what, dir, base, KEY_SIZE, sizeof(struct value),
+		VERSION, incore);
+}
+
+static void
+run_mmhash(const struct op *ops, size_t count, size_t keys, size_t loops)
+{
+	const char *what = "mmhash";
+	char kbuf[KEY_SIZE];
+
+	while (loops-- != 0) {
+		struct state *st = xmalloc0(keys * sizeof st[0]);
+		mmhash_t *mh;
+		size_t i, n = 0;
+
+		/*
+		 * Start from an empty table, whatever a previous run left.
+		 */
+
+		mh = open_table(what);
+		mmhash_clear(mh);
+
+		for (i = 0; i < count; i++) {
+			const struct op *o = &ops[i];
+			struct state *s = &st[o->key];
+			struct expire_ctx ctx;
+			struct value *v;
+			size_t removed;
+			bool created;
+
+			make_key(kbuf, o->key);
+
+			switch (o->type) {
+			case OP_WRITE:
+				v = mmhash_write(mh, kbuf, &created);
+				if (created == s->present)
+					test_abort(what);
+				fill_value(v, o->key, o->version);
+				n += !s->present;
+				s->present = TRUE;
+				s->version = o->version;
+				break;
+			case OP_DELETE:
+				if (s->present != mmhash_remove(mh, kbuf))
+					test_abort(what);
+				n -= s->present;
+				s->present = FALSE;
+				break;
+			case OP_READ:
+				check_read(s, mmhash_lookup(mh, kbuf), o->key, what);
+				break;
+			case OP_EXPIRE:
+				ctx.st = st;
+				ctx.limit = o->version - o->version / 4;
+				ctx.removed = 0;
+				removed = mmhash_foreach_remove(mh, expire_cb, &ctx);
+				if (removed != ctx.removed)
+					test_abort(what);
+				n -= ctx.removed;
+				break;
+			}
+
+			if (n != mmhash_count(mh))
+				test_abort(what);
+
+			if (0 == (i + 1) % REOPEN_EVERY) {
+				if (incore) {
+					mmhash_sync(mh);
+				} else {
+					mmhash_close_null(&mh);
+					mh = open_table(what);
+					if (n != mmhash_count(mh))
+						test_abort(what);
+				}
+			}
+		}
+
+		for (i = 0; i < keys; i++) {
+			make_key(kbuf, i);
+			check_read(&st[i], mmhash_lookup(mh, kbuf), i, what);
+		}
+
+		if (2 * mmhash_count(mh) > mmhash_capacity(mh))
+			test_abort(what);
+
+		mmhash_close_null(&mh);
+		xfree(st);
+	}
+
+	if (!incore) {
+		char *path = make_pathname(dir, base);
+		unlink(path);
+		HFREE_NULL(path);
+	}
+}
+
+static double
+timeit(void (*f)(const struct op *, size_t, size_t, size_t),
+	const struct op *ops, size_t count, size_t keys, size_t loops)
+{
+	tm_t start, end;
+
+	/*
+	 * We're measuring I/O as well, hence we use the wall-clock time.
+	 */
+
+	tm_now_exact(&start);
+	(*f)(ops, count, keys, loops);
+	tm_now_exact(&end);
+
+	return tm_elapsed_f(&end, &start);
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	bool tflag = FALSE;
+	size_t count = DEFAULT_OPS;
+	size_t keys = DEFAULT_KEYS;
+	size_t loops = 0;
+	unsigned rseed = 0;
+	struct op *ops;
+	double tmh;
+	char what[80];
+	int c;
+
+	mingw_early_init();
+	progname = filepath_basename(argv[0]);
+
+	while ((c = getopt(argc, argv, "d:hk:mn:o:tR:")) != EOF) {
+		switch (c) {
+		case 'd':			/* directory for files */
+			dir = optarg;
+			break;
+		case 'k':			/* amount of keys */
+			keys = atol(optarg);
+			break;
+		case 'm':			/* in-core tables */
+			incore = TRUE;
+			break;
+		case 'n':			/* amount of loops */
+			loops = atol(optarg);
+			break;
+		case 'o':			/* amount of operations */
+			count = atol(optarg);
+			break;
+		case 't':			/* timing report */
+			tflag = TRUE;
+			break;
+		case 'R':			/* randomize in a repeatable way */
+			rseed = atoi(optarg);
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 0)
+		usage();
+
+	if (keys < 2 || 0 == count)
+		usage();
+
+	/*
+	 * Files can only be opened through absolute paths.
+	 */
+
+	if (!incore && !is_absolute_path(dir)) {
+		static char path[MAX_PATH_LEN];
+		char cwd[MAX_PATH_LEN];
+
+		if (NULL == getcwd(cwd, sizeof cwd)) {
+			fprintf(stderr, "%s: getcwd() failed: %s\n",
+				progname, g_strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		str_bprintf(path, sizeof path, "%s/%s", cwd, dir);
+		dir = path;
+	}
+
+	rand31_set_seed(rseed);
+	initial_seed = rand31_current_seed();
+
+	if (0 == loops)
+		loops = tflag ? 3 : 1;
+
+	ops = generate_ops(count, keys);
+
+	str_bprintf(what, sizeof what, "%zu operations on %zu keys%s",
+		count, keys, incore ? " in core" : "");
+
+	tmh = timeit(run_mmhash, ops, count, keys, loops);
+
+	if (tflag) {
+		printf("%s - [%zu] %.3gs (%.3g op/s)\n",
+			what, loops, tmh, tmh > 0.0 ? count * loops / tmh : 0.0);
+	} else {
+		printf("%s - OK\n", what);
+	}
+
+	xfree(ops);
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,856 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Memory-mapped hash tables of fixed-size records.
+ *
+ * The table is a flat open-addressing hash table with linear probing, each
+ * slot holding the value, the key and a state byte.  Its whole image, a
+ * small header followed by the slots, is the content of the backing file,
+ * which is mapped in memory: reading a record returns a pointer within the
+ * mapping, without any copy nor deserialization, and updates are made in
+ * place.
+ *
+ * Persistence is lazy: dirty pages are written back by the kernel, and
+ * mmhash_sync() merely schedules an asynchronous flush.  When mmap() is not
+ * available or fails, the image is kept in memory and written back as a
+ * whole by mmhash_sync() and when the table is closed.
+ *
+ * Values are laid out as-is, in host order: the file is meant to be read
+ * back by the same program on the same machine.  The header records the
+ * geometry of the table and a user-supplied version number, and a file
+ * whose header does not match the expected layout is discarded.
+ *
+ * Removed records leave a tombstone behind so that pointers to other values
+ * remain valid until the next insertion.  Tombstones are purged when the
+ * table is resized.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "mmhash.h"
+#include "compat_pio.h"
+#include "fd.h"
+#include "file.h"
+#include "halloc.h"
+#include "hashing.h"
+#include "misc.h"
+#include "path.h"
+#include "pow2.h"
+#include "vmm.h"
+#include "walloc.h"
+
+#include "override.h"			/* Must be the last header included */
+
+#define MMHASH_MIN_SLOTS	64		/**< Minimum table capacity */
+#define MMHASH_HDR_SIZE		64		/**< Size of the image header */
+#define MMHASH_FORMAT		1		/**< Version of the image layout */
+#define MMHASH_ENDIAN		0x01020304U
+#define MMHASH_ALIGN		8		/**< Slot alignment */
+
+/*
+ * Slot states.
+ */
+#define MMHASH_FREE			0
+#define MMHASH_USED			1
+#define MMHASH_DELETED		2
+
+static const char MMHASH_FILE_MAGIC[] = "MMHT";
+
+/**
+ * Header of the table image.
+ */
+struct mmhash_header {
+	char magic[4];			/**< MMHASH_FILE_MAGIC */
+	uint32 format;			/**< MMHASH_FORMAT */
+	uint32 endian;			/**< MMHASH_ENDIAN, in host order */
+	uint32 version;			/**< User version of the values */
+	uint32 keysize;			/**< Key size */
+	uint32 valsize;			/**< Value size */
+	uint32 slotsize;		/**< Slot size */
+	uint32 capacity;		/**< Amount of slots */
+	uint32 count;			/**< Amount of records */
+	uint32 deleted;			/**< Amount of tombstones */
+	uint32 reserved[6];
+};
+
+enum mmhash_magic { MMHASH_MAGIC = 0x7e1b05d3 };
+
+/**
+ * A memory-mapped hash table.
+ */
+struct mmhash {
+	enum mmhash_magic magic;
+	char *name;				/**< Table name, for logs */
+	char *path;				/**< Backing file, NULL if held in core */
+	char *image;			/**< Table image: header + slots */
+	char *slots;			/**< Start of slots within image */
+	size_t size;			/**< Size of table image */
+	size_t keysize;			/**< Key size */
+	size_t valsize;			/**< Value size */
+	size_t slotsize;		/**< Slot size */
+	size_t capacity;		/**< Amount of slots (power of 2) */
+	size_t bits;			/**< log2(capacity) */
+	size_t count;			/**< Amount of records */
+	size_t deleted;			/**< Amount of tombstones */
+	uint32 version;			/**< User version of the values */
+	int fd;					/**< Backing file, -1 if held in core */
+	bool mapped;			/**< Whether image is mapped from the file */
+	bool dirty;				/**< Whether image was modified since sync */
+};
+
+static inline void
+mmhash_check(const struct mmhash * const mh)
+{
+	g_assert(mh != NULL);
+	g_assert(MMHASH_MAGIC == mh->magic);
+}
+
+/**
+ * @return the address of slot at given index.
+ */
+static inline char *
+mmhash_slot(const mmhash_t *mh, size_t i)
+{
+	return &mh->slots[i * mh->slotsize];
+}
+
+/**
+ * @return the state of slot.
+ */
+static inline uint8
+mmhash_state(const mmhash_t *mh, const char *slot)
+{
+	return slot[mh->valsize + mh->keysize];
+}
+
+static inline void
+mmhash_set_state(const mmhash_t *mh, char *slot, uint8 state)
+{
+	slot[mh->valsize + mh->keysize] = state;
+}
+
+/**
+ * @return the address of the key within slot.
+ */
+static inline char *
+mmhash_key(const mmhash_t *mh, char *slot)
+{
+	return &slot[mh->valsize];
+}
+
+/**
+ * @return the size of the table image for the given capacity.
+ */
+static inline size_t
+mmhash_image_size(const mmhash_t *mh, size_t capacity)
+{
+	return MMHASH_HDR_SIZE + capacity * mh->slotsize;
+}
+
+/**
+ * Update the image header from the table information.
+ */
+static void
+mmhash_header_update(const mmhash_t *mh)
+{
+	struct mmhash_header *h = (struct mmhash_header *) mh->image;
+
+	STATIC_ASSERT(MMHASH_HDR_SIZE == sizeof *h);
+
+	memcpy(h->magic, MMHASH_FILE_MAGIC, sizeof h->magic);
+	h->format = MMHASH_FORMAT;
+	h->endian = MMHASH_ENDIAN;
+	h->version = mh->version;
+	h->keysize = mh->keysize;
+	h->valsize = mh->valsize;
+	h->slotsize = mh->slotsize;
+	h->capacity = mh->capacity;
+	h->count = mh->count;
+	h->deleted = mh->deleted;
+}
+
+/**
+ * Map the table image of given capacity from the backing file, or allocate
+ * it in memory if the table is held in core or if the file cannot be mapped.
+ *
+ * The file is resized to the image size.  When ``fresh'' is TRUE, all the
+ * slots are cleared, otherwise the image reflects the file content if it
+ * could be mapped, and must be loaded by the caller otherwise.
+ */
+static void
+mmhash_map(mmhash_t *mh, size_t capacity, bool fresh)
+{
+	size_t size = mmhash_image_size(mh, capacity);
+	bool resized = TRUE;
+
+	g_assert(NULL == mh->image);
+	g_assert(is_pow2(capacity));
+
+	mh->capacity = capacity;
+	mh->bits = highest_bit_set(capacity);
+	mh->size = size;
+	mh->mapped = FALSE;
+
+	if (mh->fd != -1 && -1 == ftruncate(mh->fd, size)) {
+		g_warning("%s(): cannot resize \"%s\" to %zu bytes: %m",
+			G_STRFUNC, mh->path, size);
+		resized = FALSE;
+	}
+
+#ifdef HAS_MMAP
+	/*
+	 * Never map beyond the end of the file, since accessing these pages
+	 * would raise a SIGBUS.
+	 */
+
+	if (mh->fd != -1 && resized) {
+		void *p = vmm_mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			mh->fd, 0);
+
+		if (MAP_FAILED == p) {
+			g_warning("%s(): cannot map \"%s\", keeping table in core: %m",
+				G_STRFUNC, mh->path);
+		} else {
+			mh->image = p;
+			mh->mapped = TRUE;
+		}
+	}
+#else
+	(void) resized;
+#endif	/* HAS_MMAP */
+
+	if (NULL == mh->image)
+		mh->image = vmm_alloc0(size);
+
+	mh->slots = &mh->image[MMHASH_HDR_SIZE];
+
+	if (fresh) {
+		if (mh->mapped)
+			memset(mh->slots, 0, capacity * mh->slotsize);
+		mh->count = mh->deleted = 0;
+		mmhash_header_update(mh);
+		mh->dirty = TRUE;
+	}
+}
+
+/**
+ * Release the table image.
+ */
+static void
+mmhash_unmap(mmhash_t *mh)
+{
+	if (NULL == mh->image)
+		return;
+
+	if (mh->mapped)
+		vmm_munmap(mh->image, mh->size);
+	else
+		vmm_free(mh->image, mh->size);
+
+	mh->image = mh->slots = NULL;
+	mh->mapped = FALSE;
+}
+
+/**
+ * Locate slot for key.
+ *
+ * @param mh		the table
+ * @param key		the key to look for
+ * @param found		written with whether key was found
+ *
+ * @return the slot holding the key if found, the slot where it should be
+ * inserted otherwise.
+ */
+static char *
+mmhash_find(const mmhash_t *mh, const void *key, bool *found)
+{
+	size_t i, n, mask = mh->capacity - 1;
+	char *tomb = NULL;
+
+	i = hashing_fold(binary_hash(key, mh->keysize), mh->bits);
+
+	for (n = 0; n < mh->capacity; n++, i = (i + 1) & mask) {
+		char *slot = mmhash_slot(mh, i);
+
+		switch (mmhash_state(mh, slot)) {
+		case MMHASH_FREE:
+			*found = FALSE;
+			return NULL == tomb ? slot : tomb;
+		case MMHASH_DELETED:
+			if (NULL == tomb)
+				tomb = slot;
+			break;
+		default:
+			if (0 == memcmp(mmhash_key(mh, slot), key, mh->keysize)) {
+				*found = TRUE;
+				return slot;
+			}
+			break;
+		}
+	}
+
+	/*
+	 * The load factor guarantees there are free slots, unless the image
+	 * was loaded with too many tombstones, in which case we can reuse one.
+	 */
+
+	g_assert(tomb != NULL);
+
+	*found = FALSE;
+	return tomb;
+}
+
+/**
+ * Rebuild table with given capacity, purging all tombstones.
+ */
+static void
+mmhash_resize(mmhash_t *mh, size_t capacity)
+{
+	size_t i, oldcap = mh->capacity;
+	size_t len = oldcap * mh->slotsize;
+	char *old;
+
+	g_assert(capacity >= 2 * mh->count);
+
+	old = vmm_alloc(len);
+	memcpy(old, mh->slots, len);
+
+	mmhash_unmap(mh);
+	mmhash_map(mh, capacity, TRUE);
+
+	for (i = 0; i < oldcap; i++) {
+		char *slot = &old[i * mh->slotsize];
+		char *nslot;
+		bool found;
+
+		if (MMHASH_USED != mmhash_state(mh, slot))
+			continue;
+
+		nslot = mmhash_find(mh, mmhash_key(mh, slot), &found);
+		g_assert(!found);
+		memcpy(nslot, slot, mh->slotsize);
+		mh->count++;
+	}
+
+	vmm_free(old, len);
+	mmhash_header_update(mh);
+}
+
+/**
+ * Shrink the table or purge tombstones after records were removed.
+ */
+static void
+mmhash_adjust(mmhash_t *mh)
+{
+	size_t capacity = mh->capacity;
+
+	while (capacity > MMHASH_MIN_SLOTS && mh->count * 8 < capacity)
+		capacity /= 2;
+
+	if (capacity != mh->capacity || mh->deleted * 4 > mh->capacity)
+		mmhash_resize(mh, capacity);
+}
+
+/**
+ * Validate header of the image read back from the backing file.
+ *
+ * @return the capacity of the table, 0 if the header is invalid.
+ */
+static size_t
+mmhash_header_valid(const mmhash_t *mh, const struct mmhash_header *h,
+	filesize_t filesize)
+{
+	if (
+		0 != memcmp(h->magic, MMHASH_FILE_MAGIC, sizeof h->magic) ||
+		h->format != MMHASH_FORMAT ||
+		h->endian != MMHASH_ENDIAN ||
+		h->version != mh->version ||
+		h->keysize != mh->keysize ||
+		h->valsize != mh->valsize ||
+		h->slotsize != mh->slotsize ||
+		h->capacity < MMHASH_MIN_SLOTS ||
+		!is_pow2(h->capacity) ||
+		filesize < mmhash_image_size(mh, h->capacity)
+	)
+		return 0;
+
+	return h->capacity;
+}
+
+/**
+ * Load the table from its backing file.
+ *
+ * @return TRUE if the file contained a valid table image.
+ */
+static bool
+mmhash_load(mmhash_t *mh)
+{
+	struct mmhash_header h;
+	filestat_t buf;
+	size_t i, capacity;
+
+	if (-1 == fstat(mh->fd, &buf)) {
+		g_warning("%s(): cannot stat \"%s\": %m", G_STRFUNC, mh->path);
+		return FALSE;
+	}
+
+	if (buf.st_size < MMHASH_HDR_SIZE)
+		return FALSE;
+
+	if (sizeof h != compat_pread(mh->fd, &h, sizeof h, 0)) {
+		g_warning("%s(): cannot read header of \"%s\": %m",
+			G_STRFUNC, mh->path);
+		return FALSE;
+	}
+
+	capacity = mmhash_header_valid(mh, &h, buf.st_size);
+
+	if (0 == capacity) {
+		g_warning("%s(): discarding incompatible table image in \"%s\"",
+			G_STRFUNC, mh->path);
+		return FALSE;
+	}
+
+	mmhash_map(mh, capacity, FALSE);
+
+	if (!mh->mapped) {
+		ssize_t n = compat_pread(mh->fd, mh->image, mh->size, 0);
+
+		if ((ssize_t) mh->size != n) {
+			g_warning("%s(): cannot read \"%s\": %m", G_STRFUNC, mh->path);
+			goto failed;
+		}
+	}
+
+	/*
+	 * Recount records: the header is only refreshed when the table is
+	 * synchronized, so it may lag behind the slots if we did not exit
+	 * cleanly.
+	 */
+
+	mh->count = mh->deleted = 0;
+
+	for (i = 0; i < capacity; i++) {
+		switch (mmhash_state(mh, mmhash_slot(mh, i))) {
+		case MMHASH_FREE:
+			break;
+		case MMHASH_USED:
+			mh->count++;
+			break;
+		case MMHASH_DELETED:
+			mh->deleted++;
+			break;
+		default:
+			g_warning("%s(): corrupted slot #%zu in \"%s\"",
+				G_STRFUNC, i, mh->path);
+			goto failed;
+		}
+	}
+
+	if (mh->count * 2 > capacity) {
+		g_warning("%s(): table in \"%s\" is overloaded (%zu/%zu)",
+			G_STRFUNC, mh->path, mh->count, capacity);
+		goto failed;
+	}
+
+	if (mh->count + mh->deleted == capacity || mh->deleted * 4 > capacity)
+		mmhash_resize(mh, capacity);
+
+	mmhash_header_update(mh);
+	return TRUE;
+
+failed:
+	mmhash_unmap(mh);
+	return FALSE;
+}
+
+/**
+ * Open a memory-mapped hash table, loading back its previous content.
+ *
+ * @param name		the name of the table, for logs
+ * @param dir		the directory where the backing file is put
+ * @param base		the name of the backing file
+ * @param keysize	the size of keys
+ * @param valsize	the size of values
+ * @param version	user version of the value layout, for compatibility
+ * @param incore	if TRUE, keep table in memory, without any backing file
+ *
+ * @return new table.
+ */
+mmhash_t *
+mmhash_open(const char *name, const char *dir, const char *base,
+	size_t keysize, size_t valsize, uint32 version, bool incore)
+{
+	mmhash_t *mh;
+
+	g_assert(name != NULL);
+	g_assert(incore || (dir != NULL && base != NULL));
+	g_assert(keysize != 0);
+
+	WALLOC0(mh);
+	mh->magic = MMHASH_MAGIC;
+	mh->name = h_strdup(name);
+	mh->keysize = keysize;
+	mh->valsize = valsize;
+	mh->slotsize = round_size(MMHASH_ALIGN, valsize + keysize + 1);
+	mh->version = version;
+	mh->fd = -1;
+
+	if (!incore) {
+		mh->path = make_pathname(dir, base);
+		mh->fd = file_open_missing(mh->path, O_RDWR);
+
+		if (-1 == mh->fd) {
+			mh->fd = file_create(mh->path, O_RDWR | O_TRUNC,
+				S_IRUSR | S_IWUSR);
+		}
+
+		if (-1 == mh->fd)
+			HFREE_NULL(mh->path);
+	}
+
+	if (-1 == mh->fd || !mmhash_load(mh))
+		mmhash_map(mh, MMHASH_MIN_SLOTS, TRUE);
+
+	return mh;
+}
+
+/**
+ * Synchronize table image with its backing file.
+ *
+ * When the image is mapped, this only schedules the write-back of dirty
+ * pages, otherwise the whole image is written.
+ */
+void
+mmhash_sync(mmhash_t *mh)
+{
+	mmhash_check(mh);
+
+	if (!mh->dirty || -1 == mh->fd)
+		return;
+
+	mmhash_header_update(mh);
+
+#ifdef HAS_MMAP
+	if (mh->mapped) {
+		if (-1 == msync(mh->image, mh->size, MS_ASYNC))
+			g_warning("%s(): cannot sync \"%s\": %m", G_STRFUNC, mh->path);
+		mh->dirty = FALSE;
+		return;
+	}
+#endif	/* HAS_MMAP */
+
+	if ((ssize_t) mh->size != compat_pwrite(mh->fd, mh->image, mh->size, 0)) {
+		g_warning("%s(): cannot write %zu bytes to \"%s\": %m",
+			G_STRFUNC, mh->size, mh->path);
+		return;
+	}
+
+	mh->dirty = FALSE;
+}
+
+/**
+ * Close table, persisting its content, and nullify its pointer.
+ */
+void
+mmhash_close_null(mmhash_t **mh_ptr)
+{
+	mmhash_t *mh = *mh_ptr;
+
+	if (NULL == mh)
+		return;
+
+	mmhash_check(mh);
+
+	mmhash_sync(mh);
+	mmhash_unmap(mh);
+	fd_forget_and_close(&mh->fd);
+	HFREE_NULL(mh->name);
+	HFREE_NULL(mh->path);
+	mh->magic = 0;
+	WFREE(mh);
+	*mh_ptr = NULL;
+}
+
+/**
+ * Lookup record.
+ *
+ * @return a pointer to the value within the table image, NULL if the key
+ * is not present.  The pointer remains valid until the next insertion or
+ * until records are removed by mmhash_foreach_remove().
+ */
+const void *
+mmhash_lookup(const mmhash_t *mh, const void *key)
+{
+	char *slot;
+	bool found;
+
+	mmhash_check(mh);
+	g_assert(key != NULL);
+
+	slot = mmhash_find(mh, key, &found);
+
+	return found ? slot : NULL;
+}
+
+/**
+ * @return whether key is present in the table.
+ */
+bool
+mmhash_contains(const mmhash_t *mh, const void *key)
+{
+	return NULL != mmhash_lookup(mh, key);
+}
+
+/**
+ * Get record for update, creating it if needed.
+ *
+ * The value can then be updated in place, until the next insertion or
+ * until records are removed by mmhash_foreach_remove().  A new record
+ * is zeroed.
+ *
+ * @param mh		the table
+ * @param key		the key of the record
+ * @param created	if non-NULL, written with whether the record was created
+ *
+ * @return a pointer to the value within the table image.
+ */
+void *
+mmhash_write(mmhash_t *mh, const void *key, bool *created)
+{
+	char *slot;
+	bool found;
+
+	mmhash_check(mh);
+	g_assert(key != NULL);
+
+	mh->dirty = TRUE;
+	slot = mmhash_find(mh, key, &found);
+
+	if (!found) {
+		/*
+		 * Keep the load factor, tombstones included, under 3/4 so that
+		 * probe sequences stay short and always end on a free slot.
+		 */
+
+		if (4 * (mh->count + mh->deleted + 1) > 3 * mh->capacity) {
+			size_t capacity = mh->capacity;
+
+			if (2 * (mh->count + 1) > capacity)
+				capacity *= 2;
+
+			mmhash_resize(mh, capacity);
+			slot = mmhash_find(mh, key, &found);
+			g_assert(!found);
+		}
+
+		if (MMHASH_DELETED == mmhash_state(mh, slot))
+			mh->deleted--;
+
+		memset(slot, 0, mh->valsize);
+		memcpy(mmhash_key(mh, slot), key, mh->keysize);
+		mmhash_set_state(mh, slot, MMHASH_USED);
+		mh->count++;
+	}
+
+	if (created != NULL)
+		*created = !found;
+
+	return slot;
+}
+
+/**
+ * Remove record from slot.
+ */
+static void
+mmhash_remove_slot(mmhash_t *mh, char *slot)
+{
+	size_t i = (slot - mh->slots) / mh->slotsize;
+	char *next = mmhash_slot(mh, (i + 1) & (mh->capacity - 1));
+
+	g_assert(mh->count != 0);
+
+	/*
+	 * No tombstone is needed if the next slot is free: no probe sequence
+	 * can go through this slot to reach a record further away.
+	 */
+
+	if (MMHASH_FREE == mmhash_state(mh, next)) {
+		mmhash_set_state(mh, slot, MMHASH_FREE);
+	} else {
+		mmhash_set_state(mh, slot, MMHASH_DELETED);
+		mh->deleted++;
+	}
+
+	mh->count--;
+	mh->dirty = TRUE;
+}
+
+/**
+ * Remove record.
+ *
+ * Pointers to other values remain valid.
+ *
+ * @return TRUE if the key was present.
+ */
+bool
+mmhash_remove(mmhash_t *mh, const void *key)
+{
+	char *slot;
+	bool found;
+
+	mmhash_check(mh);
+	g_assert(key != NULL);
+
+	slot = mmhash_find(mh, key, &found);
+
+	if (found)
+		mmhash_remove_slot(mh, slot);
+
+	return found;
+}
+
+/**
+ * Remove all records, shrinking the table back to its minimal size.
+ */
+void
+mmhash_clear(mmhash_t *mh)
+{
+	mmhash_check(mh);
+
+	mmhash_unmap(mh);
+	mmhash_map(mh, MMHASH_MIN_SLOTS, TRUE);
+}
+
+/**
+ * Iterate over all the records.
+ *
+ * Values may be updated in place by the callback, but records must not be
+ * inserted nor removed.
+ */
+void
+mmhash_foreach(const mmhash_t *mh, mmhash_cb_t cb, void *data)
+{
+	size_t i;
+
+	mmhash_check(mh);
+	g_assert(cb != NULL);
+
+	for (i = 0; i < mh->capacity; i++) {
+		char *slot = mmhash_slot(mh, i);
+
+		if (MMHASH_USED == mmhash_state(mh, slot))
+			(*cb)(mmhash_key(mh, slot), slot, data);
+	}
+}
+
+/**
+ * Iterate over all the records, removing those for which the callback
+ * returns TRUE.
+ *
+ * The table may be shrunk afterwards, invalidating all value pointers.
+ *
+ * @return the amount of records removed.
+ */
+size_t
+mmhash_foreach_remove(mmhash_t *mh, mmhash_cbr_t cb, void *data)
+{
+	size_t i, removed = 0;
+
+	mmhash_check(mh);
+	g_assert(cb != NULL);
+
+	for (i = 0; i < mh->capacity; i++) {
+		char *slot = mmhash_slot(mh, i);
+
+		if (MMHASH_USED != mmhash_state(mh, slot))
+			continue;
+
+		if ((*cb)(mmhash_key(mh, slot), slot, data)) {
+			mmhash_set_state(mh, slot, MMHASH_DELETED);
+			mh->count--;
+			mh->deleted++;
+			removed++;
+		}
+	}
+
+	if (removed != 0) {
+		mh->dirty = TRUE;
+		mmhash_adjust(mh);
+	}
+
+	return removed;
+}
+
+/**
+ * @return table name.
+ */
+const char *
+mmhash_name(const mmhash_t *mh)
+{
+	mmhash_check(mh);
+
+	return mh->name;
+}
+
+/**
+ * @return amount of records held.
+ */
+size_t
+mmhash_count(const mmhash_t *mh)
+{
+	mmhash_check(mh);
+
+	return mh->count;
+}
+
+/**
+ * @return amount of slots in the table.
+ */
+size_t
+mmhash_capacity(const mmhash_t *mh)
+{
+	mmhash_check(mh);
+
+	return mh->capacity;
+}
+
+/**
+ * @return whether the table image is mapped from its backing file.
+ */
+bool
+mmhash_is_mapped(const mmhash_t *mh)
+{
+	mmhash_check(mh);
+
+	return mh->mapped;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
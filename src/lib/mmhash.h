@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Memory-mapped hash tables of fixed-size records.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#ifndef _mmhash_h_
+#define _mmhash_h_
+
+typedef struct mmhash mmhash_t;
+
+/**
+ * Iterator callbacks, given the key and the value of each record.
+ */
+typedef void (*mmhash_cb_t)(const void *key, void *value, void *data);
+typedef bool (*mmhash_cbr_t)(const void *key, void *value, void *data);
+
+/*
+ * Public interface.
+ */
+
+mmhash_t *mmhash_open(const char *name, const char *dir, const char *base,
+	size_t keysize, size_t valsize, uint32 version, bool incore);
+void mmhash_close_null(mmhash_t **mh_ptr);
+
+const void *mmhash_lookup(const mmhash_t *mh, const void *key);
+bool mmhash_contains(const mmhash_t *mh, const void *key);
+void *mmhash_write(mmhash_t *mh, const void *key, bool *created);
+bool mmhash_remove(mmhash_t *mh, const void *key);
+void mmhash_clear(mmhash_t *mh);
+void mmhash_sync(mmhash_t *mh);
+
+void mmhash_foreach(const mmhash_t *mh, mmhash_cb_t cb, void *data);
+size_t mmhash_foreach_remove(mmhash_t *mh, mmhash_cbr_t cb, void *data);
+
+const char *mmhash_name(const mmhash_t *mh) G_GNUC_PURE;
+size_t mmhash_count(const mmhash_t *mh) G_GNUC_PURE;
+size_t mmhash_capacity(const mmhash_t *mh) G_GNUC_PURE;
+bool mmhash_is_mapped(const mmhash_t *mh) G_GNUC_PURE;
+
+#endif /* _mmhash_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
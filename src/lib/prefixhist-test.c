@@ -0,0 +1,475 @@
+/*
+ * prefixhist-test -- prefix length histogram tests and benchmarking.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This program replays DHT lookups where nodes are added to and removed
+ * from the lookup path, checking after each change the prefix distribution
+ * of the k closest nodes and its Kullback-Leibler divergence, as computed
+ * incrementally from the histogram, against a full rescan of the nodes.
+ *
+ * With -t, it reports the per-iteration cost of both approaches.
+ */
+
+#include "common.h"
+
+#include <math.h>		/* For log() */
+
+#include "misc.h"
+#include "path.h"
+#include "pow2.h"
+#include "prefixhist.h"
+#include "rand31.h"
+#include "str.h"
+#include "tm.h"
+#include "xmalloc.h"
+
+#define DEFAULT_NODES	500		/* Nodes in a lookup path */
+#define DEFAULT_LOOKUPS	200		/* Amount of lookups replayed */
+#define ID_SIZE			20		/* Same as a KUID */
+#define ID_BITS			(ID_SIZE * 8)
+#define K				20		/* Same as KDA_K */
+#define WIDTH			11		/* Same as KDA_C + 1 */
+#define BMIN			13		/* Window start, as for a 200k-node DHT */
+#define REMOVE_EVERY	8		/* A node is removed after that many adds */
+
+const char *progname;
+static unsigned initial_seed;
+
+/*
+ * A node in the lookup path.
+ */
+struct node {
+	uint8 id[ID_SIZE];
+	size_t common;			/* Common leading bits with target */
+};
+
+/*
+ * A replayed lookup.
+ */
+struct lookup {
+	uint8 target[ID_SIZE];
+	struct node *nodes;		/* Nodes, in the order they join the path */
+	size_t *removed;		/* Index of node removed at each step, or -1 */
+};
+
+static void G_GNUC_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-ht] [-l lookups] [-n loops] [-N nodes] [-R seed]\n"
+		"  -h : prints this help message\n"
+		"  -l : amount of lookups (default = %u)\n"
+		"  -n : sets amount of loops\n"
+		"  -t : time each test\n"
+		"  -N : amount of nodes in lookup path (default = %u)\n"
+		"  -R : seed for repeatable random operation sequence\n"
+		, progname, DEFAULT_LOOKUPS, DEFAULT_NODES);
+	exit(EXIT_FAILURE);
+}
+
+static void G_GNUC_NORETURN
+test_abort(const char *what)
+{
+	printf("%s - FAILED\n", what);
+	printf("use '-R %u' to reproduce problem.\n", initial_seed);
+	abort();
+}
+
+static size_t
+common_prefix(const uint8 *a, const uint8 *b)
+{
+	size_t i;
+
+	for (i = 0; i < ID_SIZE; i++) {
+		uint8 x = a[i] ^ b[i];
+		if (x != 0)
+			return i * 8 + 7 - highest_bit_set(x);
+	}
+
+	return ID_BITS;
+}
+
+/*
+ * @return whether ``a'' is closer to the target than ``b''.
+ */
+static bool
+closer(const uint8 *target, const uint8 *a, const uint8 *b)
+{
+	size_t i;
+
+	for (i = 0; i < ID_SIZE; i++) {
+		uint8 da = a[i] ^ target[i];
+		uint8 db = b[i] ^ target[i];
+		if (da != db)
+			return da < db;
+	}
+
+	return FALSE;
+}
+
+/*
+ * Nodes gathered by a lookup converge towards the target: most of them
+ * share a few more leading bits with the target than the k-ball frontier.
+ */
+static void
+generate_node(struct node *n, const uint8 *target)
+{
+	size_t common = BMIN - 4, i;
+
+	while (common < ID_BITS - 1 && rand31_value(99) < 55)
+		common++;
+
+	rand31_bytes(n->id, ID_SIZE);
+
+	for (i = 0; i < common; i++) {
+		uint8 mask = 0x80 >> (i % 8);
+		n->id[i / 8] = (n->id[i / 8] & ~mask) | (target[i / 8] & mask);
+	}
+
+	/* Bit ``common'' differs from the target */
+
+	n->id[common / 8] = (n->id[common / 8] & ~(0x80 >> (common % 8))) |
+		(~target[common / 8] & (0x80 >> (common % 8)));
+
+	n->common = common_prefix(n->id, target);
+	g_assert(n->common == common);
+}
+
+static struct lookup *
+generate_lookups(size_t count, size_t nodes)
+{
+	struct lookup *lk;
+	bool *gone = xmalloc(nodes * sizeof gone[0]);
+	size_t i, j;
+
+	lk = xmalloc(count * sizeof lk[0]);
+
+	for (i = 0; i < count; i++) {
+		struct lookup *l = &lk[i];
+
+		rand31_bytes(l->target, ID_SIZE);
+		l->nodes = xmalloc(nodes * sizeof l->nodes[0]);
+		l->removed = xmalloc(nodes * sizeof l->removed[0]);
+		memset(gone, 0, nodes * sizeof gone[0]);
+
+		for (j = 0; j < nodes; j++) {
+			generate_node(&l->nodes[j], l->target);
+			l->removed[j] = (size_t) -1;
+			if (j != 0 && 0 == j % REMOVE_EVERY) {
+				size_t r = rand31_value(j - 1);
+				if (!gone[r]) {
+					gone[r] = TRUE;
+					l->removed[j] = r;
+				}
+			}
+		}
+	}
+
+	xfree(gone);
+	return lk;
+}
+
+static void
+free_lookups(struct lookup *lk, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		xfree(lk[i].nodes);
+		xfree(lk[i].removed);
+	}
+
+	xfree(lk);
+}
+
+/*
+ * Reference computation: select the K closest nodes still in the path,
+ * count their prefixes in the window and compute the divergence directly.
+ */
+static double
+rescan(const struct lookup *l, const bool *present, size_t n,
+	size_t bmin, size_t counts[WIDTH], size_t *nodes)
+{
+	const struct node *best[K];
+	size_t i, j, cnt = 0;
+	double dkl = 0.0;
+
+	for (i = 0; i < n; i++) {
+		const struct node *nd = &l->nodes[i];
+
+		if (!present[i])
+			continue;
+
+		if (cnt == K && !closer(l->target, nd->id, best[K - 1]->id))
+			continue;
+
+		j = cnt < K ? cnt++ : K - 1;
+		while (j > 0 && closer(l->target, nd->id, best[j - 1]->id)) {
+			best[j] = best[j - 1];
+			j--;
+		}
+		best[j] = nd;
+	}
+
+	memset(counts, 0, WIDTH * sizeof counts[0]);
+	*nodes = 0;
+
+	for (i = 0; i < cnt; i++) {
+		size_t c = best[i]->common;
+		if (c >= bmin && c < bmin + WIDTH) {
+			counts[c - bmin]++;
+			(*nodes)++;
+		}
+	}
+
+	for (i = 0; i < WIDTH && *nodes != 0; i++) {
+		double m = (double) counts[i] / *nodes;
+		if (counts[i] != 0)
+			dkl += m * (log(m) / log(2.0) + i + 1.0);
+	}
+
+	return dkl;
+}
+
+static void
+check_window(const prefixhist_window_t *w, const size_t counts[WIDTH],
+	size_t nodes, double dkl, const char *what)
+{
+	size_t i;
+
+	if (w->nodes != nodes)
+		test_abort(what);
+
+	for (i = 0; i < WIDTH; i++) {
+		if (w->counts[i] != counts[i])
+			test_abort(what);
+	}
+
+	if (fabs(w->dkl - dkl) > 1e-9)
+		test_abort(what);
+}
+
+/*
+ * Replay lookups, running the checks done at each lookup iteration
+ * with both the incremental histogram and the rescan of all nodes.
+ */
+static void
+run_check(struct lookup *lk, size_t count, size_t nodes)
+{
+	const char *what = "prefixhist";
+	bool *present = xmalloc(nodes * sizeof present[0]);
+	size_t i, j;
+
+	for (i = 0; i < count; i++) {
+		const struct lookup *l = &lk[i];
+		prefixhist_t *ph = prefixhist_make(ID_BITS);
+
+		memset(present, 0, nodes * sizeof present[0]);
+
+		for (j = 0; j < nodes; j++) {
+			prefixhist_window_t w[2];
+			size_t counts[WIDTH], n, r = l->removed[j], b;
+			double dkl;
+
+			prefixhist_add(ph, l->nodes[j].common);
+			present[j] = TRUE;
+
+			if (r != (size_t) -1) {
+				prefixhist_remove(ph, l->nodes[r].common);
+				present[r] = FALSE;
+			}
+
+			prefixhist_windows(ph, K, BMIN, WIDTH, w, G_N_ELEMENTS(w));
+
+			for (b = 0; b < G_N_ELEMENTS(w); b++) {
+				dkl = rescan(l, present, j + 1, BMIN + b, counts, &n);
+				check_window(&w[b], counts, n, dkl, what);
+			}
+		}
+
+		prefixhist_free_null(&ph);
+	}
+
+	xfree(present);
+}
+
+static void
+run_incremental(struct lookup *lk, size_t count, size_t nodes)
+{
+	size_t i, j;
+	double sum = 0.0;
+
+	for (i = 0; i < count; i++) {
+		const struct lookup *l = &lk[i];
+		prefixhist_t *ph = prefixhist_make(ID_BITS);
+
+		for (j = 0; j < nodes; j++) {
+			prefixhist_window_t w[2];
+			size_t r = l->removed[j];
+
+			prefixhist_add(ph, l->nodes[j].common);
+			if (r != (size_t) -1)
+				prefixhist_remove(ph, l->nodes[r].common);
+
+			prefixhist_windows(ph, K, BMIN, WIDTH, w, G_N_ELEMENTS(w));
+			sum += w[0].dkl + w[1].dkl;
+		}
+
+		prefixhist_free_null(&ph);
+	}
+
+	if (sum < 0.0)
+		test_abort("incremental");	/* Also prevents optimizing out */
+}
+
+static void
+run_rescan(struct lookup *lk, size_t count, size_t nodes)
+{
+	bool *present = xmalloc(nodes * sizeof present[0]);
+	size_t i, j;
+	double sum = 0.0;
+
+	for (i = 0; i < count; i++) {
+		const struct lookup *l = &lk[i];
+
+		memset(present, 0, nodes * sizeof present[0]);
+
+		for (j = 0; j < nodes; j++) {
+			size_t counts[WIDTH], n, r = l->removed[j];
+
+			present[j] = TRUE;
+			if (r != (size_t) -1)
+				present[r] = FALSE;
+
+			sum += rescan(l, present, j + 1, BMIN, counts, &n);
+			sum += rescan(l, present, j + 1, BMIN + 1, counts, &n);
+		}
+	}
+
+	xfree(present);
+
+	if (sum < 0.0)
+		test_abort("rescan");
+}
+
+static double
+timeit(void (*f)(struct lookup *, size_t, size_t),
+	struct lookup *lk, size_t count, size_t nodes, size_t loops)
+{
+	tm_t start, end;
+	size_t i;
+
+	tm_now_exact(&start);
+	for (i = 0; i < loops; i++)
+		(*f)(lk, count, nodes);
+	tm_now_exact(&end);
+
+	return tm_elapsed_f(&end, &start);
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	bool tflag = FALSE;
+	size_t count = DEFAULT_LOOKUPS;
+	size_t nodes = DEFAULT_NODES;
+	size_t loops = 0;
+	unsigned rseed = 0;
+	struct lookup *lk;
+	char what[80];
+	int c;
+
+	mingw_early_init();
+	progname = filepath_basename(argv[0]);
+
+	while ((c = getopt(argc, argv, "hl:n:tN:R:")) != EOF) {
+		switch (c) {
+		case 'l':			/* amount of lookups */
+			count = atol(optarg);
+			break;
+		case 'n':			/* amount of loops */
+			loops = atol(optarg);
+			break;
+		case 't':			/* timing report */
+			tflag = TRUE;
+			break;
+		case 'N':			/* amount of nodes in path */
+			nodes = atol(optarg);
+			break;
+		case 'R':			/* randomize in a repeatable way */
+			rseed = atoi(optarg);
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 0)
+		usage();
+
+	if (0 == count || 0 == nodes)
+		usage();
+
+	rand31_set_seed(rseed);
+	initial_seed = rand31_current_seed();
+
+	if (0 == loops)
+		loops = tflag ? 3 : 1;
+
+	lk = generate_lookups(count, nodes);
+
+	str_bprintf(what, sizeof what, "%zu lookups with %zu-node paths",
+		count, nodes);
+
+	run_check(lk, count, nodes);
+
+	if (tflag) {
+		double iter = (double) count * nodes * loops;
+		double tinc = timeit(run_incremental, lk, count, nodes, loops);
+		double tscan = timeit(run_rescan, lk, count, nodes, loops);
+
+		printf("%s - [%zu] incremental %.3g us/iter, rescan %.3g us/iter\n",
+			what, loops, tinc * 1e6 / iter, tscan * 1e6 / iter);
+	} else {
+		printf("%s - OK\n", what);
+	}
+
+	free_lookups(lk, count);
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
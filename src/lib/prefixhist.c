@@ -0,0 +1,333 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Histograms of common prefix lengths.
+ *
+ * A histogram counts items, typically nodes in a DHT lookup path, by the
+ * amount of leading bits they have in common with a target.  It is updated
+ * as items come and go, so that the distribution of prefix lengths among
+ * the k items closest to the target can be derived without iterating over
+ * the items: since items sharing more leading bits with the target are
+ * closer to it, the k closest items are found by walking down the histogram
+ * from the longest prefix length.
+ *
+ * The Kullback-Leibler divergence of the theoretical distribution of prefix
+ * lengths, T(i) = 1 / 2^(i + 1) for the i-th length of the window, from the
+ * measured distribution can then be computed for several consecutive
+ * windows at once, from a single walk.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include <math.h>		/* For log() */
+
+#include "prefixhist.h"
+#include "halloc.h"
+#include "once.h"
+#include "walloc.h"
+
+#include "override.h"			/* Must be the last header included */
+
+#define PREFIXHIST_LOG2_CACHE	256		/**< Cached log2(n) values */
+
+enum prefixhist_magic { PREFIXHIST_MAGIC = 0x2c5a19e7 };
+
+/**
+ * A prefix length histogram.
+ */
+struct prefixhist {
+	enum prefixhist_magic magic;
+	size_t *counts;			/**< Items by common prefix length */
+	size_t bits;			/**< Maximum prefix length */
+	size_t top;				/**< Longest prefix length held, if any items */
+	size_t total;			/**< Amount of items */
+};
+
+static inline void
+prefixhist_check(const struct prefixhist * const ph)
+{
+	g_assert(ph != NULL);
+	g_assert(PREFIXHIST_MAGIC == ph->magic);
+}
+
+static double prefixhist_log2_cache[PREFIXHIST_LOG2_CACHE];
+static double prefixhist_ln2;
+static bool prefixhist_inited;
+
+/**
+ * Compute the cached log2(n) values, once.
+ */
+static void
+prefixhist_init_once(void)
+{
+	size_t i;
+
+	prefixhist_ln2 = log(2.0);
+
+	for (i = 1; i < G_N_ELEMENTS(prefixhist_log2_cache); i++)
+		prefixhist_log2_cache[i] = log((double) i) / prefixhist_ln2;
+}
+
+/**
+ * @return log2(n), for n > 0.
+ */
+static inline double
+prefixhist_log2(size_t n)
+{
+	if G_LIKELY(n < G_N_ELEMENTS(prefixhist_log2_cache))
+		return prefixhist_log2_cache[n];
+
+	return log((double) n) / prefixhist_ln2;
+}
+
+/**
+ * Create a new histogram.
+ *
+ * @param bits		maximum common prefix length, in bits
+ *
+ * @return new empty histogram.
+ */
+prefixhist_t *
+prefixhist_make(size_t bits)
+{
+	prefixhist_t *ph;
+
+	once_run(&prefixhist_inited, prefixhist_init_once);
+
+	WALLOC0(ph);
+	ph->magic = PREFIXHIST_MAGIC;
+	ph->bits = bits;
+	ph->counts = halloc0((bits + 1) * sizeof ph->counts[0]);
+
+	return ph;
+}
+
+/**
+ * Free histogram and nullify its pointer.
+ */
+void
+prefixhist_free_null(prefixhist_t **ph_ptr)
+{
+	prefixhist_t *ph = *ph_ptr;
+
+	if (ph != NULL) {
+		prefixhist_check(ph);
+		HFREE_NULL(ph->counts);
+		ph->magic = 0;
+		WFREE(ph);
+		*ph_ptr = NULL;
+	}
+}
+
+/**
+ * Record an item sharing ``common'' leading bits with the target.
+ */
+void
+prefixhist_add(prefixhist_t *ph, size_t common)
+{
+	prefixhist_check(ph);
+	g_assert(common <= ph->bits);
+
+	if (0 == ph->total || common > ph->top)
+		ph->top = common;
+
+	ph->counts[common]++;
+	ph->total++;
+}
+
+/**
+ * Forget about an item sharing ``common'' leading bits with the target.
+ */
+void
+prefixhist_remove(prefixhist_t *ph, size_t common)
+{
+	prefixhist_check(ph);
+	g_assert(common <= ph->bits);
+	g_assert(ph->counts[common] != 0);
+	g_assert(ph->total != 0);
+
+	ph->counts[common]--;
+	ph->total--;
+
+	while (0 == ph->counts[ph->top] && ph->top != 0)
+		ph->top--;
+}
+
+/**
+ * @return amount of items in histogram.
+ */
+size_t
+prefixhist_count(const prefixhist_t *ph)
+{
+	prefixhist_check(ph);
+
+	return ph->total;
+}
+
+/**
+ * Count the amount of the k closest items whose common prefix length falls
+ * within the specified window.
+ *
+ * @param ph		the histogram
+ * @param k			amount of closest items to consider
+ * @param bmin		minimum prefix length in window
+ * @param width		amount of prefix lengths in window
+ * @param counts[]	filled with item counts, counts[i] for length bmin + i
+ *
+ * @return the amount of items falling within the window.
+ */
+size_t
+prefixhist_closest(const prefixhist_t *ph, size_t k,
+	size_t bmin, size_t width, size_t counts[])
+{
+	size_t b, taken = 0, nodes = 0;
+
+	prefixhist_check(ph);
+	g_assert(counts != NULL);
+
+	memset(counts, 0, width * sizeof counts[0]);
+
+	if (0 == ph->total)
+		return 0;
+
+	for (b = ph->top + 1; b-- > bmin && taken < k; /* empty */) {
+		size_t c = MIN(ph->counts[b], k - taken);
+
+		taken += c;
+		if (b < bmin + width) {
+			counts[b - bmin] = c;
+			nodes += c;
+		}
+	}
+
+	return nodes;
+}
+
+/**
+ * Compute the Kullback-Leibler divergence of the theoretical prefix
+ * distribution from the measured prefix distribution.
+ *
+ * @param nodes		amount of items in the window (sum of counts)
+ * @param width		amount of prefix lengths in window
+ * @param counts[]	item counts by prefix length
+ * @param contrib[]	divergence contribution by prefix length, filled in
+ *
+ * @return the value of the Kullback-Leibler divergence.
+ */
+double
+prefixhist_kl_div(size_t nodes, size_t width,
+	const size_t counts[], double contrib[])
+{
+	double lgn, dkl = 0.0;
+	size_t i;
+
+	g_assert(nodes != 0);
+	g_assert(width <= PREFIXHIST_WIDTH_MAX);
+
+	once_run(&prefixhist_inited, prefixhist_init_once);
+
+	/*
+	 * With M(i) = counts[i] / nodes and T(i) = 1 / 2^(i + 1):
+	 *
+	 * M(i) * log2(M(i) / T(i)) = M(i) * (log2(counts[i]) - log2(nodes) + i + 1)
+	 */
+
+	lgn = prefixhist_log2(nodes);
+
+	for (i = 0; i < width; i++) {
+		size_t c = counts[i];
+		double ct;
+
+		g_assert(c <= nodes);
+
+		if (0 == c) {
+			contrib[i] = 0.0;
+			continue;
+		}
+
+		ct = (double) c / nodes * (prefixhist_log2(c) - lgn + (i + 1.0));
+		contrib[i] = ct;
+		dkl += ct;
+	}
+
+	return dkl;
+}
+
+/**
+ * Compute the prefix distribution of the k closest items and its divergence
+ * for ``n'' consecutive windows, the j-th one starting at bmin + j.
+ *
+ * @param ph		the histogram
+ * @param k			amount of closest items to consider
+ * @param bmin		minimum prefix length in first window
+ * @param width		amount of prefix lengths in each window
+ * @param w			the windows to fill
+ * @param n			amount of windows
+ */
+void
+prefixhist_windows(const prefixhist_t *ph, size_t k,
+	size_t bmin, size_t width, prefixhist_window_t *w, size_t n)
+{
+	size_t span[2 * PREFIXHIST_WIDTH_MAX];
+	size_t i, j;
+
+	prefixhist_check(ph);
+	g_assert(width <= PREFIXHIST_WIDTH_MAX);
+	g_assert(n != 0 && n <= PREFIXHIST_WIDTH_MAX);
+
+	/*
+	 * A single walk of the histogram covers all the windows.
+	 */
+
+	prefixhist_closest(ph, k, bmin, width + n - 1, span);
+
+	for (j = 0; j < n; j++) {
+		prefixhist_window_t *pw = &w[j];
+
+		pw->bmin = bmin + j;
+		pw->width = width;
+		pw->nodes = 0;
+
+		for (i = 0; i < width; i++) {
+			pw->counts[i] = span[i + j];
+			pw->nodes += span[i + j];
+		}
+
+		if (0 == pw->nodes) {
+			memset(pw->contrib, 0, width * sizeof pw->contrib[0]);
+			pw->dkl = 0.0;
+		} else {
+			pw->dkl = prefixhist_kl_div(pw->nodes, width,
+				pw->counts, pw->contrib);
+		}
+	}
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Histograms of common prefix lengths.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#ifndef _prefixhist_h_
+#define _prefixhist_h_
+
+#define PREFIXHIST_WIDTH_MAX	32	/**< Maximum width of a window */
+
+typedef struct prefixhist prefixhist_t;
+
+/**
+ * Distribution of the common prefix lengths of the closest items, within
+ * a window of prefix lengths.
+ */
+typedef struct prefixhist_window {
+	size_t bmin;			/**< Prefix length of counts[0] */
+	size_t width;			/**< Amount of prefix lengths in window */
+	size_t nodes;			/**< Amount of items falling within window */
+	double dkl;				/**< K-L divergence from theoretical distribution */
+	size_t counts[PREFIXHIST_WIDTH_MAX];	/**< Items by prefix length */
+	double contrib[PREFIXHIST_WIDTH_MAX];	/**< K-L contribution by length */
+} prefixhist_window_t;
+
+/*
+ * Public interface.
+ */
+
+prefixhist_t *prefixhist_make(size_t bits);
+void prefixhist_free_null(prefixhist_t **ph_ptr);
+
+void prefixhist_add(prefixhist_t *ph, size_t common);
+void prefixhist_remove(prefixhist_t *ph, size_t common);
+size_t prefixhist_count(const prefixhist_t *ph) G_GNUC_PURE;
+
+size_t prefixhist_closest(const prefixhist_t *ph, size_t k,
+	size_t bmin, size_t width, size_t counts[]);
+void prefixhist_windows(const prefixhist_t *ph, size_t k,
+	size_t bmin, size_t width, prefixhist_window_t *w, size_t n);
+double prefixhist_kl_div(size_t nodes, size_t width,
+	const size_t counts[], double contrib[]);
+
+#endif /* _prefixhist_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,780 @@
+/*
+ * rqueue-test -- ranked queue tests and message queue stress benchmark.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This program replays a synthetic stream of messages of various priorities
+ * through a message queue serviced at a slower rate than the arrival rate,
+ * so that the queue regularly enters flow-control and drops its least
+ * important messages to make room for new ones.
+ *
+ * The ranked queue is compared with the historical message queue layout: a
+ * GList serviced from its tail, with prioritary messages inserted near the
+ * tail, and a sorted array of links created when we first need to drop
+ * messages, which is then maintained until we leave flow-control.
+ *
+ * Messages of the same rank are further ordered by hops, TTL and size, as
+ * gmsg_cmp() does for Gnutella messages of the same weight.
+ */
+
+#include "common.h"
+
+#include "rqueue.h"
+#include "glib-missing.h"
+#include "misc.h"
+#include "path.h"
+#include "rand31.h"
+#include "str.h"
+#include "tm.h"
+#include "xmalloc.h"
+
+#define DEFAULT_MESSAGES	1000000		/* Amount of messages replayed */
+#define DEFAULT_HIWAT		4000		/* Flow-control above that many messages */
+#define DEFAULT_BURST		20000		/* Period of service bursts */
+#define LEVELS				4			/* Priorities, as for pmsg_t */
+#define WEIGHTS				16			/* Message weights, per priority */
+#define RANKS				(LEVELS * WEIGHTS)
+
+#define EV_DROPPED			((size_t) 1 << (8 * sizeof(size_t) - 1))
+
+const char *progname;
+static unsigned initial_seed;
+
+/*
+ * A message, as replayed.
+ */
+struct msg {
+	size_t id;				/* Position in stream */
+	uint level;				/* Priority */
+	uint rank;				/* Drop rank, within priority */
+	uint serve;				/* Amount of messages serviced after arrival */
+	uint size;				/* Message size */
+	uint8 hops;				/* Hop count */
+	uint8 ttl;				/* Time to live */
+	bool query;				/* Whether more hops make it less important */
+};
+
+/*
+ * The replay context.
+ */
+struct replay {
+	const struct msg *stream;
+	size_t count;			/* Amount of messages in stream */
+	size_t hiwat;			/* Flow-control high watermark */
+	size_t lowat;			/* Flow-control low watermark */
+	size_t burst;			/* Period of service bursts */
+	size_t *events;			/* Log of serviced and dropped messages */
+	size_t nevents;			/* Amount of logged events */
+};
+
+/*
+ * Operations on a message queue implementation.
+ */
+struct queue_ops {
+	void *(*make)(void);
+	void (*free)(void *q);
+	size_t (*count)(const void *q);
+	void (*put)(void *q, const struct msg *m);
+	const struct msg *(*shift)(void *q);
+	const struct msg *(*lowest)(void *q);
+	void (*drop_lowest)(void *q);
+	void (*leave_flowc)(void *q);
+};
+
+static void G_GNUC_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-ht] [-b burst] [-m messages] [-n loops] [-q hiwat]\n"
+		"       [-R seed]\n"
+		"  -b : period of service bursts, in messages (default = %u)\n"
+		"  -h : prints this help message\n"
+		"  -m : amount of messages replayed (default = %u)\n"
+		"  -n : sets amount of loops\n"
+		"  -q : flow-control watermark, in messages (default = %u)\n"
+		"  -t : time each test\n"
+		"  -R : seed for repeatable random message sequence\n"
+		, progname, DEFAULT_BURST, DEFAULT_MESSAGES, DEFAULT_HIWAT);
+	exit(EXIT_FAILURE);
+}
+
+static void G_GNUC_NORETURN
+test_abort(const char *what)
+{
+	printf("%s - FAILED\n", what);
+	printf("use '-R %u' to reproduce problem.\n", initial_seed);
+	abort();
+}
+
+/*
+ * Most of the traffic is regular data, with the occasional control or
+ * urgent message.  On average, slightly less than one message is serviced
+ * for each message arriving.
+ */
+static struct msg *
+generate_stream(size_t count)
+{
+	struct msg *stream;
+	size_t i;
+
+	stream = xmalloc(count * sizeof stream[0]);
+
+	for (i = 0; i < count; i++) {
+		struct msg *m = &stream[i];
+		uint r = rand31_value(99);
+
+		m->id = i;
+		m->level = r < 90 ? 0 : r < 96 ? 1 : r < 99 ? 2 : 3;
+		m->rank = m->level * WEIGHTS + rand31_value(WEIGHTS - 1);
+		r = rand31_value(99);
+		m->serve = r < 20 ? 0 : r < 97 ? 1 : 2;
+		m->hops = rand31_value(4);
+		m->ttl = rand31_value(4);
+		m->size = 23 + rand31_value(3) * 100;
+		m->query = 0 == (m->rank & 0x1);
+	}
+
+	return stream;
+}
+
+/*
+ * Compare messages of the same rank, as gmsg_cmp() does for messages of the
+ * same weight: the more hops a query has travelled, the less important it
+ * is, whereas replies become more important, then favoring the lowest TTL
+ * for replies and the shortest message.
+ */
+static int
+msg_cmp(const void *a, const void *b)
+{
+	const struct msg *m1 = a, *m2 = b;
+
+	if (m1->hops != m2->hops) {
+		if (m1->query)
+			return m1->hops > m2->hops ? -1 : +1;
+		return m1->hops < m2->hops ? -1 : +1;
+	}
+
+	if (!m1->query && m1->ttl != m2->ttl)
+		return CMP(m2->ttl, m1->ttl);
+
+	return CMP(m2->size, m1->size);
+}
+
+/*
+ * Full comparison of messages: by rank, then within the rank.
+ */
+static int
+msg_full_cmp(const struct msg *m1, const struct msg *m2)
+{
+	if (m1->rank != m2->rank)
+		return m1->rank < m2->rank ? -1 : +1;
+
+	return msg_cmp(m1, m2);
+}
+
+/*
+ * Historical queue: GList serviced from its tail, with a sorted array of
+ * links used to find the messages to drop during flow-control.
+ */
+struct hist {
+	GList *head, *tail;
+	GList **qlink;
+	size_t qlink_count;
+	size_t count;
+};
+
+static int
+hist_cmp(const void *a, const void *b)
+{
+	const GList * const *l1 = a, * const *l2 = b;
+	const struct msg *m1 = (*l1)->data, *m2 = (*l2)->data;
+	int c = msg_full_cmp(m1, m2);
+
+	return 0 != c ? c : CMP(m1->id, m2->id);
+}
+
+static void *
+hist_make(void)
+{
+	return xmalloc0(sizeof(struct hist));
+}
+
+static void
+hist_leave_flowc(void *q)
+{
+	struct hist *h = q;
+
+	XFREE_NULL(h->qlink);
+	h->qlink_count = 0;
+}
+
+static void
+hist_free(void *q)
+{
+	struct hist *h = q;
+
+	hist_leave_flowc(h);
+	g_list_free(h->head);
+	xfree(h);
+}
+
+static size_t
+hist_count(const void *q)
+{
+	const struct hist *h = q;
+
+	return h->count;
+}
+
+/*
+ * Insert link in the sorted array, compacting it first.
+ */
+static void
+hist_qlink_insert(struct hist *h, GList *l)
+{
+	size_t i, n, low, high;
+
+	for (i = n = 0; i < h->qlink_count; i++) {
+		if (h->qlink[i] != NULL)
+			h->qlink[n++] = h->qlink[i];
+	}
+
+	low = 0;
+	high = n;
+
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+
+		if (hist_cmp(&h->qlink[mid], &l) < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	h->qlink = xrealloc(h->qlink, (n + 1) * sizeof h->qlink[0]);
+	memmove(&h->qlink[low + 1], &h->qlink[low], (n - low) * sizeof h->qlink[0]);
+	h->qlink[low] = l;
+	h->qlink_count = n + 1;
+}
+
+static void
+hist_put(void *q, const struct msg *m)
+{
+	struct hist *h = q;
+	GList *l, *new = NULL;
+
+	/*
+	 * Regular messages are prepended, others are inserted near the tail,
+	 * after all the messages of the same or higher priority.
+	 */
+
+	for (l = 0 == m->level ? NULL : h->tail; l; l = g_list_previous(l)) {
+		const struct msg *lm = l->data;
+
+		if (lm->level < m->level) {
+			h->head = gm_list_insert_after(h->head, l, deconstify_pointer(m));
+			new = g_list_next(l);
+			if (l == h->tail)
+				h->tail = new;
+			break;
+		}
+	}
+
+	if (NULL == new) {
+		new = h->head = g_list_prepend(h->head, deconstify_pointer(m));
+		if (NULL == h->tail)
+			h->tail = h->head;
+	}
+
+	h->count++;
+
+	if (h->qlink != NULL)
+		hist_qlink_insert(h, new);
+}
+
+static void
+hist_remove(struct hist *h, GList *l)
+{
+	if (h->qlink != NULL) {
+		size_t i;
+
+		for (i = 0; i < h->qlink_count; i++) {
+			if (l == h->qlink[i]) {
+				h->qlink[i] = NULL;
+				break;
+			}
+		}
+	}
+
+	if (h->tail == l)
+		h->tail = g_list_previous(l);
+	h->head = g_list_delete_link(h->head, l);
+	h->count--;
+}
+
+static const struct msg *
+hist_shift(void *q)
+{
+	struct hist *h = q;
+	const struct msg *m;
+
+	if (NULL == h->tail)
+		return NULL;
+
+	m = h->tail->data;
+	hist_remove(h, h->tail);
+
+	return m;
+}
+
+static GList *
+hist_lowest_link(struct hist *h)
+{
+	size_t i;
+
+	if (NULL == h->qlink && h->count != 0) {
+		GList *l;
+
+		h->qlink = xmalloc(h->count * sizeof h->qlink[0]);
+		for (i = 0, l = h->head; l != NULL; l = g_list_next(l))
+			h->qlink[i++] = l;
+		h->qlink_count = i;
+		qsort(h->qlink, i, sizeof h->qlink[0], hist_cmp);
+	}
+
+	for (i = 0; i < h->qlink_count; i++) {
+		if (h->qlink[i] != NULL)
+			return h->qlink[i];
+	}
+
+	return NULL;
+}
+
+static const struct msg *
+hist_lowest(void *q)
+{
+	GList *l = hist_lowest_link(q);
+
+	return NULL == l ? NULL : l->data;
+}
+
+static void
+hist_drop_lowest(void *q)
+{
+	GList *l = hist_lowest_link(q);
+
+	g_assert(l != NULL);
+
+	hist_remove(q, l);
+}
+
+static const struct queue_ops hist_ops = {
+	hist_make,
+	hist_free,
+	hist_count,
+	hist_put,
+	hist_shift,
+	hist_lowest,
+	hist_drop_lowest,
+	hist_leave_flowc,
+};
+
+/*
+ * Ranked queue.
+ */
+
+static void *
+rq_make(void)
+{
+	return rqueue_make(LEVELS, RANKS, msg_cmp);
+}
+
+static void
+rq_free(void *q)
+{
+	rqueue_t *rq = q;
+
+	rqueue_free_null(&rq);
+}
+
+static size_t
+rq_count(const void *q)
+{
+	return rqueue_count(q);
+}
+
+static void
+rq_put(void *q, const struct msg *m)
+{
+	rqueue_put(q, m->level, m->rank, deconstify_pointer(m));
+}
+
+static const struct msg *
+rq_shift(void *q)
+{
+	return rqueue_shift(q);
+}
+
+static const struct msg *
+rq_lowest(void *q)
+{
+	return rqueue_lowest(q, NULL);
+}
+
+static void
+rq_drop_lowest(void *q)
+{
+	(void) rqueue_drop_lowest(q);
+}
+
+static void
+rq_leave_flowc(void *q)
+{
+	(void) q;
+}
+
+static const struct queue_ops rq_ops = {
+	rq_make,
+	rq_free,
+	rq_count,
+	rq_put,
+	rq_shift,
+	rq_lowest,
+	rq_drop_lowest,
+	rq_leave_flowc,
+};
+
+static void
+log_event(struct replay *r, const struct msg *m, bool dropped)
+{
+	r->events[r->nevents++] = m->id | (dropped ? EV_DROPPED : 0);
+}
+
+static void
+serve(const struct queue_ops *ops, void *q, struct replay *r, size_t n)
+{
+	while (n-- != 0) {
+		const struct msg *m = (*ops->shift)(q);
+
+		if (NULL == m)
+			break;
+		log_event(r, m, FALSE);
+	}
+}
+
+/*
+ * Replay the stream, as the message queue would process it.
+ *
+ * In flow-control, room is made for each new message by dropping the
+ * least important queued one, provided it is less important than the new
+ * message, otherwise the new message is dropped.
+ */
+static void
+replay(const struct queue_ops *ops, struct replay *r, size_t loops)
+{
+	while (loops-- != 0) {
+		void *q = (*ops->make)();
+		bool flowc = FALSE;
+		size_t i;
+
+		r->nevents = 0;
+
+		for (i = 0; i < r->count; i++) {
+			const struct msg *m = &r->stream[i];
+
+			if (flowc) {
+				const struct msg *low = (*ops->lowest)(q);
+
+				if (low != NULL && msg_full_cmp(low, m) < 0) {
+					(*ops->drop_lowest)(q);
+					log_event(r, low, TRUE);
+				} else {
+					log_event(r, m, TRUE);
+					goto service;
+				}
+			}
+
+			(*ops->put)(q, m);
+
+		service:
+			serve(ops, q, r, m->serve);
+
+			if (0 == (i + 1) % r->burst)
+				serve(ops, q, r, (*ops->count)(q) / 2);
+
+			if (!flowc && (*ops->count)(q) >= r->hiwat) {
+				flowc = TRUE;
+			} else if (flowc && (*ops->count)(q) <= r->lowat) {
+				flowc = FALSE;
+				(*ops->leave_flowc)(q);
+			}
+		}
+
+		serve(ops, q, r, (*ops->count)(q));
+		(*ops->free)(q);
+	}
+}
+
+static double
+timeit(const struct queue_ops *ops, struct replay *r, size_t loops)
+{
+	tm_t start, end;
+	double ustart, uend;
+
+	tm_now_exact(&start);
+	tm_cputime(&ustart, NULL);
+	replay(ops, r, loops);
+	tm_cputime(&uend, NULL);
+	tm_now_exact(&end);
+
+	return ustart == uend ? tm_elapsed_f(&end, &start) : uend - ustart;
+}
+
+/*
+ * Check iteration in service order and removal during iteration.
+ */
+static void
+test_iter(const struct msg *stream, size_t count, const char *what)
+{
+	rqueue_t *rq = rqueue_make(LEVELS, RANKS, msg_cmp);
+	void *q = hist_make();
+	rqueue_iter_t *ri;
+	const struct msg *m;
+	GList *l;
+	size_t i, n = MIN(count, 1000);
+
+	for (i = 0; i < n; i++) {
+		rqueue_put(rq, stream[i].level, stream[i].rank,
+			deconstify_pointer(&stream[i]));
+		hist_put(q, &stream[i]);
+	}
+
+	/*
+	 * Remove every third message through the iterator.
+	 */
+
+	ri = rqueue_iter_new(rq);
+	i = 0;
+
+	while (NULL != (m = rqueue_iter_next(ri))) {
+		if (0 == i++ % 3) {
+			struct hist *h = q;
+
+			if (m != rqueue_iter_remove(ri))
+				test_abort(what);
+
+			for (l = h->head; l != NULL; l = g_list_next(l)) {
+				if (l->data == m)
+					break;
+			}
+			if (NULL == l)
+				test_abort(what);
+			hist_remove(h, l);
+		}
+	}
+
+	rqueue_iter_release(&ri);
+
+	if (rqueue_count(rq) != hist_count(q))
+		test_abort(what);
+
+	while (NULL != (m = rqueue_shift(rq))) {
+		if (m != hist_shift(q))
+			test_abort(what);
+	}
+
+	if (0 != hist_count(q) || NULL != rqueue_lowest(rq, NULL))
+		test_abort(what);
+
+	hist_free(q);
+	rqueue_free_null(&rq);
+}
+
+/*
+ * Check that items are dropped in hops/TTL order within each rank, or in
+ * FIFO order when there is no comparison routine, including after some of
+ * them were served.
+ */
+static void
+test_drop(const struct msg *stream, size_t count, rqueue_cmp_t cmp,
+	const char *what)
+{
+	rqueue_t *rq = rqueue_make(LEVELS, RANKS, cmp);
+	const struct msg *m, *prev = NULL;
+	size_t i, n = MIN(count, 5000);
+
+	for (i = 0; i < n; i++) {
+		rqueue_put(rq, stream[i].level, stream[i].rank,
+			deconstify_pointer(&stream[i]));
+		if (0 == i % 4)
+			(void) rqueue_shift(rq);
+	}
+
+	while (NULL != (m = rqueue_lowest(rq, NULL))) {
+		if (m != rqueue_drop_lowest(rq))
+			test_abort(what);
+
+		if (prev != NULL) {
+			int c = prev->rank != m->rank ? CMP(prev->rank, m->rank) :
+				NULL == cmp ? 0 : msg_cmp(prev, m);
+
+			if (c > 0 || (0 == c && prev->id > m->id))
+				test_abort(what);
+		}
+		prev = m;
+	}
+
+	if (0 != rqueue_count(rq))
+		test_abort(what);
+
+	rqueue_free_null(&rq);
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	bool tflag = FALSE;
+	size_t count = DEFAULT_MESSAGES;
+	size_t hiwat = DEFAULT_HIWAT;
+	size_t burst = DEFAULT_BURST;
+	size_t loops = 0;
+	unsigned rseed = 0;
+	struct replay ref, res;
+	struct msg *stream;
+	size_t i, ndropped;
+	char what[80];
+	int c;
+
+	mingw_early_init();
+	progname = filepath_basename(argv[0]);
+
+	while ((c = getopt(argc, argv, "b:hm:n:q:tR:")) != EOF) {
+		switch (c) {
+		case 'b':			/* period of service bursts */
+			burst = atol(optarg);
+			break;
+		case 'm':			/* amount of messages */
+			count = atol(optarg);
+			break;
+		case 'n':			/* amount of loops */
+			loops = atol(optarg);
+			break;
+		case 'q':			/* flow-control watermark */
+			hiwat = atol(optarg);
+			break;
+		case 't':			/* timing report */
+			tflag = TRUE;
+			break;
+		case 'R':			/* randomize in a repeatable way */
+			rseed = atoi(optarg);
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 0)
+		usage();
+
+	if (0 == count || hiwat < 2 || 0 == burst)
+		usage();
+
+	rand31_set_seed(rseed);
+	initial_seed = rand31_current_seed();
+
+	if (0 == loops)
+		loops = tflag ? 3 : 1;
+
+	stream = generate_stream(count);
+
+	ZERO(&ref);
+	ref.stream = stream;
+	ref.count = count;
+	ref.hiwat = hiwat;
+	ref.lowat = hiwat / 2;
+	ref.burst = burst;
+	res = ref;				/* Struct copy */
+
+	ref.events = xmalloc(2 * count * sizeof ref.events[0]);
+	res.events = xmalloc(2 * count * sizeof res.events[0]);
+
+	str_bprintf(what, sizeof what, "%zu messages, flow-control at %zu",
+		count, hiwat);
+
+	{
+		double thist, trq;
+
+		thist = timeit(&hist_ops, &ref, loops);
+		trq = timeit(&rq_ops, &res, loops);
+
+		if (
+			ref.nevents != res.nevents ||
+			0 != memcmp(ref.events, res.events,
+					ref.nevents * sizeof ref.events[0])
+		)
+			test_abort(what);
+
+		test_iter(stream, count, what);
+		test_drop(stream, count, msg_cmp, what);
+		test_drop(stream, count, NULL, what);
+
+		for (i = 0, ndropped = 0; i < res.nevents; i++) {
+			if (res.events[i] & EV_DROPPED)
+				ndropped++;
+		}
+
+		if (res.nevents != count)		/* Each message is logged once */
+			test_abort(what);
+
+		if (tflag) {
+			printf("%s - [%zu] glist=%.3gs (%.3g msg/s), "
+				"rqueue=%.3gs (%.3g msg/s), speedup=%.2f\n",
+				what, loops,
+				thist, thist > 0.0 ? count * loops / thist : 0.0,
+				trq, trq > 0.0 ? count * loops / trq : 0.0,
+				trq > 0.0 ? thist / trq : 0.0);
+		} else {
+			printf("%s - %zu messages dropped - OK\n", what, ndropped);
+		}
+	}
+
+	xfree(ref.events);
+	xfree(res.events);
+	xfree(stream);
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
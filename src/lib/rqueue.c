@@ -0,0 +1,682 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Ranked queues.
+ *
+ * A ranked queue holds items in FIFO order within a set of levels, the
+ * items of the highest level being always served first.  Each item is also
+ * given a rank, independent of its level, and the queue can supply the
+ * least important item of the lowest rank, so that it can be dropped when
+ * the queue must be shrunk.  Within a rank, items are ordered by the
+ * comparison routine supplied at creation time, the oldest item coming
+ * first among items comparing equal (or when there is no routine).
+ *
+ * Each level is a circular buffer of slots, addressed by an ever increasing
+ * sequence number.  Each rank is a binary heap of references to these
+ * slots.  Removing an item from its level outside the head of the buffer
+ * simply clears the slot, and references to cleared or already served
+ * slots are discarded lazily when they reach the top of the rank heap, or
+ * when the heap is rebuilt because it holds too many of them.  Therefore,
+ * serving items runs in amortized constant time and enqueuing or dropping
+ * them in amortized logarithmic time.
+ *
+ * Non-empty levels and ranks are tracked in bitmaps, which is why there
+ * cannot be more than RQUEUE_MAX of each.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "rqueue.h"
+#include "halloc.h"
+#include "pow2.h"
+#include "walloc.h"
+
+#include "override.h"			/* Must be the last header included */
+
+#define RQUEUE_MIN_SLOTS	16	/**< Initial size of circular buffers and heaps */
+
+enum rqueue_magic { RQUEUE_MAGIC = 0x1f3a92c5 };
+enum rqueue_iter_magic { RQUEUE_ITER_MAGIC = 0x6b20d47e };
+
+/**
+ * A slot within a level.
+ */
+struct rq_slot {
+	void *item;				/**< The item, NULL if removed */
+	uint rank;				/**< Rank of the item */
+};
+
+/**
+ * A reference to a level slot, held in a rank.
+ */
+struct rq_ref {
+	void *item;				/**< The item, for comparisons */
+	size_t stamp;			/**< Enqueuing order, to break ties */
+	size_t seq;				/**< Sequence number of the slot */
+	uint level;				/**< Level holding the slot */
+};
+
+/**
+ * A circular buffer.
+ *
+ * The ``head'' and ``tail'' indices are never wrapped, the physical position
+ * of an entry being given by masking its index with ``mask''.
+ */
+struct rq_ring {
+	void *base;				/**< The entries */
+	size_t mask;			/**< Capacity - 1, or 0 when nothing allocated */
+	size_t head;			/**< Index of first entry */
+	size_t tail;			/**< Index of next entry to fill */
+};
+
+/**
+ * A binary heap of slot references, the least important item at the top.
+ */
+struct rq_heap {
+	struct rq_ref *refs;	/**< The references, some maybe stale */
+	size_t count;			/**< Amount of references */
+	size_t capacity;		/**< Amount of references allocated */
+	size_t live;			/**< Amount of items of that rank held */
+};
+
+/**
+ * A ranked queue.
+ */
+struct rqueue {
+	enum rqueue_magic magic;
+	uint levels;			/**< Amount of levels */
+	uint ranks;				/**< Amount of ranks */
+	size_t count;			/**< Amount of items held */
+	size_t stamp;			/**< Amount of items ever enqueued */
+	uint64 lmap;			/**< Non-empty levels */
+	uint64 rmap;			/**< Non-empty ranks */
+	rqueue_cmp_t cmp;		/**< Optional item comparison routine */
+	struct rq_ring *level;	/**< Slots, for each level */
+	struct rq_heap *rank;	/**< References to slots, for each rank */
+};
+
+/**
+ * A ranked queue iterator, traversing items in the order they would be
+ * served by rqueue_shift().
+ */
+struct rqueue_iter {
+	enum rqueue_iter_magic magic;
+	rqueue_t *rq;			/**< Queue being iterated over */
+	uint64 lmap;			/**< Levels not visited yet */
+	int level;				/**< Current level, -1 before starting */
+	size_t seq;				/**< Next slot to visit within level */
+	size_t last;			/**< Slot of last item returned */
+	bool valid;				/**< Whether ``last'' is valid */
+};
+
+static inline void
+rqueue_check(const struct rqueue * const rq)
+{
+	g_assert(rq != NULL);
+	g_assert(RQUEUE_MAGIC == rq->magic);
+}
+
+static inline void
+rqueue_iter_check(const struct rqueue_iter * const ri)
+{
+	g_assert(ri != NULL);
+	g_assert(RQUEUE_ITER_MAGIC == ri->magic);
+	rqueue_check(ri->rq);
+}
+
+static inline size_t
+rq_ring_count(const struct rq_ring *r)
+{
+	return r->tail - r->head;
+}
+
+static inline struct rq_slot *
+rq_slot(const struct rq_ring *r, size_t seq)
+{
+	struct rq_slot *slots = r->base;
+	return &slots[seq & r->mask];
+}
+
+/**
+ * Make sure there is room for one more entry in the circular buffer.
+ *
+ * Entries keep their index, hence they are moved to the position given
+ * by the new mask when the buffer is enlarged.
+ */
+static void
+rq_ring_reserve(struct rq_ring *r, size_t entry_size)
+{
+	size_t capacity, i;
+	char *base;
+
+	if (r->base != NULL && rq_ring_count(r) <= r->mask)
+		return;
+
+	capacity = NULL == r->base ? RQUEUE_MIN_SLOTS : 2 * (r->mask + 1);
+	base = halloc(capacity * entry_size);
+
+	for (i = r->head; i != r->tail; i++) {
+		memcpy(&base[(i & (capacity - 1)) * entry_size],
+			(char *) r->base + (i & r->mask) * entry_size, entry_size);
+	}
+
+	HFREE_NULL(r->base);
+	r->base = base;
+	r->mask = capacity - 1;
+}
+
+/**
+ * Create a new ranked queue.
+ *
+ * @param levels	amount of levels, items of higher levels being served first
+ * @param ranks		amount of ranks, items of lower ranks being dropped first
+ * @param cmp		if non-NULL, items of a rank comparing lower are dropped
+ *					first, otherwise the oldest item of a rank is dropped first
+ */
+rqueue_t *
+rqueue_make(uint levels, uint ranks, rqueue_cmp_t cmp)
+{
+	rqueue_t *rq;
+
+	g_assert(levels > 0 && levels <= RQUEUE_MAX);
+	g_assert(ranks > 0 && ranks <= RQUEUE_MAX);
+
+	WALLOC0(rq);
+	rq->magic = RQUEUE_MAGIC;
+	rq->levels = levels;
+	rq->ranks = ranks;
+	rq->cmp = cmp;
+	rq->level = halloc0(levels * sizeof rq->level[0]);
+	rq->rank = halloc0(ranks * sizeof rq->rank[0]);
+
+	return rq;
+}
+
+/**
+ * Free ranked queue and nullify its pointer.
+ *
+ * The items still held in the queue are not freed.
+ */
+void
+rqueue_free_null(rqueue_t **rq_ptr)
+{
+	rqueue_t *rq = *rq_ptr;
+
+	if (rq != NULL) {
+		uint i;
+
+		rqueue_check(rq);
+
+		for (i = 0; i < rq->levels; i++)
+			HFREE_NULL(rq->level[i].base);
+		for (i = 0; i < rq->ranks; i++)
+			HFREE_NULL(rq->rank[i].refs);
+
+		HFREE_NULL(rq->level);
+		HFREE_NULL(rq->rank);
+		rq->magic = 0;
+		WFREE(rq);
+		*rq_ptr = NULL;
+	}
+}
+
+/**
+ * @return amount of items held in the queue.
+ */
+size_t
+rqueue_count(const rqueue_t *rq)
+{
+	rqueue_check(rq);
+
+	return rq->count;
+}
+
+/**
+ * Skip removed slots at the head of a level.
+ */
+static void
+rq_level_trim(rqueue_t *rq, uint level)
+{
+	struct rq_ring *r = &rq->level[level];
+
+	while (r->head != r->tail && NULL == rq_slot(r, r->head)->item)
+		r->head++;
+
+	if (r->head == r->tail)
+		rq->lmap &= ~((uint64) 1 << level);
+}
+
+/**
+ * Is the reference still pointing to an item held in the queue?
+ */
+static inline bool
+rq_ref_is_live(const rqueue_t *rq, const struct rq_ref *ref)
+{
+	const struct rq_ring *r = &rq->level[ref->level];
+
+	if (ref->seq < r->head || ref->seq >= r->tail)
+		return FALSE;
+
+	return NULL != rq_slot(r, ref->seq)->item;
+}
+
+/**
+ * Should the item referenced by ``a'' be dropped before that of ``b''?
+ */
+static inline bool
+rq_ref_before(const rqueue_t *rq, const struct rq_ref *a, const struct rq_ref *b)
+{
+	if (rq->cmp != NULL) {
+		int c = (*rq->cmp)(a->item, b->item);
+		if (c != 0)
+			return c < 0;
+	}
+
+	return a->stamp < b->stamp;
+}
+
+/**
+ * Move the reference at index ``i'' up the heap until its parent comes first.
+ */
+static void
+rq_heap_sift_up(const rqueue_t *rq, struct rq_heap *h, size_t i)
+{
+	struct rq_ref ref = h->refs[i];
+
+	while (i != 0) {
+		size_t parent = (i - 1) / 2;
+
+		if (!rq_ref_before(rq, &ref, &h->refs[parent]))
+			break;
+
+		h->refs[i] = h->refs[parent];
+		i = parent;
+	}
+
+	h->refs[i] = ref;
+}
+
+/**
+ * Move the reference at index ``i'' down the heap until it comes before
+ * its children.
+ */
+static void
+rq_heap_sift_down(const rqueue_t *rq, struct rq_heap *h, size_t i)
+{
+	struct rq_ref ref = h->refs[i];
+
+	for (;;) {
+		size_t child = 2 * i + 1;
+
+		if (child >= h->count)
+			break;
+
+		if (
+			child + 1 < h->count &&
+			rq_ref_before(rq, &h->refs[child + 1], &h->refs[child])
+		)
+			child++;
+
+		if (!rq_ref_before(rq, &h->refs[child], &ref))
+			break;
+
+		h->refs[i] = h->refs[child];
+		i = child;
+	}
+
+	h->refs[i] = ref;
+}
+
+/**
+ * Remove the reference at the top of the heap.
+ */
+static void
+rq_heap_pop(const rqueue_t *rq, struct rq_heap *h)
+{
+	g_assert(h->count != 0);
+
+	if (0 != --h->count) {
+		h->refs[0] = h->refs[h->count];
+		rq_heap_sift_down(rq, h, 0);
+	}
+}
+
+/**
+ * Rebuild the heap with its live references only.
+ */
+static void
+rq_heap_rebuild(const rqueue_t *rq, struct rq_heap *h)
+{
+	size_t i, n;
+
+	for (i = n = 0; i < h->count; i++) {
+		if (rq_ref_is_live(rq, &h->refs[i]))
+			h->refs[n++] = h->refs[i];
+	}
+
+	g_assert(n == h->live);
+
+	h->count = n;
+
+	for (i = n / 2; i != 0; i--)
+		rq_heap_sift_down(rq, h, i - 1);
+}
+
+/**
+ * Discard stale references at the top of a rank.
+ */
+static void
+rq_rank_trim(rqueue_t *rq, uint rank)
+{
+	struct rq_heap *h = &rq->rank[rank];
+
+	while (h->count != 0 && !rq_ref_is_live(rq, &h->refs[0]))
+		rq_heap_pop(rq, h);
+}
+
+/**
+ * Remove the item held in the slot of a level.
+ *
+ * @return the removed item.
+ */
+static void *
+rq_slot_remove(rqueue_t *rq, uint level, size_t seq)
+{
+	struct rq_ring *r = &rq->level[level];
+	struct rq_slot *s = rq_slot(r, seq);
+	struct rq_heap *h = &rq->rank[s->rank];
+	void *item = s->item;
+
+	g_assert(item != NULL);
+	g_assert(rq->count != 0);
+	g_assert(h->live != 0);
+
+	s->item = NULL;
+	rq->count--;
+
+	/*
+	 * When the last item of a rank goes, all its references are stale.
+	 */
+
+	if (0 == --h->live) {
+		h->count = 0;
+		rq->rmap &= ~((uint64) 1 << s->rank);
+	}
+
+	if (seq == r->head)
+		rq_level_trim(rq, level);
+
+	return item;
+}
+
+/**
+ * Append item to the queue.
+ *
+ * @param rq		the ranked queue
+ * @param level		the level of the item, determining the service order
+ * @param rank		the rank of the item, determining the drop order
+ * @param item		the item to enqueue (cannot be NULL)
+ */
+void
+rqueue_put(rqueue_t *rq, uint level, uint rank, void *item)
+{
+	struct rq_ring *lr;
+	struct rq_heap *h;
+	struct rq_slot *s;
+	struct rq_ref *ref;
+
+	rqueue_check(rq);
+	g_assert(level < rq->levels);
+	g_assert(rank < rq->ranks);
+	g_assert(item != NULL);
+
+	lr = &rq->level[level];
+	rq_ring_reserve(lr, sizeof(struct rq_slot));
+	s = rq_slot(lr, lr->tail);
+	s->item = item;
+	s->rank = rank;
+
+	/*
+	 * Items served or removed leave their stale references behind in the
+	 * rank heap, where they may not reach the top for a long time.  Get
+	 * rid of them when they outnumber the items held.
+	 */
+
+	h = &rq->rank[rank];
+
+	if (h->count >= 2 * h->live + RQUEUE_MIN_SLOTS)
+		rq_heap_rebuild(rq, h);
+
+	if (h->count == h->capacity) {
+		h->capacity = MAX(RQUEUE_MIN_SLOTS, 2 * h->capacity);
+		h->refs = hrealloc(h->refs, h->capacity * sizeof h->refs[0]);
+	}
+
+	ref = &h->refs[h->count++];
+	ref->item = item;
+	ref->stamp = rq->stamp++;
+	ref->seq = lr->tail++;
+	ref->level = level;
+	rq_heap_sift_up(rq, h, h->count - 1);
+
+	h->live++;
+	rq->lmap |= (uint64) 1 << level;
+	rq->rmap |= (uint64) 1 << rank;
+	rq->count++;
+}
+
+/**
+ * @return the next item to be served, NULL if the queue is empty.
+ */
+void *
+rqueue_head(const rqueue_t *rq)
+{
+	const struct rq_ring *r;
+
+	rqueue_check(rq);
+
+	if (0 == rq->lmap)
+		return NULL;
+
+	r = &rq->level[highest_bit_set64(rq->lmap)];
+	return rq_slot(r, r->head)->item;
+}
+
+/**
+ * Remove the next item to be served, i.e. the oldest item of the highest
+ * non-empty level.
+ *
+ * @return the removed item, NULL if the queue was empty.
+ */
+void *
+rqueue_shift(rqueue_t *rq)
+{
+	uint level;
+	struct rq_ring *r;
+
+	rqueue_check(rq);
+
+	if (0 == rq->lmap)
+		return NULL;
+
+	level = highest_bit_set64(rq->lmap);
+	r = &rq->level[level];
+
+	return rq_slot_remove(rq, level, r->head);
+}
+
+/**
+ * Get the least important item of the lowest rank, which is the first
+ * candidate to be dropped when the queue has to be shrunk.
+ *
+ * @param rq		the ranked queue
+ * @param rank		if non-NULL, written with the rank of the item returned
+ *
+ * @return the item, NULL if the queue is empty.
+ */
+void *
+rqueue_lowest(rqueue_t *rq, uint *rank)
+{
+	struct rq_heap *h;
+	uint i;
+
+	rqueue_check(rq);
+
+	if (0 == rq->rmap)
+		return NULL;
+
+	i = ctz64(rq->rmap);
+	h = &rq->rank[i];
+	rq_rank_trim(rq, i);
+
+	g_assert(h->count != 0);		/* Rank has live items */
+
+	if (rank != NULL)
+		*rank = i;
+
+	return h->refs[0].item;
+}
+
+/**
+ * Remove the item that rqueue_lowest() would return.
+ *
+ * @return the removed item, NULL if the queue was empty.
+ */
+void *
+rqueue_drop_lowest(rqueue_t *rq)
+{
+	struct rq_heap *h;
+	struct rq_ref ref;
+	uint rank;
+
+	if (NULL == rqueue_lowest(rq, &rank))
+		return NULL;
+
+	h = &rq->rank[rank];
+	ref = h->refs[0];				/* Struct copy */
+	rq_heap_pop(rq, h);
+
+	return rq_slot_remove(rq, ref.level, ref.seq);
+}
+
+/**
+ * Create an iterator to traverse the items in the order they would be
+ * served.  The queue cannot be modified during the traversal, except
+ * through rqueue_iter_remove().
+ */
+rqueue_iter_t *
+rqueue_iter_new(rqueue_t *rq)
+{
+	rqueue_iter_t *ri;
+
+	rqueue_check(rq);
+
+	WALLOC0(ri);
+	ri->magic = RQUEUE_ITER_MAGIC;
+	ri->rq = rq;
+	ri->lmap = rq->lmap;
+	ri->level = -1;
+
+	return ri;
+}
+
+/**
+ * Release iterator and nullify its pointer.
+ */
+void
+rqueue_iter_release(rqueue_iter_t **iter_ptr)
+{
+	rqueue_iter_t *ri = *iter_ptr;
+
+	if (ri != NULL) {
+		rqueue_iter_check(ri);
+		ri->magic = 0;
+		WFREE(ri);
+		*iter_ptr = NULL;
+	}
+}
+
+/**
+ * @return next item in service order, NULL when the traversal is over.
+ */
+void *
+rqueue_iter_next(rqueue_iter_t *ri)
+{
+	rqueue_iter_check(ri);
+
+	ri->valid = FALSE;
+
+	for (;;) {
+		if (ri->level >= 0) {
+			const struct rq_ring *r = &ri->rq->level[ri->level];
+
+			while (ri->seq < r->tail) {
+				size_t seq = ri->seq++;
+				void *item = rq_slot(r, seq)->item;
+
+				if (item != NULL) {
+					ri->last = seq;
+					ri->valid = TRUE;
+					return item;
+				}
+			}
+		}
+
+		if (0 == ri->lmap)
+			return NULL;
+
+		ri->level = highest_bit_set64(ri->lmap);
+		ri->lmap &= ~((uint64) 1 << ri->level);
+		ri->seq = ri->rq->level[ri->level].head;
+	}
+}
+
+/**
+ * Remove the item last returned by rqueue_iter_next().
+ *
+ * @return the removed item.
+ */
+void *
+rqueue_iter_remove(rqueue_iter_t *ri)
+{
+	rqueue_iter_check(ri);
+	g_assert(ri->valid);
+
+	ri->valid = FALSE;
+
+	/*
+	 * The reference to the slot held by the item rank is left behind: it
+	 * will be discarded as stale when it reaches the top of its rank heap.
+	 */
+
+	return rq_slot_remove(ri->rq, ri->level, ri->last);
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Ranked queues.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#ifndef _rqueue_h_
+#define _rqueue_h_
+
+#define RQUEUE_MAX	64		/**< Maximum amount of levels or ranks */
+
+typedef struct rqueue rqueue_t;
+
+struct rqueue_iter;
+typedef struct rqueue_iter rqueue_iter_t;
+
+/**
+ * Item comparison routine, returning a negative value when the first item
+ * is less important than the second one.
+ */
+typedef int (*rqueue_cmp_t)(const void *a, const void *b);
+
+/*
+ * Public interface.
+ */
+
+rqueue_t *rqueue_make(uint levels, uint ranks, rqueue_cmp_t cmp);
+void rqueue_free_null(rqueue_t **rq_ptr);
+
+size_t rqueue_count(const rqueue_t *rq) G_GNUC_PURE;
+
+void rqueue_put(rqueue_t *rq, uint level, uint rank, void *item);
+void *rqueue_head(const rqueue_t *rq) G_GNUC_PURE;
+void *rqueue_shift(rqueue_t *rq);
+void *rqueue_lowest(rqueue_t *rq, uint *rank);
+void *rqueue_drop_lowest(rqueue_t *rq);
+
+rqueue_iter_t *rqueue_iter_new(rqueue_t *rq);
+void rqueue_iter_release(rqueue_iter_t **iter_ptr);
+void *rqueue_iter_next(rqueue_iter_t *ri);
+void *rqueue_iter_remove(rqueue_iter_t *ri);
+
+#endif /* _rqueue_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,487 @@
+/*
+ * tbitmap-test -- transposed bitmap tests and benchmarking.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This program simulates the routing of queries to leaves by an ultrapeer,
+ * using synthetic leaf QRP tables of various sizes loaded in a transposed
+ * bitmap, and compares the candidates found through the transposed rows
+ * with those found by probing each leaf table in turn.
+ */
+
+#include "common.h"
+
+#include "misc.h"
+#include "path.h"
+#include "rand31.h"
+#include "str.h"
+#include "tbitmap.h"
+#include "tm.h"
+#include "xmalloc.h"
+
+#define DEFAULT_LEAVES	300			/* Amount of leaf tables */
+#define DEFAULT_BITS	16			/* 64K rows in the transposed bitmap */
+#define DEFAULT_FILL	1			/* 1% of slots filled */
+#define DEFAULT_QUERIES	10000		/* Amount of queries routed */
+#define QUERY_WORDS		3			/* Max amount of words per query */
+
+const char *progname;
+static unsigned initial_seed;
+
+struct leaf_table {
+	uint8 *arena;					/* Compacted arena, 1 bit per slot */
+	size_t slots;
+	size_t col;						/* Column in transposed bitmap */
+};
+
+struct query {
+	size_t rows[QUERY_WORDS];		/* Row of each word */
+	size_t words;					/* Amount of words */
+	bool urn;						/* Whether words are alternatives */
+};
+
+static void G_GNUC_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-ht] [-b bits] [-c leaves] [-f fill] [-n loops]\n"
+		"       [-q queries] [-R seed]\n"
+		"  -b : bitmap size in bits (default = %u)\n"
+		"  -c : amount of leaf tables (default = %u)\n"
+		"  -f : fill percentage of leaf tables (default = %u)\n"
+		"  -h : prints this help message\n"
+		"  -n : sets amount of loops\n"
+		"  -q : amount of queries (default = %u)\n"
+		"  -t : time each test\n"
+		"  -R : seed for repeatable random key sequence\n"
+		, progname, DEFAULT_BITS, DEFAULT_LEAVES, DEFAULT_FILL,
+		DEFAULT_QUERIES);
+	exit(EXIT_FAILURE);
+}
+
+static void G_GNUC_NORETURN
+test_abort(const char *what)
+{
+	printf("%s - FAILED\n", what);
+	printf("use '-R %u' to reproduce problem.\n", initial_seed);
+	abort();
+}
+
+static inline bool
+slot_is_set(const uint8 *arena, size_t slot)
+{
+	return 0 != (arena[slot >> 3] & (0x80 >> (slot & 0x7)));
+}
+
+/*
+ * Leaf tables range from 1/4 to 4 times the amount of rows, so that both
+ * the expanded and the folded column loadings are exercised.
+ */
+static struct leaf_table *
+generate_tables(size_t leaves, uint bits, uint fill)
+{
+	struct leaf_table *lt;
+	size_t i;
+
+	lt = xmalloc0(leaves * sizeof lt[0]);
+
+	for (i = 0; i < leaves; i++) {
+		uint b = bits - 2 + rand31_value(4);
+		size_t slots = (size_t) 1 << b;
+		size_t set = slots * fill / 100;
+		size_t j;
+
+		lt[i].slots = slots;
+		lt[i].arena = xmalloc0(slots / 8);
+		lt[i].col = TBITMAP_NONE;
+
+		for (j = 0; j < set; j++) {
+			size_t s = rand31_value(slots - 1);
+			lt[i].arena[s >> 3] |= 0x80 >> (s & 0x7);
+		}
+	}
+
+	return lt;
+}
+
+static void
+free_tables(struct leaf_table *lt, size_t leaves)
+{
+	size_t i;
+
+	for (i = 0; i < leaves; i++)
+		xfree(lt[i].arena);
+	xfree(lt);
+}
+
+/*
+ * Queries mostly target slots that are set in some leaf, otherwise we would
+ * only be testing empty rows.
+ */
+static struct query *
+generate_queries(const struct leaf_table *lt, size_t leaves, size_t count,
+	uint bits)
+{
+	struct query *q;
+	size_t rows = (size_t) 1 << bits;
+	size_t i;
+
+	q = xmalloc0(count * sizeof q[0]);
+
+	for (i = 0; i < count; i++) {
+		const struct leaf_table *l = &lt[rand31_value(leaves - 1)];
+		size_t j;
+
+		q[i].words = 1 + rand31_value(QUERY_WORDS - 1);
+		q[i].urn = 0 == rand31_value(9);
+
+		for (j = 0; j < q[i].words; j++) {
+			size_t s = rand31_value(l->slots - 1);
+			size_t n;
+
+			for (n = 0; n < l->slots && !slot_is_set(l->arena, s); n++)
+				s = (s + 1) & (l->slots - 1);
+
+			q[i].rows[j] = l->slots > rows ?
+				s / (l->slots / rows) : s * (rows / l->slots);
+		}
+	}
+
+	return q;
+}
+
+/*
+ * Whether the leaf table has one of the slots covered by the bitmap row.
+ */
+static bool
+leaf_has_row(const struct leaf_table *lt, size_t rows, size_t row)
+{
+	if (lt->slots >= rows) {
+		size_t factor = lt->slots / rows;
+		size_t s;
+
+		for (s = row * factor; s < (row + 1) * factor; s++) {
+			if (slot_is_set(lt->arena, s))
+				return TRUE;
+		}
+		return FALSE;
+	}
+
+	return slot_is_set(lt->arena, row / (rows / lt->slots));
+}
+
+static bool
+leaf_is_target(const struct leaf_table *lt, size_t rows, const struct query *q)
+{
+	size_t j;
+
+	for (j = 0; j < q->words; j++) {
+		bool has = leaf_has_row(lt, rows, q->rows[j]);
+		if (q->urn && has)
+			return TRUE;
+		if (!q->urn && !has)
+			return FALSE;
+	}
+
+	return !q->urn;
+}
+
+/*
+ * Probe each leaf table in turn, marking candidates in the ``found'' vector.
+ */
+static size_t
+route_probe(const struct leaf_table *lt, size_t leaves, size_t rows,
+	const struct query *q, uint64 *found)
+{
+	size_t i, n = 0;
+
+	for (i = 0; i < leaves; i++) {
+		if (TBITMAP_NONE == lt[i].col)
+			continue;
+		if (leaf_is_target(&lt[i], rows, q)) {
+			found[lt[i].col / 64] |= (uint64) 1 << (lt[i].col % 64);
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Use the transposed rows, leaving candidates in ``found''.
+ */
+static size_t
+route_rows(const tbitmap_t *tb, const struct query *q, uint64 *found)
+{
+	size_t j, col, n = 0;
+
+	if (q->urn) {
+		tbitmap_vec_clear(tb, found);
+		for (j = 0; j < q->words; j++)
+			tbitmap_vec_or(tb, found, q->rows[j]);
+	} else {
+		tbitmap_vec_fill(tb, found);
+		for (j = 0; j < q->words; j++) {
+			if (!tbitmap_vec_and(tb, found, q->rows[j]))
+				return 0;
+		}
+	}
+
+	col = 0;
+	while (TBITMAP_NONE != (col = tbitmap_vec_next(tb, found, col))) {
+		n++;
+		col++;
+	}
+
+	return n;
+}
+
+static void
+load_tables(tbitmap_t *tb, struct leaf_table *lt, size_t leaves)
+{
+	size_t i;
+
+	for (i = 0; i < leaves; i++) {
+		lt[i].col = tbitmap_column_alloc(tb);
+		tbitmap_column_load(tb, lt[i].col, lt[i].arena, lt[i].slots / 8);
+	}
+}
+
+/*
+ * Release every other column and reload the corresponding leaves, which
+ * must get back the lowest free columns.
+ */
+static void
+reload_tables(tbitmap_t *tb, struct leaf_table *lt, size_t leaves,
+	const char *what)
+{
+	size_t i, count = tbitmap_count(tb);
+
+	for (i = 0; i < leaves; i += 2) {
+		tbitmap_column_free(tb, lt[i].col);
+		lt[i].col = TBITMAP_NONE;
+	}
+
+	if (tbitmap_count(tb) != count - (leaves + 1) / 2)
+		test_abort(what);
+
+	for (i = 0; i < leaves; i += 2) {
+		lt[i].col = tbitmap_column_alloc(tb);
+		if (lt[i].col != i)
+			test_abort(what);
+		tbitmap_column_load(tb, lt[i].col, lt[i].arena, lt[i].slots / 8);
+	}
+
+	if (tbitmap_count(tb) != count)
+		test_abort(what);
+}
+
+static void
+check_queries(const tbitmap_t *tb, const struct leaf_table *lt, size_t leaves,
+	const struct query *q, size_t count, const char *what)
+{
+	size_t words = tbitmap_words(tb);
+	size_t rows = (size_t) 1 << tbitmap_bits(tb);
+	uint64 *ref = xmalloc(words * sizeof ref[0]);
+	uint64 *res = xmalloc(words * sizeof res[0]);
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		size_t nref, nres;
+
+		memset(ref, 0, words * sizeof ref[0]);
+		nref = route_probe(lt, leaves, rows, &q[i], ref);
+		nres = route_rows(tb, &q[i], res);
+
+		if (nref != nres)
+			test_abort(what);
+		if (nres != 0 && 0 != memcmp(ref, res, words * sizeof ref[0]))
+			test_abort(what);
+	}
+
+	xfree(ref);
+	xfree(res);
+}
+
+static void
+run_probe(const tbitmap_t *tb, const struct leaf_table *lt, size_t leaves,
+	const struct query *q, size_t count, size_t loops)
+{
+	size_t rows = (size_t) 1 << tbitmap_bits(tb);
+	uint64 *v = xmalloc(tbitmap_words(tb) * sizeof v[0]);
+
+	while (loops-- != 0) {
+		size_t i;
+
+		for (i = 0; i < count; i++)
+			route_probe(lt, leaves, rows, &q[i], v);
+	}
+
+	xfree(v);
+}
+
+static void
+run_rows(const tbitmap_t *tb, const struct leaf_table *lt, size_t leaves,
+	const struct query *q, size_t count, size_t loops)
+{
+	uint64 *v = xmalloc(tbitmap_words(tb) * sizeof v[0]);
+
+	(void) lt;
+	(void) leaves;
+
+	while (loops-- != 0) {
+		size_t i;
+
+		for (i = 0; i < count; i++)
+			route_rows(tb, &q[i], v);
+	}
+
+	xfree(v);
+}
+
+static double
+timeit(void (*f)(const tbitmap_t *, const struct leaf_table *, size_t,
+		const struct query *, size_t, size_t),
+	const tbitmap_t *tb, const struct leaf_table *lt, size_t leaves,
+	const struct query *q, size_t count, size_t loops)
+{
+	tm_t start, end;
+	double ustart, uend;
+
+	tm_now_exact(&start);
+	tm_cputime(&ustart, NULL);
+	(*f)(tb, lt, leaves, q, count, loops);
+	tm_cputime(&uend, NULL);
+	tm_now_exact(&end);
+
+	return ustart == uend ? tm_elapsed_f(&end, &start) : uend - ustart;
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	bool tflag = FALSE;
+	size_t leaves = DEFAULT_LEAVES;
+	size_t count = DEFAULT_QUERIES;
+	uint bits = DEFAULT_BITS;
+	uint fill = DEFAULT_FILL;
+	size_t loops = 0;
+	unsigned rseed = 0;
+	struct leaf_table *lt;
+	struct query *q;
+	tbitmap_t *tb;
+	char what[80];
+	int c;
+
+	mingw_early_init();
+	progname = filepath_basename(argv[0]);
+
+	while ((c = getopt(argc, argv, "b:c:f:hn:q:tR:")) != EOF) {
+		switch (c) {
+		case 'b':			/* bitmap size, in bits */
+			bits = atoi(optarg);
+			break;
+		case 'c':			/* amount of leaf tables */
+			leaves = atol(optarg);
+			break;
+		case 'f':			/* fill percentage */
+			fill = atoi(optarg);
+			break;
+		case 'n':			/* amount of loops */
+			loops = atol(optarg);
+			break;
+		case 'q':			/* amount of queries */
+			count = atol(optarg);
+			break;
+		case 't':			/* timing report */
+			tflag = TRUE;
+			break;
+		case 'R':			/* randomize in a repeatable way */
+			rseed = atoi(optarg);
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 0)
+		usage();
+
+	if (bits < 8 || bits > 20 || 0 == fill || fill > 100 || 0 == leaves)
+		usage();
+
+	rand31_set_seed(rseed);
+	initial_seed = rand31_current_seed();
+
+	if (0 == loops)
+		loops = tflag ? 10 : 1;
+
+	lt = generate_tables(leaves, bits, fill);
+	q = generate_queries(lt, leaves, count, bits);
+	tb = tbitmap_make(bits);
+
+	str_bprintf(what, sizeof what, "%zu queries on %zu leaves, %u%% filled",
+		count, leaves, fill);
+
+	load_tables(tb, lt, leaves);
+
+	if (tbitmap_count(tb) != leaves || tbitmap_columns(tb) < leaves)
+		test_abort(what);
+
+	check_queries(tb, lt, leaves, q, count, what);
+	reload_tables(tb, lt, leaves, what);
+	check_queries(tb, lt, leaves, q, count, what);
+
+	if (tflag) {
+		double tprobe, trows;
+
+		tprobe = timeit(run_probe, tb, lt, leaves, q, count, loops);
+		trows = timeit(run_rows, tb, lt, leaves, q, count, loops);
+
+		printf("%s - [%zu] probe=%.3gs, rows=%.3gs, speedup=%.2f\n",
+			what, loops, tprobe, trows,
+			trows > 0.0 ? tprobe / trows : 0.0);
+	} else {
+		printf("%s - OK\n", what);
+	}
+
+	tbitmap_free_null(&tb);
+	xfree(q);
+	free_tables(lt, leaves);
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
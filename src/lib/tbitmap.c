@@ -0,0 +1,410 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Transposed bitmaps.
+ *
+ * A transposed bitmap stores a set of packed bitsets of 2^bits bits each
+ * (the columns) so that all the bits at the same position (a row) are
+ * contiguous in memory.  Looking at a given row therefore yields, in a few
+ * machine words, the set of columns having that bit set.
+ *
+ * This is used to find which of the many bitsets have all the bits of a
+ * given set of positions: instead of probing each bitset in turn, one ANDs
+ * the rows for these positions and gets the result for all the columns
+ * at once.
+ *
+ * Columns are loaded from bitsets using the layout of compacted QRP tables
+ * (see bitmerge.c).  Bitsets that are smaller than the amount of rows are
+ * expanded, each bit covering several rows.  Larger bitsets are folded, in
+ * which case a row says that at least one of the corresponding bits in the
+ * original bitset was set.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "tbitmap.h"
+#include "bitmerge.h"
+#include "halloc.h"
+#include "pow2.h"
+#include "unsigned.h"
+#include "walloc.h"
+
+#include "override.h"			/* Must be the last header included */
+
+#define TBITMAP_WORD_BITS	64	/**< Amount of columns per word */
+
+enum tbitmap_magic { TBITMAP_MAGIC = 0x5b0e72d1 };
+
+/**
+ * A transposed bitmap.
+ */
+struct tbitmap {
+	enum tbitmap_magic magic;
+	uint bits;				/**< Log2 of the amount of rows */
+	size_t rows;			/**< Amount of rows, 2^bits */
+	size_t words;			/**< Amount of words per row */
+	size_t count;			/**< Amount of columns in use */
+	uint64 *used;			/**< Columns in use (``words'' long) */
+	uint64 *arena;			/**< The rows, ``words'' each */
+};
+
+static inline void
+tbitmap_check(const struct tbitmap * const tb)
+{
+	g_assert(tb != NULL);
+	g_assert(TBITMAP_MAGIC == tb->magic);
+}
+
+/**
+ * Create a new transposed bitmap with 2^bits rows and no columns.
+ */
+tbitmap_t *
+tbitmap_make(uint bits)
+{
+	tbitmap_t *tb;
+
+	g_assert(bits >= 3 && bits < 8 * sizeof(size_t));
+
+	WALLOC0(tb);
+	tb->magic = TBITMAP_MAGIC;
+	tb->bits = bits;
+	tb->rows = (size_t) 1 << bits;
+
+	return tb;
+}
+
+/**
+ * Free transposed bitmap and nullify its pointer.
+ */
+void
+tbitmap_free_null(tbitmap_t **tb_ptr)
+{
+	tbitmap_t *tb = *tb_ptr;
+
+	if (tb != NULL) {
+		tbitmap_check(tb);
+		HFREE_NULL(tb->used);
+		HFREE_NULL(tb->arena);
+		tb->magic = 0;
+		WFREE(tb);
+		*tb_ptr = NULL;
+	}
+}
+
+/**
+ * @return the log2 of the amount of rows.
+ */
+uint
+tbitmap_bits(const tbitmap_t *tb)
+{
+	tbitmap_check(tb);
+
+	return tb->bits;
+}
+
+/**
+ * @return the amount of columns in use.
+ */
+size_t
+tbitmap_count(const tbitmap_t *tb)
+{
+	tbitmap_check(tb);
+
+	return tb->count;
+}
+
+/**
+ * @return the amount of columns that can be allocated before the rows need
+ * to be enlarged, i.e. one plus the largest column number we can return.
+ */
+size_t
+tbitmap_columns(const tbitmap_t *tb)
+{
+	tbitmap_check(tb);
+
+	return tb->words * TBITMAP_WORD_BITS;
+}
+
+/**
+ * @return the amount of 64-bit words in a row, which is the size of the
+ * column vectors handled by the tbitmap_vec_*() routines.
+ */
+size_t
+tbitmap_words(const tbitmap_t *tb)
+{
+	tbitmap_check(tb);
+
+	return tb->words;
+}
+
+/**
+ * Add one word to each row, making room for 64 more columns.
+ */
+static void
+tbitmap_grow(tbitmap_t *tb)
+{
+	size_t nwords = tb->words + 1;
+	uint64 *arena;
+	size_t i;
+
+	arena = halloc0(tb->rows * nwords * sizeof arena[0]);
+
+	if (tb->words != 0) {
+		for (i = 0; i < tb->rows; i++) {
+			memcpy(&arena[i * nwords], &tb->arena[i * tb->words],
+				tb->words * sizeof arena[0]);
+		}
+	}
+
+	HFREE_NULL(tb->arena);
+	tb->arena = arena;
+	tb->used = hrealloc(tb->used, nwords * sizeof tb->used[0]);
+	tb->used[tb->words] = 0;
+	tb->words = nwords;
+}
+
+/**
+ * Allocate a new empty column.
+ *
+ * The lowest free column is returned, to keep the columns in use packed
+ * at the beginning of the rows.
+ *
+ * @return the allocated column number.
+ */
+size_t
+tbitmap_column_alloc(tbitmap_t *tb)
+{
+	size_t w;
+
+	tbitmap_check(tb);
+
+	for (w = 0; w < tb->words; w++) {
+		if (tb->used[w] != (uint64) -1)
+			break;
+	}
+
+	if (w == tb->words)
+		tbitmap_grow(tb);
+
+	{
+		int b = ctz64(~tb->used[w]);
+
+		tb->used[w] |= (uint64) 1 << b;
+		tb->count++;
+
+		return w * TBITMAP_WORD_BITS + b;
+	}
+}
+
+/**
+ * Clear all the bits of a column.
+ */
+static void
+tbitmap_column_clear(tbitmap_t *tb, size_t col)
+{
+	uint64 mask = ~((uint64) 1 << (col % TBITMAP_WORD_BITS));
+	uint64 *p = &tb->arena[col / TBITMAP_WORD_BITS];
+	size_t i;
+
+	for (i = 0; i < tb->rows; i++, p += tb->words)
+		*p &= mask;
+}
+
+/**
+ * Release a column previously allocated by tbitmap_column_alloc().
+ */
+void
+tbitmap_column_free(tbitmap_t *tb, size_t col)
+{
+	uint64 mask;
+
+	tbitmap_check(tb);
+	g_assert(col < tb->words * TBITMAP_WORD_BITS);
+
+	mask = (uint64) 1 << (col % TBITMAP_WORD_BITS);
+
+	g_assert(tb->used[col / TBITMAP_WORD_BITS] & mask);
+
+	tbitmap_column_clear(tb, col);
+	tb->used[col / TBITMAP_WORD_BITS] &= ~mask;
+	tb->count--;
+}
+
+/**
+ * Load bitset into the column, superseding its previous content.
+ *
+ * @param tb		the transposed bitmap
+ * @param col		the column to load
+ * @param set		the packed bitset, in QRP compacted order
+ * @param len		the length of the bitset in bytes (a power of 2)
+ */
+void
+tbitmap_column_load(tbitmap_t *tb, size_t col, const void *set, size_t len)
+{
+	const uint8 *s = set;
+	uint8 *folded = NULL;
+	uint64 mask, *base;
+	size_t slots, expand, i;
+
+	tbitmap_check(tb);
+	g_assert(col < tb->words * TBITMAP_WORD_BITS);
+	g_assert(tb->used[col / TBITMAP_WORD_BITS] &
+		((uint64) 1 << (col % TBITMAP_WORD_BITS)));
+	g_assert(set != NULL);
+	g_assert(IS_POWER_OF_2(len));
+
+	tbitmap_column_clear(tb, col);
+
+	slots = len * 8;
+
+	if (slots > tb->rows) {
+		folded = halloc0(tb->rows / 8);
+		bitmerge_or_shrink(folded, tb->rows / 8, set, len);
+		s = folded;
+		slots = tb->rows;
+	}
+
+	expand = tb->rows / slots;
+	mask = (uint64) 1 << (col % TBITMAP_WORD_BITS);
+	base = &tb->arena[col / TBITMAP_WORD_BITS];
+
+	for (i = 0; i < slots; i++) {
+		uint64 *p;
+		size_t j;
+
+		if (0 == (i & 0x7) && 0 == s[i >> 3]) {
+			i += 7;			/* Empty byte, skip to next one */
+			continue;
+		}
+
+		if (0 == (s[i >> 3] & (0x80 >> (i & 0x7))))
+			continue;
+
+		p = &base[i * expand * tb->words];
+		for (j = 0; j < expand; j++, p += tb->words)
+			*p |= mask;
+	}
+
+	HFREE_NULL(folded);
+}
+
+/**
+ * Fill the column vector with all the columns in use.
+ */
+void
+tbitmap_vec_fill(const tbitmap_t *tb, uint64 *v)
+{
+	tbitmap_check(tb);
+
+	memcpy(v, tb->used, tb->words * sizeof v[0]);
+}
+
+/**
+ * Clear the column vector.
+ */
+void
+tbitmap_vec_clear(const tbitmap_t *tb, uint64 *v)
+{
+	tbitmap_check(tb);
+
+	memset(v, 0, tb->words * sizeof v[0]);
+}
+
+/**
+ * AND the given row into the column vector.
+ *
+ * @return whether the resulting vector still has columns set.
+ */
+bool
+tbitmap_vec_and(const tbitmap_t *tb, uint64 *v, size_t row)
+{
+	const uint64 *r;
+	uint64 any = 0;
+	size_t i;
+
+	tbitmap_check(tb);
+	g_assert(row < tb->rows);
+
+	r = &tb->arena[row * tb->words];
+
+	for (i = 0; i < tb->words; i++)
+		any |= (v[i] &= r[i]);
+
+	return 0 != any;
+}
+
+/**
+ * OR the given row into the column vector.
+ */
+void
+tbitmap_vec_or(const tbitmap_t *tb, uint64 *v, size_t row)
+{
+	const uint64 *r;
+	size_t i;
+
+	tbitmap_check(tb);
+	g_assert(row < tb->rows);
+
+	r = &tb->arena[row * tb->words];
+
+	for (i = 0; i < tb->words; i++)
+		v[i] |= r[i];
+}
+
+/**
+ * Find the next column set in the vector, starting at ``col''.
+ *
+ * @return the column found, TBITMAP_NONE if there are no more.
+ */
+size_t
+tbitmap_vec_next(const tbitmap_t *tb, const uint64 *v, size_t col)
+{
+	size_t w;
+	uint64 x;
+
+	tbitmap_check(tb);
+
+	w = col / TBITMAP_WORD_BITS;
+
+	if (w >= tb->words)
+		return TBITMAP_NONE;
+
+	x = v[w] & ((uint64) -1 << (col % TBITMAP_WORD_BITS));
+
+	while (0 == x) {
+		if (++w >= tb->words)
+			return TBITMAP_NONE;
+		x = v[w];
+	}
+
+	return w * TBITMAP_WORD_BITS + ctz64(x);
+}
+
+/* vi: set ts=4 sw=4 cindent: */
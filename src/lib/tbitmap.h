@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Transposed bitmaps.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#ifndef _tbitmap_h_
+#define _tbitmap_h_
+
+#define TBITMAP_NONE	((size_t) -1)	/**< No column */
+
+typedef struct tbitmap tbitmap_t;
+
+/*
+ * Public interface.
+ */
+
+tbitmap_t *tbitmap_make(uint bits);
+void tbitmap_free_null(tbitmap_t **tb_ptr);
+
+uint tbitmap_bits(const tbitmap_t *tb) G_GNUC_PURE;
+size_t tbitmap_count(const tbitmap_t *tb) G_GNUC_PURE;
+size_t tbitmap_columns(const tbitmap_t *tb) G_GNUC_PURE;
+size_t tbitmap_words(const tbitmap_t *tb) G_GNUC_PURE;
+
+size_t tbitmap_column_alloc(tbitmap_t *tb);
+void tbitmap_column_free(tbitmap_t *tb, size_t col);
+void tbitmap_column_load(tbitmap_t *tb, size_t col,
+	const void *set, size_t len);
+
+void tbitmap_vec_fill(const tbitmap_t *tb, uint64 *v);
+void tbitmap_vec_clear(const tbitmap_t *tb, uint64 *v);
+bool tbitmap_vec_and(const tbitmap_t *tb, uint64 *v, size_t row);
+void tbitmap_vec_or(const tbitmap_t *tb, uint64 *v, size_t row);
+size_t tbitmap_vec_next(const tbitmap_t *tb, const uint64 *v, size_t col);
+
+#endif /* _tbitmap_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
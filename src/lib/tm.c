@@ -48,8 +48,11 @@ tm_t tm_cached_now;			/* Currently cached time */
 
 /**
  * Get current time for the system, filling the supplied tm_t structure.
+ *
+ * Contrary to tm_now_exact(), this does not update the cached time and
+ * can therefore be safely called from any thread.
  */
-static void
+void
 tm_current_time(tm_t *tm)
 {
 	struct timeval tv;
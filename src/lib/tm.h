@@ -83,6 +83,7 @@ int tm_cmp(const tm_t *a, const tm_t *b) G_GNUC_PURE;
 
 void tm_now(tm_t *tm);
 void tm_now_exact(tm_t *tm);
+void tm_current_time(tm_t *tm);
 time_t tm_time_exact(void);
 double tm_cputime(double *user, double *sys);
 
@@ -0,0 +1,408 @@
+/*
+ * tslab-test -- time-bucketed slab table tests and benchmarking.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This program replays a synthetic stream of message MUIDs, as seen by the
+ * duplicate detection logic of the message routing layer, and compares the
+ * time-bucketed slab table with the historical approach of individually
+ * allocated entries held in a hash set and recycled through a ring of slots.
+ */
+
+#include "common.h"
+
+#include "tslab.h"
+#include "hashing.h"
+#include "hset.h"
+#include "misc.h"
+#include "path.h"
+#include "rand31.h"
+#include "str.h"
+#include "tm.h"
+#include "walloc.h"
+#include "xmalloc.h"
+
+#define DEFAULT_MESSAGES	1000000		/* Amount of messages replayed */
+#define DEFAULT_DUPS		30			/* 30% of duplicates */
+#define DEFAULT_WINDOW		10000		/* Dups seen within 10000 messages */
+#define KEY_SIZE			17			/* MUID + function */
+
+const char *progname;
+static unsigned initial_seed;
+
+/*
+ * A message, as replayed.
+ */
+struct msg {
+	uint8 key[KEY_SIZE];
+};
+
+/*
+ * Routing table entry, sized as the ones of the routing layer.
+ */
+struct entry {
+	uint8 key[KEY_SIZE];
+	uint8 ttl;
+	uint8 count;
+	void *routes[5];
+};
+
+static void G_GNUC_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-ht] [-d dups] [-m messages] [-n loops] [-w window]\n"
+		"       [-R seed]\n"
+		"  -d : percentage of duplicates (default = %u)\n"
+		"  -h : prints this help message\n"
+		"  -m : amount of messages replayed (default = %u)\n"
+		"  -n : sets amount of loops\n"
+		"  -t : time each test\n"
+		"  -w : window within which duplicates are seen (default = %u)\n"
+		"  -R : seed for repeatable random key sequence\n"
+		, progname, DEFAULT_DUPS, DEFAULT_MESSAGES, DEFAULT_WINDOW);
+	exit(EXIT_FAILURE);
+}
+
+static void G_GNUC_NORETURN
+test_abort(const char *what)
+{
+	printf("%s - FAILED\n", what);
+	printf("use '-R %u' to reproduce problem.\n", initial_seed);
+	abort();
+}
+
+static struct msg *
+generate_stream(size_t count, uint dups, size_t window)
+{
+	struct msg *stream;
+	size_t i;
+
+	stream = xmalloc(count * sizeof stream[0]);
+
+	for (i = 0; i < count; i++) {
+		if (i != 0 && (uint) rand31_value(99) < dups) {
+			size_t back = 1 + rand31_value(MIN(i, window) - 1);
+			stream[i] = stream[i - back];		/* Struct copy */
+		} else {
+			rand31_bytes(stream[i].key, KEY_SIZE);
+		}
+	}
+
+	return stream;
+}
+
+static uint
+entry_hash(const void *key)
+{
+	return universal_hash(key, KEY_SIZE);
+}
+
+static uint
+entry_hash2(const void *key)
+{
+	return binary_hash2(key, KEY_SIZE);
+}
+
+static bool
+entry_eq(const void *a, const void *b)
+{
+	return 0 == memcmp(a, b, KEY_SIZE);
+}
+
+/*
+ * Historical table: walloc()'ed entries, hashed in a set and referenced from
+ * a ring of slots, the oldest entry being recycled once the ring is full.
+ */
+static void
+run_hset(const struct msg *stream, size_t count, size_t capacity,
+	bool *dup, size_t loops)
+{
+	while (loops-- != 0) {
+		hset_t *hs = hset_create_any(entry_hash, entry_hash2, entry_eq);
+		struct entry **ring = xmalloc0(capacity * sizeof ring[0]);
+		size_t i, idx = 0;
+
+		for (i = 0; i < count; i++) {
+			struct entry *e;
+
+			if (hset_contains(hs, stream[i].key)) {
+				dup[i] = TRUE;
+				continue;
+			}
+
+			dup[i] = FALSE;
+			e = ring[idx];
+
+			if (e != NULL) {
+				hset_remove(hs, e);
+			} else {
+				WALLOC0(e);
+				ring[idx] = e;
+			}
+
+			memcpy(e->key, stream[i].key, KEY_SIZE);
+			hset_insert(hs, e);
+			idx = (idx + 1) % capacity;
+		}
+
+		for (i = 0; i < capacity; i++) {
+			if (ring[i] != NULL)
+				WFREE(ring[i]);
+		}
+
+		xfree(ring);
+		hset_free_null(&hs);
+	}
+}
+
+static void
+run_tslab(const struct msg *stream, size_t count, size_t capacity,
+	bool *dup, size_t loops)
+{
+	(void) capacity;
+
+	while (loops-- != 0) {
+		tslab_t *ts;
+		size_t i;
+
+		ts = tslab_make(sizeof(struct entry), KEY_SIZE, 8, 3600, 0, NULL, NULL);
+
+		for (i = 0; i < count; i++) {
+			if (tslab_lookup(ts, stream[i].key) != NULL) {
+				dup[i] = TRUE;
+				continue;
+			}
+
+			dup[i] = FALSE;
+			(void) tslab_insert(ts, stream[i].key);
+		}
+
+		tslab_free_null(&ts);
+	}
+}
+
+static double
+timeit(void (*f)(const struct msg *, size_t, size_t, bool *, size_t),
+	const struct msg *stream, size_t count, size_t capacity,
+	bool *dup, size_t loops)
+{
+	tm_t start, end;
+	double ustart, uend;
+
+	tm_now_exact(&start);
+	tm_cputime(&ustart, NULL);
+	(*f)(stream, count, capacity, dup, loops);
+	tm_cputime(&uend, NULL);
+	tm_now_exact(&end);
+
+	return ustart == uend ? tm_elapsed_f(&end, &start) : uend - ustart;
+}
+
+static void
+count_freed(void *rec, void *data)
+{
+	size_t *freed = data;
+	struct entry *e = rec;
+
+	g_assert(1 == e->ttl);		/* Only live records are freed */
+
+	e->ttl = 0;
+	(*freed)++;
+}
+
+/*
+ * Exercise refreshing, forced expiration through the memory ceiling and
+ * clearing of the table.
+ */
+static void
+test_expire(const struct msg *stream, size_t count, const char *what)
+{
+	size_t freed = 0, inserted = 0;
+	size_t maxmem = 1024 * 1024;
+	tslab_info_t info;
+	tslab_t *ts;
+	struct entry *e;
+	size_t i;
+
+	ts = tslab_make(sizeof(struct entry), KEY_SIZE, 4, 3600,
+		maxmem, count_freed, &freed);
+
+	for (i = 0; i < count; i++) {
+		if (NULL == tslab_lookup(ts, stream[i].key)) {
+			e = tslab_insert(ts, stream[i].key);
+			e->ttl = 1;
+			inserted++;
+		}
+
+		/*
+		 * Keep the first message alive by refreshing it regularly.
+		 */
+
+		if (0 == i % 1000) {
+			e = tslab_lookup(ts, stream[0].key);
+			if (NULL == e)
+				test_abort(what);
+			e = tslab_refresh(ts, e);
+			if (0 != memcmp(e->key, stream[0].key, KEY_SIZE) || 1 != e->ttl)
+				test_abort(what);
+		}
+	}
+
+	tslab_info(ts, &info);
+
+	if (info.memory > maxmem + maxmem / 4)
+		test_abort(what);
+
+	if (count * sizeof(struct entry) > 2 * maxmem && 0 == info.forced)
+		test_abort(what);
+
+	if (NULL == tslab_lookup(ts, stream[count - 1].key))
+		test_abort(what);
+
+	tslab_clear(ts);
+
+	if (0 != tslab_count(ts) || NULL != tslab_lookup(ts, stream[0].key))
+		test_abort(what);
+
+	tslab_free_null(&ts);
+
+	if (freed != inserted)		/* Each record must be freed exactly once */
+		test_abort(what);
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	bool tflag = FALSE;
+	size_t count = DEFAULT_MESSAGES;
+	uint dups = DEFAULT_DUPS;
+	size_t window = DEFAULT_WINDOW;
+	size_t loops = 0;
+	unsigned rseed = 0;
+	struct msg *stream;
+	bool *ref, *res;
+	size_t i, ndups;
+	char what[80];
+	int c;
+
+	mingw_early_init();
+	progname = filepath_basename(argv[0]);
+
+	while ((c = getopt(argc, argv, "d:hm:n:tw:R:")) != EOF) {
+		switch (c) {
+		case 'd':			/* percentage of duplicates */
+			dups = atoi(optarg);
+			break;
+		case 'm':			/* amount of messages */
+			count = atol(optarg);
+			break;
+		case 'n':			/* amount of loops */
+			loops = atol(optarg);
+			break;
+		case 't':			/* timing report */
+			tflag = TRUE;
+			break;
+		case 'w':			/* duplicate window */
+			window = atol(optarg);
+			break;
+		case 'R':			/* randomize in a repeatable way */
+			rseed = atoi(optarg);
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 0)
+		usage();
+
+	if (dups > 100 || 0 == window || 0 == count)
+		usage();
+
+	rand31_set_seed(rseed);
+	initial_seed = rand31_current_seed();
+
+	if (0 == loops)
+		loops = tflag ? 3 : 1;
+
+	stream = generate_stream(count, dups, window);
+	ref = xmalloc(count * sizeof ref[0]);
+	res = xmalloc(count * sizeof res[0]);
+
+	str_bprintf(what, sizeof what, "%zu messages, %u%% dups within %zu",
+		count, dups, window);
+
+	{
+		double thset, ttslab;
+
+		/*
+		 * The historical table is given the same capacity as the stream
+		 * so that both tables take the same duplicate decisions.
+		 */
+
+		thset = timeit(run_hset, stream, count, count, ref, loops);
+		ttslab = timeit(run_tslab, stream, count, count, res, loops);
+
+		if (0 != memcmp(ref, res, count * sizeof ref[0]))
+			test_abort(what);
+
+		test_expire(stream, count, what);
+
+		for (i = 0, ndups = 0; i < count; i++) {
+			if (res[i])
+				ndups++;
+		}
+
+		if (tflag) {
+			printf("%s - [%zu] hset=%.3gs (%.3g msg/s), "
+				"tslab=%.3gs (%.3g msg/s), speedup=%.2f\n",
+				what, loops,
+				thset, thset > 0.0 ? count * loops / thset : 0.0,
+				ttslab, ttslab > 0.0 ? count * loops / ttslab : 0.0,
+				ttslab > 0.0 ? thset / ttslab : 0.0);
+		} else {
+			printf("%s - %zu duplicates detected - OK\n", what, ndups);
+		}
+	}
+
+	xfree(ref);
+	xfree(res);
+	xfree(stream);
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,640 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Time-bucketed slab tables.
+ *
+ * Such a table holds fixed-size records, starting with a fixed-size key,
+ * which are stored in large slabs instead of being allocated individually.
+ * The records are grouped in a ring of buckets: new records are always
+ * appended to the current bucket, and every ``period'' seconds the next
+ * bucket in the ring becomes the current one, after having been emptied.
+ * Records therefore live between (buckets - 1) and ``buckets'' periods,
+ * unless they are refreshed, which moves them to the current bucket.
+ *
+ * Expiring records is done a whole bucket at a time: its slabs are freed
+ * without having to locate each record in a global hash table.  Indeed,
+ * each bucket has its own open-addressing index, referring to the records
+ * by their number within the bucket, along with a few bits of their hash
+ * value to avoid touching non-matching records during probing.  Lookups
+ * probe the buckets from the most recent one to the oldest one.
+ *
+ * A memory ceiling can be configured: when the current bucket uses more
+ * than its share of the memory, rotation is forced, discarding the oldest
+ * records before their natural expiration.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "tslab.h"
+#include "halloc.h"
+#include "hashing.h"
+#include "tm.h"
+#include "unsigned.h"
+#include "walloc.h"
+
+#include "override.h"			/* Must be the last header included */
+
+#define TSLAB_SLAB_SIZE		(64 * 1024)	/**< Targeted slab size */
+#define TSLAB_INDEX_MIN		1024		/**< Minimum index size */
+#define TSLAB_REC_BITS		24			/**< Record number bits in index */
+#define TSLAB_REC_MASK		((1U << TSLAB_REC_BITS) - 1)
+#define TSLAB_REC_MAX		(TSLAB_REC_MASK - 1)	/**< Max records per bucket */
+#define TSLAB_NONE			((size_t) -1)
+
+/*
+ * An index entry is the record number within the bucket plus one, so that
+ * zero flags an empty entry, with the upper bits of the hash value stored
+ * in the remaining bits.
+ */
+#define TSLAB_TAG(h)		((h) & ~TSLAB_REC_MASK)
+#define TSLAB_RECNO(e)		(((e) & TSLAB_REC_MASK) - 1)
+
+enum tslab_magic { TSLAB_MAGIC = 0x2e9d4a17 };
+
+/**
+ * A bucket of records.
+ */
+struct tslab_bucket {
+	char **slabs;			/**< Allocated slabs */
+	uint32 *index;			/**< Open-addressing index of records */
+	size_t nslabs;			/**< Amount of allocated slabs */
+	size_t used;			/**< Amount of records allocated in slabs */
+	size_t isize;			/**< Index size (power of 2) */
+	size_t items;			/**< Amount of records referenced by index */
+	size_t memory;			/**< Memory used by slabs and index */
+	time_t start;			/**< When bucket became the current one */
+};
+
+/**
+ * A time-bucketed slab table.
+ */
+struct tslab {
+	enum tslab_magic magic;
+	size_t recsize;			/**< Record size */
+	size_t keysize;			/**< Key size, key starting each record */
+	size_t slab_shift;		/**< log2 of amount of records per slab */
+	size_t slab_bytes;		/**< Size of a slab in bytes */
+	size_t maxmem;			/**< Memory ceiling, 0 if none */
+	size_t memory;			/**< Memory used by all buckets */
+	size_t count;			/**< Amount of records held */
+	size_t nslabs;			/**< Amount of slabs held */
+	size_t rotations;		/**< Amount of rotations */
+	size_t forced;			/**< Amount of forced rotations */
+	time_delta_t period;	/**< Rotation period, in seconds */
+	tslab_free_t freecb;	/**< Invoked on discarded records */
+	void *data;				/**< Additional argument for freecb */
+	struct tslab_bucket *buckets;	/**< Ring of buckets */
+	uint nbuckets;			/**< Amount of buckets */
+	uint cur;				/**< Current bucket */
+};
+
+static inline void
+tslab_check(const struct tslab * const ts)
+{
+	g_assert(ts != NULL);
+	g_assert(TSLAB_MAGIC == ts->magic);
+}
+
+/**
+ * Create a new time-bucketed slab table.
+ *
+ * @param recsize		the size of records
+ * @param keysize		the size of the key, at the start of each record
+ * @param buckets		amount of buckets in the ring (at least 2)
+ * @param period		rotation period, in seconds
+ * @param maxmem		memory ceiling in bytes, 0 for none
+ * @param freecb		if non-NULL, invoked on each discarded record
+ * @param data			additional argument for freecb
+ *
+ * @return new table.
+ */
+tslab_t *
+tslab_make(size_t recsize, size_t keysize, uint buckets,
+	time_delta_t period, size_t maxmem, tslab_free_t freecb, void *data)
+{
+	tslab_t *ts;
+	size_t per_slab;
+	uint i;
+
+	g_assert(size_is_positive(keysize));
+	g_assert(recsize >= keysize);
+	g_assert(recsize <= TSLAB_SLAB_SIZE);
+	g_assert(buckets >= 2);
+	g_assert(period > 0);
+
+	WALLOC0(ts);
+	ts->magic = TSLAB_MAGIC;
+	ts->recsize = recsize;
+	ts->keysize = keysize;
+	ts->nbuckets = buckets;
+	ts->period = period;
+	ts->maxmem = maxmem;
+	ts->freecb = freecb;
+	ts->data = data;
+
+	/*
+	 * The amount of records per slab is a power of 2, so that locating a
+	 * record from its number does not require any division.
+	 */
+
+	for (per_slab = 1; per_slab * 2 * recsize <= TSLAB_SLAB_SIZE; per_slab *= 2)
+		ts->slab_shift++;
+
+	ts->slab_bytes = per_slab * recsize;
+	ts->buckets = halloc0(buckets * sizeof ts->buckets[0]);
+
+	for (i = 0; i < buckets; i++)
+		ts->buckets[i].start = tm_time();
+
+	return ts;
+}
+
+/**
+ * @return address of record number ``n'' in the bucket.
+ */
+static inline void *
+tslab_record(const tslab_t *ts, const struct tslab_bucket *b, size_t n)
+{
+	size_t mask = ((size_t) 1 << ts->slab_shift) - 1;
+
+	return &b->slabs[n >> ts->slab_shift][(n & mask) * ts->recsize];
+}
+
+/**
+ * @return hash value of the key.
+ */
+static inline uint
+tslab_hash(const tslab_t *ts, const void *key)
+{
+	return binary_hash(key, ts->keysize);
+}
+
+/**
+ * Discard all the records held in the bucket.
+ */
+static void
+tslab_bucket_empty(tslab_t *ts, struct tslab_bucket *b)
+{
+	size_t i;
+
+	/*
+	 * Only records referenced from the index are live: the others were moved
+	 * to a more recent bucket when refreshed.
+	 */
+
+	if (ts->freecb != NULL && b->items != 0) {
+		for (i = 0; i < b->isize; i++) {
+			uint32 e = b->index[i];
+
+			if (e != 0)
+				(*ts->freecb)(tslab_record(ts, b, TSLAB_RECNO(e)), ts->data);
+		}
+	}
+
+	for (i = 0; i < b->nslabs; i++)
+		hfree(b->slabs[i]);
+
+	HFREE_NULL(b->slabs);
+	HFREE_NULL(b->index);
+
+	g_assert(ts->count >= b->items);
+	g_assert(ts->memory >= b->memory);
+	g_assert(ts->nslabs >= b->nslabs);
+
+	ts->count -= b->items;
+	ts->memory -= b->memory;
+	ts->nslabs -= b->nslabs;
+
+	b->nslabs = b->used = b->isize = b->items = b->memory = 0;
+}
+
+/**
+ * Make the next bucket in the ring the current one, discarding its records.
+ */
+static void
+tslab_advance(tslab_t *ts, time_t now)
+{
+	struct tslab_bucket *b;
+
+	ts->cur = (ts->cur + 1) % ts->nbuckets;
+	ts->rotations++;
+
+	b = &ts->buckets[ts->cur];
+	tslab_bucket_empty(ts, b);
+	b->start = now;
+}
+
+/**
+ * Rotate buckets if the current one has been used for more than a period.
+ */
+static void
+tslab_rotate_check(tslab_t *ts)
+{
+	struct tslab_bucket *b = &ts->buckets[ts->cur];
+	time_t now = tm_time();
+	time_delta_t elapsed = delta_time(now, b->start);
+
+	if G_UNLIKELY(elapsed >= ts->period) {
+		time_delta_t n = elapsed / ts->period;
+
+		/*
+		 * If more than a period elapsed since the last insertion, the
+		 * buckets that would have been made current in between are empty
+		 * and all the records older than the ring span must go.
+		 */
+
+		n = MIN(n, (time_delta_t) ts->nbuckets);
+
+		while (n-- != 0)
+			tslab_advance(ts, now);
+	}
+}
+
+/**
+ * Insert record number ``n'' of the bucket in its index.
+ */
+static void
+tslab_index_put(struct tslab_bucket *b, size_t n, uint h)
+{
+	size_t mask = b->isize - 1;
+	size_t i = h & mask;
+
+	while (b->index[i] != 0)
+		i = (i + 1) & mask;
+
+	b->index[i] = TSLAB_TAG(h) | (n + 1);
+	b->items++;
+}
+
+/**
+ * Resize the index of the bucket.
+ */
+static void
+tslab_index_resize(tslab_t *ts, struct tslab_bucket *b, size_t size)
+{
+	uint32 *old = b->index;
+	size_t osize = b->isize, i;
+
+	g_assert(size > b->items * 2);
+
+	b->index = halloc0(size * sizeof b->index[0]);
+	b->isize = size;
+	b->items = 0;
+
+	for (i = 0; i < osize; i++) {
+		uint32 e = old[i];
+
+		if (e != 0) {
+			size_t n = TSLAB_RECNO(e);
+			tslab_index_put(b, n, tslab_hash(ts, tslab_record(ts, b, n)));
+		}
+	}
+
+	HFREE_NULL(old);
+
+	b->memory += (size - osize) * sizeof b->index[0];
+	ts->memory += (size - osize) * sizeof b->index[0];
+}
+
+/**
+ * Locate key in the bucket index.
+ *
+ * @return the index position, TSLAB_NONE if not found.
+ */
+static size_t
+tslab_index_find(const tslab_t *ts, const struct tslab_bucket *b,
+	const void *key, uint h)
+{
+	size_t mask = b->isize - 1;
+	size_t i = h & mask;
+	uint32 tag = TSLAB_TAG(h);
+	uint32 e;
+
+	while ((e = b->index[i]) != 0) {
+		if (
+			TSLAB_TAG(e) == tag &&
+			0 == memcmp(tslab_record(ts, b, TSLAB_RECNO(e)), key, ts->keysize)
+		)
+			return i;
+		i = (i + 1) & mask;
+	}
+
+	return TSLAB_NONE;
+}
+
+/**
+ * Remove entry at position ``i'' from the bucket index, shifting back the
+ * entries that follow in the same cluster so that no tombstone is needed.
+ */
+static void
+tslab_index_remove(const tslab_t *ts, struct tslab_bucket *b, size_t i)
+{
+	size_t mask = b->isize - 1;
+	size_t j = i;
+
+	for (;;) {
+		uint32 e;
+		size_t k;
+
+		j = (j + 1) & mask;
+		e = b->index[j];
+
+		if (0 == e)
+			break;
+
+		k = tslab_hash(ts, tslab_record(ts, b, TSLAB_RECNO(e))) & mask;
+
+		/*
+		 * Move entry at ``j'' to the hole at ``i'' unless its home position
+		 * ``k'' lies cyclically within (i, j].
+		 */
+
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+
+		b->index[i] = e;
+		i = j;
+	}
+
+	b->index[i] = 0;
+	b->items--;
+}
+
+/**
+ * Allocate a new zeroed record in the current bucket.
+ *
+ * @param ts		the table
+ * @param rotate	whether we may rotate buckets to honour the memory ceiling
+ *
+ * @return the bucket where record was allocated, with the record number
+ * filled in ``np'', NULL if no record can be allocated without rotating.
+ */
+static struct tslab_bucket *
+tslab_alloc(tslab_t *ts, bool rotate, size_t *np)
+{
+	struct tslab_bucket *b = &ts->buckets[ts->cur];
+	size_t per_slab = (size_t) 1 << ts->slab_shift;
+
+	if G_UNLIKELY(b->used == b->nslabs * per_slab) {
+		bool full = b->used + per_slab > TSLAB_REC_MAX;
+
+		if (
+			b->used != 0 && (full || (
+				ts->maxmem != 0 &&
+				b->memory + ts->slab_bytes > ts->maxmem / ts->nbuckets
+			))
+		) {
+			if (!rotate) {
+				if (full)
+					return NULL;
+			} else {
+				tslab_advance(ts, tm_time());
+				ts->forced++;
+				b = &ts->buckets[ts->cur];
+			}
+		}
+
+		b->slabs = hrealloc(b->slabs, (b->nslabs + 1) * sizeof b->slabs[0]);
+		b->slabs[b->nslabs++] = halloc(ts->slab_bytes);
+		b->memory += ts->slab_bytes;
+		ts->memory += ts->slab_bytes;
+		ts->nslabs++;
+	}
+
+	if G_UNLIKELY((b->items + 1) * 2 > b->isize)
+		tslab_index_resize(ts, b, MAX(TSLAB_INDEX_MIN, b->isize * 2));
+
+	*np = b->used++;
+	memset(tslab_record(ts, b, *np), 0, ts->recsize);
+
+	return b;
+}
+
+/**
+ * Look for a record.
+ *
+ * @param ts		the table
+ * @param key		the key, of the size given at creation time
+ *
+ * @return the record if found, NULL otherwise.
+ */
+void *
+tslab_lookup(const tslab_t *ts, const void *key)
+{
+	uint h, i;
+
+	tslab_check(ts);
+
+	h = tslab_hash(ts, key);
+
+	for (i = 0; i < ts->nbuckets; i++) {
+		uint n = (ts->cur + ts->nbuckets - i) % ts->nbuckets;
+		const struct tslab_bucket *b = &ts->buckets[n];
+		size_t pos;
+
+		if (0 == b->items)
+			continue;
+
+		pos = tslab_index_find(ts, b, key, h);
+
+		if (pos != TSLAB_NONE)
+			return tslab_record(ts, b, TSLAB_RECNO(b->index[pos]));
+	}
+
+	return NULL;
+}
+
+/**
+ * Insert new record in the table.
+ *
+ * The key must not already be present in the table.  This may cause older
+ * records to be discarded, so any record previously returned by the table
+ * must be considered as invalid after this call.
+ *
+ * @param ts		the table
+ * @param key		the key, of the size given at creation time
+ *
+ * @return the new record, zeroed except for its leading key.
+ */
+void *
+tslab_insert(tslab_t *ts, const void *key)
+{
+	struct tslab_bucket *b;
+	size_t n;
+	void *rec;
+
+	tslab_check(ts);
+
+	tslab_rotate_check(ts);
+	b = tslab_alloc(ts, TRUE, &n);
+
+	g_assert(b != NULL);
+
+	rec = tslab_record(ts, b, n);
+	memcpy(rec, key, ts->keysize);
+	tslab_index_put(b, n, tslab_hash(ts, key));
+	ts->count++;
+
+	return rec;
+}
+
+/**
+ * Refresh record, moving it to the current bucket to prevent its expiration.
+ *
+ * This never discards other records, so records previously returned by the
+ * table remain valid, except for the refreshed one whose new location is
+ * returned.
+ *
+ * @return the new record location, which may be the old one.
+ */
+void *
+tslab_refresh(tslab_t *ts, void *rec)
+{
+	uint h, i;
+
+	tslab_check(ts);
+	g_assert(rec != NULL);
+
+	h = tslab_hash(ts, rec);
+
+	for (i = 0; i < ts->nbuckets; i++) {
+		uint n = (ts->cur + ts->nbuckets - i) % ts->nbuckets;
+		struct tslab_bucket *b = &ts->buckets[n];
+		struct tslab_bucket *cb;
+		size_t pos, recno;
+		void *nrec;
+
+		if (0 == b->items)
+			continue;
+
+		pos = tslab_index_find(ts, b, rec, h);
+
+		if (TSLAB_NONE == pos)
+			continue;
+
+		g_assert(rec == tslab_record(ts, b, TSLAB_RECNO(b->index[pos])));
+
+		if (0 == i)
+			return rec;			/* Already in the current bucket */
+
+		cb = tslab_alloc(ts, FALSE, &recno);
+		if G_UNLIKELY(NULL == cb)
+			return rec;			/* Current bucket is full, leave it */
+
+		g_assert(cb == &ts->buckets[ts->cur]);
+
+		nrec = tslab_record(ts, cb, recno);
+		memcpy(nrec, rec, ts->recsize);
+		tslab_index_put(cb, recno, h);
+		tslab_index_remove(ts, b, pos);
+
+		return nrec;
+	}
+
+	g_assert_not_reached();
+	return NULL;
+}
+
+/**
+ * Discard all the records from the table.
+ */
+void
+tslab_clear(tslab_t *ts)
+{
+	uint i;
+
+	tslab_check(ts);
+
+	for (i = 0; i < ts->nbuckets; i++) {
+		tslab_bucket_empty(ts, &ts->buckets[i]);
+		ts->buckets[i].start = tm_time();
+	}
+
+	g_assert(0 == ts->count);
+	g_assert(0 == ts->memory);
+}
+
+/**
+ * Change the memory ceiling, enforced as new records get inserted.
+ */
+void
+tslab_set_maxmem(tslab_t *ts, size_t maxmem)
+{
+	tslab_check(ts);
+
+	ts->maxmem = maxmem;
+}
+
+/**
+ * @return amount of records held in the table.
+ */
+size_t
+tslab_count(const tslab_t *ts)
+{
+	tslab_check(ts);
+
+	return ts->count;
+}
+
+/**
+ * Fill statistics about the table.
+ */
+void
+tslab_info(const tslab_t *ts, tslab_info_t *info)
+{
+	tslab_check(ts);
+	g_assert(info != NULL);
+
+	info->count = ts->count;
+	info->capacity = ts->nslabs << ts->slab_shift;
+	info->slabs = ts->nslabs;
+	info->memory = ts->memory;
+	info->rotations = ts->rotations;
+	info->forced = ts->forced;
+}
+
+/**
+ * Free table, discarding all its records, and nullify its pointer.
+ */
+void
+tslab_free_null(tslab_t **ts_ptr)
+{
+	tslab_t *ts = *ts_ptr;
+
+	if (ts != NULL) {
+		tslab_clear(ts);
+		HFREE_NULL(ts->buckets);
+		ts->magic = 0;
+		WFREE(ts);
+		*ts_ptr = NULL;
+	}
+}
+
+/* vi: set ts=4 sw=4 cindent: */
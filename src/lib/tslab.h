@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Time-bucketed slab tables.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#ifndef _tslab_h_
+#define _tslab_h_
+
+#include "tm.h"			/* For time_delta_t */
+
+typedef struct tslab tslab_t;
+
+/**
+ * Callback invoked on each record being discarded from the table.
+ *
+ * @param rec		the record being discarded
+ * @param data		user-supplied data
+ */
+typedef void (*tslab_free_t)(void *rec, void *data);
+
+/**
+ * Table statistics.
+ */
+typedef struct tslab_info {
+	size_t count;			/**< Amount of records held */
+	size_t capacity;		/**< Amount of records we can hold without growing */
+	size_t slabs;			/**< Amount of allocated slabs */
+	size_t memory;			/**< Memory used by slabs and indices, in bytes */
+	size_t rotations;		/**< Amount of bucket rotations */
+	size_t forced;			/**< Rotations forced by the memory ceiling */
+} tslab_info_t;
+
+/*
+ * Public interface.
+ */
+
+tslab_t *tslab_make(size_t recsize, size_t keysize, uint buckets,
+	time_delta_t period, size_t maxmem, tslab_free_t freecb, void *data);
+void tslab_free_null(tslab_t **ts_ptr);
+void tslab_set_maxmem(tslab_t *ts, size_t maxmem);
+
+void *tslab_lookup(const tslab_t *ts, const void *key);
+void *tslab_insert(tslab_t *ts, const void *key);
+void *tslab_refresh(tslab_t *ts, void *rec);
+void tslab_clear(tslab_t *ts);
+
+size_t tslab_count(const tslab_t *ts) G_GNUC_PURE;
+void tslab_info(const tslab_t *ts, tslab_info_t *info);
+
+#endif /* _tslab_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
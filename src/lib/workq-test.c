@@ -0,0 +1,352 @@
+/*
+ * workq-test -- worker thread queues tests and benchmarking.
+ *
+ * Copyright (c) 2026 agent <agent@local>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the authors nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This program feeds several independent streams of jobs to a work queue,
+ * each job depending on the result of the previous one in its stream, and
+ * checks that the streams are processed in order and yield the same results
+ * as a sequential computation.
+ */
+
+#include "common.h"
+
+#include "workq.h"
+#include "inputevt.h"
+#include "misc.h"
+#include "path.h"
+#include "rand31.h"
+#include "str.h"
+#include "tm.h"
+#include "walloc.h"
+#include "xmalloc.h"
+
+#define DEFAULT_STREAMS		8		/* Amount of independent streams */
+#define DEFAULT_JOBS		2000	/* Jobs per stream */
+#define DEFAULT_THREADS		4		/* Worker threads */
+#define DEFAULT_WORK		20000	/* Iterations per job */
+
+const char *progname;
+static unsigned initial_seed;
+static const char *what;
+
+/*
+ * A stream of jobs, whose state is only accessed by the worker thread.
+ */
+struct stream {
+	uint32 value;			/* Running value */
+	size_t seq;				/* Next expected job */
+	size_t done;			/* Next expected completion */
+	const uint32 *ref;		/* Reference values, for each job */
+};
+
+struct job {
+	struct stream *s;
+	size_t seq;				/* Job sequence number in stream */
+	uint32 seed;			/* Job input */
+	uint32 result;			/* Value of stream after job */
+	bool ordered;			/* Whether job was run in sequence */
+};
+
+static size_t work = DEFAULT_WORK;
+
+static void G_GNUC_NORETURN
+usage(void)
+{
+	fprintf(stderr,
+		"Usage: %s [-ht] [-j jobs] [-n loops] [-s streams] [-w threads]\n"
+		"       [-W work] [-R seed]\n"
+		"  -h : prints this help message\n"
+		"  -j : amount of jobs per stream (default = %u)\n"
+		"  -n : sets amount of loops\n"
+		"  -s : amount of streams (default = %u)\n"
+		"  -t : time each test\n"
+		"  -w : amount of worker threads (default = %u)\n"
+		"  -W : amount of iterations per job (default = %u)\n"
+		"  -R : seed for repeatable random job sequence\n"
+		, progname, DEFAULT_JOBS, DEFAULT_STREAMS, DEFAULT_THREADS,
+		DEFAULT_WORK);
+	exit(EXIT_FAILURE);
+}
+
+static void G_GNUC_NORETURN
+test_abort(void)
+{
+	printf("%s - FAILED\n", what);
+	printf("use '-R %u' to reproduce problem.\n", initial_seed);
+	abort();
+}
+
+/*
+ * Make the value of the stream depend on all the jobs run so far, at a
+ * configurable CPU cost.
+ */
+static uint32
+compute(uint32 value, uint32 seed)
+{
+	size_t i;
+
+	value ^= seed;
+
+	for (i = 0; i < work; i++)
+		value = value * 1103515245U + 12345U + (value >> 16);
+
+	return value;
+}
+
+static void
+job_run(void *arg)
+{
+	struct job *j = arg;
+	struct stream *s = j->s;
+
+	j->ordered = j->seq == s->seq++;
+	s->value = compute(s->value, j->seed);
+	j->result = s->value;
+}
+
+static void
+job_done(void *arg)
+{
+	struct job *j = arg;
+	struct stream *s = j->s;
+
+	if (!j->ordered || j->seq != s->done++ || j->result != s->ref[j->seq])
+		test_abort();
+
+	WFREE(j);
+}
+
+static uint32 **
+generate_seeds(size_t streams, size_t jobs)
+{
+	uint32 **seeds;
+	size_t i;
+
+	seeds = xmalloc(streams * sizeof seeds[0]);
+
+	for (i = 0; i < streams; i++) {
+		seeds[i] = xmalloc(jobs * sizeof seeds[i][0]);
+		rand31_bytes(seeds[i], jobs * sizeof seeds[i][0]);
+	}
+
+	return seeds;
+}
+
+static void
+run_sync(uint32 **seeds, uint32 **ref, size_t streams, size_t jobs,
+	uint threads, size_t loops)
+{
+	(void) threads;
+
+	while (loops-- != 0) {
+		size_t i, k;
+
+		for (i = 0; i < streams; i++) {
+			uint32 value = 0;
+
+			for (k = 0; k < jobs; k++)
+				ref[i][k] = value = compute(value, seeds[i][k]);
+		}
+	}
+}
+
+static void
+run_workq(uint32 **seeds, uint32 **ref, size_t streams, size_t jobs,
+	uint threads, size_t loops)
+{
+	while (loops-- != 0) {
+		struct stream *st;
+		workq_t *wq;
+		size_t i, k;
+
+		wq = workq_make("test", threads);
+		if (NULL == wq)
+			test_abort();
+
+		st = xmalloc0(streams * sizeof st[0]);
+
+		for (i = 0; i < streams; i++)
+			st[i].ref = ref[i];
+
+		/*
+		 * Interleave the streams, as independent links would do.
+		 */
+
+		for (k = 0; k < jobs; k++) {
+			for (i = 0; i < streams; i++) {
+				struct job *j;
+
+				WALLOC0(j);
+				j->s = &st[i];
+				j->seq = k;
+				j->seed = seeds[i][k];
+				workq_post(wq, i, job_run, job_done, j);
+			}
+
+			if (0 == k % 64)
+				workq_dispatch(wq);
+		}
+
+		workq_flush(wq);
+
+		if (0 != workq_pending(wq))
+			test_abort();
+
+		for (i = 0; i < streams; i++) {
+			if (st[i].done != jobs || st[i].value != ref[i][jobs - 1])
+				test_abort();
+		}
+
+		workq_free_null(&wq);
+		xfree(st);
+	}
+}
+
+static double
+timeit(
+	void (*f)(uint32 **, uint32 **, size_t, size_t, uint, size_t),
+	uint32 **seeds, uint32 **ref, size_t streams, size_t jobs,
+	uint threads, size_t loops)
+{
+	tm_t start, end;
+
+	/*
+	 * Workers run in parallel, hence we measure the wall-clock time.
+	 */
+
+	tm_now_exact(&start);
+	(*f)(seeds, ref, streams, jobs, threads, loops);
+	tm_now_exact(&end);
+
+	return tm_elapsed_f(&end, &start);
+}
+
+int
+main(int argc, char **argv)
+{
+	extern int optind;
+	extern char *optarg;
+	bool tflag = FALSE;
+	size_t streams = DEFAULT_STREAMS;
+	size_t jobs = DEFAULT_JOBS;
+	uint threads = DEFAULT_THREADS;
+	size_t loops = 0;
+	unsigned rseed = 0;
+	uint32 **seeds, **ref;
+	double tsync, twq;
+	char buf[80];
+	size_t i;
+	int c;
+
+	mingw_early_init();
+	progname = filepath_basename(argv[0]);
+
+	while ((c = getopt(argc, argv, "hj:n:s:tw:W:R:")) != EOF) {
+		switch (c) {
+		case 'j':			/* jobs per stream */
+			jobs = atol(optarg);
+			break;
+		case 'n':			/* amount of loops */
+			loops = atol(optarg);
+			break;
+		case 's':			/* amount of streams */
+			streams = atol(optarg);
+			break;
+		case 't':			/* timing report */
+			tflag = TRUE;
+			break;
+		case 'w':			/* amount of workers */
+			threads = atoi(optarg);
+			break;
+		case 'W':			/* iterations per job */
+			work = atol(optarg);
+			break;
+		case 'R':			/* randomize in a repeatable way */
+			rseed = atoi(optarg);
+			break;
+		case 'h':			/* show help */
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if ((argc -= optind) != 0)
+		usage();
+
+	if (0 == streams || 0 == jobs || 0 == threads)
+		usage();
+
+	rand31_set_seed(rseed);
+	initial_seed = rand31_current_seed();
+
+	if (0 == loops)
+		loops = tflag ? 3 : 1;
+
+	inputevt_init(TRUE);
+
+	str_bprintf(buf, sizeof buf, "%zu streams of %zu jobs, %u workers",
+		streams, jobs, threads);
+	what = buf;
+
+	seeds = generate_seeds(streams, jobs);
+	ref = xmalloc(streams * sizeof ref[0]);
+
+	for (i = 0; i < streams; i++)
+		ref[i] = xmalloc(jobs * sizeof ref[i][0]);
+
+	tsync = timeit(run_sync, seeds, ref, streams, jobs, threads, loops);
+	twq = timeit(run_workq, seeds, ref, streams, jobs, threads, loops);
+
+	if (tflag) {
+		printf("%s - [%zu] sync=%.3gs (%.3g job/s), "
+			"workq=%.3gs (%.3g job/s), speedup=%.2f\n",
+			what, loops,
+			tsync, tsync > 0.0 ? streams * jobs * loops / tsync : 0.0,
+			twq, twq > 0.0 ? streams * jobs * loops / twq : 0.0,
+			twq > 0.0 ? tsync / twq : 0.0);
+	} else {
+		printf("%s - OK\n", what);
+	}
+
+	for (i = 0; i < streams; i++) {
+		xfree(seeds[i]);
+		xfree(ref[i]);
+	}
+
+	xfree(seeds);
+	xfree(ref);
+
+	return 0;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
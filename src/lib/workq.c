@@ -0,0 +1,614 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Worker thread queues.
+ *
+ * A work queue is a small pool of threads to which the main thread can
+ * hand over CPU-intensive jobs.  Each job is posted with a key, and all the
+ * jobs bearing the same key are processed by the same worker, in the order
+ * they were posted.  This allows a stateful computation (e.g. a compression
+ * stream) to be pinned to a worker, whilst independent computations run
+ * in parallel.
+ *
+ * Once processed, a job is handed back to the main thread, which runs its
+ * completion routine from the I/O event loop.  Jobs therefore travel through
+ * two kinds of queues:
+ *
+ * - each worker has its own job queue, fed by the main thread;
+ * - all the workers feed the completion queue, drained by the main thread.
+ *
+ * These are intrusive multiple-producer / single-consumer queues which are
+ * lock-free: pushing is a single atomic exchange and popping does not need
+ * any atomic operation.  Pipes are only used to wake up a sleeping worker
+ * or to signal the main thread that completed jobs are waiting, and no
+ * more than one wakeup byte is outstanding at any time for a given reader.
+ *
+ * Job records are allocated and freed by the main thread only.
+ *
+ * When the platform does not provide threads or atomic operations, no work
+ * queue can be created and callers must process their jobs synchronously.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#include "common.h"
+
+#include "workq.h"
+#include "atomic.h"
+#include "compat_poll.h"
+#include "fd.h"
+#include "inputevt.h"
+#include "thread.h"			/* For <pthread.h> */
+#include "unsigned.h"
+#include "walloc.h"
+#include "xmalloc.h"
+
+#include "override.h"			/* Must be the last header included */
+
+#if defined(I_PTHREAD) && defined(HAS_SYNC_ATOMIC) && !defined(MINGW32)
+#define WORKQ_THREADED
+#endif
+
+#define WORKQ_MAX_THREADS	16		/**< Max amount of workers per queue */
+#define WORKQ_FLUSH_WAIT	100		/**< ms, polling period when flushing */
+
+enum workq_magic { WORKQ_MAGIC = 0x2f6d1a95 };
+
+/**
+ * A job, linked in one of the queues.
+ */
+struct workq_job {
+	struct workq_job * volatile next;
+	workq_fn_t fn;				/**< Processing routine (worker) */
+	workq_done_t done;			/**< Completion routine (main thread) */
+	void *arg;					/**< Job argument */
+};
+
+/**
+ * A multiple-producer / single-consumer queue of jobs.
+ *
+ * Producers append at the tail, the consumer removes from the head.
+ * The queue is never empty: it always holds at least the stub.
+ */
+struct workq_list {
+	struct workq_job * volatile head;	/**< Consumer side */
+	struct workq_job * volatile tail;	/**< Producers side */
+	struct workq_job stub;				/**< Placeholder when empty */
+};
+
+/**
+ * A worker thread.
+ */
+struct workq_worker {
+	struct workq *wq;			/**< Work queue we belong to */
+	struct workq_list jobs;		/**< Jobs to process */
+#ifdef WORKQ_THREADED
+	pthread_t tid;				/**< The thread */
+#endif
+	int doorbell[2];			/**< Pipe to wake the worker up */
+	volatile int sleeping;		/**< Whether worker waits on doorbell */
+	volatile int stop;			/**< Whether worker must exit when idle */
+};
+
+/**
+ * A work queue.
+ */
+struct workq {
+	enum workq_magic magic;
+	const char *name;			/**< Name, for logging */
+	uint threads;				/**< Amount of running workers */
+	size_t pending;				/**< Jobs posted but not completed yet */
+	struct workq_worker *workers;	/**< Worker array */
+	struct workq_list done;		/**< Completed jobs */
+	int notify[2];				/**< Pipe to wake the main thread up */
+	volatile int signalled;		/**< Whether main thread was notified */
+	uint event_id;				/**< I/O event for the notification pipe */
+};
+
+static inline void
+workq_check(const struct workq * const wq)
+{
+	g_assert(wq != NULL);
+	g_assert(WORKQ_MAGIC == wq->magic);
+}
+
+#ifdef WORKQ_THREADED
+
+/**
+ * Initialize job queue.
+ */
+static void
+workq_list_init(struct workq_list *l)
+{
+	l->stub.next = NULL;
+	l->head = l->tail = &l->stub;
+}
+
+/**
+ * Append job to queue.
+ *
+ * This can be called concurrently by several threads.
+ */
+static void
+workq_list_push(struct workq_list *l, struct workq_job *j)
+{
+	struct workq_job *prev;
+
+	j->next = NULL;
+	atomic_mb();
+	prev = __sync_lock_test_and_set(&l->tail, j);
+	prev->next = j;
+	atomic_mb();
+}
+
+/**
+ * Remove job at the head of the queue.
+ *
+ * This must only be called by the consumer of the queue.
+ *
+ * @return the removed job, NULL if the queue is empty or if the only job
+ * present is still being linked by its producer.
+ */
+static struct workq_job *
+workq_list_pop(struct workq_list *l)
+{
+	struct workq_job *head = l->head;
+	struct workq_job *next = head->next;
+
+	if (&l->stub == head) {
+		if (NULL == next)
+			return NULL;
+		l->head = head = next;
+		next = next->next;
+	}
+
+	if (next != NULL) {
+		l->head = next;
+		return head;
+	}
+
+	if (head != l->tail)
+		return NULL;		/* A producer is linking a new job */
+
+	/*
+	 * The head is the last job: re-insert the stub so that we can
+	 * remove the head without leaving the queue empty.
+	 */
+
+	workq_list_push(l, &l->stub);
+	next = head->next;
+
+	if (next != NULL) {
+		l->head = next;
+		return head;
+	}
+
+	return NULL;
+}
+
+/**
+ * Wake up the reader of the pipe whose writing end is given.
+ */
+static void
+workq_ring(int fd)
+{
+	static const char c;
+	ssize_t r;
+
+	/*
+	 * The writing end is non-blocking: a full pipe means the reader
+	 * has wakeups pending already.
+	 */
+
+	r = write(fd, &c, sizeof c);
+	(void) r;
+}
+
+/**
+ * Process job, then hand it back to the main thread.
+ */
+static void
+workq_worker_run(struct workq *wq, struct workq_job *j)
+{
+	(*j->fn)(j->arg);
+
+	workq_list_push(&wq->done, j);
+
+	if (__sync_bool_compare_and_swap(&wq->signalled, 0, 1))
+		workq_ring(wq->notify[1]);
+}
+
+/**
+ * Main loop of worker threads.
+ */
+static void *
+workq_worker_main(void *p)
+{
+	struct workq_worker *w = p;
+	struct workq *wq = w->wq;
+	sigset_t set;
+
+	/*
+	 * Signals must be delivered to the main thread only.
+	 */
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	for (;;) {
+		struct workq_job *j;
+		char c;
+
+		while (NULL != (j = workq_list_pop(&w->jobs)))
+			workq_worker_run(wq, j);
+
+		/*
+		 * Advertise we're going to sleep, then look at the queue again:
+		 * the main thread checks our flag after posting, so either we see
+		 * its job or it sees our flag and rings the doorbell.
+		 */
+
+		w->sleeping = 1;
+		atomic_mb();
+
+		if (NULL != (j = workq_list_pop(&w->jobs))) {
+			w->sleeping = 0;
+			workq_worker_run(wq, j);
+			continue;
+		}
+
+		if (w->stop)
+			break;
+
+		while (-1 == read(w->doorbell[0], &c, sizeof c) && EINTR == errno)
+			continue;
+
+		w->sleeping = 0;
+	}
+
+	return NULL;
+}
+
+/**
+ * Callback invoked when the notification pipe becomes readable.
+ */
+static void
+workq_notified(void *data, int unused_source, inputevt_cond_t unused_cond)
+{
+	workq_t *wq = data;
+
+	(void) unused_source;
+	(void) unused_cond;
+
+	workq_dispatch(wq);
+}
+
+/**
+ * Stop and reap all the workers, then release their resources.
+ */
+static void
+workq_stop(workq_t *wq)
+{
+	uint i;
+
+	for (i = 0; i < wq->threads; i++) {
+		struct workq_worker *w = &wq->workers[i];
+
+		w->stop = 1;
+		atomic_mb();
+		workq_ring(w->doorbell[1]);
+	}
+
+	for (i = 0; i < wq->threads; i++) {
+		struct workq_worker *w = &wq->workers[i];
+		int error;
+
+		error = pthread_join(w->tid, NULL);
+		if (error != 0) {
+			errno = error;
+			g_warning("%s(): cannot join worker #%u of \"%s\": %m",
+				G_STRFUNC, i, wq->name);
+		}
+
+		fd_close(&w->doorbell[0]);
+		fd_close(&w->doorbell[1]);
+	}
+
+	wq->threads = 0;
+}
+
+/**
+ * Create a new work queue.
+ *
+ * @param name		the name of the queue, for logging (static string)
+ * @param threads	amount of worker threads to launch
+ *
+ * @return the new work queue, NULL if threads cannot be used.
+ */
+workq_t *
+workq_make(const char *name, uint threads)
+{
+	workq_t *wq;
+	uint i;
+
+	g_assert(name != NULL);
+	g_assert(threads != 0);
+
+	threads = MIN(threads, WORKQ_MAX_THREADS);
+
+	WALLOC0(wq);
+	wq->magic = WORKQ_MAGIC;
+	wq->name = name;
+	wq->notify[0] = wq->notify[1] = -1;
+	wq->workers = xmalloc0(threads * sizeof wq->workers[0]);
+	workq_list_init(&wq->done);
+
+	if (-1 == pipe(wq->notify)) {
+		g_warning("%s(): cannot create pipe for \"%s\": %m",
+			G_STRFUNC, name);
+		goto failed;
+	}
+
+	for (i = 0; i < 2; i++) {
+		set_close_on_exec(wq->notify[i]);
+		fd_set_nonblocking(wq->notify[i]);
+	}
+
+	for (i = 0; i < threads; i++) {
+		struct workq_worker *w = &wq->workers[i];
+		int error;
+
+		w->wq = wq;
+		workq_list_init(&w->jobs);
+
+		if (-1 == pipe(w->doorbell)) {
+			g_warning("%s(): cannot create pipe for \"%s\": %m",
+				G_STRFUNC, name);
+			break;
+		}
+
+		set_close_on_exec(w->doorbell[0]);
+		set_close_on_exec(w->doorbell[1]);
+		fd_set_nonblocking(w->doorbell[1]);
+
+		error = pthread_create(&w->tid, NULL, workq_worker_main, w);
+
+		if (error != 0) {
+			errno = error;
+			g_warning("%s(): cannot create worker #%u for \"%s\": %m",
+				G_STRFUNC, i, name);
+			fd_close(&w->doorbell[0]);
+			fd_close(&w->doorbell[1]);
+			break;
+		}
+
+		wq->threads++;
+	}
+
+	if (0 == wq->threads)
+		goto failed;
+
+	wq->event_id = inputevt_add(wq->notify[0], INPUT_EVENT_RX,
+		workq_notified, wq);
+
+	return wq;
+
+failed:
+	fd_close(&wq->notify[0]);
+	fd_close(&wq->notify[1]);
+	xfree(wq->workers);
+	wq->magic = 0;
+	WFREE(wq);
+	return NULL;
+}
+
+/**
+ * Process all the pending jobs, then stop the workers and free the queue.
+ */
+void
+workq_free_null(workq_t **wq_ptr)
+{
+	workq_t *wq = *wq_ptr;
+
+	if (wq != NULL) {
+		workq_check(wq);
+
+		workq_flush(wq);
+		workq_stop(wq);
+		inputevt_remove(&wq->event_id);
+		fd_close(&wq->notify[0]);
+		fd_close(&wq->notify[1]);
+		xfree(wq->workers);
+		wq->magic = 0;
+		WFREE(wq);
+		*wq_ptr = NULL;
+	}
+}
+
+/**
+ * Post a new job.
+ *
+ * All the jobs posted with the same key are processed sequentially, in the
+ * order they were posted, and their completion routines are invoked in that
+ * same order.
+ *
+ * @param wq		the work queue
+ * @param key		job key, selecting the worker
+ * @param fn		processing routine, run by the worker
+ * @param done		completion routine, run by the main thread (may be NULL)
+ * @param arg		argument for both routines
+ */
+void
+workq_post(workq_t *wq, uint key,
+	workq_fn_t fn, workq_done_t done, void *arg)
+{
+	struct workq_worker *w;
+	struct workq_job *j;
+
+	workq_check(wq);
+	g_assert(fn != NULL);
+
+	WALLOC(j);
+	j->fn = fn;
+	j->done = done;
+	j->arg = arg;
+
+	w = &wq->workers[key % wq->threads];
+	wq->pending++;
+
+	workq_list_push(&w->jobs, j);
+
+	if (w->sleeping && __sync_bool_compare_and_swap(&w->sleeping, 1, 0))
+		workq_ring(w->doorbell[1]);
+}
+
+/**
+ * Run the completion routine of all the jobs processed so far.
+ *
+ * This is normally invoked from the I/O event loop, when workers signal
+ * completed jobs.
+ */
+void
+workq_dispatch(workq_t *wq)
+{
+	struct workq_job *j;
+	char buf[64];
+
+	workq_check(wq);
+
+	while (read(wq->notify[0], buf, sizeof buf) > 0)
+		continue;
+
+	/*
+	 * Clear the notification flag before looking at the queue, so that
+	 * any job completed from now on signals us again.
+	 */
+
+	wq->signalled = 0;
+	atomic_mb();
+
+	while (NULL != (j = workq_list_pop(&wq->done))) {
+		g_assert(size_is_positive(wq->pending));
+
+		wq->pending--;
+		if (j->done != NULL)
+			(*j->done)(j->arg);
+		WFREE(j);
+	}
+}
+
+/**
+ * Wait for all the posted jobs to be processed, running their completion
+ * routines.
+ */
+void
+workq_flush(workq_t *wq)
+{
+	workq_check(wq);
+
+	while (0 != wq->pending) {
+		struct pollfd pfd;
+
+		pfd.fd = wq->notify[0];
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		(void) compat_poll(&pfd, 1, WORKQ_FLUSH_WAIT);
+		workq_dispatch(wq);
+	}
+}
+
+#else	/* !WORKQ_THREADED */
+
+workq_t *
+workq_make(const char *name, uint threads)
+{
+	(void) name;
+	(void) threads;
+
+	return NULL;
+}
+
+void
+workq_free_null(workq_t **wq_ptr)
+{
+	g_assert(NULL == *wq_ptr);
+}
+
+void
+workq_post(workq_t *wq, uint key,
+	workq_fn_t fn, workq_done_t done, void *arg)
+{
+	(void) key;
+	(void) fn;
+	(void) done;
+	(void) arg;
+
+	workq_check(wq);
+	g_assert_not_reached();
+}
+
+void
+workq_dispatch(workq_t *wq)
+{
+	workq_check(wq);
+	g_assert_not_reached();
+}
+
+void
+workq_flush(workq_t *wq)
+{
+	workq_check(wq);
+	g_assert_not_reached();
+}
+
+#endif	/* WORKQ_THREADED */
+
+/**
+ * @return the amount of worker threads.
+ */
+uint
+workq_threads(const workq_t *wq)
+{
+	workq_check(wq);
+
+	return wq->threads;
+}
+
+/**
+ * @return the amount of jobs posted whose completion routine was not run yet.
+ */
+size_t
+workq_pending(const workq_t *wq)
+{
+	workq_check(wq);
+
+	return wq->pending;
+}
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2026, agent
+ *
+ *----------------------------------------------------------------------
+ * This file is part of gtk-gnutella.
+ *
+ *  gtk-gnutella is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  gtk-gnutella is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with gtk-gnutella; if not, write to the Free Software
+ *  Foundation, Inc.:
+ *      59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *----------------------------------------------------------------------
+ */
+
+/**
+ * @ingroup lib
+ * @file
+ *
+ * Worker thread queues.
+ *
+ * @author agent
+ * @date 2026
+ */
+
+#ifndef _workq_h_
+#define _workq_h_
+
+typedef struct workq workq_t;
+
+/**
+ * Job processing routine, run by a worker thread.
+ *
+ * It must not use any of the non thread-safe facilities of the library
+ * (logging, halloc(), callout queues, etc...): the only memory allocator
+ * that can be used is xmalloc().
+ *
+ * @param arg		the job argument
+ */
+typedef void (*workq_fn_t)(void *arg);
+
+/**
+ * Job completion routine, run by the main thread once the job was processed.
+ *
+ * @param arg		the job argument
+ */
+typedef void (*workq_done_t)(void *arg);
+
+/*
+ * Public interface.
+ */
+
+workq_t *workq_make(const char *name, uint threads);
+void workq_free_null(workq_t **wq_ptr);
+
+uint workq_threads(const workq_t *wq) G_GNUC_PURE;
+size_t workq_pending(const workq_t *wq) G_GNUC_PURE;
+
+void workq_post(workq_t *wq, uint key,
+	workq_fn_t fn, workq_done_t done, void *arg);
+void workq_dispatch(workq_t *wq);
+void workq_flush(workq_t *wq);
+
+#endif /* _workq_h_ */
+
+/* vi: set ts=4 sw=4 cindent: */
@@ -41,6 +41,8 @@
 #include "halloc.h"
 #include "unsigned.h"
 #include "walloc.h"
+#include "workq.h"
+#include "xmalloc.h"
 #include "override.h"		/* Must be the last header included */
 
 #define OUT_GROW	1024		/**< To grow output buffer if it's to short */
@@ -209,6 +211,83 @@ zlib_free_func(void *unused_opaque, void *p)
 	hfree(p);
 }
 
+/**
+ * Thread-safe allocator, for streams processed by worker threads.
+ */
+void *
+zlib_xalloc_func(void *unused_opaque, uint n, uint m)
+{
+	(void) unused_opaque;
+
+	g_return_val_if_fail(n > 0, NULL);
+	g_return_val_if_fail(m > 0, NULL);
+	g_return_val_if_fail(m < ((size_t) -1) / n, NULL);
+
+	return xmalloc((size_t) n * m);
+}
+
+/**
+ * Thread-safe freeing routine, for streams processed by worker threads.
+ */
+void
+zlib_xfree_func(void *unused_opaque, void *p)
+{
+	(void) unused_opaque;
+	xfree(p);
+}
+
+static workq_t *zlib_wq;		/**< Workers processing offloaded streams */
+static uint zlib_wq_key;		/**< Key of the last stream pinned */
+
+/**
+ * Launch the worker threads to which streams can be offloaded.
+ *
+ * @param threads		amount of workers, 0 meaning streams are not offloaded
+ */
+void
+zlib_offload_init(uint threads)
+{
+	g_assert(NULL == zlib_wq);
+
+	if (0 == threads)
+		return;
+
+	zlib_wq = workq_make("zlib", threads);
+
+	if (NULL == zlib_wq) {
+		g_warning("cannot offload compression to %u thread%s",
+			threads, 1 == threads ? "" : "s");
+	}
+}
+
+/**
+ * Get the queue of workers to which a new stream can be offloaded.
+ *
+ * @param key		where the key pinning the stream to a worker is written
+ *
+ * @return the work queue, NULL if streams must be processed synchronously.
+ */
+workq_t *
+zlib_offload(uint *key)
+{
+	g_assert(key != NULL);
+
+	if (NULL == zlib_wq)
+		return NULL;
+
+	*key = zlib_wq_key++;		/* Spread streams evenly among workers */
+	return zlib_wq;
+}
+
+/**
+ * Wait for offloaded jobs to be completed and stop the workers.
+ */
+void
+zlib_offload_close(void)
+{
+	workq_free_null(&zlib_wq);
+}
+
 /**
  * Initialize internal state for our incremental zlib stream.
  *
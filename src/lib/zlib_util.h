@@ -92,6 +92,14 @@ bool zlib_is_valid_header(const void *data, int len);
 
 void zlib_free_func(void *unused_opaque, void *p);
 void *zlib_alloc_func(void *unused_opaque, uint n, uint m);
+void zlib_xfree_func(void *unused_opaque, void *p);
+void *zlib_xalloc_func(void *unused_opaque, uint n, uint m);
+
+struct workq;
+
+void zlib_offload_init(uint threads);
+struct workq *zlib_offload(uint *key);
+void zlib_offload_close(void);
 
 #endif	/* _zlib_util_h_ */
 
@@ -36,6 +36,7 @@
 #include "cmd.h"
 
 #include "core/nodes.h"
+#include "core/tx_deflate.h"
 
 #include "lib/ascii.h"
 #include "lib/glib-missing.h"
@@ -96,6 +97,32 @@ print_node_info(struct gnutella_shell *sh, const struct gnutella_node *n)
 	shell_write(sh, "\n");	/* Terminate line */
 }
 
+static void
+print_node_deflate(struct gnutella_shell *sh, const struct gnutella_node *n)
+{
+	struct tx_deflate_info info;
+	char buf[256];
+
+	g_return_if_fail(sh);
+	g_return_if_fail(n);
+
+	if (NULL == n->outq || !NODE_TX_COMPRESSED(n))
+		return;
+
+	if (!tx_deflate_info(mq_tx_driver(n->outq), &info))
+		return;
+
+	gm_snprintf(buf, sizeof buf,
+		"%-21.45s %2d/%d %6.2f%% %6.2f%% %8.1f %7u %10s %10s\n",
+		node_gnet_addr(n),
+		info.level, info.max_level,
+		100.0 * info.ratio, 100.0 * info.ratio_ema,
+		info.cost, info.changes,
+		uint64_to_string(info.input), uint64_to_string2(info.output));
+
+	shell_write(sh, buf);
+}
+
 /**
  * Displays all connected nodes
  */
@@ -103,13 +130,37 @@ enum shell_reply
 shell_exec_nodes(struct gnutella_shell *sh, int argc, const char *argv[])
 {
 	const GSList *sl;
+	const char *opt_c;
+	const option_t options[] = {
+		{ "c", &opt_c },
+	};
+	int parsed;
 
 	shell_check(sh);
 	g_assert(argv);
 	g_assert(argc > 0);
 
+	parsed = shell_options_parse(sh, argv, options, G_N_ELEMENTS(options));
+	if (parsed < 0)
+		return REPLY_ERROR;
+
 	shell_set_msg(sh, "");
 
+	if (opt_c) {
+		shell_write(sh,
+		  "100~ \n"
+		  "Node                  Level   Ratio     EMA  us/KiB Changes"
+		  "      Input     Output\n");
+
+		for (sl = node_all_nodes(); sl; sl = g_slist_next(sl)) {
+			const struct gnutella_node *n = sl->data;
+			print_node_deflate(sh, n);
+		}
+		shell_write(sh, ".\n");	/* Terminate message body */
+
+		return REPLY_READY;
+	}
+
 	shell_write(sh,
 	  "100~ \n"
 	  "Node                  Flags       CC Since  Uptime User-Agent\n");
@@ -135,7 +186,10 @@ shell_help_nodes(int argc, const char *argv[])
 	g_assert(argv);
 	g_assert(argc > 0);
 
-	return NULL;
+	return
+		"nodes [-c]\n"
+		"show connected Gnutella nodes\n"
+		"-c: show compression level and statistics of compressed links\n";
 }
 
 /* vi: set ts=4 sw=4 cindent: */
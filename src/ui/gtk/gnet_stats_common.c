@@ -116,6 +116,8 @@ general_type_str(gint value)
 		N_("Hits on local DB"),
 		N_("Hits on local partial files"),
 		N_("Hits on \"what's new?\" queries"),
+		N_("Local queries answered from the query cache"),
+		N_("Local queries not found in the query cache"),
 		N_("Query hits received for local queries"),
 		N_("Query hits received for OOB-proxied queries"),
 		N_("Queries requesting OOB hit delivery"),
@@ -198,6 +200,8 @@ general_type_str(gint value)
 		N_("Semi-reliable UDP fragments resent"),
 		N_("Semi-reliable UDP fragment sendings avoided"),
 		N_("Semi-reliable UDP fragments sent too many times"),
+		N_("Semi-reliable UDP fragments resent on extended acknowledgment"),
+		N_("Semi-reliable UDP fragments deferred by congestion window"),
 		N_("Semi-reliable UDP total acknowledgments received"),
 		N_("Semi-reliable UDP cumulative acknowledgments received"),
 		N_("Semi-reliable UDP extended acknowledgments received"),
@@ -226,6 +230,16 @@ general_type_str(gint value)
 		N_("Semi-reliable UDP EARs received for unknown message"),
 		N_("Semi-reliable UDP EARs received whilst lingering"),
 		N_("Semi-reliable UDP fragments from hostile IP addresses"),
+		N_("UDP DHT replies dropped by scheduler"),
+		N_("UDP DHT requests dropped by scheduler"),
+		N_("UDP GUESS queries and pings dropped by scheduler"),
+		N_("UDP OOB query hits dropped by scheduler"),
+		N_("UDP other datagrams dropped by scheduler"),
+		N_("UDP DHT replies average queueing delay (ms)"),
+		N_("UDP DHT requests average queueing delay (ms)"),
+		N_("UDP GUESS queries and pings average queueing delay (ms)"),
+		N_("UDP OOB query hits average queueing delay (ms)"),
+		N_("UDP other datagrams average queueing delay (ms)"),
 		N_("Consolidated servers (after GUID and IP address linking)"),
 		N_("Duplicate downloads found during server consolidation"),
 		N_("Discovered server GUIDs"),
@@ -301,9 +315,12 @@ general_type_str(gint value)
 		N_("DHT nodes rejected during lookup based on suspicious proximity"),
 		N_("DHT nodes rejected during lookup based on frequency divergence"),
 		N_("DHT node contact IP addresses fixed during lookup"),
+		N_("DHT lookup RPCs shared with a concurrent lookup"),
+		N_("DHT lookup hops pipelined past stalled RPCs"),
 		N_("DHT keys held"),
 		N_("DHT cached keys held"),
 		N_("DHT values held"),
+		N_("DHT key data lookups spared by key filters"),
 		N_("DHT cached KUID targets held"),
 		N_("DHT cached closest root nodes"),
 		N_("DHT cached roots exact hits"),
@@ -363,6 +380,10 @@ general_type_str(gint value)
 		N_("DHT background publishing completion attempts"),
 		N_("DHT background publishing completion showing improvements"),
 		N_("DHT background publishing completion successful (all roots)"),
+		N_("DHT STORE messages batching values for several keys"),
+		N_("DHT values published through batched STORE messages"),
+		N_("DHT publisher backlog of files waiting to be published"),
+		N_("DHT publisher average lag past scheduled publishing (s)"),
 		N_("DHT SHA1 data type collisions"),
 		N_("DHT lookup path passively protected against attack"),
 		N_("DHT lookup path actively protected against attack"),